@@ -0,0 +1,2781 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../../ComPort/capture.h"
+#include "../../ComPort/compress.h"
+#include "../../ComPort/connect.h"
+#include "../../ComPort/engine.h"
+#include "../../ComPort/mux.h"
+#include "../../ComPort/pool.h"
+#include "../../ComPort/shmring.h"
+#include "../../ComPort/tap.h"
+#include "../../ComPort/udp.h"
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+#endif
+
+//
+// a connected pair of loopback tcp sockets. Engine.Socket is one end, Peer the other.
+//
+class EngineTest : public ::testing::Test {
+protected:
+    HTS_VSP_REPORT Stats = {};
+    NET_ENGINE* Engine = nullptr;
+    SOCKET Peer = INVALID_SOCKET;
+    PPLATFORM_WAITER Waiter = nullptr;
+
+    void SetUp() override
+    {
+        ASSERT_EQ(PlatformSocketStartup(), (UINT32)NO_ERROR);
+        Engine = new NET_ENGINE;
+        EngineInitialize(Engine, &Stats);
+
+        SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        ASSERT_NE(listener, INVALID_SOCKET);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        ASSERT_EQ(bind(listener, (sockaddr*)&addr, sizeof(addr)), 0);
+        ASSERT_EQ(listen(listener, 1), 0);
+        ASSERT_EQ(getsockname(listener, (sockaddr*)&addr, &len), 0);
+        Peer = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        ASSERT_EQ(connect(Peer, (sockaddr*)&addr, sizeof(addr)), 0);
+        Engine->Socket = accept(listener, NULL, NULL);
+        ASSERT_NE(Engine->Socket, INVALID_SOCKET);
+        closesocket(listener);
+
+        ASSERT_EQ(PlatformWaiterCreate(&Waiter), (UINT32)NO_ERROR);
+        ASSERT_EQ(PlatformWaiterAddSocket(Waiter, Engine->Socket, PLATFORM_SOCKET_READ), (UINT32)NO_ERROR);
+    }
+
+    void TearDown() override
+    {
+        PlatformWaiterClose(Waiter);
+        if (Engine->Socket != INVALID_SOCKET) {
+            closesocket(Engine->Socket);
+        }
+        if (Peer != INVALID_SOCKET) {
+            closesocket(Peer);
+        }
+        delete Engine;
+        PlatformSocketCleanup();
+    }
+
+    size_t RingData()
+    {
+        size_t available;
+        RingBufferGetAvailableData(&Engine->ReceiveRing, &available);
+        return available;
+    }
+
+    void PeerSend(const char* data, int length)
+    {
+        ASSERT_EQ(send(Peer, data, length, 0), length);
+    }
+
+    // waits for the socket and receives what is there.
+    ENGINE_RECEIVE_STATUS WaitAndReceive(ULONG* received)
+    {
+        EXPECT_EQ(PlatformWait(Waiter, 2000), 0u);
+        return EngineReceive(Engine, received);
+    }
+};
+
+TEST(ReadTimers, NoTimeouts) {
+    SERIAL_TIMEOUTS timeouts = {};
+    READ_TIMERS timers;
+    CalculateReadTimers(&timeouts, 100, &timers);
+    EXPECT_FALSE(timers.UseIntervalTimer);
+    EXPECT_FALSE(timers.UseTotalTimer);
+    EXPECT_FALSE(timers.returnWithWhatsPresent);
+}
+
+TEST(ReadTimers, ReturnImmediately) {
+    SERIAL_TIMEOUTS timeouts = {};
+    timeouts.ReadIntervalTimeout = MAXULONG;
+    READ_TIMERS timers;
+    CalculateReadTimers(&timeouts, 100, &timers);
+    EXPECT_TRUE(timers.returnWithWhatsPresent);
+    EXPECT_FALSE(timers.UseIntervalTimer);
+    EXPECT_FALSE(timers.UseTotalTimer);
+}
+
+TEST(ReadTimers, IntervalAndTotal) {
+    SERIAL_TIMEOUTS timeouts = {};
+    timeouts.ReadIntervalTimeout = 10;
+    timeouts.ReadTotalTimeoutMultiplier = 2;
+    timeouts.ReadTotalTimeoutConstant = 100;
+    READ_TIMERS timers;
+    CalculateReadTimers(&timeouts, 50, &timers);
+    EXPECT_TRUE(timers.UseIntervalTimer);
+    EXPECT_EQ(timers.IntervalMs, 10u);
+    EXPECT_TRUE(timers.UseTotalTimer);
+    EXPECT_EQ(timers.TotalMs, 200u);
+}
+
+TEST(ReadTimers, Os2ssReturn) {
+    SERIAL_TIMEOUTS timeouts = {};
+    timeouts.ReadIntervalTimeout = MAXULONG;
+    timeouts.ReadTotalTimeoutMultiplier = MAXULONG;
+    timeouts.ReadTotalTimeoutConstant = 500;
+    READ_TIMERS timers;
+    CalculateReadTimers(&timeouts, 50, &timers);
+    EXPECT_TRUE(timers.os2ssreturn);
+    EXPECT_TRUE(timers.crunchDownToOne);
+    EXPECT_EQ(timers.TotalMs, 500u);
+}
+
+TEST_F(EngineTest, ReadCompletesWhenFull) {
+    SERIAL_TIMEOUTS timeouts = {};
+    UCHAR buffer[8] = {};
+    ENGINE_READ read = { buffer, sizeof(buffer), 0, 0 };
+    ULONG received;
+
+    EngineStartRead(Engine, &read, &timeouts);
+    PeerSend("abcd", 4);
+    EXPECT_EQ(WaitAndReceive(&received), EngineReceiveData);
+    EXPECT_EQ(received, 4u);
+    EXPECT_EQ(EngineProcessRead(Engine), EngineReadPending);
+    EXPECT_EQ(Engine->BytesFromLastRead, 4u);
+
+    PeerSend("efghij", 6);
+    while (read.Information + RingData() < sizeof(buffer)) {
+        ASSERT_EQ(WaitAndReceive(&received), EngineReceiveData);
+    }
+    EXPECT_EQ(EngineProcessRead(Engine), EngineReadSuccess);
+    EXPECT_EQ(read.Information, 8u);
+    EXPECT_EQ(memcmp(buffer, "abcdefgh", 8), 0);
+    EXPECT_EQ(Engine->CurrentRead, nullptr);
+
+    // the rest stays in the ring for the next read.
+    ENGINE_READ next = { buffer, sizeof(buffer), 0, 0 };
+    timeouts.ReadIntervalTimeout = MAXULONG;
+    EngineStartRead(Engine, &next, &timeouts);
+    EXPECT_EQ(EngineProcessRead(Engine), EngineReadSuccess);
+    EXPECT_EQ(next.Information, 2u);
+    EXPECT_EQ(memcmp(buffer, "ij", 2), 0);
+    EXPECT_EQ(Stats.bytesRead, 10);
+}
+
+TEST_F(EngineTest, Os2ssReturnsFirstBytes) {
+    SERIAL_TIMEOUTS timeouts = {};
+    timeouts.ReadIntervalTimeout = MAXULONG;
+    timeouts.ReadTotalTimeoutMultiplier = MAXULONG;
+    timeouts.ReadTotalTimeoutConstant = 1000;
+    UCHAR buffer[64];
+    ENGINE_READ read = { buffer, sizeof(buffer), 0, 0 };
+    ULONG received;
+
+    EngineStartRead(Engine, &read, &timeouts);
+    EXPECT_EQ(EngineProcessRead(Engine), EngineReadPending);
+    PeerSend("x", 1);
+    EXPECT_EQ(WaitAndReceive(&received), EngineReceiveData);
+    EXPECT_EQ(EngineProcessRead(Engine), EngineReadSuccess);
+    EXPECT_EQ(read.Information, 1u);
+}
+
+TEST_F(EngineTest, TimerRules) {
+    SERIAL_TIMEOUTS timeouts = {};
+    UCHAR buffer[16];
+    ENGINE_READ read = { buffer, sizeof(buffer), 0, 0 };
+    ULONG received;
+
+    // the interval timer only ends a read that has data.
+    EngineStartRead(Engine, &read, &timeouts);
+    EXPECT_EQ(EngineIntervalTimerExpired(Engine), EngineReadPending);
+    PeerSend("ab", 2);
+    EXPECT_EQ(WaitAndReceive(&received), EngineReceiveData);
+    EXPECT_EQ(EngineProcessRead(Engine), EngineReadPending);
+    EXPECT_EQ(EngineIntervalTimerExpired(Engine), EngineReadCancelled);
+    EXPECT_EQ(read.Information, 2u);
+
+    // the total timer always does.
+    ENGINE_READ empty = { buffer, sizeof(buffer), 0, 0 };
+    EngineStartRead(Engine, &empty, &timeouts);
+    EXPECT_EQ(EngineTotalTimerExpired(Engine), EngineReadCancelled);
+
+    // without timers the read times out after WaitUnits waits.
+    ENGINE_READ waiting = { buffer, sizeof(buffer), 0, 0 };
+    EngineStartRead(Engine, &waiting, &timeouts);
+    EXPECT_EQ(EngineWaitTimeout(Engine, 3), EngineReadPending);
+    EXPECT_EQ(EngineWaitTimeout(Engine, 3), EngineReadPending);
+    EXPECT_EQ(EngineWaitTimeout(Engine, 3), EngineReadTimeout);
+    EXPECT_EQ(Engine->CurrentRead, nullptr);
+}
+
+TEST_F(EngineTest, PeerClose) {
+    ULONG received;
+    PeerSend("z", 1);
+    closesocket(Peer);
+    Peer = INVALID_SOCKET;
+
+    ENGINE_RECEIVE_STATUS status = WaitAndReceive(&received);
+    if (status == EngineReceiveData) {
+        status = WaitAndReceive(&received);
+    }
+    EXPECT_EQ(status, EngineReceiveClosed);
+    EXPECT_EQ(RingData(), 1u);
+}
+
+TEST_F(EngineTest, RingFullLeavesDataInSocket) {
+    std::vector<char> data(ENGINE_RECEIVE_BUFFER_SIZE + 1000, 'q');
+    ULONG received;
+    int sent = 0;
+    while (sent < (int)data.size()) {
+        int result = send(Peer, data.data() + sent, (int)data.size() - sent, 0);
+        ASSERT_GT(result, 0);
+        sent += result;
+    }
+    while (!EngineReceiveRingFull(Engine)) {
+        ASSERT_EQ(WaitAndReceive(&received), EngineReceiveData);
+    }
+    EXPECT_EQ(EngineReceive(Engine, &received), EngineReceiveIdle);
+    EXPECT_EQ(RingData(), (size_t)ENGINE_RECEIVE_BUFFER_SIZE - 1);
+}
+
+TEST_F(EngineTest, Send) {
+    char buffer[4];
+    EXPECT_EQ(EngineSend(Engine, "ping", 4), (UINT32)NO_ERROR);
+    EXPECT_EQ(recv(Peer, buffer, sizeof(buffer), MSG_WAITALL), 4);
+    EXPECT_EQ(memcmp(buffer, "ping", 4), 0);
+    EXPECT_EQ(Stats.bytesWritten, 4);
+}
+
+TEST(Spin, BudgetFollowsArrivals) {
+    ENGINE_SPIN spin = {};
+    spin.MaxUs = 1000;
+    for (int n = 0; n < 32; n++) {
+        EngineSpinArrival(&spin, 100);
+    }
+    EXPECT_NEAR(spin.GapUs, 100u, 4u);
+    EXPECT_NEAR(spin.BudgetUs, 200u + ENGINE_SPIN_MIN_US, 8u);
+
+    // one early arrival moves the budget only a little.
+    EngineSpinArrival(&spin, 0);
+    EXPECT_GT(spin.BudgetUs, 150u);
+
+    // arrivals no spin catches halve it until it is off.
+    for (int n = 0; n < 8; n++) {
+        EngineSpinArrival(&spin, 5000);
+    }
+    EXPECT_EQ(spin.BudgetUs, 0u);
+
+    // and a short one brings it back.
+    EngineSpinArrival(&spin, 100);
+    EXPECT_GT(spin.BudgetUs, 0u);
+}
+
+TEST(Spin, BudgetLimitedByMax) {
+    ENGINE_SPIN spin = {};
+    spin.MaxUs = 300;
+    for (int n = 0; n < 32; n++) {
+        EngineSpinArrival(&spin, 290);
+    }
+    EXPECT_EQ(spin.BudgetUs, 300u);
+}
+
+TEST_F(EngineTest, SpinOff) {
+    EngineSetSpin(Engine, 0);
+    EXPECT_EQ(EngineWait(Engine, Waiter, 20, 1), PLATFORM_WAIT_TIMEOUT);
+    EXPECT_EQ(Stats.spinWaits, 0);
+    EXPECT_TRUE(Engine->Spin.LastWaitBlocked);
+
+    EngineSetSpin(Engine, 100000);
+    EXPECT_EQ(Engine->Spin.MaxUs, (ULONG)ENGINE_SPIN_MAX_US);
+    EXPECT_EQ(Stats.spinMaxUs, (DWORD)ENGINE_SPIN_MAX_US);
+}
+
+TEST_F(EngineTest, SpinHit) {
+    EngineSetSpin(Engine, 1000);
+    Engine->Spin.BudgetUs = 1000;
+    PeerSend("x", 1);
+    EXPECT_EQ(EngineWait(Engine, Waiter, 2000, 1), 0u);
+    EXPECT_EQ(Stats.spinWaits, 1);
+    EXPECT_EQ(Stats.spinHits, 1);
+    EXPECT_FALSE(Engine->Spin.LastWaitBlocked);
+}
+
+TEST_F(EngineTest, SpinMissBlocks) {
+    EngineSetSpin(Engine, 1000);
+    Engine->Spin.BudgetUs = 200;
+    EXPECT_EQ(EngineWait(Engine, Waiter, 20, 1), PLATFORM_WAIT_TIMEOUT);
+    EXPECT_EQ(Stats.spinWaits, 1);
+    EXPECT_EQ(Stats.spinHits, 0);
+    EXPECT_GE(Stats.spinUs, 200);
+    EXPECT_TRUE(Engine->Spin.LastWaitBlocked);
+    // a timeout is no arrival.
+    EXPECT_EQ(Engine->Spin.BudgetUs, 200u);
+
+    EngineSpinWakeLatency(Engine, 80);
+    EXPECT_EQ(Stats.wakeLatencyUs, 10u);
+}
+
+TEST(Platform, WaiterReturnsLowestSource) {
+    PPLATFORM_WAITER waiter;
+    PLATFORM_EVENT manual, automatic;
+    PLATFORM_TIMER timer;
+    ASSERT_EQ(PlatformWaiterCreate(&waiter), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformEventCreate(TRUE, &manual), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformEventCreate(FALSE, &automatic), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformTimerCreate(&timer), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformWaiterAddEvent(waiter, manual), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformWaiterAddEvent(waiter, automatic), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformWaiterAddTimer(waiter, timer), (UINT32)NO_ERROR);
+
+    EXPECT_EQ(PlatformWait(waiter, 0), PLATFORM_WAIT_TIMEOUT);
+
+    PlatformTimerStart(timer, 10);
+    EXPECT_EQ(PlatformWait(waiter, 2000), 2u);
+    EXPECT_EQ(PlatformWait(waiter, 0), PLATFORM_WAIT_TIMEOUT);
+
+    // an auto reset event is reset by the wait.
+    PlatformEventSet(automatic);
+    PlatformTimerStart(timer, 0);
+    EXPECT_EQ(PlatformWait(waiter, 2000), 1u);
+    EXPECT_EQ(PlatformWait(waiter, 2000), 2u);
+
+    // a manual reset event stays set.
+    PlatformEventSet(manual);
+    EXPECT_EQ(PlatformWait(waiter, 0), 0u);
+    EXPECT_EQ(PlatformWait(waiter, 0), 0u);
+    PlatformEventReset(manual);
+    EXPECT_EQ(PlatformWait(waiter, 0), PLATFORM_WAIT_TIMEOUT);
+
+    // a stopped timer does not fire.
+    PlatformTimerStart(timer, 20);
+    PlatformTimerStop(timer);
+    EXPECT_EQ(PlatformWait(waiter, 50), PLATFORM_WAIT_TIMEOUT);
+
+    PlatformWaiterClose(waiter);
+    PlatformTimerClose(timer);
+    PlatformEventClose(automatic);
+    PlatformEventClose(manual);
+}
+
+//
+// a name for a unix socket or pipe that no other test run uses.
+//
+static std::string LocalName(const char* kind)
+{
+#ifdef _WIN32
+    char directory[MAX_PATH];
+    GetTempPathA(sizeof(directory), directory);
+    std::string name = std::string(directory) + "htsvsp-" + kind + "-" + std::to_string(GetCurrentProcessId());
+    if (strcmp(kind, "pipe") == 0 || strcmp(kind, "shm") == 0) {
+        name = name.substr(name.rfind('\\') + 1);
+    }
+    return name;
+#else
+    return std::string("/tmp/htsvsp-") + kind + "-" + std::to_string(getpid());
+#endif
+}
+
+static void RemoveLocalName(const std::string& name)
+{
+#ifdef _WIN32
+    DeleteFileA(name.c_str());
+#else
+    unlink(name.c_str());
+    unlink((name + ".in").c_str());
+    unlink((name + ".out").c_str());
+#endif
+}
+
+//
+// Engine on the client end of a pipe, Server the other end.
+//
+class PipeTest : public ::testing::Test {
+protected:
+    HTS_VSP_REPORT Stats = {};
+    NET_ENGINE* Engine = nullptr;
+    PLATFORM_STREAM Server = NULL;
+    PPLATFORM_WAITER Waiter = nullptr;
+    std::string Name = LocalName("pipe");
+
+    void SetUp() override
+    {
+        Engine = new NET_ENGINE;
+        EngineInitialize(Engine, &Stats);
+        ASSERT_EQ(PlatformPipeCreate(Name.c_str(), &Server), (UINT32)NO_ERROR);
+        ASSERT_EQ(PlatformPipeConnect(Name.c_str(), &Engine->Stream), (UINT32)NO_ERROR);
+        ASSERT_EQ(PlatformWaiterCreate(&Waiter), (UINT32)NO_ERROR);
+        ASSERT_EQ(EngineWaiterAdd(Engine, Waiter), (UINT32)NO_ERROR);
+    }
+
+    void TearDown() override
+    {
+        PlatformWaiterClose(Waiter);
+        EngineClose(Engine);
+        PlatformStreamClose(Server);
+        RemoveLocalName(Name);
+        delete Engine;
+    }
+
+    // waits for data on a stream and receives it.
+    static int StreamRecv(PLATFORM_STREAM stream, char* buffer, int length)
+    {
+        PPLATFORM_WAITER waiter;
+        EXPECT_EQ(PlatformWaiterCreate(&waiter), (UINT32)NO_ERROR);
+        EXPECT_EQ(PlatformWaiterAddStream(waiter, stream), (UINT32)NO_ERROR);
+        int result;
+        do {
+            EXPECT_EQ(PlatformWait(waiter, 2000), 0u);
+            result = PlatformStreamRecv(stream, buffer, length);
+        } while (result == SOCKET_ERROR && PlatformSocketWouldBlock(PlatformSocketLastError()));
+        PlatformWaiterClose(waiter);
+        return result;
+    }
+};
+
+TEST_F(PipeTest, BothWays) {
+    char buffer[16];
+    ASSERT_EQ(PlatformStreamSend(Server, "hello", 5), 5);
+    ASSERT_EQ(EngineWait(Engine, Waiter, 2000, 1), 0u);
+    ULONG received;
+    EXPECT_EQ(EngineReceive(Engine, &received), EngineReceiveData);
+    EXPECT_EQ(received, 5u);
+    EXPECT_EQ(Stats.bytesRead, 5);
+
+    EXPECT_EQ(EngineSend(Engine, "world", 5), (UINT32)NO_ERROR);
+    EXPECT_EQ(StreamRecv(Server, buffer, sizeof(buffer)), 5);
+    EXPECT_EQ(memcmp(buffer, "world", 5), 0);
+
+    // nothing more to receive.
+    EXPECT_EQ(EngineReceive(Engine, &received), EngineReceiveIdle);
+}
+
+TEST_F(PipeTest, ServerClose) {
+    PlatformStreamClose(Server);
+    Server = NULL;
+    ASSERT_EQ(EngineWait(Engine, Waiter, 2000, 1), 0u);
+    ULONG received;
+    EXPECT_EQ(EngineReceive(Engine, &received), EngineReceiveClosed);
+    EngineClose(Engine);
+    EXPECT_FALSE(EngineConnected(Engine));
+}
+
+TEST(Pipe, ConnectWithoutServerFails) {
+    PLATFORM_STREAM stream;
+    EXPECT_NE(PlatformPipeConnect(LocalName("nopipe").c_str(), &stream), (UINT32)NO_ERROR);
+}
+
+TEST(ShmRing, SignalsOnlyTransitions) {
+    std::vector<BYTE> mapping(ShmMappingSize(SHM_MIN_RING_SIZE));
+    PSHM_HEADER header = (PSHM_HEADER)mapping.data();
+    ShmInitialize(header, SHM_MIN_RING_SIZE);
+    ASSERT_EQ(ShmValidate(header, mapping.size()), (ULONG)SHM_MIN_RING_SIZE);
+    SHM_RING_VIEW ring;
+    ShmRingView(header, SHM_RING_TO_SERVER, &ring);
+    BYTE data[SHM_MIN_RING_SIZE] = {};
+    BOOL wake;
+
+    // a new ring is armed, the first write wakes, the next ones do not.
+    EXPECT_TRUE(ShmRingReaderArmed(&ring));
+    EXPECT_EQ(ShmRingWrite(&ring, data, 100, &wake), 100u);
+    EXPECT_TRUE(wake);
+    EXPECT_EQ(ShmRingWrite(&ring, data, 100, &wake), 100u);
+    EXPECT_FALSE(wake);
+    EXPECT_FALSE(ShmRingArmReader(&ring));
+
+    // one byte stays free. A full writer arms and the first read wakes it.
+    EXPECT_EQ(ShmRingWrite(&ring, data, sizeof(data), &wake), SHM_MIN_RING_SIZE - 201u);
+    EXPECT_EQ(ShmRingAvailableSpace(&ring), 0u);
+    EXPECT_TRUE(ShmRingArmWriter(&ring));
+    EXPECT_EQ(ShmRingRead(&ring, data, 10, &wake), 10u);
+    EXPECT_TRUE(wake);
+    EXPECT_EQ(ShmRingRead(&ring, data, 10, &wake), 10u);
+    EXPECT_FALSE(wake);
+    EXPECT_FALSE(ShmRingArmWriter(&ring));
+}
+
+static UINT32 ShmConnectThread(PVOID Context)
+{
+    std::pair<std::string, PLATFORM_STREAM>* client = (std::pair<std::string, PLATFORM_STREAM>*)Context;
+    return PlatformShmConnect(client->first.c_str(), &client->second);
+}
+
+//
+// connects a client to a shared memory server. The server hands the mapping
+// over from its recv, so the client connects from a second thread.
+//
+static void ShmConnect(const std::string& name, PLATFORM_STREAM server, PLATFORM_STREAM* client)
+{
+    std::pair<std::string, PLATFORM_STREAM> connect(name, NULL);
+    PLATFORM_THREAD thread;
+    PPLATFORM_WAITER waiter;
+    char byte;
+    ASSERT_EQ(PlatformWaiterCreate(&waiter), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformWaiterAddStream(waiter, server), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformThreadCreate(ShmConnectThread, &connect, &thread), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformWait(waiter, 2000), 0u);
+    EXPECT_EQ(PlatformStreamRecv(server, &byte, 1), SOCKET_ERROR);
+    EXPECT_TRUE(PlatformSocketWouldBlock(PlatformSocketLastError()));
+    EXPECT_TRUE(PlatformThreadJoin(thread, 5000));
+    PlatformWaiterClose(waiter);
+    ASSERT_NE(connect.second, (PLATFORM_STREAM)NULL);
+    *client = connect.second;
+}
+
+//
+// Engine on the client end of a shared memory stream with small rings.
+//
+class ShmTest : public PipeTest {
+protected:
+    void SetUp() override
+    {
+        Name = LocalName("shm");
+        Engine = new NET_ENGINE;
+        EngineInitialize(Engine, &Stats);
+        ASSERT_EQ(PlatformShmCreate(Name.c_str(), SHM_MIN_RING_SIZE, &Server), (UINT32)NO_ERROR);
+        ShmConnect(Name, Server, &Engine->Stream);
+        ASSERT_EQ(PlatformWaiterCreate(&Waiter), (UINT32)NO_ERROR);
+        ASSERT_EQ(EngineWaiterAdd(Engine, Waiter), (UINT32)NO_ERROR);
+    }
+};
+
+TEST_F(ShmTest, BothWays) {
+    char buffer[16];
+    ASSERT_EQ(PlatformStreamSend(Server, "hello", 5), 5);
+    ASSERT_EQ(EngineWait(Engine, Waiter, 2000, 1), 0u);
+    ULONG received;
+    EXPECT_EQ(EngineReceive(Engine, &received), EngineReceiveData);
+    EXPECT_EQ(received, 5u);
+
+    EXPECT_EQ(EngineSend(Engine, "world", 5), (UINT32)NO_ERROR);
+    EXPECT_EQ(StreamRecv(Server, buffer, sizeof(buffer)), 5);
+    EXPECT_EQ(memcmp(buffer, "world", 5), 0);
+
+    // nothing more to receive, and nothing signals the waiter.
+    EXPECT_EQ(EngineReceive(Engine, &received), EngineReceiveIdle);
+    EXPECT_EQ(EngineWait(Engine, Waiter, 50, 1), PLATFORM_WAIT_TIMEOUT);
+}
+
+TEST_F(ShmTest, FullRingWrapsInOrder) {
+    std::vector<char> sent(3 * SHM_MIN_RING_SIZE);
+    for (size_t i = 0; i < sent.size(); i++) {
+        sent[i] = (char)(i * 7);
+    }
+    // a full ring takes no more until the reader frees space.
+    int count = PlatformStreamSend(Engine->Stream, sent.data(), (int)sent.size());
+    EXPECT_EQ(count, SHM_MIN_RING_SIZE - 1);
+    EXPECT_NE(PlatformStreamWaitWritable(Engine->Stream, 20), (UINT32)NO_ERROR);
+
+    std::vector<char> echoed(sent.size());
+    size_t read = 0;
+    while (read < sent.size()) {
+        int result = StreamRecv(Server, &echoed[read], 1000);
+        ASSERT_GT(result, 0);
+        read += result;
+        if ((size_t)count < sent.size()) {
+            EXPECT_EQ(PlatformStreamWaitWritable(Engine->Stream, 0), (UINT32)NO_ERROR);
+            int more = PlatformStreamSend(Engine->Stream, &sent[count], (int)(sent.size() - count));
+            ASSERT_GT(more, 0);
+            count += more;
+        }
+    }
+    EXPECT_EQ(echoed, sent);
+}
+
+TEST_F(ShmTest, ServerClose) {
+    PlatformStreamClose(Server);
+    Server = NULL;
+    ASSERT_EQ(EngineWait(Engine, Waiter, 2000, 1), 0u);
+    ULONG received;
+    EXPECT_EQ(EngineReceive(Engine, &received), EngineReceiveClosed);
+    char byte = 0;
+    EXPECT_EQ(PlatformStreamSend(Engine->Stream, &byte, 1), SOCKET_ERROR);
+}
+
+TEST(Shm, ConnectWithoutServerFails) {
+    PLATFORM_STREAM stream;
+    EXPECT_NE(PlatformShmConnect(LocalName("noshm").c_str(), &stream), (UINT32)NO_ERROR);
+}
+
+//
+// a connected unix domain socket pair, bound to a path like the driver does.
+//
+static void UnixConnect(const std::string& path, SOCKET* client, SOCKET* server)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    RemoveLocalName(path);
+    SOCKET listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_NE(listener, INVALID_SOCKET);
+    ASSERT_EQ(bind(listener, (sockaddr*)&address, sizeof(address)), 0);
+    ASSERT_EQ(listen(listener, 1), 0);
+    *client = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(*client, (sockaddr*)&address, sizeof(address)), 0);
+    *server = accept(listener, NULL, NULL);
+    ASSERT_NE(*server, INVALID_SOCKET);
+    closesocket(listener);
+    RemoveLocalName(path);
+}
+
+TEST(UnixSocket, EngineReceive) {
+    ASSERT_EQ(PlatformSocketStartup(), (UINT32)NO_ERROR);
+    HTS_VSP_REPORT stats = {};
+    NET_ENGINE* engine = new NET_ENGINE;
+    EngineInitialize(engine, &stats);
+    SOCKET peer;
+    UnixConnect(LocalName("unix"), &engine->Socket, &peer);
+    PPLATFORM_WAITER waiter;
+    ASSERT_EQ(PlatformWaiterCreate(&waiter), (UINT32)NO_ERROR);
+    ASSERT_EQ(EngineWaiterAdd(engine, waiter), (UINT32)NO_ERROR);
+
+    ASSERT_EQ(send(peer, "hello", 5, 0), 5);
+    ASSERT_EQ(EngineWait(engine, waiter, 2000, 1), 0u);
+    ULONG received;
+    EXPECT_EQ(EngineReceive(engine, &received), EngineReceiveData);
+    EXPECT_EQ(received, 5u);
+
+    PlatformWaiterClose(waiter);
+    closesocket(peer);
+    EngineClose(engine);
+    delete engine;
+    PlatformSocketCleanup();
+}
+
+static UINT32 SetEventThread(PVOID Context)
+{
+    PlatformEventSet((PLATFORM_EVENT)Context);
+    return 0;
+}
+
+TEST(Platform, Thread) {
+    PPLATFORM_WAITER waiter;
+    PLATFORM_EVENT event;
+    PLATFORM_THREAD thread;
+    ASSERT_EQ(PlatformWaiterCreate(&waiter), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformEventCreate(FALSE, &event), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformWaiterAddEvent(waiter, event), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformThreadCreate(SetEventThread, event, &thread), (UINT32)NO_ERROR);
+    EXPECT_EQ(PlatformWait(waiter, 2000), 0u);
+    EXPECT_TRUE(PlatformThreadJoin(thread, 2000));
+    PlatformWaiterClose(waiter);
+    PlatformEventClose(event);
+}
+
+TEST(Platform, WatcherReturnsArmedWaitersOnce) {
+    PPLATFORM_WATCHER watcher;
+    PPLATFORM_WAITER waiter;
+    PLATFORM_EVENT event;
+    ASSERT_EQ(PlatformWatcherCreate(&watcher), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformWaiterCreate(&waiter), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformEventCreate(FALSE, &event), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformWaiterAddEvent(waiter, event), (UINT32)NO_ERROR);
+    int context;
+    PVOID found[4];
+
+    ASSERT_EQ(PlatformWatcherArm(watcher, waiter, &context), (UINT32)NO_ERROR);
+    EXPECT_EQ(PlatformWatcherWait(watcher, 0, found, 4), 0u);
+    PlatformEventSet(event);
+    ASSERT_EQ(PlatformWatcherWait(watcher, 2000, found, 4), 1u);
+    EXPECT_EQ(found[0], &context);
+
+    // the signal is still there for the waiter, and the watcher is done with it.
+    EXPECT_EQ(PlatformWatcherWait(watcher, 0, found, 4), 0u);
+    EXPECT_EQ(PlatformWait(waiter, 0), 0u);
+    EXPECT_EQ(PlatformWait(waiter, 0), PLATFORM_WAIT_TIMEOUT);
+
+    PlatformWatcherWake(watcher);
+    EXPECT_EQ(PlatformWatcherWait(watcher, 2000, found, 4), 0u);
+
+    ASSERT_EQ(PlatformWatcherArm(watcher, waiter, &context), (UINT32)NO_ERROR);
+    PlatformWaiterClose(waiter);
+    PlatformEventSet(event);
+    EXPECT_EQ(PlatformWatcherWait(watcher, 50, found, 4), 0u);
+    PlatformEventClose(event);
+    PlatformWatcherClose(watcher);
+}
+
+//
+// a port loop for the pool: counts the signals of its event and finishes
+// after Limit of them.
+//
+struct PoolTestWork {
+    PPLATFORM_WAITER Waiter = nullptr;
+    PLATFORM_EVENT Event = nullptr;
+    ULONG TimeoutMs = INFINITE;
+    ULONG Limit = 1;
+    std::atomic<int> Runs{ 0 };
+    std::atomic<int> Signals{ 0 };
+    std::atomic<int> Timeouts{ 0 };
+    std::atomic<bool> Running{ false };
+    std::atomic<int> Overlaps{ 0 };
+    std::atomic<bool> Done{ false };
+
+    PoolTestWork()
+    {
+        EXPECT_EQ(PlatformWaiterCreate(&Waiter), (UINT32)NO_ERROR);
+        EXPECT_EQ(PlatformEventCreate(FALSE, &Event), (UINT32)NO_ERROR);
+        EXPECT_EQ(PlatformWaiterAddEvent(Waiter, Event), (UINT32)NO_ERROR);
+    }
+
+    ~PoolTestWork()
+    {
+        PlatformWaiterClose(Waiter);
+        PlatformEventClose(Event);
+    }
+
+    static POOL_WORK_STATUS Run(PVOID Context, BOOL TimedOut, PPLATFORM_WAITER* Waiter, ULONG* TimeoutMs)
+    {
+        PoolTestWork* work = (PoolTestWork*)Context;
+        if (work->Running.exchange(true)) {
+            work->Overlaps++;
+        }
+        work->Runs++;
+        if (TimedOut) {
+            work->Timeouts++;
+        }
+        else if (PlatformWait(work->Waiter, 0) == 0) {
+            work->Signals++;
+        }
+        work->Running = false;
+        if ((ULONG)(work->Signals + work->Timeouts) >= work->Limit) {
+            PlatformWaiterClose(work->Waiter);
+            work->Waiter = nullptr;
+            work->Done = true;
+            return PoolWorkDone;
+        }
+        *Waiter = work->Waiter;
+        *TimeoutMs = work->TimeoutMs;
+        return PoolWorkWait;
+    }
+};
+
+static bool WaitFor(const std::function<bool()>& condition)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (!condition()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+TEST(Pool, AWaitingWorkRunsOnlyWhenSignalled) {
+    ASSERT_EQ(PoolStartup(2), (UINT32)NO_ERROR);
+    PoolTestWork test;
+    test.Limit = 3;
+    PPOOL_WORK work;
+    ASSERT_EQ(PoolWorkStart(PoolTestWork::Run, &test, &work), (UINT32)NO_ERROR);
+    ASSERT_TRUE(WaitFor([&] { return test.Runs == 1; }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_EQ(test.Runs, 1);
+
+    for (int signal = 1; signal <= 3; signal++) {
+        PlatformEventSet(test.Event);
+        ASSERT_TRUE(WaitFor([&] { return test.Signals == signal; }));
+    }
+    EXPECT_TRUE(PoolWorkJoin(work, 2000));
+    EXPECT_EQ(test.Runs, 4);
+    POOL_STATS stats;
+    PoolGetStats(&stats);
+    EXPECT_EQ(stats.Workers, 2u);
+    EXPECT_EQ(stats.Works, 0u);
+    EXPECT_EQ(stats.Wakeups, 3);
+    PoolCleanup();
+}
+
+TEST(Pool, AWaitTimesOut) {
+    ASSERT_EQ(PoolStartup(1), (UINT32)NO_ERROR);
+    PoolTestWork test;
+    test.TimeoutMs = 20;
+    test.Limit = 2;
+    auto start = std::chrono::steady_clock::now();
+    PPOOL_WORK work;
+    ASSERT_EQ(PoolWorkStart(PoolTestWork::Run, &test, &work), (UINT32)NO_ERROR);
+    EXPECT_TRUE(PoolWorkJoin(work, 2000));
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(40));
+    EXPECT_EQ(test.Timeouts, 2);
+    EXPECT_EQ(test.Signals, 0);
+    PoolCleanup();
+}
+
+//
+// a busy work starts works behind it on its own queue, the idle worker takes them.
+//
+struct PoolParentWork {
+    PoolTestWork Children[4];
+    PPOOL_WORK ChildWorks[4] = {};
+    bool ChildrenDoneWhileBusy = false;
+
+    static POOL_WORK_STATUS Run(PVOID Context, BOOL, PPLATFORM_WAITER*, ULONG*)
+    {
+        PoolParentWork* parent = (PoolParentWork*)Context;
+        for (int index = 0; index < 4; index++) {
+            parent->Children[index].TimeoutMs = 0;
+            EXPECT_EQ(PoolWorkStart(PoolTestWork::Run, &parent->Children[index], &parent->ChildWorks[index]),
+                (UINT32)NO_ERROR);
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        parent->ChildrenDoneWhileBusy = false;
+        while (!parent->ChildrenDoneWhileBusy && std::chrono::steady_clock::now() < deadline) {
+            parent->ChildrenDoneWhileBusy = true;
+            for (PoolTestWork& child : parent->Children) {
+                parent->ChildrenDoneWhileBusy &= child.Done.load();
+            }
+        }
+        return PoolWorkDone;
+    }
+};
+
+TEST(Pool, IdleWorkersStealFromABusyOne) {
+    ASSERT_EQ(PoolStartup(2), (UINT32)NO_ERROR);
+    PoolParentWork parent;
+    PPOOL_WORK work;
+    ASSERT_EQ(PoolWorkStart(PoolParentWork::Run, &parent, &work), (UINT32)NO_ERROR);
+    EXPECT_TRUE(PoolWorkJoin(work, 5000));
+    EXPECT_TRUE(parent.ChildrenDoneWhileBusy);
+    for (PPOOL_WORK child : parent.ChildWorks) {
+        EXPECT_TRUE(PoolWorkJoin(child, 2000));
+    }
+    for (PoolTestWork& child : parent.Children) {
+        EXPECT_EQ(child.Overlaps, 0);
+    }
+    POOL_STATS stats;
+    PoolGetStats(&stats);
+    EXPECT_GE(stats.Steals, 1);
+    PoolCleanup();
+}
+
+//
+// a work that joins another on the only worker runs it meanwhile.
+//
+static POOL_WORK_STATUS JoinChildRun(PVOID Context, BOOL, PPLATFORM_WAITER*, ULONG*)
+{
+    PoolTestWork* child = (PoolTestWork*)Context;
+    child->TimeoutMs = 0;
+    PPOOL_WORK work;
+    EXPECT_EQ(PoolWorkStart(PoolTestWork::Run, child, &work), (UINT32)NO_ERROR);
+    EXPECT_TRUE(PoolWorkJoin(work, 2000));
+    return PoolWorkDone;
+}
+
+static POOL_WORK_STATUS YieldRun(PVOID Context, BOOL, PPLATFORM_WAITER*, ULONG*)
+{
+    std::atomic<int>* turns = (std::atomic<int>*)Context;
+    return ++*turns < 10 ? PoolWorkYield : PoolWorkDone;
+}
+
+TEST(Pool, JoinAndYieldOnOneWorker) {
+    ASSERT_EQ(PoolStartup(1), (UINT32)NO_ERROR);
+    PoolTestWork child;
+    std::atomic<int> turns{ 0 };
+    PPOOL_WORK yielding;
+    PPOOL_WORK parent;
+    ASSERT_EQ(PoolWorkStart(YieldRun, &turns, &yielding), (UINT32)NO_ERROR);
+    ASSERT_EQ(PoolWorkStart(JoinChildRun, &child, &parent), (UINT32)NO_ERROR);
+    EXPECT_TRUE(PoolWorkJoin(parent, 2000));
+    EXPECT_TRUE(PoolWorkJoin(yielding, 2000));
+    EXPECT_EQ(child.Timeouts, 1);
+    EXPECT_EQ(turns, 10);
+    POOL_STATS stats;
+    PoolGetStats(&stats);
+    EXPECT_EQ(stats.Yields, 9);
+    PoolCleanup();
+}
+
+//
+// a work that waits for the done event of another instead of joining it,
+// the way the service loop waits for the loop of its last client.
+//
+struct PoolAwaitWork {
+    PoolTestWork Child;
+    PPOOL_WORK ChildWork = nullptr;
+    PPLATFORM_WAITER Waiter = nullptr;
+    bool Joined = false;
+
+    static POOL_WORK_STATUS Run(PVOID Context, BOOL, PPLATFORM_WAITER* Waiter, ULONG* TimeoutMs)
+    {
+        PoolAwaitWork* parent = (PoolAwaitWork*)Context;
+        if (parent->Waiter == nullptr) {
+            EXPECT_EQ(PoolWorkStart(PoolTestWork::Run, &parent->Child, &parent->ChildWork), (UINT32)NO_ERROR);
+            EXPECT_EQ(PlatformWaiterCreate(&parent->Waiter), (UINT32)NO_ERROR);
+            EXPECT_EQ(PlatformWaiterAddEvent(parent->Waiter, PoolWorkDoneEvent(parent->ChildWork)), (UINT32)NO_ERROR);
+            *Waiter = parent->Waiter;
+            *TimeoutMs = INFINITE;
+            return PoolWorkWait;
+        }
+        parent->Joined = PoolWorkJoin(parent->ChildWork, 0) != FALSE;
+        PlatformWaiterClose(parent->Waiter);
+        parent->Waiter = nullptr;
+        return PoolWorkDone;
+    }
+};
+
+TEST(Pool, AWorkWaitsForTheDoneEventOfAnother) {
+    ASSERT_EQ(PoolStartup(1), (UINT32)NO_ERROR);
+    PoolAwaitWork parent;
+    PPOOL_WORK work;
+    ASSERT_EQ(PoolWorkStart(PoolAwaitWork::Run, &parent, &work), (UINT32)NO_ERROR);
+    // both wait, neither holds the only worker.
+    ASSERT_TRUE(WaitFor([&] { return parent.Child.Runs == 1; }));
+    PlatformEventSet(parent.Child.Event);
+    EXPECT_TRUE(PoolWorkJoin(work, 2000));
+    EXPECT_TRUE(parent.Joined);
+    POOL_STATS stats;
+    PoolGetStats(&stats);
+    EXPECT_EQ(stats.Works, 0u);
+    PoolCleanup();
+}
+
+//
+// a hand made getaddrinfo result, to give TcpConnectAddresses addresses in
+// a chosen order.
+//
+struct TestAddress {
+    addrinfo        Info = {};
+    sockaddr_in6    Address = {};
+};
+
+static void MakeAddress(TestAddress* entry, int family, const char* ip, USHORT port)
+{
+    entry->Info.ai_family = family;
+    entry->Info.ai_socktype = SOCK_STREAM;
+    entry->Info.ai_protocol = IPPROTO_TCP;
+    entry->Info.ai_addr = (sockaddr*)&entry->Address;
+    if (family == AF_INET6) {
+        entry->Address.sin6_family = AF_INET6;
+        entry->Address.sin6_port = htons(port);
+        inet_pton(AF_INET6, ip, &entry->Address.sin6_addr);
+        entry->Info.ai_addrlen = sizeof(sockaddr_in6);
+    }
+    else {
+        sockaddr_in* address = (sockaddr_in*)&entry->Address;
+        address->sin_family = AF_INET;
+        address->sin_port = htons(port);
+        inet_pton(AF_INET, ip, &address->sin_addr);
+        entry->Info.ai_addrlen = sizeof(sockaddr_in);
+    }
+}
+
+//
+// a loopback listener and its port.
+//
+static SOCKET Listen(const char* address, USHORT* port)
+{
+    SOCKET listener;
+    if (TcpBind(address, 0, &listener) != NO_ERROR) {
+        return INVALID_SOCKET;
+    }
+    sockaddr_in6 bound = {};
+    socklen_t length = sizeof(bound);
+    getsockname(listener, (sockaddr*)&bound, &length);
+    *port = ntohs(bound.sin6_port);     // at the same offset in sockaddr_in.
+    listen(listener, 4);
+    return listener;
+}
+
+TEST(Connect, OrderInterleavesFamilies) {
+    TestAddress entries[5];
+    MakeAddress(&entries[0], AF_INET6, "2001:db8::1", 1);
+    MakeAddress(&entries[1], AF_INET6, "2001:db8::2", 1);
+    MakeAddress(&entries[2], AF_INET6, "2001:db8::3", 1);
+    MakeAddress(&entries[3], AF_INET, "192.0.2.1", 1);
+    MakeAddress(&entries[4], AF_INET, "192.0.2.2", 1);
+    for (int n = 0; n < 4; n++) {
+        entries[n].Info.ai_next = &entries[n + 1].Info;
+    }
+    const addrinfo* ordered[8];
+    ASSERT_EQ(TcpOrderAddresses(&entries[0].Info, ordered, 8), 5u);
+    const int expected[] = { 0, 3, 1, 4, 2 };
+    for (int n = 0; n < 5; n++) {
+        EXPECT_EQ(ordered[n], &entries[expected[n]].Info) << n;
+    }
+    EXPECT_EQ(TcpOrderAddresses(&entries[0].Info, ordered, 2), 2u);
+
+    // the first family of the list goes first.
+    EXPECT_EQ(TcpOrderAddresses(&entries[3].Info, ordered, 8), 2u);
+    EXPECT_EQ(ordered[0], &entries[3].Info);
+}
+
+TEST(Connect, DualStackBind) {
+    ASSERT_EQ(PlatformSocketStartup(), (UINT32)NO_ERROR);
+    USHORT port = 0;
+    SOCKET listener = Listen("", &port);
+    ASSERT_NE(listener, INVALID_SOCKET);
+
+    for (const char* host : { "127.0.0.1", "::1", "localhost" }) {
+        CONNECT_REPORT report;
+        SOCKET client;
+        UINT32 error = TcpConnect(host, port, CONNECT_ATTEMPT_DELAY_MS, 2000, NULL, &client, &report);
+        if (error != NO_ERROR && strcmp(host, "::1") == 0) {
+            // a host without ipv6 loopback.
+            continue;
+        }
+        ASSERT_EQ(error, (UINT32)NO_ERROR) << host;
+        ASSERT_GE(report.AttemptCount, 1u);
+        EXPECT_EQ(report.Attempts[report.AttemptCount - 1].error, (DWORD)NO_ERROR);
+        EXPECT_GT(report.LatencyUs, 0u);
+        SOCKET server = accept(listener, NULL, NULL);
+        EXPECT_NE(server, INVALID_SOCKET);
+        closesocket(server);
+        closesocket(client);
+    }
+    closesocket(listener);
+    PlatformSocketCleanup();
+}
+
+TEST(Connect, FailedAttemptStartsTheNextAtOnce) {
+    ASSERT_EQ(PlatformSocketStartup(), (UINT32)NO_ERROR);
+    USHORT closedPort = 0;
+    SOCKET closed = Listen("127.0.0.1", &closedPort);
+    closesocket(closed);
+    USHORT port = 0;
+    SOCKET listener = Listen("127.0.0.1", &port);
+    ASSERT_NE(listener, INVALID_SOCKET);
+
+    TestAddress entries[2];
+    MakeAddress(&entries[0], AF_INET, "127.0.0.1", closedPort);
+    MakeAddress(&entries[1], AF_INET, "127.0.0.1", port);
+    const addrinfo* addresses[] = { &entries[0].Info, &entries[1].Info };
+    CONNECT_REPORT report;
+    SOCKET client;
+    ASSERT_EQ(TcpConnectAddresses(addresses, 2, 10000, 20000, NULL, &client, &report), (UINT32)NO_ERROR);
+    ASSERT_EQ(report.AttemptCount, 2u);
+    EXPECT_NE(report.Attempts[0].error, (DWORD)NO_ERROR);
+    EXPECT_NE(report.Attempts[0].error, (DWORD)HTS_VSP_CONNECT_ABANDONED);
+    EXPECT_EQ(report.Attempts[1].error, (DWORD)NO_ERROR);
+    EXPECT_STREQ(report.Attempts[1].address, "127.0.0.1");
+    // well before the attempt delay.
+    EXPECT_LT(report.LatencyUs, 5000000u);
+
+    closesocket(client);
+    closesocket(listener);
+    PlatformSocketCleanup();
+}
+
+#ifndef _WIN32
+//
+// a listener that drops new connections, its accept queue is full. Windows
+// refuses them instead.
+//
+static SOCKET StalledListener(USHORT* port, std::vector<SOCKET>* queued)
+{
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    bind(listener, (sockaddr*)&address, sizeof(address));
+    listen(listener, 0);
+    getsockname(listener, (sockaddr*)&address, &length);
+    *port = ntohs(address.sin_port);
+    for (int n = 0; n < 16; n++) {
+        SOCKET client = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+        queued->push_back(client);
+        connect(client, (sockaddr*)&address, sizeof(address));
+        if (PlatformSocketWaitWritable(client, 100) != NO_ERROR) {
+            return listener;
+        }
+    }
+    return INVALID_SOCKET;
+}
+
+TEST(Connect, StalledAddressCostsTheAttemptDelay) {
+    std::vector<SOCKET> queued;
+    USHORT stalledPort = 0;
+    SOCKET stalled = StalledListener(&stalledPort, &queued);
+    ASSERT_NE(stalled, INVALID_SOCKET);
+    USHORT port = 0;
+    SOCKET listener = Listen("127.0.0.1", &port);
+    ASSERT_NE(listener, INVALID_SOCKET);
+
+    TestAddress entries[2];
+    MakeAddress(&entries[0], AF_INET, "127.0.0.1", stalledPort);
+    MakeAddress(&entries[1], AF_INET, "127.0.0.1", port);
+    const addrinfo* addresses[] = { &entries[0].Info, &entries[1].Info };
+    CONNECT_REPORT report;
+    SOCKET client;
+    ASSERT_EQ(TcpConnectAddresses(addresses, 2, 100, 20000, NULL, &client, &report), (UINT32)NO_ERROR);
+    ASSERT_EQ(report.AttemptCount, 2u);
+    EXPECT_EQ(report.Attempts[0].error, (DWORD)HTS_VSP_CONNECT_ABANDONED);
+    EXPECT_EQ(report.Attempts[1].error, (DWORD)NO_ERROR);
+    EXPECT_GE(report.Attempts[1].startUs, 100000u);
+    EXPECT_LT(report.LatencyUs, 1000000u);
+    closesocket(client);
+
+    // alone it runs into the timeout.
+    ULONGLONG start = PlatformTimeUs();
+    EXPECT_EQ(TcpConnectAddresses(addresses, 1, 100, 300, NULL, &client, &report), (UINT32)ETIMEDOUT);
+    EXPECT_EQ(client, INVALID_SOCKET);
+    EXPECT_LT(PlatformTimeUs() - start, 2000000u);
+
+    // a port that stops cancels it.
+    PLATFORM_EVENT cancel = NULL;
+    ASSERT_EQ(PlatformEventCreate(TRUE, &cancel), (UINT32)NO_ERROR);
+    std::thread stop([cancel] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        PlatformEventSet(cancel);
+    });
+    start = PlatformTimeUs();
+    EXPECT_EQ(TcpConnectAddresses(addresses, 1, 100, 20000, cancel, &client, &report), (UINT32)ECANCELED);
+    EXPECT_EQ(client, INVALID_SOCKET);
+    EXPECT_LT(PlatformTimeUs() - start, 2000000u);
+    stop.join();
+    PlatformEventClose(cancel);
+
+    for (SOCKET socket : queued) {
+        closesocket(socket);
+    }
+    closesocket(stalled);
+    closesocket(listener);
+}
+#endif
+
+TEST(Connect, BackoffDoublesWithJitter) {
+    CONNECT_BACKOFF backoff;
+    ConnectBackoffReset(&backoff, 12345);
+    ULONG ceiling = CONNECT_BACKOFF_MIN_MS;
+    for (int n = 0; n < 12; n++) {
+        ULONG delay = ConnectBackoffNext(&backoff);
+        EXPECT_GE(delay, ceiling / 2) << n;
+        EXPECT_LE(delay, ceiling) << n;
+        ceiling = (ceiling * 2 < CONNECT_BACKOFF_MAX_MS) ? ceiling * 2 : CONNECT_BACKOFF_MAX_MS;
+    }
+    EXPECT_EQ(backoff.CeilingMs, (ULONG)CONNECT_BACKOFF_MAX_MS);
+
+    // ports seeded differently do not retry in step.
+    CONNECT_BACKOFF other;
+    ConnectBackoffReset(&backoff, 1);
+    ConnectBackoffReset(&other, 2);
+    bool differ = false;
+    for (int n = 0; n < 8; n++) {
+        differ |= ConnectBackoffNext(&backoff) != ConnectBackoffNext(&other);
+    }
+    EXPECT_TRUE(differ);
+
+    ConnectBackoffReset(&backoff, 1);
+    EXPECT_LE(ConnectBackoffNext(&backoff), (ULONG)CONNECT_BACKOFF_MIN_MS);
+}
+
+TEST_F(EngineTest, WritesKeptUntilAttach) {
+    PeerSend("r", 1);
+    ULONG received;
+    ASSERT_EQ(WaitAndReceive(&received), EngineReceiveData);
+
+    EngineDisconnect(Engine);
+    EXPECT_FALSE(EngineConnected(Engine));
+    EXPECT_EQ(EngineWrite(Engine, "abc", 3), (UINT32)NO_ERROR);
+    EXPECT_EQ(EngineWrite(Engine, "def", 3), (UINT32)NO_ERROR);
+    EXPECT_EQ(Stats.backlogBytes, 6);
+    // the received data stays for the reads.
+    EXPECT_EQ(RingData(), 1u);
+
+    USHORT port = 0;
+    SOCKET listener = Listen("127.0.0.1", &port);
+    ASSERT_NE(listener, INVALID_SOCKET);
+    CONNECT_REPORT report;
+    SOCKET client;
+    ASSERT_EQ(TcpConnect("127.0.0.1", port, CONNECT_ATTEMPT_DELAY_MS, 2000, NULL, &client, &report), (UINT32)NO_ERROR);
+    SOCKET server = accept(listener, NULL, NULL);
+    closesocket(listener);
+    ASSERT_NE(server, INVALID_SOCKET);
+
+    EXPECT_EQ(EngineAttach(Engine, client, NULL), (UINT32)NO_ERROR);
+    EXPECT_EQ(EngineWrite(Engine, "g", 1), (UINT32)NO_ERROR);
+    char buffer[8] = {};
+    EXPECT_EQ(recv(server, buffer, 7, MSG_WAITALL), 7);
+    EXPECT_STREQ(buffer, "abcdefg");
+    closesocket(server);
+}
+
+TEST_F(EngineTest, BacklogOverflowDrops) {
+    EngineDisconnect(Engine);
+    std::vector<char> data(ENGINE_BACKLOG_SIZE + 100, 'b');
+    EXPECT_EQ(EngineWrite(Engine, data.data(), (int)data.size()), (UINT32)NO_ERROR);
+    EXPECT_EQ(Stats.backlogBytes + Stats.backlogDroppedBytes, (INT64)data.size());
+    EXPECT_GE(Stats.backlogDroppedBytes, 100);
+
+    // closed for good, the writes go nowhere and the backlog is gone.
+    EngineClose(Engine);
+    EXPECT_EQ(EngineWrite(Engine, "x", 1), (UINT32)NO_ERROR);
+    EXPECT_EQ(Stats.backlogBytes + Stats.backlogDroppedBytes, (INT64)data.size());
+}
+
+TEST_F(EngineTest, WatermarksPauseAndResumeReceiving) {
+    EngineSetWatermarks(Engine, 1000, 200);
+    EXPECT_EQ(Stats.flowHighWater, 1000u);
+    EXPECT_EQ(Stats.flowLowWater, 200u);
+    std::vector<char> data(4000, 'w');
+    PeerSend(data.data(), (int)data.size());
+
+    ULONG received;
+    while (EngineReceiveAllowed(Engine)) {
+        ASSERT_EQ(WaitAndReceive(&received), EngineReceiveData);
+    }
+    EXPECT_EQ(Stats.flowPauses, 1);
+    EXPECT_GE(RingData(), 1000u);
+    EXPECT_EQ(Stats.flowOverrunBytes, (INT64)RingData() - 1000);
+    EXPECT_EQ(EngineReceive(Engine, &received), EngineReceiveIdle);
+
+    // reads above the low watermark do not resume it.
+    BYTE buffer[4000];
+    size_t copied;
+    RingBufferRead(&Engine->ReceiveRing, buffer, RingData() - 500, &copied);
+    EXPECT_FALSE(EngineReceiveAllowed(Engine));
+    RingBufferRead(&Engine->ReceiveRing, buffer, 300, &copied);
+    EXPECT_TRUE(EngineReceiveAllowed(Engine));
+    EXPECT_EQ(Stats.flowResumes, 1);
+
+    // the hold pauses it at any level.
+    EngineHoldReceive(Engine, TRUE);
+    EXPECT_FALSE(EngineReceiveAllowed(Engine));
+    EngineHoldReceive(Engine, FALSE);
+    EXPECT_TRUE(EngineReceiveAllowed(Engine));
+    EXPECT_EQ(Stats.flowPauses, 2);
+
+    // limits past the ring are a full ring.
+    EngineSetWatermarks(Engine, ENGINE_RECEIVE_BUFFER_SIZE * 2, ENGINE_RECEIVE_BUFFER_SIZE * 2);
+    EXPECT_EQ(Engine->Flow.HighWater, (size_t)ENGINE_RECEIVE_BUFFER_SIZE - 1);
+    EXPECT_EQ(Engine->Flow.LowWater, (size_t)ENGINE_RECEIVE_BUFFER_SIZE - 2);
+}
+
+TEST_F(EngineTest, ClearedRtsHoldsReceivingOnlyUnderTheHandshake) {
+    // SetCommState with RTS_CONTROL_DISABLE on a port without flow control.
+    EngineSetRts(Engine, FALSE);
+    EXPECT_TRUE(EngineReceiveAllowed(Engine));
+    PeerSend("rts", 3);
+    ULONG received;
+    ASSERT_EQ(WaitAndReceive(&received), EngineReceiveData);
+    EXPECT_EQ(received, 3u);
+    EXPECT_EQ(Stats.flowPauses, 0);
+
+    // SetHandFlow with the rts handshake.
+    EngineSetWatermarks(Engine, 1000, 200);
+    Engine->Flow.RtsHandshake = TRUE;
+    EngineSetRts(Engine, FALSE);
+    EXPECT_FALSE(EngineReceiveAllowed(Engine));
+    EngineSetRts(Engine, TRUE);
+    EXPECT_TRUE(EngineReceiveAllowed(Engine));
+    EXPECT_EQ(Stats.flowPauses, 1);
+}
+
+TEST_F(EngineTest, XoffHoldsWritesUntilXon) {
+    EXPECT_EQ(EngineHoldTransmit(Engine, TRUE), (UINT32)NO_ERROR);
+    EXPECT_EQ(EngineWrite(Engine, "abc", 3), (UINT32)NO_ERROR);
+    EXPECT_EQ(Stats.flowHeldBytes, 3);
+    EXPECT_EQ(Stats.bytesWritten, 0);
+
+    EXPECT_EQ(EngineHoldTransmit(Engine, FALSE), (UINT32)NO_ERROR);
+    EXPECT_EQ(EngineWrite(Engine, "d", 1), (UINT32)NO_ERROR);
+    char buffer[5] = {};
+    EXPECT_EQ(recv(Peer, buffer, 4, MSG_WAITALL), 4);
+    EXPECT_STREQ(buffer, "abcd");
+    EXPECT_EQ(Stats.backlogBytes, 0);
+}
+
+TEST(RingBuffer, OverflowPoliciesCountTheDroppedBytes) {
+    BYTE storage[8];
+    RING_BUFFER ring;
+    RingBufferInitialize(&ring, storage, sizeof(storage));
+    BYTE data[] = "abcdefghij";
+    BYTE buffer[8] = {};
+    size_t dropped;
+    size_t copied;
+
+    // the ring holds 7, the newest 3 are dropped.
+    EXPECT_EQ(RingBufferWriteOverflow(&ring, data, 10, RingOverflowDropNewest, &dropped), STATUS_SUCCESS);
+    EXPECT_EQ(dropped, 3u);
+    RingBufferRead(&ring, buffer, 2, &copied);
+    EXPECT_EQ(memcmp(buffer, "ab", 2), 0);
+
+    // the oldest 3 make room for 5, across the end of the buffer.
+    EXPECT_EQ(RingBufferWriteOverflow(&ring, data, 5, RingOverflowDropOldest, &dropped), STATUS_SUCCESS);
+    EXPECT_EQ(dropped, 3u);
+    RingBufferRead(&ring, buffer, sizeof(buffer), &copied);
+    ASSERT_EQ(copied, 7u);
+    EXPECT_EQ(memcmp(buffer, "fgabcde", 7), 0);
+
+    // more than the ring holds keeps the last 7.
+    RingBufferWrite(&ring, data, 1);
+    EXPECT_EQ(RingBufferWriteOverflow(&ring, data, 10, RingOverflowDropOldest, &dropped), STATUS_SUCCESS);
+    EXPECT_EQ(dropped, 4u);
+    RingBufferRead(&ring, buffer, sizeof(buffer), &copied);
+    ASSERT_EQ(copied, 7u);
+    EXPECT_EQ(memcmp(buffer, "defghij", 7), 0);
+
+    RingBufferWrite(&ring, data, 2);
+    size_t discarded;
+    RingBufferDiscard(&ring, 5, &discarded);
+    EXPECT_EQ(discarded, 2u);
+}
+
+TEST_F(EngineTest, DropPoliciesCountTheOverflow) {
+    EngineSetOverflow(Engine, HtsOverflowDropNewest, 0);
+    EngineSetWatermarks(Engine, 0, 0);
+    std::vector<char> data(ENGINE_RECEIVE_BUFFER_SIZE + 1000, 'n');
+    int sent = 0;
+    while (sent < (int)data.size()) {
+        int result = send(Peer, data.data() + sent, (int)data.size() - sent, 0);
+        ASSERT_GT(result, 0);
+        sent += result;
+    }
+    // a ring that drops does not pause the peer.
+    ULONG received;
+    while (Stats.bytesRead < (INT64)data.size()) {
+        ASSERT_TRUE(EngineReceiveAllowed(Engine));
+        ASSERT_EQ(WaitAndReceive(&received), EngineReceiveData);
+    }
+    EXPECT_EQ(RingData(), (size_t)ENGINE_RECEIVE_BUFFER_SIZE - 1);
+    EXPECT_EQ(Stats.overflowBytes, 1001);
+    EXPECT_GE(Stats.overflowEvents, 1);
+    EXPECT_EQ(Stats.flowPauses, 0);
+
+    // drop oldest keeps the newest byte.
+    EngineSetOverflow(Engine, HtsOverflowDropOldest, 0);
+    EXPECT_EQ(Stats.overflowPolicy, (DWORD)HtsOverflowDropOldest);
+    PeerSend("xyz", 3);
+    while (Stats.bytesRead < (INT64)data.size() + 3) {
+        ASSERT_EQ(WaitAndReceive(&received), EngineReceiveData);
+    }
+    EXPECT_EQ(Stats.overflowBytes, 1004);
+    EXPECT_EQ(RingData(), (size_t)ENGINE_RECEIVE_BUFFER_SIZE - 1);
+    std::vector<BYTE> buffer(ENGINE_RECEIVE_BUFFER_SIZE);
+    size_t copied;
+    RingBufferRead(&Engine->ReceiveRing, buffer.data(), buffer.size(), &copied);
+    EXPECT_EQ(memcmp(buffer.data() + copied - 3, "xyz", 3), 0);
+}
+
+TEST_F(EngineTest, BlockTimeoutDropsUntilTheLowWatermark) {
+    EngineSetOverflow(Engine, HtsOverflowBlock, 50);
+    EngineSetWatermarks(Engine, 1000, 200);
+    std::vector<char> data(4000, 'b');
+    PeerSend(data.data(), (int)data.size());
+
+    ULONG received;
+    EXPECT_EQ(EngineOverflowTimeout(Engine), 0u);
+    while (EngineReceiveAllowed(Engine)) {
+        ASSERT_EQ(WaitAndReceive(&received), EngineReceiveData);
+    }
+    EXPECT_EQ(EngineOverflowTimeout(Engine), 50u);
+
+    // after the timeout the rest is received, what does not fit dropped.
+    EngineOverflowTimerExpired(Engine);
+    EXPECT_EQ(Stats.overflowTimeouts, 1);
+    EXPECT_EQ(EngineOverflowTimeout(Engine), 0u);
+    EXPECT_TRUE(EngineReceiveAllowed(Engine));
+    while (Stats.bytesRead < (INT64)data.size()) {
+        ASSERT_EQ(WaitAndReceive(&received), EngineReceiveData);
+    }
+    EXPECT_EQ(Stats.overflowBytes, 0);
+    EXPECT_EQ(RingData(), data.size());
+
+    // it blocks again once reads take the ring down to the low watermark.
+    BYTE buffer[4000];
+    size_t copied;
+    RingBufferRead(&Engine->ReceiveRing, buffer, RingData() - 200, &copied);
+    EXPECT_TRUE(EngineReceiveAllowed(Engine));
+    EXPECT_FALSE(Engine->Overflow.Expired);
+}
+
+TEST(Mux, HeaderRoundTrip) {
+    MUX_HEADER header = { MUX_FRAME_DATA, 0x1234, MUX_MAX_PAYLOAD };
+    BYTE buffer[MUX_HEADER_SIZE];
+    MuxEncodeHeader(&header, buffer);
+    EXPECT_EQ(buffer[2], 0x12);
+    EXPECT_EQ(buffer[3], 0x34);
+    MUX_HEADER decoded;
+    ASSERT_TRUE(MuxDecodeHeader(buffer, &decoded));
+    EXPECT_EQ(decoded.Type, MUX_FRAME_DATA);
+    EXPECT_EQ(decoded.Channel, 0x1234);
+    EXPECT_EQ(decoded.Length, (ULONG)MUX_MAX_PAYLOAD);
+
+    header.Length = MUX_MAX_PAYLOAD + 1;
+    MuxEncodeHeader(&header, buffer);
+    EXPECT_FALSE(MuxDecodeHeader(buffer, &decoded));
+    header = { 9, 1, 0 };
+    MuxEncodeHeader(&header, buffer);
+    EXPECT_FALSE(MuxDecodeHeader(buffer, &decoded));
+}
+
+//
+// the relay end of a session, driven by the test with blocking sockets.
+//
+static void RelaySend(SOCKET relay, UCHAR type, USHORT channel, const void* payload, ULONG length)
+{
+    BYTE header[MUX_HEADER_SIZE];
+    MUX_HEADER frame = { type, channel, length };
+    MuxEncodeHeader(&frame, header);
+    ASSERT_EQ(send(relay, (const char*)header, sizeof(header), 0), (int)sizeof(header));
+    if (length) {
+        ASSERT_EQ(send(relay, (const char*)payload, (int)length, 0), (int)length);
+    }
+}
+
+static void RelaySendUlong(SOCKET relay, UCHAR type, USHORT channel, ULONG value)
+{
+    BYTE payload[4];
+    MuxEncodeUlong(value, payload);
+    RelaySend(relay, type, channel, payload, sizeof(payload));
+}
+
+static std::string RelayRecv(SOCKET relay, MUX_HEADER* header)
+{
+    BYTE buffer[MUX_HEADER_SIZE];
+    if (recv(relay, (char*)buffer, sizeof(buffer), MSG_WAITALL) != (int)sizeof(buffer) ||
+        !MuxDecodeHeader(buffer, header)) {
+        header->Type = 0;
+        return "";
+    }
+    std::string payload(header->Length, '\0');
+    if (header->Length && recv(relay, &payload[0], (int)header->Length, MSG_WAITALL) != (int)header->Length) {
+        header->Type = 0;
+    }
+    return payload;
+}
+
+//
+// opens Channel in a thread while the relay, already accepted or accepted
+// here from Listener, answers the open with Window.
+//
+static void MuxOpen(SOCKET listener, SOCKET* relay, USHORT port, USHORT channel, ULONG window,
+    PLATFORM_STREAM* stream)
+{
+    UINT32 error = MAXULONG;
+    std::thread opener([&] { error = MuxChannelOpen("127.0.0.1", port, channel, 2000, stream); });
+    if (*relay == INVALID_SOCKET) {
+        *relay = accept(listener, NULL, NULL);
+    }
+    MUX_HEADER header = {};
+    std::string payload = RelayRecv(*relay, &header);
+    EXPECT_EQ(header.Type, MUX_FRAME_OPEN);
+    EXPECT_EQ(header.Channel, channel);
+    EXPECT_EQ(payload.size() == 4 ? MuxDecodeUlong((const BYTE*)payload.data()) : 0, (ULONG)MUX_WINDOW);
+    RelaySendUlong(*relay, MUX_FRAME_OPEN, channel, window);
+    opener.join();
+    EXPECT_EQ(error, (UINT32)NO_ERROR);
+}
+
+static int MuxWaitRecv(PLATFORM_STREAM stream, char* buffer, int length)
+{
+    PPLATFORM_WAITER waiter;
+    if (PlatformWaiterCreate(&waiter) != NO_ERROR || PlatformWaiterAddStream(waiter, stream) != NO_ERROR) {
+        return SOCKET_ERROR;
+    }
+    int result;
+    while ((result = PlatformStreamRecv(stream, buffer, length)) < 0 &&
+        PlatformSocketWouldBlock(PlatformSocketLastError()) && PlatformWait(waiter, 2000) == 0) {
+    }
+    PlatformWaiterClose(waiter);
+    return result;
+}
+
+TEST(Mux, ChannelDataCreditAndClose) {
+    ASSERT_EQ(PlatformSocketStartup(), (UINT32)NO_ERROR);
+    MuxStartup();
+    USHORT port = 0;
+    SOCKET listener = Listen("127.0.0.1", &port);
+    ASSERT_NE(listener, INVALID_SOCKET);
+    SOCKET relay = INVALID_SOCKET;
+    PLATFORM_STREAM stream = NULL;
+    MuxOpen(listener, &relay, port, 7, 16, &stream);
+    ASSERT_NE(stream, nullptr);
+
+    // a second open of the channel fails without asking the relay.
+    PLATFORM_STREAM again = NULL;
+    EXPECT_NE(MuxChannelOpen("127.0.0.1", port, 7, 2000, &again), (UINT32)NO_ERROR);
+
+    EXPECT_EQ(PlatformStreamSend(stream, "hello", 5), 5);
+    MUX_HEADER header = {};
+    EXPECT_EQ(RelayRecv(relay, &header), "hello");
+    EXPECT_EQ(header.Type, MUX_FRAME_DATA);
+    EXPECT_EQ(header.Channel, 7);
+
+    RelaySend(relay, MUX_FRAME_DATA, 7, "world", 5);
+    char buffer[32] = {};
+    EXPECT_EQ(MuxWaitRecv(stream, buffer, sizeof(buffer)), 5);
+    EXPECT_STREQ(buffer, "world");
+
+    // 11 bytes of credit are left, then the send waits for the relay.
+    EXPECT_EQ(PlatformStreamSend(stream, "0123456789abcdef", 16), 11);
+    EXPECT_EQ(RelayRecv(relay, &header), "0123456789a");
+    EXPECT_EQ(PlatformStreamSend(stream, "bcdef", 5), SOCKET_ERROR);
+    EXPECT_TRUE(PlatformSocketWouldBlock(PlatformSocketLastError()));
+    EXPECT_NE(PlatformStreamWaitWritable(stream, 10), (UINT32)NO_ERROR);
+    RelaySendUlong(relay, MUX_FRAME_CREDIT, 7, 16);
+    EXPECT_EQ(PlatformStreamWaitWritable(stream, 2000), (UINT32)NO_ERROR);
+    EXPECT_EQ(PlatformStreamSend(stream, "bcdef", 5), 5);
+    EXPECT_EQ(RelayRecv(relay, &header), "bcdef");
+
+    RelaySend(relay, MUX_FRAME_CLOSE, 7, NULL, 0);
+    EXPECT_EQ(MuxWaitRecv(stream, buffer, sizeof(buffer)), 0);
+    PlatformStreamClose(stream);
+
+    // the last channel closed the session.
+    EXPECT_EQ(recv(relay, buffer, sizeof(buffer), 0), 0);
+    closesocket(relay);
+    closesocket(listener);
+    MuxCleanup();
+}
+
+TEST(Mux, ChannelsShareTheSessionAndCloseWithIt) {
+    ASSERT_EQ(PlatformSocketStartup(), (UINT32)NO_ERROR);
+    MuxStartup();
+    USHORT port = 0;
+    SOCKET listener = Listen("127.0.0.1", &port);
+    ASSERT_NE(listener, INVALID_SOCKET);
+    SOCKET relay = INVALID_SOCKET;
+    PLATFORM_STREAM first = NULL;
+    PLATFORM_STREAM second = NULL;
+    MuxOpen(listener, &relay, port, 1, MUX_WINDOW, &first);
+    MuxOpen(listener, &relay, port, 2, MUX_WINDOW, &second);
+    ASSERT_NE(first, nullptr);
+    ASSERT_NE(second, nullptr);
+
+    RelaySend(relay, MUX_FRAME_DATA, 2, "two", 3);
+    RelaySend(relay, MUX_FRAME_DATA, 1, "one", 3);
+    char buffer[8] = {};
+    EXPECT_EQ(MuxWaitRecv(first, buffer, sizeof(buffer)), 3);
+    EXPECT_STREQ(buffer, "one");
+    EXPECT_EQ(MuxWaitRecv(second, buffer, sizeof(buffer)), 3);
+    EXPECT_STREQ(buffer, "two");
+
+    // the data that came first is still read, then the end.
+    RelaySend(relay, MUX_FRAME_DATA, 1, "end", 3);
+    closesocket(relay);
+    EXPECT_EQ(MuxWaitRecv(first, buffer, sizeof(buffer)), 3);
+    EXPECT_EQ(MuxWaitRecv(first, buffer, sizeof(buffer)), 0);
+    EXPECT_EQ(MuxWaitRecv(second, buffer, sizeof(buffer)), 0);
+    EXPECT_EQ(PlatformStreamSend(second, "x", 1), SOCKET_ERROR);
+    PlatformStreamClose(first);
+    PlatformStreamClose(second);
+    closesocket(listener);
+    MuxCleanup();
+}
+
+//
+// a tap connected through a loopback listener, Client is its own end.
+//
+static void TapConnect(PTAP_SET taps, SOCKET* client, BOOL* added)
+{
+    USHORT port = 0;
+    SOCKET listener = Listen("127.0.0.1", &port);
+    ASSERT_NE(listener, INVALID_SOCKET);
+    CONNECT_REPORT report;
+    ASSERT_EQ(TcpConnect("127.0.0.1", port, CONNECT_ATTEMPT_DELAY_MS, 2000, NULL, client, &report), (UINT32)NO_ERROR);
+    SOCKET server = accept(listener, NULL, NULL);
+    closesocket(listener);
+    ASSERT_NE(server, INVALID_SOCKET);
+    *added = TapAdd(taps, server);
+    if (!*added) {
+        closesocket(server);
+    }
+}
+
+TEST_F(EngineTest, TapsGetBothDirectionsInOrder) {
+    TAP_SET taps;
+    ASSERT_EQ(TapInitialize(&taps, &Stats), (UINT32)NO_ERROR);
+    TapConfigure(&taps, 2, HtsTapDrop);
+    Engine->Taps = &taps;
+    EXPECT_EQ(TapFlush(&taps), (ULONG)INFINITE);
+
+    SOCKET tap;
+    BOOL added;
+    TapConnect(&taps, &tap, &added);
+    ASSERT_TRUE(added);
+    EXPECT_EQ(Stats.tapClients, 1u);
+
+    PeerSend("in", 2);
+    ULONG received;
+    ASSERT_EQ(WaitAndReceive(&received), EngineReceiveData);
+    EXPECT_EQ(EngineWrite(Engine, "out", 3), (UINT32)NO_ERROR);
+
+    // the copies wait for the flush, the primary already has its bytes.
+    char buffer[8] = {};
+    EXPECT_EQ(recv(Peer, buffer, 3, MSG_WAITALL), 3);
+    PPLATFORM_WAITER tapWaiter;
+    ASSERT_EQ(PlatformWaiterCreate(&tapWaiter), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformWaiterAddEvent(tapWaiter, taps.Event), (UINT32)NO_ERROR);
+    EXPECT_EQ(PlatformWait(tapWaiter, 0), 0u);
+    PlatformWaiterClose(tapWaiter);
+    EXPECT_EQ(TapFlush(&taps), (ULONG)TAP_POLL_MS);
+    RtlZeroMemory(buffer, sizeof(buffer));
+    EXPECT_EQ(recv(tap, buffer, 5, MSG_WAITALL), 5);
+    EXPECT_STREQ(buffer, "inout");
+    EXPECT_EQ(Stats.tapBytes, 5);
+
+    // a tap is not heard.
+    EXPECT_EQ(send(tap, "x", 1, 0), 1);
+    EXPECT_EQ(TapFlush(&taps), (ULONG)TAP_POLL_MS);
+    EXPECT_EQ(RingData(), 2u);
+
+    // a closed tap is found by the next flush.
+    closesocket(tap);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_EQ(TapFlush(&taps), (ULONG)INFINITE);
+    EXPECT_EQ(Stats.tapClients, 0u);
+
+    Engine->Taps = NULL;
+    TapCleanup(&taps);
+}
+
+TEST(Tap, SlowTapDropsWholeCopies) {
+    HTS_VSP_REPORT stats = {};
+    TAP_SET taps;
+    ASSERT_EQ(PlatformSocketStartup(), (UINT32)NO_ERROR);
+    ASSERT_EQ(TapInitialize(&taps, &stats), (UINT32)NO_ERROR);
+    TapConfigure(&taps, 1, HtsTapDrop);
+
+    SOCKET slow, extra;
+    BOOL added;
+    TapConnect(&taps, &slow, &added);
+    ASSERT_TRUE(added);
+    TapConnect(&taps, &extra, &added);
+    EXPECT_FALSE(added);
+    closesocket(extra);
+
+    // more than the queue takes before a flush.
+    std::vector<BYTE> copy(TAP_QUEUE_SIZE / 4 + 1, 's');
+    for (int i = 0; i < 4; i++) {
+        TapCopy(&taps, copy.data(), (ULONG)copy.size());
+    }
+    EXPECT_EQ(stats.tapDroppedBytes, (INT64)copy.size());
+    EXPECT_EQ(stats.tapDisconnects, 0u);
+    EXPECT_EQ(stats.tapClients, 1u);
+
+    TapCleanup(&taps);
+    closesocket(slow);
+    PlatformSocketCleanup();
+}
+
+TEST(Tap, DisconnectPolicyClosesTheSlowTap) {
+    HTS_VSP_REPORT stats = {};
+    TAP_SET taps;
+    ASSERT_EQ(PlatformSocketStartup(), (UINT32)NO_ERROR);
+    ASSERT_EQ(TapInitialize(&taps, &stats), (UINT32)NO_ERROR);
+    TapConfigure(&taps, 1, HtsTapDisconnect);
+
+    SOCKET slow;
+    BOOL added;
+    TapConnect(&taps, &slow, &added);
+    ASSERT_TRUE(added);
+
+    std::vector<BYTE> copy(TAP_QUEUE_SIZE / 2 + 1, 'd');
+    TapCopy(&taps, copy.data(), (ULONG)copy.size());
+    TapCopy(&taps, copy.data(), (ULONG)copy.size());
+    EXPECT_EQ(stats.tapDroppedBytes, 0);
+    EXPECT_EQ(TapFlush(&taps), (ULONG)INFINITE);
+    EXPECT_EQ(stats.tapDisconnects, 1u);
+    EXPECT_EQ(stats.tapClients, 0u);
+
+    // the tap sees the close.
+    std::vector<char> buffer(64 * 1024);
+    int result;
+    while ((result = recv(slow, buffer.data(), (int)buffer.size(), 0)) > 0) {
+    }
+    EXPECT_LE(result, 0);
+
+    TapCleanup(&taps);
+    closesocket(slow);
+    PlatformSocketCleanup();
+}
+
+static std::vector<BYTE> LzTestData(size_t length, ULONG seed)
+{
+    // text like a debug print stream, with runs of a counter in it.
+    std::vector<BYTE> data(length);
+    for (size_t i = 0; i < length; i++) {
+        seed = seed * 1664525 + 1013904223;
+        data[i] = (i % 64 < 40) ? (BYTE)("nt!KiSwapContext+0x76 thread "[i % 29]) : (BYTE)(seed >> 24 & 0x0f);
+    }
+    return data;
+}
+
+TEST(Lz, RoundTripKeepsHistoryAcrossBlocks) {
+    std::unique_ptr<LZ_ENCODER> encoder(new LZ_ENCODER);
+    std::unique_ptr<LZ_DECODER> decoder(new LZ_DECODER);
+    LzEncoderInitialize(encoder.get());
+    LzDecoderInitialize(decoder.get());
+    std::vector<BYTE> block(LZ_BLOCK_SIZE);
+
+    // a repeat of the last block is a few matches.
+    std::vector<BYTE> packet = LzTestData(1000, 1);
+    ULONG first = LzCompress(encoder.get(), packet.data(), (ULONG)packet.size(), block.data());
+    ASSERT_NE(first, 0u);
+    const BYTE* data = LzDecompress(decoder.get(), block.data(), first, (ULONG)packet.size());
+    ASSERT_NE(data, nullptr);
+    EXPECT_EQ(memcmp(data, packet.data(), packet.size()), 0);
+    ULONG second = LzCompress(encoder.get(), packet.data(), (ULONG)packet.size(), block.data());
+    EXPECT_LT(second, 32u);
+    data = LzDecompress(decoder.get(), block.data(), second, (ULONG)packet.size());
+    ASSERT_NE(data, nullptr);
+    EXPECT_EQ(memcmp(data, packet.data(), packet.size()), 0);
+
+    // blocks of every size, more than the history holds, both sides move it.
+    for (ULONG n = 0; n < 200; n++) {
+        std::vector<BYTE> input = LzTestData(1 + (n * 977) % LZ_BLOCK_SIZE, n);
+        ULONG length = LzCompress(encoder.get(), input.data(), (ULONG)input.size(), block.data());
+        if (length == 0) {
+            memcpy(block.data(), input.data(), input.size());
+            length = (ULONG)input.size();
+        }
+        data = LzDecompress(decoder.get(), block.data(), length, (ULONG)input.size());
+        ASSERT_NE(data, nullptr) << "block " << n;
+        ASSERT_EQ(memcmp(data, input.data(), input.size()), 0) << "block " << n;
+    }
+}
+
+TEST(Lz, IncompressibleDataIsStored) {
+    std::unique_ptr<LZ_ENCODER> encoder(new LZ_ENCODER);
+    std::unique_ptr<LZ_DECODER> decoder(new LZ_DECODER);
+    LzEncoderInitialize(encoder.get());
+    LzDecoderInitialize(decoder.get());
+    std::vector<BYTE> random(4096);
+    ULONG seed = 7;
+    for (auto& value : random) {
+        seed = seed * 1664525 + 1013904223;
+        value = (BYTE)(seed >> 24);
+    }
+    std::vector<BYTE> block(LZ_BLOCK_SIZE);
+    EXPECT_EQ(LzCompress(encoder.get(), random.data(), (ULONG)random.size(), block.data()), 0u);
+    const BYTE* data = LzDecompress(decoder.get(), random.data(), (ULONG)random.size(), (ULONG)random.size());
+    ASSERT_NE(data, nullptr);
+    EXPECT_EQ(memcmp(data, random.data(), random.size()), 0);
+
+    // the stored block is history all the same.
+    ULONG length = LzCompress(encoder.get(), random.data(), (ULONG)random.size(), block.data());
+    ASSERT_NE(length, 0u);
+    data = LzDecompress(decoder.get(), block.data(), length, (ULONG)random.size());
+    ASSERT_NE(data, nullptr);
+    EXPECT_EQ(memcmp(data, random.data(), random.size()), 0);
+}
+
+TEST(Lz, CorruptBlocksAreRejected) {
+    std::unique_ptr<LZ_DECODER> decoder(new LZ_DECODER);
+    LzDecoderInitialize(decoder.get());
+
+    // a match before the start of the stream.
+    const BYTE before[] = { 0x10, 'a', 0x05, 0x00, 0x50, 'b', 'c', 'd', 'e', 'f' };
+    EXPECT_EQ(LzDecompress(decoder.get(), before, sizeof(before), 20), nullptr);
+    // literals past the end of the block.
+    const BYTE truncated[] = { 0xf0, 0x20, 'a', 'b' };
+    EXPECT_EQ(LzDecompress(decoder.get(), truncated, sizeof(truncated), 64), nullptr);
+    // a block that makes less than its length.
+    const BYTE shorter[] = { 0x30, 'a', 'b', 'c' };
+    EXPECT_EQ(LzDecompress(decoder.get(), shorter, sizeof(shorter), 8), nullptr);
+    EXPECT_EQ(LzDecompress(decoder.get(), shorter, sizeof(shorter), LZ_BLOCK_SIZE + 1), nullptr);
+
+    BYTE header[COMPRESS_HEADER_SIZE];
+    ULONG length, blockLength;
+    CompressEncodeHeader(LZ_BLOCK_SIZE, 100, header);
+    ASSERT_TRUE(CompressDecodeHeader(header, &length, &blockLength));
+    EXPECT_EQ(length, (ULONG)LZ_BLOCK_SIZE);
+    EXPECT_EQ(blockLength, 100u);
+    CompressEncodeHeader(100, 101, header);
+    EXPECT_FALSE(CompressDecodeHeader(header, &length, &blockLength));
+}
+
+//
+// opens a compressed stream on a loopback connection, Peer is the other end
+// and answers with Hello.
+//
+static void CompressOpen(const BYTE* hello, PHTS_VSP_REPORT stats, SOCKET* peer, PLATFORM_STREAM* stream,
+    UINT32* error)
+{
+    USHORT port = 0;
+    SOCKET listener = Listen("127.0.0.1", &port);
+    ASSERT_NE(listener, INVALID_SOCKET);
+    SOCKET client = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(connect(client, (sockaddr*)&address, sizeof(address)), 0);
+    *peer = accept(listener, NULL, NULL);
+    closesocket(listener);
+    ASSERT_NE(*peer, INVALID_SOCKET);
+
+    std::thread opener([&] { *error = CompressStreamOpen(client, 2000, stats, stream); });
+    BYTE received[COMPRESS_HELLO_SIZE];
+    EXPECT_EQ(recv(*peer, (char*)received, sizeof(received), MSG_WAITALL), (int)sizeof(received));
+    EXPECT_TRUE(CompressHelloValid(FALSE, received));
+    send(*peer, (const char*)hello, COMPRESS_HELLO_SIZE, 0);
+    opener.join();
+}
+
+//
+// the peer end of a compressed stream, driven by the test with a blocking
+// socket.
+//
+static void CompressPeerSend(SOCKET peer, PLZ_ENCODER encoder, const std::vector<BYTE>& data)
+{
+    std::vector<BYTE> block(COMPRESS_HEADER_SIZE + LZ_BLOCK_SIZE);
+    ULONG length = LzCompress(encoder, data.data(), (ULONG)data.size(), block.data() + COMPRESS_HEADER_SIZE);
+    if (length == 0) {
+        memcpy(block.data() + COMPRESS_HEADER_SIZE, data.data(), data.size());
+        length = (ULONG)data.size();
+    }
+    CompressEncodeHeader((ULONG)data.size(), length, block.data());
+    send(peer, (const char*)block.data(), (int)(COMPRESS_HEADER_SIZE + length), 0);
+}
+
+static std::vector<BYTE> CompressPeerRecv(SOCKET peer, PLZ_DECODER decoder)
+{
+    BYTE header[COMPRESS_HEADER_SIZE];
+    ULONG length, blockLength;
+    if (recv(peer, (char*)header, sizeof(header), MSG_WAITALL) != (int)sizeof(header) ||
+        !CompressDecodeHeader(header, &length, &blockLength)) {
+        return {};
+    }
+    std::vector<BYTE> block(blockLength);
+    if (recv(peer, (char*)block.data(), (int)blockLength, MSG_WAITALL) != (int)blockLength) {
+        return {};
+    }
+    const BYTE* data = LzDecompress(decoder, block.data(), blockLength, length);
+    return data ? std::vector<BYTE>(data, data + length) : std::vector<BYTE>();
+}
+
+TEST(Compress, StreamBothWays) {
+    ASSERT_EQ(PlatformSocketStartup(), (UINT32)NO_ERROR);
+    HTS_VSP_REPORT stats = {};
+    BYTE hello[COMPRESS_HELLO_SIZE];
+    CompressEncodeHello(TRUE, hello);
+    SOCKET peer = INVALID_SOCKET;
+    PLATFORM_STREAM stream = NULL;
+    UINT32 error = MAXULONG;
+    CompressOpen(hello, &stats, &peer, &stream, &error);
+    ASSERT_EQ(error, (UINT32)NO_ERROR);
+    std::unique_ptr<LZ_ENCODER> encoder(new LZ_ENCODER);
+    std::unique_ptr<LZ_DECODER> decoder(new LZ_DECODER);
+    LzEncoderInitialize(encoder.get());
+    LzDecoderInitialize(decoder.get());
+
+    // each send is a block.
+    std::vector<BYTE> packet = LzTestData(600, 3);
+    for (int i = 0; i < 3; i++) {
+        EXPECT_EQ(PlatformStreamSend(stream, (const char*)packet.data(), (int)packet.size()), (int)packet.size());
+        EXPECT_EQ(CompressPeerRecv(peer, decoder.get()), packet);
+    }
+    EXPECT_EQ(stats.compressRawBytes, 3 * (INT64)packet.size());
+    EXPECT_LT(stats.compressWireBytes, stats.compressRawBytes);
+
+    //
+    // more than Rx holds, the stream thread waits for the reads while the
+    // peer sends.
+    //
+    std::vector<BYTE> sent;
+    for (ULONG n = 0; n < 40; n++) {
+        std::vector<BYTE> data = LzTestData(4096 + n, 100 + n);
+        sent.insert(sent.end(), data.begin(), data.end());
+    }
+    std::thread sender([&] {
+        for (size_t offset = 0; offset < sent.size(); ) {
+            size_t length = std::min(sent.size() - offset, (size_t)4096 + offset / 4096);
+            CompressPeerSend(peer, encoder.get(),
+                std::vector<BYTE>(sent.begin() + offset, sent.begin() + offset + length));
+            offset += length;
+        }
+        shutdown(peer, SD_BOTH);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::vector<BYTE> received;
+    std::vector<char> buffer(1000);
+    int result;
+    while ((result = MuxWaitRecv(stream, buffer.data(), (int)buffer.size())) > 0) {
+        received.insert(received.end(), buffer.begin(), buffer.begin() + result);
+    }
+    sender.join();
+    EXPECT_EQ(result, 0);
+    EXPECT_TRUE(received == sent);
+    EXPECT_EQ(stats.decompressRawBytes, (INT64)sent.size());
+
+    PlatformStreamClose(stream);
+    closesocket(peer);
+    PlatformSocketCleanup();
+}
+
+TEST(Compress, EchoOfTheHelloFails) {
+    ASSERT_EQ(PlatformSocketStartup(), (UINT32)NO_ERROR);
+    HTS_VSP_REPORT stats = {};
+    // what a plain echo peer answers.
+    BYTE echo[COMPRESS_HELLO_SIZE];
+    CompressEncodeHello(FALSE, echo);
+    SOCKET peer = INVALID_SOCKET;
+    PLATFORM_STREAM stream = NULL;
+    UINT32 error = NO_ERROR;
+    CompressOpen(echo, &stats, &peer, &stream, &error);
+    EXPECT_NE(error, (UINT32)NO_ERROR);
+    EXPECT_EQ(stream, nullptr);
+    closesocket(peer);
+    PlatformSocketCleanup();
+}
+
+//
+// moves the datagrams From has to send at NowUs to To. Drop, if given,
+// loses the datagrams it returns true for, counted from 0 across calls.
+//
+static ULONG RudpDeliver(PRUDP_CONNECTION From, PRUDP_CONNECTION To, ULONGLONG NowUs,
+    const std::function<bool(ULONG)>& Drop = nullptr, ULONG* Sent = nullptr)
+{
+    BYTE datagram[RUDP_MAX_DATAGRAM];
+    ULONG delivered = 0;
+    ULONG length;
+    while ((length = RudpOutput(From, NowUs, datagram)) != 0) {
+        ULONG index = Sent ? (*Sent)++ : 0;
+        if (Drop && Drop(index)) {
+            continue;
+        }
+        RudpInput(To, datagram, length, NowUs);
+        delivered++;
+    }
+    return delivered;
+}
+
+static void RudpConnect(PRUDP_CONNECTION Client, PRUDP_CONNECTION Peer)
+{
+    RudpInitialize(Client, FALSE, 0);
+    RudpInitialize(Peer, TRUE, 0);
+    RudpDeliver(Client, Peer, 100);
+    RudpDeliver(Peer, Client, 200);
+    ASSERT_EQ(Client->State, (ULONG)RudpEstablished);
+    ASSERT_EQ(Peer->State, (ULONG)RudpEstablished);
+}
+
+static std::vector<BYTE> RudpReadAll(PRUDP_CONNECTION Connection)
+{
+    std::vector<BYTE> data(RUDP_WINDOW * RUDP_MAX_PAYLOAD);
+    data.resize(RudpRead(Connection, data.data(), (ULONG)data.size()));
+    return data;
+}
+
+TEST(Rudp, HandshakeAndDeliveryInOrder) {
+    std::unique_ptr<RUDP_CONNECTION> client(new RUDP_CONNECTION);
+    std::unique_ptr<RUDP_CONNECTION> peer(new RUDP_CONNECTION);
+    RudpConnect(client.get(), peer.get());
+    // the syn timed the round trip.
+    EXPECT_EQ(client->SrttUs, 100u);
+
+    std::vector<BYTE> data = LzTestData(5000, 4);
+    EXPECT_EQ(RudpWrite(client.get(), data.data(), (ULONG)data.size()), (ULONG)data.size());
+    EXPECT_EQ(RudpDeliver(client.get(), peer.get(), 300), 5u);
+    EXPECT_EQ(RudpReadAll(peer.get()), data);
+    EXPECT_EQ(RudpDeliver(peer.get(), client.get(), 400), 1u);
+    EXPECT_EQ(client->SendBase, client->SendTail);
+    EXPECT_EQ(client->Counters.Retransmits, 0);
+
+    // a write that fits joins the packet still waiting.
+    EXPECT_EQ(RudpWrite(client.get(), (const BYTE*)"ab", 2), 2u);
+    EXPECT_EQ(RudpWrite(client.get(), (const BYTE*)"cd", 2), 2u);
+    EXPECT_EQ(RudpDeliver(client.get(), peer.get(), 500), 1u);
+    std::vector<BYTE> expected = { 'a', 'b', 'c', 'd' };
+    EXPECT_EQ(RudpReadAll(peer.get()), expected);
+}
+
+TEST(Rudp, SelectiveAcksRetransmitBeforeTheTimeout) {
+    std::unique_ptr<RUDP_CONNECTION> client(new RUDP_CONNECTION);
+    std::unique_ptr<RUDP_CONNECTION> peer(new RUDP_CONNECTION);
+    RudpConnect(client.get(), peer.get());
+
+    // the second of eight packets is lost.
+    std::vector<BYTE> data = LzTestData(8 * RUDP_MAX_PAYLOAD, 5);
+    EXPECT_EQ(RudpWrite(client.get(), data.data(), (ULONG)data.size()), (ULONG)data.size());
+    ULONG sent = 0;
+    EXPECT_EQ(RudpDeliver(client.get(), peer.get(), 300, [](ULONG index) { return index == 1; }, &sent), 7u);
+    EXPECT_EQ(RudpReadAll(peer.get()).size(), (size_t)RUDP_MAX_PAYLOAD);
+
+    // the ack of the peer names the six after it.
+    EXPECT_EQ(RudpDeliver(peer.get(), client.get(), 400), 1u);
+    EXPECT_EQ(client->Counters.FastRetransmits, 1);
+    EXPECT_EQ(RudpDeliver(client.get(), peer.get(), 400), 1u);
+    std::vector<BYTE> rest = RudpReadAll(peer.get());
+    EXPECT_TRUE(std::equal(rest.begin(), rest.end(), data.begin() + RUDP_MAX_PAYLOAD));
+    EXPECT_EQ(rest.size(), data.size() - RUDP_MAX_PAYLOAD);
+    EXPECT_EQ(RudpDeliver(peer.get(), client.get(), 500), 1u);
+    EXPECT_EQ(client->SendBase, client->SendTail);
+    EXPECT_EQ(client->Counters.Timeouts, 0);
+}
+
+TEST(Rudp, TheTimeoutRetransmitsALonePacket) {
+    std::unique_ptr<RUDP_CONNECTION> client(new RUDP_CONNECTION);
+    std::unique_ptr<RUDP_CONNECTION> peer(new RUDP_CONNECTION);
+    RudpConnect(client.get(), peer.get());
+
+    // nothing behind the packet to ack, only the timer finds it lost.
+    EXPECT_EQ(RudpWrite(client.get(), (const BYTE*)"g", 1), 1u);
+    EXPECT_EQ(RudpDeliver(client.get(), peer.get(), 300, [](ULONG) { return true; }), 0u);
+    ULONGLONG dueUs = RudpNextUs(client.get());
+    EXPECT_EQ(dueUs, 300 + client->RtoUs);
+    EXPECT_EQ(RudpDeliver(client.get(), peer.get(), dueUs - 1), 0u);
+    EXPECT_EQ(RudpDeliver(client.get(), peer.get(), dueUs), 1u);
+    EXPECT_EQ(client->Counters.Timeouts, 1);
+    EXPECT_EQ(client->Counters.Retransmits, 1);
+    std::vector<BYTE> expected = { 'g' };
+    EXPECT_EQ(RudpReadAll(peer.get()), expected);
+
+    // the timeout backed off, the ack of the retransmission is not timed.
+    ULONG rtoUs = client->RtoUs;
+    EXPECT_EQ(RudpDeliver(peer.get(), client.get(), dueUs + 100), 1u);
+    EXPECT_EQ(client->RtoUs, rtoUs);
+    EXPECT_EQ(client->SendBase, client->SendTail);
+}
+
+//
+// delivers both ways, the clock moving on for the pacing, until neither
+// side has anything to send. Returns the data packets the client sent.
+//
+static ULONG RudpExchange(PRUDP_CONNECTION Client, PRUDP_CONNECTION Peer, ULONGLONG* NowUs)
+{
+    ULONG sent = Client->SendNext;
+    for (int round = 0; round < 1000; round++) {
+        *NowUs += 100;
+        if (RudpDeliver(Client, Peer, *NowUs) + RudpDeliver(Peer, Client, *NowUs) == 0) {
+            break;
+        }
+    }
+    return Client->SendNext - sent;
+}
+
+TEST(Rudp, TheWindowStopsTheSenderUntilTheReaderReads) {
+    std::unique_ptr<RUDP_CONNECTION> client(new RUDP_CONNECTION);
+    std::unique_ptr<RUDP_CONNECTION> peer(new RUDP_CONNECTION);
+    RudpConnect(client.get(), peer.get());
+    ULONGLONG nowUs = 200;
+
+    std::vector<BYTE> data = LzTestData(3 * RUDP_WINDOW * RUDP_MAX_PAYLOAD, 6);
+    ULONG written = RudpWrite(client.get(), data.data(), (ULONG)data.size());
+    EXPECT_EQ(written, (ULONG)(RUDP_WINDOW * RUDP_MAX_PAYLOAD));
+    EXPECT_FALSE(RudpWritable(client.get()));
+    EXPECT_EQ(RudpExchange(client.get(), peer.get(), &nowUs), (ULONG)RUDP_WINDOW);
+
+    // all acked, but the peer holds all of them and takes no more.
+    EXPECT_EQ(client->SendBase, client->SendTail);
+    written += RudpWrite(client.get(), data.data() + written, (ULONG)data.size() - written);
+    EXPECT_EQ(RudpExchange(client.get(), peer.get(), &nowUs), 0u);
+
+    // reading opens the window and the peer says so at once.
+    std::vector<BYTE> received = RudpReadAll(peer.get());
+    EXPECT_TRUE(peer->AckPending);
+    while (received.size() < written) {
+        ASSERT_GT(RudpExchange(client.get(), peer.get(), &nowUs), 0u);
+        std::vector<BYTE> more = RudpReadAll(peer.get());
+        received.insert(received.end(), more.begin(), more.end());
+    }
+    EXPECT_TRUE(std::equal(received.begin(), received.end(), data.begin()));
+    EXPECT_EQ(client->Counters.Retransmits, 0);
+}
+
+TEST(Rudp, CloseAndReset) {
+    std::unique_ptr<RUDP_CONNECTION> client(new RUDP_CONNECTION);
+    std::unique_ptr<RUDP_CONNECTION> peer(new RUDP_CONNECTION);
+    RudpConnect(client.get(), peer.get());
+    RudpClose(client.get());
+    EXPECT_EQ(RudpDeliver(client.get(), peer.get(), 300), 1u);
+    EXPECT_EQ(peer->State, (ULONG)RudpClosed);
+    EXPECT_EQ(peer->Error, (UINT32)NO_ERROR);
+
+    BYTE reset[RUDP_HEADER_SIZE];
+    RudpInitialize(client.get(), FALSE, 0);
+    EXPECT_NE(RudpInput(client.get(), reset, RudpEncodeReset(reset), 100), (UINT32)NO_ERROR);
+    EXPECT_EQ(client->State, (ULONG)RudpClosed);
+    EXPECT_EQ(RudpNextUs(client.get()), RUDP_NEVER);
+}
+
+//
+// the peer end of a udp stream: echoes what it reads, or answers everything
+// with a reset.
+//
+struct UdpTestPeer {
+    SOCKET Socket = INVALID_SOCKET;
+    USHORT Port = 0;
+    BOOL Reset = FALSE;
+    std::atomic<bool> Stop{ false };
+    std::unique_ptr<RUDP_CONNECTION> Connection{ new RUDP_CONNECTION };
+
+    void Run()
+    {
+        BYTE datagram[RUDP_MAX_DATAGRAM];
+        BYTE data[RUDP_MAX_PAYLOAD];
+        sockaddr_in client = {};
+        socklen_t clientLength = sizeof(client);
+        RudpInitialize(Connection.get(), TRUE, PlatformTimeUs());
+        PPLATFORM_WAITER waiter = NULL;
+        PlatformWaiterCreate(&waiter);
+        PlatformWaiterAddSocket(waiter, Socket, PLATFORM_SOCKET_READ);
+        while (!Stop) {
+            PlatformWait(waiter, 1);
+            int received;
+            while ((received = recvfrom(Socket, (char*)datagram, sizeof(datagram), 0,
+                (sockaddr*)&client, &clientLength)) > 0) {
+                if (Reset) {
+                    sendto(Socket, (const char*)datagram, (int)RudpEncodeReset(datagram), 0,
+                        (sockaddr*)&client, clientLength);
+                    continue;
+                }
+                RudpInput(Connection.get(), datagram, received, PlatformTimeUs());
+            }
+            ULONG length;
+            while (RudpWritable(Connection.get()) &&
+                (length = RudpRead(Connection.get(), data, sizeof(data))) != 0) {
+                EXPECT_EQ(RudpWrite(Connection.get(), data, length), length);
+            }
+            while ((length = RudpOutput(Connection.get(), PlatformTimeUs(), datagram)) != 0) {
+                sendto(Socket, (const char*)datagram, (int)length, 0, (sockaddr*)&client, clientLength);
+            }
+        }
+        PlatformWaiterClose(waiter);
+    }
+
+    void Start()
+    {
+        Socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        ASSERT_EQ(bind(Socket, (sockaddr*)&address, sizeof(address)), 0);
+        ASSERT_EQ(getsockname(Socket, (sockaddr*)&address, &length), 0);
+        ASSERT_EQ(PlatformSocketSetNonBlocking(Socket), (UINT32)NO_ERROR);
+        Port = ntohs(address.sin_port);
+    }
+};
+
+TEST(Udp, StreamEchoesThroughThePeer) {
+    ASSERT_EQ(PlatformSocketStartup(), (UINT32)NO_ERROR);
+    UdpTestPeer peer;
+    peer.Start();
+    std::thread peerThread([&] { peer.Run(); });
+
+    HTS_VSP_REPORT stats = {};
+    PLATFORM_STREAM stream = NULL;
+    ASSERT_EQ(UdpStreamOpen("127.0.0.1", peer.Port, 2000, &stats, &stream), (UINT32)NO_ERROR);
+    PPLATFORM_WAITER waiter = NULL;
+    ASSERT_EQ(PlatformWaiterCreate(&waiter), (UINT32)NO_ERROR);
+    ASSERT_EQ(PlatformWaiterAddStream(waiter, stream), (UINT32)NO_ERROR);
+
+    // more than the window, the sends wait for room.
+    std::vector<BYTE> data = LzTestData(200 * 1024, 7);
+    std::thread sender([&] {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            int result = PlatformStreamSend(stream, (const char*)data.data() + sent, (int)(data.size() - sent));
+            if (result > 0) {
+                sent += result;
+            }
+            else {
+                ASSERT_TRUE(PlatformSocketWouldBlock(PlatformSocketLastError()));
+                ASSERT_EQ(PlatformStreamWaitWritable(stream, 2000), (UINT32)NO_ERROR);
+            }
+        }
+    });
+    std::vector<BYTE> received;
+    std::vector<char> buffer(16 * 1024);
+    while (received.size() < data.size()) {
+        int result = PlatformStreamRecv(stream, buffer.data(), (int)buffer.size());
+        if (result > 0) {
+            received.insert(received.end(), buffer.begin(), buffer.begin() + result);
+            continue;
+        }
+        ASSERT_TRUE(result < 0 && PlatformSocketWouldBlock(PlatformSocketLastError()));
+        ASSERT_EQ(PlatformWait(waiter, 2000), 0u);
+    }
+    sender.join();
+    EXPECT_EQ(received, data);
+    EXPECT_GT(stats.udpDatagramsSent, 0);
+    EXPECT_GT(stats.udpSrttUs, 0u);
+
+    // closing sends the fin.
+    PlatformWaiterClose(waiter);
+    PlatformStreamClose(stream);
+    for (int i = 0; i < 200 && peer.Connection->State != RudpClosed; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    peer.Stop = true;
+    peerThread.join();
+    EXPECT_EQ(peer.Connection->State, (ULONG)RudpClosed);
+    closesocket(peer.Socket);
+    PlatformSocketCleanup();
+}
+
+TEST(Udp, APeerWithoutTheConnectionResetsIt) {
+    ASSERT_EQ(PlatformSocketStartup(), (UINT32)NO_ERROR);
+    UdpTestPeer peer;
+    peer.Reset = TRUE;
+    peer.Start();
+    std::thread peerThread([&] { peer.Run(); });
+
+    HTS_VSP_REPORT stats = {};
+    PLATFORM_STREAM stream = NULL;
+    ULONGLONG startUs = PlatformTimeUs();
+    EXPECT_NE(UdpStreamOpen("127.0.0.1", peer.Port, 2000, &stats, &stream), (UINT32)NO_ERROR);
+    EXPECT_LT(PlatformTimeUs() - startUs, 1000000u);
+    EXPECT_EQ(stream, nullptr);
+    peer.Stop = true;
+    peerThread.join();
+    closesocket(peer.Socket);
+    PlatformSocketCleanup();
+}
+
+struct CapturedRecord {
+    ULONG Segment;
+    ULONG Offset;
+    USHORT Direction;
+    ULONGLONG TimeUs;
+    std::vector<BYTE> Data;
+};
+
+//
+// the records of the segments of the log at path, in order, and removes the files.
+//
+static std::vector<CapturedRecord> CaptureReadAll(const std::string& path, ULONG* segments)
+{
+    std::vector<CapturedRecord> records;
+    for (*segments = 0;; (*segments)++) {
+        std::string name = path + "." + std::to_string(*segments);
+        ULONGLONG size = 0;
+        PVOID view;
+        if (PlatformFileMap(name.c_str(), FALSE, &size, &view) != NO_ERROR) {
+            break;
+        }
+        const CAPTURE_SEGMENT_HEADER* header = CaptureSegmentHeader((const BYTE*)view, size);
+        EXPECT_NE(header, nullptr);
+        ULONG offset = 0;
+        const CAPTURE_RECORD* record;
+        while (header && (record = CaptureRecordAt(header, offset)) != nullptr) {
+            if (record->Direction != CAPTURE_PAD) {
+                const BYTE* data = CaptureRecordData(record);
+                records.push_back({ *segments, offset, record->Direction, record->TimeUs,
+                    std::vector<BYTE>(data, data + CaptureRecordLength(record)) });
+            }
+            offset += record->Size;
+        }
+        PlatformFileUnmap(view, size);
+        RemoveLocalName(name);
+    }
+    return records;
+}
+
+TEST_F(EngineTest, CaptureRecordsBothDirections) {
+    CAPTURE_LOG log;
+    ASSERT_EQ(CaptureInitialize(&log, &Stats), (UINT32)NO_ERROR);
+    std::string path = LocalName("capture");
+    ASSERT_EQ(CaptureStart(&log, path.c_str(), 0), (UINT32)NO_ERROR);
+    Engine->Capture = &log;
+
+    PeerSend("in", 2);
+    ULONG received;
+    ASSERT_EQ(WaitAndReceive(&received), EngineReceiveData);
+    EXPECT_EQ(EngineWrite(Engine, "out", 3), (UINT32)NO_ERROR);
+    CaptureStop(&log);
+    // stopped, nothing more is recorded.
+    EXPECT_EQ(EngineWrite(Engine, "late", 4), (UINT32)NO_ERROR);
+    Engine->Capture = NULL;
+    CaptureCleanup(&log);
+
+    EXPECT_EQ(Stats.captureRecords, 2);
+    EXPECT_EQ(Stats.captureBytes, 5);
+    EXPECT_EQ(Stats.captureDroppedRecords, 0);
+    EXPECT_EQ(Stats.captureSegments, 2u);
+    ULONG segments;
+    std::vector<CapturedRecord> records = CaptureReadAll(path, &segments);
+    EXPECT_EQ(segments, 2u);
+    ASSERT_EQ(records.size(), 2u);
+    EXPECT_EQ(records[0].Direction, CAPTURE_RECEIVED);
+    EXPECT_EQ(std::string(records[0].Data.begin(), records[0].Data.end()), "in");
+    EXPECT_EQ(records[1].Direction, CAPTURE_WRITTEN);
+    EXPECT_EQ(std::string(records[1].Data.begin(), records[1].Data.end()), "out");
+    EXPECT_LE(records[0].TimeUs, records[1].TimeUs);
+}
+
+TEST(Capture, SegmentsRollOverAndTheIndexSeeks) {
+    HTS_VSP_REPORT stats = {};
+    CAPTURE_LOG log;
+    ASSERT_EQ(CaptureInitialize(&log, &stats), (UINT32)NO_ERROR);
+    std::string path = LocalName("capture");
+    ASSERT_EQ(CaptureStart(&log, path.c_str(), CAPTURE_MIN_SEGMENT), (UINT32)NO_ERROR);
+
+    // about five segments of records, each numbered, slow enough for the capture thread.
+    const ULONG count = 300;
+    std::vector<BYTE> data(1000);
+    for (ULONG n = 0; n < count; n++) {
+        memcpy(data.data(), &n, sizeof(n));
+        CaptureRecord(&log, (n % 2) ? CAPTURE_WRITTEN : CAPTURE_RECEIVED, data.data(), (ULONG)data.size() - n % 8);
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    // longer than a segment holds.
+    std::vector<BYTE> large(CAPTURE_MIN_SEGMENT);
+    CaptureRecord(&log, CAPTURE_WRITTEN, large.data(), (ULONG)large.size());
+    CaptureCleanup(&log);
+    EXPECT_EQ(stats.captureRecords, (INT64)count);
+    EXPECT_EQ(stats.captureDroppedRecords, 1);
+
+    // keep the first segment mapped to seek in it.
+    std::string first = path + ".0";
+    ULONGLONG size = 0;
+    PVOID view;
+    ASSERT_EQ(PlatformFileMap(first.c_str(), FALSE, &size, &view), (UINT32)NO_ERROR);
+    ULONG segments;
+    std::vector<CapturedRecord> records = CaptureReadAll(path, &segments);
+    EXPECT_GE(segments, 5u);
+    EXPECT_EQ(stats.captureSegments, segments);
+    ASSERT_EQ(records.size(), (size_t)count);
+    for (ULONG n = 0; n < count; n++) {
+        ULONG number;
+        memcpy(&number, records[n].Data.data(), sizeof(number));
+        EXPECT_EQ(number, n);
+        EXPECT_EQ(records[n].Data.size(), data.size() - n % 8);
+        EXPECT_EQ(records[n].Direction, (n % 2) ? CAPTURE_WRITTEN : CAPTURE_RECEIVED);
+    }
+
+    // the index finds a record of the first segment at most an interval early.
+    const CAPTURE_SEGMENT_HEADER* header = CaptureSegmentHeader((const BYTE*)view, size);
+    ASSERT_NE(header, nullptr);
+    EXPECT_LE(header->StartUs, records[0].TimeUs);
+    const CapturedRecord* target = nullptr;
+    for (const CapturedRecord& record : records) {
+        if (record.Segment == 0 && record.Offset >= 2 * CAPTURE_INDEX_INTERVAL) {
+            target = &record;
+            break;
+        }
+    }
+    ASSERT_NE(target, nullptr);
+    ULONG offset = CaptureSeek(header, target->TimeUs);
+    EXPECT_LE(offset, target->Offset);
+    EXPECT_GE(offset + 2 * CAPTURE_INDEX_INTERVAL, target->Offset);
+    EXPECT_EQ(CaptureSeek(header, 0), 0u);
+    PlatformFileUnmap(view, size);
+}
+
+TEST(Capture, ConcurrentWritersKeepTheirOrder) {
+    HTS_VSP_REPORT stats = {};
+    CAPTURE_LOG log;
+    ASSERT_EQ(CaptureInitialize(&log, &stats), (UINT32)NO_ERROR);
+    std::string path = LocalName("capture");
+    ASSERT_EQ(CaptureStart(&log, path.c_str(), 256 * 1024), (UINT32)NO_ERROR);
+
+    const ULONG writers = 4;
+    const ULONG count = 5000;
+    std::vector<std::thread> threads;
+    for (ULONG w = 0; w < writers; w++) {
+        threads.emplace_back([&log, w] {
+            BYTE data[64] = {};
+            for (ULONG n = 0; n < count; n++) {
+                memcpy(data, &w, sizeof(w));
+                memcpy(data + sizeof(w), &n, sizeof(n));
+                CaptureRecord(&log, CAPTURE_WRITTEN, data, 8 + n % 56);
+                if (n % 64 == 0) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    CaptureCleanup(&log);
+    EXPECT_EQ(stats.captureRecords + stats.captureDroppedRecords, (INT64)(writers * count));
+
+    // what a writer captured is there, whole and in its order.
+    ULONG segments;
+    std::vector<CapturedRecord> records = CaptureReadAll(path, &segments);
+    EXPECT_EQ(records.size(), (size_t)stats.captureRecords);
+    std::vector<LONG> last(writers, -1);
+    for (const CapturedRecord& record : records) {
+        ULONG w;
+        ULONG n;
+        memcpy(&w, record.Data.data(), sizeof(w));
+        memcpy(&n, record.Data.data() + sizeof(w), sizeof(n));
+        ASSERT_LT(w, writers);
+        EXPECT_GT((LONG)n, last[w]);
+        EXPECT_EQ(record.Data.size(), 8 + n % 56);
+        last[w] = (LONG)n;
+    }
+}
+
+static UINT32 EchoThread(PVOID Context)
+{
+    SOCKET peer = *(SOCKET*)Context;
+    char buffer[64];
+    for (;;) {
+        int received = recv(peer, buffer, sizeof(buffer), 0);
+        if (received <= 0 || send(peer, buffer, received, 0) != received) {
+            return 0;
+        }
+    }
+}
+
+//
+// 16 byte round trips through an echo thread with and without spinning, run
+// with --gtest_also_run_disabled_tests. Spinning only pays with a spare cpu
+// for the echo thread.
+//
+TEST_F(EngineTest, DISABLED_SpinRoundTrip) {
+    const int roundTrips = 20000;
+    char message[16] = {};
+    PLATFORM_THREAD thread;
+    ASSERT_EQ(PlatformThreadCreate(EchoThread, &Peer, &thread), (UINT32)NO_ERROR);
+
+    for (ULONG spinUs : { 0u, 50u, (ULONG)ENGINE_SPIN_MAX_US }) {
+        EngineSetSpin(Engine, spinUs);
+        Stats = {};
+        auto start = std::chrono::steady_clock::now();
+        for (int n = 0; n < roundTrips; n++) {
+            ASSERT_EQ(EngineSend(Engine, message, sizeof(message)), (UINT32)NO_ERROR);
+            size_t echoed = 0;
+            while (echoed < sizeof(message)) {
+                ASSERT_EQ(EngineWait(Engine, Waiter, 2000, 1), 0u);
+                ULONG received;
+                EngineReceive(Engine, &received);
+                echoed += received;
+            }
+            RingBufferInitialize(&Engine->ReceiveRing, Engine->ReceiveBuffer, sizeof(Engine->ReceiveBuffer));
+        }
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        printf("spin %4u us: %.2f us/rtt, spin %.2f us/rtt, hits %.0f%%, budget %u us\n",
+            spinUs, us / roundTrips, (double)Stats.spinUs / roundTrips,
+            Stats.spinWaits ? 100.0 * Stats.spinHits / Stats.spinWaits : 0.0,
+            Stats.spinBudgetUs);
+    }
+    shutdown(Engine->Socket, SD_BOTH);
+    EXPECT_TRUE(PlatformThreadJoin(thread, 2000));
+}
+
+//
+// the port side of the priority bench, a pool work that echoes what the
+// engine receives, like a port loop serves a read.
+//
+struct PoolEchoPort {
+    PNET_ENGINE Engine;
+    PPLATFORM_WAITER* Waiter;
+    std::atomic<int> Priority{ PlatformPriorityNormal };
+
+    static POOL_WORK_STATUS Run(PVOID Context, BOOL, PPLATFORM_WAITER* Waiter, ULONG* TimeoutMs)
+    {
+        PoolEchoPort* port = (PoolEchoPort*)Context;
+        PoolWorkSchedule((PLATFORM_PRIORITY)port->Priority.load(), 0);
+        ULONG received;
+        ENGINE_RECEIVE_STATUS status;
+        while ((status = EngineReceive(port->Engine, &received)) == EngineReceiveData) {
+            BYTE buffer[256];
+            size_t read;
+            RingBufferRead(&port->Engine->ReceiveRing, buffer, sizeof(buffer), &read);
+            EngineSend(port->Engine, (const char*)buffer, (int)read);
+        }
+        if (status != EngineReceiveIdle) {
+            PlatformWaiterClose(*port->Waiter);
+            *port->Waiter = nullptr;
+            return PoolWorkDone;
+        }
+        *Waiter = *port->Waiter;
+        *TimeoutMs = INFINITE;
+        return PoolWorkWait;
+    }
+};
+
+//
+// 16 byte round trips through a port on the worker pool while a spinning
+// thread per cpu competes for the cpus, with the port at each priority. Run
+// with --gtest_also_run_disabled_tests, as root so that the high priority
+// may be taken. The bench thread, the peer of the port, runs at high priority
+// throughout so that only the port side changes.
+//
+TEST_F(EngineTest, DISABLED_PoolPriorityUnderLoad) {
+    const int roundTrips = 5000;
+    char message[16] = {};
+    ASSERT_EQ(PoolStartup(0), (UINT32)NO_ERROR);
+    PoolEchoPort port;
+    port.Engine = Engine;
+    port.Waiter = &Waiter;
+    PPOOL_WORK work;
+    ASSERT_EQ(PoolWorkStart(PoolEchoPort::Run, &port, &work), (UINT32)NO_ERROR);
+    if (PlatformThreadSetPriority(PlatformPriorityHigh) != NO_ERROR) {
+        printf("the bench thread cannot take a high priority, the port cannot either\n");
+    }
+
+    std::atomic<bool> stop{ false };
+    std::vector<std::thread> load;
+    for (ULONG cpu = 0; cpu < PlatformCpuCount(); cpu++) {
+        load.emplace_back([&stop] {
+            while (!stop) {
+                PlatformSpinPause();
+            }
+        });
+    }
+
+    const char* names[] = { "normal", "high", "low" };
+    for (PLATFORM_PRIORITY priority : { PlatformPriorityNormal, PlatformPriorityHigh, PlatformPriorityLow }) {
+        port.Priority = priority;
+        std::vector<double> samples;
+        for (int n = 0; n < roundTrips + 100; n++) {
+            auto start = std::chrono::steady_clock::now();
+            ASSERT_EQ(send(Peer, message, sizeof(message), 0), (int)sizeof(message));
+            size_t echoed = 0;
+            while (echoed < sizeof(message)) {
+                char buffer[sizeof(message)];
+                int received = recv(Peer, buffer, (int)(sizeof(message) - echoed), 0);
+                ASSERT_GT(received, 0);
+                echoed += received;
+            }
+            if (n >= 100) {
+                // the first round trips run the port at its new priority.
+                samples.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+            }
+        }
+        std::sort(samples.begin(), samples.end());
+        auto at = [&samples](double share) { return samples[(size_t)(share * (samples.size() - 1))]; };
+        printf("%-6s port, %u spinning threads: p50 %8.1f us, p99 %8.1f us, p99.9 %8.1f us, max %8.1f us\n",
+            names[priority], PlatformCpuCount(), at(0.5), at(0.99), at(0.999), samples.back());
+    }
+
+    stop = true;
+    for (std::thread& thread : load) {
+        thread.join();
+    }
+    shutdown(Peer, SD_BOTH);
+    EXPECT_TRUE(PoolWorkJoin(work, 2000));
+    POOL_STATS stats;
+    PoolGetStats(&stats);
+    EXPECT_EQ(stats.ScheduleErrors, 0);
+    PoolCleanup();
+    PlatformThreadSetPriority(PlatformPriorityNormal);
+}
+
+static UINT32 StreamEchoThread(PVOID Context)
+{
+    PLATFORM_STREAM stream = (PLATFORM_STREAM)Context;
+    PPLATFORM_WAITER waiter;
+    char buffer[64];
+    if (PlatformWaiterCreate(&waiter) != NO_ERROR) {
+        return 1;
+    }
+    PlatformWaiterAddStream(waiter, stream);
+    while (PlatformWait(waiter, 2000) == 0) {
+        int received = PlatformStreamRecv(stream, buffer, sizeof(buffer));
+        if (received == 0) {
+            break;
+        }
+        if (received > 0 && PlatformStreamSend(stream, buffer, received) != received) {
+            break;
+        }
+    }
+    PlatformWaiterClose(waiter);
+    return 0;
+}
+
+//
+// 16 byte round trips through the engine over each transport, run with
+// --gtest_also_run_disabled_tests.
+//
+TEST(Transport, DISABLED_RoundTrip) {
+    const int roundTrips = 20000;
+    char message[16] = {};
+    ASSERT_EQ(PlatformSocketStartup(), (UINT32)NO_ERROR);
+
+    for (const char* transport : { "tcp", "unix", "pipe", "shm" }) {
+        HTS_VSP_REPORT stats = {};
+        NET_ENGINE* engine = new NET_ENGINE;
+        EngineInitialize(engine, &stats);
+        SOCKET peer = INVALID_SOCKET;
+        PLATFORM_STREAM server = NULL;
+        PLATFORM_THREAD thread;
+        std::string name = LocalName(transport);
+
+        if (strcmp(transport, "tcp") == 0) {
+            SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t len = sizeof(addr);
+            ASSERT_EQ(bind(listener, (sockaddr*)&addr, sizeof(addr)), 0);
+            ASSERT_EQ(listen(listener, 1), 0);
+            ASSERT_EQ(getsockname(listener, (sockaddr*)&addr, &len), 0);
+            engine->Socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            ASSERT_EQ(connect(engine->Socket, (sockaddr*)&addr, sizeof(addr)), 0);
+            peer = accept(listener, NULL, NULL);
+            closesocket(listener);
+            int yes = 1;
+            setsockopt(engine->Socket, IPPROTO_TCP, TCP_NODELAY, (char*)&yes, sizeof(yes));
+            setsockopt(peer, IPPROTO_TCP, TCP_NODELAY, (char*)&yes, sizeof(yes));
+        }
+        else if (strcmp(transport, "unix") == 0) {
+            UnixConnect(name, &engine->Socket, &peer);
+        }
+        else if (strcmp(transport, "pipe") == 0) {
+            ASSERT_EQ(PlatformPipeCreate(name.c_str(), &server), (UINT32)NO_ERROR);
+            ASSERT_EQ(PlatformPipeConnect(name.c_str(), &engine->Stream), (UINT32)NO_ERROR);
+        }
+        else {
+            ASSERT_EQ(PlatformShmCreate(name.c_str(), 0, &server), (UINT32)NO_ERROR);
+            ShmConnect(name, server, &engine->Stream);
+        }
+        if (server) {
+            ASSERT_EQ(PlatformThreadCreate(StreamEchoThread, server, &thread), (UINT32)NO_ERROR);
+        }
+        else {
+            ASSERT_EQ(PlatformThreadCreate(EchoThread, &peer, &thread), (UINT32)NO_ERROR);
+        }
+        PPLATFORM_WAITER waiter;
+        ASSERT_EQ(PlatformWaiterCreate(&waiter), (UINT32)NO_ERROR);
+        ASSERT_EQ(EngineWaiterAdd(engine, waiter), (UINT32)NO_ERROR);
+
+        auto start = std::chrono::steady_clock::now();
+        for (int n = 0; n < roundTrips; n++) {
+            ASSERT_EQ(EngineSend(engine, message, sizeof(message)), (UINT32)NO_ERROR);
+            size_t echoed = 0;
+            while (echoed < sizeof(message)) {
+                ASSERT_EQ(EngineWait(engine, waiter, 2000, 1), 0u);
+                ULONG received;
+                EngineReceive(engine, &received);
+                echoed += received;
+            }
+            RingBufferInitialize(&engine->ReceiveRing, engine->ReceiveBuffer, sizeof(engine->ReceiveBuffer));
+        }
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        printf("%-5s %.2f us/rtt\n", transport, us / roundTrips);
+
+        PlatformWaiterClose(waiter);
+        EngineClose(engine);
+        EXPECT_TRUE(PlatformThreadJoin(thread, 5000));
+        if (peer != INVALID_SOCKET) {
+            closesocket(peer);
+        }
+        PlatformStreamClose(server);
+        RemoveLocalName(name);
+        delete engine;
+    }
+    PlatformSocketCleanup();
+}
+
+static UINT32 ShmSinkThread(PVOID Context)
+{
+    PLATFORM_STREAM stream = (PLATFORM_STREAM)Context;
+    PPLATFORM_WAITER waiter;
+    std::vector<char> buffer(256 * 1024);
+    if (PlatformWaiterCreate(&waiter) != NO_ERROR) {
+        return 1;
+    }
+    PlatformWaiterAddStream(waiter, stream);
+    while (PlatformWait(waiter, 2000) == 0) {
+        int received;
+        while ((received = PlatformStreamRecv(stream, buffer.data(), (int)buffer.size())) > 0) {
+        }
+        if (received == 0) {
+            break;
+        }
+    }
+    PlatformWaiterClose(waiter);
+    return 0;
+}
+
+//
+// polls for one byte without waiting. It only yields the cpu after a while,
+// for a machine without a cpu to spare.
+//
+static int ShmPollRecv(PLATFORM_STREAM stream, char* byte)
+{
+    for (int polls = 1; ; polls++) {
+        int received = PlatformStreamRecv(stream, byte, 1);
+        if (received >= 0) {
+            return received;
+        }
+        if (polls % 256 == 0) {
+            std::this_thread::yield();
+        }
+        PlatformSpinPause();
+    }
+}
+
+static UINT32 ShmPollEchoThread(PVOID Context)
+{
+    PLATFORM_STREAM stream = (PLATFORM_STREAM)Context;
+    char byte;
+    while (ShmPollRecv(stream, &byte) == 1 && PlatformStreamSend(stream, &byte, 1) == 1) {
+    }
+    return 0;
+}
+
+//
+// shared memory stream throughput into a sink thread, and the one way handoff
+// time of a polling ping pong, run with --gtest_also_run_disabled_tests. The
+// handoff needs a cpu for each side.
+//
+TEST(Shm, DISABLED_ThroughputAndHandoff) {
+    std::string name = LocalName("shm");
+    PLATFORM_STREAM server, client;
+    PLATFORM_THREAD thread;
+    ASSERT_EQ(PlatformShmCreate(name.c_str(), 0, &server), (UINT32)NO_ERROR);
+    ShmConnect(name, server, &client);
+
+    const size_t total = (size_t)4 * 1024 * 1024 * 1024;
+    std::vector<char> chunk(64 * 1024, 'b');
+    ASSERT_EQ(PlatformThreadCreate(ShmSinkThread, server, &thread), (UINT32)NO_ERROR);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t sent = 0; sent < total; ) {
+        int result = PlatformStreamSend(client, chunk.data(), (int)chunk.size());
+        if (result > 0) {
+            sent += result;
+            continue;
+        }
+        ASSERT_TRUE(PlatformSocketWouldBlock(PlatformSocketLastError()));
+        ASSERT_EQ(PlatformStreamWaitWritable(client, 2000), (UINT32)NO_ERROR);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("throughput %.2f GB/s\n", total / seconds / (1024.0 * 1024 * 1024));
+    PlatformStreamClose(client);
+    EXPECT_TRUE(PlatformThreadJoin(thread, 5000));
+    PlatformStreamClose(server);
+
+    ASSERT_EQ(PlatformShmCreate(name.c_str(), 0, &server), (UINT32)NO_ERROR);
+    ShmConnect(name, server, &client);
+    ASSERT_EQ(PlatformThreadCreate(ShmPollEchoThread, server, &thread), (UINT32)NO_ERROR);
+    const int roundTrips = 20000;
+    char byte = 0;
+    start = std::chrono::steady_clock::now();
+    for (int n = 0; n < roundTrips; n++) {
+        ASSERT_EQ(PlatformStreamSend(client, &byte, 1), 1);
+        ASSERT_EQ(ShmPollRecv(client, &byte), 1);
+    }
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    printf("handoff %.3f us\n", us / roundTrips / 2);
+    PlatformStreamClose(client);
+    EXPECT_TRUE(PlatformThreadJoin(thread, 5000));
+    PlatformStreamClose(server);
+}
+
+//
+// receive throughput of the engine over loopback, run with
+// --gtest_also_run_disabled_tests.
+//
+TEST_F(EngineTest, DISABLED_ReceiveThroughput) {
+    const size_t total = 256 * 1024 * 1024;
+    std::vector<char> chunk(64 * 1024, 'b');
+    std::vector<UCHAR> buffer(4096);
+    SERIAL_TIMEOUTS timeouts = {};
+    timeouts.ReadIntervalTimeout = MAXULONG;
+    size_t sent = 0, read = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    while (read < total) {
+        if (sent < total) {
+            int result = send(Peer, chunk.data(), (int)chunk.size(), 0);
+            ASSERT_GT(result, 0);
+            sent += result;
+        }
+        ULONG received;
+        ENGINE_RECEIVE_STATUS status = WaitAndReceive(&received);
+        ASSERT_TRUE(status == EngineReceiveData || status == EngineReceiveIdle);
+        for (;;) {
+            ENGINE_READ request = { buffer.data(), (ULONG)buffer.size(), 0, 0 };
+            EngineStartRead(Engine, &request, &timeouts);
+            EngineProcessRead(Engine);
+            if (request.Information == 0) {
+                break;
+            }
+            read += request.Information;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%.1f MB/s\n", read / seconds / (1024 * 1024));
+}
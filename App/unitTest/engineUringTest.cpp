@@ -0,0 +1,367 @@
+//
+// the io_uring engine backend, linux only. See the README for the build line.
+//
+#include <gtest/gtest.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include "../../ComPort/engine_uring.h"
+
+//
+// a connected pair of loopback tcp sockets. Engine.Socket is one end, Peer the other.
+//
+class UringEngineTest : public ::testing::Test {
+protected:
+    HTS_VSP_REPORT Stats = {};
+    NET_ENGINE* Engine = nullptr;
+    SOCKET Peer = INVALID_SOCKET;
+    PURING_ENGINE Uring = nullptr;
+
+    void SetUp() override
+    {
+        Engine = new NET_ENGINE;
+        EngineInitialize(Engine, &Stats);
+        Connect(&Engine->Socket, &Peer);
+        UINT32 error = UringEngineCreate(Engine, 0, &Uring);
+        if (error == ENOSYS || error == EPERM || error == EINVAL) {
+            GTEST_SKIP() << "no usable io_uring: " << strerror(error);
+        }
+        ASSERT_EQ(error, (UINT32)NO_ERROR);
+    }
+
+    void TearDown() override
+    {
+        UringEngineClose(Uring);
+        if (Engine->Socket != INVALID_SOCKET) {
+            closesocket(Engine->Socket);
+        }
+        if (Peer != INVALID_SOCKET) {
+            closesocket(Peer);
+        }
+        delete Engine;
+    }
+
+public:
+    static void Connect(SOCKET* accepted, SOCKET* connected)
+    {
+        SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        ASSERT_NE(listener, INVALID_SOCKET);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        ASSERT_EQ(bind(listener, (sockaddr*)&addr, sizeof(addr)), 0);
+        ASSERT_EQ(listen(listener, 1), 0);
+        ASSERT_EQ(getsockname(listener, (sockaddr*)&addr, &len), 0);
+        *connected = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        ASSERT_EQ(connect(*connected, (sockaddr*)&addr, sizeof(addr)), 0);
+        *accepted = accept(listener, NULL, NULL);
+        ASSERT_NE(*accepted, INVALID_SOCKET);
+        closesocket(listener);
+        int one = 1;
+        setsockopt(*accepted, IPPROTO_TCP, TCP_NODELAY, (char*)&one, sizeof(one));
+        setsockopt(*connected, IPPROTO_TCP, TCP_NODELAY, (char*)&one, sizeof(one));
+    }
+};
+
+TEST_F(UringEngineTest, Os2ssReturnsFirstBytes) {
+    SERIAL_TIMEOUTS timeouts = {};
+    timeouts.ReadIntervalTimeout = MAXULONG;
+    timeouts.ReadTotalTimeoutMultiplier = MAXULONG;
+    timeouts.ReadTotalTimeoutConstant = 2000;
+    UCHAR buffer[64];
+    ENGINE_READ read = { buffer, sizeof(buffer), 0, 0 };
+
+    ASSERT_EQ(send(Peer, "hello", 5, 0), 5);
+    UringEngineStartRead(Uring, &read, &timeouts);
+    EXPECT_EQ(UringEngineWaitRead(Uring, 4), EngineReadSuccess);
+    EXPECT_EQ(read.Information, 5u);
+    EXPECT_EQ(memcmp(buffer, "hello", 5), 0);
+    EXPECT_EQ(Stats.bytesRead, 5);
+}
+
+TEST_F(UringEngineTest, TotalTimer) {
+    SERIAL_TIMEOUTS timeouts = {};
+    timeouts.ReadTotalTimeoutConstant = 50;
+    UCHAR buffer[16];
+    ENGINE_READ read = { buffer, sizeof(buffer), 0, 0 };
+
+    auto start = std::chrono::steady_clock::now();
+    UringEngineStartRead(Uring, &read, &timeouts);
+    EXPECT_EQ(UringEngineWaitRead(Uring, 4), EngineReadCancelled);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_EQ(read.Information, 0u);
+    EXPECT_GE(elapsed, std::chrono::milliseconds(45));
+    EXPECT_LT(elapsed, std::chrono::milliseconds(450));
+}
+
+TEST_F(UringEngineTest, IntervalTimer) {
+    SERIAL_TIMEOUTS timeouts = {};
+    timeouts.ReadIntervalTimeout = 30;
+    UCHAR buffer[16];
+    ENGINE_READ read = { buffer, sizeof(buffer), 0, 0 };
+
+    ASSERT_EQ(send(Peer, "ab", 2, 0), 2);
+    UringEngineStartRead(Uring, &read, &timeouts);
+    EXPECT_EQ(UringEngineWaitRead(Uring, 4), EngineReadCancelled);
+    EXPECT_EQ(read.Information, 2u);
+
+    // the timer of the last read does not end the next one.
+    ENGINE_READ next = { buffer, 2, 0, 0 };
+    UringEngineStartRead(Uring, &next, &timeouts);
+    ASSERT_EQ(send(Peer, "cd", 2, 0), 2);
+    EXPECT_EQ(UringEngineWaitRead(Uring, 4), EngineReadSuccess);
+    EXPECT_EQ(memcmp(buffer, "cd", 2), 0);
+}
+
+TEST_F(UringEngineTest, WaitUnits) {
+    SERIAL_TIMEOUTS timeouts = {};
+    UCHAR buffer[16];
+    ENGINE_READ read = { buffer, sizeof(buffer), 0, 0 };
+
+    UringEngineStartRead(Uring, &read, &timeouts);
+    EXPECT_EQ(UringEngineWaitRead(Uring, 1), EngineReadTimeout);
+}
+
+TEST_F(UringEngineTest, PeerCloseKeepsReceivedData) {
+    SERIAL_TIMEOUTS timeouts = {};
+    UCHAR buffer[16];
+    ENGINE_READ read = { buffer, 3, 0, 0 };
+
+    ASSERT_EQ(send(Peer, "xyz!", 4, 0), 4);
+    closesocket(Peer);
+    Peer = INVALID_SOCKET;
+    UringEngineStartRead(Uring, &read, &timeouts);
+    EXPECT_EQ(UringEngineWaitRead(Uring, 4), EngineReadSuccess);
+    ENGINE_READ last = { buffer, sizeof(buffer), 0, 0 };
+    UringEngineStartRead(Uring, &last, &timeouts);
+    EXPECT_EQ(UringEngineWaitRead(Uring, 4), EngineReadFailed);
+}
+
+//
+// more than the receive ring and the provided buffers hold, in order.
+//
+TEST_F(UringEngineTest, BulkBothWays) {
+    const size_t total = 1024 * 1024;
+    std::vector<UCHAR> data(total);
+    for (size_t i = 0; i < total; i++) {
+        data[i] = (UCHAR)(i * 7 + i / 251);
+    }
+
+    std::vector<UCHAR> echoed;
+    std::thread peer([&]() {
+        std::vector<char> chunk(8192);
+        size_t sent = 0;
+        while (echoed.size() < total) {
+            struct pollfd pfd = { Peer, (short)(POLLIN | (sent < total ? POLLOUT : 0)), 0 };
+            if (poll(&pfd, 1, 5000) <= 0) {
+                break;
+            }
+            if ((pfd.revents & POLLOUT) && (sent < total)) {
+                size_t length = std::min(total - sent, (size_t)3000);
+                int result = send(Peer, (const char*)&data[sent], (int)length, MSG_DONTWAIT);
+                if (result > 0) {
+                    sent += result;
+                }
+            }
+            if (pfd.revents & POLLIN) {
+                int result = recv(Peer, chunk.data(), (int)chunk.size(), MSG_DONTWAIT);
+                if (result == 0) {
+                    break;
+                }
+                if (result > 0) {
+                    echoed.insert(echoed.end(), chunk.begin(), chunk.begin() + result);
+                }
+            }
+        }
+    });
+
+    SERIAL_TIMEOUTS timeouts = {};
+    timeouts.ReadIntervalTimeout = MAXULONG;
+    timeouts.ReadTotalTimeoutMultiplier = MAXULONG;
+    timeouts.ReadTotalTimeoutConstant = 5000;
+    std::vector<UCHAR> received;
+    std::vector<UCHAR> buffer(1000);
+    while (received.size() < total) {
+        ENGINE_READ read = { buffer.data(), (ULONG)buffer.size(), 0, 0 };
+        UringEngineStartRead(Uring, &read, &timeouts);
+        ASSERT_EQ(UringEngineWaitRead(Uring, 4), EngineReadSuccess);
+        received.insert(received.end(), buffer.begin(), buffer.begin() + read.Information);
+        ASSERT_EQ(UringEngineSend(Uring, (const char*)buffer.data(), read.Information), (UINT32)NO_ERROR);
+    }
+    EXPECT_EQ(UringEngineFlush(Uring, 5000), (UINT32)NO_ERROR);
+    peer.join();
+    EXPECT_TRUE(received == data);
+    EXPECT_TRUE(echoed == data);
+    EXPECT_EQ(Stats.bytesWritten, (INT64)total);
+}
+
+//
+// epoll and io_uring round trips of kd sized messages and bulk receive, run
+// with --gtest_also_run_disabled_tests. The epoll system calls are counted
+// from the calls the engine makes: one epoll_wait, recv and send each.
+//
+struct BackendResult {
+    double roundTripUs;
+    double syscallsPerRoundTrip;
+    double megabytesPerSecond;
+};
+
+static const int kRoundTrips = 20000;
+static const int kMessageSize = 16;
+static const size_t kBulkBytes = 256 * 1024 * 1024;
+
+static void EchoPeer(SOCKET peer, int messages)
+{
+    char buffer[kMessageSize];
+    for (int i = 0; i < messages; i++) {
+        if (recv(peer, buffer, sizeof(buffer), MSG_WAITALL) != sizeof(buffer) ||
+            send(peer, buffer, sizeof(buffer), 0) != sizeof(buffer)) {
+            return;
+        }
+    }
+}
+
+static void SourcePeer(SOCKET peer, size_t total)
+{
+    std::vector<char> chunk(64 * 1024, 's');
+    for (size_t sent = 0; sent < total; ) {
+        int result = send(peer, chunk.data(), (int)std::min(chunk.size(), total - sent), 0);
+        if (result <= 0) {
+            return;
+        }
+        sent += result;
+    }
+}
+
+static BackendResult RunEpoll()
+{
+    BackendResult result = {};
+    HTS_VSP_REPORT stats = {};
+    NET_ENGINE* engine = new NET_ENGINE;
+    SOCKET peer;
+    PPLATFORM_WAITER waiter;
+    SERIAL_TIMEOUTS timeouts = {};
+    UCHAR buffer[64 * 1024];
+    ULONG received;
+    ULONGLONG waits = 0, sends = 0;
+
+    EngineInitialize(engine, &stats);
+    UringEngineTest::Connect(&engine->Socket, &peer);
+    PlatformWaiterCreate(&waiter);
+    PlatformWaiterAddSocket(waiter, engine->Socket, PLATFORM_SOCKET_READ);
+
+    std::thread echo(EchoPeer, peer, kRoundTrips);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kRoundTrips; i++) {
+        EngineSend(engine, (const char*)buffer, kMessageSize);
+        sends++;
+        ENGINE_READ read = { buffer, kMessageSize, 0, 0 };
+        EngineStartRead(engine, &read, &timeouts);
+        while (EngineProcessRead(engine) == EngineReadPending) {
+            PlatformWait(waiter, INFINITE);
+            waits++;
+            EngineReceive(engine, &received);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    echo.join();
+    result.roundTripUs = seconds * 1e6 / kRoundTrips;
+    result.syscallsPerRoundTrip = (double)(waits + stats.sockRecvData + sends) / kRoundTrips;
+
+    std::thread source(SourcePeer, peer, kBulkBytes);
+    timeouts.ReadIntervalTimeout = MAXULONG;
+    size_t total = 0;
+    start = std::chrono::steady_clock::now();
+    while (total < kBulkBytes) {
+        PlatformWait(waiter, INFINITE);
+        EngineReceive(engine, &received);
+        ENGINE_READ read = { buffer, sizeof(buffer), 0, 0 };
+        EngineStartRead(engine, &read, &timeouts);
+        EngineProcessRead(engine);
+        total += read.Information;
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    source.join();
+    result.megabytesPerSecond = total / seconds / (1024 * 1024);
+
+    PlatformWaiterClose(waiter);
+    closesocket(engine->Socket);
+    closesocket(peer);
+    delete engine;
+    return result;
+}
+
+static BackendResult RunUring(ULONG flags)
+{
+    BackendResult result = {};
+    HTS_VSP_REPORT stats = {};
+    NET_ENGINE* engine = new NET_ENGINE;
+    SOCKET peer;
+    PURING_ENGINE uring;
+    SERIAL_TIMEOUTS timeouts = {};
+    UCHAR buffer[64 * 1024];
+
+    EngineInitialize(engine, &stats);
+    UringEngineTest::Connect(&engine->Socket, &peer);
+    if (UringEngineCreate(engine, flags, &uring) != NO_ERROR) {
+        closesocket(engine->Socket);
+        closesocket(peer);
+        delete engine;
+        return result;
+    }
+
+    std::thread echo(EchoPeer, peer, kRoundTrips);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kRoundTrips; i++) {
+        UringEngineSend(uring, (const char*)buffer, kMessageSize);
+        ENGINE_READ read = { buffer, kMessageSize, 0, 0 };
+        UringEngineStartRead(uring, &read, &timeouts);
+        UringEngineWaitRead(uring, MAXULONG);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    echo.join();
+    result.roundTripUs = seconds * 1e6 / kRoundTrips;
+    result.syscallsPerRoundTrip = (double)UringEngineEnterCount(uring) / kRoundTrips;
+
+    std::thread source(SourcePeer, peer, kBulkBytes);
+    timeouts.ReadIntervalTimeout = MAXULONG;
+    timeouts.ReadTotalTimeoutMultiplier = MAXULONG;
+    timeouts.ReadTotalTimeoutConstant = 5000;
+    size_t total = 0;
+    start = std::chrono::steady_clock::now();
+    while (total < kBulkBytes) {
+        ENGINE_READ read = { buffer, sizeof(buffer), 0, 0 };
+        UringEngineStartRead(uring, &read, &timeouts);
+        if (UringEngineWaitRead(uring, MAXULONG) != EngineReadSuccess) {
+            break;
+        }
+        total += read.Information;
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    source.join();
+    result.megabytesPerSecond = total / seconds / (1024 * 1024);
+
+    UringEngineClose(uring);
+    closesocket(engine->Socket);
+    closesocket(peer);
+    delete engine;
+    return result;
+}
+
+TEST(UringEngineBenchmark, DISABLED_EpollVersusUring) {
+    struct {
+        const char* name;
+        BackendResult result;
+    } runs[] = {
+        { "epoll", RunEpoll() },
+        { "io_uring", RunUring(0) },
+        { "io_uring sqpoll", RunUring(URING_ENGINE_SQPOLL) },
+    };
+    printf("%-16s %12s %16s %10s\n", "backend", "rtt us", "syscalls/rtt", "MB/s");
+    for (auto& run : runs) {
+        printf("%-16s %12.2f %16.2f %10.1f\n", run.name, run.result.roundTripUs,
+            run.result.syscallsPerRoundTrip, run.result.megabytesPerSecond);
+    }
+}
@@ -0,0 +1,488 @@
+#include "Benchmark.h"
+#include "KdProtocol.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include "Logger.h"
+
+extern Logger logger;
+
+using std::chrono::steady_clock;
+
+namespace {
+    const size_t BULK_MESSAGE_SIZE = 64 * 1024;
+    const size_t READ_BUFFER_SIZE = 64 * 1024;
+
+    double micros(steady_clock::duration duration)
+    {
+        return std::chrono::duration<double, std::micro>(duration).count();
+    }
+
+    std::string jsonEscape(const std::string& text)
+    {
+        std::string escaped;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+}
+
+#ifdef _WIN32
+ComPortTransport::~ComPortTransport()
+{
+    if (handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(handle);
+    }
+    if (readOverlapped.hEvent) {
+        CloseHandle(readOverlapped.hEvent);
+    }
+    if (writeOverlapped.hEvent) {
+        CloseHandle(writeOverlapped.hEvent);
+    }
+}
+
+bool ComPortTransport::open(ULONG readTimeoutMs)
+{
+    handle = OpenCommPort(portNumber, GENERIC_READ | GENERIC_WRITE, FILE_FLAG_OVERLAPPED);
+    if (handle == INVALID_HANDLE_VALUE) {
+        logger << "OpenCommPort failed error " << GetLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return false;
+    }
+    readOverlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    writeOverlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!readOverlapped.hEvent || !writeOverlapped.hEvent) {
+        logger << "CreateEvent failed error " << GetLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return false;
+    }
+    //
+    // MAXDWORD interval and multiplier with a constant: return as soon as
+    // any byte is present, or after the constant with nothing.
+    //
+    COMMTIMEOUTS timeouts = { 0 };
+    timeouts.ReadIntervalTimeout = MAXDWORD;
+    timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+    timeouts.ReadTotalTimeoutConstant = readTimeoutMs;
+    if (!SetCommTimeouts(handle, &timeouts)) {
+        logger << "SetCommTimeouts failed error " << GetLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return false;
+    }
+    PurgeComm(handle, PURGE_RXCLEAR | PURGE_TXCLEAR);
+    return true;
+}
+
+bool ComPortTransport::write(const BYTE* data, size_t length)
+{
+    while (length) {
+        DWORD written = 0;
+        if (!WriteFile(handle, data, (DWORD)length, &written, &writeOverlapped)) {
+            if (GetLastError() != ERROR_IO_PENDING ||
+                !GetOverlappedResult(handle, &writeOverlapped, &written, TRUE)) {
+                return false;
+            }
+        }
+        if (written == 0) {
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+long ComPortTransport::read(BYTE* data, size_t length)
+{
+    DWORD bytesRead = 0;
+    if (!ReadFile(handle, data, (DWORD)length, &bytesRead, &readOverlapped)) {
+        if (GetLastError() != ERROR_IO_PENDING ||
+            !GetOverlappedResult(handle, &readOverlapped, &bytesRead, TRUE)) {
+            return -1;
+        }
+    }
+    return (long)bytesRead;
+}
+#endif
+
+SocketTransport::~SocketTransport()
+{
+    if (s != INVALID_SOCKET) {
+        closesocket(s);
+    }
+}
+
+bool SocketTransport::open(const std::string& host, USHORT port, ULONG readTimeoutMs)
+{
+    target = host + ":" + std::to_string(port);
+    timeoutMs = (int)readTimeoutMs;
+    s = netConnect(host.c_str(), port);
+    if (s == INVALID_SOCKET) {
+        logger << "cannot connect to " << target << " error " << netLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return false;
+    }
+    netSetNoDelay(s);
+    return true;
+}
+
+bool SocketTransport::write(const BYTE* data, size_t length)
+{
+    while (length) {
+        int sent = send(s, (const char*)data, (int)std::min(length, (size_t)INT_MAX), 0);
+        if (sent == SOCKET_ERROR) {
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+long SocketTransport::read(BYTE* data, size_t length)
+{
+    pollfd_t fd = { 0 };
+    fd.fd = s;
+    fd.events = POLLIN;
+    int ready = netPoll(&fd, 1, timeoutMs);
+    if (ready == 0) {
+        return 0;
+    }
+    if (ready < 0) {
+        return -1;
+    }
+    int received = recv(s, (char*)data, (int)length, 0);
+    return (received > 0) ? received : -1;
+}
+
+Benchmark::Benchmark(BenchPattern Pattern, ULONG Count) : pattern(Pattern)
+{
+    switch (pattern) {
+    case BenchPattern::Byte:
+        count = 10000;
+        window = 1;
+        for (int value = 0; value < 256; value++) {
+            templates.push_back({ (BYTE)value });
+        }
+        break;
+
+    case BenchPattern::Kd:
+        //
+        // a debugger exchange: the ack of the previous packet and the
+        // next state manipulate packet, sized between 56 bytes and 1 KiB.
+        //
+        count = 2000;
+        window = 1;
+        for (ULONG burst = 0; burst < 8; burst++) {
+            std::vector<BYTE> payload(56 + burst * 128);
+            for (size_t i = 0; i < payload.size(); i++) {
+                payload[i] = (BYTE)(i * 7 + burst);
+            }
+            std::vector<BYTE> packet(2 * sizeof(KD_PACKET_HEADER) + payload.size() + 1);
+            size_t length = kdBuildControlPacket(packet.data(), KD_PACKET_TYPE_ACKNOWLEDGE,
+                KD_INITIAL_PACKET_ID + burst);
+            length += kdBuildDataPacket(packet.data() + length, KD_PACKET_TYPE_STATE_MANIPULATE,
+                KD_INITIAL_PACKET_ID + burst + 1, payload.data(), (USHORT)payload.size());
+            packet.resize(length);
+            templates.push_back(packet);
+        }
+        break;
+
+    case BenchPattern::Bulk:
+        count = 256;
+        window = 4;
+        for (ULONG block = 0; block < 4; block++) {
+            std::vector<BYTE> data(BULK_MESSAGE_SIZE);
+            ULONG seed = 0x9e3779b9 * (block + 1);
+            for (auto& value : data) {
+                seed = seed * 1664525 + 1013904223;
+                value = (BYTE)(seed >> 24);
+            }
+            templates.push_back(data);
+        }
+        break;
+    }
+    if (Count) {
+        count = Count;
+    }
+}
+
+const char* Benchmark::patternName(BenchPattern pattern)
+{
+    switch (pattern) {
+    case BenchPattern::Byte: return "byte";
+    case BenchPattern::Kd: return "kd";
+    case BenchPattern::Bulk: return "bulk";
+    }
+    return "unknown";
+}
+
+bool Benchmark::parsePattern(const std::string& name, BenchPattern& pattern)
+{
+    for (auto candidate : { BenchPattern::Byte, BenchPattern::Kd, BenchPattern::Bulk }) {
+        if (name == patternName(candidate)) {
+            pattern = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Benchmark::writer(BenchTransport& transport)
+{
+    for (ULONG index = 0; index < count; index++) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            progress.wait(guard, [this] { return failed || started - consumed < window; });
+            if (failed) {
+                return;
+            }
+            sendTimes[index] = steady_clock::now();
+            started++;
+        }
+        auto& data = message(index);
+        if (!transport.write(data.data(), data.size())) {
+            logger << "bench: write failed error " << netLastError() << "\n";
+            logger.flush(Logger::ERROR_LVL);
+            std::lock_guard<std::mutex> guard(lock);
+            failed = true;
+            progress.notify_all();
+            return;
+        }
+        bytesSent += data.size();
+    }
+}
+
+void Benchmark::reader(BenchTransport& transport, BenchResult& result)
+{
+    std::vector<BYTE> buffer(READ_BUFFER_SIZE);
+    ULONG index = 0;
+    size_t offset = 0;
+
+    while (index < count) {
+        long received = transport.read(buffer.data(), buffer.size());
+        auto now = steady_clock::now();
+        ULONG limit;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (received < 0) {
+                logger << "bench: read failed error " << netLastError() << "\n";
+                logger.flush(Logger::ERROR_LVL);
+                failed = true;
+                progress.notify_all();
+                return;
+            }
+            if (failed) {
+                return;
+            }
+            if (received == 0) {
+                //
+                // the read timed out, every message in flight is dropped.
+                // Bytes that arrive for them later count as mismatched.
+                //
+                if (index < started) {
+                    result.droppedBytes += message(index).size() - offset;
+                    for (ULONG next = index + 1; next < started; next++) {
+                        result.droppedBytes += message(next).size();
+                    }
+                    result.dropped += started - index;
+                    index = started;
+                    offset = 0;
+                    consumed = index;
+                    progress.notify_all();
+                }
+                continue;
+            }
+            limit = started;
+        }
+        result.bytesReceived += received;
+        for (long position = 0; position < received; ) {
+            if (index >= limit) {
+                // nothing is in flight, so none of this was sent.
+                result.mismatchedBytes += received - position;
+                break;
+            }
+            auto& expected = message(index);
+            size_t take = std::min(expected.size() - offset, (size_t)(received - position));
+            for (size_t i = 0; i < take; i++) {
+                if (buffer[position + i] != expected[offset + i]) {
+                    result.mismatchedBytes++;
+                }
+            }
+            position += (long)take;
+            offset += take;
+            if (offset == expected.size()) {
+                rtts.push_back(micros(now - sendTimes[index]));
+                result.completed++;
+                index++;
+                offset = 0;
+            }
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        consumed = index;
+        progress.notify_all();
+    }
+}
+
+BenchResult Benchmark::run(BenchTransport& transport)
+{
+    BenchResult result;
+    result.pattern = patternName(pattern);
+    result.transport = transport.name();
+    result.messages = count;
+
+    sendTimes.assign(count, steady_clock::time_point());
+    rtts.clear();
+    rtts.reserve(count);
+    started = 0;
+    consumed = 0;
+    failed = false;
+    bytesSent = 0;
+
+    auto start = steady_clock::now();
+    std::thread writeThread(&Benchmark::writer, this, std::ref(transport));
+    reader(transport, result);
+    writeThread.join();
+    result.seconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+    result.failed = failed;
+    result.bytesSent = bytesSent;
+    if (result.seconds > 0) {
+        result.megabytesPerSecond = (double)result.bytesReceived / result.seconds / 1000000.0;
+    }
+    if (!rtts.empty()) {
+        std::sort(rtts.begin(), rtts.end());
+        auto percentile = [this](double p) {
+            size_t rank = (size_t)std::ceil(p * rtts.size());
+            return rtts[std::min(rtts.size(), std::max(rank, (size_t)1)) - 1];
+        };
+        double sum = 0;
+        for (double rtt : rtts) {
+            sum += rtt;
+        }
+        result.rttMinUs = rtts.front();
+        result.rttMeanUs = sum / rtts.size();
+        result.rttP50Us = percentile(0.50);
+        result.rttP90Us = percentile(0.90);
+        result.rttP99Us = percentile(0.99);
+        result.rttP999Us = percentile(0.999);
+        result.rttMaxUs = rtts.back();
+    }
+    return result;
+}
+
+void Benchmark::print(const BenchResult& result)
+{
+    std::ostringstream line;
+    line.precision(3);
+    line << std::fixed;
+    line << result.pattern << " over " << result.transport << (result.failed ? " FAILED" : "") << "\n" <<
+        "  messages:   " << result.completed << "/" << result.messages << " echoed, "
+        << result.dropped << " dropped (" << result.droppedBytes << " bytes), "
+        << result.mismatchedBytes << " mismatched bytes\n" <<
+        "  throughput: " << result.megabytesPerSecond << " MB/s, "
+        << result.bytesReceived << " bytes in " << result.seconds << " s\n" <<
+        "  rtt us:     min " << result.rttMinUs << " mean " << result.rttMeanUs
+        << " p50 " << result.rttP50Us << " p90 " << result.rttP90Us
+        << " p99 " << result.rttP99Us << " p99.9 " << result.rttP999Us
+        << " max " << result.rttMaxUs;
+    logger << line.str();
+    logger.flush(result.failed ? Logger::ERROR_LVL : Logger::INFO_LVL);
+}
+
+bool Benchmark::writeJson(const std::string& fileName, const std::vector<BenchResult>& results)
+{
+    std::ofstream out(fileName, std::ios::out | std::ios::trunc);
+    if (!out) {
+        logger << "cannot create " << fileName << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return false;
+    }
+    out.precision(3);
+    out << std::fixed;
+    out << "{\"version\":1,\"results\":[";
+    for (size_t i = 0; i < results.size(); i++) {
+        auto& result = results[i];
+        out << (i ? ",\n" : "\n") <<
+            "{\"pattern\":\"" << result.pattern << "\"" <<
+            ",\"transport\":\"" << jsonEscape(result.transport) << "\"" <<
+            ",\"failed\":" << (result.failed ? "true" : "false") <<
+            ",\"messages\":" << result.messages <<
+            ",\"completed\":" << result.completed <<
+            ",\"dropped\":" << result.dropped <<
+            ",\"bytesSent\":" << result.bytesSent <<
+            ",\"bytesReceived\":" << result.bytesReceived <<
+            ",\"droppedBytes\":" << result.droppedBytes <<
+            ",\"mismatchedBytes\":" << result.mismatchedBytes <<
+            ",\"seconds\":" << result.seconds <<
+            ",\"megabytesPerSecond\":" << result.megabytesPerSecond <<
+            ",\"rttUs\":{\"min\":" << result.rttMinUs <<
+            ",\"mean\":" << result.rttMeanUs <<
+            ",\"p50\":" << result.rttP50Us <<
+            ",\"p90\":" << result.rttP90Us <<
+            ",\"p99\":" << result.rttP99Us <<
+            ",\"p999\":" << result.rttP999Us <<
+            ",\"max\":" << result.rttMaxUs << "}" <<
+            ",\"late\":" << result.late <<
+            ",\"lateMaxUs\":" << result.lateMaxUs << "}";
+    }
+    out << "\n]}\n";
+    return (bool)out;
+}
+
+int Benchmark::runPatterns(BenchTransport& transport, const std::string& patterns, ULONG count,
+    const std::string& jsonFile)
+{
+    return runPatterns(std::vector<BenchTransport*>{ &transport }, patterns, count, jsonFile);
+}
+
+int Benchmark::runPatterns(const std::vector<BenchTransport*>& transports, const std::string& patterns,
+    ULONG count, const std::string& jsonFile)
+{
+    std::vector<BenchPattern> selected;
+    if (patterns == "all") {
+        selected = { BenchPattern::Byte, BenchPattern::Kd, BenchPattern::Bulk };
+    }
+    else {
+        std::istringstream names(patterns);
+        std::string name;
+        while (std::getline(names, name, ',')) {
+            BenchPattern pattern;
+            if (!parsePattern(name, pattern)) {
+                logger << "unknown bench pattern " << name << ", use byte, kd, bulk or all\n";
+                logger.flush(Logger::ERROR_LVL);
+                return 1;
+            }
+            selected.push_back(pattern);
+        }
+    }
+
+    std::vector<BenchResult> results;
+    bool failed = false;
+    for (auto pattern : selected) {
+        for (auto transport : transports) {
+            Benchmark bench(pattern, count);
+            results.push_back(bench.run(*transport));
+            print(results.back());
+            if (results.back().failed) {
+                // the transport is broken, later patterns would fail too.
+                failed = true;
+                break;
+            }
+        }
+        if (failed) {
+            break;
+        }
+    }
+    if (!jsonFile.empty() && !writeJson(jsonFile, results)) {
+        return 1;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,183 @@
+#pragma once
+#include "NetCompat.h"
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+/**
+ * @brief The byte stream a benchmark run sends to the echo peer.
+ */
+enum class BenchPattern {
+    Byte,   // single byte ping-pong, the worst case for read completion latency.
+    Kd,     // kd packet bursts: a control ack followed by a data packet, one burst in flight.
+    Bulk,   // 64 KiB transfers with several in flight.
+};
+
+/**
+ * @brief A duplex byte stream connected to an echo peer.
+ *
+ * write is only called from the writer thread and read only from the reader thread,
+ * so an implementation may run them concurrently without locking.
+ */
+class BenchTransport {
+public:
+    virtual ~BenchTransport() {}
+
+    /**
+     * @brief Writes all of data.
+     *
+     * @return bool false if the transport failed.
+     */
+    virtual bool write(const BYTE* data, size_t length) = 0;
+
+    /**
+     * @brief Reads whatever is available, waiting at most the transport read timeout.
+     *
+     * @return long The number of bytes read, 0 on timeout, -1 if the transport failed.
+     */
+    virtual long read(BYTE* data, size_t length) = 0;
+
+    virtual std::string name() const = 0;
+};
+
+#ifdef _WIN32
+/**
+ * @brief A COM port opened for overlapped io, normally an htsvsp port.
+ */
+class ComPortTransport : public BenchTransport {
+public:
+    ComPortTransport(ULONG PortNumber) : portNumber(PortNumber) {}
+    ~ComPortTransport();
+
+    /**
+     * @brief Opens the port and sets read timeouts that return as soon as any data is present.
+     */
+    bool open(ULONG readTimeoutMs);
+    bool write(const BYTE* data, size_t length) override;
+    long read(BYTE* data, size_t length) override;
+    std::string name() const override { return "COM" + std::to_string(portNumber); }
+
+private:
+    ULONG portNumber;
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    OVERLAPPED readOverlapped = { 0 };
+    OVERLAPPED writeOverlapped = { 0 };
+};
+#endif
+
+/**
+ * @brief A tcp connection, used to measure the network path without the port.
+ */
+class SocketTransport : public BenchTransport {
+public:
+    SocketTransport() {}
+    ~SocketTransport();
+
+    bool open(const std::string& host, USHORT port, ULONG readTimeoutMs);
+    bool write(const BYTE* data, size_t length) override;
+    long read(BYTE* data, size_t length) override;
+    std::string name() const override { return target; }
+
+private:
+    SOCKET s = INVALID_SOCKET;
+    int timeoutMs = 0;
+    std::string target;
+};
+
+struct BenchResult {
+    std::string pattern;
+    std::string transport;
+    ULONG messages = 0;
+    ULONG completed = 0;
+    ULONG dropped = 0;            // messages not fully echoed within the read timeout
+    INT64 bytesSent = 0;
+    INT64 bytesReceived = 0;
+    INT64 droppedBytes = 0;
+    INT64 mismatchedBytes = 0;    // echoed bytes that differ from what was sent
+    double seconds = 0;
+    double megabytesPerSecond = 0;
+    double rttMinUs = 0;
+    double rttMeanUs = 0;
+    double rttP50Us = 0;
+    double rttP90Us = 0;
+    double rttP99Us = 0;
+    double rttP999Us = 0;
+    double rttMaxUs = 0;
+    ULONG late = 0;               // capture replay writes behind their schedule, see CaptureReplay
+    double lateMaxUs = 0;
+    bool failed = false;
+};
+
+/**
+ * @brief Drives a traffic pattern through an echo peer and measures throughput and round trip time.
+ *
+ * A writer thread sends messages while a reader thread checks the echoed bytes against what
+ * was sent. The round trip time of a message runs from the start of its write to the arrival
+ * of its last echoed byte. The number of messages in flight is limited by the pattern's window.
+ */
+class Benchmark {
+public:
+    /**
+     * @brief Constructs a Benchmark for a pattern.
+     *
+     * @param Pattern The traffic pattern.
+     * @param Count The number of messages to send, 0 for the pattern default.
+     */
+    Benchmark(BenchPattern Pattern, ULONG Count = 0);
+
+    /**
+     * @brief Runs the pattern over a transport. The transport must be connected to an echo peer.
+     */
+    BenchResult run(BenchTransport& transport);
+
+    /**
+     * @brief Runs a comma separated list of patterns, or all of them, and logs each result.
+     *
+     * @param jsonFile Also writes the results to this file if not empty.
+     * @return int 0 if every run completed, else 1.
+     */
+    static int runPatterns(BenchTransport& transport, const std::string& patterns, ULONG count,
+        const std::string& jsonFile);
+
+    /**
+     * @brief Runs each pattern over each transport in turn, to compare them under the same load.
+     */
+    static int runPatterns(const std::vector<BenchTransport*>& transports, const std::string& patterns,
+        ULONG count, const std::string& jsonFile);
+
+    static const char* patternName(BenchPattern pattern);
+    static bool parsePattern(const std::string& name, BenchPattern& pattern);
+
+    /**
+     * @brief Writes results as a JSON document that release builds can be compared with.
+     */
+    static bool writeJson(const std::string& fileName, const std::vector<BenchResult>& results);
+
+    /**
+     * @brief Logs a one run summary.
+     */
+    static void print(const BenchResult& result);
+
+private:
+    void writer(BenchTransport& transport);
+    void reader(BenchTransport& transport, BenchResult& result);
+    const std::vector<BYTE>& message(ULONG index) const { return templates[index % templates.size()]; }
+
+    BenchPattern pattern;
+    ULONG count;
+    ULONG window;
+    std::vector<std::vector<BYTE>> templates;
+    std::vector<std::chrono::steady_clock::time_point> sendTimes;
+    std::vector<double> rtts;
+
+    // messages started by the writer and messages consumed (echoed or dropped) by the reader.
+    std::mutex lock;
+    std::condition_variable progress;
+    ULONG started = 0;
+    ULONG consumed = 0;
+    bool failed = false;
+    INT64 bytesSent = 0;
+};
@@ -0,0 +1,172 @@
+#include "CaptureReader.h"
+#include "capture.h"
+#include <iomanip>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace {
+    // maps the file at path read only, returns nullptr if it cannot.
+    const BYTE* mapFile(const std::string& path, uint64_t& size)
+    {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return nullptr;
+        }
+        LARGE_INTEGER length;
+        const BYTE* view = nullptr;
+        if (GetFileSizeEx(file, &length) && length.QuadPart > 0) {
+            HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping != NULL) {
+                view = (const BYTE*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(mapping);
+            }
+            size = (uint64_t)length.QuadPart;
+        }
+        CloseHandle(file);
+        return view;
+#else
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat status;
+        const BYTE* view = nullptr;
+        if (fstat(fd, &status) == 0 && status.st_size > 0) {
+            void* base = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (base != MAP_FAILED) {
+                view = (const BYTE*)base;
+                size = (uint64_t)status.st_size;
+            }
+        }
+        ::close(fd);
+        return view;
+#endif
+    }
+
+    void unmapFile(const BYTE* view, uint64_t size)
+    {
+#ifdef _WIN32
+        (void)size;
+        UnmapViewOfFile(view);
+#else
+        munmap((void*)view, (size_t)size);
+#endif
+    }
+}
+
+bool CaptureReader::open(const std::string& path)
+{
+    close();
+    for (ULONG n = 0;; n++) {
+        uint64_t size = 0;
+        const BYTE* view = mapFile(path + "." + std::to_string(n), size);
+        if (view == nullptr) {
+            break;
+        }
+        const CAPTURE_SEGMENT_HEADER* header = CaptureSegmentHeader(view, size);
+        if (header == nullptr || header->Segment != n ||
+            (n > 0 && header->StartUs != ((const CAPTURE_SEGMENT_HEADER*)segments[0].view)->StartUs)) {
+            // a segment of an earlier, longer capture.
+            unmapFile(view, size);
+            break;
+        }
+        segments.push_back({ view, size });
+    }
+    return !segments.empty();
+}
+
+void CaptureReader::close()
+{
+    for (const Segment& segment : segments) {
+        unmapFile(segment.view, segment.size);
+    }
+    segments.clear();
+}
+
+uint64_t CaptureReader::forEach(uint64_t fromUs, uint64_t toUs, unsigned directions,
+    const std::function<bool(const CaptureEntry&)>& visit) const
+{
+    uint64_t visited = 0;
+    if (segments.empty()) {
+        return 0;
+    }
+    uint64_t startUs = ((const CAPTURE_SEGMENT_HEADER*)segments[0].view)->StartUs;
+    for (size_t n = 0; n < segments.size(); n++) {
+        const CAPTURE_SEGMENT_HEADER* header = (const CAPTURE_SEGMENT_HEADER*)segments[n].view;
+        // a segment whose successor starts before fromUs has nothing to visit.
+        if (n + 1 < segments.size()) {
+            const CAPTURE_SEGMENT_HEADER* next = (const CAPTURE_SEGMENT_HEADER*)segments[n + 1].view;
+            const CAPTURE_INDEX_ENTRY* first = (const CAPTURE_INDEX_ENTRY*)(next + 1);
+            if (first->TimeUs != 0 && first->TimeUs < startUs + fromUs) {
+                continue;
+            }
+        }
+        ULONG offset = CaptureSeek(header, startUs + fromUs);
+        const CAPTURE_RECORD* record;
+        while ((record = CaptureRecordAt(header, offset)) != nullptr) {
+            offset += record->Size;
+            uint64_t timeUs = record->TimeUs - startUs;
+            if (record->Direction == CAPTURE_PAD || timeUs < fromUs) {
+                continue;
+            }
+            if (timeUs > toUs) {
+                // racing writers are a few microseconds apart at most.
+                return visited;
+            }
+            if ((directions & record->Direction) == 0) {
+                continue;
+            }
+            CaptureEntry entry = { timeUs, record->Direction, CaptureRecordData(record), CaptureRecordLength(record) };
+            visited++;
+            if (!visit(entry)) {
+                return visited;
+            }
+        }
+    }
+    return visited;
+}
+
+uint64_t CaptureReader::dump(std::ostream& out, uint64_t fromUs, uint64_t toUs, unsigned directions,
+    bool brief) const
+{
+    return forEach(fromUs, toUs, directions, [&](const CaptureEntry& entry) {
+        out << std::setw(12) << std::fixed << std::setprecision(6) << entry.timeUs / 1e6
+            << (entry.direction == CAPTURE_RECEIVED ? " rx " : " tx ") << entry.length << "\n";
+        if (brief) {
+            return true;
+        }
+        for (ULONG line = 0; line < entry.length; line += 16) {
+            out << "    " << std::hex << std::setfill('0') << std::setw(4) << line << " ";
+            for (ULONG n = line; n < line + 16; n++) {
+                if (n < entry.length) {
+                    out << " " << std::setw(2) << (unsigned)entry.data[n];
+                }
+                else {
+                    out << "   ";
+                }
+            }
+            out << std::dec << std::setfill(' ') << "  ";
+            for (ULONG n = line; n < line + 16 && n < entry.length; n++) {
+                BYTE c = entry.data[n];
+                out << (char)((c >= 0x20 && c < 0x7f) ? c : '.');
+            }
+            out << "\n";
+        }
+        return true;
+    });
+}
+
+unsigned CaptureReader::directionMask(const std::string& name)
+{
+    if (name == "rx") {
+        return CAPTURE_RECEIVED;
+    }
+    if (name == "tx") {
+        return CAPTURE_WRITTEN;
+    }
+    return (name == "both") ? (CAPTURE_RECEIVED | CAPTURE_WRITTEN) : 0;
+}
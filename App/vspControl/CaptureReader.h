@@ -0,0 +1,75 @@
+#pragma once
+#include "NetCompat.h"
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief A record of a capture log, pointing into the mapped segment.
+ */
+struct CaptureEntry {
+    uint64_t timeUs;        // since the capture started.
+    USHORT direction;       // CAPTURE_RECEIVED or CAPTURE_WRITTEN.
+    const BYTE* data;
+    ULONG length;
+};
+
+/**
+ * @brief Reads the capture log a port writes with IOCTL_HTSVSP_CAPTURE_CONTROL,
+ * see ComPort/capture.h.
+ *
+ * The segment files path.0, path.1 and so on are mapped read only, so records are
+ * visited in place without copying. The log ends at the first segment that is missing
+ * or belongs to another capture. A log the port is still writing can be read, it ends
+ * at the last record complete when it was reached.
+ */
+class CaptureReader {
+public:
+    ~CaptureReader() { close(); }
+
+    /**
+     * @brief Maps the segments of the log at path.
+     *
+     * @return bool false if there is no valid first segment.
+     */
+    bool open(const std::string& path);
+
+    void close();
+
+    size_t segmentCount() const { return segments.size(); }
+
+    /**
+     * @brief Visits the records of the directions in the mask, a bit for each of
+     * CAPTURE_RECEIVED and CAPTURE_WRITTEN, from fromUs up to toUs since the start,
+     * in the order they were appended. The time index finds fromUs.
+     *
+     * @param visit Returns false to stop.
+     * @return uint64_t The records visited.
+     */
+    uint64_t forEach(uint64_t fromUs, uint64_t toUs, unsigned directions,
+        const std::function<bool(const CaptureEntry&)>& visit) const;
+
+    /**
+     * @brief Writes the records like forEach visits them, a line each with the time in
+     * seconds, the direction and the length, followed by a hex dump unless brief.
+     *
+     * @return uint64_t The records written.
+     */
+    uint64_t dump(std::ostream& out, uint64_t fromUs, uint64_t toUs, unsigned directions,
+        bool brief) const;
+
+    /**
+     * @brief The direction mask of rx, tx or both, 0 for anything else.
+     */
+    static unsigned directionMask(const std::string& name);
+
+private:
+    struct Segment {
+        const BYTE* view;
+        uint64_t size;
+    };
+
+    std::vector<Segment> segments;
+};
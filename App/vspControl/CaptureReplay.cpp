@@ -0,0 +1,224 @@
+#include "CaptureReplay.h"
+#include "capture.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include "Logger.h"
+
+extern Logger logger;
+
+using std::chrono::steady_clock;
+
+namespace {
+    const size_t READ_BUFFER_SIZE = 64 * 1024;
+
+    double micros(steady_clock::duration duration)
+    {
+        return std::chrono::duration<double, std::micro>(duration).count();
+    }
+}
+
+CaptureReplay::CaptureReplay(const CaptureReader& Reader, const ReplayOptions& Options) :
+    captureReader(Reader), options(Options)
+{
+    if (options.directions == 0) {
+        options.directions = CAPTURE_WRITTEN;
+    }
+}
+
+void CaptureReplay::writer(BenchTransport& transport)
+{
+    auto start = steady_clock::now();
+    uint64_t firstUs = UINT64_MAX;
+
+    captureReader.forEach(options.fromUs, options.toUs, options.directions, [&](const CaptureEntry& entry) {
+        steady_clock::time_point due = start;
+        if (options.speed > 0) {
+            if (firstUs == UINT64_MAX) {
+                firstUs = entry.timeUs;
+            }
+            // racing writers of the port can be a few microseconds out of order.
+            uint64_t offsetUs = (entry.timeUs > firstUs) ? entry.timeUs - firstUs : 0;
+            due = start + std::chrono::microseconds((int64_t)(offsetUs / options.speed));
+            std::this_thread::sleep_until(due);
+        }
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            progress.wait(guard, [this] { return failed || options.window == 0 || started - consumed < options.window; });
+            if (failed || started == count) {
+                // a log still being written grew since it was counted.
+                return false;
+            }
+            auto now = steady_clock::now();
+            if (options.speed > 0) {
+                double behindUs = micros(now - due);
+                if (behindUs > options.lateUs) {
+                    late++;
+                }
+                lateMaxUs = std::max(lateMaxUs, behindUs);
+            }
+            sendTimes[started] = now;
+            started++;
+            bytesStarted += entry.length;
+        }
+        if (!transport.write(entry.data, entry.length)) {
+            logger << "replay: write failed error " << netLastError() << "\n";
+            logger.flush(Logger::ERROR_LVL);
+            std::lock_guard<std::mutex> guard(lock);
+            failed = true;
+            progress.notify_all();
+            return false;
+        }
+        bytesSent += entry.length;
+        return true;
+    });
+}
+
+void CaptureReplay::reader(BenchTransport& transport, BenchResult& result)
+{
+    ULONG index = 0;
+    ULONG limit = 0;
+    ULONG skipTo = 0;            // the records before it were dropped at a read timeout.
+    INT64 bytesConsumed = 0;
+    long received = 0;
+    long position = 0;
+    steady_clock::time_point now;
+
+    captureReader.forEach(options.fromUs, options.toUs, options.directions, [&](const CaptureEntry& entry) {
+        ULONG current = index++;
+        if (current >= count) {
+            return false;
+        }
+        if (current < skipTo) {
+            return true;
+        }
+        size_t offset = 0;
+        while (offset < entry.length) {
+            if (position == received) {
+                received = transport.read(buffer.data(), buffer.size());
+                position = 0;
+                now = steady_clock::now();
+                std::lock_guard<std::mutex> guard(lock);
+                if (received < 0) {
+                    logger << "replay: read failed error " << netLastError() << "\n";
+                    logger.flush(Logger::ERROR_LVL);
+                    failed = true;
+                    progress.notify_all();
+                    return false;
+                }
+                if (failed) {
+                    return false;
+                }
+                if (received == 0) {
+                    if (current < started) {
+                        //
+                        // the read timed out, every record in flight is dropped.
+                        // Bytes that arrive for them later count as mismatched.
+                        //
+                        result.dropped += started - current;
+                        result.droppedBytes += bytesStarted - bytesConsumed - (INT64)offset;
+                        skipTo = started;
+                        consumed = started;
+                        bytesConsumed = bytesStarted;
+                        progress.notify_all();
+                        return true;
+                    }
+                    // a pause of the captured session.
+                    continue;
+                }
+                limit = started;
+                result.bytesReceived += received;
+            }
+            if (current >= limit) {
+                // nothing is in flight, so none of this was sent.
+                result.mismatchedBytes += received - position;
+                position = received;
+                continue;
+            }
+            size_t take = std::min(entry.length - offset, (size_t)(received - position));
+            for (size_t i = 0; i < take; i++) {
+                if (buffer[position + i] != entry.data[offset + i]) {
+                    result.mismatchedBytes++;
+                }
+            }
+            position += (long)take;
+            offset += take;
+        }
+        rtts.push_back(micros(now - sendTimes[current]));
+        result.completed++;
+        std::lock_guard<std::mutex> guard(lock);
+        consumed = current + 1;
+        bytesConsumed += entry.length;
+        progress.notify_all();
+        return true;
+    });
+    // what is left in the buffer was never sent.
+    result.mismatchedBytes += received - position;
+}
+
+BenchResult CaptureReplay::run(BenchTransport& transport)
+{
+    BenchResult result;
+    result.pattern = "replay";
+    result.transport = transport.name();
+
+    count = (ULONG)captureReader.forEach(options.fromUs, options.toUs, options.directions,
+        [](const CaptureEntry&) { return true; });
+    result.messages = count;
+
+    sendTimes.assign(count, steady_clock::time_point());
+    rtts.clear();
+    rtts.reserve(count);
+    buffer.assign(READ_BUFFER_SIZE, 0);
+    started = 0;
+    consumed = 0;
+    bytesStarted = 0;
+    failed = false;
+    bytesSent = 0;
+    late = 0;
+    lateMaxUs = 0;
+
+    auto start = steady_clock::now();
+    std::thread writeThread(&CaptureReplay::writer, this, std::ref(transport));
+    reader(transport, result);
+    writeThread.join();
+    result.seconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+    result.failed = failed;
+    result.bytesSent = bytesSent;
+    result.late = late;
+    result.lateMaxUs = lateMaxUs;
+    if (result.seconds > 0) {
+        result.megabytesPerSecond = (double)result.bytesReceived / result.seconds / 1000000.0;
+    }
+    if (!rtts.empty()) {
+        std::sort(rtts.begin(), rtts.end());
+        auto percentile = [this](double p) {
+            size_t rank = (size_t)std::ceil(p * rtts.size());
+            return rtts[std::min(rtts.size(), std::max(rank, (size_t)1)) - 1];
+        };
+        double sum = 0;
+        for (double rtt : rtts) {
+            sum += rtt;
+        }
+        result.rttMinUs = rtts.front();
+        result.rttMeanUs = sum / rtts.size();
+        result.rttP50Us = percentile(0.50);
+        result.rttP90Us = percentile(0.90);
+        result.rttP99Us = percentile(0.99);
+        result.rttP999Us = percentile(0.999);
+        result.rttMaxUs = rtts.back();
+    }
+    return result;
+}
+
+void CaptureReplay::print(const BenchResult& result)
+{
+    Benchmark::print(result);
+    std::ostringstream line;
+    line.precision(3);
+    line << std::fixed;
+    line << "  schedule:   " << result.late << " late writes, at most " << result.lateMaxUs << " us behind";
+    logger << line.str();
+    logger.flush(Logger::INFO_LVL);
+}
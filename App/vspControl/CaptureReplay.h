@@ -0,0 +1,66 @@
+#pragma once
+#include "Benchmark.h"
+#include "CaptureReader.h"
+#include <cstdint>
+
+/**
+ * @brief How a capture replay schedules its writes, see CaptureReplay.
+ */
+struct ReplayOptions {
+    double speed = 1.0;             // 1 keeps the captured timing, 2 replays twice as fast, 0 as fast as possible.
+    unsigned directions = 0;        // CaptureReader::directionMask, 0 for the records written to the port.
+    uint64_t fromUs = 0;            // the part of the capture replayed, since it started.
+    uint64_t toUs = UINT64_MAX;
+    ULONG window = 0;               // records in flight, 0 for no limit.
+    ULONG lateUs = 1000;            // a write this far behind its schedule counts as late.
+};
+
+/**
+ * @brief Replays a capture log through an echo peer as a benchmark workload.
+ *
+ * The records of the log are written in the order they were captured, each at its
+ * captured time since the first one divided by the speed, or back to back. A reader
+ * thread walks the same records and checks the echoed bytes against them, so a
+ * production session becomes a repeatable run of the read timeout and completion paths
+ * of the transport. Both threads visit the records in place in the mapped segments,
+ * there is no allocation per record.
+ *
+ * The result is a BenchResult of the pattern "replay" with one message per record. The
+ * round trip time of a record runs from the start of its write to its last echoed byte.
+ */
+class CaptureReplay {
+public:
+    CaptureReplay(const CaptureReader& Reader, const ReplayOptions& Options);
+
+    /**
+     * @brief Replays the log over a transport connected to an echo peer.
+     */
+    BenchResult run(BenchTransport& transport);
+
+    /**
+     * @brief Logs the result like Benchmark::print, and how well the schedule was kept.
+     */
+    static void print(const BenchResult& result);
+
+private:
+    void writer(BenchTransport& transport);
+    void reader(BenchTransport& transport, BenchResult& result);
+
+    const CaptureReader& captureReader;
+    ReplayOptions options;
+    ULONG count = 0;
+    std::vector<std::chrono::steady_clock::time_point> sendTimes;
+    std::vector<double> rtts;
+    std::vector<BYTE> buffer;
+
+    // records started by the writer and records consumed (echoed or dropped) by the reader.
+    std::mutex lock;
+    std::condition_variable progress;
+    ULONG started = 0;
+    ULONG consumed = 0;
+    INT64 bytesStarted = 0;
+    bool failed = false;
+    INT64 bytesSent = 0;
+    ULONG late = 0;
+    double lateMaxUs = 0;
+};
@@ -0,0 +1,186 @@
+#include "EngineTransport.h"
+#include <sstream>
+#include "Logger.h"
+
+extern Logger logger;
+
+namespace {
+    // the wait sources, in the order they are added.
+    enum EngineTransportWait {
+        EngineTransportWaitSocket = 0,
+        EngineTransportWaitIntervalTimer,
+        EngineTransportWaitTotalTimer,
+        EngineTransportWaitOverflowTimer,
+    };
+
+    // a read without timers times out after this many 500 ms waits, the driver's default.
+    const ULONG ENGINE_WAIT_UNITS = 3;
+}
+
+EngineTransport::EngineTransport() : engine(new NET_ENGINE()), stats(new HTS_VSP_REPORT())
+{
+    EngineInitialize(engine.get(), stats.get());
+}
+
+EngineTransport::~EngineTransport()
+{
+    if (waiter) {
+        PlatformWaiterClose(waiter);
+    }
+    PlatformTimerClose(intervalTimer);
+    PlatformTimerClose(totalTimer);
+    PlatformTimerClose(overflowTimer);
+    EngineClose(engine.get());
+}
+
+bool EngineTransport::open(const std::string& host, USHORT port, const SERIAL_TIMEOUTS& timeouts)
+{
+    target = "engine:" + host + ":" + std::to_string(port);
+    readTimeouts = timeouts;
+    SOCKET s = netConnect(host.c_str(), port);
+    if (s == INVALID_SOCKET) {
+        logger << "cannot connect to " << target << " error " << netLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return false;
+    }
+    netSetNoDelay(s);
+    UINT32 error = EngineAttach(engine.get(), s, NULL);
+    if (error == NO_ERROR) {
+        error = PlatformTimerCreate(&intervalTimer);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformTimerCreate(&totalTimer);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformTimerCreate(&overflowTimer);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterCreate(&waiter);
+    }
+    if (error == NO_ERROR) {
+        error = EngineWaiterAdd(engine.get(), waiter);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddTimer(waiter, intervalTimer);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddTimer(waiter, totalTimer);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddTimer(waiter, overflowTimer);
+    }
+    if (error != NO_ERROR) {
+        logger << "engine setup for " << target << " failed error " << error << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return false;
+    }
+    return true;
+}
+
+void EngineTransport::setOverflow(ULONG policy, ULONG timeoutMs)
+{
+    EngineSetOverflow(engine.get(), policy, timeoutMs);
+}
+
+bool EngineTransport::write(const BYTE* data, size_t length)
+{
+    return EngineWrite(engine.get(), (const char*)data, (int)length) == NO_ERROR;
+}
+
+long EngineTransport::read(BYTE* data, size_t length)
+{
+    PNET_ENGINE netEngine = engine.get();
+    ENGINE_READ request = { data, (ULONG)length, 0, 0 };
+    BOOL socketEnabled = TRUE;
+    BOOL overflowTimerRunning = FALSE;
+
+    //
+    // serves the read like the client loop of the driver serves a read
+    // request, see ClientRun in ComPort/network.cpp.
+    //
+    EngineStartRead(netEngine, &request, &readTimeouts);
+    if (netEngine->Timers.UseTotalTimer) {
+        PlatformTimerStart(totalTimer, netEngine->Timers.TotalMs);
+    }
+    ENGINE_READ_STATUS status;
+    for (;;) {
+        status = EngineProcessRead(netEngine);
+        if (netEngine->BytesFromLastRead && netEngine->Timers.UseIntervalTimer) {
+            // the interval restarts with every byte.
+            PlatformTimerStart(intervalTimer, netEngine->Timers.IntervalMs);
+        }
+        if (status != EngineReadPending) {
+            break;
+        }
+        BOOL receive = EngineReceiveAllowed(netEngine);
+        if (receive != socketEnabled) {
+            EngineWaiterEnable(netEngine, waiter, receive);
+            socketEnabled = receive;
+        }
+        ULONG overflowMs = EngineOverflowTimeout(netEngine);
+        if ((overflowMs != 0) != overflowTimerRunning) {
+            if (overflowMs) {
+                PlatformTimerStart(overflowTimer, overflowMs);
+            }
+            else {
+                PlatformTimerStop(overflowTimer);
+            }
+            overflowTimerRunning = overflowMs != 0;
+        }
+        ULONG timeout = (netEngine->Timers.UseIntervalTimer || netEngine->Timers.UseTotalTimer) ? INFINITE : 500;
+        ULONG waitResult = EngineWait(netEngine, waiter, timeout, 1 << EngineTransportWaitSocket);
+        ULONG received = 0;
+        switch (waitResult) {
+        case PLATFORM_WAIT_TIMEOUT:
+            status = EngineWaitTimeout(netEngine, ENGINE_WAIT_UNITS);
+            if (status != EngineReadPending) {
+                waitTimeouts++;
+            }
+            break;
+
+        case EngineTransportWaitSocket:
+            switch (EngineReceive(netEngine, &received)) {
+            case EngineReceiveData:
+            case EngineReceiveIdle:
+                break;
+            default:
+                status = EngineReadFailed;
+                break;
+            }
+            break;
+
+        case EngineTransportWaitIntervalTimer:
+            intervalTimerEvents++;
+            status = EngineIntervalTimerExpired(netEngine);
+            break;
+
+        case EngineTransportWaitTotalTimer:
+            totalTimerEvents++;
+            status = EngineTotalTimerExpired(netEngine);
+            break;
+
+        case EngineTransportWaitOverflowTimer:
+            overflowTimerRunning = FALSE;
+            EngineOverflowTimerExpired(netEngine);
+            break;
+
+        default:
+            status = EngineReadFailed;
+            break;
+        }
+        if (status == EngineReadFailed) {
+            EngineAbortRead(netEngine);
+            break;
+        }
+        if (status != EngineReadPending) {
+            break;
+        }
+    }
+    PlatformTimerStop(intervalTimer);
+    PlatformTimerStop(totalTimer);
+    PlatformTimerStop(overflowTimer);
+    if (!socketEnabled) {
+        EngineWaiterEnable(netEngine, waiter, TRUE);
+    }
+    return (status == EngineReadFailed) ? -1 : (long)request.Information;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include "Benchmark.h"
+#include "engine.h"
+#include <memory>
+
+/**
+ * @brief A tcp connection read through the portable engine of the driver, see
+ * ComPort/engine.h, the way its client loop serves read requests.
+ *
+ * Each read is a read request with the serial timeouts given to open: the engine
+ * completes it from received data, or at its interval or total timer, or after the
+ * wait units of a read without timers. This runs the read timeout and completion
+ * logic of the port on linux, without the driver.
+ */
+class EngineTransport : public BenchTransport {
+public:
+    EngineTransport();
+    ~EngineTransport();
+
+    /**
+     * @brief Connects to host and port.
+     *
+     * @param timeouts The timeouts of each read. ReadIntervalTimeout and
+     * ReadTotalTimeoutMultiplier MAXULONG with a constant returns as soon as any data is
+     * present, like ComPortTransport.
+     */
+    bool open(const std::string& host, USHORT port, const SERIAL_TIMEOUTS& timeouts);
+
+    /**
+     * @brief What a receive does with data that does not fit in the receive ring, see
+     * EngineSetOverflow. The report counts what the policy dropped.
+     */
+    void setOverflow(ULONG policy, ULONG timeoutMs);
+    bool write(const BYTE* data, size_t length) override;
+    long read(BYTE* data, size_t length) override;
+    std::string name() const override { return target; }
+
+    const HTS_VSP_REPORT& report() const { return *stats; }
+
+    // how the reads completed.
+    ULONG intervalTimerEvents = 0;
+    ULONG totalTimerEvents = 0;
+    ULONG waitTimeouts = 0;
+
+private:
+    std::unique_ptr<NET_ENGINE> engine;
+    std::unique_ptr<HTS_VSP_REPORT> stats;
+    SERIAL_TIMEOUTS readTimeouts = { 0 };
+    PPLATFORM_WAITER waiter = nullptr;
+    PLATFORM_TIMER intervalTimer = nullptr;
+    PLATFORM_TIMER totalTimer = nullptr;
+    PLATFORM_TIMER overflowTimer = nullptr;
+    std::string target;
+};
@@ -0,0 +1,356 @@
+#include "KdAnalyzer.h"
+#include "capture.h"
+#include <chrono>
+#include <sstream>
+#include "Logger.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define KD_SSE2 1
+#endif
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+
+extern Logger logger;
+
+namespace {
+    bool isLeaderByte(uint8_t value)
+    {
+        return value == KD_PACKET_LEADER_BYTE || value == KD_CONTROL_PACKET_LEADER_BYTE;
+    }
+
+    unsigned lowestBit(unsigned mask)
+    {
+#ifdef _WIN32
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return index;
+#else
+        return (unsigned)__builtin_ctz(mask);
+#endif
+    }
+
+    std::string percentiles(const KdAnalyzer::Latencies& latencies)
+    {
+        std::vector<uint32_t> sorted(latencies.us);
+        std::ostringstream text;
+        text << sorted.size();
+        if (sorted.empty()) {
+            return text.str();
+        }
+        std::sort(sorted.begin(), sorted.end());
+        auto percentile = [&sorted](double p) {
+            size_t rank = (size_t)(p * sorted.size());
+            return sorted[std::min(rank, sorted.size() - 1)];
+        };
+        text << ", p50 " << percentile(0.50) << " p90 " << percentile(0.90) << " p99 " << percentile(0.99) <<
+            " max " << sorted.back();
+        return text.str();
+    }
+
+    double percent(uint64_t part, uint64_t whole)
+    {
+        return whole ? 100.0 * part / whole : 0;
+    }
+}
+
+size_t kdFindLeader(const uint8_t* data, size_t length, uint64_t& breakins)
+{
+    size_t i = 0;
+#ifdef KD_SSE2
+    //
+    // a leader starts where a byte and the three after it equal the same
+    // leader byte: compare four loads a byte apart and and them.
+    //
+    const __m128i dataLeader = _mm_set1_epi8((char)KD_PACKET_LEADER_BYTE);
+    const __m128i controlLeader = _mm_set1_epi8((char)KD_CONTROL_PACKET_LEADER_BYTE);
+    const __m128i breakin = _mm_set1_epi8((char)KD_BREAKIN_PACKET_BYTE);
+    for (; i + 19 <= length; i += 16) {
+        __m128i b0 = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(data + i + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i*)(data + i + 2));
+        __m128i b3 = _mm_loadu_si128((const __m128i*)(data + i + 3));
+        __m128i d = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(b0, dataLeader), _mm_cmpeq_epi8(b1, dataLeader)),
+            _mm_and_si128(_mm_cmpeq_epi8(b2, dataLeader), _mm_cmpeq_epi8(b3, dataLeader)));
+        __m128i c = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(b0, controlLeader), _mm_cmpeq_epi8(b1, controlLeader)),
+            _mm_and_si128(_mm_cmpeq_epi8(b2, controlLeader), _mm_cmpeq_epi8(b3, controlLeader)));
+        unsigned found = (unsigned)_mm_movemask_epi8(_mm_or_si128(d, c));
+        unsigned breakins16 = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(b0, breakin));
+        if (found) {
+            unsigned at = lowestBit(found);
+            breakins16 &= (1u << at) - 1;
+            for (; breakins16; breakins16 &= breakins16 - 1) {
+                breakins++;
+            }
+            return i + at;
+        }
+        // breakins are rare, the loop runs for the ones there are.
+        for (; breakins16; breakins16 &= breakins16 - 1) {
+            breakins++;
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        uint8_t value = data[i];
+        if (isLeaderByte(value)) {
+            size_t run = 1;
+            while (run < 4 && i + run < length && data[i + run] == value) {
+                run++;
+            }
+            if (run == 4 || i + run == length) {
+                return i;
+            }
+        }
+        else if (value == KD_BREAKIN_PACKET_BYTE) {
+            breakins++;
+        }
+    }
+    return length;
+}
+
+uint32_t kdChecksumFast(const uint8_t* data, size_t length)
+{
+    uint32_t checksum = 0;
+    size_t i = 0;
+#ifdef KD_SSE2
+    // psadbw against zero sums each 8 bytes into a 64 bit lane.
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sums = zero;
+    for (; i + 16 <= length; i += 16) {
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(data + i)), zero));
+    }
+    checksum = (uint32_t)_mm_cvtsi128_si32(sums) + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+#endif
+    return checksum + kdChecksum(data + i, length - i);
+}
+
+const char* KdAnalyzer::packetTypeName(uint16_t type)
+{
+    static const char* names[KD_PACKET_TYPE_MAX] = {
+        "unused", "state_change32", "state_manipulate", "debug_io", "ack", "resend", "reset",
+        "state_change64", "poll_breakin", "trace_io", "control_request", "file_io",
+    };
+    return (type < KD_PACKET_TYPE_MAX) ? names[type] : "unknown";
+}
+
+bool KdAnalyzer::headerValid(const KD_PACKET_HEADER& header, size_t& packetLength) const
+{
+    if (header.PacketType == KD_PACKET_TYPE_UNUSED || header.PacketType >= KD_PACKET_TYPE_MAX) {
+        return false;
+    }
+    if (header.PacketLeader == KD_CONTROL_PACKET_LEADER) {
+        packetLength = sizeof(header);
+        return true;
+    }
+    if (header.ByteCount > KD_PACKET_MAX_SIZE) {
+        return false;
+    }
+    packetLength = sizeof(header) + header.ByteCount + 1;
+    return true;
+}
+
+void KdAnalyzer::packet(unsigned index, const uint8_t* data, uint64_t timeUs)
+{
+    Direction& direction = directions[index];
+    Stream& stream = streams[index];
+    Direction& otherDirection = directions[1 - index];
+    Stream& other = streams[1 - index];
+    KD_PACKET_HEADER header;
+    memcpy(&header, data, sizeof(header));
+
+    if (stream.hasPacket) {
+        direction.gap.add(timeUs - std::min(timeUs, stream.lastPacketUs));
+    }
+    stream.hasPacket = true;
+    stream.lastPacketUs = timeUs;
+    direction.packets[header.PacketType]++;
+
+    if (header.PacketLeader == KD_CONTROL_PACKET_LEADER) {
+        direction.controlPackets++;
+        if (header.PacketType == KD_PACKET_TYPE_ACKNOWLEDGE &&
+            other.hasData && !other.acked && header.PacketId == other.lastId) {
+            otherDirection.ack.add(timeUs - std::min(timeUs, other.lastDataUs));
+            other.acked = true;
+        }
+        else if (header.PacketType == KD_PACKET_TYPE_RESEND) {
+            other.resendAsked = true;
+        }
+        return;
+    }
+
+    direction.dataPackets++;
+    if (kdChecksumFast(data + sizeof(header), header.ByteCount) != header.Checksum) {
+        direction.badChecksums++;
+    }
+    if (data[sizeof(header) + header.ByteCount] != KD_PACKET_TRAILING_BYTE) {
+        direction.badTrailers++;
+    }
+    if (stream.hasData && header.PacketType == stream.lastType && header.PacketId == stream.lastId) {
+        // the same packet again, asked for or after the sender's timeout.
+        if (stream.resendAsked) {
+            direction.resendsRequested++;
+        }
+        else {
+            direction.timeouts++;
+        }
+    }
+    else if (other.hasData && !other.answered) {
+        otherDirection.reply.add(timeUs - std::min(timeUs, other.lastDataUs));
+        other.answered = true;
+    }
+    stream.hasData = true;
+    stream.lastType = header.PacketType;
+    stream.lastId = header.PacketId;
+    stream.lastDataUs = timeUs;
+    stream.acked = false;
+    stream.answered = false;
+    stream.resendAsked = false;
+}
+
+size_t KdAnalyzer::parseCarry(unsigned index, const uint8_t* data, size_t length, uint64_t timeUs)
+{
+    Direction& direction = directions[index];
+    Stream& stream = streams[index];
+    size_t used = 0;
+
+    // the leader, every byte must repeat the first.
+    while (stream.carryLength < 4 && used < length) {
+        if (data[used] != stream.carry[0]) {
+            direction.skippedBytes += stream.carryLength;
+            stream.carryLength = 0;
+            return used;
+        }
+        stream.carry[stream.carryLength++] = data[used++];
+    }
+    if (stream.carryLength < sizeof(KD_PACKET_HEADER)) {
+        size_t take = std::min(sizeof(KD_PACKET_HEADER) - stream.carryLength, length - used);
+        memcpy(stream.carry + stream.carryLength, data + used, take);
+        stream.carryLength += take;
+        used += take;
+        if (stream.carryLength < sizeof(KD_PACKET_HEADER)) {
+            return used;
+        }
+        KD_PACKET_HEADER header;
+        memcpy(&header, stream.carry, sizeof(header));
+        if (!headerValid(header, stream.packetLength)) {
+            // search again from the byte after the leader start.
+            uint8_t rest[sizeof(KD_PACKET_HEADER) - 1];
+            memcpy(rest, stream.carry + 1, sizeof(rest));
+            direction.badHeaders++;
+            direction.skippedBytes++;
+            stream.carryLength = 0;
+            parse(index, rest, sizeof(rest), timeUs);
+            return used;
+        }
+    }
+    size_t take = std::min(stream.packetLength - stream.carryLength, length - used);
+    memcpy(stream.carry + stream.carryLength, data + used, take);
+    stream.carryLength += take;
+    used += take;
+    if (stream.carryLength == stream.packetLength) {
+        stream.carryLength = 0;
+        packet(index, stream.carry, timeUs);
+    }
+    return used;
+}
+
+void KdAnalyzer::parse(unsigned index, const uint8_t* data, size_t length, uint64_t timeUs)
+{
+    Direction& direction = directions[index];
+    Stream& stream = streams[index];
+    size_t position = 0;
+
+    while (position < length) {
+        if (stream.carryLength) {
+            position += parseCarry(index, data + position, length - position, timeUs);
+            continue;
+        }
+        size_t leader = position + kdFindLeader(data + position, length - position, direction.breakins);
+        direction.skippedBytes += leader - position;
+        position = leader;
+        KD_PACKET_HEADER header;
+        size_t packetLength = 0;
+        if (length - position >= sizeof(header)) {
+            memcpy(&header, data + position, sizeof(header));
+            if (!headerValid(header, packetLength)) {
+                direction.badHeaders++;
+                direction.skippedBytes++;
+                position++;
+                continue;
+            }
+            if (length - position >= packetLength) {
+                // the common case, the whole packet is in the record.
+                packet(index, data + position, timeUs);
+                position += packetLength;
+                continue;
+            }
+        }
+        // the packet continues in the next record of this direction.
+        if (position < length) {
+            stream.carryLength = length - position;
+            stream.packetLength = packetLength;
+            memcpy(stream.carry, data + position, stream.carryLength);
+        }
+        return;
+    }
+}
+
+void KdAnalyzer::analyze(const CaptureReader& reader, uint64_t fromUs, uint64_t toUs)
+{
+    for (unsigned index = 0; index < 2; index++) {
+        directions[index] = Direction();
+        streams[index] = Stream();
+    }
+    totalBytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    records = reader.forEach(fromUs, toUs, CAPTURE_RECEIVED | CAPTURE_WRITTEN, [this](const CaptureEntry& entry) {
+        unsigned index = (entry.direction == CAPTURE_RECEIVED) ? 0 : 1;
+        directions[index].bytes += entry.length;
+        totalBytes += entry.length;
+        parse(index, entry.data, entry.length, entry.timeUs);
+        return true;
+    });
+    for (unsigned index = 0; index < 2; index++) {
+        // a packet the capture ended in.
+        directions[index].skippedBytes += streams[index].carryLength;
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void KdAnalyzer::print() const
+{
+    std::ostringstream text;
+    text.precision(2);
+    text << std::fixed;
+    text << "kd analysis of " << records << " records, " << totalBytes << " bytes in " << seconds << " s";
+    if (seconds > 0) {
+        text << " (" << totalBytes / seconds / 1e6 << " MB/s)";
+    }
+    for (unsigned index = 0; index < 2; index++) {
+        const Direction& direction = directions[index];
+        text << "\n" << (index == 0 ? "rx, received from the peer:" : "tx, written to the port:") << "\n" <<
+            "  packets:  " << direction.dataPackets << " data, " << direction.controlPackets << " control, " <<
+            direction.breakins << " breakins, " << direction.skippedBytes << " of " << direction.bytes <<
+            " bytes outside packets\n" <<
+            "  types:   ";
+        for (uint16_t type = 1; type < KD_PACKET_TYPE_MAX; type++) {
+            if (direction.packets[type]) {
+                text << " " << packetTypeName(type) << " " << direction.packets[type];
+            }
+        }
+        text << "\n" <<
+            "  errors:   " << direction.badChecksums << " bad checksums, " << direction.badTrailers <<
+            " bad trailers, " << direction.badHeaders << " bad headers\n" <<
+            "  resends:  " << direction.resendsRequested << " asked for (" <<
+            percent(direction.resendsRequested, direction.dataPackets) << "%), " << direction.timeouts <<
+            " after a timeout (" << percent(direction.timeouts, direction.dataPackets) << "%)\n" <<
+            "  ack us:   " << percentiles(direction.ack) << "\n" <<
+            "  reply us: " << percentiles(direction.reply) << "\n" <<
+            "  gap us:   " << percentiles(direction.gap);
+    }
+    logger << text.str();
+    logger.flush(Logger::INFO_LVL);
+}
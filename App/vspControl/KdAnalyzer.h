@@ -0,0 +1,102 @@
+#pragma once
+#include "CaptureReader.h"
+#include "KdProtocol.h"
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief The offset of the first packet leader in data, four equal leader bytes of a
+ * data or control packet, or of the leader bytes a shorter run at the end could start.
+ * length if there is neither. Breakin bytes before the offset are added to breakins.
+ *
+ * Searches 16 bytes at a time with sse2 where the compiler targets it.
+ */
+size_t kdFindLeader(const uint8_t* data, size_t length, uint64_t& breakins);
+
+/**
+ * @brief kdChecksum, 16 bytes at a time with sse2.
+ */
+uint32_t kdChecksumFast(const uint8_t* data, size_t length);
+
+/**
+ * @brief Parses the kd packets of a capture log offline, to triage a slow debugging
+ * session.
+ *
+ * The received and the written records are two byte streams, each split into packets
+ * in place in the mapped segments: the leader search and the checksums run over the
+ * mapping, only a packet that spans records is copied. For each direction it counts
+ * the packets by type, the checksum and framing errors, the resends the other side
+ * asked for and the retransmits without one, which the sender made at its timeout,
+ * and the latencies of the acks and the replies to its data packets, the reply being
+ * the next data packet the other way. A packet's time is that of the record that
+ * completed it.
+ */
+class KdAnalyzer {
+public:
+    struct Latencies {
+        std::vector<uint32_t> us;
+        void add(uint64_t value) { us.push_back((uint32_t)std::min<uint64_t>(value, UINT32_MAX)); }
+    };
+
+    struct Direction {
+        uint64_t bytes = 0;
+        uint64_t packets[KD_PACKET_TYPE_MAX] = { 0 };
+        uint64_t dataPackets = 0;
+        uint64_t controlPackets = 0;
+        uint64_t breakins = 0;
+        uint64_t skippedBytes = 0;      // outside packets, breakins included.
+        uint64_t badHeaders = 0;        // a leader followed by an unknown type or an oversized count.
+        uint64_t badChecksums = 0;
+        uint64_t badTrailers = 0;
+        uint64_t resendsRequested = 0;  // retransmits after a resend packet of the other side.
+        uint64_t timeouts = 0;          // retransmits without one.
+        Latencies ack;                  // of the data packets, until the other side acked them.
+        Latencies reply;                // of the data packets, until the other side sent one.
+        Latencies gap;                  // between packets.
+    };
+
+    /**
+     * @brief Analyzes the records from fromUs to toUs since the capture started.
+     */
+    void analyze(const CaptureReader& reader, uint64_t fromUs, uint64_t toUs);
+
+    /**
+     * @brief Logs the counts, rates and latency percentiles of both directions.
+     */
+    void print() const;
+
+    const Direction& received() const { return directions[0]; }
+    const Direction& written() const { return directions[1]; }
+
+    static const char* packetTypeName(uint16_t type);
+
+private:
+    // the parse state and the protocol state of a direction.
+    struct Stream {
+        uint8_t carry[sizeof(KD_PACKET_HEADER) + KD_PACKET_MAX_SIZE + 1];
+        size_t carryLength = 0;
+        size_t packetLength = 0;        // of the packet in carry once its header is complete.
+        bool hasPacket = false;
+        uint64_t lastPacketUs = 0;
+        bool hasData = false;
+        uint16_t lastType = 0;
+        uint32_t lastId = 0;
+        uint64_t lastDataUs = 0;
+        bool acked = false;
+        bool answered = false;
+        bool resendAsked = false;       // the other side sent a resend since the last data packet.
+    };
+
+    void parse(unsigned index, const uint8_t* data, size_t length, uint64_t timeUs);
+    size_t parseCarry(unsigned index, const uint8_t* data, size_t length, uint64_t timeUs);
+    bool headerValid(const KD_PACKET_HEADER& header, size_t& packetLength) const;
+    void packet(unsigned index, const uint8_t* packet, uint64_t timeUs);
+
+    Direction directions[2];
+    Stream streams[2];
+    uint64_t records = 0;
+    uint64_t totalBytes = 0;
+    double seconds = 0;
+};
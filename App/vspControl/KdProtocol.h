@@ -0,0 +1,169 @@
+#pragma once
+//
+// the windows kernel debugger serial packet format.
+// See the KD_PACKET definitions in the windbg sdk (windbgkd.h).
+//
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#define KD_PACKET_LEADER                0x30303030  // data packets
+#define KD_CONTROL_PACKET_LEADER        0x69696969  // ack, resend, reset
+#define KD_PACKET_LEADER_BYTE           0x30
+#define KD_CONTROL_PACKET_LEADER_BYTE   0x69
+#define KD_BREAKIN_PACKET_BYTE          0x62
+#define KD_PACKET_TRAILING_BYTE         0xAA
+#define KD_PACKET_MAX_SIZE              4000
+
+#define KD_PACKET_TYPE_UNUSED           0
+#define KD_PACKET_TYPE_STATE_CHANGE32   1
+#define KD_PACKET_TYPE_STATE_MANIPULATE 2
+#define KD_PACKET_TYPE_DEBUG_IO         3
+#define KD_PACKET_TYPE_ACKNOWLEDGE      4
+#define KD_PACKET_TYPE_RESEND           5
+#define KD_PACKET_TYPE_RESET            6
+#define KD_PACKET_TYPE_STATE_CHANGE64   7
+#define KD_PACKET_TYPE_POLL_BREAKIN     8
+#define KD_PACKET_TYPE_TRACE_IO         9
+#define KD_PACKET_TYPE_CONTROL_REQUEST  10
+#define KD_PACKET_TYPE_FILE_IO          11
+#define KD_PACKET_TYPE_MAX              12
+
+#define KD_INITIAL_PACKET_ID            0x80800000
+#define KD_SYNC_PACKET_ID               0x00000800
+
+#pragma pack(push, 1)
+struct KD_PACKET_HEADER {
+    uint32_t PacketLeader;
+    uint16_t PacketType;
+    uint16_t ByteCount;
+    uint32_t PacketId;
+    uint32_t Checksum;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(KD_PACKET_HEADER) == 16, "KD_PACKET_HEADER must match the wire format");
+
+/**
+ * @brief The kd checksum, a byte sum of the packet data.
+ */
+inline uint32_t kdChecksum(const uint8_t* data, size_t length)
+{
+    uint32_t checksum = 0;
+    for (size_t i = 0; i < length; i++) {
+        checksum += data[i];
+    }
+    return checksum;
+}
+
+/**
+ * @brief Builds a data packet: header, data and the trailing byte.
+ *
+ * @param out Receives the packet, must hold sizeof(KD_PACKET_HEADER) + length + 1 bytes.
+ * @return size_t The packet size.
+ */
+inline size_t kdBuildDataPacket(uint8_t* out, uint16_t type, uint32_t id, const uint8_t* data, uint16_t length)
+{
+    KD_PACKET_HEADER header = { KD_PACKET_LEADER, type, length, id, kdChecksum(data, length) };
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), data, length);
+    out[sizeof(header) + length] = KD_PACKET_TRAILING_BYTE;
+    return sizeof(header) + length + 1;
+}
+
+/**
+ * @brief Builds a control packet, which has no data and no trailing byte.
+ *
+ * @param out Receives the packet, must hold sizeof(KD_PACKET_HEADER) bytes.
+ * @return size_t The packet size.
+ */
+inline size_t kdBuildControlPacket(uint8_t* out, uint16_t type, uint32_t id)
+{
+    KD_PACKET_HEADER header = { KD_CONTROL_PACKET_LEADER, type, 0, id, 0 };
+    memcpy(out, &header, sizeof(header));
+    return sizeof(header);
+}
+
+/**
+ * @brief Splits a serial byte stream into kd packets.
+ *
+ * Bytes outside a packet are skipped, except a lone breakin byte. A packet starts
+ * with four identical leader bytes, so a partial leader resynchronizes on the next one.
+ */
+class KdStreamParser {
+public:
+    enum Result { None, Breakin, Control, Data };
+
+    /**
+     * @brief Consumes one byte.
+     *
+     * @return Result The kind of packet the byte completed, else None.
+     */
+    Result feed(uint8_t value)
+    {
+        switch (state) {
+        case Leader:
+            if (value == KD_PACKET_LEADER_BYTE || value == KD_CONTROL_PACKET_LEADER_BYTE) {
+                leaderCount = (value == leaderByte) ? leaderCount + 1 : 1;
+                leaderByte = value;
+                if (leaderCount == 4) {
+                    headerLength = 4;
+                    memset(&packet, 0, sizeof(packet));
+                    memset(&packet, value, 4);
+                    state = Header;
+                }
+                return None;
+            }
+            leaderCount = 0;
+            return (value == KD_BREAKIN_PACKET_BYTE) ? Breakin : None;
+
+        case Header:
+            ((uint8_t*)&packet)[headerLength++] = value;
+            if (headerLength < sizeof(packet)) {
+                return None;
+            }
+            leaderCount = 0;
+            if (packet.PacketLeader == KD_CONTROL_PACKET_LEADER) {
+                state = Leader;
+                return Control;
+            }
+            if (packet.ByteCount > KD_PACKET_MAX_SIZE) {
+                state = Leader;
+                return None;
+            }
+            dataLength = 0;
+            checksum = 0;
+            state = packet.ByteCount ? Payload : Trailer;
+            return None;
+
+        case Payload:
+            data[dataLength++] = value;
+            checksum += value;
+            if (dataLength == packet.ByteCount) {
+                state = Trailer;
+            }
+            return None;
+
+        case Trailer:
+            state = Leader;
+            return (value == KD_PACKET_TRAILING_BYTE) ? Data : None;
+        }
+        return None;
+    }
+
+    const KD_PACKET_HEADER& header() const { return packet; }
+    const uint8_t* payload() const { return data; }
+    bool checksumValid() const { return checksum == packet.Checksum; }
+
+private:
+    enum State { Leader, Header, Payload, Trailer };
+
+    State state = Leader;
+    uint8_t leaderByte = 0;
+    size_t leaderCount = 0;
+    size_t headerLength = 0;
+    size_t dataLength = 0;
+    uint32_t checksum = 0;
+    KD_PACKET_HEADER packet = { 0 };
+    uint8_t data[KD_PACKET_MAX_SIZE];
+};
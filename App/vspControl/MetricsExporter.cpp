@@ -0,0 +1,472 @@
+#include "MetricsExporter.h"
+#include <charconv>
+#include <cstring>
+#include <sstream>
+#include <ws2tcpip.h>
+#include "Logger.h"
+
+extern Logger logger;
+
+namespace {
+
+    // a client has this long to send its request, and again to take the
+    // response. The single serve thread handles one client at a time.
+    const DWORD clientTimeoutMs = 2000;
+
+    struct CounterDesc {
+        const char* name;
+        const char* help;
+        INT64 HTS_VSP_REPORT::* field;
+    };
+
+    // the DWORD fields of the report, mostly gauges. A count that only
+    // grows is a counter, its name ends in _total.
+    struct DwordDesc {
+        const char* name;
+        const char* help;
+        const char* type;
+        DWORD HTS_VSP_REPORT::* field;
+    };
+
+    struct HistogramDesc {
+        const char* name;
+        const char* help;
+        INT64(HTS_VSP_REPORT::* buckets)[HTS_VSP_HISTOGRAM_BUCKETS];
+        INT64 HTS_VSP_REPORT::* sum;   // may be NULL
+        INT64 HTS_VSP_REPORT::* count; // may be NULL, then the buckets are summed.
+        double scale;                  // converts the bucket unit to the metric unit.
+    };
+
+    const CounterDesc counters[] = {
+        { "htsvsp_bytes_written_total", "Bytes sent to the network peer.", &HTS_VSP_REPORT::bytesWritten },
+        { "htsvsp_bytes_read_total", "Bytes received from the network peer.", &HTS_VSP_REPORT::bytesRead },
+        { "htsvsp_interval_timer_events_total", "Read interval timer expirations.", &HTS_VSP_REPORT::intervalTimerEvents },
+        { "htsvsp_total_timer_events_total", "Read total timer expirations.", &HTS_VSP_REPORT::totalTimerEvents },
+        { "htsvsp_socket_events_total", "Socket event wakeups.", &HTS_VSP_REPORT::totalSocketEvents },
+        { "htsvsp_socket_read_events_total", "Socket events with FD_READ set.", &HTS_VSP_REPORT::sockReadEvents },
+        { "htsvsp_recv_data_total", "recv calls that returned data.", &HTS_VSP_REPORT::sockRecvData },
+        { "htsvsp_read_queue_events_total", "Read queue ready wakeups.", &HTS_VSP_REPORT::readQueueEvents },
+        { "htsvsp_read_dequeues_total", "Read requests taken from the read queue.", &HTS_VSP_REPORT::readDequeue },
+        { "htsvsp_wait_timeouts_total", "Read requests completed by the wait unit timeout.", &HTS_VSP_REPORT::waitTimeouts },
+        { "htsvsp_spin_waits_total", "Waits that spun before blocking.", &HTS_VSP_REPORT::spinWaits },
+        { "htsvsp_spin_hits_total", "Waits that ended while spinning.", &HTS_VSP_REPORT::spinHits },
+        { "htsvsp_spin_microseconds_total", "Time spent spinning, cpu busy.", &HTS_VSP_REPORT::spinUs },
+        { "htsvsp_spin_saved_microseconds_total", "Estimated wakeup latency saved by spin hits.", &HTS_VSP_REPORT::spinSavedUs },
+        { "htsvsp_downtime_microseconds_total", "Time a client port spent reconnecting.", &HTS_VSP_REPORT::downtimeUs },
+        { "htsvsp_backlog_bytes_total", "Bytes written while reconnecting, sent after the reconnect.", &HTS_VSP_REPORT::backlogBytes },
+        { "htsvsp_backlog_dropped_bytes_total", "Bytes written while reconnecting or held by an xoff that did not fit the backlog.", &HTS_VSP_REPORT::backlogDroppedBytes },
+        { "htsvsp_tap_bytes_total", "Bytes sent to the taps of a service port, all of them.", &HTS_VSP_REPORT::tapBytes },
+        { "htsvsp_tap_dropped_bytes_total", "Copies dropped for taps that did not keep up.", &HTS_VSP_REPORT::tapDroppedBytes },
+        { "htsvsp_compress_raw_bytes_total", "Bytes written to a compressed client, before compression.", &HTS_VSP_REPORT::compressRawBytes },
+        { "htsvsp_compress_wire_bytes_total", "Bytes sent for them, block headers included.", &HTS_VSP_REPORT::compressWireBytes },
+        { "htsvsp_decompress_wire_bytes_total", "Bytes received by a compressed client, block headers included.", &HTS_VSP_REPORT::decompressWireBytes },
+        { "htsvsp_decompress_raw_bytes_total", "Bytes read from them, after decompression.", &HTS_VSP_REPORT::decompressRawBytes },
+        { "htsvsp_compress_microseconds_total", "Time spent compressing.", &HTS_VSP_REPORT::compressUs },
+        { "htsvsp_decompress_microseconds_total", "Time spent decompressing.", &HTS_VSP_REPORT::decompressUs },
+        { "htsvsp_udp_datagrams_sent_total", "Datagrams sent by a udp client.", &HTS_VSP_REPORT::udpDatagramsSent },
+        { "htsvsp_udp_datagrams_received_total", "Datagrams received by a udp client.", &HTS_VSP_REPORT::udpDatagramsReceived },
+        { "htsvsp_udp_retransmits_total", "Data packets a udp client sent again.", &HTS_VSP_REPORT::udpRetransmits },
+        { "htsvsp_udp_fast_retransmits_total", "Of those, sent again on selective acks before the timeout.", &HTS_VSP_REPORT::udpFastRetransmits },
+        { "htsvsp_udp_timeouts_total", "Retransmit timeouts of a udp client.", &HTS_VSP_REPORT::udpTimeouts },
+        { "htsvsp_udp_duplicates_total", "Data packets a udp client received twice.", &HTS_VSP_REPORT::udpDuplicates },
+        { "htsvsp_capture_records_total", "Receives and writes captured, since the capture started.", &HTS_VSP_REPORT::captureRecords },
+        { "htsvsp_capture_bytes_total", "Their data.", &HTS_VSP_REPORT::captureBytes },
+        { "htsvsp_capture_dropped_records_total", "Receives and writes the capture log could not take.", &HTS_VSP_REPORT::captureDroppedRecords },
+        { "htsvsp_flow_pauses_total", "Times receiving stopped at the high watermark or for rts dropped under the handshake.", &HTS_VSP_REPORT::flowPauses },
+        { "htsvsp_flow_resumes_total", "Times receiving went on at the low watermark.", &HTS_VSP_REPORT::flowResumes },
+        { "htsvsp_flow_overrun_bytes_total", "Bytes received past the high watermark, a port without flow control would drop them.", &HTS_VSP_REPORT::flowOverrunBytes },
+        { "htsvsp_flow_held_bytes_total", "Bytes written while an xoff held the transmit.", &HTS_VSP_REPORT::flowHeldBytes },
+        { "htsvsp_overflow_events_total", "Receives that found the receive ring full.", &HTS_VSP_REPORT::overflowEvents },
+        { "htsvsp_overflow_bytes_total", "Received bytes dropped by the overflow policy.", &HTS_VSP_REPORT::overflowBytes },
+        { "htsvsp_overflow_timeouts_total", "Times the block overflow policy gave up waiting for room.", &HTS_VSP_REPORT::overflowTimeouts },
+        { "htsvsp_pool_runs_total", "Runs of the port loops on the worker pool of the driver host.", &HTS_VSP_REPORT::poolRuns },
+        { "htsvsp_pool_steals_total", "Runs taken from the queue of another worker.", &HTS_VSP_REPORT::poolSteals },
+        { "htsvsp_pool_yields_total", "Runs that gave up the worker to the ports queued behind.", &HTS_VSP_REPORT::poolYields },
+        { "htsvsp_pool_wakeups_total", "Port loop waits that ended for a signalled source.", &HTS_VSP_REPORT::poolWakeups },
+        { "htsvsp_pool_timeouts_total", "Port loop waits that ended at their timeout.", &HTS_VSP_REPORT::poolTimeouts },
+        { "htsvsp_pool_schedule_errors_total", "Priorities and cpu affinities a pool thread could not take.", &HTS_VSP_REPORT::poolScheduleErrors },
+    };
+
+    const DwordDesc dwords[] = {
+        { "htsvsp_trace_level", "Driver trace level.", "gauge", &HTS_VSP_REPORT::traceLevel },
+        { "htsvsp_wait_units", "Number of 500ms wait units before a read times out.", "gauge", &HTS_VSP_REPORT::waitUnits },
+        { "htsvsp_spin_max_microseconds", "Spin limit of the port, 0 is off.", "gauge", &HTS_VSP_REPORT::spinMaxUs },
+        { "htsvsp_spin_budget_microseconds", "Spin of the next wait.", "gauge", &HTS_VSP_REPORT::spinBudgetUs },
+        { "htsvsp_wake_latency_microseconds", "Average latency of a blocked wait.", "gauge", &HTS_VSP_REPORT::wakeLatencyUs },
+        { "htsvsp_connect_latency_microseconds", "Last client connect, first attempt until one connected.", "gauge", &HTS_VSP_REPORT::connectLatencyUs },
+        { "htsvsp_connect_attempts", "Addresses tried by the last client connect.", "gauge", &HTS_VSP_REPORT::connectAttemptCount },
+        { "htsvsp_connection_state", "0 idle, 1 listening, 2 connected, 3 reconnecting, 4 connecting at device start.", "gauge", &HTS_VSP_REPORT::connectionState },
+        { "htsvsp_startup_connect_microseconds", "Device start until the saved configuration connected.", "gauge", &HTS_VSP_REPORT::startupConnectUs },
+        { "htsvsp_in_place_configures_total", "Configurations applied without restarting the port.", "counter", &HTS_VSP_REPORT::inPlaceConfigures },
+        { "htsvsp_connection_state_changes_total", "Connection state transitions.", "counter", &HTS_VSP_REPORT::stateChanges },
+        { "htsvsp_disconnects_total", "Client connections lost.", "counter", &HTS_VSP_REPORT::disconnects },
+        { "htsvsp_reconnect_attempts_total", "Reconnects tried after a lost connection.", "counter", &HTS_VSP_REPORT::reconnectAttempts },
+        { "htsvsp_tap_clients", "Taps connected to a service port.", "gauge", &HTS_VSP_REPORT::tapClients },
+        { "htsvsp_tap_disconnects_total", "Taps closed because they did not keep up.", "counter", &HTS_VSP_REPORT::tapDisconnects },
+        { "htsvsp_udp_srtt_microseconds", "Smoothed round trip time of a udp client.", "gauge", &HTS_VSP_REPORT::udpSrttUs },
+        { "htsvsp_udp_rto_microseconds", "Retransmit timeout of a udp client.", "gauge", &HTS_VSP_REPORT::udpRtoUs },
+        { "htsvsp_capture_segments", "Segment files of the capture log.", "gauge", &HTS_VSP_REPORT::captureSegments },
+        { "htsvsp_flow_high_water_bytes", "Receive ring level at which receiving stops.", "gauge", &HTS_VSP_REPORT::flowHighWater },
+        { "htsvsp_flow_low_water_bytes", "Receive ring level at which receiving goes on.", "gauge", &HTS_VSP_REPORT::flowLowWater },
+        { "htsvsp_overflow_policy", "0 block, 1 drop newest, 2 drop oldest.", "gauge", &HTS_VSP_REPORT::overflowPolicy },
+        { "htsvsp_overflow_timeout_milliseconds", "How long the block policy stops the peer, 0 for ever.", "gauge", &HTS_VSP_REPORT::overflowTimeoutMs },
+        { "htsvsp_pool_workers", "Workers of the pool that runs the port loops.", "gauge", &HTS_VSP_REPORT::poolWorkers },
+        { "htsvsp_pool_works", "Port loops on the worker pool.", "gauge", &HTS_VSP_REPORT::poolWorks },
+        { "htsvsp_pool_priority", "Priority of the worker pool, 0 normal, 1 latency, 2 bulk.", "gauge", &HTS_VSP_REPORT::poolPriority },
+        { "htsvsp_schedule_priority", "Priority of the port loops, 0 normal, 1 latency, 2 bulk.", "gauge", &HTS_VSP_REPORT::schedulePriority },
+    };
+
+    const HistogramDesc histograms[] = {
+        { "htsvsp_read_latency_seconds", "Time from read request arrival to completion.",
+            &HTS_VSP_REPORT::readLatencyUs, &HTS_VSP_REPORT::readLatencySumUs, &HTS_VSP_REPORT::readsCompleted, 1e-6 },
+        { "htsvsp_recv_size_bytes", "Bytes returned by each successful recv.",
+            &HTS_VSP_REPORT::recvSize, &HTS_VSP_REPORT::bytesRead, NULL, 1.0 },
+    };
+
+    void append(std::string& out, INT64 value)
+    {
+        char buffer[24];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        out.append(buffer, result.ptr);
+    }
+
+    void append(std::string& out, double value)
+    {
+        char buffer[32];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        out.append(buffer, result.ptr);
+    }
+
+    void appendPortLabel(std::string& out, const std::string& label)
+    {
+        out += "{port=\"";
+        out += label;
+        out += '"';
+    }
+
+    void appendHeader(std::string& out, const char* name, const char* help, const char* type)
+    {
+        out += "# HELP ";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += ' ';
+        out += type;
+        out += '\n';
+    }
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    for (auto& port : ports) {
+        if (port.handle != INVALID_HANDLE_VALUE) {
+            CloseHandle(port.handle);
+        }
+    }
+}
+
+size_t MetricsExporter::discoverPorts()
+{
+    std::vector<ULONG> portNumbers(16);
+    ULONG portNumbersFound = 0;
+
+    ULONG result = GetCommPorts(portNumbers.data(), (ULONG)portNumbers.size(), &portNumbersFound);
+    if (result == ERROR_MORE_DATA) {
+        portNumbers.resize(portNumbersFound);
+        result = GetCommPorts(portNumbers.data(), (ULONG)portNumbers.size(), &portNumbersFound);
+    }
+    if (result != ERROR_SUCCESS) {
+        logger << "GetCommPorts failed error: " << result << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 0;
+    }
+
+    for (ULONG i = 0; i < portNumbersFound; i++) {
+        HANDLE h = OpenCommPort(portNumbers[i], GENERIC_READ | GENERIC_WRITE, FILE_FLAG_OVERLAPPED);
+        if (h == INVALID_HANDLE_VALUE) {
+            continue;
+        }
+        ULONG bytesReturned;
+        if (!DeviceIoControl(h, IOCTL_HTSVSP_IDENTIFY, NULL, 0, NULL, 0, &bytesReturned, NULL)) {
+            CloseHandle(h);
+            continue;
+        }
+        Port port = { portNumbers[i], "COM" + std::to_string(portNumbers[i]), h, false, { 0 } };
+        ports.push_back(port);
+        logger << "metrics: exporting htsvsp at \\\\.\\" << port.label << "\n";
+        logger.flush(Logger::INFO_LVL);
+    }
+    return ports.size();
+}
+
+bool MetricsExporter::queryPort(Port& port)
+{
+    if (port.handle == INVALID_HANDLE_VALUE) {
+        // the previous report failed. The device may have been restarted,
+        // reopen it once rather than on every scrape.
+        port.handle = OpenCommPort(port.number, GENERIC_READ | GENERIC_WRITE, FILE_FLAG_OVERLAPPED);
+        if (port.handle == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+    }
+    ULONG bytesReturned;
+    if (!DeviceIoControl(port.handle, IOCTL_HTSVSP_REPORT,
+        NULL, 0, &port.report, sizeof(port.report), &bytesReturned, NULL)) {
+        CloseHandle(port.handle);
+        port.handle = INVALID_HANDLE_VALUE;
+        return false;
+    }
+    return true;
+}
+
+const std::string& MetricsExporter::scrape()
+{
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    scrapes++;
+    for (auto& port : ports) {
+        port.up = queryPort(port);
+        if (!port.up) {
+            scrapeErrors++;
+        }
+    }
+
+    body.clear();
+    appendHeader(body, "htsvsp_up", "1 if the port report could be read.", "gauge");
+    for (auto& port : ports) {
+        body += "htsvsp_up";
+        appendPortLabel(body, port.label);
+        body += "} ";
+        body += port.up ? '1' : '0';
+        body += '\n';
+    }
+
+    for (auto& counter : counters) {
+        appendHeader(body, counter.name, counter.help, "counter");
+        for (auto& port : ports) {
+            if (!port.up) {
+                continue;
+            }
+            body += counter.name;
+            appendPortLabel(body, port.label);
+            body += "} ";
+            append(body, port.report.*counter.field);
+            body += '\n';
+        }
+    }
+
+    for (auto& dword : dwords) {
+        appendHeader(body, dword.name, dword.help, dword.type);
+        for (auto& port : ports) {
+            if (!port.up) {
+                continue;
+            }
+            body += dword.name;
+            appendPortLabel(body, port.label);
+            body += "} ";
+            append(body, (INT64)(port.report.*dword.field));
+            body += '\n';
+        }
+    }
+
+    for (auto& histogram : histograms) {
+        appendHeader(body, histogram.name, histogram.help, "histogram");
+        for (auto& port : ports) {
+            if (!port.up) {
+                continue;
+            }
+            const INT64* buckets = port.report.*histogram.buckets;
+            INT64 cumulative = 0;
+            for (int n = 0; n < HTS_VSP_HISTOGRAM_BUCKETS; n++) {
+                cumulative += buckets[n];
+                body += histogram.name;
+                body += "_bucket";
+                appendPortLabel(body, port.label);
+                body += ",le=\"";
+                if (n == HTS_VSP_HISTOGRAM_BUCKETS - 1) {
+                    body += "+Inf";
+                }
+                else {
+                    append(body, (double)(1ULL << n) * histogram.scale);
+                }
+                body += "\"} ";
+                append(body, cumulative);
+                body += '\n';
+            }
+            if (histogram.sum) {
+                body += histogram.name;
+                body += "_sum";
+                appendPortLabel(body, port.label);
+                body += "} ";
+                append(body, (double)(port.report.*histogram.sum) * histogram.scale);
+                body += '\n';
+            }
+            body += histogram.name;
+            body += "_count";
+            appendPortLabel(body, port.label);
+            body += "} ";
+            append(body, histogram.count ? port.report.*histogram.count : cumulative);
+            body += '\n';
+        }
+    }
+
+    QueryPerformanceCounter(&end);
+    appendHeader(body, "htsvsp_scrapes_total", "Scrapes served by this exporter.", "counter");
+    body += "htsvsp_scrapes_total ";
+    append(body, scrapes);
+    body += '\n';
+    appendHeader(body, "htsvsp_scrape_errors_total", "Port reports that could not be read.", "counter");
+    body += "htsvsp_scrape_errors_total ";
+    append(body, scrapeErrors);
+    body += '\n';
+    appendHeader(body, "htsvsp_scrape_duration_seconds", "Time spent collecting this scrape.", "gauge");
+    body += "htsvsp_scrape_duration_seconds ";
+    append(body, (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart);
+    body += '\n';
+    return body;
+}
+
+void MetricsExporter::handleClient(SOCKET client)
+{
+    char request[2048];
+    int length = 0;
+
+    // only the request line matters, read until the end of the headers. A
+    // client that does not get there before the deadline is dropped, even one
+    // that trickles in a byte at a time.
+    ULONGLONG deadline = GetTickCount64() + clientTimeoutMs;
+    DWORD timeoutMs;
+    while (length < (int)sizeof(request) - 1) {
+        ULONGLONG now = GetTickCount64();
+        if (now >= deadline) {
+            logger << "metrics: request timed out\n";
+            logger.flush(Logger::VERBOSE_LVL);
+            return;
+        }
+        timeoutMs = (DWORD)(deadline - now);
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeoutMs, sizeof(timeoutMs));
+        int result = recv(client, request + length, (int)sizeof(request) - 1 - length, 0);
+        if (result <= 0) {
+            return;
+        }
+        length += result;
+        request[length] = 0;
+        if (strstr(request, "\r\n\r\n") != NULL) {
+            break;
+        }
+    }
+    request[length] = 0;
+
+    const char* status = "200 OK";
+    const std::string* content = NULL;
+    if ((strncmp(request, "GET /metrics ", 13) == 0) ||
+        (strncmp(request, "GET /metrics?", 13) == 0)) {
+        content = &scrape();
+    }
+    else {
+        status = "404 Not Found";
+    }
+
+    response.clear();
+    response += "HTTP/1.1 ";
+    response += status;
+    response += "\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: ";
+    append(response, (INT64)(content ? content->size() : 0));
+    response += "\r\nConnection: close\r\n\r\n";
+    if (content) {
+        response += *content;
+    }
+
+    // the response has the same deadline, a client that does not read it
+    // in time is dropped.
+    deadline = GetTickCount64() + clientTimeoutMs;
+    size_t sent = 0;
+    while (sent < response.size()) {
+        ULONGLONG now = GetTickCount64();
+        if (now >= deadline) {
+            logger << "metrics: response timed out\n";
+            logger.flush(Logger::VERBOSE_LVL);
+            return;
+        }
+        timeoutMs = (DWORD)(deadline - now);
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeoutMs, sizeof(timeoutMs));
+        int result = send(client, response.data() + sent, (int)(response.size() - sent), 0);
+        if (result == SOCKET_ERROR) {
+            logger << "metrics: send error: " << WSAGetLastError() << "\n";
+            logger.flush(Logger::VERBOSE_LVL);
+            return;
+        }
+        sent += result;
+    }
+}
+
+int MetricsExporter::serve(const std::string& address, USHORT port)
+{
+    WSADATA wsaData = { 0 };
+    UINT32 status = WSAStartup(WINSOCK_VERSION, &wsaData);
+    if (status != NO_ERROR) {
+        logger << "metrics: WSAStartup error " << status << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+
+    SOCKET srvSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (srvSocket == INVALID_SOCKET) {
+        logger << "metrics: socket() error " << WSAGetLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        WSACleanup();
+        return 1;
+    }
+
+    sockaddr_in service = { 0 };
+    service.sin_family = AF_INET;
+    service.sin_port = htons(port);
+    service.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (!address.empty() &&
+        inet_pton(AF_INET, address.c_str(), &service.sin_addr) != 1) {
+        logger << "metrics: invalid address " << address << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        closesocket(srvSocket);
+        WSACleanup();
+        return 1;
+    }
+
+    if ((bind(srvSocket, (sockaddr*)&service, sizeof(service)) == SOCKET_ERROR) ||
+        (listen(srvSocket, SOMAXCONN) == SOCKET_ERROR)) {
+        logger << "metrics: bind/listen error " << WSAGetLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        closesocket(srvSocket);
+        WSACleanup();
+        return 1;
+    }
+
+    char addressString[INET_ADDRSTRLEN] = { 0 };
+    inet_ntop(AF_INET, &service.sin_addr, addressString, sizeof(addressString));
+    logger << "metrics: serving http://" << addressString << ":" << port << "/metrics\n";
+    logger.flush(Logger::INFO_LVL);
+
+    body.reserve(64 * 1024);
+    response.reserve(64 * 1024);
+
+    int result = 0;
+    for (;;) {
+        SOCKET client = accept(srvSocket, NULL, NULL);
+        if (client == INVALID_SOCKET) {
+            logger << "metrics: accept error: " << WSAGetLastError() << "\n";
+            logger.flush(Logger::ERROR_LVL);
+            result = 1;
+            break;
+        }
+        handleClient(client);
+        shutdown(client, SD_SEND);
+        closesocket(client);
+    }
+
+    closesocket(srvSocket);
+    WSACleanup();
+    return result;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <winsock2.h>
+#include <htsvsp.h>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Serves the statistics of every htsvsp port as a Prometheus/OpenMetrics text endpoint.
+ *
+ * The htsvsp ports are discovered once, when the exporter starts, and a device handle is
+ * kept open for each of them. A scrape only issues IOCTL_HTSVSP_REPORT on the cached
+ * handles and formats the result into a reused buffer.
+ */
+class MetricsExporter {
+public:
+    MetricsExporter() {}
+    ~MetricsExporter();
+
+    /**
+     * @brief Finds all htsvsp ports and opens a handle to each of them.
+     *
+     * @return size_t The number of ports found.
+     */
+    size_t discoverPorts();
+
+    /**
+     * @brief Serves http GET /metrics requests until the listening socket fails.
+     *
+     * @param address The local address to bind to, loopback if empty.
+     * @param port The tcp port to listen on.
+     * @return int 0 on normal exit, else 1.
+     */
+    int serve(const std::string& address, USHORT port);
+
+    /**
+     * @brief Formats the current statistics of all cached ports.
+     *
+     * @return const std::string& The exposition text, valid until the next call.
+     */
+    const std::string& scrape();
+
+private:
+    struct Port {
+        ULONG number;
+        std::string label;
+        HANDLE handle;
+        bool up;
+        HTS_VSP_REPORT report;
+    };
+
+    bool queryPort(Port& port);
+    void handleClient(SOCKET client);
+
+    std::vector<Port> ports;
+    std::string body;
+    std::string response;
+    INT64 scrapes = 0;
+    INT64 scrapeErrors = 0;
+
+    // Prevent copying
+    MetricsExporter(const MetricsExporter& other) = delete;
+    MetricsExporter& operator=(const MetricsExporter& other) = delete;
+};
@@ -0,0 +1,767 @@
+#include "MuxRelay.h"
+#include "SocketPoller.h"
+#include "mux.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <sstream>
+#include "Logger.h"
+
+extern Logger logger;
+
+using std::chrono::steady_clock;
+
+namespace {
+    const int STOP_POLL_MS = 100;
+
+    // frames a session buffers before its channels stop reading their targets.
+    const size_t SESSION_OUTPUT_LIMIT = 256 * 1024;
+    const size_t SESSION_INPUT_SIZE = 4 * (MUX_HEADER_SIZE + MUX_MAX_PAYLOAD);
+
+    const ULONG BENCH_CHANNELS_PER_THREAD = PLATFORM_WAIT_MAX;
+    const ULONG BENCH_OPEN_TIMEOUT_MS = 5000;
+    const ULONG BENCH_WAIT_MS = 2000;
+    const size_t BENCH_CHUNK = 4096;
+    const size_t BENCH_IN_FLIGHT = 32 * 1024;
+}
+
+struct MuxRelay::Channel {
+    Session* session = nullptr;
+    USHORT id = 0;
+    SOCKET s = INVALID_SOCKET;
+    bool connecting = true;
+    ULONG credit = 0;               // data bytes the port takes.
+    std::vector<BYTE> pending;      // from the port, not yet written to the target, from head.
+    size_t head = 0;
+    ULONG consumed = 0;             // written to the target since the last credit frame.
+    ULONG events = 0;
+    INT64 bytesIn = 0;              // from the target.
+    INT64 bytesOut = 0;
+};
+
+struct MuxRelay::Session {
+    SOCKET s = INVALID_SOCKET;
+    std::vector<BYTE> input;
+    size_t inputLength = 0;
+    std::vector<BYTE> output;       // frames not yet sent, from outputHead.
+    size_t outputHead = 0;
+    ULONG events = 0;
+    std::map<USHORT, std::unique_ptr<Channel>> channels;
+
+    size_t outputPending() const { return output.size() - outputHead; }
+};
+
+bool MuxRoute::parse(const std::string& text, MuxRoute& route)
+{
+    size_t equals = text.find('=');
+    size_t colon = text.rfind(':');
+    if (equals == std::string::npos || colon == std::string::npos || colon < equals) {
+        return false;
+    }
+    std::string channels = text.substr(0, equals);
+    size_t dash = channels.find('-');
+    try {
+        unsigned long first = std::stoul(channels.substr(0, dash));
+        unsigned long last = (dash == std::string::npos) ? first : std::stoul(channels.substr(dash + 1));
+        unsigned long port = std::stoul(text.substr(colon + 1));
+        if (first == 0 || last < first || last >= MUX_MAX_CHANNELS || port == 0 ||
+            port + (last - first) > 65535) {
+            return false;
+        }
+        route.first = (USHORT)first;
+        route.last = (USHORT)last;
+        route.port = (USHORT)port;
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+    route.host = text.substr(equals + 1, colon - equals - 1);
+    // [::1]:port for an ipv6 address.
+    if (route.host.size() > 2 && route.host.front() == '[' && route.host.back() == ']') {
+        route.host = route.host.substr(1, route.host.size() - 2);
+    }
+    return !route.host.empty();
+}
+
+MuxRelay::MuxRelay(const MuxRelayOptions& Options) : options(Options)
+{
+}
+
+MuxRelay::~MuxRelay()
+{
+    for (auto& entry : targets) {
+        closesocket(entry.first);
+    }
+    for (auto& entry : sessions) {
+        closesocket(entry.first);
+    }
+    if (listener != INVALID_SOCKET) {
+        closesocket(listener);
+    }
+}
+
+USHORT MuxRelay::start()
+{
+    poller.reset(new SocketPoller());
+    scratch.resize(MUX_MAX_PAYLOAD);
+
+    listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET || !poller->valid()) {
+        logger << "relay: socket error " << netLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 0;
+    }
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+
+    sockaddr_in service = { 0 };
+    service.sin_family = AF_INET;
+    service.sin_addr.s_addr = htonl(INADDR_ANY);
+    service.sin_port = htons(options.port);
+    if (!options.address.empty() && inet_pton(AF_INET, options.address.c_str(), &service.sin_addr) != 1) {
+        logger << "relay: invalid address " << options.address << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 0;
+    }
+    socklen_t length = sizeof(service);
+    if (bind(listener, (sockaddr*)&service, sizeof(service)) == SOCKET_ERROR ||
+        listen(listener, SOMAXCONN) == SOCKET_ERROR ||
+        getsockname(listener, (sockaddr*)&service, &length) == SOCKET_ERROR ||
+        !netSetNonBlocking(listener)) {
+        logger << "relay: bind or listen error " << netLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        closesocket(listener);
+        listener = INVALID_SOCKET;
+        return 0;
+    }
+    poller->set(listener, SocketPoller::Read, false);
+
+    char address[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &service.sin_addr, address, sizeof(address));
+    logger << "relay: listening on " << address << ":" << ntohs(service.sin_port) << ", channels";
+    if (options.routes.size() > 4) {
+        logger << " of " << options.routes.size() << " routes";
+    }
+    else {
+        for (auto& route : options.routes) {
+            logger << " " << route.first << "-" << route.last << "=" << route.host << ":" << route.port;
+        }
+    }
+    logger << "\n";
+    logger.flush(Logger::INFO_LVL);
+    return ntohs(service.sin_port);
+}
+
+int MuxRelay::run()
+{
+    if (listener == INVALID_SOCKET) {
+        return 1;
+    }
+    std::vector<std::pair<SOCKET, ULONG>> ready;
+    while (!stopping) {
+        if (poller->wait(STOP_POLL_MS, ready) < 0) {
+            logger << "relay: poll error " << netLastError() << "\n";
+            logger.flush(Logger::ERROR_LVL);
+            return 1;
+        }
+        for (auto& event : ready) {
+            bool readable = (event.second & SocketPoller::Read) != 0;
+            bool writable = (event.second & SocketPoller::Write) != 0;
+            if (event.first == listener) {
+                acceptSessions();
+                continue;
+            }
+            auto session = sessions.find(event.first);
+            if (session != sessions.end()) {
+                if (readable && !receiveSession(*session->second)) {
+                    closeSession(*session->second);
+                }
+                continue;
+            }
+            auto target = targets.find(event.first);
+            if (target == targets.end()) {
+                continue;
+            }
+            Channel& channel = *target->second;
+            if (channel.connecting) {
+                connected(channel);
+            }
+            else if ((!writable || writeTarget(channel)) && readable) {
+                readTarget(channel);
+            }
+        }
+
+        //
+        // the frames of every channel that had something go out together.
+        //
+        std::vector<Session*> failed;
+        for (auto& entry : sessions) {
+            if (!flush(*entry.second)) {
+                failed.push_back(entry.second.get());
+            }
+        }
+        for (auto session : failed) {
+            closeSession(*session);
+        }
+    }
+    return 0;
+}
+
+void MuxRelay::acceptSessions()
+{
+    for (;;) {
+        SOCKET s = accept(listener, NULL, NULL);
+        if (s == INVALID_SOCKET) {
+            if (!netWouldBlock(netLastError())) {
+                logger << "relay: accept error " << netLastError() << "\n";
+                logger.flush(Logger::WARNING_LVL);
+            }
+            return;
+        }
+        if (sessions.size() >= options.maxSessions) {
+            logger << "relay: refusing session, " << sessions.size() << " connected\n";
+            logger.flush(Logger::WARNING_LVL);
+            closesocket(s);
+            continue;
+        }
+        netSetNonBlocking(s);
+        netSetNoDelay(s);
+
+        std::unique_ptr<Session> session(new Session());
+        session->s = s;
+        session->input.resize(SESSION_INPUT_SIZE);
+        session->events = SocketPoller::Read;
+        poller->set(s, session->events, false);
+        sessions[s] = std::move(session);
+        logger << "relay: session connected, " << sessions.size() << " connected\n";
+        logger.flush(Logger::INFO_LVL);
+    }
+}
+
+void MuxRelay::closeSession(Session& session)
+{
+    SOCKET s = session.s;
+    logger << "relay: session closed with " << session.channels.size() << " channels open\n";
+    logger.flush(Logger::INFO_LVL);
+    while (!session.channels.empty()) {
+        closeChannel(*session.channels.begin()->second, false);
+    }
+    poller->remove(s);
+    closesocket(s);
+    sessions.erase(s);
+}
+
+// recv and dispatch the frames of a session. Returns false when it must be closed.
+bool MuxRelay::receiveSession(Session& session)
+{
+    int received = recv(session.s, (char*)session.input.data() + session.inputLength,
+        (int)(session.input.size() - session.inputLength), 0);
+    if (received == 0) {
+        return false;
+    }
+    if (received < 0) {
+        return netWouldBlock(netLastError());
+    }
+    session.inputLength += received;
+
+    size_t offset = 0;
+    MUX_HEADER header;
+    while (session.inputLength - offset >= MUX_HEADER_SIZE) {
+        if (!MuxDecodeHeader(session.input.data() + offset, &header)) {
+            logger << "relay: invalid frame, closing the session\n";
+            logger.flush(Logger::WARNING_LVL);
+            return false;
+        }
+        if (session.inputLength - offset < MUX_HEADER_SIZE + header.Length) {
+            break;
+        }
+        if (!dispatch(session, header.Type, header.Channel,
+            session.input.data() + offset + MUX_HEADER_SIZE, header.Length)) {
+            logger << "relay: protocol error on channel " << header.Channel << ", closing the session\n";
+            logger.flush(Logger::WARNING_LVL);
+            return false;
+        }
+        offset += MUX_HEADER_SIZE + header.Length;
+    }
+    memmove(session.input.data(), session.input.data() + offset, session.inputLength - offset);
+    session.inputLength -= offset;
+    return true;
+}
+
+bool MuxRelay::dispatch(Session& session, BYTE type, USHORT id, const BYTE* payload, ULONG length)
+{
+    if ((type == MUX_FRAME_OPEN || type == MUX_FRAME_CREDIT) && length != 4) {
+        return false;
+    }
+    auto entry = session.channels.find(id);
+    Channel* channel = (entry != session.channels.end()) ? entry->second.get() : nullptr;
+    switch (type) {
+    case MUX_FRAME_OPEN:
+        if (channel != nullptr || id == 0 || id >= MUX_MAX_CHANNELS) {
+            return false;
+        }
+        openChannel(session, id, MuxDecodeUlong(payload));
+        break;
+
+    case MUX_FRAME_DATA:
+        // frames that crossed the close of the channel are dropped.
+        if (channel != nullptr) {
+            if (channel->connecting || channel->pending.size() - channel->head + length > MUX_WINDOW) {
+                return false;
+            }
+            channel->pending.insert(channel->pending.end(), payload, payload + length);
+            writeTarget(*channel);
+        }
+        break;
+
+    case MUX_FRAME_CREDIT:
+        if (channel != nullptr) {
+            channel->credit += MuxDecodeUlong(payload);
+            update(*channel);
+        }
+        break;
+
+    case MUX_FRAME_CLOSE:
+        if (channel != nullptr) {
+            closeChannel(*channel, false);
+        }
+        break;
+    }
+    return true;
+}
+
+const MuxRoute* MuxRelay::route(USHORT id) const
+{
+    for (auto& route : options.routes) {
+        if (id >= route.first && id <= route.last) {
+            return &route;
+        }
+    }
+    return nullptr;
+}
+
+void MuxRelay::openChannel(Session& session, USHORT id, ULONG window)
+{
+    const MuxRoute* target = route(id);
+    if (target == nullptr) {
+        logger << "relay: channel " << id << " has no route\n";
+        logger.flush(Logger::WARNING_LVL);
+        queueFrame(session, MUX_FRAME_CLOSE, id, nullptr, 0);
+        return;
+    }
+
+    std::unique_ptr<Channel> channel(new Channel());
+    channel->session = &session;
+    channel->id = id;
+    channel->credit = window;
+
+    //
+    // the port of the vm, connected without blocking the other channels.
+    //
+    struct addrinfo hints = { };
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    std::string port = std::to_string(target->port + (id - target->first));
+    struct addrinfo* result = NULL;
+    int error = getaddrinfo(target->host.c_str(), port.c_str(), &hints, &result);
+    if (error == 0) {
+        channel->s = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+        error = (channel->s == INVALID_SOCKET) ? netLastError() : 0;
+        if (error == 0) {
+            netSetNonBlocking(channel->s);
+            netSetNoDelay(channel->s);
+            if (connect(channel->s, result->ai_addr, (socklen_t)result->ai_addrlen) == SOCKET_ERROR &&
+                !netWouldBlock(netLastError())) {
+                error = netLastError();
+            }
+        }
+        freeaddrinfo(result);
+    }
+    if (error != 0) {
+        logger << "relay: channel " << id << " cannot connect to " << target->host << ":" << port
+            << " error " << error << "\n";
+        logger.flush(Logger::WARNING_LVL);
+        if (channel->s != INVALID_SOCKET) {
+            closesocket(channel->s);
+        }
+        BYTE code[4];
+        MuxEncodeUlong((ULONG)error, code);
+        queueFrame(session, MUX_FRAME_CLOSE, id, code, sizeof(code));
+        return;
+    }
+
+    // connected() answers the open once the target took the connection.
+    channel->events = SocketPoller::Write;
+    poller->set(channel->s, channel->events, false);
+    targets[channel->s] = channel.get();
+    session.channels[id] = std::move(channel);
+}
+
+void MuxRelay::connected(Channel& channel)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(channel.s, SOL_SOCKET, SO_ERROR, (char*)&error, &length) == SOCKET_ERROR) {
+        error = netLastError();
+    }
+    if (error == 0) {
+        sockaddr_storage peer;
+        socklen_t peerLength = sizeof(peer);
+        if (getpeername(channel.s, (sockaddr*)&peer, &peerLength) == SOCKET_ERROR) {
+            // still connecting, a stale event of a reused socket.
+            return;
+        }
+    }
+    Session& session = *channel.session;
+    if (error != 0) {
+        logger << "relay: channel " << channel.id << " connect error " << error << "\n";
+        logger.flush(Logger::WARNING_LVL);
+        BYTE code[4];
+        MuxEncodeUlong((ULONG)error, code);
+        queueFrame(session, MUX_FRAME_CLOSE, channel.id, code, sizeof(code));
+        closeChannel(channel, false);
+        return;
+    }
+
+    channel.connecting = false;
+    BYTE window[4];
+    MuxEncodeUlong(MUX_WINDOW, window);
+    queueFrame(session, MUX_FRAME_OPEN, channel.id, window, sizeof(window));
+    update(channel);
+    logger << "relay: channel " << channel.id << " open, " << session.channels.size() << " open\n";
+    logger.flush(Logger::VERBOSE_LVL);
+}
+
+void MuxRelay::closeChannel(Channel& channel, bool tell)
+{
+    Session& session = *channel.session;
+    USHORT id = channel.id;
+    if (tell) {
+        queueFrame(session, MUX_FRAME_CLOSE, id, nullptr, 0);
+    }
+    logger << "relay: channel " << id << " closed, " << channel.bytesIn << " bytes in, "
+        << channel.bytesOut << " bytes out\n";
+    logger.flush(Logger::VERBOSE_LVL);
+    poller->remove(channel.s);
+    closesocket(channel.s);
+    targets.erase(channel.s);
+    session.channels.erase(id);
+}
+
+// one recv of the target into a data frame, no more than the port has credit for.
+bool MuxRelay::readTarget(Channel& channel)
+{
+    size_t length = std::min<size_t>(channel.credit, scratch.size());
+    if (length == 0) {
+        return true;
+    }
+    int received = recv(channel.s, (char*)scratch.data(), (int)length, 0);
+    if (received < 0 && netWouldBlock(netLastError())) {
+        return true;
+    }
+    if (received <= 0) {
+        closeChannel(channel, true);
+        return false;
+    }
+    channel.bytesIn += received;
+    channel.credit -= received;
+    queueFrame(*channel.session, MUX_FRAME_DATA, channel.id, scratch.data(), (ULONG)received);
+    update(channel);
+    return true;
+}
+
+// writes what the port sent and gives the credit back. Returns false if the channel closed.
+bool MuxRelay::writeTarget(Channel& channel)
+{
+    size_t length = channel.pending.size() - channel.head;
+    if (length != 0) {
+        int sent = send(channel.s, (const char*)channel.pending.data() + channel.head, (int)length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (!netWouldBlock(netLastError())) {
+                closeChannel(channel, true);
+                return false;
+            }
+            sent = 0;
+        }
+        channel.head += sent;
+        channel.bytesOut += sent;
+        channel.consumed += sent;
+        if (channel.head == channel.pending.size()) {
+            channel.pending.clear();
+            channel.head = 0;
+        }
+        if (channel.consumed >= MUX_WINDOW / 2) {
+            BYTE credit[4];
+            MuxEncodeUlong(channel.consumed, credit);
+            queueFrame(*channel.session, MUX_FRAME_CREDIT, channel.id, credit, sizeof(credit));
+            channel.consumed = 0;
+        }
+    }
+    update(channel);
+    return true;
+}
+
+void MuxRelay::queueFrame(Session& session, BYTE type, USHORT id, const BYTE* payload, ULONG length)
+{
+    BYTE header[MUX_HEADER_SIZE];
+    MUX_HEADER frame = { type, id, length };
+    MuxEncodeHeader(&frame, header);
+    session.output.insert(session.output.end(), header, header + MUX_HEADER_SIZE);
+    if (length != 0) {
+        session.output.insert(session.output.end(), payload, payload + length);
+    }
+}
+
+// sends the frames of the session. Returns false when it must be closed.
+bool MuxRelay::flush(Session& session)
+{
+    bool throttled = session.outputPending() >= SESSION_OUTPUT_LIMIT;
+    while (session.outputPending() != 0) {
+        int sent = send(session.s, (const char*)session.output.data() + session.outputHead,
+            (int)session.outputPending(), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (!netWouldBlock(netLastError())) {
+                return false;
+            }
+            break;
+        }
+        session.outputHead += sent;
+    }
+    if (session.outputHead == session.output.size()) {
+        session.output.clear();
+        session.outputHead = 0;
+    }
+    else if (session.outputHead > session.output.size() / 2) {
+        session.output.erase(session.output.begin(), session.output.begin() + session.outputHead);
+        session.outputHead = 0;
+    }
+    update(session);
+    if (throttled != (session.outputPending() >= SESSION_OUTPUT_LIMIT)) {
+        for (auto& entry : session.channels) {
+            update(*entry.second);
+        }
+    }
+    return true;
+}
+
+void MuxRelay::update(Session& session)
+{
+    ULONG events = SocketPoller::Read | (session.outputPending() ? SocketPoller::Write : 0);
+    if (events != session.events) {
+        session.events = events;
+        poller->set(session.s, events, true);
+    }
+}
+
+void MuxRelay::update(Channel& channel)
+{
+    ULONG events = 0;
+    if (channel.connecting) {
+        events = SocketPoller::Write;
+    }
+    else {
+        if (channel.credit != 0 && channel.session->outputPending() < SESSION_OUTPUT_LIMIT) {
+            events |= SocketPoller::Read;
+        }
+        if (channel.pending.size() != channel.head) {
+            events |= SocketPoller::Write;
+        }
+    }
+    if (events != channel.events) {
+        channel.events = events;
+        poller->set(channel.s, events, true);
+    }
+}
+
+//
+// the bench side. A group is the channels one thread drives, as many as a waiter takes.
+//
+struct MuxBench::Group {
+    std::vector<USHORT> ids;
+    std::vector<PLATFORM_STREAM> streams;
+    PPLATFORM_WAITER waiter = nullptr;
+    std::vector<std::vector<double>> rtts;  // of each channel.
+    INT64 bytes = 0;                        // echoed in the throughput phase.
+};
+
+void MuxBench::latency(Group& group)
+{
+    size_t count = group.streams.size();
+    group.rtts.assign(count, std::vector<double>());
+    std::vector<steady_clock::time_point> sent(count);
+    std::vector<bool> waiting(count);
+    char buffer[64];
+    for (ULONG round = 0; round < options.rounds && !failed; round++) {
+        for (size_t i = 0; i < count; i++) {
+            char byte = (char)round;
+            sent[i] = steady_clock::now();
+            waiting[i] = true;
+            if (PlatformStreamSend(group.streams[i], &byte, 1) != 1) {
+                failed = true;
+                return;
+            }
+        }
+        size_t outstanding = count;
+        while (outstanding != 0) {
+            ULONG ready = PlatformWait(group.waiter, BENCH_WAIT_MS);
+            if (ready >= count) {
+                failed = true;
+                return;
+            }
+            int received = PlatformStreamRecv(group.streams[ready], buffer, sizeof(buffer));
+            if (received > 0 && waiting[ready]) {
+                auto now = steady_clock::now();
+                group.rtts[ready].push_back(std::chrono::duration<double, std::micro>(now - sent[ready]).count());
+                waiting[ready] = false;
+                outstanding--;
+            }
+            else if (received == 0 || (received < 0 && !PlatformSocketWouldBlock(PlatformSocketLastError()))) {
+                failed = true;
+                return;
+            }
+        }
+    }
+}
+
+void MuxBench::throughput(Group& group)
+{
+    size_t count = group.streams.size();
+    std::vector<size_t> inFlight(count);
+    std::vector<char> chunk(BENCH_CHUNK, 'x');
+    std::vector<char> buffer(MUX_MAX_PAYLOAD);
+    auto end = steady_clock::now() + std::chrono::seconds(options.seconds);
+    while (steady_clock::now() < end && !failed) {
+        for (size_t i = 0; i < count; i++) {
+            while (inFlight[i] + BENCH_CHUNK <= BENCH_IN_FLIGHT) {
+                int sent = PlatformStreamSend(group.streams[i], chunk.data(), (int)chunk.size());
+                if (sent <= 0) {
+                    if (!PlatformSocketWouldBlock(PlatformSocketLastError())) {
+                        failed = true;
+                    }
+                    break;
+                }
+                inFlight[i] += sent;
+            }
+        }
+        ULONG ready = PlatformWait(group.waiter, 10);
+        if (ready == PLATFORM_WAIT_TIMEOUT) {
+            continue;
+        }
+        if (ready >= count) {
+            failed = true;
+            break;
+        }
+        // the lowest signalled stream wins a wait, all of them are drained so none starves.
+        for (size_t i = 0; i < count && !failed; i++) {
+            int received;
+            while ((received = PlatformStreamRecv(group.streams[i], buffer.data(), (int)buffer.size())) > 0) {
+                inFlight[i] -= std::min(inFlight[i], (size_t)received);
+                group.bytes += received;
+            }
+            if (received == 0 || !PlatformSocketWouldBlock(PlatformSocketLastError())) {
+                failed = true;
+            }
+        }
+    }
+}
+
+int MuxBench::run()
+{
+    MuxStartup();
+    std::vector<Group> groups((options.channels + BENCH_CHANNELS_PER_THREAD - 1) / BENCH_CHANNELS_PER_THREAD);
+    auto openStart = steady_clock::now();
+    for (USHORT id = 1; id <= options.channels && !failed; id++) {
+        Group& group = groups[(id - 1) / BENCH_CHANNELS_PER_THREAD];
+        if (group.waiter == nullptr && PlatformWaiterCreate(&group.waiter) != NO_ERROR) {
+            failed = true;
+            break;
+        }
+        PLATFORM_STREAM stream = nullptr;
+        UINT32 error = MuxChannelOpen(options.host.c_str(), options.port, id, BENCH_OPEN_TIMEOUT_MS, &stream);
+        if (error == NO_ERROR) {
+            error = PlatformWaiterAddStream(group.waiter, stream);
+        }
+        if (stream) {
+            group.ids.push_back(id);
+            group.streams.push_back(stream);
+        }
+        if (error != NO_ERROR) {
+            logger << "relay bench: channel " << id << " open error " << error << "\n";
+            logger.flush(Logger::ERROR_LVL);
+            failed = true;
+        }
+    }
+    double openMs = std::chrono::duration<double, std::milli>(steady_clock::now() - openStart).count();
+
+    std::vector<std::thread> threads;
+    if (!failed) {
+        for (auto& group : groups) {
+            threads.emplace_back(&MuxBench::latency, this, std::ref(group));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+    }
+    auto throughputStart = steady_clock::now();
+    if (!failed) {
+        for (auto& group : groups) {
+            threads.emplace_back(&MuxBench::throughput, this, std::ref(group));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    double seconds = std::chrono::duration<double>(steady_clock::now() - throughputStart).count();
+
+    //
+    // the round trips of all channels, and how far apart the channels are.
+    //
+    std::vector<double> all;
+    std::vector<double> medians;
+    INT64 bytes = 0;
+    for (auto& group : groups) {
+        for (auto& rtts : group.rtts) {
+            if (rtts.empty()) {
+                continue;
+            }
+            std::sort(rtts.begin(), rtts.end());
+            medians.push_back(rtts[rtts.size() / 2]);
+            all.insert(all.end(), rtts.begin(), rtts.end());
+        }
+        bytes += group.bytes;
+        for (auto stream : group.streams) {
+            PlatformStreamClose(stream);
+        }
+        PlatformWaiterClose(group.waiter);
+    }
+    MuxCleanup();
+
+    std::ostringstream line;
+    line.precision(3);
+    line << std::fixed;
+    line << "mux relay bench over " << options.channels << " channels to " << options.host << ":" << options.port
+        << (failed ? " FAILED" : "") << "\n"
+        << "  open:       " << openMs << " ms for all channels\n";
+    if (!all.empty()) {
+        std::sort(all.begin(), all.end());
+        std::sort(medians.begin(), medians.end());
+        auto percentile = [](const std::vector<double>& values, double p) {
+            size_t rank = (size_t)std::ceil(p * values.size());
+            return values[std::min(values.size(), std::max(rank, (size_t)1)) - 1];
+        };
+        line << "  rtt us:     " << all.size() << " round trips, all channels at once, p50 "
+            << percentile(all, 0.50) << " p90 " << percentile(all, 0.90) << " p99 " << percentile(all, 0.99)
+            << " max " << all.back() << "\n"
+            << "  channel p50 us: min " << medians.front() << " median " << percentile(medians, 0.50)
+            << " max " << medians.back() << "\n";
+    }
+    line << "  throughput: " << (seconds > 0 ? bytes / seconds / 1e6 : 0) << " MB/s echoed, "
+        << bytes << " bytes in " << seconds << " s\n";
+    logger << line.str();
+    logger.flush(Logger::INFO_LVL);
+    return failed ? 1 : 0;
+}
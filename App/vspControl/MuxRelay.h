@@ -0,0 +1,136 @@
+#pragma once
+#include "NetCompat.h"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class SocketPoller;
+
+/**
+ * @brief The target of a range of mux channels.
+ *
+ * Channel first goes to host:port, the next ones to the ports after it, the way a
+ * xen host numbers the hvm_serial ports of its vms.
+ */
+struct MuxRoute {
+    USHORT first = 0;
+    USHORT last = 0;
+    std::string host;
+    USHORT port = 0;
+
+    /**
+     * @brief Parses first-last=host:port, or channel=host:port for a single channel.
+     */
+    static bool parse(const std::string& text, MuxRoute& route);
+};
+
+struct MuxRelayOptions {
+    std::string address;        // local address the ports connect to, any if empty.
+    USHORT port = 0;            // 0 picks an ephemeral port.
+    std::vector<MuxRoute> routes;
+    size_t maxSessions = 16;
+};
+
+/**
+ * @brief The relay of the mux transport, near the xen host.
+ *
+ * The driver connects once and opens a channel of the connection for each port, see
+ * ComPort/mux.h. For each channel the relay connects to the serial port of its route
+ * and moves the bytes both ways. One thread serves every session and channel with
+ * non-blocking sockets. A channel only reads its target while the port has credit for
+ * it, so a port that does not read stops its own vm and no other.
+ */
+class MuxRelay {
+public:
+    MuxRelay(const MuxRelayOptions& Options);
+    ~MuxRelay();
+
+    /**
+     * @brief Binds and listens.
+     *
+     * @return USHORT The listening port, 0 on failure.
+     */
+    USHORT start();
+
+    /**
+     * @brief Serves sessions until stop is called or the listening socket fails.
+     *
+     * @return int 0 on normal exit, else 1.
+     */
+    int run();
+
+    /**
+     * @brief Makes run return within 100 ms. May be called from any thread.
+     */
+    void stop() { stopping = true; }
+
+private:
+    struct Session;
+    struct Channel;
+
+    void acceptSessions();
+    void closeSession(Session& session);
+    bool receiveSession(Session& session);
+    bool dispatch(Session& session, BYTE type, USHORT id, const BYTE* payload, ULONG length);
+    void openChannel(Session& session, USHORT id, ULONG window);
+    void closeChannel(Channel& channel, bool tell);
+    void connected(Channel& channel);
+    bool readTarget(Channel& channel);
+    bool writeTarget(Channel& channel);
+    void queueFrame(Session& session, BYTE type, USHORT id, const BYTE* payload, ULONG length);
+    bool flush(Session& session);
+    void update(Session& session);
+    void update(Channel& channel);
+    const MuxRoute* route(USHORT id) const;
+
+    MuxRelayOptions options;
+    SOCKET listener = INVALID_SOCKET;
+    std::atomic<bool> stopping{ false };
+    std::unique_ptr<SocketPoller> poller;
+    std::map<SOCKET, std::unique_ptr<Session>> sessions;
+    std::map<SOCKET, Channel*> targets;
+    std::vector<BYTE> scratch;
+
+    // Prevent copying
+    MuxRelay(const MuxRelay& other) = delete;
+    MuxRelay& operator=(const MuxRelay& other) = delete;
+};
+
+struct MuxBenchOptions {
+    std::string host = "127.0.0.1";
+    USHORT port = 0;            // the relay.
+    USHORT channels = 128;
+    ULONG rounds = 200;         // 1 byte round trips of every channel.
+    ULONG seconds = 5;          // of the throughput phase.
+};
+
+/**
+ * @brief Benches a relay whose channels all lead to a reflect peer.
+ *
+ * The channels are opened like the driver opens them. First every channel sends one
+ * byte at the same time and waits for it to come back, rounds times, for the round
+ * trip of each channel while all of them are busy. Then every channel keeps 32 KB in
+ * flight for the aggregate throughput. Threads of up to 8 channels each drive them.
+ */
+class MuxBench {
+public:
+    MuxBench(const MuxBenchOptions& Options) : options(Options) {}
+
+    /**
+     * @brief Runs both phases and prints the results.
+     *
+     * @return int 0 on success, else 1.
+     */
+    int run();
+
+private:
+    struct Group;
+
+    void latency(Group& group);
+    void throughput(Group& group);
+
+    MuxBenchOptions options;
+    std::atomic<bool> failed{ false };
+};
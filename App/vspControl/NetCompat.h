@@ -0,0 +1,119 @@
+#pragma once
+//
+// the small amount of socket api that differs between winsock and posix.
+// Code that includes this instead of winsock2.h builds on windows and linux.
+//
+#include <cstdio>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+
+typedef int socklen_t;
+typedef WSAPOLLFD pollfd_t;
+
+inline int netLastError() { return WSAGetLastError(); }
+inline bool netWouldBlock(int error) { return error == WSAEWOULDBLOCK; }
+inline int netPoll(pollfd_t* fds, ULONG count, int timeoutMs) { return WSAPoll(fds, count, timeoutMs); }
+
+inline bool netSetNonBlocking(SOCKET s)
+{
+    u_long mode = 1;
+    return ioctlsocket(s, FIONBIO, &mode) == 0;
+}
+
+inline bool netStartup()
+{
+    WSADATA wsaData = { 0 };
+    return WSAStartup(WINSOCK_VERSION, &wsaData) == NO_ERROR;
+}
+
+inline void netCleanup() { WSACleanup(); }
+
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstdint>
+
+typedef int SOCKET;
+typedef struct pollfd pollfd_t;
+typedef uint8_t BYTE;
+typedef uint16_t USHORT;
+typedef uint32_t ULONG;
+typedef int64_t INT64;
+
+#define INVALID_SOCKET  (-1)
+#define SOCKET_ERROR    (-1)
+#define SD_SEND         SHUT_WR
+#define SD_BOTH         SHUT_RDWR
+
+// platform.h has the same shim.
+#ifndef CLOSESOCKET_SHIM
+#define CLOSESOCKET_SHIM
+inline int closesocket(SOCKET s) { return close(s); }
+#endif
+inline int netLastError() { return errno; }
+inline bool netWouldBlock(int error) { return error == EWOULDBLOCK || error == EAGAIN || error == EINPROGRESS; }
+inline int netPoll(pollfd_t* fds, unsigned long count, int timeoutMs) { return poll(fds, count, timeoutMs); }
+
+inline bool netSetNonBlocking(SOCKET s)
+{
+    int flags = fcntl(s, F_GETFL, 0);
+    return (flags != -1) && (fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0);
+}
+
+inline bool netStartup() { return true; }
+inline void netCleanup() {}
+
+#endif
+
+inline bool netSetNoDelay(SOCKET s)
+{
+    int yes = 1;
+    return setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes)) == 0;
+}
+
+/**
+ * @brief Connects a tcp socket to host:port, trying each resolved address in turn.
+ *
+ * @return SOCKET The connected socket, or INVALID_SOCKET.
+ */
+inline SOCKET netConnect(const char* host, USHORT port)
+{
+    struct addrinfo hints = { };
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    char portString[8];
+    snprintf(portString, sizeof(portString), "%u", (unsigned)port);
+
+    struct addrinfo* result = NULL;
+    if (getaddrinfo(host, portString, &hints, &result) != 0) {
+        return INVALID_SOCKET;
+    }
+    SOCKET s = INVALID_SOCKET;
+    for (struct addrinfo* addr = result; addr != NULL; addr = addr->ai_next) {
+        s = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (s == INVALID_SOCKET) {
+            continue;
+        }
+        if (connect(s, addr->ai_addr, (socklen_t)addr->ai_addrlen) == 0) {
+            break;
+        }
+        closesocket(s);
+        s = INVALID_SOCKET;
+    }
+    freeaddrinfo(result);
+    return s;
+}
@@ -0,0 +1,885 @@
+#include "PeerService.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include "Logger.h"
+#include "SocketPoller.h"
+#include "../../ComPort/compress.h"
+#include "../../ComPort/rudp.h"
+
+extern Logger logger;
+
+using std::chrono::steady_clock;
+
+namespace {
+    const size_t CLIENT_BUFFER_SIZE = 64 * 1024;
+    const int STOP_POLL_MS = 100;
+
+    enum { PEER_READ = SocketPoller::Read, PEER_WRITE = SocketPoller::Write };
+
+    // datagrams received, and sent, in one system call.
+    const size_t UDP_BATCH = 32;
+
+    // what a lost segment of an interactive stream costs tcp, the minimum
+    // retransmit timeout of linux.
+    const std::chrono::milliseconds TCP_RETRANSMIT_TIMEOUT(200);
+
+    ULONGLONG nowUs()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            steady_clock::now().time_since_epoch()).count();
+    }
+}
+
+// the compressed transport of a client.
+struct PeerService::Codec {
+    bool hello = false;         // received, and the answer queued.
+    LZ_ENCODER encoder;
+    LZ_DECODER decoder;
+    std::vector<BYTE> in;       // received blocks not yet decompressed, in [0, inLength)
+    size_t inLength = 0;
+    std::vector<BYTE> out;      // the block being sent, in [outHead, outTail)
+    size_t outHead = 0;
+    size_t outTail = 0;
+
+    size_t pending() const { return outTail - outHead; }
+};
+
+struct PeerService::Client {
+    SOCKET s = INVALID_SOCKET;
+    std::unique_ptr<Codec> codec;   // compressed clients only.
+    std::vector<BYTE> buffer;       // echo and reflect data not yet sent, in [head, tail)
+    size_t head = 0;
+    size_t tail = 0;
+    double tokens = 0;
+    steady_clock::time_point lastRefill;
+    BYTE sourceNext = 0;
+    bool readClosed = false;
+    ULONG events = 0;
+    bool held = false;              // a lost read or send, until heldUntil.
+    steady_clock::time_point heldUntil;
+    INT64 holds = 0;
+    INT64 bytesIn = 0;
+    INT64 bytesOut = 0;
+
+    size_t pending() const { return tail - head; }
+};
+
+// a reliable udp client.
+struct PeerService::Session {
+    sockaddr_storage address;
+    socklen_t addressLength = 0;
+    RUDP_CONNECTION connection;
+    std::vector<BYTE> buffer;       // echo and reflect data not yet written, in [head, tail)
+    size_t head = 0;
+    size_t tail = 0;
+    BYTE sourceNext = 0;
+    INT64 bytesIn = 0;
+    INT64 bytesOut = 0;
+};
+
+struct PeerService::Datagram {
+    sockaddr_storage address;
+    socklen_t addressLength = 0;
+    ULONG length = 0;
+    BYTE data[RUDP_MAX_DATAGRAM];
+};
+
+
+PeerService::PeerService(const PeerOptions& Options) : options(Options)
+{
+}
+
+PeerService::~PeerService()
+{
+    for (auto& entry : clients) {
+        closesocket(entry.first);
+    }
+    if (listener != INVALID_SOCKET) {
+        closesocket(listener);
+    }
+    if (udpSocket != INVALID_SOCKET) {
+        closesocket(udpSocket);
+    }
+}
+
+const char* PeerService::modeName(PeerMode mode)
+{
+    switch (mode) {
+    case PeerMode::Echo: return "echo";
+    case PeerMode::Discard: return "discard";
+    case PeerMode::Source: return "source";
+    case PeerMode::Reflect: return "reflect";
+    }
+    return "unknown";
+}
+
+bool PeerService::parseMode(const std::string& name, PeerMode& mode)
+{
+    for (auto candidate : { PeerMode::Echo, PeerMode::Discard, PeerMode::Source, PeerMode::Reflect }) {
+        if (name == modeName(candidate)) {
+            mode = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+USHORT PeerService::start()
+{
+    poller.reset(new SocketPoller());
+    scratch.resize(CLIENT_BUFFER_SIZE);
+    if (options.baud) {
+        bytesPerSecond = options.baud / 10.0;
+        burst = std::max(16.0, bytesPerSecond / 100.0);
+    }
+
+    listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET || !poller->valid()) {
+        logger << "peer: socket error " << netLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 0;
+    }
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+
+    sockaddr_in service = { 0 };
+    service.sin_family = AF_INET;
+    service.sin_addr.s_addr = htonl(INADDR_ANY);
+    service.sin_port = htons(options.port);
+    if (!options.address.empty() && inet_pton(AF_INET, options.address.c_str(), &service.sin_addr) != 1) {
+        logger << "peer: invalid address " << options.address << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 0;
+    }
+    socklen_t length = sizeof(service);
+    if (bind(listener, (sockaddr*)&service, sizeof(service)) == SOCKET_ERROR ||
+        listen(listener, SOMAXCONN) == SOCKET_ERROR ||
+        getsockname(listener, (sockaddr*)&service, &length) == SOCKET_ERROR ||
+        !netSetNonBlocking(listener)) {
+        logger << "peer: bind or listen error " << netLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        closesocket(listener);
+        listener = INVALID_SOCKET;
+        return 0;
+    }
+    poller->set(listener, PEER_READ, false);
+    if (options.udp && !bindUdp(service)) {
+        return 0;
+    }
+
+    char address[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &service.sin_addr, address, sizeof(address));
+    logger << "peer: " << modeName(options.mode) << " listening on " << address << ":" << ntohs(service.sin_port);
+    if (options.baud) {
+        logger << " at " << options.baud << " baud";
+    }
+    if (options.udp) {
+        logger << ", udp too";
+    }
+    if (options.loss) {
+        logger << ", " << options.loss << "% loss";
+    }
+    logger.flush(Logger::INFO_LVL);
+    return ntohs(service.sin_port);
+}
+
+// the udp socket on the address and port of the listener.
+bool PeerService::bindUdp(const sockaddr_in& service)
+{
+    udpSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (udpSocket == INVALID_SOCKET ||
+        bind(udpSocket, (const sockaddr*)&service, sizeof(service)) == SOCKET_ERROR ||
+        !netSetNonBlocking(udpSocket)) {
+        logger << "peer: udp bind error " << netLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return false;
+    }
+    outbox.resize(UDP_BATCH);
+    inbox.resize(UDP_BATCH * RUDP_MAX_DATAGRAM);
+    poller->set(udpSocket, PEER_READ, false);
+    return true;
+}
+
+int PeerService::run()
+{
+    if (listener == INVALID_SOCKET) {
+        return 1;
+    }
+    std::vector<std::pair<SOCKET, ULONG>> ready;
+    while (!stopping) {
+        if (poller->wait(std::min(pacingTimeout(), udpTimeout()), ready) < 0) {
+            logger << "peer: poll error " << netLastError() << "\n";
+            logger.flush(Logger::ERROR_LVL);
+            return 1;
+        }
+        for (auto& event : ready) {
+            if (event.first == listener) {
+                acceptClients();
+                continue;
+            }
+            if (event.first == udpSocket) {
+                receiveDatagrams();
+                continue;
+            }
+            auto entry = clients.find(event.first);
+            if (entry != clients.end()) {
+                serviceClient(*entry->second, (event.second & PEER_READ) != 0, (event.second & PEER_WRITE) != 0);
+            }
+        }
+        if (options.baud || options.loss) {
+            // clients waiting only for tokens or a hold have no socket event to wake them.
+            std::vector<Client*> waiting;
+            steady_clock::time_point now = steady_clock::now();
+            for (auto& entry : clients) {
+                if ((options.baud && entry.second->tokens < 1) ||
+                    (entry.second->held && now >= entry.second->heldUntil)) {
+                    waiting.push_back(entry.second.get());
+                }
+            }
+            for (auto client : waiting) {
+                serviceClient(*client, false, false);
+            }
+        }
+        if (udpSocket != INVALID_SOCKET) {
+            serviceSessions();
+        }
+    }
+    return 0;
+}
+
+void PeerService::acceptClients()
+{
+    for (;;) {
+        SOCKET s = accept(listener, NULL, NULL);
+        if (s == INVALID_SOCKET) {
+            if (!netWouldBlock(netLastError())) {
+                logger << "peer: accept error " << netLastError() << "\n";
+                logger.flush(Logger::WARNING_LVL);
+            }
+            return;
+        }
+        if (clients.size() >= options.maxClients) {
+            logger << "peer: refusing client, " << clients.size() << " connected\n";
+            logger.flush(Logger::WARNING_LVL);
+            closesocket(s);
+            continue;
+        }
+        netSetNonBlocking(s);
+        netSetNoDelay(s);
+
+        std::unique_ptr<Client> client(new Client());
+        client->s = s;
+        if (options.mode == PeerMode::Echo || options.mode == PeerMode::Reflect) {
+            client->buffer.resize(CLIENT_BUFFER_SIZE);
+        }
+        if (options.compress) {
+            client->codec.reset(new Codec());
+            LzEncoderInitialize(&client->codec->encoder);
+            LzDecoderInitialize(&client->codec->decoder);
+            client->codec->in.resize(2 * (COMPRESS_HEADER_SIZE + LZ_BLOCK_SIZE));
+            client->codec->out.resize(COMPRESS_HEADER_SIZE + LZ_BLOCK_SIZE);
+        }
+        client->lastRefill = steady_clock::now();
+        client->tokens = options.baud ? burst : 0;
+        client->events = interest(*client);
+        poller->set(s, client->events, false);
+        clients[s] = std::move(client);
+        logger << "peer: client connected, " << clients.size() << " connected\n";
+        logger.flush(Logger::VERBOSE_LVL);
+    }
+}
+
+void PeerService::closeClient(Client& client)
+{
+    SOCKET s = client.s;
+    logger << "peer: client closed, " << client.bytesIn << " bytes in, " << client.bytesOut << " bytes out";
+    if (client.holds) {
+        logger << ", " << client.holds << " holds";
+    }
+    logger << "\n";
+    logger.flush(Logger::VERBOSE_LVL);
+    poller->remove(s);
+    closesocket(s);
+    clients.erase(s);
+}
+
+void PeerService::refill(Client& client, steady_clock::time_point now)
+{
+    if (options.baud == 0) {
+        return;
+    }
+    double elapsed = std::chrono::duration<double>(now - client.lastRefill).count();
+    client.lastRefill = now;
+    client.tokens = std::min(burst, client.tokens + elapsed * bytesPerSecond);
+}
+
+ULONG PeerService::interest(const Client& client) const
+{
+    bool paced = options.baud != 0;
+    ULONG events = 0;
+    if (client.held) {
+        return events;
+    }
+    if (client.codec) {
+        // blocks are received as long as they fit, decode moves them on.
+        const Codec& codec = *client.codec;
+        if (!client.readClosed && codec.inLength < codec.in.size()) {
+            events |= PEER_READ;
+        }
+        if (codec.pending() ||
+            (codec.hello && (client.pending() || options.mode == PeerMode::Source) &&
+             (!paced || options.mode == PeerMode::Reflect || client.tokens >= 1))) {
+            events |= PEER_WRITE;
+        }
+        return events;
+    }
+    switch (options.mode) {
+    case PeerMode::Echo:
+    case PeerMode::Reflect:
+        if (!client.readClosed && (client.head > 0 || client.tail < client.buffer.size())) {
+            events |= PEER_READ;
+        }
+        if (client.pending() && (!paced || options.mode == PeerMode::Reflect || client.tokens >= 1)) {
+            events |= PEER_WRITE;
+        }
+        break;
+    case PeerMode::Discard:
+        if (!client.readClosed && (!paced || client.tokens >= 1)) {
+            events |= PEER_READ;
+        }
+        break;
+    case PeerMode::Source:
+        // reads only notice the client closing.
+        events |= PEER_READ;
+        if (!paced || client.tokens >= 1) {
+            events |= PEER_WRITE;
+        }
+        break;
+    }
+    return events;
+}
+
+int PeerService::pacingTimeout() const
+{
+    int timeout = STOP_POLL_MS;
+    steady_clock::time_point now = steady_clock::now();
+    for (auto& entry : clients) {
+        const Client& client = *entry.second;
+        if (client.held) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(client.heldUntil - now).count() + 1;
+            timeout = std::min(timeout, std::max((int)wait, 0));
+        }
+        if (options.baud == 0 || client.tokens >= 1) {
+            continue;
+        }
+        int wait = (int)std::ceil((1 - client.tokens) * 1000.0 / bytesPerSecond);
+        timeout = std::min(timeout, std::max(wait, 1));
+    }
+    return timeout;
+}
+
+bool PeerService::lost()
+{
+    return options.loss > 0 && std::uniform_real_distribution<double>(0, 100)(random) < options.loss;
+}
+
+// holds the client until a retransmit timeout if the read or send it is
+// about to do is lost. Returns true while it is held.
+bool PeerService::hold(Client& client)
+{
+    if (client.held) {
+        return true;
+    }
+    if (!lost()) {
+        return false;
+    }
+    client.held = true;
+    client.heldUntil = steady_clock::now() + TCP_RETRANSMIT_TIMEOUT;
+    client.holds++;
+    return true;
+}
+
+// recv into the client buffer, or the scratch buffer for discard and source.
+// Returns false when the client must be closed.
+bool PeerService::receive(Client& client)
+{
+    BYTE* target = scratch.data();
+    size_t length = scratch.size();
+    if (client.codec) {
+        target = client.codec->in.data() + client.codec->inLength;
+        length = client.codec->in.size() - client.codec->inLength;
+    }
+    else if (!client.buffer.empty()) {
+        if (client.head == client.tail) {
+            client.head = client.tail = 0;
+        }
+        else if (client.tail == client.buffer.size()) {
+            memmove(client.buffer.data(), client.buffer.data() + client.head, client.pending());
+            client.tail -= client.head;
+            client.head = 0;
+        }
+        target = client.buffer.data() + client.tail;
+        length = client.buffer.size() - client.tail;
+    }
+    else if (options.mode == PeerMode::Discard && options.baud) {
+        length = std::min(length, (size_t)client.tokens);
+    }
+    if (length == 0 || hold(client)) {
+        return true;
+    }
+
+    int received = recv(client.s, (char*)target, (int)length, 0);
+    if (received == 0) {
+        client.readClosed = true;
+        return true;
+    }
+    if (received < 0) {
+        return netWouldBlock(netLastError());
+    }
+    client.bytesIn += received;
+    if (client.codec) {
+        client.codec->inLength += received;
+        return decode(client);
+    }
+    if (!client.buffer.empty()) {
+        client.tail += received;
+    }
+    else if (options.mode == PeerMode::Discard && options.baud) {
+        client.tokens -= received;
+    }
+    return true;
+}
+
+// decompresses the received blocks into the client buffer, as long as they
+// fit, the first thing received is the hello. Returns false when the client
+// must be closed.
+bool PeerService::decode(Client& client)
+{
+    Codec& codec = *client.codec;
+    size_t offset = 0;
+    if (!codec.hello) {
+        if (codec.inLength < COMPRESS_HELLO_SIZE) {
+            return true;
+        }
+        if (!CompressHelloValid(FALSE, codec.in.data())) {
+            logger << "peer: client does not compress\n";
+            logger.flush(Logger::WARNING_LVL);
+            return false;
+        }
+        codec.hello = true;
+        offset = COMPRESS_HELLO_SIZE;
+        CompressEncodeHello(TRUE, codec.out.data());
+        codec.outHead = 0;
+        codec.outTail = COMPRESS_HELLO_SIZE;
+    }
+
+    bool valid = true;
+    while (codec.inLength - offset >= COMPRESS_HEADER_SIZE) {
+        ULONG length;
+        ULONG blockLength;
+        if (!CompressDecodeHeader(codec.in.data() + offset, &length, &blockLength)) {
+            valid = false;
+            break;
+        }
+        if (codec.inLength - offset < COMPRESS_HEADER_SIZE + blockLength) {
+            break;
+        }
+        if (!client.buffer.empty()) {
+            if (client.head > 0) {
+                memmove(client.buffer.data(), client.buffer.data() + client.head, client.pending());
+                client.tail -= client.head;
+                client.head = 0;
+            }
+            if (client.buffer.size() - client.tail < length) {
+                // the rest waits until transmit made room.
+                break;
+            }
+        }
+        const BYTE* data = LzDecompress(&codec.decoder, codec.in.data() + offset + COMPRESS_HEADER_SIZE,
+            blockLength, length);
+        if (data == NULL) {
+            valid = false;
+            break;
+        }
+        if (!client.buffer.empty()) {
+            memcpy(client.buffer.data() + client.tail, data, length);
+            client.tail += length;
+        }
+        else if (options.mode == PeerMode::Discard && options.baud) {
+            client.tokens -= length;
+        }
+        offset += COMPRESS_HEADER_SIZE + blockLength;
+    }
+    if (!valid) {
+        logger << "peer: invalid block from client\n";
+        logger.flush(Logger::WARNING_LVL);
+        return false;
+    }
+    memmove(codec.in.data(), codec.in.data() + offset, codec.inLength - offset);
+    codec.inLength -= offset;
+    return true;
+}
+
+// the next data to send, at most limit bytes and the tokens of a paced
+// client. The source pattern moves on past it.
+size_t PeerService::outgoing(Client& client, size_t limit, const BYTE*& data)
+{
+    bool paced = options.baud != 0 && options.mode != PeerMode::Reflect;
+    if (paced) {
+        limit = std::min(limit, (size_t)client.tokens);
+    }
+    size_t length;
+    if (options.mode == PeerMode::Source) {
+        length = std::min(scratch.size(), limit);
+        for (size_t i = 0; i < length; i++) {
+            scratch[i] = client.sourceNext++;
+        }
+        data = scratch.data();
+    }
+    else {
+        length = std::min(client.pending(), limit);
+        data = client.buffer.data() + client.head;
+    }
+    return length;
+}
+
+// sent of the length bytes of outgoing left.
+void PeerService::consumed(Client& client, size_t length, size_t sent)
+{
+    if (options.mode == PeerMode::Source) {
+        // the pattern continues from the last byte actually sent.
+        client.sourceNext -= (BYTE)(length - sent);
+    }
+    else {
+        client.head += sent;
+    }
+    if (options.baud != 0 && options.mode != PeerMode::Reflect) {
+        client.tokens -= sent;
+    }
+}
+
+bool PeerService::transmit(Client& client)
+{
+    if (client.codec) {
+        return transmitCompressed(client);
+    }
+    if ((client.pending() == 0 && options.mode != PeerMode::Source) || hold(client)) {
+        return true;
+    }
+    const BYTE* data;
+    size_t length = outgoing(client, SIZE_MAX, data);
+    if (length == 0) {
+        return true;
+    }
+
+    int sent = send(client.s, (const char*)data, (int)length, 0);
+    consumed(client, length, sent < 0 ? 0 : sent);
+    if (sent < 0) {
+        return netWouldBlock(netLastError());
+    }
+    client.bytesOut += sent;
+    return true;
+}
+
+// compresses what there is to send into a block once the last one is out.
+// The pacing applies to the data, before compression.
+bool PeerService::transmitCompressed(Client& client)
+{
+    Codec& codec = *client.codec;
+    if (codec.pending() == 0 && codec.hello) {
+        const BYTE* data;
+        size_t length = outgoing(client, LZ_BLOCK_SIZE, data);
+        if (length == 0) {
+            return true;
+        }
+        BYTE* block = codec.out.data() + COMPRESS_HEADER_SIZE;
+        ULONG blockLength = LzCompress(&codec.encoder, data, (ULONG)length, block);
+        if (blockLength == 0) {
+            memcpy(block, data, length);
+            blockLength = (ULONG)length;
+        }
+        CompressEncodeHeader((ULONG)length, blockLength, codec.out.data());
+        codec.outHead = 0;
+        codec.outTail = COMPRESS_HEADER_SIZE + blockLength;
+        consumed(client, length, length);
+    }
+    if (codec.pending() == 0) {
+        return true;
+    }
+
+    int sent = send(client.s, (const char*)codec.out.data() + codec.outHead, (int)codec.pending(), 0);
+    if (sent < 0) {
+        return netWouldBlock(netLastError());
+    }
+    codec.outHead += sent;
+    client.bytesOut += sent;
+    return true;
+}
+
+void PeerService::serviceClient(Client& client, bool readable, bool writable)
+{
+    steady_clock::time_point now = steady_clock::now();
+    refill(client, now);
+    if (client.held && now >= client.heldUntil) {
+        // the segment arrived with its retransmission.
+        client.held = false;
+        readable = writable = true;
+    }
+    bool alive = true;
+    if (readable) {
+        alive = receive(client);
+        // the reflector answers each read without waiting for the next poll.
+        writable = writable || (options.mode == PeerMode::Reflect && client.pending());
+    }
+    if (alive && (writable || (client.events & PEER_WRITE) == 0)) {
+        // also try when writes were not being polled, tokens may have arrived since.
+        alive = transmit(client);
+    }
+    if (alive && client.codec) {
+        // blocks that waited for room in the buffer.
+        alive = decode(client);
+    }
+    bool drained = client.pending() == 0 && !(client.codec && client.codec->pending());
+    if (!alive || (client.readClosed && (drained || options.mode == PeerMode::Source))) {
+        closeClient(client);
+        return;
+    }
+    ULONG events = interest(client);
+    if (events != client.events) {
+        client.events = events;
+        poller->set(client.s, events, true);
+    }
+}
+
+// takes the datagrams the udp socket has, a few batches at most so that the
+// answers go out in time.
+void PeerService::receiveDatagrams()
+{
+#ifdef __linux__
+    mmsghdr messages[UDP_BATCH];
+    iovec vectors[UDP_BATCH];
+    sockaddr_storage addresses[UDP_BATCH];
+    for (int round = 0; round < 4; round++) {
+        for (size_t i = 0; i < UDP_BATCH; i++) {
+            vectors[i].iov_base = inbox.data() + i * RUDP_MAX_DATAGRAM;
+            vectors[i].iov_len = RUDP_MAX_DATAGRAM;
+            memset(&messages[i], 0, sizeof(messages[i]));
+            messages[i].msg_hdr.msg_name = &addresses[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+            messages[i].msg_hdr.msg_iov = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+        int count = recvmmsg(udpSocket, messages, UDP_BATCH, MSG_DONTWAIT, NULL);
+        for (int i = 0; i < count; i++) {
+            input((const sockaddr*)&addresses[i], messages[i].msg_hdr.msg_namelen,
+                inbox.data() + i * RUDP_MAX_DATAGRAM, messages[i].msg_len);
+        }
+        if (count < (int)UDP_BATCH) {
+            break;
+        }
+    }
+#else
+    for (size_t i = 0; i < UDP_BATCH; i++) {
+        sockaddr_storage address;
+        socklen_t addressLength = sizeof(address);
+        int received = recvfrom(udpSocket, (char*)inbox.data(), RUDP_MAX_DATAGRAM, 0,
+            (sockaddr*)&address, &addressLength);
+        if (received < 0) {
+            // also the port unreachable of a client that went away.
+            break;
+        }
+        input((const sockaddr*)&address, addressLength, inbox.data(), received);
+    }
+#endif
+}
+
+// a datagram of a client. A syn starts a session, anything else of a client
+// without one is answered with a reset.
+void PeerService::input(const sockaddr* address, socklen_t addressLength, const BYTE* data, ULONG length)
+{
+    if (lost()) {
+        datagramsDropped++;
+        return;
+    }
+    std::string key((const char*)address, addressLength);
+    auto entry = sessions.find(key);
+    if (entry == sessions.end()) {
+        if (!RudpIsSyn(data, length)) {
+            Datagram& reset = nextDatagram(address, addressLength);
+            reset.length = RudpEncodeReset(reset.data);
+            outboxCount++;
+            return;
+        }
+        if (clients.size() + sessions.size() >= options.maxClients) {
+            logger << "peer: refusing udp client, " << clients.size() + sessions.size() << " connected\n";
+            logger.flush(Logger::WARNING_LVL);
+            return;
+        }
+        std::unique_ptr<Session> session(new Session());
+        memcpy(&session->address, address, addressLength);
+        session->addressLength = addressLength;
+        RudpInitialize(&session->connection, TRUE, nowUs());
+        if (options.mode == PeerMode::Echo || options.mode == PeerMode::Reflect) {
+            session->buffer.resize(CLIENT_BUFFER_SIZE);
+        }
+        entry = sessions.emplace(key, std::move(session)).first;
+        logger << "peer: udp client connected, " << sessions.size() << " connected\n";
+        logger.flush(Logger::VERBOSE_LVL);
+    }
+
+    Session& session = *entry->second;
+    if (RudpInput(&session.connection, data, length, nowUs()) != NO_ERROR && RudpIsSyn(data, length)) {
+        // the client started over.
+        RudpInitialize(&session.connection, TRUE, nowUs());
+        session.head = session.tail = 0;
+        RudpInput(&session.connection, data, length, nowUs());
+    }
+}
+
+// moves the data of each session on and sends what the sessions have to
+// send, closed sessions go.
+void PeerService::serviceSessions()
+{
+    ULONGLONG now = nowUs();
+    for (auto entry = sessions.begin(); entry != sessions.end(); ) {
+        Session& session = *entry->second;
+        if (pump(session, now)) {
+            ++entry;
+            continue;
+        }
+        logger << "peer: udp client closed, " << session.bytesIn << " bytes in, " << session.bytesOut <<
+            " bytes out, " << session.connection.Counters.Retransmits << " retransmits, " <<
+            datagramsDropped << " datagrams dropped\n";
+        logger.flush(Logger::VERBOSE_LVL);
+        entry = sessions.erase(entry);
+    }
+    flushDatagrams();
+}
+
+// the mode of the peer on the stream of a session, then its datagrams.
+// Returns false once the session closed.
+bool PeerService::pump(Session& session, uint64_t now)
+{
+    PRUDP_CONNECTION connection = &session.connection;
+    switch (options.mode) {
+    case PeerMode::Echo:
+    case PeerMode::Reflect:
+        for (;;) {
+            if (session.head == session.tail) {
+                session.head = session.tail = 0;
+                session.tail = RudpRead(connection, session.buffer.data(), (ULONG)session.buffer.size());
+                session.bytesIn += session.tail;
+                if (session.tail == 0) {
+                    break;
+                }
+            }
+            ULONG written = RudpWrite(connection, session.buffer.data() + session.head,
+                (ULONG)(session.tail - session.head));
+            if (written == 0) {
+                break;
+            }
+            session.head += written;
+            session.bytesOut += written;
+        }
+        break;
+    case PeerMode::Discard:
+    case PeerMode::Source:
+        for (ULONG read; (read = RudpRead(connection, scratch.data(), (ULONG)scratch.size())) != 0; ) {
+            session.bytesIn += read;
+        }
+        while (options.mode == PeerMode::Source && RudpWritable(connection)) {
+            const size_t length = 4 * RUDP_MAX_PAYLOAD;
+            for (size_t i = 0; i < length; i++) {
+                scratch[i] = session.sourceNext++;
+            }
+            ULONG written = RudpWrite(connection, scratch.data(), (ULONG)length);
+            session.sourceNext -= (BYTE)(length - written);
+            session.bytesOut += written;
+            if (written == 0) {
+                break;
+            }
+        }
+        break;
+    }
+
+    for (;;) {
+        Datagram& datagram = nextDatagram((const sockaddr*)&session.address, session.addressLength);
+        datagram.length = RudpOutput(connection, now, datagram.data);
+        if (datagram.length == 0) {
+            break;
+        }
+        outboxCount++;
+    }
+    return connection->State != RudpClosed;
+}
+
+// the next free datagram of the outbox, for address. Sends a full outbox.
+PeerService::Datagram& PeerService::nextDatagram(const sockaddr* address, socklen_t addressLength)
+{
+    if (outboxCount == outbox.size()) {
+        flushDatagrams();
+    }
+    Datagram& datagram = outbox[outboxCount];
+    memcpy(&datagram.address, address, addressLength);
+    datagram.addressLength = addressLength;
+    return datagram;
+}
+
+void PeerService::flushDatagrams()
+{
+#ifdef __linux__
+    mmsghdr messages[UDP_BATCH];
+    iovec vectors[UDP_BATCH];
+    unsigned int count = 0;
+    for (size_t i = 0; i < outboxCount; i++) {
+        if (lost()) {
+            datagramsDropped++;
+            continue;
+        }
+        Datagram& datagram = outbox[i];
+        vectors[count].iov_base = datagram.data;
+        vectors[count].iov_len = datagram.length;
+        memset(&messages[count], 0, sizeof(messages[count]));
+        messages[count].msg_hdr.msg_name = &datagram.address;
+        messages[count].msg_hdr.msg_namelen = datagram.addressLength;
+        messages[count].msg_hdr.msg_iov = &vectors[count];
+        messages[count].msg_hdr.msg_iovlen = 1;
+        count++;
+    }
+    for (unsigned int sent = 0; sent < count; ) {
+        int result = sendmmsg(udpSocket, messages + sent, count - sent, 0);
+        if (result <= 0) {
+            // a full socket buffer loses the rest like the wire would.
+            break;
+        }
+        sent += result;
+    }
+#else
+    for (size_t i = 0; i < outboxCount; i++) {
+        if (lost()) {
+            datagramsDropped++;
+            continue;
+        }
+        Datagram& datagram = outbox[i];
+        sendto(udpSocket, (const char*)datagram.data, (int)datagram.length, 0,
+            (const sockaddr*)&datagram.address, datagram.addressLength);
+    }
+#endif
+    outboxCount = 0;
+}
+
+// until the next timer of a session.
+int PeerService::udpTimeout() const
+{
+    int timeout = STOP_POLL_MS;
+    ULONGLONG now = nowUs();
+    for (auto& entry : sessions) {
+        ULONGLONG next = RudpNextUs(&entry.second->connection);
+        if (next != RUDP_NEVER) {
+            timeout = std::min(timeout, (next <= now) ? 0 : (int)((next - now + 999) / 1000));
+        }
+    }
+    return timeout;
+}
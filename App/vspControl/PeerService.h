@@ -0,0 +1,127 @@
+#pragma once
+#include "NetCompat.h"
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+class SocketPoller;
+
+/**
+ * @brief What a PeerService does with the bytes of each client.
+ */
+enum class PeerMode {
+    Echo,       // send everything back, paced like the serial line.
+    Discard,    // read and drop, paced like the serial line.
+    Source,     // send a counting byte pattern, paced like the serial line.
+    Reflect,    // send every read straight back, never paced, for round trip latency.
+};
+
+struct PeerOptions {
+    PeerMode mode = PeerMode::Echo;
+    std::string address;        // local address to bind to, any if empty.
+    USHORT port = 0;            // 0 picks an ephemeral port.
+    ULONG baud = 0;             // emulated line rate in bits per second, 0 for no pacing.
+    size_t maxClients = 64;
+    bool compress = false;      // clients say hello and send lz blocks, see ComPort/compress.h.
+    bool udp = false;           // also serve the reliable udp transport on the port, see ComPort/udp.h.
+    double loss = 0;            // percent of udp datagrams dropped each way, and of tcp reads and
+                                // sends held for a retransmit timeout, see PeerService.
+};
+
+/**
+ * @brief An event driven test peer that stands in for the Xen pty endpoint.
+ *
+ * One thread serves all clients with non-blocking sockets, using epoll on linux and
+ * WSAPoll on windows. Pacing is a per client token bucket filled at baud / 10 bytes
+ * per second (8N1 framing) that holds about 10 ms of data, so a paced client sees
+ * the short bursts a real uart fifo produces rather than single bytes.
+ *
+ * With PeerOptions::udp the same thread serves reliable udp sessions, see ComPort/rudp.h, on a
+ * udp socket of the same port, with recvmmsg and sendmmsg batches on linux. Udp sessions are
+ * never paced. PeerOptions::loss stands in for netem: it drops udp datagrams, and holds a tcp
+ * client for the 200 ms minimum retransmit timeout of linux on a lost read or send, which is
+ * what a lost segment costs an interactive stream that has nothing behind it to trigger a
+ * fast retransmit.
+ */
+class PeerService {
+public:
+    PeerService(const PeerOptions& Options);
+    ~PeerService();
+
+    /**
+     * @brief Binds and listens.
+     *
+     * @return USHORT The listening port, 0 on failure.
+     */
+    USHORT start();
+
+    /**
+     * @brief Serves clients until stop is called or the listening socket fails.
+     *
+     * @return int 0 on normal exit, else 1.
+     */
+    int run();
+
+    /**
+     * @brief Makes run return within 100 ms. May be called from any thread.
+     */
+    void stop() { stopping = true; }
+
+    static const char* modeName(PeerMode mode);
+    static bool parseMode(const std::string& name, PeerMode& mode);
+
+private:
+    struct Client;
+    struct Codec;
+    struct Session;
+    struct Datagram;
+
+    void acceptClients();
+    void closeClient(Client& client);
+    void serviceClient(Client& client, bool readable, bool writable);
+    bool receive(Client& client);
+    bool transmit(Client& client);
+    bool decode(Client& client);
+    bool transmitCompressed(Client& client);
+    size_t outgoing(Client& client, size_t limit, const BYTE*& data);
+    void consumed(Client& client, size_t length, size_t sent);
+    void refill(Client& client, std::chrono::steady_clock::time_point now);
+    ULONG interest(const Client& client) const;
+    int pacingTimeout() const;
+    bool hold(Client& client);
+    bool lost();
+
+    bool bindUdp(const sockaddr_in& service);
+    void receiveDatagrams();
+    void input(const sockaddr* address, socklen_t addressLength, const BYTE* data, ULONG length);
+    void serviceSessions();
+    bool pump(Session& session, uint64_t nowUs);
+    Datagram& nextDatagram(const sockaddr* address, socklen_t addressLength);
+    void flushDatagrams();
+    int udpTimeout() const;
+
+    PeerOptions options;
+    SOCKET listener = INVALID_SOCKET;
+    std::atomic<bool> stopping{ false };
+    std::unique_ptr<SocketPoller> poller;
+    std::map<SOCKET, std::unique_ptr<Client>> clients;
+    std::vector<BYTE> scratch;
+    SOCKET udpSocket = INVALID_SOCKET;
+    std::map<std::string, std::unique_ptr<Session>> sessions;   // by the address of the client.
+    std::vector<Datagram> outbox;                               // datagrams to send, in [0, outboxCount)
+    size_t outboxCount = 0;
+    std::vector<BYTE> inbox;
+    std::minstd_rand random;
+    INT64 datagramsDropped = 0;
+    double bytesPerSecond = 0;
+    double burst = 0;
+
+    // Prevent copying
+    PeerService(const PeerService& other) = delete;
+    PeerService& operator=(const PeerService& other) = delete;
+};
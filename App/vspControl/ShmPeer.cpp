@@ -0,0 +1,204 @@
+#include "ShmPeer.h"
+#include "platform.h"
+#include "htsvsp.h"
+#include "udp.h"
+#include <sstream>
+#include <vector>
+#include "Logger.h"
+
+extern Logger logger;
+
+namespace {
+    const size_t SHM_PEER_BUFFER_SIZE = 256 * 1024;
+    const ULONG SHM_PEER_WAIT_MS = 100;
+#ifdef _WIN32
+    const UINT32 SHM_PEER_TIMEOUT = WSAETIMEDOUT;
+#else
+    const UINT32 SHM_PEER_TIMEOUT = ETIMEDOUT;
+#endif
+}
+
+ShmPeer::~ShmPeer()
+{
+    PlatformStreamClose(stream);
+}
+
+bool ShmPeer::start()
+{
+    UINT32 error = PlatformShmCreate(name.c_str(), 0, &stream);
+    if (error != NO_ERROR) {
+        logger << "peer: shared memory " << name << " create error " << error << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return false;
+    }
+    logger << "peer: " << PeerService::modeName(mode) << " on shared memory " << name << "\n";
+    logger.flush(Logger::INFO_LVL);
+    return true;
+}
+
+bool ShmPeer::sendAll(const char* data, size_t length)
+{
+    while (length) {
+        int sent = PlatformStreamSend(stream, data, (int)length);
+        if (sent > 0) {
+            data += sent;
+            length -= sent;
+            bytesOut += sent;
+            continue;
+        }
+        UINT32 error = PlatformSocketLastError();
+        if (!PlatformSocketWouldBlock(error)) {
+            return false;
+        }
+        // a full ring, the client reads it.
+        while ((error = PlatformStreamWaitWritable(stream, SHM_PEER_WAIT_MS)) != NO_ERROR) {
+            if (stopping || error != SHM_PEER_TIMEOUT) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int ShmPeer::run()
+{
+    PPLATFORM_WAITER waiter;
+    if (PlatformWaiterCreate(&waiter) != NO_ERROR ||
+        PlatformWaiterAddStream(waiter, stream) != NO_ERROR) {
+        logger << "peer: waiter error\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+
+    std::vector<char> buffer(SHM_PEER_BUFFER_SIZE);
+    BYTE next = 0;
+    bool connected = false;
+    int status = 0;
+    while (!stopping) {
+        bool sourcing = (mode == PeerMode::Source) && connected;
+        ULONG ready = PlatformWait(waiter, sourcing ? 0 : SHM_PEER_WAIT_MS);
+        if (ready == PLATFORM_WAIT_FAILED) {
+            status = 1;
+            break;
+        }
+        int received;
+        while ((received = PlatformStreamRecv(stream, buffer.data(), (int)buffer.size())) > 0) {
+            bytesIn += received;
+            if ((mode == PeerMode::Echo || mode == PeerMode::Reflect) &&
+                !sendAll(buffer.data(), received)) {
+                received = 0;
+                break;
+            }
+        }
+        if (received == 0) {
+            break;
+        }
+        UINT32 error = PlatformSocketLastError();
+        if (!PlatformSocketWouldBlock(error)) {
+            logger << "peer: shared memory error " << error << "\n";
+            logger.flush(Logger::ERROR_LVL);
+            status = 1;
+            break;
+        }
+        if (!connected && ready == 0) {
+            // the first signal is the client attaching.
+            connected = true;
+            logger << "peer: client attached\n";
+            logger.flush(Logger::VERBOSE_LVL);
+        }
+
+        //
+        // a source keeps the ring full while the client reads it.
+        //
+        if (sourcing) {
+            for (size_t i = 0; i < buffer.size(); i++) {
+                buffer[i] = (char)next++;
+            }
+            if (!sendAll(buffer.data(), buffer.size())) {
+                break;
+            }
+        }
+    }
+    PlatformWaiterClose(waiter);
+    logger << "peer: client closed, " << bytesIn << " bytes in, " << bytesOut << " bytes out\n";
+    logger.flush(Logger::VERBOSE_LVL);
+    return status;
+}
+
+StreamTransport::StreamTransport() : stats(new HTS_VSP_REPORT())
+{
+}
+
+StreamTransport::~StreamTransport()
+{
+    if (waiter) {
+        PlatformWaiterClose(waiter);
+    }
+    PlatformStreamClose(stream);
+}
+
+bool StreamTransport::openShm(const std::string& name, ULONG readTimeoutMs)
+{
+    target = "shm:" + name;
+    timeoutMs = readTimeoutMs;
+    return attach(PlatformShmConnect(name.c_str(), &stream));
+}
+
+bool StreamTransport::openUdp(const std::string& host, USHORT port, ULONG readTimeoutMs)
+{
+    target = "udp:" + host + ":" + std::to_string(port);
+    timeoutMs = readTimeoutMs;
+    return attach(UdpStreamOpen(host.c_str(), port, readTimeoutMs, stats.get(), &stream));
+}
+
+bool StreamTransport::attach(uint32_t error)
+{
+    if (error == NO_ERROR) {
+        error = PlatformWaiterCreate(&waiter);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddStream(waiter, stream);
+    }
+    if (error != NO_ERROR) {
+        logger << "cannot connect to " << target << " error " << error << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return false;
+    }
+    return true;
+}
+
+bool StreamTransport::write(const BYTE* data, size_t length)
+{
+    while (length) {
+        int sent = PlatformStreamSend(stream, (const char*)data, (int)length);
+        if (sent > 0) {
+            data += sent;
+            length -= sent;
+        }
+        else if (!PlatformSocketWouldBlock(PlatformSocketLastError()) ||
+            PlatformStreamWaitWritable(stream, timeoutMs) != NO_ERROR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+long StreamTransport::read(BYTE* data, size_t length)
+{
+    for (;;) {
+        int received = PlatformStreamRecv(stream, (char*)data, (int)length);
+        if (received > 0) {
+            return received;
+        }
+        if (received == 0 || !PlatformSocketWouldBlock(PlatformSocketLastError())) {
+            return -1;
+        }
+        ULONG ready = PlatformWait(waiter, timeoutMs);
+        if (ready == PLATFORM_WAIT_TIMEOUT) {
+            return 0;
+        }
+        if (ready != 0) {
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "Benchmark.h"
+#include "PeerService.h"
+#include <atomic>
+#include <memory>
+#include <string>
+
+struct HTS_VSP_REPORT;
+typedef struct _PLATFORM_STREAM *PLATFORM_STREAM;
+typedef struct _PLATFORM_WAITER *PPLATFORM_WAITER;
+
+/**
+ * @brief A test peer on the server end of a shared memory stream.
+ *
+ * The stream is a pair of rings in a mapping shared with one client on the same host,
+ * normally the driver with --transport shm, see ComPort/shmring.h. The peer is not paced,
+ * the transport is there for throughput and handoff latency, so echo and reflect are the same.
+ */
+class ShmPeer {
+public:
+    ShmPeer(const std::string& Name, PeerMode Mode) : name(Name), mode(Mode) {}
+    ~ShmPeer();
+
+    /**
+     * @brief Creates the mapping the client attaches to.
+     */
+    bool start();
+
+    /**
+     * @brief Serves the client until it closes its end or stop is called.
+     *
+     * @return int 0 on normal exit, else 1.
+     */
+    int run();
+
+    /**
+     * @brief Makes run return within 100 ms. May be called from any thread.
+     */
+    void stop() { stopping = true; }
+
+private:
+    bool sendAll(const char* data, size_t length);
+
+    std::string name;
+    PeerMode mode;
+    PLATFORM_STREAM stream = nullptr;
+    std::atomic<bool> stopping{ false };
+    INT64 bytesIn = 0;
+    INT64 bytesOut = 0;
+};
+
+/**
+ * @brief The client end of a driver stream, to bench a ShmPeer in another process or a
+ * PeerService over the reliable udp transport, see ComPort/udp.h.
+ */
+class StreamTransport : public BenchTransport {
+public:
+    StreamTransport();
+    ~StreamTransport();
+
+    bool openShm(const std::string& name, ULONG readTimeoutMs);
+    bool openUdp(const std::string& host, USHORT port, ULONG readTimeoutMs);
+    bool write(const BYTE* data, size_t length) override;
+    long read(BYTE* data, size_t length) override;
+    std::string name() const override { return target; }
+
+    /**
+     * @brief The counters of the udp transport, as the driver reports them.
+     */
+    const HTS_VSP_REPORT& report() const { return *stats; }
+
+private:
+    bool attach(uint32_t error);
+
+    PLATFORM_STREAM stream = nullptr;
+    PPLATFORM_WAITER waiter = nullptr;
+    ULONG timeoutMs = 0;
+    std::string target;
+    std::unique_ptr<HTS_VSP_REPORT> stats;
+};
@@ -0,0 +1,99 @@
+#pragma once
+#include "NetCompat.h"
+#include <map>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+/**
+ * @brief Waits on many non-blocking sockets, with epoll on linux and WSAPoll on windows.
+ *
+ * Each socket has an interest of Read and Write flags, wait returns the sockets that are
+ * ready for any of it.
+ */
+#ifdef __linux__
+class SocketPoller {
+public:
+    enum { Read = 1, Write = 2 };
+
+    SocketPoller() : epoll(epoll_create1(EPOLL_CLOEXEC)) {}
+    ~SocketPoller() { if (epoll >= 0) close(epoll); }
+
+    bool valid() const { return epoll >= 0; }
+
+    void set(SOCKET s, ULONG events, bool added)
+    {
+        struct epoll_event event = { };
+        event.events = ((events & Read) ? EPOLLIN : 0) | ((events & Write) ? EPOLLOUT : 0);
+        event.data.fd = s;
+        epoll_ctl(epoll, added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, s, &event);
+    }
+
+    void remove(SOCKET s) { epoll_ctl(epoll, EPOLL_CTL_DEL, s, NULL); }
+
+    int wait(int timeoutMs, std::vector<std::pair<SOCKET, ULONG>>& ready)
+    {
+        struct epoll_event events[64];
+        int count = epoll_wait(epoll, events, 64, timeoutMs);
+        ready.clear();
+        for (int i = 0; i < count; i++) {
+            ULONG flags = 0;
+            // errors and hangup are reported as readable, recv returns the reason.
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                flags |= Read;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flags |= Write;
+            }
+            SOCKET s = events[i].data.fd;
+            ready.emplace_back(s, flags);
+        }
+        return (count < 0 && errno == EINTR) ? 0 : count;
+    }
+
+private:
+    int epoll;
+};
+#else
+class SocketPoller {
+public:
+    enum { Read = 1, Write = 2 };
+
+    bool valid() const { return true; }
+
+    void set(SOCKET s, ULONG events, bool) { sockets[s] = events; }
+    void remove(SOCKET s) { sockets.erase(s); }
+
+    int wait(int timeoutMs, std::vector<std::pair<SOCKET, ULONG>>& ready)
+    {
+        fds.clear();
+        for (auto& entry : sockets) {
+            pollfd_t fd = { 0 };
+            fd.fd = entry.first;
+            fd.events = ((entry.second & Read) ? POLLIN : 0) | ((entry.second & Write) ? POLLOUT : 0);
+            fds.push_back(fd);
+        }
+        int count = netPoll(fds.data(), (ULONG)fds.size(), timeoutMs);
+        ready.clear();
+        for (int i = 0; count > 0 && i < (int)fds.size(); i++) {
+            ULONG flags = 0;
+            if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+                flags |= Read;
+            }
+            if (fds[i].revents & POLLOUT) {
+                flags |= Write;
+            }
+            if (flags) {
+                ready.emplace_back(fds[i].fd, flags);
+            }
+        }
+        return count;
+    }
+
+private:
+    std::map<SOCKET, ULONG> sockets;
+    std::vector<pollfd_t> fds;
+};
+#endif
@@ -0,0 +1,182 @@
+#include "TimelineCapture.h"
+#include <fstream>
+#include <sstream>
+#include "Logger.h"
+
+extern Logger logger;
+
+namespace {
+    const char* waitName(INT64 waitResult)
+    {
+        // must match CLIENT_WAIT_SOURCE in ComPort/network.cpp.
+        switch (waitResult) {
+        case WAIT_OBJECT_0: return "socket event";
+        case WAIT_OBJECT_0 + 1: return "terminate event";
+        case WAIT_OBJECT_0 + 2: return "read queue event";
+        case WAIT_OBJECT_0 + 3: return "cancel event";
+        case WAIT_OBJECT_0 + 4: return "interval timer event";
+        case WAIT_OBJECT_0 + 5: return "total timer event";
+        case WAIT_OBJECT_0 + 6: return "overflow timer event";
+        case WAIT_OBJECT_0 + 7: return "configure or client stop event";
+        case WAIT_TIMEOUT: return "wait timeout";
+        case WAIT_IO_COMPLETION: return "io completion";
+        default: return "wait failed";
+        }
+    }
+
+    const char* connectionStateName(INT64 state)
+    {
+        switch (state) {
+        case HtsConnectionIdle: return "idle";
+        case HtsConnectionListening: return "listening";
+        case HtsConnectionConnected: return "connected";
+        case HtsConnectionReconnecting: return "reconnecting";
+        case HtsConnectionConnecting: return "connecting";
+        default: return "unknown";
+        }
+    }
+
+    // track ids within the port process.
+    enum { REQUEST_TRACK = 1, CLIENT_THREAD_TRACK = 2, TIMER_TRACK = 3 };
+}
+
+bool TimelineCapture::control(HANDLE h, DWORD enable)
+{
+    ULONG bytesReturned;
+    if (!DeviceIoControl(h, IOCTL_HTSVSP_TIMELINE_CONTROL,
+        &enable, sizeof(enable), NULL, 0, &bytesReturned, NULL)) {
+        logger << "DeviceIoControl IOCTL_HTSVSP_TIMELINE_CONTROL failed error " << GetLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return false;
+    }
+    return true;
+}
+
+bool TimelineCapture::drain(HANDLE h)
+{
+    for (;;) {
+        ULONG bytesReturned = 0;
+        if (!DeviceIoControl(h, IOCTL_HTSVSP_TIMELINE_READ,
+            NULL, 0, readBuffer.data(), (DWORD)readBuffer.size(), &bytesReturned, NULL)) {
+            logger << "DeviceIoControl IOCTL_HTSVSP_TIMELINE_READ failed error " << GetLastError() << "\n";
+            logger.flush(Logger::ERROR_LVL);
+            return false;
+        }
+        auto header = (PHTS_VSP_TIMELINE_HEADER)readBuffer.data();
+        auto first = (PHTS_VSP_TIMELINE_EVENT)(header + 1);
+        events.insert(events.end(), first, first + header->count);
+        dropped += header->dropped;
+        // a partially filled buffer means the driver capture is empty.
+        size_t capacity = (readBuffer.size() - sizeof(*header)) / sizeof(HTS_VSP_TIMELINE_EVENT);
+        if (header->count < capacity) {
+            return true;
+        }
+    }
+}
+
+bool TimelineCapture::capture(ULONG seconds)
+{
+    HANDLE h = OpenCommPort(portNumber, GENERIC_READ | GENERIC_WRITE, FILE_FLAG_OVERLAPPED);
+    if (h == INVALID_HANDLE_VALUE) {
+        logger << "OpenCommPort failed error " << GetLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return false;
+    }
+    readBuffer.resize(sizeof(HTS_VSP_TIMELINE_HEADER) + 1024 * sizeof(HTS_VSP_TIMELINE_EVENT));
+    events.clear();
+    dropped = 0;
+
+    if (!control(h, 1)) {
+        CloseHandle(h);
+        return false;
+    }
+
+    //
+    // the driver keeps the last 4096 events, drain often enough
+    // that a busy port does not overwrite them.
+    //
+    bool result = true;
+    ULONGLONG end = GetTickCount64() + (ULONGLONG)seconds * 1000;
+    while (result && GetTickCount64() < end) {
+        Sleep(50);
+        result = drain(h);
+    }
+    control(h, 0);
+    if (result) {
+        result = drain(h);
+    }
+    CloseHandle(h);
+    return result;
+}
+
+bool TimelineCapture::writeChromeTrace(const std::string& fileName) const
+{
+    std::ofstream out(fileName, std::ios::out | std::ios::trunc);
+    if (!out) {
+        logger << "cannot create " << fileName << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return false;
+    }
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    INT64 origin = events.empty() ? 0 : events.front().timestamp;
+    auto micros = [&](INT64 timestamp) {
+        return (double)(timestamp - origin) * 1000000.0 / (double)frequency.QuadPart;
+    };
+
+    out.precision(3);
+    out << std::fixed;
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << portNumber
+        << ",\"args\":{\"name\":\"htsvsp COM" << portNumber << "\"}},\n";
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << portNumber << ",\"tid\":" << REQUEST_TRACK
+        << ",\"args\":{\"name\":\"read requests\"}},\n";
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << portNumber << ",\"tid\":" << CLIENT_THREAD_TRACK
+        << ",\"args\":{\"name\":\"ClientThread\"}},\n";
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << portNumber << ",\"tid\":" << TIMER_TRACK
+        << ",\"args\":{\"name\":\"read timers\"}}";
+
+    for (auto& event : events) {
+        out << ",\n{\"pid\":" << portNumber << ",\"ts\":" << micros(event.timestamp);
+        switch (event.type) {
+        case HtsTimelineReadQueued:
+            out << ",\"tid\":" << REQUEST_TRACK << ",\"ph\":\"b\",\"cat\":\"read\",\"name\":\"read\",\"id\":"
+                << event.correlationId << ",\"args\":{\"length\":" << event.arg0 << "}}";
+            break;
+        case HtsTimelineReadDequeued:
+            out << ",\"tid\":" << REQUEST_TRACK << ",\"ph\":\"n\",\"cat\":\"read\",\"name\":\"dequeued\",\"id\":"
+                << event.correlationId << "}";
+            break;
+        case HtsTimelineRecv:
+            out << ",\"tid\":" << REQUEST_TRACK << ",\"ph\":\"n\",\"cat\":\"read\",\"name\":\"recv\",\"id\":"
+                << event.correlationId << ",\"args\":{\"bytes\":" << event.arg0 << "}}";
+            break;
+        case HtsTimelineReadCompleted:
+            out << ",\"tid\":" << REQUEST_TRACK << ",\"ph\":\"e\",\"cat\":\"read\",\"name\":\"read\",\"id\":"
+                << event.correlationId << ",\"args\":{\"status\":\"0x" << std::hex << (ULONG)event.arg0 << std::dec
+                << "\",\"information\":" << event.arg1 << "}}";
+            break;
+        case HtsTimelineWake:
+            out << ",\"tid\":" << CLIENT_THREAD_TRACK << ",\"ph\":\"i\",\"s\":\"t\",\"name\":\""
+                << waitName(event.arg0) << "\",\"args\":{\"request\":" << event.correlationId << "}}";
+            break;
+        case HtsTimelineTimerFired:
+            out << ",\"tid\":" << TIMER_TRACK << ",\"ph\":\"i\",\"s\":\"t\",\"name\":\""
+                << (event.arg0 ? "total timer" : "interval timer") << "\",\"args\":{\"request\":"
+                << event.correlationId << "}}";
+            break;
+        case HtsTimelineConnectionState:
+            out << ",\"tid\":" << CLIENT_THREAD_TRACK << ",\"ph\":\"i\",\"s\":\"p\",\"name\":\""
+                << connectionStateName(event.arg0) << "\",\"args\":{\"from\":\""
+                << connectionStateName(event.arg1) << "\"}}";
+            break;
+        default:
+            out << ",\"tid\":" << CLIENT_THREAD_TRACK << ",\"ph\":\"i\",\"s\":\"t\",\"name\":\"type "
+                << event.type << "\"}";
+            break;
+        }
+    }
+    out << "\n]}\n";
+    return (bool)out;
+}
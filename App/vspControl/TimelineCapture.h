@@ -0,0 +1,51 @@
+#pragma once
+#include <windows.h>
+#include <htsvsp.h>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Captures the driver request timeline of one htsvsp port and writes it as a
+ * Chrome trace-event JSON file, viewable in chrome://tracing or ui.perfetto.dev.
+ *
+ * Each read request becomes an async slice from ReadQueued to ReadCompleted, with
+ * dequeue and recv as steps inside it. Client thread wakeups and timer callbacks are
+ * instant events on their own tracks.
+ */
+class TimelineCapture {
+public:
+    /**
+     * @brief Constructs a TimelineCapture for a port.
+     *
+     * @param PortNumber The COM port number of the htsvsp device.
+     */
+    TimelineCapture(ULONG PortNumber) : portNumber(PortNumber) {}
+
+    /**
+     * @brief Enables the driver capture, drains it for the given time and disables it again.
+     *
+     * @param seconds How long to capture.
+     * @return bool true if the capture ran, false if the driver could not be reached.
+     */
+    bool capture(ULONG seconds);
+
+    /**
+     * @brief Writes the captured events as a trace-event JSON file.
+     *
+     * @param fileName The output file.
+     * @return bool true on success.
+     */
+    bool writeChromeTrace(const std::string& fileName) const;
+
+    size_t eventCount() const { return events.size(); }
+    ULONGLONG droppedCount() const { return dropped; }
+
+private:
+    bool control(HANDLE h, DWORD enable);
+    bool drain(HANDLE h);
+
+    ULONG portNumber;
+    std::vector<HTS_VSP_TIMELINE_EVENT> events;
+    std::vector<BYTE> readBuffer;
+    ULONGLONG dropped = 0;
+};
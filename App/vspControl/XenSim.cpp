@@ -0,0 +1,436 @@
+#include "XenSim.h"
+#include "KdProtocol.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include "Logger.h"
+
+extern Logger logger;
+
+using std::chrono::steady_clock;
+
+namespace {
+    const size_t SOCKET_BUFFER_SIZE = 16 * 1024;
+    const int STOP_POLL_MS = 100;
+
+    // the guest loops the port back, like a loopback plug.
+    class EchoGuest : public GuestModel {
+    public:
+        void receive(const BYTE* data, size_t length) override
+        {
+            output.insert(output.end(), data, data + length);
+        }
+    };
+
+    //
+    // a kd target stopped in the debugger: every data packet is acked
+    // and answered with a state manipulate packet of the same size, a
+    // breakin is answered with a state change.
+    //
+    class KdGuest : public GuestModel {
+    public:
+        void receive(const BYTE* data, size_t length) override
+        {
+            for (size_t i = 0; i < length; i++) {
+                switch (parser.feed(data[i])) {
+                case KdStreamParser::Breakin:
+                    stateChange();
+                    break;
+                case KdStreamParser::Control:
+                    if (parser.header().PacketType == KD_PACKET_TYPE_RESET) {
+                        control(KD_PACKET_TYPE_RESET, KD_SYNC_PACKET_ID);
+                        nextId = KD_INITIAL_PACKET_ID;
+                    }
+                    break;
+                case KdStreamParser::Data:
+                    if (!parser.checksumValid()) {
+                        control(KD_PACKET_TYPE_RESEND, 0);
+                        break;
+                    }
+                    control(KD_PACKET_TYPE_ACKNOWLEDGE, parser.header().PacketId);
+                    if (parser.header().PacketType == KD_PACKET_TYPE_STATE_MANIPULATE) {
+                        send(KD_PACKET_TYPE_STATE_MANIPULATE, parser.payload(), parser.header().ByteCount);
+                    }
+                    break;
+                default:
+                    break;
+                }
+            }
+        }
+
+    private:
+        void control(uint16_t type, uint32_t id)
+        {
+            BYTE packet[sizeof(KD_PACKET_HEADER)];
+            size_t length = kdBuildControlPacket(packet, type, id);
+            output.insert(output.end(), packet, packet + length);
+        }
+
+        void send(uint16_t type, const BYTE* data, uint16_t length)
+        {
+            std::vector<BYTE> packet(sizeof(KD_PACKET_HEADER) + length + 1);
+            kdBuildDataPacket(packet.data(), type, nextId, data, length);
+            output.insert(output.end(), packet.begin(), packet.end());
+            nextId ^= 1;
+        }
+
+        void stateChange()
+        {
+            // about the size of DBGKD_ANY_WAIT_STATE_CHANGE on x64.
+            BYTE state[0xf0] = { 0 };
+            send(KD_PACKET_TYPE_STATE_CHANGE64, state, sizeof(state));
+        }
+
+        KdStreamParser parser;
+        uint32_t nextId = KD_INITIAL_PACKET_ID;
+    };
+
+    // the guest sends a recorded stream and ignores what it receives.
+    class ReplayGuest : public GuestModel {
+    public:
+        ReplayGuest(std::vector<BYTE>&& Data, bool Loop) : data(std::move(Data)), loop(Loop) {}
+
+        void receive(const BYTE*, size_t) override {}
+
+        void poll(UartModel::TimePoint) override
+        {
+            // keep a few fifos worth queued, the uart paces the rest.
+            while (output.size() < 256 && position < data.size()) {
+                size_t length = std::min((size_t)256, data.size() - position);
+                output.insert(output.end(), data.begin() + position, data.begin() + position + length);
+                position += length;
+                if (position == data.size() && loop) {
+                    position = 0;
+                }
+            }
+        }
+
+    private:
+        std::vector<BYTE> data;
+        bool loop;
+        size_t position = 0;
+    };
+}
+
+UartModel::UartModel(ULONG Baud, size_t FifoDepth, bool DropOnOverflow) :
+    bytesPerSecond(Baud / 10.0),
+    fifoDepth(std::max(FifoDepth, (size_t)1)),
+    dropOnOverflow(DropOnOverflow)
+{
+}
+
+void UartModel::ptyWrite(const BYTE* data, size_t length)
+{
+    ptyInput.insert(ptyInput.end(), data, data + length);
+}
+
+size_t UartModel::ptyPeek(BYTE* data, size_t length) const
+{
+    length = std::min(length, ptyOutput.size());
+    std::copy(ptyOutput.begin(), ptyOutput.begin() + length, data);
+    return length;
+}
+
+void UartModel::ptyConsume(size_t length)
+{
+    ptyOutput.erase(ptyOutput.begin(), ptyOutput.begin() + std::min(length, ptyOutput.size()));
+}
+
+size_t UartModel::ptyRead(BYTE* data, size_t length)
+{
+    length = ptyPeek(data, length);
+    ptyConsume(length);
+    return length;
+}
+
+size_t UartModel::guestRead(BYTE* data, size_t length)
+{
+    length = std::min(length, rxFifo.size());
+    std::copy(rxFifo.begin(), rxFifo.begin() + length, data);
+    rxFifo.erase(rxFifo.begin(), rxFifo.begin() + length);
+    return length;
+}
+
+size_t UartModel::guestWrite(const BYTE* data, size_t length)
+{
+    length = std::min(length, fifoDepth - txFifo.size());
+    txFifo.insert(txFifo.end(), data, data + length);
+    return length;
+}
+
+void UartModel::ptyReset()
+{
+    ptyInput.clear();
+    ptyOutput.clear();
+}
+
+void UartModel::advance(TimePoint now)
+{
+    if (!started) {
+        started = true;
+        last = now;
+    }
+    if (bytesPerSecond > 0) {
+        credit += std::chrono::duration<double>(now - last).count() * bytesPerSecond;
+    }
+    last = now;
+
+    while (bytesPerSecond == 0 || credit >= 1) {
+        bool moved = false;
+        if (!ptyInput.empty()) {
+            if (rxFifo.size() < fifoDepth) {
+                rxFifo.push_back(ptyInput.front());
+                ptyInput.pop_front();
+                received++;
+                peakRxFifo = std::max(peakRxFifo, rxFifo.size());
+                moved = true;
+            }
+            else if (dropOnOverflow) {
+                ptyInput.pop_front();
+                overruns++;
+                moved = true;
+            }
+        }
+        if (!txFifo.empty()) {
+            ptyOutput.push_back(txFifo.front());
+            txFifo.pop_front();
+            transmitted++;
+            moved = true;
+        }
+        if (!moved) {
+            break;
+        }
+        credit -= 1;
+    }
+    // an idle or stalled line does not save up byte times.
+    credit = std::min(credit, 1.0);
+}
+
+int UartModel::nextByteMs() const
+{
+    bool waiting = !txFifo.empty() ||
+        (!ptyInput.empty() && (dropOnOverflow || rxFifo.size() < fifoDepth));
+    if (!waiting) {
+        return -1;
+    }
+    if (bytesPerSecond == 0 || credit >= 1) {
+        return 0;
+    }
+    return (int)std::ceil((1 - credit) * 1000.0 / bytesPerSecond);
+}
+
+XenSimulator::~XenSimulator()
+{
+    if (client != INVALID_SOCKET) {
+        closesocket(client);
+    }
+    if (listener != INVALID_SOCKET) {
+        closesocket(listener);
+    }
+}
+
+bool XenSimulator::parseGuest(const std::string& name, XenGuest& guest)
+{
+    if (name == "echo") {
+        guest = XenGuest::Echo;
+    }
+    else if (name == "kd") {
+        guest = XenGuest::Kd;
+    }
+    else if (name == "replay") {
+        guest = XenGuest::Replay;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+USHORT XenSimulator::start()
+{
+    switch (options.guest) {
+    case XenGuest::Echo:
+        guest.reset(new EchoGuest());
+        break;
+    case XenGuest::Kd:
+        guest.reset(new KdGuest());
+        break;
+    case XenGuest::Replay: {
+        std::ifstream in(options.replayFile, std::ios::binary);
+        if (!in) {
+            logger << "xensim: cannot open replay file " << options.replayFile << "\n";
+            logger.flush(Logger::ERROR_LVL);
+            return 0;
+        }
+        std::vector<BYTE> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        guest.reset(new ReplayGuest(std::move(data), options.replayLoop));
+        break;
+    }
+    }
+    buffer.resize(SOCKET_BUFFER_SIZE);
+
+    listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET) {
+        logger << "xensim: socket error " << netLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 0;
+    }
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+    sockaddr_in service = { 0 };
+    service.sin_family = AF_INET;
+    service.sin_addr.s_addr = htonl(INADDR_ANY);
+    service.sin_port = htons(options.port);
+    if (!options.address.empty() && inet_pton(AF_INET, options.address.c_str(), &service.sin_addr) != 1) {
+        logger << "xensim: invalid address " << options.address << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 0;
+    }
+    socklen_t length = sizeof(service);
+    // like qemu, one client is served and the next waits in the backlog.
+    if (bind(listener, (sockaddr*)&service, sizeof(service)) == SOCKET_ERROR ||
+        listen(listener, 1) == SOCKET_ERROR ||
+        getsockname(listener, (sockaddr*)&service, &length) == SOCKET_ERROR) {
+        logger << "xensim: bind or listen error " << netLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        closesocket(listener);
+        listener = INVALID_SOCKET;
+        return 0;
+    }
+    logger << "xensim: hvm_serial=tcp::" << ntohs(service.sin_port) << ",server,nodelay,nowait " <<
+        options.baud << " baud, fifo " << options.fifoDepth <<
+        (options.dropOnOverflow ? ", drop on overflow" : ", no overflow") <<
+        ", guest poll " << options.guestPollUs << " us";
+    logger.flush(Logger::INFO_LVL);
+    return ntohs(service.sin_port);
+}
+
+int XenSimulator::run()
+{
+    if (listener == INVALID_SOCKET) {
+        return 1;
+    }
+    UartModel uart(options.baud, options.fifoDepth, options.dropOnOverflow);
+    auto guestPoll = std::chrono::microseconds(std::max(options.guestPollUs, (ULONG)1));
+    auto nextPoll = steady_clock::now();
+    std::vector<BYTE> guestBuffer(options.fifoDepth);
+
+    while (!stopping) {
+        auto now = steady_clock::now();
+        if (now - nextPoll > std::chrono::seconds(1)) {
+            // the simulator itself stalled, do not replay the missed polls.
+            nextPoll = now;
+        }
+        //
+        // run the uart up to each guest poll in turn, so the guest sees the
+        // fifo as it would have been at that time however late this loop woke.
+        //
+        while (nextPoll <= now) {
+            uart.advance(nextPoll);
+            serviceGuest(uart, guestBuffer, nextPoll);
+            nextPoll += guestPoll;
+        }
+        uart.advance(now);
+        if (client == INVALID_SOCKET) {
+            // nowait: with nobody connected the guest output is lost.
+            while (uart.ptyRead(buffer.data(), buffer.size())) {}
+        }
+
+        auto untilPoll = std::chrono::duration_cast<std::chrono::microseconds>(nextPoll - now).count();
+        int timeout = (int)((std::max((long long)untilPoll, 0LL) + 999) / 1000);
+        int byteMs = uart.nextByteMs();
+        if (byteMs >= 0) {
+            timeout = std::min(timeout, byteMs);
+        }
+        timeout = std::min(timeout, STOP_POLL_MS);
+
+        pollfd_t fd = { 0 };
+        if (client == INVALID_SOCKET) {
+            fd.fd = listener;
+            fd.events = POLLIN;
+        }
+        else {
+            fd.fd = client;
+            fd.events = (uart.ptySpace() ? POLLIN : 0) | (uart.ptyPending() ? POLLOUT : 0);
+        }
+        int ready = netPoll(&fd, 1, timeout);
+        if (ready < 0) {
+            if (netLastError() == EINTR) {
+                continue;
+            }
+            logger << "xensim: poll error " << netLastError() << "\n";
+            logger.flush(Logger::ERROR_LVL);
+            return 1;
+        }
+        if (ready == 0) {
+            continue;
+        }
+        if (client == INVALID_SOCKET) {
+            client = accept(listener, NULL, NULL);
+            if (client != INVALID_SOCKET) {
+                netSetNonBlocking(client);
+                netSetNoDelay(client);
+                clientBytesIn = clientBytesOut = 0;
+                logger << "xensim: client connected";
+                logger.flush(Logger::INFO_LVL);
+            }
+            continue;
+        }
+        if (!serviceClient(uart, (fd.revents & (POLLIN | POLLERR | POLLHUP)) != 0, (fd.revents & POLLOUT) != 0)) {
+            closeClient(uart);
+        }
+    }
+    return 0;
+}
+
+// the guest driver empties the receive fifo and refills the transmit fifo.
+void XenSimulator::serviceGuest(UartModel& uart, std::vector<BYTE>& guestBuffer, UartModel::TimePoint now)
+{
+    size_t length;
+    while ((length = uart.guestRead(guestBuffer.data(), guestBuffer.size())) != 0) {
+        guest->receive(guestBuffer.data(), length);
+    }
+    guest->poll(now);
+    length = std::min(guest->output.size(), guestBuffer.size());
+    std::copy(guest->output.begin(), guest->output.begin() + length, guestBuffer.begin());
+    length = uart.guestWrite(guestBuffer.data(), length);
+    guest->output.erase(guest->output.begin(), guest->output.begin() + length);
+}
+
+bool XenSimulator::serviceClient(UartModel& uart, bool readable, bool writable)
+{
+    if (readable && uart.ptySpace()) {
+        int received = recv(client, (char*)buffer.data(), (int)std::min(buffer.size(), uart.ptySpace()), 0);
+        if (received == 0) {
+            return false;
+        }
+        if (received < 0) {
+            return netWouldBlock(netLastError());
+        }
+        uart.ptyWrite(buffer.data(), received);
+        clientBytesIn += received;
+    }
+    if (writable) {
+        size_t length = uart.ptyPeek(buffer.data(), buffer.size());
+        int sent = send(client, (const char*)buffer.data(), (int)length, 0);
+        if (sent < 0) {
+            return netWouldBlock(netLastError());
+        }
+        uart.ptyConsume(sent);
+        clientBytesOut += sent;
+    }
+    return true;
+}
+
+void XenSimulator::closeClient(UartModel& uart)
+{
+    logger << "xensim: client closed, " << clientBytesIn << " bytes in, " << clientBytesOut <<
+        " bytes out. uart received " << uart.received << ", transmitted " << uart.transmitted <<
+        ", overruns " << uart.overruns << ", peak rx fifo " << uart.peakRxFifo;
+    logger.flush(Logger::INFO_LVL);
+    closesocket(client);
+    client = INVALID_SOCKET;
+    uart.ptyReset();
+}
@@ -0,0 +1,155 @@
+#pragma once
+#include "NetCompat.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * @brief A 16550 style uart between the Xen pty and the guest.
+ *
+ * Bytes written by the pty client wait in a pty buffer, then cross the line one byte
+ * time apart into the receive fifo, where the guest reads them. If the fifo is full
+ * when a byte arrives it is dropped as an overrun, or, when dropOnOverflow is false,
+ * the line stalls as qemu does when the uart cannot receive. Guest output goes the
+ * other way through the transmit fifo. A baud of 0 moves bytes without delay.
+ */
+class UartModel {
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    UartModel(ULONG Baud, size_t FifoDepth, bool DropOnOverflow);
+
+    // the pty side.
+    size_t ptySpace() const { return PTY_BUFFER_SIZE - ptyInput.size(); }
+    void ptyWrite(const BYTE* data, size_t length);
+    size_t ptyRead(BYTE* data, size_t length);
+    size_t ptyPeek(BYTE* data, size_t length) const;
+    void ptyConsume(size_t length);
+    size_t ptyPending() const { return ptyOutput.size(); }
+
+    // the guest side.
+    size_t guestRead(BYTE* data, size_t length);
+    size_t guestWrite(const BYTE* data, size_t length);
+
+    /**
+     * @brief Moves the bytes the line could carry since the last call.
+     */
+    void advance(TimePoint now);
+
+    /**
+     * @brief How long until advance can move another byte.
+     *
+     * @return int Milliseconds, -1 if no byte is waiting for the line.
+     */
+    int nextByteMs() const;
+
+    /**
+     * @brief Forgets the bytes in the pty buffers, the pty client went away.
+     */
+    void ptyReset();
+
+    INT64 received = 0;         // bytes that reached the receive fifo
+    INT64 transmitted = 0;      // bytes that left the transmit fifo
+    INT64 overruns = 0;         // bytes dropped on a full receive fifo
+    size_t peakRxFifo = 0;
+
+    static const size_t PTY_BUFFER_SIZE = 4096;
+
+private:
+    double bytesPerSecond;
+    size_t fifoDepth;
+    bool dropOnOverflow;
+    double credit = 0;
+    TimePoint last;
+    bool started = false;
+    std::deque<BYTE> ptyInput;
+    std::deque<BYTE> rxFifo;
+    std::deque<BYTE> txFifo;
+    std::deque<BYTE> ptyOutput;
+};
+
+/**
+ * @brief What the simulated guest does with the serial port.
+ */
+class GuestModel {
+public:
+    virtual ~GuestModel() {}
+
+    /**
+     * @brief Bytes the guest read from the receive fifo.
+     */
+    virtual void receive(const BYTE* data, size_t length) = 0;
+
+    /**
+     * @brief Called at every guest poll, before output is moved to the transmit fifo.
+     */
+    virtual void poll(UartModel::TimePoint) {}
+
+    std::deque<BYTE> output;
+};
+
+enum class XenGuest {
+    Echo,       // the guest loops the port back
+    Kd,         // the guest is a kd target stopped in the debugger
+    Replay,     // the guest sends a recorded byte stream
+};
+
+struct XenSimOptions {
+    std::string address;
+    USHORT port = 7001;
+    ULONG baud = 115200;
+    size_t fifoDepth = 16;
+    bool dropOnOverflow = true;
+    ULONG guestPollUs = 1000;   // how often the guest driver services the uart
+    XenGuest guest = XenGuest::Echo;
+    std::string replayFile;
+    bool replayLoop = false;
+};
+
+/**
+ * @brief Listens like a Xen host hvm_serial 'tcp::port,server,nodelay,nowait' pty and
+ * connects one client at a time to a simulated guest uart.
+ */
+class XenSimulator {
+public:
+    XenSimulator(const XenSimOptions& Options) : options(Options) {}
+    ~XenSimulator();
+
+    /**
+     * @brief Binds and listens, and prepares the guest.
+     *
+     * @return USHORT The listening port, 0 on failure.
+     */
+    USHORT start();
+
+    /**
+     * @brief Serves pty clients until stop is called.
+     *
+     * @return int 0 on normal exit, else 1.
+     */
+    int run();
+    void stop() { stopping = true; }
+
+    static bool parseGuest(const std::string& name, XenGuest& guest);
+
+private:
+    void serviceGuest(UartModel& uart, std::vector<BYTE>& guestBuffer, UartModel::TimePoint now);
+    bool serviceClient(UartModel& uart, bool readable, bool writable);
+    void closeClient(UartModel& uart);
+
+    XenSimOptions options;
+    SOCKET listener = INVALID_SOCKET;
+    SOCKET client = INVALID_SOCKET;
+    std::unique_ptr<GuestModel> guest;
+    std::vector<BYTE> buffer;
+    std::atomic<bool> stopping{ false };
+    INT64 clientBytesIn = 0;
+    INT64 clientBytesOut = 0;
+
+    // Prevent copying
+    XenSimulator(const XenSimulator& other) = delete;
+    XenSimulator& operator=(const XenSimulator& other) = delete;
+};
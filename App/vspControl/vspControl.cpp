@@ -8,6 +8,13 @@
 #include <string>
 #include <msports.h>
 #include "PortDeviceManager.h"
+#include "MetricsExporter.h"
+#include "TimelineCapture.h"
+#include "CaptureReader.h"
+#include "CaptureReplay.h"
+#include "KdAnalyzer.h"
+#include "Benchmark.h"
+#include "PeerService.h"
 #include "logger.h"
 
 #ifdef min
@@ -23,6 +30,7 @@ using std::cout;
 using std::endl;
 
 #define _CRT_SECURE_CPP_OVERLOAD_SECURE_NAMES 1
+#define BENCH_READ_TIMEOUT_MS 2000
 
 ULONG findHtsVsp(ULONG& portNumber);
 HANDLE configVSp(ULONG portNumber, HTS_VSP_CONFIG& config);
@@ -30,8 +38,16 @@ void listComportDatabase();
 void deleteComPort(ULONG comport);
 void setTraceLevel(ULONG level);
 void reportStatistics();
-int echoService(HTS_VSP_CONFIG& config);
+int echoService(HTS_VSP_CONFIG& config, const cxxopts::ParseResult& optResult);
 void setWaitUnits(ULONG units);
+void setSpin(ULONG spinUs);
+void setOverflow(const HTS_VSP_OVERFLOW& overflow);
+void setSchedule(const HTS_VSP_SCHEDULE& schedule);
+bool parseCpus(const std::string& cpus, ULONGLONG& affinity);
+std::string formatCpus(ULONGLONG affinity);
+bool controlCapture(const std::string& path, ULONG segmentBytes);
+int runBench(BenchTransport& transport, const cxxopts::ParseResult& optResult);
+int runReplay(BenchTransport& transport, const cxxopts::ParseResult& optResult);
 
 
 // Initialize the static members
@@ -52,13 +68,24 @@ int main(int argc, CHAR* argv[])
             ("c,client", "client mode. requires port and ipddress")
             ("s,server", "server mode. requires port and ipaddress")
             ("p,port", "service port, must be greater than zero.", cxxopts::value<USHORT>())
-            ("i,ipaddress", "ip address or dns name.", cxxopts::value<std::string>())
+            ("i,ipaddress", "ip address or dns name, the socket path for unix, the pipe name for pipe, the mapping name for shm.", cxxopts::value<std::string>())
+            ("transport", "tcp (default), unix, pipe, shm, mux or udp. echoservice: udp also serves reliable udp.", cxxopts::value<std::string>())
+            ("channel", "mux: the channel of the relay at ipaddress and port, 1 to 1023.", cxxopts::value<USHORT>())
+            ("taps", "service: clients that connect while one is connected get a read-only copy of the traffic, up to n.", cxxopts::value<USHORT>())
+            ("tapPolicy", "a tap that falls behind: drop (default) its copies or disconnect.", cxxopts::value<std::string>())
+            ("compress", "tcp or unix client, or echoservice: compress the stream, the peer must compress too.")
             ("l,listports", "list all active comport database ports.")
             ("d,deleteport", "delete comport number.", cxxopts::value<ULONG>())
             ("t,trace", "trace log level (0-3).", cxxopts::value<ULONG>())
             ("r,report", "report statistics.")
             ("v,verbose", "verbose output.")
             ("w,waitUnits", "set the 500ms wait units to n.", cxxopts::value<ULONG>())
+            ("spin", "busy poll the port for up to n microseconds before blocking, 0 is off. Needs a spare cpu.", cxxopts::value<ULONG>())
+            ("overflow", "received data that does not fit in the receive ring of the port: block (default) stops the peer, newest or oldest drops that data.", cxxopts::value<std::string>())
+            ("overflowTimeout", "overflow block: drop the newest data once the peer was stopped for this many ms, default never.", cxxopts::value<ULONG>())
+            ("priority", "scheduling of the port loops: latency runs them ahead of the others, for a debugger port, bulk behind, for a log port, or normal.", cxxopts::value<std::string>())
+            ("cpus", "priority: run the port loops on these cpus, like 0,2-3, or any (default).", cxxopts::value<std::string>())
+            ("pool", "priority, cpus: set the worker pool of all the ports instead of the selected port.")
             ("addDevice", "add a new htsvsp device")
             ("removeDevice", "remove htsvsp device specified by com port", cxxopts::value<std::string>())
             ("enableDevice", "enable htsvsp device specified by com port", cxxopts::value<std::string>())
@@ -67,6 +94,27 @@ int main(int argc, CHAR* argv[])
             ("stop", "stop network operations.")
             ("selectPort", "select which htsvsp port to use. Default is first found.", cxxopts::value<ULONG>())
             ("echoservice", "run as an echo service on the specified port.", cxxopts::value<USHORT>())
+            ("mode", "echo service mode: echo (default), discard, source or reflect.", cxxopts::value<std::string>())
+            ("baud", "pace the echo service like a serial line at this baud rate.", cxxopts::value<ULONG>())
+            ("metrics", "serve prometheus metrics for all htsvsp ports on the specified local port.", cxxopts::value<USHORT>())
+            ("timeline", "capture the read request timeline to a chrome trace json file.", cxxopts::value<std::string>())
+            ("duration", "timeline capture duration in seconds, default 10.", cxxopts::value<ULONG>())
+            ("capture", "capture what the port receives and what is written to it to path.0, path.1 and so on. The driver writes the files.", cxxopts::value<std::string>())
+            ("segmentMB", "capture: the size of a segment file, default 16.", cxxopts::value<ULONG>())
+            ("captureStop", "stop the capture.")
+            ("captureDump", "print the capture log at path.", cxxopts::value<std::string>())
+            ("from", "captureDump, kdAnalyze, replay: from this many ms after the capture started.", cxxopts::value<ULONG>())
+            ("to", "captureDump, kdAnalyze, replay: up to this many ms after the capture started.", cxxopts::value<ULONG>())
+            ("direction", "captureDump: rx (received), tx (written) or both (default). replay: tx by default.", cxxopts::value<std::string>())
+            ("brief", "captureDump: a line per record, without the data.")
+            ("kdAnalyze", "parse the kd packets of the capture log at path and report counts, resends, timeouts and latencies.", cxxopts::value<std::string>())
+            ("bench", "run the load generator through an echo peer. Uses the htsvsp port, or ipaddress and port directly.")
+            ("pattern", "bench patterns: byte, kd, bulk or all (default), comma separated.", cxxopts::value<std::string>())
+            ("count", "bench messages per pattern, default depends on the pattern.", cxxopts::value<ULONG>())
+            ("json", "write the bench results to a json file.", cxxopts::value<std::string>())
+            ("replay", "replay the records of the capture log at path like bench, through the htsvsp port or ipaddress and port.", cxxopts::value<std::string>())
+            ("speed", "replay: 1 (default) keeps the captured timing, 2 is twice as fast, 0 as fast as possible.", cxxopts::value<double>())
+            ("window", "replay: records in flight, default no limit.", cxxopts::value<ULONG>())
             ("install", "install driver, requires path to the inf file.", cxxopts::value<std::string>())
             ("uninstall", "uninstall driver, requires path to the inf file.", cxxopts::value<std::string>());
 
@@ -135,6 +183,49 @@ int main(int argc, CHAR* argv[])
         if (optResult.count("client")) {
             config.clientMode = true;
         }
+        if (optResult.count("transport")) {
+            std::string transport = optResult["transport"].as<std::string>();
+            if (transport == "unix") {
+                config.transport = HtsTransportUnix;
+            }
+            else if (transport == "pipe") {
+                config.transport = HtsTransportPipe;
+            }
+            else if (transport == "shm") {
+                config.transport = HtsTransportShm;
+            }
+            else if (transport == "mux") {
+                config.transport = HtsTransportMux;
+            }
+            else if (transport == "udp") {
+                config.transport = HtsTransportUdp;
+            }
+            else if (transport != "tcp") {
+                logger << "unknown transport " << transport << "\n";
+                logger.flush(Logger::ERROR_LVL);
+                return 1;
+            }
+        }
+        if (optResult.count("channel")) {
+            config.channel = optResult["channel"].as<USHORT>();
+        }
+        if (optResult.count("taps")) {
+            config.taps = optResult["taps"].as<USHORT>();
+        }
+        if (optResult.count("tapPolicy")) {
+            std::string policy = optResult["tapPolicy"].as<std::string>();
+            if (policy == "disconnect") {
+                config.tapPolicy = HtsTapDisconnect;
+            }
+            else if (policy != "drop") {
+                logger << "unknown tap policy " << policy << "\n";
+                logger.flush(Logger::ERROR_LVL);
+                return 1;
+            }
+        }
+        if (optResult.count("compress")) {
+            config.compression = HtsCompressionLz;
+        }
         if (optResult.count("listports")) {
             listComportDatabase();
             return 0;
@@ -144,6 +235,74 @@ int main(int argc, CHAR* argv[])
             return 0;
         }
 
+        if (optResult.count("metrics")) {
+            // the exporter finds all htsvsp ports itself.
+            MetricsExporter exporter;
+            if (exporter.discoverPorts() == 0) {
+                logger << "no htsvsp ports found\n";
+                logger.flush(Logger::ERROR_LVL);
+                return 1;
+            }
+            std::string address;
+            if (optResult.count("ipaddress")) {
+                address = optResult["ipaddress"].as<std::string>();
+            }
+            return exporter.serve(address, optResult["metrics"].as<USHORT>());
+        }
+
+        if (optResult.count("captureDump")) {
+            // reads the files, the port is not needed.
+            std::string path = optResult["captureDump"].as<std::string>();
+            unsigned directions = CaptureReader::directionMask(
+                optResult.count("direction") ? optResult["direction"].as<std::string>() : "both");
+            if (directions == 0) {
+                logger << "unknown direction " << optResult["direction"].as<std::string>() << "\n";
+                logger.flush(Logger::ERROR_LVL);
+                return 1;
+            }
+            CaptureReader reader;
+            if (!reader.open(path)) {
+                logger << "no capture log at " << path << ".0\n";
+                logger.flush(Logger::ERROR_LVL);
+                return 1;
+            }
+            uint64_t fromUs = optResult.count("from") ? optResult["from"].as<ULONG>() * 1000ULL : 0;
+            uint64_t toUs = optResult.count("to") ? optResult["to"].as<ULONG>() * 1000ULL : UINT64_MAX;
+            uint64_t records = reader.dump(std::cout, fromUs, toUs, directions, optResult.count("brief") != 0);
+            logger << records << " records in " << reader.segmentCount() << " segments\n";
+            logger.flush(Logger::INFO_LVL);
+            return 0;
+        }
+
+        if (optResult.count("kdAnalyze")) {
+            std::string path = optResult["kdAnalyze"].as<std::string>();
+            CaptureReader reader;
+            if (!reader.open(path)) {
+                logger << "no capture log at " << path << ".0\n";
+                logger.flush(Logger::ERROR_LVL);
+                return 1;
+            }
+            KdAnalyzer analyzer;
+            analyzer.analyze(reader, optResult.count("from") ? optResult["from"].as<ULONG>() * 1000ULL : 0,
+                optResult.count("to") ? optResult["to"].as<ULONG>() * 1000ULL : UINT64_MAX);
+            analyzer.print();
+            return 0;
+        }
+
+        if ((optResult.count("bench") || optResult.count("replay")) && config.address[0] && config.port) {
+            // measure the network path to the echo peer without the port.
+            if (!netStartup()) {
+                logger << "bench: WSAStartup error " << WSAGetLastError() << "\n";
+                logger.flush(Logger::ERROR_LVL);
+                return 1;
+            }
+            SocketTransport transport;
+            int status = transport.open(config.address, config.port, BENCH_READ_TIMEOUT_MS) ?
+                runBench(transport, optResult) : 1;
+            netCleanup();
+            return status;
+        }
+
         if (optResult.count("selectPort")) {
             htsvspPortNumber = optResult["selectPort"].as<ULONG>();
         }
@@ -159,7 +318,7 @@ int main(int argc, CHAR* argv[])
             return result;
         }
 
-        // these three functions depend on selectPort to work correctly.
+        // these functions depend on selectPort to work correctly.
         if (optResult.count("trace")) {
             setTraceLevel(optResult["trace"].as<ULONG>());
             return 0;
@@ -172,6 +331,81 @@ int main(int argc, CHAR* argv[])
             setWaitUnits(optResult["waitUnits"].as<ULONG>());
             return 0;
         }
+        if (optResult.count("spin")) {
+            setSpin(optResult["spin"].as<ULONG>());
+            return 0;
+        }
+        if (optResult.count("overflow")) {
+            HTS_VSP_OVERFLOW overflow = { HtsOverflowBlock, 0 };
+            std::string policy = optResult["overflow"].as<std::string>();
+            if (policy == "newest") {
+                overflow.policy = HtsOverflowDropNewest;
+            }
+            else if (policy == "oldest") {
+                overflow.policy = HtsOverflowDropOldest;
+            }
+            else if (policy != "block") {
+                logger << "unknown overflow policy " << policy << "\n";
+                logger.flush(Logger::ERROR_LVL);
+                return 1;
+            }
+            if (optResult.count("overflowTimeout")) {
+                overflow.timeoutMs = optResult["overflowTimeout"].as<ULONG>();
+            }
+            setOverflow(overflow);
+            return 0;
+        }
+        if (optResult.count("priority") || optResult.count("cpus")) {
+            HTS_VSP_SCHEDULE schedule = { 0 };
+            schedule.global = optResult.count("pool") ? TRUE : FALSE;
+            std::string priority = optResult.count("priority") ? optResult["priority"].as<std::string>() : "normal";
+            if (priority == "latency") {
+                schedule.priority = HtsPriorityLatency;
+            }
+            else if (priority == "bulk") {
+                schedule.priority = HtsPriorityBulk;
+            }
+            else if (priority != "normal") {
+                logger << "unknown priority " << priority << "\n";
+                logger.flush(Logger::ERROR_LVL);
+                return 1;
+            }
+            if (optResult.count("cpus") && !parseCpus(optResult["cpus"].as<std::string>(), schedule.affinity)) {
+                logger << "bad cpu list " << optResult["cpus"].as<std::string>() << "\n";
+                logger.flush(Logger::ERROR_LVL);
+                return 1;
+            }
+            setSchedule(schedule);
+            return 0;
+        }
+        if (optResult.count("capture") || optResult.count("captureStop")) {
+            std::string path = optResult.count("captureStop") ? "" : optResult["capture"].as<std::string>();
+            ULONG segmentMB = optResult.count("segmentMB") ? optResult["segmentMB"].as<ULONG>() : 0;
+            return controlCapture(path, segmentMB * 1024 * 1024) ? 0 : 1;
+        }
+        if (optResult.count("timeline")) {
+            ULONG seconds = optResult.count("duration") ? optResult["duration"].as<ULONG>() : 10;
+            std::string fileName = optResult["timeline"].as<std::string>();
+            TimelineCapture timeline(htsvspPortNumber);
+            logger << "capturing timeline for " << seconds << " seconds\n";
+            logger.flush(Logger::INFO_LVL);
+            if (!timeline.capture(seconds) || !timeline.writeChromeTrace(fileName)) {
+                return 1;
+            }
+            logger << timeline.eventCount() << " events (" << timeline.droppedCount()
+                << " dropped) written to " << fileName << "\n";
+            logger.flush(Logger::INFO_LVL);
+            return 0;
+        }
+
+        if (optResult.count("bench") || optResult.count("replay")) {
+            // the port must already be connected to an echo peer.
+            ComPortTransport transport(htsvspPortNumber);
+            if (!transport.open(BENCH_READ_TIMEOUT_MS)) {
+                return 1;
+            }
+            return runBench(transport, optResult);
+        }
 
         if (optResult.count("echoservice")) {
             config.port = optResult["echoservice"].as<USHORT>();
@@ -189,7 +423,25 @@ int main(int argc, CHAR* argv[])
             CloseHandle(handle);
             return 0;
         }
-        if (config.port == 0) {
+        if (config.transport == HtsTransportMux) {
+            if (!config.clientMode || config.port == 0 || config.channel == 0 || config.channel >= 1024) {
+                logger.log(Logger::ERROR_LVL, "mux transport requires client mode, port and a channel from 1 to 1023\n");
+                return 0;
+            }
+        }
+        else if (config.transport == HtsTransportUdp) {
+            if ((!config.clientMode && !echoServiceMode) || config.port == 0) {
+                logger.log(Logger::ERROR_LVL, "udp transport requires client mode and a port\n");
+                return 0;
+            }
+        }
+        else if (config.transport != HtsTransportTcp) {
+            if (config.address[0] == 0) {
+                logger.log(Logger::ERROR_LVL, "unix, pipe and shm transports require a path or name\n");
+                return 0;
+            }
+        }
+        else if (config.port == 0) {
             logger.log(Logger::ERROR_LVL, "port number must be greater than zero\n");
             return 0;
         }
@@ -197,8 +449,18 @@ int main(int argc, CHAR* argv[])
             logger.log(Logger::ERROR_LVL, "client mode requires an ip address or dns name\n");
             return 0;
         }
+        if (config.taps != 0 && (config.clientMode ||
+            (config.transport != HtsTransportTcp && config.transport != HtsTransportUnix))) {
+            logger.log(Logger::ERROR_LVL, "taps require a tcp or unix service\n");
+            return 0;
+        }
+        if (config.compression != HtsCompressionNone && !echoServiceMode && (!config.clientMode ||
+            (config.transport != HtsTransportTcp && config.transport != HtsTransportUnix))) {
+            logger.log(Logger::ERROR_LVL, "compression requires a tcp or unix client\n");
+            return 0;
+        }
         if (echoServiceMode) {
-            return echoService(config);
+            return echoService(config, optResult);
         }
 
         result = ERROR_SUCCESS;
@@ -225,6 +487,146 @@ int main(int argc, CHAR* argv[])
     }
 }
 
+int runBench(BenchTransport& transport, const cxxopts::ParseResult& optResult)
+{
+    if (optResult.count("replay")) {
+        return runReplay(transport, optResult);
+    }
+    std::string patterns = optResult.count("pattern") ? optResult["pattern"].as<std::string>() : "all";
+    ULONG count = optResult.count("count") ? optResult["count"].as<ULONG>() : 0;
+    std::string jsonFile = optResult.count("json") ? optResult["json"].as<std::string>() : "";
+    return Benchmark::runPatterns(transport, patterns, count, jsonFile);
+}
+
+// print the non empty buckets of a report histogram as "<upper bound>:count"
+void printHistogram(const char * title, const INT64 * buckets)
+{
+    logger << title;
+    for (int n = 0; n < HTS_VSP_HISTOGRAM_BUCKETS; n++) {
+        if (buckets[n] == 0) {
+            continue;
+        }
+        if (n == HTS_VSP_HISTOGRAM_BUCKETS - 1) {
+            logger << " inf:" << buckets[n];
+        }
+        else {
+            logger << " <" << (1ULL << n) << ":" << buckets[n];
+        }
+    }
+    logger << endl;
+}
+
+void printConnectAttempts(const HTS_VSP_REPORT& report)
+{
+    if (report.connectAttemptCount == 0) {
+        return;
+    }
+    logger << "connect us:        " << report.connectLatencyUs << endl;
+    for (DWORD n = 0; n < report.connectAttemptCount && n < HTS_VSP_CONNECT_ATTEMPTS; n++) {
+        const HTS_VSP_CONNECT_ATTEMPT& attempt = report.connectAttempts[n];
+        logger << "  attempt " << n << " " << attempt.address << " at " << attempt.startUs << " us: ";
+        if (attempt.error == HTS_VSP_CONNECT_ABANDONED) {
+            logger << "abandoned" << endl;
+        }
+        else {
+            if (attempt.error) {
+                logger << "error " << attempt.error;
+            }
+            else {
+                logger << "connected";
+            }
+            logger << " after " << attempt.latencyUs << " us" << endl;
+        }
+    }
+}
+
+void printConnectionState(const HTS_VSP_REPORT& report)
+{
+    static const char* names[] = { "idle", "listening", "connected", "reconnecting", "connecting" };
+    logger << "connection:        " <<
+        (report.connectionState < _countof(names) ? names[report.connectionState] : "unknown") <<
+        ", " << report.stateChanges << " changes" << endl;
+    if (report.startupConnectUs) {
+        logger << "startup connect us:" << report.startupConnectUs << endl;
+    }
+    if (report.inPlaceConfigures) {
+        logger << "in place configs:  " << report.inPlaceConfigures << endl;
+    }
+    if (report.tapClients || report.tapBytes) {
+        logger <<
+            "taps:              " << report.tapClients << endl <<
+            "tap bytes:         " << report.tapBytes << endl <<
+            "tap dropped bytes: " << report.tapDroppedBytes << endl <<
+            "tap disconnects:   " << report.tapDisconnects << endl;
+    }
+    if (report.compressRawBytes || report.decompressRawBytes) {
+        // the ratio of data to wire bytes and the compressor time per MB of data.
+        auto ratio = [](INT64 raw, INT64 wire) { return wire ? (double)raw / wire : 0.0; };
+        auto usPerMb = [](INT64 us, INT64 raw) { return raw ? us * 1e6 / raw : 0.0; };
+        std::ostringstream text;
+        text.precision(2);
+        text << std::fixed <<
+            "compressed:        " << report.compressRawBytes << " to " << report.compressWireBytes <<
+            " bytes, ratio " << ratio(report.compressRawBytes, report.compressWireBytes) <<
+            ", " << usPerMb(report.compressUs, report.compressRawBytes) << " us/MB" << endl <<
+            "decompressed:      " << report.decompressWireBytes << " to " << report.decompressRawBytes <<
+            " bytes, ratio " << ratio(report.decompressRawBytes, report.decompressWireBytes) <<
+            ", " << usPerMb(report.decompressUs, report.decompressRawBytes) << " us/MB" << endl;
+        logger << text.str();
+    }
+    if (report.udpDatagramsSent) {
+        logger <<
+            "udp srtt us:       " << report.udpSrttUs << ", rto " << report.udpRtoUs << endl <<
+            "udp datagrams:     " << report.udpDatagramsSent << " sent, " << report.udpDatagramsReceived << " received" << endl <<
+            "udp retransmits:   " << report.udpRetransmits << ", fast " << report.udpFastRetransmits <<
+            ", timeouts " << report.udpTimeouts << endl <<
+            "udp duplicates:    " << report.udpDuplicates << endl;
+    }
+    if (report.flowPauses || report.flowHeldBytes) {
+        logger <<
+            "flow watermarks:   " << report.flowHighWater << " high, " << report.flowLowWater << " low" << endl <<
+            "flow pauses:       " << report.flowPauses << ", resumes " << report.flowResumes << endl <<
+            "flow overrun bytes:" << report.flowOverrunBytes << endl <<
+            "xoff held bytes:   " << report.flowHeldBytes << endl;
+    }
+    if (report.overflowEvents || report.overflowPolicy != HtsOverflowBlock) {
+        static const char* names[] = { "block", "drop newest", "drop oldest" };
+        logger <<
+            "overflow policy:   " << (report.overflowPolicy < _countof(names) ? names[report.overflowPolicy] : "unknown") <<
+            ", timeout ms " << report.overflowTimeoutMs << endl <<
+            "overflow events:   " << report.overflowEvents << ", timeouts " << report.overflowTimeouts << endl <<
+            "overflow bytes:    " << report.overflowBytes << endl;
+    }
+    if (report.poolWorkers) {
+        logger <<
+            "pool workers:      " << report.poolWorkers << ", port loops " << report.poolWorks << endl <<
+            "pool runs:         " << report.poolRuns << ", steals " << report.poolSteals <<
+            ", yields " << report.poolYields << endl <<
+            "pool wakeups:      " << report.poolWakeups << ", timeouts " << report.poolTimeouts << endl;
+    }
+    if (report.poolWorkers) {
+        static const char* names[] = { "normal", "latency", "bulk" };
+        logger <<
+            "pool schedule:     " << (report.poolPriority < _countof(names) ? names[report.poolPriority] : "unknown") <<
+            ", cpus " << formatCpus(report.poolAffinity) << ", errors " << report.poolScheduleErrors << endl <<
+            "port schedule:     " << (report.schedulePriority < _countof(names) ? names[report.schedulePriority] : "unknown") <<
+            ", cpus " << formatCpus(report.scheduleAffinity) << endl;
+    }
+    if (report.captureSegments) {
+        logger <<
+            "capture:           " << report.captureRecords << " records, " << report.captureBytes <<
+            " bytes in " << report.captureSegments << " segments, " << report.captureDroppedRecords << " dropped" << endl;
+    }
+    if (report.disconnects == 0) {
+        return;
+    }
+    logger <<
+        "disconnects:       " << report.disconnects << endl <<
+        "reconnect tries:   " << report.reconnectAttempts << endl <<
+        "downtime us:       " << report.downtimeUs << ", last " << report.lastDowntimeUs << endl <<
+        "backlog bytes:     " << report.backlogBytes << ", dropped " << report.backlogDroppedBytes << endl;
+}
+
 void reportStatistics()
 {
     ULONG portNumber;
@@ -263,8 +665,20 @@ void reportStatistics()
             "read queue events: " << report.readQueueEvents << endl <<
             "read de-queues:    " << report.readDequeue << endl <<
             "wait timeouts:     " << report.waitTimeouts << endl <<
+            "reads completed:   " << report.readsCompleted << endl <<
             "wait units:        " << report.waitUnits << endl <<
+            "spin max us:       " << report.spinMaxUs << endl <<
+            "spin budget us:    " << report.spinBudgetUs << endl <<
+            "spin waits:        " << report.spinWaits << endl <<
+            "spin hits:         " << report.spinHits << endl <<
+            "spin cpu us:       " << report.spinUs << endl <<
+            "wake latency us:   " << report.wakeLatencyUs << endl <<
+            "spin saved us:     " << report.spinSavedUs << endl <<
             "trace level:       " << report.traceLevel << endl;
+        printHistogram("read latency us:   ", report.readLatencyUs);
+        printHistogram("recv size bytes:   ", report.recvSize);
+        printConnectAttempts(report);
+        printConnectionState(report);
         logger.flush(Logger::INFO_LVL);
         CloseHandle(h);
     }
@@ -354,6 +768,169 @@ void setWaitUnits(ULONG units)
 
 }
 
+// the spin limit is per port, it applies to the selected port.
+void setSpin(ULONG spinUs)
+{
+    HANDLE h = OpenCommPort(htsvspPortNumber, GENERIC_READ | GENERIC_WRITE, FILE_FLAG_OVERLAPPED);
+    if (h == INVALID_HANDLE_VALUE) {
+        cout << "OpenCommPort failed error " << GetLastError() << "\n";
+        return;
+    }
+    ULONG bytesReturned;
+    bool bResult = DeviceIoControl(h, IOCTL_HTSVSP_SET_SPIN,
+        &spinUs, sizeof(spinUs), NULL, 0, &bytesReturned, NULL);
+    if (!bResult) {
+        cout << "DeviceIoControl IOCTL_HTSVSP_SET_SPIN failed error " << GetLastError() << "\n";
+    }
+    else if (spinUs) {
+        cout << "spin set to at most " << spinUs << " us\n";
+    }
+    else {
+        cout << "spin off\n";
+    }
+    CloseHandle(h);
+}
+
+// the overflow policy is per port, it applies to the selected port.
+void setOverflow(const HTS_VSP_OVERFLOW& overflow)
+{
+    static const char* names[] = { "block", "drop newest", "drop oldest" };
+    HANDLE h = OpenCommPort(htsvspPortNumber, GENERIC_READ | GENERIC_WRITE, FILE_FLAG_OVERLAPPED);
+    if (h == INVALID_HANDLE_VALUE) {
+        cout << "OpenCommPort failed error " << GetLastError() << "\n";
+        return;
+    }
+    ULONG bytesReturned;
+    bool bResult = DeviceIoControl(h, IOCTL_HTSVSP_SET_OVERFLOW,
+        (LPVOID)&overflow, sizeof(overflow), NULL, 0, &bytesReturned, NULL);
+    if (!bResult) {
+        cout << "DeviceIoControl IOCTL_HTSVSP_SET_OVERFLOW failed error " << GetLastError() << "\n";
+    }
+    else if (overflow.policy == HtsOverflowBlock && overflow.timeoutMs) {
+        cout << "overflow block, drop newest after " << overflow.timeoutMs << " ms\n";
+    }
+    else {
+        cout << "overflow " << names[overflow.policy] << "\n";
+    }
+    CloseHandle(h);
+}
+
+// the schedule is of the selected port, or of the worker pool that runs all the
+// ports. The driver saves it and sets it again when the device starts.
+void setSchedule(const HTS_VSP_SCHEDULE& schedule)
+{
+    static const char* names[] = { "normal", "latency", "bulk" };
+    HANDLE h = OpenCommPort(htsvspPortNumber, GENERIC_READ | GENERIC_WRITE, FILE_FLAG_OVERLAPPED);
+    if (h == INVALID_HANDLE_VALUE) {
+        cout << "OpenCommPort failed error " << GetLastError() << "\n";
+        return;
+    }
+    ULONG bytesReturned;
+    bool bResult = DeviceIoControl(h, IOCTL_HTSVSP_SET_SCHEDULE,
+        (LPVOID)&schedule, sizeof(schedule), NULL, 0, &bytesReturned, NULL);
+    if (!bResult) {
+        cout << "DeviceIoControl IOCTL_HTSVSP_SET_SCHEDULE failed error " << GetLastError() << "\n";
+    }
+    else {
+        cout << (schedule.global ? "pool" : "port") << " priority " << names[schedule.priority] <<
+            ", cpus " << formatCpus(schedule.affinity) << "\n";
+    }
+    CloseHandle(h);
+}
+
+// a list like 0,2-3 of the first 64 cpus, or any for 0.
+bool parseCpus(const std::string& cpus, ULONGLONG& affinity)
+{
+    affinity = 0;
+    if (cpus == "any") {
+        return true;
+    }
+    std::stringstream list(cpus);
+    std::string range;
+    while (std::getline(list, range, ',')) {
+        unsigned first, last;
+        char dash;
+        std::stringstream item(range);
+        if (!(item >> first)) {
+            return false;
+        }
+        last = first;
+        if (item >> dash && (dash != '-' || !(item >> last))) {
+            return false;
+        }
+        if (first > last || last >= 64) {
+            return false;
+        }
+        for (unsigned cpu = first; cpu <= last; cpu++) {
+            affinity |= 1ULL << cpu;
+        }
+    }
+    return affinity != 0;
+}
+
+std::string formatCpus(ULONGLONG affinity)
+{
+    if (affinity == 0) {
+        return "any";
+    }
+    std::string cpus;
+    for (unsigned cpu = 0; cpu < 64; cpu++) {
+        if (!(affinity & (1ULL << cpu))) {
+            continue;
+        }
+        unsigned last = cpu;
+        while (last + 1 < 64 && (affinity & (1ULL << (last + 1)))) {
+            last++;
+        }
+        if (!cpus.empty()) {
+            cpus += ",";
+        }
+        cpus += std::to_string(cpu);
+        if (last > cpu) {
+            cpus += "-" + std::to_string(last);
+        }
+        cpu = last;
+    }
+    return cpus;
+}
+
+// the capture is per port, it applies to the selected port. An empty path stops it.
+bool controlCapture(const std::string& path, ULONG segmentBytes)
+{
+    HTS_VSP_CAPTURE_CONTROL control = { 0 };
+    if (path.size() >= sizeof(control.path)) {
+        cout << "capture path too long\n";
+        return false;
+    }
+    if (!path.empty()) {
+        // the driver runs in another process and directory.
+        if (GetFullPathNameA(path.c_str(), sizeof(control.path), control.path, NULL) == 0) {
+            cout << "GetFullPathName failed error " << GetLastError() << "\n";
+            return false;
+        }
+    }
+    control.segmentBytes = segmentBytes;
+    HANDLE h = OpenCommPort(htsvspPortNumber, GENERIC_READ | GENERIC_WRITE, FILE_FLAG_OVERLAPPED);
+    if (h == INVALID_HANDLE_VALUE) {
+        cout << "OpenCommPort failed error " << GetLastError() << "\n";
+        return false;
+    }
+    ULONG bytesReturned;
+    bool bResult = DeviceIoControl(h, IOCTL_HTSVSP_CAPTURE_CONTROL,
+        &control, sizeof(control), NULL, 0, &bytesReturned, NULL);
+    if (!bResult) {
+        cout << "DeviceIoControl IOCTL_HTSVSP_CAPTURE_CONTROL failed error " << GetLastError() << "\n";
+    }
+    else if (path.empty()) {
+        cout << "capture stopped\n";
+    }
+    else {
+        cout << "capturing to " << control.path << ".0\n";
+    }
+    CloseHandle(h);
+    return bResult;
+}
+
 bool testHtsVspPort(ULONG portNumber)
 {
 #pragma warning(push)
@@ -508,103 +1085,60 @@ void deleteComPort(ULONG comport)
     ComDBClose(handle);
 }
 
-int echoService(HTS_VSP_CONFIG& config)
+int echoService(HTS_VSP_CONFIG& config, const cxxopts::ParseResult& optResult)
 {
-    SOCKET srvSocket = INVALID_SOCKET;
-    SOCKET client = INVALID_SOCKET;
-
-    UINT16  versionRequested = WINSOCK_VERSION;
-    WSADATA wsaData = { 0 };
-    UINT32  status = WSAStartup(versionRequested,
-        &wsaData);
-    if (status != NO_ERROR) {
-        cout << "echo: WSAStartup error " << status << endl;
+    PeerOptions options;
+    options.port = config.port;
+    if (optResult.count("mode") && !PeerService::parseMode(optResult["mode"].as<std::string>(), options.mode)) {
+        logger << "unknown echo service mode " << optResult["mode"].as<std::string>() << "\n";
+        logger.flush(Logger::ERROR_LVL);
         return 1;
     }
-    srvSocket = socket(
-        AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (srvSocket == INVALID_SOCKET)
-    {
-        status = WSAGetLastError();
-        cout << "echo: socket() status: " << status << endl;
-        return 1;
-    };
-    sockaddr_in service;
-    service.sin_family = AF_INET;
-    service.sin_addr.s_addr = htonl(INADDR_ANY);
-    service.sin_port = htons(config.port);
-    cout << "echo: bind to: " << inet_ntoa(service.sin_addr) << ":" << ntohs(service.sin_port) << endl;
-    int result = bind(srvSocket, (sockaddr*)&service, sizeof(service));
-    if (result == SOCKET_ERROR) {
-        cout << "echo: bind error " << WSAGetLastError() << endl;
-        closesocket(srvSocket);
+    if (optResult.count("baud")) {
+        options.baud = optResult["baud"].as<ULONG>();
+    }
+    options.compress = config.compression != HtsCompressionNone;
+    options.udp = config.transport == HtsTransportUdp;
+    if (!netStartup()) {
+        logger << "echo: WSAStartup error " << WSAGetLastError() << "\n";
+        logger.flush(Logger::ERROR_LVL);
         return 1;
-
     }
+    PeerService peer(options);
+    int status = peer.start() ? peer.run() : 1;
+    netCleanup();
+    return status;
+}
 
-    struct sockaddr addr = { 0 };
-    int addrlen = sizeof(addr);
-    if (getsockname(srvSocket, &addr, &addrlen) == SOCKET_ERROR)
-    {
-        cout << "echo: getsockname error " << WSAGetLastError() << endl;
+int runReplay(BenchTransport& transport, const cxxopts::ParseResult& optResult)
+{
+    std::string path = optResult["replay"].as<std::string>();
+    ReplayOptions replayOptions;
+    std::string direction = optResult.count("direction") ? optResult["direction"].as<std::string>() : "tx";
+    replayOptions.directions = CaptureReader::directionMask(direction);
+    if (replayOptions.directions == 0) {
+        logger << "unknown direction " << direction << "\n";
+        logger.flush(Logger::ERROR_LVL);
         return 1;
     }
-    else
-    {
-        char buffer[1024];
-        DWORD cbBuffer = 1024;
-        if ((WSAAddressToString(&addr,
-            addrlen,
-            NULL,
-            buffer,
-            &cbBuffer)) == SOCKET_ERROR)
-        {
-            cout << "echo: WSAAddressToString error " << WSAGetLastError() << endl;
-            return 1;
-        }
-        cout << "echo: listen on: " << buffer << endl;
+    if (optResult.count("speed")) {
+        replayOptions.speed = optResult["speed"].as<double>();
     }
-
-    result = listen(srvSocket, 2);
-    if (result == SOCKET_ERROR) {
-        cout << "echo: listen error: " << WSAGetLastError() << endl;
-        closesocket(srvSocket);
+    if (optResult.count("window")) {
+        replayOptions.window = optResult["window"].as<ULONG>();
+    }
+    replayOptions.fromUs = optResult.count("from") ? optResult["from"].as<ULONG>() * 1000ULL : 0;
+    replayOptions.toUs = optResult.count("to") ? optResult["to"].as<ULONG>() * 1000ULL : UINT64_MAX;
+    CaptureReader reader;
+    if (!reader.open(path)) {
+        logger << "no capture log at " << path << ".0\n";
+        logger.flush(Logger::ERROR_LVL);
         return 1;
     }
-
-    while (srvSocket != INVALID_SOCKET) {
-        if ((client = accept(srvSocket, NULL, 0)) != INVALID_SOCKET) {
-            while (client != INVALID_SOCKET) {
-                char buffer[4096];
-                result = recv(client, buffer, 4096, 0);
-                if (result > 0) {
-                    result = send(client, buffer, result, 0);
-                    if (result == SOCKET_ERROR) {
-                        cout << "echo: send error: " << WSAGetLastError() << endl;
-                        closesocket(client);
-                        client = INVALID_SOCKET;
-                    }
-                }
-                else if (result == 0) {
-                    cout << "echo: client closed connection." << endl;
-                    closesocket(client);
-                    client = INVALID_SOCKET;
-
-                }
-                else {
-                    cout << "echo: recv error: " << WSAGetLastError() << endl;
-                    closesocket(client);
-                    client = INVALID_SOCKET;
-
-                }
-            }
-        }
-        else {
-            cout << "echo: accept error: " << WSAGetLastError() << endl;
-            closesocket(srvSocket);
-            srvSocket = INVALID_SOCKET;
-
-        }
+    BenchResult result = CaptureReplay(reader, replayOptions).run(transport);
+    CaptureReplay::print(result);
+    if (optResult.count("json") && !Benchmark::writeJson(optResult["json"].as<std::string>(), { result })) {
+        return 1;
     }
-    return 0;
+    return result.failed ? 1 : 0;
 }
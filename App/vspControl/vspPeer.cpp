@@ -0,0 +1,736 @@
+// vspPeer.cpp : the portable peer and load generator.
+//
+// vspControl needs the htsvsp driver and only builds on windows. The parts of it
+// that only need sockets are collected here so they also run on linux, for example
+// on the xen host or a build machine:
+//
+//   g++ -std=c++17 -O2 -pthread -I../../inc -I../../ComPort -o vspPeer vspPeer.cpp Benchmark.cpp PeerService.cpp XenSim.cpp
+//       ShmPeer.cpp MuxRelay.cpp ../../ComPort/platform_posix.cpp ../../ComPort/shmring.cpp ../../ComPort/mux.cpp
+//       ../../ComPort/ringbuffer.cpp ../../ComPort/connect.cpp ../../ComPort/lz.cpp ../../ComPort/rudp.cpp
+//       ../../ComPort/udp.cpp CaptureReader.cpp CaptureReplay.cpp EngineTransport.cpp ../../ComPort/engine.cpp
+//       ../../ComPort/tap.cpp ../../ComPort/capture.cpp KdAnalyzer.cpp
+//
+#include <sstream>
+#include "NetCompat.h"
+#include "Benchmark.h"
+#include "PeerService.h"
+#include "ShmPeer.h"
+#include "XenSim.h"
+#include "MuxRelay.h"
+#include "CaptureReader.h"
+#include "CaptureReplay.h"
+#include "KdAnalyzer.h"
+#include "EngineTransport.h"
+#include "mux.h"
+#include "compress.h"
+#include "htsvsp.h"
+#include "KdProtocol.h"
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include "Logger.h"
+#include "cxxopts.hpp"
+
+// Initialize the static members
+Logger::Level Logger::currentLevel = Logger::INFO_LVL;
+std::mutex Logger::logMutex;
+Logger logger;
+
+#define BENCH_READ_TIMEOUT_MS 2000
+
+int xenSimulator(const cxxopts::ParseResult& optResult)
+{
+    XenSimOptions options;
+    options.port = optResult["xensim"].as<USHORT>();
+    if (optResult.count("ipaddress")) {
+        options.address = optResult["ipaddress"].as<std::string>();
+    }
+    if (optResult.count("baud")) {
+        options.baud = optResult["baud"].as<ULONG>();
+    }
+    if (optResult.count("fifo")) {
+        options.fifoDepth = optResult["fifo"].as<size_t>();
+    }
+    if (optResult.count("guestpoll")) {
+        options.guestPollUs = optResult["guestpoll"].as<ULONG>();
+    }
+    options.dropOnOverflow = optResult.count("nodrop") == 0;
+    if (optResult.count("guest") && !XenSimulator::parseGuest(optResult["guest"].as<std::string>(), options.guest)) {
+        logger << "unknown xensim guest " << optResult["guest"].as<std::string>() << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+    if (optResult.count("replay")) {
+        options.guest = XenGuest::Replay;
+        options.replayFile = optResult["replay"].as<std::string>();
+        options.replayLoop = optResult.count("loop") != 0;
+    }
+    if (options.guest == XenGuest::Replay && options.replayFile.empty()) {
+        logger << "the replay guest needs --replay file\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+    XenSimulator simulator(options);
+    int status = simulator.start() ? simulator.run() : 1;
+    netCleanup();
+    return status;
+}
+
+int muxRelay(const cxxopts::ParseResult& optResult)
+{
+    MuxRelayOptions options;
+    options.port = optResult["relay"].as<USHORT>();
+    if (optResult.count("ipaddress")) {
+        options.address = optResult["ipaddress"].as<std::string>();
+    }
+    if (optResult.count("map")) {
+        for (auto& text : optResult["map"].as<std::vector<std::string>>()) {
+            MuxRoute route;
+            if (!MuxRoute::parse(text, route)) {
+                logger << "invalid relay map " << text << ", use first-last=host:port\n";
+                logger.flush(Logger::ERROR_LVL);
+                return 1;
+            }
+            options.routes.push_back(route);
+        }
+    }
+    if (options.routes.empty()) {
+        logger << "the relay needs --map first-last=host:port\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+    MuxRelay relay(options);
+    int status = relay.start() ? relay.run() : 1;
+    netCleanup();
+    return status;
+}
+
+//
+// benches a remote relay, or a loopback one in front of a reflect peer with every
+// channel routed to the peer.
+//
+int muxRelayBench(const cxxopts::ParseResult& optResult)
+{
+    MuxBenchOptions options;
+    if (optResult.count("channels")) {
+        options.channels = optResult["channels"].as<USHORT>();
+    }
+    if (options.channels == 0 || options.channels >= MUX_MAX_CHANNELS) {
+        logger << "relay bench channels must be 1 to " << MUX_MAX_CHANNELS - 1 << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+    if (optResult.count("rounds")) {
+        options.rounds = optResult["rounds"].as<ULONG>();
+    }
+    if (optResult.count("seconds")) {
+        options.seconds = optResult["seconds"].as<ULONG>();
+    }
+
+    PeerOptions peerOptions;
+    peerOptions.mode = PeerMode::Reflect;
+    peerOptions.address = "127.0.0.1";
+    peerOptions.maxClients = options.channels;
+    PeerService peer(peerOptions);
+    std::unique_ptr<MuxRelay> relay;
+    std::thread peerThread;
+    std::thread relayThread;
+    if (optResult.count("ipaddress")) {
+        if (!optResult.count("port")) {
+            logger << "relay bench with an ipaddress requires a port\n";
+            logger.flush(Logger::ERROR_LVL);
+            return 1;
+        }
+        options.host = optResult["ipaddress"].as<std::string>();
+        options.port = optResult["port"].as<USHORT>();
+    }
+    else {
+        USHORT peerPort = peer.start();
+        MuxRelayOptions relayOptions;
+        relayOptions.address = "127.0.0.1";
+        for (USHORT id = 1; id <= options.channels; id++) {
+            MuxRoute route;
+            route.first = route.last = id;
+            route.host = "127.0.0.1";
+            route.port = peerPort;
+            relayOptions.routes.push_back(route);
+        }
+        relay.reset(new MuxRelay(relayOptions));
+        options.port = peerPort ? relay->start() : 0;
+        if (options.port == 0) {
+            return 1;
+        }
+        peerThread = std::thread(&PeerService::run, &peer);
+        relayThread = std::thread(&MuxRelay::run, relay.get());
+    }
+
+    int status = MuxBench(options).run();
+    if (relay) {
+        relay->stop();
+        relayThread.join();
+        peer.stop();
+        peerThread.join();
+    }
+    netCleanup();
+    return status;
+}
+
+//
+// splits a recorded stream at the kd packet boundaries, the blocks the driver
+// sends when the debugger writes a packet at a time.
+//
+static std::vector<std::vector<BYTE>> kdBlocks(const std::vector<BYTE>& data)
+{
+    std::vector<std::vector<BYTE>> blocks;
+    KdStreamParser parser;
+    size_t start = 0;
+    for (size_t i = 0; i < data.size(); i++) {
+        if (parser.feed(data[i]) != KdStreamParser::None || i + 1 - start == LZ_BLOCK_SIZE) {
+            blocks.emplace_back(data.begin() + start, data.begin() + i + 1);
+            start = i + 1;
+        }
+    }
+    if (start < data.size()) {
+        blocks.emplace_back(data.begin() + start, data.end());
+    }
+    return blocks;
+}
+
+//
+// a synthesized debugger session as the target sends it: the ack and answer of
+// memory reads, kernel pointers, code and zero pages, and debug prints.
+//
+static std::vector<std::vector<BYTE>> kdSession(ULONG Packets)
+{
+    std::vector<std::vector<BYTE>> blocks;
+    ULONG seed = 0x2545f491;
+    ULONGLONG address = 0xfffff80312340000ull;
+    uint32_t id = KD_INITIAL_PACKET_ID;
+    for (ULONG n = 0; n < Packets; n++) {
+        std::vector<BYTE> payload;
+        uint16_t type = KD_PACKET_TYPE_STATE_MANIPULATE;
+        if (n % 16 == 15) {
+            std::ostringstream text;
+            text << "nt!KiDispatchInterrupt: thread " << std::hex << (address + n * 0x80) << " waits\n";
+            std::string line = text.str();
+            payload.assign(line.begin(), line.end());
+            type = KD_PACKET_TYPE_DEBUG_IO;
+        }
+        else {
+            // the DBGKD_MANIPULATE_STATE64 header of a read memory answer.
+            payload.resize(56 + 0x400);
+            memcpy(payload.data() + 16, &address, sizeof(address));
+            BYTE* memory = payload.data() + 56;
+            switch (n % 3) {
+            case 0:
+                for (size_t i = 0; i + 8 <= 0x400; i += 8) {
+                    ULONGLONG pointer = address + ((seed = seed * 1664525 + 1013904223) >> 20) * 16;
+                    memcpy(memory + i, &pointer, sizeof(pointer));
+                }
+                break;
+            case 1:
+                for (size_t i = 0; i < 0x400; i++) {
+                    static const BYTE code[] = { 0x48, 0x8b, 0x89, 0x4c, 0x0f, 0x85, 0xe8, 0xc3, 0x00, 0xff };
+                    memory[i] = code[((seed = seed * 1664525 + 1013904223) >> 24) % sizeof(code)];
+                }
+                break;
+            default:
+                break;
+            }
+            address += 0x400;
+        }
+        std::vector<BYTE> block(2 * sizeof(KD_PACKET_HEADER) + payload.size() + 1);
+        size_t length = kdBuildControlPacket(block.data(), KD_PACKET_TYPE_ACKNOWLEDGE, id);
+        length += kdBuildDataPacket(block.data() + length, type, id ^ 1, payload.data(), (USHORT)payload.size());
+        block.resize(length);
+        blocks.push_back(block);
+        id ^= 1;
+    }
+    return blocks;
+}
+
+//
+// runs the compressed transport codec over kd traffic, a packet per block, for
+// the ratio and the throughput of one core.
+//
+int compressBench(const cxxopts::ParseResult& optResult)
+{
+    std::vector<std::vector<BYTE>> blocks;
+    std::string source = optResult["compress-bench"].as<std::string>();
+    if (source.empty()) {
+        source = "synthesized kd session";
+        blocks = kdSession(optResult.count("count") ? optResult["count"].as<ULONG>() : 4000);
+    }
+    else {
+        std::ifstream in(source, std::ios::binary);
+        if (!in) {
+            logger << "cannot open " << source << "\n";
+            logger.flush(Logger::ERROR_LVL);
+            return 1;
+        }
+        blocks = kdBlocks(std::vector<BYTE>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()));
+    }
+    if (blocks.empty()) {
+        logger << source << " is empty\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+
+    //
+    // compress once for the blocks, then time rounds of each side for at
+    // least a second.
+    //
+    std::unique_ptr<LZ_ENCODER> encoder(new LZ_ENCODER);
+    std::unique_ptr<LZ_DECODER> decoder(new LZ_DECODER);
+    std::vector<std::vector<BYTE>> compressed;
+    std::vector<BYTE> block(LZ_BLOCK_SIZE);
+    INT64 rawBytes = 0;
+    INT64 wireBytes = 0;
+    LzEncoderInitialize(encoder.get());
+    for (auto& data : blocks) {
+        ULONG length = LzCompress(encoder.get(), data.data(), (ULONG)data.size(), block.data());
+        compressed.push_back(length ? std::vector<BYTE>(block.begin(), block.begin() + length) : data);
+        rawBytes += data.size();
+        wireBytes += COMPRESS_HEADER_SIZE + compressed.back().size();
+    }
+
+    using clock = std::chrono::steady_clock;
+    double compressSeconds = 0;
+    ULONG compressRounds = 0;
+    auto start = clock::now();
+    while (compressSeconds < 1) {
+        LzEncoderInitialize(encoder.get());
+        for (auto& data : blocks) {
+            LzCompress(encoder.get(), data.data(), (ULONG)data.size(), block.data());
+        }
+        compressRounds++;
+        compressSeconds = std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    double decompressSeconds = 0;
+    ULONG decompressRounds = 0;
+    start = clock::now();
+    while (decompressSeconds < 1) {
+        LzDecoderInitialize(decoder.get());
+        for (size_t i = 0; i < blocks.size(); i++) {
+            const BYTE* data = LzDecompress(decoder.get(), compressed[i].data(),
+                (ULONG)compressed[i].size(), (ULONG)blocks[i].size());
+            if (data == NULL || (decompressRounds == 0 && memcmp(data, blocks[i].data(), blocks[i].size()) != 0)) {
+                logger << "block " << i << " does not decompress to its data\n";
+                logger.flush(Logger::ERROR_LVL);
+                return 1;
+            }
+        }
+        decompressRounds++;
+        decompressSeconds = std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    std::ostringstream line;
+    line.precision(3);
+    line << std::fixed;
+    line << "compression of " << source << "\n" <<
+        "  blocks:     " << blocks.size() << ", " << rawBytes << " bytes, " << wireBytes << " on the wire\n" <<
+        "  ratio:      " << (double)rawBytes / wireBytes << "\n" <<
+        "  compress:   " << rawBytes * compressRounds / compressSeconds / 1e6 << " MB/s\n" <<
+        "  decompress: " << rawBytes * decompressRounds / decompressSeconds / 1e6 << " MB/s";
+    logger << line.str();
+    logger.flush(Logger::INFO_LVL);
+    return 0;
+}
+
+//
+// prints a capture log of the driver, copied from the windows machine.
+//
+int captureDump(const cxxopts::ParseResult& optResult)
+{
+    std::string path = optResult["capture-dump"].as<std::string>();
+    std::string direction = optResult.count("direction") ? optResult["direction"].as<std::string>() : "both";
+    unsigned directions = CaptureReader::directionMask(direction);
+    if (directions == 0) {
+        logger << "unknown direction " << direction << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+    CaptureReader reader;
+    if (!reader.open(path)) {
+        logger << "no capture log at " << path << ".0\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+    uint64_t fromUs = optResult.count("from") ? optResult["from"].as<ULONG>() * 1000ULL : 0;
+    uint64_t toUs = optResult.count("to") ? optResult["to"].as<ULONG>() * 1000ULL : UINT64_MAX;
+    uint64_t records = reader.dump(std::cout, fromUs, toUs, directions, optResult.count("brief") != 0);
+    logger << records << " records in " << reader.segmentCount() << " segments\n";
+    logger.flush(Logger::INFO_LVL);
+    return 0;
+}
+
+//
+// the kd packets of a capture log of the driver, copied from the windows machine.
+//
+int kdAnalyze(const cxxopts::ParseResult& optResult)
+{
+    std::string path = optResult["kd-analyze"].as<std::string>();
+    CaptureReader reader;
+    if (!reader.open(path)) {
+        logger << "no capture log at " << path << ".0\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+    KdAnalyzer analyzer;
+    analyzer.analyze(reader, optResult.count("from") ? optResult["from"].as<ULONG>() * 1000ULL : 0,
+        optResult.count("to") ? optResult["to"].as<ULONG>() * 1000ULL : UINT64_MAX);
+    analyzer.print();
+    return 0;
+}
+
+//
+// replays a capture log through an echo peer, a loopback one if no ipaddress is
+// given, over tcp or through the portable engine of the driver.
+//
+int captureReplay(const cxxopts::ParseResult& optResult)
+{
+    std::string path = optResult["capture-replay"].as<std::string>();
+    ReplayOptions replayOptions;
+    std::string direction = optResult.count("direction") ? optResult["direction"].as<std::string>() : "tx";
+    replayOptions.directions = CaptureReader::directionMask(direction);
+    if (replayOptions.directions == 0) {
+        logger << "unknown direction " << direction << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+    if (optResult.count("speed")) {
+        replayOptions.speed = optResult["speed"].as<double>();
+    }
+    if (optResult.count("window")) {
+        replayOptions.window = optResult["window"].as<ULONG>();
+    }
+    replayOptions.fromUs = optResult.count("from") ? optResult["from"].as<ULONG>() * 1000ULL : 0;
+    replayOptions.toUs = optResult.count("to") ? optResult["to"].as<ULONG>() * 1000ULL : UINT64_MAX;
+    ULONG overflowPolicy = HtsOverflowBlock;
+    std::string overflow = optResult.count("overflow") ? optResult["overflow"].as<std::string>() : "block";
+    if (overflow == "newest") {
+        overflowPolicy = HtsOverflowDropNewest;
+    }
+    else if (overflow == "oldest") {
+        overflowPolicy = HtsOverflowDropOldest;
+    }
+    else if (overflow != "block") {
+        logger << "unknown overflow policy " << overflow << "\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+    ULONG overflowTimeoutMs = optResult.count("overflow-timeout") ? optResult["overflow-timeout"].as<ULONG>() : 0;
+    CaptureReader reader;
+    if (!reader.open(path)) {
+        logger << "no capture log at " << path << ".0\n";
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+
+    PeerOptions peerOptions;
+    peerOptions.address = "127.0.0.1";
+    PeerService loopback(peerOptions);
+    std::thread loopbackThread;
+    std::string address = "127.0.0.1";
+    USHORT port = 0;
+    if (optResult.count("ipaddress")) {
+        if (!optResult.count("port")) {
+            logger << "replay with an ipaddress requires a port\n";
+            logger.flush(Logger::ERROR_LVL);
+            return 1;
+        }
+        address = optResult["ipaddress"].as<std::string>();
+        port = optResult["port"].as<USHORT>();
+    }
+    else {
+        port = loopback.start();
+        if (port == 0) {
+            return 1;
+        }
+        loopbackThread = std::thread(&PeerService::run, &loopback);
+    }
+
+    int status = 1;
+    {
+        SocketTransport tcp;
+        EngineTransport engine;
+        BenchTransport* transport = nullptr;
+        if (optResult.count("engine")) {
+            //
+            // return as soon as data is present like the bench, or at a gap in
+            // the data like a debugger client.
+            //
+            SERIAL_TIMEOUTS timeouts = { 0 };
+            timeouts.ReadIntervalTimeout = MAXULONG;
+            timeouts.ReadTotalTimeoutMultiplier = MAXULONG;
+            timeouts.ReadTotalTimeoutConstant = BENCH_READ_TIMEOUT_MS;
+            if (optResult.count("read-interval")) {
+                timeouts.ReadIntervalTimeout = optResult["read-interval"].as<ULONG>();
+                timeouts.ReadTotalTimeoutMultiplier = 0;
+            }
+            if (engine.open(address, port, timeouts)) {
+                transport = &engine;
+                engine.setOverflow(overflowPolicy, overflowTimeoutMs);
+            }
+        }
+        else if (tcp.open(address, port, BENCH_READ_TIMEOUT_MS)) {
+            transport = &tcp;
+        }
+        if (transport) {
+            BenchResult result = CaptureReplay(reader, replayOptions).run(*transport);
+            CaptureReplay::print(result);
+            if (transport == &engine) {
+                logger << "engine: " << engine.intervalTimerEvents << " interval timer, " <<
+                    engine.totalTimerEvents << " total timer and " << engine.waitTimeouts <<
+                    " wait unit completions";
+                logger.flush(Logger::INFO_LVL);
+                const HTS_VSP_REPORT& report = engine.report();
+                if (report.overflowEvents) {
+                    logger << "overflow: " << report.overflowEvents << " events, " << report.overflowBytes <<
+                        " bytes dropped, " << report.overflowTimeouts << " timeouts";
+                    logger.flush(Logger::INFO_LVL);
+                }
+            }
+            status = result.failed ? 1 : 0;
+            if (optResult.count("json") && !Benchmark::writeJson(optResult["json"].as<std::string>(), { result })) {
+                status = 1;
+            }
+        }
+    }
+    loopback.stop();
+    if (loopbackThread.joinable()) {
+        loopbackThread.join();
+    }
+    netCleanup();
+    return status;
+}
+
+int main(int argc, char* argv[])
+{
+    try {
+        cxxopts::Options options(argv[0], "portable peer for htsvsp");
+        options.add_options()
+            ("h,help", "print usage")
+            ("p,port", "echo peer port.", cxxopts::value<USHORT>())
+            ("i,ipaddress", "echo peer ip address or dns name, or the local address for serve.", cxxopts::value<std::string>())
+            ("v,verbose", "verbose output.")
+            ("serve", "run as a test peer on the specified port.", cxxopts::value<USHORT>())
+            ("mode", "test peer mode: echo (default), discard, source or reflect.", cxxopts::value<std::string>())
+            ("baud", "pace the test peer like a serial line at this baud rate.", cxxopts::value<ULONG>())
+            ("clients", "maximum test peer clients, default 64.", cxxopts::value<size_t>())
+            ("compress", "the test peer takes compressed clients, as the driver's --compress.")
+            ("udp", "the test peer also serves reliable udp on its port, as the driver's --transport udp.")
+            ("loss", "the test peer drops this percent of udp datagrams each way, and holds tcp for a retransmit "
+                "timeout as often.", cxxopts::value<double>())
+            ("compress-bench", "bench the compression of kd traffic, of --compress-bench=file or synthesized.",
+                cxxopts::value<std::string>()->implicit_value(""))
+            ("xensim", "listen like a xen hvm_serial pty on the specified port.", cxxopts::value<USHORT>())
+            ("guest", "xensim guest: echo (default), kd or replay.", cxxopts::value<std::string>())
+            ("fifo", "xensim uart fifo depth, default 16.", cxxopts::value<size_t>())
+            ("nodrop", "xensim stalls the line on a full fifo instead of dropping bytes.")
+            ("guestpoll", "xensim guest uart service interval in microseconds, default 1000.", cxxopts::value<ULONG>())
+            ("replay", "xensim replay guest input file.", cxxopts::value<std::string>())
+            ("loop", "xensim replays the file forever.")
+            ("shm", "serve a shared memory stream of this name, or bench one with --bench.", cxxopts::value<std::string>())
+            ("bench", "run the load generator through an echo peer, a loopback one if no ipaddress is given.")
+            ("pattern", "bench patterns: byte, kd, bulk or all (default), comma separated.", cxxopts::value<std::string>())
+            ("count", "bench messages per pattern, default depends on the pattern.", cxxopts::value<ULONG>())
+            ("json", "write the bench results to a json file.", cxxopts::value<std::string>())
+            ("transport", "bench transport: tcp (default), udp or both, each pattern over each.",
+                cxxopts::value<std::string>())
+            ("relay", "run as a mux relay for the driver on the specified port.", cxxopts::value<USHORT>())
+            ("map", "relay channels first-last=host:port, channel first to port and on, comma separated.",
+                cxxopts::value<std::vector<std::string>>())
+            ("relay-bench", "bench a mux relay at ipaddress and port, a loopback one if no ipaddress is given.")
+            ("channels", "relay bench channels, default 128.", cxxopts::value<USHORT>())
+            ("rounds", "relay bench round trips of each channel, default 200.", cxxopts::value<ULONG>())
+            ("seconds", "relay bench throughput seconds, default 5.", cxxopts::value<ULONG>())
+            ("capture-dump", "print the capture log of a port at path, see vspControl --capture.", cxxopts::value<std::string>())
+            ("from", "capture dump, replay and kd analyze from this many ms after the capture started.", cxxopts::value<ULONG>())
+            ("to", "capture dump, replay and kd analyze up to this many ms after the capture started.", cxxopts::value<ULONG>())
+            ("direction", "capture dump rx (received), tx (written) or both (default).", cxxopts::value<std::string>())
+            ("brief", "capture dump a line per record, without the data.")
+            ("kd-analyze", "parse the kd packets of a capture log at path and report counts, resends, timeouts and "
+                "latencies, --from and --to select a part.", cxxopts::value<std::string>())
+            ("capture-replay", "replay the records of a capture log at path through an echo peer, a loopback one if no "
+                "ipaddress is given. --direction defaults to tx.", cxxopts::value<std::string>())
+            ("speed", "capture replay speed, 1 (default) keeps the captured timing, 0 is as fast as possible.",
+                cxxopts::value<double>())
+            ("window", "capture replay records in flight, default no limit.", cxxopts::value<ULONG>())
+            ("engine", "capture replay reads through the portable engine of the driver instead of the socket.")
+            ("read-interval", "engine reads complete at a gap of this many ms instead of as soon as data is present.",
+                cxxopts::value<ULONG>())
+            ("overflow", "engine receive ring overflow: block (default) stops the peer, newest or oldest drops that data.",
+                cxxopts::value<std::string>())
+            ("overflow-timeout", "engine overflow block drops the newest data once the peer was stopped this many ms.",
+                cxxopts::value<ULONG>());
+
+        auto optResult = options.parse(argc, argv);
+        if (optResult.count("verbose")) {
+            logger.setLogLevel(Logger::VERBOSE_LVL);
+        }
+        if (optResult.count("help") ||
+            !(optResult.count("bench") || optResult.count("serve") || optResult.count("xensim") ||
+              optResult.count("shm") || optResult.count("relay") || optResult.count("relay-bench") ||
+              optResult.count("compress-bench") || optResult.count("capture-dump") ||
+              optResult.count("capture-replay") || optResult.count("kd-analyze"))) {
+            std::cout << options.help() << std::endl;
+            return 0;
+        }
+        if (optResult.count("compress-bench")) {
+            return compressBench(optResult);
+        }
+        if (optResult.count("capture-dump")) {
+            return captureDump(optResult);
+        }
+        if (optResult.count("kd-analyze")) {
+            return kdAnalyze(optResult);
+        }
+        if (!netStartup()) {
+            logger << "socket startup failed error " << netLastError() << "\n";
+            logger.flush(Logger::ERROR_LVL);
+            return 1;
+        }
+
+        if (optResult.count("capture-replay")) {
+            return captureReplay(optResult);
+        }
+        if (optResult.count("xensim")) {
+            return xenSimulator(optResult);
+        }
+        if (optResult.count("relay")) {
+            return muxRelay(optResult);
+        }
+        if (optResult.count("relay-bench")) {
+            return muxRelayBench(optResult);
+        }
+
+        PeerOptions peerOptions;
+        if (optResult.count("mode") && !PeerService::parseMode(optResult["mode"].as<std::string>(), peerOptions.mode)) {
+            logger << "unknown peer mode " << optResult["mode"].as<std::string>() << "\n";
+            logger.flush(Logger::ERROR_LVL);
+            return 1;
+        }
+        if (optResult.count("baud")) {
+            peerOptions.baud = optResult["baud"].as<ULONG>();
+        }
+        if (optResult.count("clients")) {
+            peerOptions.maxClients = optResult["clients"].as<size_t>();
+        }
+        peerOptions.compress = optResult.count("compress") != 0;
+        peerOptions.udp = optResult.count("udp") != 0;
+        if (optResult.count("loss")) {
+            peerOptions.loss = optResult["loss"].as<double>();
+        }
+        std::string benchTransport = optResult.count("transport") ? optResult["transport"].as<std::string>() : "tcp";
+        if (benchTransport != "tcp" && benchTransport != "udp" && benchTransport != "both") {
+            logger << "unknown bench transport " << benchTransport << "\n";
+            logger.flush(Logger::ERROR_LVL);
+            return 1;
+        }
+        if (optResult.count("shm")) {
+            int status = 1;
+            std::string name = optResult["shm"].as<std::string>();
+            if (optResult.count("bench")) {
+                StreamTransport transport;
+                if (transport.openShm(name, BENCH_READ_TIMEOUT_MS)) {
+                    status = Benchmark::runPatterns(transport,
+                        optResult.count("pattern") ? optResult["pattern"].as<std::string>() : "all",
+                        optResult.count("count") ? optResult["count"].as<ULONG>() : 0,
+                        optResult.count("json") ? optResult["json"].as<std::string>() : "");
+                }
+            }
+            else {
+                ShmPeer peer(name, peerOptions.mode);
+                status = peer.start() ? peer.run() : 1;
+            }
+            netCleanup();
+            return status;
+        }
+        if (optResult.count("serve")) {
+            if (optResult.count("ipaddress")) {
+                peerOptions.address = optResult["ipaddress"].as<std::string>();
+            }
+            peerOptions.port = optResult["serve"].as<USHORT>();
+            PeerService peer(peerOptions);
+            int status = peer.start() ? peer.run() : 1;
+            netCleanup();
+            return status;
+        }
+
+        //
+        // without a remote echo peer the bench runs against
+        // a local one in a second thread.
+        //
+        peerOptions.address = "127.0.0.1";
+        peerOptions.udp = benchTransport != "tcp";
+        PeerService loopback(peerOptions);
+        std::thread loopbackThread;
+        std::string address = "127.0.0.1";
+        USHORT port = 0;
+        if (optResult.count("ipaddress")) {
+            address = optResult["ipaddress"].as<std::string>();
+            if (!optResult.count("port")) {
+                logger << "bench with an ipaddress requires a port\n";
+                logger.flush(Logger::ERROR_LVL);
+                return 1;
+            }
+            port = optResult["port"].as<USHORT>();
+        }
+        else {
+            port = loopback.start();
+            if (port == 0) {
+                return 1;
+            }
+            loopbackThread = std::thread(&PeerService::run, &loopback);
+        }
+
+        int status = 1;
+        {
+            SocketTransport tcp;
+            StreamTransport udp;
+            std::vector<BenchTransport*> transports;
+            bool opened = true;
+            if (benchTransport != "udp") {
+                opened = tcp.open(address, port, BENCH_READ_TIMEOUT_MS);
+                transports.push_back(&tcp);
+            }
+            if (opened && benchTransport != "tcp") {
+                opened = udp.openUdp(address, port, BENCH_READ_TIMEOUT_MS);
+                transports.push_back(&udp);
+            }
+            if (opened) {
+                status = Benchmark::runPatterns(transports,
+                    optResult.count("pattern") ? optResult["pattern"].as<std::string>() : "all",
+                    optResult.count("count") ? optResult["count"].as<ULONG>() : 0,
+                    optResult.count("json") ? optResult["json"].as<std::string>() : "");
+            }
+            if (opened && benchTransport != "tcp") {
+                const HTS_VSP_REPORT& report = udp.report();
+                logger << "udp: srtt " << report.udpSrttUs << " us, rto " << report.udpRtoUs << " us, " <<
+                    report.udpDatagramsSent << " datagrams sent, " << report.udpDatagramsReceived << " received, " <<
+                    report.udpRetransmits << " retransmits, " << report.udpFastRetransmits << " fast, " <<
+                    report.udpTimeouts << " timeouts, " << report.udpDuplicates << " duplicates";
+                logger.flush(Logger::INFO_LVL);
+            }
+        }
+        loopback.stop();
+        if (loopbackThread.joinable()) {
+            loopbackThread.join();
+        }
+        netCleanup();
+        return status;
+    }
+    catch (const cxxopts::exceptions::exception& e) {
+        logger << "error parsing options: " << e.what() << std::endl;
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+    catch (const std::exception& e) {
+        logger << "error: " << e.what() << std::endl;
+        logger.flush(Logger::ERROR_LVL);
+        return 1;
+    }
+}
@@ -0,0 +1,423 @@
+/*++
+
+Module Name:
+
+    capture.cpp
+
+Abstract:
+
+    The capture log of a port, see capture.h.
+
+--*/
+
+#include "capture.h"
+#include <stdio.h>
+
+#ifdef _WIN32
+#define CAPTURE_INVALID_ERROR   ERROR_INVALID_PARAMETER
+#else
+#define CAPTURE_INVALID_ERROR   EINVAL
+#endif
+
+//
+// the capture thread waits for these.
+//
+enum CAPTURE_WAIT
+{
+    CaptureWaitStop = 0,
+    CaptureWaitWake,
+};
+
+static inline INT64
+CaptureLoad(
+    _In_  volatile INT64    *Value
+    )
+{
+#ifdef _WIN32
+    return InterlockedCompareExchange64((volatile LONG64*)Value, 0, 0);
+#else
+    return __atomic_load_n(Value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline VOID
+CaptureStore(
+    _In_  volatile INT64    *Value,
+    _In_  INT64             NewValue
+    )
+{
+#ifdef _WIN32
+    InterlockedExchange64((volatile LONG64*)Value, NewValue);
+#else
+    __atomic_store_n(Value, NewValue, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline BOOL
+CaptureCompareExchange(
+    _In_  volatile INT64    *Value,
+    _In_  INT64             Expected,
+    _In_  INT64             NewValue
+    )
+{
+#ifdef _WIN32
+    return InterlockedCompareExchange64((volatile LONG64*)Value, NewValue, Expected) == Expected;
+#else
+    return __atomic_compare_exchange_n(Value, &Expected, NewValue, FALSE,
+        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline VOID
+CaptureAdd(
+    _In_  volatile LONG     *Value,
+    _In_  LONG              Add
+    )
+{
+#ifdef _WIN32
+    InterlockedExchangeAdd(Value, Add);
+#else
+    __atomic_add_fetch(Value, Add, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline VOID
+CaptureCount(
+    _In_  INT64             *Counter,
+    _In_  INT64             Add
+    )
+{
+#ifdef _WIN32
+    InterlockedExchangeAdd64((volatile LONG64*)Counter, Add);
+#else
+    __atomic_add_fetch(Counter, Add, __ATOMIC_RELAXED);
+#endif
+}
+
+//
+// a reader that sees the size sees the record.
+//
+static inline VOID
+CapturePublish(
+    _In_  PCAPTURE_RECORD   Record,
+    _In_  ULONG             Size
+    )
+{
+#ifdef _WIN32
+    InterlockedExchange((volatile LONG*)&Record->Size, (LONG)Size);
+#else
+    __atomic_store_n(&Record->Size, Size, __ATOMIC_RELEASE);
+#endif
+}
+
+//
+// unmaps the slot once the writers that still copy into it are done. New
+// writers see it is not their segment and drop their record.
+//
+static VOID
+CaptureRetire(
+    _In_  PCAPTURE_LOG      Log,
+    _In_  PCAPTURE_SLOT     Slot
+    )
+{
+    CaptureStore(&Slot->Segment, -1);
+    while (Slot->Writers != 0) {
+        PlatformSpinPause();
+    }
+    if (Slot->View != NULL) {
+        PlatformFileUnmap(Slot->View, Log->SegmentBytes);
+        Slot->View = NULL;
+    }
+}
+
+//
+// maps Segment in its slot, replacing the one there.
+//
+static UINT32
+CaptureMap(
+    _In_  PCAPTURE_LOG      Log,
+    _In_  INT64             Segment
+    )
+{
+    PCAPTURE_SLOT slot = &Log->Slots[Segment % CAPTURE_SLOTS];
+    if (CaptureLoad(&slot->Segment) == Segment) {
+        return NO_ERROR;
+    }
+    CaptureRetire(Log, slot);
+
+    char path[sizeof(Log->Path) + 16];
+    snprintf(path, sizeof(path), "%s.%lld", Log->Path, (long long)Segment);
+    ULONGLONG size = Log->SegmentBytes;
+    PVOID view;
+    UINT32 error = PlatformFileMap(path, TRUE, &size, &view);
+    if (error != NO_ERROR) {
+        return error;
+    }
+    PCAPTURE_SEGMENT_HEADER header = (PCAPTURE_SEGMENT_HEADER)view;
+    header->Magic = CAPTURE_MAGIC;
+    header->Version = CAPTURE_VERSION;
+    header->Segment = (ULONG)Segment;
+    header->SegmentBytes = Log->SegmentBytes;
+    header->HeaderBytes = Log->HeaderBytes;
+    header->IndexInterval = CAPTURE_INDEX_INTERVAL;
+    header->IndexCount = Log->IndexCount;
+    header->StartUs = Log->StartUs;
+    slot->View = (BYTE*)view;
+    CaptureStore(&slot->Segment, Segment);
+    Log->Stats->captureSegments++;
+    return NO_ERROR;
+}
+
+//
+// keeps the segment of the writers and the next one mapped, and lets the
+// writers up to the end of the next one.
+//
+static UINT32
+CaptureAdvance(
+    _In_  PCAPTURE_LOG      Log
+    )
+{
+    INT64 current = CaptureLoad(&Log->Position) / Log->RecordBytes;
+    UINT32 error = CaptureMap(Log, current);
+    if (error == NO_ERROR) {
+        error = CaptureMap(Log, current + 1);
+    }
+    if (error == NO_ERROR) {
+        CaptureStore(&Log->Limit, (current + 2) * Log->RecordBytes);
+    }
+    return error;
+}
+
+static UINT32
+CaptureThread(
+    _In_  PVOID             Context
+    )
+{
+    PCAPTURE_LOG log = (PCAPTURE_LOG)Context;
+    PPLATFORM_WAITER waiter = NULL;
+
+    UINT32 error = PlatformWaiterCreate(&waiter);
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddEvent(waiter, log->StopEvent);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddEvent(waiter, log->WakeEvent);
+    }
+    while (error == NO_ERROR) {
+        ULONG ready = PlatformWait(waiter, INFINITE);
+        if (ready != CaptureWaitWake) {
+            break;
+        }
+        //
+        // a segment that cannot be mapped, on a full disk say, leaves the
+        // limit where it is and the writers drop until it can.
+        //
+        CaptureAdvance(log);
+    }
+    if (waiter != NULL) {
+        PlatformWaiterClose(waiter);
+    }
+    return error;
+}
+
+UINT32
+CaptureInitialize(
+    _In_  PCAPTURE_LOG      Log,
+    _In_  PHTS_VSP_REPORT   Stats
+    )
+{
+    RtlZeroMemory(Log, sizeof(*Log));
+    Log->Stats = Stats;
+    for (ULONG i = 0; i < CAPTURE_SLOTS; i++) {
+        Log->Slots[i].Segment = -1;
+    }
+    UINT32 error = PlatformEventCreate(TRUE, &Log->StopEvent);
+    if (error == NO_ERROR) {
+        error = PlatformEventCreate(FALSE, &Log->WakeEvent);
+    }
+    return error;
+}
+
+VOID
+CaptureCleanup(
+    _In_  PCAPTURE_LOG      Log
+    )
+{
+    CaptureStop(Log);
+    if (Log->StopEvent != NULL) {
+        PlatformEventClose(Log->StopEvent);
+        Log->StopEvent = NULL;
+    }
+    if (Log->WakeEvent != NULL) {
+        PlatformEventClose(Log->WakeEvent);
+        Log->WakeEvent = NULL;
+    }
+}
+
+UINT32
+CaptureStart(
+    _In_  PCAPTURE_LOG      Log,
+    _In_  const char*       Path,
+    _In_  ULONG             SegmentBytes
+    )
+{
+    CaptureStop(Log);
+    if (strlen(Path) >= sizeof(Log->Path) || Path[0] == 0) {
+        return CAPTURE_INVALID_ERROR;
+    }
+    if (SegmentBytes == 0) {
+        SegmentBytes = CAPTURE_DEFAULT_SEGMENT;
+    }
+    SegmentBytes = (SegmentBytes < CAPTURE_MIN_SEGMENT) ? CAPTURE_MIN_SEGMENT :
+        (SegmentBytes > CAPTURE_MAX_SEGMENT) ? CAPTURE_MAX_SEGMENT : SegmentBytes;
+    SegmentBytes &= ~(ULONG)(CAPTURE_ALIGN - 1);
+
+    strcpy(Log->Path, Path);
+    Log->SegmentBytes = SegmentBytes;
+    Log->IndexCount = (SegmentBytes + CAPTURE_INDEX_INTERVAL - 1) / CAPTURE_INDEX_INTERVAL;
+    Log->HeaderBytes = (ULONG)(sizeof(CAPTURE_SEGMENT_HEADER) + Log->IndexCount * sizeof(CAPTURE_INDEX_ENTRY));
+    Log->RecordBytes = SegmentBytes - Log->HeaderBytes;
+    Log->StartUs = PlatformTimeUs();
+    Log->Position = 0;
+    Log->Limit = 0;
+    Log->Stats->captureSegments = 0;
+    Log->Stats->captureRecords = 0;
+    Log->Stats->captureBytes = 0;
+    Log->Stats->captureDroppedRecords = 0;
+
+    //
+    // the first two segments are mapped here, so a path that does not work
+    // fails the start.
+    //
+    PlatformEventReset(Log->StopEvent);
+    UINT32 error = CaptureAdvance(Log);
+    if (error == NO_ERROR) {
+        error = PlatformThreadCreate(CaptureThread, Log, &Log->Thread);
+    }
+    if (error != NO_ERROR) {
+        CaptureStop(Log);
+        return error;
+    }
+    CaptureAdd(&Log->Active, 1);
+    return NO_ERROR;
+}
+
+VOID
+CaptureStop(
+    _In_  PCAPTURE_LOG      Log
+    )
+{
+    if (Log->Active) {
+        CaptureAdd(&Log->Active, -1);
+    }
+    CaptureStore(&Log->Limit, 0);
+    if (Log->Thread != NULL) {
+        PlatformEventSet(Log->StopEvent);
+        PlatformThreadJoin(Log->Thread, INFINITE);
+        Log->Thread = NULL;
+    }
+    for (ULONG i = 0; i < CAPTURE_SLOTS; i++) {
+        CaptureRetire(Log, &Log->Slots[i]);
+    }
+}
+
+//
+// writes a reserved record, a pad record has no Data. Returns FALSE if its
+// segment is no longer mapped.
+//
+static BOOL
+CaptureWrite(
+    _In_  PCAPTURE_LOG      Log,
+    _In_  INT64             Position,
+    _In_  ULONG             Size,
+    _In_  USHORT            Direction,
+    _In_  ULONGLONG         TimeUs,
+    _In_reads_bytes_(Length)
+          const BYTE        *Data,
+    _In_  ULONG             Length
+    )
+{
+    INT64 segment = Position / Log->RecordBytes;
+    ULONG offset = (ULONG)(Position % Log->RecordBytes);
+    PCAPTURE_SLOT slot = &Log->Slots[segment % CAPTURE_SLOTS];
+    BOOL written = FALSE;
+
+    CaptureAdd(&slot->Writers, 1);
+    if (CaptureLoad(&slot->Segment) == segment) {
+        BYTE* records = slot->View + Log->HeaderBytes;
+        PCAPTURE_RECORD record = (PCAPTURE_RECORD)(records + offset);
+        record->Direction = Direction;
+        record->Padding = (Data != NULL) ? (USHORT)(Size - sizeof(*record) - Length) : 0;
+        record->TimeUs = TimeUs;
+        if (Data != NULL) {
+            RtlCopyMemory(record + 1, Data, Length);
+        }
+        //
+        // the record indexes the interval boundaries it covers.
+        //
+        PCAPTURE_INDEX_ENTRY index = (PCAPTURE_INDEX_ENTRY)(slot->View + sizeof(CAPTURE_SEGMENT_HEADER));
+        for (ULONG n = (offset + CAPTURE_INDEX_INTERVAL - 1) / CAPTURE_INDEX_INTERVAL;
+            n < Log->IndexCount && (ULONGLONG)n * CAPTURE_INDEX_INTERVAL < (ULONGLONG)offset + Size; n++) {
+            index[n].Offset = offset;
+            CaptureStore((volatile INT64*)&index[n].TimeUs, (INT64)TimeUs);
+        }
+        CapturePublish(record, Size);
+        written = TRUE;
+    }
+    CaptureAdd(&slot->Writers, -1);
+    return written;
+}
+
+VOID
+CaptureRecord(
+    _In_  PCAPTURE_LOG      Log,
+    _In_  USHORT            Direction,
+    _In_reads_bytes_(Length)
+          const BYTE        *Data,
+    _In_  ULONG             Length
+    )
+{
+    if (Log == NULL || Log->Active == 0 || Length == 0) {
+        return;
+    }
+    ULONGLONG size = sizeof(CAPTURE_RECORD) + (ULONGLONG)Length;
+    size = (size + CAPTURE_ALIGN - 1) & ~(ULONGLONG)(CAPTURE_ALIGN - 1);
+    if (size > Log->RecordBytes) {
+        CaptureCount(&Log->Stats->captureDroppedRecords, 1);
+        return;
+    }
+    ULONGLONG now = PlatformTimeUs();
+
+    //
+    // a record that does not fit in the rest of a segment goes to the next
+    // one, and a pad record fills the rest.
+    //
+    INT64 position;
+    INT64 start;
+    do {
+        position = CaptureLoad(&Log->Position);
+        ULONG left = Log->RecordBytes - (ULONG)(position % Log->RecordBytes);
+        start = (left < size) ? position + left : position;
+        if (start + (INT64)size > CaptureLoad(&Log->Limit)) {
+            // ahead of the capture thread, or stopping.
+            CaptureCount(&Log->Stats->captureDroppedRecords, 1);
+            PlatformEventSet(Log->WakeEvent);
+            return;
+        }
+    } while (!CaptureCompareExchange(&Log->Position, position, start + (INT64)size));
+
+    if (start != position && start - position >= (INT64)sizeof(CAPTURE_RECORD)) {
+        CaptureWrite(Log, position, (ULONG)(start - position), CAPTURE_PAD, now, NULL, 0);
+    }
+    if (start % Log->RecordBytes == 0) {
+        // the capture thread maps the segment after this one.
+        PlatformEventSet(Log->WakeEvent);
+    }
+    if (CaptureWrite(Log, start, (ULONG)size, Direction, now, Data, Length)) {
+        CaptureCount(&Log->Stats->captureRecords, 1);
+        CaptureCount(&Log->Stats->captureBytes, Length);
+    }
+    else {
+        CaptureCount(&Log->Stats->captureDroppedRecords, 1);
+    }
+}
@@ -0,0 +1,268 @@
+/*++
+
+Module Name:
+
+    capture.h
+
+Abstract:
+
+    The capture log of a port, what went over the wire. Each receive and
+    each write of the engine appends a record, the time, the direction and
+    the bytes, to a log of memory mapped segment files, Path.0, Path.1 and
+    so on, each SegmentBytes long.
+
+    Appending takes no lock. A writer reserves its record by moving the end
+    of the log with a compare exchange, copies into the mapping and
+    publishes the record by storing its size last. The capture thread maps
+    the next segment before the writers get there and unmaps the segments
+    they left. A writer that gets ahead of it, or a record that does not
+    fit in a segment, is dropped and counted.
+
+    Every CAPTURE_INDEX_INTERVAL bytes of records a segment keeps the time
+    and offset of a record in its index, so a reader finds a time without
+    reading the records before it. The format and the reader helpers below
+    are also used by vspControl, on a segment it mapped itself.
+
+--*/
+
+#pragma once
+
+#include "platform.h"
+#include "htsvsp.h"
+
+#define CAPTURE_MAGIC           0x43535648  // "HVSC"
+#define CAPTURE_VERSION         1
+
+#define CAPTURE_DEFAULT_SEGMENT (16 * 1024 * 1024)
+#define CAPTURE_MIN_SEGMENT     (64 * 1024)
+#define CAPTURE_MAX_SEGMENT     (1024 * 1024 * 1024)
+
+#define CAPTURE_INDEX_INTERVAL  (16 * 1024)
+
+//
+// records start at this alignment, their sizes are multiples of it.
+//
+#define CAPTURE_ALIGN           8
+
+//
+// segments a log keeps mapped: the one of the writers, the one the capture
+// thread mapped ahead and the ones before, for a writer that was slow to
+// finish its copy.
+//
+#define CAPTURE_SLOTS           4
+
+//
+// CAPTURE_RECORD Direction.
+//
+#define CAPTURE_RECEIVED        1   // the engine received it from the peer.
+#define CAPTURE_WRITTEN         2   // the application wrote it to the port.
+#define CAPTURE_PAD             3   // fills the end of a segment, no data.
+
+typedef struct _CAPTURE_SEGMENT_HEADER
+{
+    ULONG       Magic;
+    ULONG       Version;
+    ULONG       Segment;            // the number of the file.
+    ULONG       SegmentBytes;
+    ULONG       HeaderBytes;        // the records start here, after the index.
+    ULONG       IndexInterval;
+    ULONG       IndexCount;
+    ULONG       Reserved0;
+    ULONGLONG   StartUs;            // PlatformTimeUs when the capture started.
+    ULONGLONG   Reserved[4];
+} CAPTURE_SEGMENT_HEADER, *PCAPTURE_SEGMENT_HEADER;
+
+//
+// the first record that covers offset n * IndexInterval of the records,
+// TimeUs is 0 until it is written.
+//
+typedef struct _CAPTURE_INDEX_ENTRY
+{
+    ULONGLONG   TimeUs;
+    ULONG       Offset;             // from the start of the records.
+    ULONG       Reserved;
+} CAPTURE_INDEX_ENTRY, *PCAPTURE_INDEX_ENTRY;
+
+//
+// Size is 0 past the last record.
+//
+typedef struct _CAPTURE_RECORD
+{
+    ULONG       Size;               // of the record, header and padding included.
+    USHORT      Direction;
+    USHORT      Padding;            // bytes after the data.
+    ULONGLONG   TimeUs;
+} CAPTURE_RECORD, *PCAPTURE_RECORD;
+
+typedef struct _CAPTURE_SLOT
+{
+    volatile INT64  Segment;        // mapped here, -1 for none.
+    volatile LONG   Writers;        // copying into the mapping now.
+    BYTE*           View;
+} CAPTURE_SLOT, *PCAPTURE_SLOT;
+
+typedef struct _CAPTURE_LOG
+{
+    PHTS_VSP_REPORT Stats;
+
+    volatile LONG   Active;
+
+    volatile INT64  Position;       // the end of the records of all segments.
+
+    volatile INT64  Limit;          // the end of the last segment mapped.
+
+    ULONG           SegmentBytes;
+
+    ULONG           HeaderBytes;
+
+    ULONG           RecordBytes;    // of a segment, SegmentBytes - HeaderBytes.
+
+    ULONG           IndexCount;
+
+    ULONGLONG       StartUs;
+
+    CAPTURE_SLOT    Slots[CAPTURE_SLOTS];
+
+    PLATFORM_EVENT  StopEvent;      // manual reset.
+
+    PLATFORM_EVENT  WakeEvent;      // auto reset, a writer entered a segment or was dropped.
+
+    PLATFORM_THREAD Thread;
+
+    char            Path[260];
+
+} CAPTURE_LOG, *PCAPTURE_LOG;
+
+_Success_(return == NO_ERROR)
+UINT32
+CaptureInitialize(
+    _In_  PCAPTURE_LOG      Log,
+    _In_  PHTS_VSP_REPORT   Stats
+    );
+
+//
+// stops the log and closes the events.
+//
+VOID
+CaptureCleanup(
+    _In_  PCAPTURE_LOG      Log
+    );
+
+//
+// starts a log at Path, replacing the segments of an earlier one. A log that
+// is running is stopped first. SegmentBytes 0 is CAPTURE_DEFAULT_SEGMENT,
+// others are rounded to CAPTURE_ALIGN and kept within CAPTURE_MIN_SEGMENT and
+// CAPTURE_MAX_SEGMENT.
+//
+_Success_(return == NO_ERROR)
+UINT32
+CaptureStart(
+    _In_  PCAPTURE_LOG      Log,
+    _In_  const char*       Path,
+    _In_  ULONG             SegmentBytes
+    );
+
+//
+// stops the log and unmaps its segments, the files stay. Safe while
+// CaptureRecord runs on other threads, and when the log is not running.
+//
+VOID
+CaptureStop(
+    _In_  PCAPTURE_LOG      Log
+    );
+
+//
+// appends a record. Safe from any thread, and cheap while the log is not
+// running.
+//
+VOID
+CaptureRecord(
+    _In_  PCAPTURE_LOG      Log,
+    _In_  USHORT            Direction,
+    _In_reads_bytes_(Length)
+          const BYTE        *Data,
+    _In_  ULONG             Length
+    );
+
+//
+// the reader, on a segment of Size bytes mapped at Base.
+//
+inline const CAPTURE_SEGMENT_HEADER*
+CaptureSegmentHeader(
+    _In_  const BYTE        *Base,
+    _In_  ULONGLONG         Size
+    )
+{
+    const CAPTURE_SEGMENT_HEADER* header = (const CAPTURE_SEGMENT_HEADER*)Base;
+    if (Size < sizeof(*header) || header->Magic != CAPTURE_MAGIC ||
+        header->Version != CAPTURE_VERSION || header->SegmentBytes > Size ||
+        header->HeaderBytes < sizeof(*header) + header->IndexCount * sizeof(CAPTURE_INDEX_ENTRY) ||
+        header->HeaderBytes >= header->SegmentBytes) {
+        return NULL;
+    }
+    return header;
+}
+
+//
+// the record at Offset of the records, NULL at the end. A record that is
+// still being written reads as the end.
+//
+inline const CAPTURE_RECORD*
+CaptureRecordAt(
+    _In_  const CAPTURE_SEGMENT_HEADER *Header,
+    _In_  ULONG             Offset
+    )
+{
+    ULONG recordBytes = Header->SegmentBytes - Header->HeaderBytes;
+    if (Offset > recordBytes || recordBytes - Offset < sizeof(CAPTURE_RECORD)) {
+        return NULL;
+    }
+    const CAPTURE_RECORD* record = (const CAPTURE_RECORD*)((const BYTE*)Header + Header->HeaderBytes + Offset);
+#ifdef _WIN32
+    ULONG size = *(volatile const ULONG*)&record->Size;
+    MemoryBarrier();
+#else
+    ULONG size = __atomic_load_n(&record->Size, __ATOMIC_ACQUIRE);
+#endif
+    if (size < sizeof(CAPTURE_RECORD) || size > recordBytes - Offset || (size % CAPTURE_ALIGN) != 0 ||
+        record->Padding >= CAPTURE_ALIGN || size - sizeof(CAPTURE_RECORD) < record->Padding) {
+        return NULL;
+    }
+    return record;
+}
+
+inline const BYTE*
+CaptureRecordData(
+    _In_  const CAPTURE_RECORD *Record
+    )
+{
+    return (const BYTE*)(Record + 1);
+}
+
+inline ULONG
+CaptureRecordLength(
+    _In_  const CAPTURE_RECORD *Record
+    )
+{
+    return Record->Size - (ULONG)sizeof(CAPTURE_RECORD) - Record->Padding;
+}
+
+//
+// the offset of a record at or shortly before the first record of TimeUs or
+// later, from the index. Records of threads that raced are not strictly in
+// time order, so the reader still compares the times of the records it reads.
+//
+inline ULONG
+CaptureSeek(
+    _In_  const CAPTURE_SEGMENT_HEADER *Header,
+    _In_  ULONGLONG         TimeUs
+    )
+{
+    const CAPTURE_INDEX_ENTRY* index = (const CAPTURE_INDEX_ENTRY*)(Header + 1);
+    ULONG offset = 0;
+    for (ULONG n = 1; n < Header->IndexCount && index[n].TimeUs != 0 && index[n].TimeUs < TimeUs; n++) {
+        // an interval early, for the records that raced.
+        offset = index[n - 1].Offset;
+    }
+    return offset;
+}
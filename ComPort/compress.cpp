@@ -0,0 +1,452 @@
+/*++
+
+Module Name:
+
+    compress.cpp
+
+Abstract:
+
+    The compressed stream of a client port, see compress.h.
+
+    A thread receives the blocks and decompresses them into Rx, the stream
+    reads Rx like a mux channel. While Rx has no room for the next block the
+    thread stops receiving and tcp flow controls the peer.
+
+--*/
+
+#include "compress.h"
+#include "ringbuffer.h"
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define COMPRESS_TIMEOUT_ERROR      WSAETIMEDOUT
+#define COMPRESS_WOULD_BLOCK_ERROR  WSAEWOULDBLOCK
+#define COMPRESS_CLOSED_ERROR       WSAECONNRESET
+#define COMPRESS_PROTOCOL_ERROR     WSAECONNABORTED
+#define COMPRESS_REFUSED_ERROR      WSAEPROTONOSUPPORT
+#define COMPRESS_MEMORY_ERROR       ERROR_NOT_ENOUGH_MEMORY
+#else
+#define COMPRESS_TIMEOUT_ERROR      ETIMEDOUT
+#define COMPRESS_WOULD_BLOCK_ERROR  EWOULDBLOCK
+#define COMPRESS_CLOSED_ERROR       ECONNRESET
+#define COMPRESS_PROTOCOL_ERROR     ECONNABORTED
+#define COMPRESS_REFUSED_ERROR      EPROTONOSUPPORT
+#define COMPRESS_MEMORY_ERROR       ENOMEM
+#endif
+
+//
+// longest a block waits for the peer to take it.
+//
+#define COMPRESS_SEND_TIMEOUT_MS    5000
+
+#define COMPRESS_RX_SIZE            (64 * 1024)
+#define COMPRESS_RECEIVE_SIZE       (2 * (COMPRESS_HEADER_SIZE + LZ_BLOCK_SIZE))
+
+enum COMPRESS_WAIT_SOURCE {
+    CompressWaitStop = 0,
+    CompressWaitSocket,
+    CompressWaitSpace,
+};
+
+typedef struct _COMPRESS_STREAM {
+    SOCKET              Socket;
+    PHTS_VSP_REPORT     Stats;
+    PLATFORM_THREAD     Thread;
+    PLATFORM_EVENT      StopEvent;      // manual reset, the stream is closed.
+    PLATFORM_EVENT      SpaceEvent;     // auto reset, a recv made room in Rx.
+
+    //
+    // under the Lock.
+    //
+    PLATFORM_LOCK       Lock;
+    BOOL                Closed;         // by the peer or a failed connection.
+    UINT32              Error;          // NO_ERROR if the peer closed.
+    BOOL                WaitingForSpace;
+    RING_BUFFER         Rx;
+    PLATFORM_EVENT      DataEvent;      // manual reset, set while Rx has data or the stream closed.
+
+    PLATFORM_LOCK       SendLock;
+    UINT32              SendError;      // under SendLock, the block that broke the stream.
+    LZ_ENCODER          Encoder;
+    BYTE                SendBuffer[COMPRESS_HEADER_SIZE + LZ_BLOCK_SIZE];
+
+    //
+    // the receive thread only.
+    //
+    LZ_DECODER          Decoder;
+    ULONG               ReceiveLength;
+    BYTE                ReceiveBuffer[COMPRESS_RECEIVE_SIZE];
+    BYTE                RxBuffer[COMPRESS_RX_SIZE + 1];
+} COMPRESS_STREAM, *PCOMPRESS_STREAM;
+
+//
+// sends all of Buffer, called with the SendLock held. A block that could
+// not be sent breaks the stream, later sends fail too.
+//
+static UINT32
+CompressSendAll(
+    _In_  PCOMPRESS_STREAM  Stream,
+    _In_reads_bytes_(Length) const BYTE* Buffer,
+    _In_  ULONG             Length
+    )
+{
+    ULONG sent = 0;
+    UINT32 error = Stream->SendError;
+    while (error == NO_ERROR && sent < Length) {
+        int result = send(Stream->Socket, (const char*)Buffer + sent, (int)(Length - sent), MSG_NOSIGNAL);
+        if (result > 0) {
+            sent += result;
+            continue;
+        }
+        error = PlatformSocketLastError();
+        if (PlatformSocketWouldBlock(error)) {
+            error = PlatformSocketWaitWritable(Stream->Socket, COMPRESS_SEND_TIMEOUT_MS);
+        }
+        if (error != NO_ERROR) {
+            Stream->SendError = error;
+        }
+    }
+    return error;
+}
+
+//
+// decompresses the blocks received into Rx, as long as they fit. Sets
+// *Blocked if the next one does not.
+//
+static UINT32
+CompressDeliver(
+    _In_  PCOMPRESS_STREAM  Stream,
+    _Out_ BOOL              *Blocked
+    )
+{
+    UINT32 error = NO_ERROR;
+    ULONG offset = 0;
+
+    *Blocked = FALSE;
+    while (Stream->ReceiveLength - offset >= COMPRESS_HEADER_SIZE) {
+        ULONG length;
+        ULONG blockLength;
+        if (!CompressDecodeHeader(Stream->ReceiveBuffer + offset, &length, &blockLength)) {
+            error = COMPRESS_PROTOCOL_ERROR;
+            break;
+        }
+        if (Stream->ReceiveLength - offset < COMPRESS_HEADER_SIZE + blockLength) {
+            break;
+        }
+
+        size_t space = 0;
+        PlatformLockAcquire(&Stream->Lock);
+        RingBufferGetAvailableSpace(&Stream->Rx, &space);
+        if (space < length) {
+            Stream->WaitingForSpace = TRUE;
+            *Blocked = TRUE;
+        }
+        PlatformLockRelease(&Stream->Lock);
+        if (*Blocked) {
+            break;
+        }
+
+        ULONGLONG startUs = PlatformTimeUs();
+        const BYTE* data = LzDecompress(&Stream->Decoder,
+            Stream->ReceiveBuffer + offset + COMPRESS_HEADER_SIZE, blockLength, length);
+        Stream->Stats->decompressUs += PlatformTimeUs() - startUs;
+        if (data == NULL) {
+            error = COMPRESS_PROTOCOL_ERROR;
+            break;
+        }
+        Stream->Stats->decompressRawBytes += length;
+        Stream->Stats->decompressWireBytes += COMPRESS_HEADER_SIZE + blockLength;
+
+        PlatformLockAcquire(&Stream->Lock);
+        RingBufferWrite(&Stream->Rx, (BYTE*)data, length);
+        PlatformEventSet(Stream->DataEvent);
+        PlatformLockRelease(&Stream->Lock);
+        offset += COMPRESS_HEADER_SIZE + blockLength;
+    }
+    memmove(Stream->ReceiveBuffer, Stream->ReceiveBuffer + offset, Stream->ReceiveLength - offset);
+    Stream->ReceiveLength -= offset;
+    return error;
+}
+
+static UINT32
+CompressThread(
+    _In_  PVOID             Context
+    )
+{
+    PCOMPRESS_STREAM stream = (PCOMPRESS_STREAM)Context;
+    PPLATFORM_WAITER waiter = NULL;
+    BOOL receiving = TRUE;
+    BOOL closed = FALSE;
+
+    UINT32 error = PlatformWaiterCreate(&waiter);
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddEvent(waiter, stream->StopEvent);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddSocket(waiter, stream->Socket, PLATFORM_SOCKET_READ);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddEvent(waiter, stream->SpaceEvent);
+    }
+
+    while (error == NO_ERROR && !closed) {
+        ULONG ready = PlatformWait(waiter, INFINITE);
+        if (ready == CompressWaitStop || ready == PLATFORM_WAIT_FAILED) {
+            error = COMPRESS_CLOSED_ERROR;
+            break;
+        }
+        if (ready == CompressWaitSocket) {
+            int result = recv(stream->Socket,
+                (char*)stream->ReceiveBuffer + stream->ReceiveLength,
+                (int)(sizeof(stream->ReceiveBuffer) - stream->ReceiveLength), 0);
+            if (result == 0) {
+                // what was received before the close still goes to Rx.
+                closed = TRUE;
+            }
+            else if (result < 0) {
+                error = PlatformSocketLastError();
+                if (PlatformSocketWouldBlock(error)) {
+                    error = NO_ERROR;
+                }
+                continue;
+            }
+            else {
+                stream->ReceiveLength += result;
+            }
+        }
+
+        BOOL blocked;
+        error = CompressDeliver(stream, &blocked);
+        if (closed && blocked && error == NO_ERROR) {
+            // the rest of a peer that closed waits for room too.
+            closed = FALSE;
+            receiving = TRUE;
+        }
+        if (blocked == receiving) {
+            receiving = !blocked;
+            PlatformWaiterEnableSocket(waiter, stream->Socket, receiving);
+        }
+    }
+
+    PlatformWaiterClose(waiter);
+    PlatformLockAcquire(&stream->Lock);
+    stream->Closed = TRUE;
+    stream->Error = error;
+    PlatformEventSet(stream->DataEvent);
+    PlatformLockRelease(&stream->Lock);
+    return error;
+}
+
+static int
+CompressStreamRecv(
+    _In_  PVOID             Context,
+    _Out_writes_bytes_(Length) char* Buffer,
+    _In_  int               Length,
+    _Out_ UINT32*           Error
+    )
+{
+    PCOMPRESS_STREAM stream = (PCOMPRESS_STREAM)Context;
+    size_t length = 0;
+    BOOL space = FALSE;
+
+    PlatformLockAcquire(&stream->Lock);
+    RingBufferGetAvailableData(&stream->Rx, &length);
+    if (length == 0) {
+        BOOL closed = stream->Closed;
+        *Error = closed ? stream->Error : COMPRESS_WOULD_BLOCK_ERROR;
+        if (!closed) {
+            PlatformEventReset(stream->DataEvent);
+        }
+        PlatformLockRelease(&stream->Lock);
+        return (closed && *Error == NO_ERROR) ? 0 : SOCKET_ERROR;
+    }
+    RingBufferRead(&stream->Rx, (BYTE*)Buffer, (size_t)Length, &length);
+    if (stream->WaitingForSpace) {
+        stream->WaitingForSpace = FALSE;
+        space = TRUE;
+    }
+    PlatformLockRelease(&stream->Lock);
+
+    if (space) {
+        PlatformEventSet(stream->SpaceEvent);
+    }
+    *Error = NO_ERROR;
+    return (int)length;
+}
+
+static int
+CompressStreamSend(
+    _In_  PVOID             Context,
+    _In_reads_bytes_(Length) const char* Buffer,
+    _In_  int               Length,
+    _Out_ UINT32*           Error
+    )
+{
+    PCOMPRESS_STREAM stream = (PCOMPRESS_STREAM)Context;
+    ULONG count = (Length < LZ_BLOCK_SIZE) ? (ULONG)Length : LZ_BLOCK_SIZE;
+    if (count == 0) {
+        *Error = NO_ERROR;
+        return 0;
+    }
+
+    PlatformLockAcquire(&stream->SendLock);
+    ULONGLONG startUs = PlatformTimeUs();
+    BYTE* block = stream->SendBuffer + COMPRESS_HEADER_SIZE;
+    ULONG blockLength = LzCompress(&stream->Encoder, (const BYTE*)Buffer, count, block);
+    if (blockLength == 0) {
+        RtlCopyMemory(block, Buffer, count);
+        blockLength = count;
+    }
+    stream->Stats->compressUs += PlatformTimeUs() - startUs;
+    stream->Stats->compressRawBytes += count;
+    stream->Stats->compressWireBytes += COMPRESS_HEADER_SIZE + blockLength;
+    CompressEncodeHeader(count, blockLength, stream->SendBuffer);
+    *Error = CompressSendAll(stream, stream->SendBuffer, COMPRESS_HEADER_SIZE + blockLength);
+    PlatformLockRelease(&stream->SendLock);
+    return (*Error == NO_ERROR) ? (int)count : SOCKET_ERROR;
+}
+
+//
+// a send waits for the socket itself.
+//
+static UINT32
+CompressStreamWaitWritable(
+    _In_  PVOID             Context,
+    _In_  ULONG             TimeoutMs
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(TimeoutMs);
+    return NO_ERROR;
+}
+
+static VOID
+CompressStreamClose(
+    _In_  PVOID             Context
+    )
+{
+    PCOMPRESS_STREAM stream = (PCOMPRESS_STREAM)Context;
+    if (stream->Thread) {
+        PlatformEventSet(stream->StopEvent);
+        PlatformThreadJoin(stream->Thread, INFINITE);
+    }
+    closesocket(stream->Socket);
+    if (stream->StopEvent) {
+        PlatformEventClose(stream->StopEvent);
+    }
+    if (stream->SpaceEvent) {
+        PlatformEventClose(stream->SpaceEvent);
+    }
+    if (stream->DataEvent) {
+        PlatformEventClose(stream->DataEvent);
+    }
+    free(stream);
+}
+
+static const PLATFORM_STREAM_OPS CompressStreamOps = {
+    CompressStreamRecv,
+    CompressStreamSend,
+    CompressStreamWaitWritable,
+    CompressStreamClose,
+};
+
+//
+// receives the hello of the peer, exactly, the blocks after it are the
+// thread's.
+//
+static UINT32
+CompressReceiveHello(
+    _In_  PCOMPRESS_STREAM  Stream,
+    _In_  ULONG             TimeoutMs
+    )
+{
+    BYTE hello[COMPRESS_HELLO_SIZE];
+    ULONG received = 0;
+    ULONGLONG deadlineUs = PlatformTimeUs() + (ULONGLONG)TimeoutMs * 1000;
+    PPLATFORM_WAITER waiter = NULL;
+
+    UINT32 error = PlatformWaiterCreate(&waiter);
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddSocket(waiter, Stream->Socket, PLATFORM_SOCKET_READ);
+    }
+    while (error == NO_ERROR && received < sizeof(hello)) {
+        int result = recv(Stream->Socket, (char*)hello + received, (int)(sizeof(hello) - received), 0);
+        if (result > 0) {
+            received += result;
+            continue;
+        }
+        if (result == 0) {
+            error = COMPRESS_REFUSED_ERROR;
+            break;
+        }
+        error = PlatformSocketLastError();
+        if (!PlatformSocketWouldBlock(error)) {
+            break;
+        }
+        ULONGLONG nowUs = PlatformTimeUs();
+        error = (nowUs < deadlineUs &&
+            PlatformWait(waiter, (ULONG)((deadlineUs - nowUs + 999) / 1000)) == 0) ?
+            NO_ERROR : COMPRESS_TIMEOUT_ERROR;
+    }
+    PlatformWaiterClose(waiter);
+    if (error == NO_ERROR && !CompressHelloValid(TRUE, hello)) {
+        error = COMPRESS_REFUSED_ERROR;
+    }
+    return error;
+}
+
+_Success_(return == NO_ERROR)
+UINT32
+CompressStreamOpen(
+    _In_  SOCKET            Socket,
+    _In_  ULONG             TimeoutMs,
+    _In_  PHTS_VSP_REPORT   Stats,
+    _Out_ PLATFORM_STREAM   *Stream
+    )
+{
+    *Stream = NULL;
+    PCOMPRESS_STREAM stream = (PCOMPRESS_STREAM)calloc(1, sizeof(*stream));
+    if (stream == NULL) {
+        closesocket(Socket);
+        return COMPRESS_MEMORY_ERROR;
+    }
+    stream->Socket = Socket;
+    stream->Stats = Stats;
+    PlatformLockInitialize(&stream->Lock);
+    PlatformLockInitialize(&stream->SendLock);
+    RingBufferInitialize(&stream->Rx, stream->RxBuffer, sizeof(stream->RxBuffer));
+    LzEncoderInitialize(&stream->Encoder);
+    LzDecoderInitialize(&stream->Decoder);
+
+    BYTE hello[COMPRESS_HELLO_SIZE];
+    CompressEncodeHello(FALSE, hello);
+    UINT32 error = PlatformSocketSetNonBlocking(Socket);
+    if (error == NO_ERROR) {
+        error = PlatformEventCreate(TRUE, &stream->StopEvent);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformEventCreate(FALSE, &stream->SpaceEvent);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformEventCreate(TRUE, &stream->DataEvent);
+    }
+    if (error == NO_ERROR) {
+        error = CompressSendAll(stream, hello, sizeof(hello));
+    }
+    if (error == NO_ERROR) {
+        error = CompressReceiveHello(stream, TimeoutMs);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformThreadCreate(CompressThread, stream, &stream->Thread);
+        if (error != NO_ERROR) {
+            stream->Thread = NULL;
+        }
+    }
+    if (error == NO_ERROR) {
+        error = PlatformStreamCreate(&CompressStreamOps, stream, stream->DataEvent, Stream);
+    }
+    if (error != NO_ERROR) {
+        CompressStreamClose(stream);
+    }
+    return error;
+}
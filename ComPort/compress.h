@@ -0,0 +1,118 @@
+/*++
+
+Module Name:
+
+    compress.h
+
+Abstract:
+
+    The compressed transport of a client port, for a peer across a slow
+    link. Once connected the port sends a hello and a peer that compresses
+    too, vspControl --echoservice --compress or vspPeer --serve --compress,
+    answers with the answer hello. Anything else, also a plain echo of the
+    hello, fails the connect, the bytes of a peer that does not compress
+    are never taken for data.
+
+    From then on both directions are blocks: a header with the length of
+    the data and of the block, big endian 16 bit values less one, and the
+    block, see lz.h. A block as long as its data is the data as it is. The
+    sender makes a block of each send, at most LZ_BLOCK_SIZE bytes, so a kd
+    packet goes out at its boundary and nothing waits for more data.
+
+--*/
+
+#pragma once
+
+#include "platform.h"
+#include "htsvsp.h"
+#include "lz.h"
+
+#define COMPRESS_HELLO_SIZE     8
+#define COMPRESS_HEADER_SIZE    4
+
+#define COMPRESS_VERSION        1
+
+//
+// the framing is inline, the peers of vspControl and vspPeer use it
+// without the stream.
+//
+
+//
+// "HVSZ", the version, HTS_VSP_COMPRESSION and whether it is the answer of
+// the peer.
+//
+inline VOID
+CompressEncodeHello(
+    _In_  BOOL              Answer,
+    _Out_writes_bytes_(COMPRESS_HELLO_SIZE)
+          BYTE              *Buffer
+    )
+{
+    Buffer[0] = 'H';
+    Buffer[1] = 'V';
+    Buffer[2] = 'S';
+    Buffer[3] = 'Z';
+    Buffer[4] = COMPRESS_VERSION;
+    Buffer[5] = HtsCompressionLz;
+    Buffer[6] = Answer ? 1 : 0;
+    Buffer[7] = 0;
+}
+
+inline BOOL
+CompressHelloValid(
+    _In_  BOOL              Answer,
+    _In_reads_bytes_(COMPRESS_HELLO_SIZE)
+          const BYTE        *Buffer
+    )
+{
+    BYTE hello[COMPRESS_HELLO_SIZE];
+    CompressEncodeHello(Answer, hello);
+    return memcmp(Buffer, hello, sizeof(hello)) == 0;
+}
+
+inline VOID
+CompressEncodeHeader(
+    _In_  ULONG             Length,
+    _In_  ULONG             BlockLength,
+    _Out_writes_bytes_(COMPRESS_HEADER_SIZE)
+          BYTE              *Buffer
+    )
+{
+    Buffer[0] = (BYTE)((Length - 1) >> 8);
+    Buffer[1] = (BYTE)(Length - 1);
+    Buffer[2] = (BYTE)((BlockLength - 1) >> 8);
+    Buffer[3] = (BYTE)(BlockLength - 1);
+}
+
+//
+// returns FALSE for a header no side sends.
+//
+inline BOOL
+CompressDecodeHeader(
+    _In_reads_bytes_(COMPRESS_HEADER_SIZE)
+          const BYTE        *Buffer,
+    _Out_ ULONG             *Length,
+    _Out_ ULONG             *BlockLength
+    )
+{
+    *Length = ((ULONG)Buffer[0] << 8 | Buffer[1]) + 1;
+    *BlockLength = ((ULONG)Buffer[2] << 8 | Buffer[3]) + 1;
+    return *Length <= LZ_BLOCK_SIZE && *BlockLength <= *Length;
+}
+
+//
+// says hello on the connected Socket and makes Stream of it once the peer
+// answered, within TimeoutMs. Stream takes Socket, also when this fails.
+//
+// A thread receives and decompresses. Sends compress and send at once,
+// waiting for the socket like EngineSend. Stats counts the bytes before and
+// after compression and the time the compressor takes, both ways.
+//
+_Success_(return == NO_ERROR)
+UINT32
+CompressStreamOpen(
+    _In_  SOCKET            Socket,
+    _In_  ULONG             TimeoutMs,
+    _In_  PHTS_VSP_REPORT   Stats,
+    _Out_ PLATFORM_STREAM   *Stream
+    );
@@ -0,0 +1,404 @@
+/*++
+
+Module Name:
+
+    connect.cpp
+
+Abstract:
+
+    The happy eyeballs tcp connect and the dual stack bind, see connect.h.
+
+--*/
+
+#include "connect.h"
+#include <string>
+
+#ifdef _WIN32
+#define CONNECT_TIMEOUT_ERROR       WSAETIMEDOUT
+#define CONNECT_CANCELLED_ERROR     WSAECANCELLED
+#define CONNECT_NO_ADDRESS_ERROR    WSAEADDRNOTAVAIL
+#define CONNECT_NO_FAMILY_ERROR     WSAEAFNOSUPPORT
+#else
+#define CONNECT_TIMEOUT_ERROR       ETIMEDOUT
+#define CONNECT_CANCELLED_ERROR     ECANCELED
+#define CONNECT_NO_ADDRESS_ERROR    EADDRNOTAVAIL
+#define CONNECT_NO_FAMILY_ERROR     EAFNOSUPPORT
+#endif
+
+static_assert(CONNECT_MAX_ATTEMPTS <= HTS_VSP_CONNECT_ATTEMPTS,
+    "HTS_VSP_REPORT keeps every attempt of a connect");
+
+ULONG
+TcpOrderAddresses(
+    _In_  const struct addrinfo*    List,
+    _Out_ const struct addrinfo**   Ordered,
+    _In_  ULONG                     Max
+    )
+{
+    const struct addrinfo* next[2] = { List, List };    // the next address of each family.
+    int family[2] = { 0, 0 };
+    ULONG count = 0;
+
+    for (const struct addrinfo* addr = List; addr != NULL; addr = addr->ai_next) {
+        if (addr->ai_family == AF_INET || addr->ai_family == AF_INET6) {
+            family[0] = addr->ai_family;
+            break;
+        }
+    }
+    family[1] = (family[0] == AF_INET6) ? AF_INET : AF_INET6;
+
+    for (ULONG turn = 0; count < Max; turn ^= 1) {
+        //
+        // the next address of this turn's family, or of the other one once
+        // this family has no more.
+        //
+        ULONG side = turn;
+        while (next[side] != NULL && next[side]->ai_family != family[side]) {
+            next[side] = next[side]->ai_next;
+        }
+        if (next[side] == NULL) {
+            side ^= 1;
+            while (next[side] != NULL && next[side]->ai_family != family[side]) {
+                next[side] = next[side]->ai_next;
+            }
+            if (next[side] == NULL) {
+                break;
+            }
+        }
+        Ordered[count++] = next[side];
+        next[side] = next[side]->ai_next;
+    }
+    return count;
+}
+
+//
+// starts the connect of one attempt. Returns NO_ERROR if it connected at once,
+// a would block error while it is in progress, else the error it failed with.
+//
+static UINT32
+StartAttempt(
+    _In_  PPLATFORM_WAITER          Waiter,
+    _In_  const struct addrinfo*    Address,
+    _Out_ SOCKET*                   Socket,
+    _Out_ PHTS_VSP_CONNECT_ATTEMPT  Attempt
+    )
+{
+    const void* ip = (Address->ai_family == AF_INET6) ?
+        (const void*)&((const sockaddr_in6*)Address->ai_addr)->sin6_addr :
+        (const void*)&((const sockaddr_in*)Address->ai_addr)->sin_addr;
+    inet_ntop(Address->ai_family, ip, Attempt->address, sizeof(Attempt->address));
+    Attempt->family = (USHORT)Address->ai_family;
+
+    *Socket = socket(Address->ai_family, SOCK_STREAM, IPPROTO_TCP);
+    if (*Socket == INVALID_SOCKET) {
+        return PlatformSocketLastError();
+    }
+    //
+    // the waiter makes the socket non-blocking before the connect.
+    //
+    UINT32 error = PlatformWaiterAddSocket(Waiter, *Socket, PLATFORM_SOCKET_CONNECT);
+    if (error != NO_ERROR) {
+        closesocket(*Socket);
+        *Socket = INVALID_SOCKET;
+        return error;
+    }
+    if (connect(*Socket, Address->ai_addr, (int)Address->ai_addrlen) == SOCKET_ERROR) {
+        return PlatformSocketLastError();
+    }
+    return NO_ERROR;
+}
+
+UINT32
+TcpConnectAddresses(
+    _In_  const struct addrinfo* const* Addresses,
+    _In_  ULONG                     Count,
+    _In_  ULONG                     AttemptDelayMs,
+    _In_  ULONG                     TimeoutMs,
+    _In_opt_ PLATFORM_EVENT         Cancel,
+    _Out_ SOCKET*                   Socket,
+    _Out_ PCONNECT_REPORT           Report
+    )
+{
+    SOCKET sockets[CONNECT_MAX_ATTEMPTS];
+    ULONG attemptOfSource[PLATFORM_WAIT_MAX];   // the attempt of each socket source of the waiter.
+    PPLATFORM_WAITER waiter = NULL;
+    PLATFORM_TIMER timer = NULL;
+    ULONG sources = 1;                          // the timer is source 0, then the cancel event.
+    ULONG pending = 0;
+    ULONG next = 0;
+    LONG winner = -1;
+    BOOL startNext = TRUE;
+    UINT32 result = CONNECT_NO_ADDRESS_ERROR;
+    ULONGLONG startUs = PlatformTimeUs();
+    ULONGLONG deadlineUs = startUs + (ULONGLONG)TimeoutMs * 1000;
+
+    *Socket = INVALID_SOCKET;
+    RtlZeroMemory(Report, sizeof(*Report));
+    if (Count > CONNECT_MAX_ATTEMPTS) {
+        Count = CONNECT_MAX_ATTEMPTS;
+    }
+
+    UINT32 error = PlatformWaiterCreate(&waiter);
+    if (error == NO_ERROR) {
+        error = PlatformTimerCreate(&timer);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddTimer(waiter, timer);
+    }
+    if (error == NO_ERROR && Cancel) {
+        error = PlatformWaiterAddEvent(waiter, Cancel);
+        sources++;
+    }
+    if (error != NO_ERROR) {
+        result = error;
+        goto cleanup;
+    }
+
+    for (;;) {
+        //
+        // the next attempt starts when the delay of the last one is over, or
+        // at once when the last one failed.
+        //
+        while (startNext && next < Count) {
+            PHTS_VSP_CONNECT_ATTEMPT attempt = &Report->Attempts[next];
+
+            startNext = FALSE;
+            attempt->startUs = (DWORD)(PlatformTimeUs() - startUs);
+            error = StartAttempt(waiter, Addresses[next], &sockets[next], attempt);
+            if (sockets[next] != INVALID_SOCKET) {
+                attemptOfSource[sources++] = next;
+            }
+            Report->AttemptCount = ++next;
+
+            if (error == NO_ERROR) {
+                attempt->latencyUs = (DWORD)(PlatformTimeUs() - startUs) - attempt->startUs;
+                winner = next - 1;
+                break;
+            }
+            if (PlatformSocketWouldBlock(error)) {
+                attempt->error = HTS_VSP_CONNECT_ABANDONED;
+                pending++;
+                PlatformTimerStart(timer, AttemptDelayMs);
+            }
+            else {
+                attempt->error = error;
+                attempt->latencyUs = (DWORD)(PlatformTimeUs() - startUs) - attempt->startUs;
+                result = error;
+                startNext = TRUE;
+            }
+        }
+        if (winner >= 0) {
+            break;
+        }
+        if (pending == 0) {
+            // every address failed.
+            break;
+        }
+
+        ULONGLONG nowUs = PlatformTimeUs();
+        if (nowUs >= deadlineUs) {
+            result = CONNECT_TIMEOUT_ERROR;
+            break;
+        }
+        ULONG ready = PlatformWait(waiter, (ULONG)((deadlineUs - nowUs + 999) / 1000));
+        if (ready == PLATFORM_WAIT_TIMEOUT) {
+            result = CONNECT_TIMEOUT_ERROR;
+            break;
+        }
+        if (ready == PLATFORM_WAIT_FAILED || ready >= sources) {
+            result = PlatformSocketLastError();
+            break;
+        }
+        if (ready == 0) {
+            startNext = TRUE;
+            continue;
+        }
+        if (Cancel && ready == 1) {
+            result = CONNECT_CANCELLED_ERROR;
+            break;
+        }
+
+        ULONG index = attemptOfSource[ready];
+        PHTS_VSP_CONNECT_ATTEMPT attempt = &Report->Attempts[index];
+        attempt->error = PlatformSocketConnectResult(sockets[index]);
+        attempt->latencyUs = (DWORD)(PlatformTimeUs() - startUs) - attempt->startUs;
+        if (attempt->error == NO_ERROR) {
+            winner = index;
+            break;
+        }
+        //
+        // the socket stays open until the waiter is closed, a closed socket
+        // in a waiter is not removed from it on every platform.
+        //
+        PlatformWaiterEnableSocket(waiter, sockets[index], FALSE);
+        result = attempt->error;
+        pending--;
+        startNext = TRUE;
+    }
+
+    if (winner >= 0) {
+        Report->LatencyUs = (ULONG)(PlatformTimeUs() - startUs);
+        result = NO_ERROR;
+    }
+
+cleanup:
+    PlatformWaiterClose(waiter);
+    if (timer) {
+        PlatformTimerClose(timer);
+    }
+    for (ULONG index = 0; index < next; index++) {
+        if ((LONG)index == winner) {
+            *Socket = sockets[index];
+        }
+        else if (sockets[index] != INVALID_SOCKET) {
+            closesocket(sockets[index]);
+        }
+    }
+    return result;
+}
+
+UINT32
+TcpConnect(
+    _In_  const char*               Host,
+    _In_  USHORT                    Port,
+    _In_  ULONG                     AttemptDelayMs,
+    _In_  ULONG                     TimeoutMs,
+    _In_opt_ PLATFORM_EVENT         Cancel,
+    _Out_ SOCKET*                   Socket,
+    _Out_ PCONNECT_REPORT           Report
+    )
+{
+    struct addrinfo hints = { };
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    std::string port = std::to_string(Port);
+    struct addrinfo* list = NULL;
+    const struct addrinfo* ordered[CONNECT_MAX_ATTEMPTS];
+
+    *Socket = INVALID_SOCKET;
+    RtlZeroMemory(Report, sizeof(*Report));
+    int error = getaddrinfo(Host, port.c_str(), &hints, &list);
+    if (error != 0) {
+        return (UINT32)error;
+    }
+    ULONG count = TcpOrderAddresses(list, ordered, CONNECT_MAX_ATTEMPTS);
+    UINT32 result = TcpConnectAddresses(ordered, count, AttemptDelayMs, TimeoutMs, Cancel, Socket, Report);
+    freeaddrinfo(list);
+    return result;
+}
+
+VOID
+ConnectBackoffReset(
+    _Out_ PCONNECT_BACKOFF          Backoff,
+    _In_  ULONG                     Seed
+    )
+{
+    Backoff->CeilingMs = CONNECT_BACKOFF_MIN_MS;
+    Backoff->Seed = Seed ? Seed : 1;
+}
+
+ULONG
+ConnectBackoffNext(
+    _Inout_ PCONNECT_BACKOFF        Backoff
+    )
+{
+    //
+    // xorshift32, the jitter needs no better.
+    //
+    ULONG seed = Backoff->Seed;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    Backoff->Seed = seed;
+
+    ULONG half = Backoff->CeilingMs / 2;
+    ULONG delayMs = half + seed % (Backoff->CeilingMs - half + 1);
+    if (Backoff->CeilingMs < CONNECT_BACKOFF_MAX_MS / 2) {
+        Backoff->CeilingMs *= 2;
+    }
+    else {
+        Backoff->CeilingMs = CONNECT_BACKOFF_MAX_MS;
+    }
+    return delayMs;
+}
+
+//
+// binds a new socket to one address.
+//
+static UINT32
+BindAddress(
+    _In_  int                       Family,
+    _In_  const sockaddr*           Address,
+    _In_  int                       Length,
+    _Out_ SOCKET*                   Socket
+    )
+{
+    *Socket = socket(Family, SOCK_STREAM, IPPROTO_TCP);
+    if (*Socket == INVALID_SOCKET) {
+        return PlatformSocketLastError();
+    }
+    if (Family == AF_INET6) {
+        //
+        // ipv4 clients come in as mapped addresses. Linux defaults to this,
+        // windows does not.
+        //
+        int no = 0;
+        setsockopt(*Socket, IPPROTO_IPV6, IPV6_V6ONLY, (char*)&no, sizeof(no));
+    }
+    if (bind(*Socket, Address, Length) == SOCKET_ERROR) {
+        UINT32 error = PlatformSocketLastError();
+        closesocket(*Socket);
+        *Socket = INVALID_SOCKET;
+        return error;
+    }
+    return NO_ERROR;
+}
+
+UINT32
+TcpBind(
+    _In_  const char*               Address,
+    _In_  USHORT                    Port,
+    _Out_ SOCKET*                   Socket
+    )
+{
+    *Socket = INVALID_SOCKET;
+    if (Address == NULL || Address[0] == 0 || strcmp(Address, "0") == 0) {
+        sockaddr_in6 any6 = { };    // in6addr_any is all zero.
+        any6.sin6_family = AF_INET6;
+        any6.sin6_port = htons(Port);
+        UINT32 error = BindAddress(AF_INET6, (sockaddr*)&any6, sizeof(any6), Socket);
+        if (error != CONNECT_NO_FAMILY_ERROR) {
+            return error;
+        }
+        // a host without ipv6.
+        sockaddr_in any4 = { };
+        any4.sin_family = AF_INET;
+        any4.sin_addr.s_addr = htonl(INADDR_ANY);
+        any4.sin_port = htons(Port);
+        return BindAddress(AF_INET, (sockaddr*)&any4, sizeof(any4), Socket);
+    }
+
+    struct addrinfo hints = { };
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    std::string port = std::to_string(Port);
+    struct addrinfo* list = NULL;
+    int result = getaddrinfo(Address, port.c_str(), &hints, &list);
+    if (result != 0) {
+        return (UINT32)result;
+    }
+    UINT32 error = CONNECT_NO_ADDRESS_ERROR;
+    for (struct addrinfo* addr = list; addr != NULL; addr = addr->ai_next) {
+        error = BindAddress(addr->ai_family, addr->ai_addr, (int)addr->ai_addrlen, Socket);
+        if (error == NO_ERROR) {
+            break;
+        }
+    }
+    freeaddrinfo(list);
+    return error;
+}
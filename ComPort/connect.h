@@ -0,0 +1,145 @@
+/*++
+
+Module Name:
+
+    connect.h
+
+Abstract:
+
+    The tcp connect of a client port and the bind of a service port, over
+    ipv6 or ipv4.
+
+    A client connects the way RFC 8305 (happy eyeballs) describes. The
+    addresses of the name are tried with the families interleaved, a new
+    attempt starts every CONNECT_ATTEMPT_DELAY_MS or as soon as the last one
+    failed, the attempts run in parallel and the first one to connect wins.
+    An address that does not answer costs the attempt delay instead of the
+    tcp connect timeout.
+
+--*/
+
+#pragma once
+
+#include "platform.h"
+#include "htsvsp.h"
+
+//
+// RFC 8305 recommends 250 ms between attempts.
+//
+#define CONNECT_ATTEMPT_DELAY_MS    250
+
+//
+// longest a connect takes over all its attempts, about the tcp connect
+// timeout of one attempt.
+//
+#define CONNECT_TIMEOUT_MS          20000
+
+//
+// attempts of one connect, each takes a source of the waiter, one is the
+// attempt delay timer and one the cancel event. Further addresses are not
+// tried.
+//
+#define CONNECT_MAX_ATTEMPTS        (PLATFORM_WAIT_MAX - 2)
+
+//
+// a client that lost its connection reconnects after a delay that doubles
+// from CONNECT_BACKOFF_MIN_MS up to CONNECT_BACKOFF_MAX_MS, each a random
+// time between half of it and all of it so that ports that lost the same
+// host do not come back in step. One reconnect gives up after
+// RECONNECT_TIMEOUT_MS, a tcp one also when the port stops.
+//
+#define CONNECT_BACKOFF_MIN_MS      250
+#define CONNECT_BACKOFF_MAX_MS      30000
+#define RECONNECT_TIMEOUT_MS        2000
+
+typedef struct _CONNECT_BACKOFF {
+    ULONG   CeilingMs;                      // of the next delay.
+    ULONG   Seed;
+} CONNECT_BACKOFF, *PCONNECT_BACKOFF;
+
+//
+// the attempts of a connect, in the order they started.
+//
+typedef struct _CONNECT_REPORT {
+    ULONG                   LatencyUs;      // first attempt until one connected, 0 if none did.
+    ULONG                   AttemptCount;
+    HTS_VSP_CONNECT_ATTEMPT Attempts[CONNECT_MAX_ATTEMPTS];
+} CONNECT_REPORT, *PCONNECT_REPORT;
+
+//
+// orders the ipv6 and ipv4 addresses of List for TcpConnectAddresses: the
+// family of the first address first, then alternating. getaddrinfo already
+// sorts each family by preference. Returns the number of addresses in
+// Ordered, at most Max.
+//
+ULONG
+TcpOrderAddresses(
+    _In_  const struct addrinfo*    List,
+    _Out_ const struct addrinfo**   Ordered,
+    _In_  ULONG                     Max
+    );
+
+//
+// connects Socket to the first of Addresses that takes it, trying them in
+// order with AttemptDelayMs between the attempts. Returns the error of the
+// last attempt that failed if none connected, a timeout error after
+// TimeoutMs, or a cancelled error once Cancel, if not NULL, is signalled. The
+// socket is non-blocking.
+//
+_Success_(return == NO_ERROR)
+UINT32
+TcpConnectAddresses(
+    _In_  const struct addrinfo* const* Addresses,
+    _In_  ULONG                     Count,
+    _In_  ULONG                     AttemptDelayMs,
+    _In_  ULONG                     TimeoutMs,
+    _In_opt_ PLATFORM_EVENT         Cancel,
+    _Out_ SOCKET*                   Socket,
+    _Out_ PCONNECT_REPORT           Report
+    );
+
+//
+// resolves Host, a name or a numeric ipv6 or ipv4 address, and connects to
+// Port on one of its addresses.
+//
+_Success_(return == NO_ERROR)
+UINT32
+TcpConnect(
+    _In_  const char*               Host,
+    _In_  USHORT                    Port,
+    _In_  ULONG                     AttemptDelayMs,
+    _In_  ULONG                     TimeoutMs,
+    _In_opt_ PLATFORM_EVENT         Cancel,
+    _Out_ SOCKET*                   Socket,
+    _Out_ PCONNECT_REPORT           Report
+    );
+
+//
+// starts over at CONNECT_BACKOFF_MIN_MS. Seed varies the jitter, any value.
+//
+VOID
+ConnectBackoffReset(
+    _Out_ PCONNECT_BACKOFF          Backoff,
+    _In_  ULONG                     Seed
+    );
+
+//
+// the delay before the next reconnect.
+//
+ULONG
+ConnectBackoffNext(
+    _Inout_ PCONNECT_BACKOFF        Backoff
+    );
+
+//
+// creates a socket bound to Port of Address. An empty Address or "0" binds
+// all addresses: an ipv6 socket that also takes ipv4 clients, or an ipv4
+// socket if the host has no ipv6. "::" is the same, "0.0.0.0" only ipv4.
+//
+_Success_(return == NO_ERROR)
+UINT32
+TcpBind(
+    _In_  const char*               Address,
+    _In_  USHORT                    Port,
+    _Out_ SOCKET*                   Socket
+    );
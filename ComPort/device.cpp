@@ -11,9 +11,9 @@ Abstract:
     This module contains the implementation of the VirtualSerial sample
     driver's device callback object.
 
-    The VirtualSerial sample device does very little.  It does not implement
-    either of the PNP interfaces so once the device is setup, it won't ever get
-    any callbacks until the device is removed.
+    The VirtualSerial sample device does very little.  Of the PNP callbacks it
+    only takes D0 entry, where a saved configuration starts, so once the
+    device is setup, it won't get any other callbacks until it is removed.
 
 Environment:
 
@@ -52,8 +52,13 @@ DeviceCreate(
     WDF_OBJECT_ATTRIBUTES   attributes;
     WDFDEVICE               device;
     PDEVICE_CONTEXT         deviceContext;
+    WDF_PNPPOWER_EVENT_CALLBACKS pnpPowerCallbacks;
     UNREFERENCED_PARAMETER  (Driver);
 
+    WDF_PNPPOWER_EVENT_CALLBACKS_INIT(&pnpPowerCallbacks);
+    pnpPowerCallbacks.EvtDeviceD0Entry = EvtDeviceD0Entry;
+    WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &pnpPowerCallbacks);
+
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(
         &attributes,
         REQUEST_CONTEXT);
@@ -115,13 +120,28 @@ DeviceConfigure(
     WDFKEY                  key;
     LPGUID                  guid;
     errno_t                 errorNo;
+    UINT32                  result;
     
     DECLARE_CONST_UNICODE_STRING(portName,          REG_VALUENAME_PORTNAME);
     DECLARE_UNICODE_STRING_SIZE (comPort,           10);
     DECLARE_UNICODE_STRING_SIZE (symbolicLinkName,  SYMBOLIC_LINK_NAME_LENGTH);
 
     DeviceContext->ServiceSocket = INVALID_SOCKET;
-    DeviceContext->ClientSocket = INVALID_SOCKET;
+    DeviceContext->PendingClient = INVALID_SOCKET;
+    DeviceContext->NextSocket = INVALID_SOCKET;
+    PlatformLockInitialize(&DeviceContext->ConfigureLock);
+    EngineInitialize(&DeviceContext->Engine, &DeviceContext->Stats);
+
+    //
+    // the serial.sys defaults: dtr and rts on, no handshake.
+    //
+    DeviceContext->HandFlow.ControlHandShake = SERIAL_DTR_CONTROL;
+    DeviceContext->HandFlow.FlowReplace = SERIAL_RTS_CONTROL;
+    DeviceContext->HandFlow.XoffLimit = ENGINE_RECEIVE_BUFFER_SIZE >> 3;
+    DeviceContext->HandFlow.XonLimit = ENGINE_RECEIVE_BUFFER_SIZE >> 1;
+    DeviceContext->ModemControlRegister = SERIAL_MCR_DTR | SERIAL_MCR_RTS;
+    DeviceContext->Chars.XonChar = 0x11;
+    DeviceContext->Chars.XoffChar = 0x13;
 
     //
     // Identify as a virtual serial port
@@ -241,99 +261,349 @@ DeviceConfigure(
         goto Exit;
     }
 
-    DeviceContext->ClientSocketEvent = WSACreateEvent();
-    if (DeviceContext->ClientSocketEvent == WSA_INVALID_EVENT) {
-        Trace(TRACE_LEVEL_ERROR, "WSACreateEvent error: %#x",
-            WSAGetLastError());
+    result = PlatformEventCreate(TRUE, &DeviceContext->ThreadEvent); // manual reset
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "PlatformEventCreate ThreadEvent error: %#x",
+            result);
         status = STATUS_UNSUCCESSFUL;
         goto Exit;
     }
 
-    DeviceContext->ServiceSocketEvent = WSACreateEvent();
-    if (DeviceContext->ServiceSocketEvent == WSA_INVALID_EVENT) {
-        Trace(TRACE_LEVEL_ERROR, "WSACreateEvent error: %#x",
-            WSAGetLastError());
+    result = PlatformEventCreate(FALSE, &DeviceContext->ReadQueueEvent); // auto reset
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "PlatformEventCreate ReadQueueEvent error: %#x",
+            result);
         status = STATUS_UNSUCCESSFUL;
         goto Exit;
     }
 
-    DeviceContext->ThreadEvent = CreateEvent(NULL, TRUE, FALSE, NULL); // manual reset
-    if (DeviceContext->ThreadEvent == NULL) {
-        Trace(TRACE_LEVEL_ERROR, "CreateEvent ThreadEvent error: %#x",
-            GetLastError());
+    result = PlatformEventCreate(FALSE, &DeviceContext->CancelEvent); // auto reset
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "PlatformEventCreate CancelEvent error: %#x",
+            result);
         status = STATUS_UNSUCCESSFUL;
         goto Exit;
     }
 
-    DeviceContext->ReadQueueEvent = CreateEvent(NULL, FALSE, FALSE, NULL); // auto reset
-    if (DeviceContext->ReadQueueEvent == NULL) {
-        Trace(TRACE_LEVEL_ERROR, "CreateEvent ReadQueueEvent error: %#x",
-            GetLastError());
+    result = PlatformEventCreate(FALSE, &DeviceContext->ClientStopEvent); // auto reset
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "PlatformEventCreate ClientStopEvent error: %#x",
+            result);
         status = STATUS_UNSUCCESSFUL;
         goto Exit;
     }
 
-    DeviceContext->CancelEvent = CreateEvent(NULL, FALSE, FALSE, NULL); // auto reset
-    if (DeviceContext->CancelEvent == NULL) {
-        Trace(TRACE_LEVEL_ERROR, "CreateEvent CancelEvent error: %#x",
-            GetLastError());
+    result = PlatformEventCreate(FALSE, &DeviceContext->ConfigureEvent); // auto reset
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "PlatformEventCreate ConfigureEvent error: %#x",
+            result);
         status = STATUS_UNSUCCESSFUL;
         goto Exit;
     }
 
-    DeviceContext->IntervalTimerEvent = CreateEvent(NULL, FALSE, FALSE, NULL); // auto reset
-    if (DeviceContext->IntervalTimerEvent == NULL) {
-        Trace(TRACE_LEVEL_ERROR, "CreateEvent IntervalTimerEvent error: %#x",
-            GetLastError());
+    result = PlatformEventCreate(FALSE, &DeviceContext->ConfiguredEvent); // auto reset
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "PlatformEventCreate ConfiguredEvent error: %#x",
+            result);
         status = STATUS_UNSUCCESSFUL;
         goto Exit;
     }
 
-    DeviceContext->TotalTimerEvent = CreateEvent(NULL, FALSE, FALSE, NULL); // auto reset
-    if (DeviceContext->TotalTimerEvent == NULL) {
-        Trace(TRACE_LEVEL_ERROR, "CreateEvent TotalTimerEvent error: %#x",
-            GetLastError());
+    result = TapInitialize(&DeviceContext->Taps, &DeviceContext->Stats);
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "TapInitialize error: %#x",
+            result);
         status = STATUS_UNSUCCESSFUL;
         goto Exit;
     }
+    DeviceContext->Engine.Taps = &DeviceContext->Taps;
 
-    WDF_TIMER_CONFIG  timerConfig;
-    WDF_OBJECT_ATTRIBUTES  timerAttributes;
+    result = CaptureInitialize(&DeviceContext->Capture, &DeviceContext->Stats);
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "CaptureInitialize error: %#x",
+            result);
+        status = STATUS_UNSUCCESSFUL;
+        goto Exit;
+    }
+    DeviceContext->Engine.Capture = &DeviceContext->Capture;
 
-    WDF_TIMER_CONFIG_INIT(
-        &timerConfig,
-        EvtIntervalTimer);
+    result = PlatformTimerCreate(&DeviceContext->IntervalTimer);
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "PlatformTimerCreate IntervalTimer error: %#x",
+            result);
+        status = STATUS_UNSUCCESSFUL;
+        goto Exit;
+    }
 
-    timerConfig.AutomaticSerialization = TRUE;
+    result = PlatformTimerCreate(&DeviceContext->TotalTimer);
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "PlatformTimerCreate TotalTimer error: %#x",
+            result);
+        status = STATUS_UNSUCCESSFUL;
+        goto Exit;
+    }
 
-    WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
-    timerAttributes.ParentObject = device;
+    result = PlatformTimerCreate(&DeviceContext->ReconnectTimer);
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "PlatformTimerCreate ReconnectTimer error: %#x",
+            result);
+        status = STATUS_UNSUCCESSFUL;
+        goto Exit;
+    }
 
-    status = WdfTimerCreate(&timerConfig, &timerAttributes, &DeviceContext->IntervalTimer);
-    if (!NT_SUCCESS(status)) {
-        Trace(TRACE_LEVEL_ERROR, "WdfTimerCreate IntervalTimer error: %#x",
-           status);
+    result = PlatformTimerCreate(&DeviceContext->OverflowTimer);
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "PlatformTimerCreate OverflowTimer error: %#x",
+            result);
+        status = STATUS_UNSUCCESSFUL;
         goto Exit;
     }
 
-    WDF_TIMER_CONFIG_INIT(
-        &timerConfig,
-        EvtTotalTimer);
+Exit:
+    return status;
+}
+
+
+NTSTATUS
+EvtDeviceD0Entry(
+    _In_  WDFDEVICE              Device,
+    _In_  WDF_POWER_DEVICE_STATE PreviousState
+    )
+/*++
+
+  Routine Description:
+
+    Starts the saved schedules and configuration when the device starts. A
+    return to D0 from a sleep state keeps the port as it is.
+
+--*/
+{
+    PDEVICE_CONTEXT         deviceContext = GetDeviceContext(Device);
+    HTS_VSP_CONFIG          config;
+
+    if (PreviousState != WdfPowerDeviceD3Final) {
+        return STATUS_SUCCESS;
+    }
+    deviceContext->StartedUs = PlatformTimeUs();
+
+    //
+    // the saved schedules apply before the port starts.
+    //
+    HTS_VSP_SCHEDULE schedule;
+    if (NT_SUCCESS(DeviceLoadSchedule(deviceContext, TRUE, &schedule))) {
+        PoolSetSchedule((PLATFORM_PRIORITY)schedule.priority, schedule.affinity);
+    }
+    DeviceLoadSchedule(deviceContext, FALSE, &deviceContext->Schedule);
+
+    //
+    // a saved configuration starts now, a client connects in the background
+    // so that the port is up before a debugger opens it. A port without one
+    // waits for IOCTL_HTSVSP_CONFIGURE as before. A configuration that fails
+    // does not fail the start, the port waits for the next one.
+    //
+    if (NT_SUCCESS(DeviceLoadConfig(deviceContext, &config))) {
+        PQUEUE_CONTEXT queueContext = GetQueueContext(WdfDeviceGetDefaultQueue(Device));
+        deviceContext->StartupPending = TRUE;
+        Trace(TRACE_LEVEL_INFO, "saved configuration %s:%d client %d transport %d",
+            config.address, config.port, config.clientMode, config.transport);
+        if (config.clientMode) {
+            ConfigureClient(&config, queueContext, TRUE);
+        }
+        else {
+            ConfigureService(&config, queueContext);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+//
+// UMDF drivers only write below the Device Parameters key with
+// WDF_REGKEY_DEVICE_SUBKEY.
+//
+static NTSTATUS
+DeviceOpenConfigKey(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_  ACCESS_MASK       Access,
+    _Out_ WDFKEY            *Key
+    )
+{
+    NTSTATUS status = WdfDeviceOpenRegistryKey(
+                            DeviceContext->Device,
+                            PLUGPLAY_REGKEY_DEVICE | WDF_REGKEY_DEVICE_SUBKEY,
+                            Access,
+                            WDF_NO_OBJECT_ATTRIBUTES,
+                            Key);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR,
+            "Error: Failed to open device hardware key 0x%x", status);
+    }
+    return status;
+}
+
 
-    timerConfig.AutomaticSerialization = TRUE;
+NTSTATUS
+DeviceSaveConfig(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_opt_ PHTS_VSP_CONFIG Config
+    )
+{
+    WDFKEY                  key;
+    NTSTATUS                status;
+
+    DECLARE_CONST_UNICODE_STRING(valueName, REG_VALUENAME_HTSVSP_CONFIG);
 
-    status = WdfTimerCreate(&timerConfig, &timerAttributes, &DeviceContext->TotalTimer);
+    status = DeviceOpenConfigKey(DeviceContext, KEY_SET_VALUE, &key);
     if (!NT_SUCCESS(status)) {
-        Trace(TRACE_LEVEL_ERROR, "WdfTimerCreate TotalTimer error: %#x",
-            status);
-        goto Exit;
+        return status;
     }
 
-Exit:
+    if (Config) {
+        status = WdfRegistryAssignValue(key,
+                                        &valueName,
+                                        REG_BINARY,
+                                        sizeof(*Config),
+                                        Config);
+    }
+    else {
+        status = WdfRegistryRemoveValue(key, &valueName);
+        if (status == STATUS_OBJECT_NAME_NOT_FOUND) {
+            status = STATUS_SUCCESS;
+        }
+    }
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR,
+            "Error: Failed to save the configuration 0x%x", status);
+    }
+
+    WdfRegistryClose(key);
+    return status;
+}
+
+
+NTSTATUS
+DeviceLoadConfig(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _Out_ PHTS_VSP_CONFIG   Config
+    )
+{
+    WDFKEY                  key;
+    NTSTATUS                status;
+    ULONG                   length = 0;
+    ULONG                   type = REG_NONE;
+
+    DECLARE_CONST_UNICODE_STRING(valueName, REG_VALUENAME_HTSVSP_CONFIG);
+
+    RtlZeroMemory(Config, sizeof(*Config));
+    status = DeviceOpenConfigKey(DeviceContext, KEY_QUERY_VALUE, &key);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = WdfRegistryQueryValue(key,
+                                   &valueName,
+                                   sizeof(*Config),
+                                   Config,
+                                   &length,
+                                   &type);
+    WdfRegistryClose(key);
+    if (!NT_SUCCESS(status)) {
+        // never configured, or closed.
+        return status;
+    }
+
+    //
+    // a configuration saved by a driver with another HTS_VSP_CONFIG is not
+    // used.
+    //
+    if (type != REG_BINARY || length != sizeof(*Config) || Config->closeConnections) {
+        Trace(TRACE_LEVEL_ERROR,
+            "Error: saved configuration of type %lu length %lu ignored", type, length);
+        return STATUS_OBJECT_TYPE_MISMATCH;
+    }
+    Config->address[sizeof(Config->address) - 1] = '\0';
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+DeviceSaveSchedule(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_  PHTS_VSP_SCHEDULE Schedule
+    )
+{
+    WDFKEY                  key;
+    NTSTATUS                status;
+
+    DECLARE_CONST_UNICODE_STRING(portName, REG_VALUENAME_HTSVSP_SCHEDULE);
+    DECLARE_CONST_UNICODE_STRING(poolName, REG_VALUENAME_HTSVSP_POOL_SCHEDULE);
+
+    status = DeviceOpenConfigKey(DeviceContext, KEY_SET_VALUE, &key);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = WdfRegistryAssignValue(key,
+                                    Schedule->global ? &poolName : &portName,
+                                    REG_BINARY,
+                                    sizeof(*Schedule),
+                                    Schedule);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR,
+            "Error: Failed to save the schedule 0x%x", status);
+    }
+
+    WdfRegistryClose(key);
     return status;
 }
 
 
+NTSTATUS
+DeviceLoadSchedule(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_  BOOL              Global,
+    _Out_ PHTS_VSP_SCHEDULE Schedule
+    )
+{
+    WDFKEY                  key;
+    NTSTATUS                status;
+    ULONG                   length = 0;
+    ULONG                   type = REG_NONE;
+
+    DECLARE_CONST_UNICODE_STRING(portName, REG_VALUENAME_HTSVSP_SCHEDULE);
+    DECLARE_CONST_UNICODE_STRING(poolName, REG_VALUENAME_HTSVSP_POOL_SCHEDULE);
+
+    RtlZeroMemory(Schedule, sizeof(*Schedule));
+    status = DeviceOpenConfigKey(DeviceContext, KEY_QUERY_VALUE, &key);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = WdfRegistryQueryValue(key,
+                                   Global ? &poolName : &portName,
+                                   sizeof(*Schedule),
+                                   Schedule,
+                                   &length,
+                                   &type);
+    WdfRegistryClose(key);
+    if (!NT_SUCCESS(status)) {
+        // never set.
+        return status;
+    }
+
+    if (type != REG_BINARY || length != sizeof(*Schedule) || Schedule->priority > HtsPriorityBulk) {
+        Trace(TRACE_LEVEL_ERROR,
+            "Error: saved schedule of type %lu length %lu ignored", type, length);
+        RtlZeroMemory(Schedule, sizeof(*Schedule));
+        return STATUS_OBJECT_TYPE_MISMATCH;
+    }
+    Trace(TRACE_LEVEL_INFO, "saved %s schedule priority %lu affinity %#I64x",
+        Global ? "pool" : "port", Schedule->priority, Schedule->affinity);
+    return STATUS_SUCCESS;
+}
+
+
 NTSTATUS
 DeviceGetPdoName(
     _In_  PDEVICE_CONTEXT   DeviceContext
@@ -467,35 +737,53 @@ EvtDeviceCleanup(
 exit:
 
     if (deviceContext->ReadQueueEvent) {
-        CloseHandle(deviceContext->ReadQueueEvent);
+        PlatformEventClose(deviceContext->ReadQueueEvent);
         deviceContext->ReadQueueEvent = NULL;
     }
 
     if (deviceContext->CancelEvent) {
-        CloseHandle(deviceContext->CancelEvent);
+        PlatformEventClose(deviceContext->CancelEvent);
         deviceContext->CancelEvent = NULL;
     }
 
-    if (deviceContext->IntervalTimerEvent) {
-        CloseHandle(deviceContext->IntervalTimerEvent);
-        deviceContext->IntervalTimerEvent = NULL;
+    if (deviceContext->ClientStopEvent) {
+        PlatformEventClose(deviceContext->ClientStopEvent);
+        deviceContext->ClientStopEvent = NULL;
+    }
+
+    if (deviceContext->ConfigureEvent) {
+        PlatformEventClose(deviceContext->ConfigureEvent);
+        deviceContext->ConfigureEvent = NULL;
     }
 
-    if (deviceContext->TotalTimerEvent) {
-        CloseHandle(deviceContext->TotalTimerEvent);
-        deviceContext->TotalTimerEvent = NULL;
+    if (deviceContext->ConfiguredEvent) {
+        PlatformEventClose(deviceContext->ConfiguredEvent);
+        deviceContext->ConfiguredEvent = NULL;
     }
 
+    TapCleanup(&deviceContext->Taps);
+
+    CaptureCleanup(&deviceContext->Capture);
+
     if (deviceContext->IntervalTimer) {
-        WdfTimerStop(deviceContext->IntervalTimer, TRUE);
+        PlatformTimerClose(deviceContext->IntervalTimer);
         deviceContext->IntervalTimer = NULL;
     }
 
     if (deviceContext->TotalTimer) {
-        WdfTimerStop(deviceContext->TotalTimer, TRUE);
+        PlatformTimerClose(deviceContext->TotalTimer);
         deviceContext->TotalTimer = NULL;
     }
-    
+
+    if (deviceContext->ReconnectTimer) {
+        PlatformTimerClose(deviceContext->ReconnectTimer);
+        deviceContext->ReconnectTimer = NULL;
+    }
+
+    if (deviceContext->OverflowTimer) {
+        PlatformTimerClose(deviceContext->OverflowTimer);
+        deviceContext->OverflowTimer = NULL;
+    }
 
     if (key != NULL) {
         WdfRegistryClose(key);
@@ -577,3 +865,128 @@ GetTimeouts(
 {
     *Timeouts = DeviceContext->Timeouts;
 }
+
+NTSTATUS
+SetHandFlow(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_  const SERIAL_HANDFLOW *HandFlow
+    )
+{
+    PNET_ENGINE engine = &DeviceContext->Engine;
+    size_t size = engine->ReceiveRing.Size - 1;     // what the ring holds.
+
+    if ((HandFlow->ControlHandShake & SERIAL_CONTROL_INVALID) ||
+        (HandFlow->FlowReplace & SERIAL_FLOW_INVALID) ||
+        (HandFlow->ControlHandShake & SERIAL_DTR_MASK) == SERIAL_DTR_MASK ||
+        HandFlow->XonLimit < 0 || (size_t)HandFlow->XonLimit > size ||
+        HandFlow->XoffLimit < 0 || (size_t)HandFlow->XoffLimit > size) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if ((HandFlow->FlowReplace & (SERIAL_AUTO_TRANSMIT | SERIAL_AUTO_RECEIVE)) &&
+        DeviceContext->Chars.XonChar == DeviceContext->Chars.XoffChar) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    DeviceContext->HandFlow = *HandFlow;
+
+    //
+    // a handshake line is on while the port receives, the engine takes it
+    // down by not reading the socket.
+    //
+    BOOLEAN dtrHandshake = (HandFlow->ControlHandShake & SERIAL_DTR_MASK) == SERIAL_DTR_HANDSHAKE;
+    BOOLEAN rtsHandshake = (HandFlow->FlowReplace & SERIAL_RTS_MASK) == SERIAL_RTS_HANDSHAKE;
+    if (dtrHandshake) {
+        DeviceContext->ModemControlRegister |= SERIAL_MCR_DTR;
+    }
+    if (rtsHandshake) {
+        DeviceContext->ModemControlRegister |= SERIAL_MCR_RTS;
+    }
+    engine->Flow.RtsHandshake = rtsHandshake;
+    EngineSetRts(engine, (DeviceContext->ModemControlRegister & SERIAL_MCR_RTS) != 0);
+    if (dtrHandshake || rtsHandshake || (HandFlow->FlowReplace & SERIAL_AUTO_RECEIVE)) {
+        EngineSetWatermarks(engine, size - HandFlow->XoffLimit, HandFlow->XonLimit);
+    }
+    else {
+        EngineSetWatermarks(engine, 0, 0);
+    }
+    // the client loop applies them at its next wait.
+    PlatformEventSet(DeviceContext->ReadQueueEvent);
+    Trace(TRACE_LEVEL_INFO, "ControlHandShake %x FlowReplace %x watermarks %d %d",
+        HandFlow->ControlHandShake,
+        HandFlow->FlowReplace,
+        (int)engine->Flow.HighWater,
+        (int)engine->Flow.LowWater);
+    return STATUS_SUCCESS;
+}
+
+VOID
+GetHandFlow(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _Out_ SERIAL_HANDFLOW   *HandFlow
+    )
+{
+    *HandFlow = DeviceContext->HandFlow;
+}
+
+NTSTATUS
+SetChars(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_  const SERIAL_CHARS *Chars
+    )
+{
+    if ((DeviceContext->HandFlow.FlowReplace & (SERIAL_AUTO_TRANSMIT | SERIAL_AUTO_RECEIVE)) &&
+        Chars->XonChar == Chars->XoffChar) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    DeviceContext->Chars = *Chars;
+    return STATUS_SUCCESS;
+}
+
+VOID
+GetChars(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _Out_ SERIAL_CHARS      *Chars
+    )
+{
+    *Chars = DeviceContext->Chars;
+}
+
+NTSTATUS
+SetModemLine(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_  ULONG             Line,
+    _In_  BOOLEAN           On
+    )
+{
+    if (Line == SERIAL_MCR_DTR &&
+        (DeviceContext->HandFlow.ControlHandShake & SERIAL_DTR_MASK) == SERIAL_DTR_HANDSHAKE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (Line == SERIAL_MCR_RTS &&
+        (DeviceContext->HandFlow.FlowReplace & SERIAL_RTS_MASK) > SERIAL_RTS_CONTROL) {
+        // rts handshake or transmit toggle.
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (On) {
+        DeviceContext->ModemControlRegister |= Line;
+    }
+    else {
+        DeviceContext->ModemControlRegister &= ~Line;
+    }
+    if (Line == SERIAL_MCR_RTS) {
+        EngineSetRts(&DeviceContext->Engine, On);
+        PlatformEventSet(DeviceContext->ReadQueueEvent);
+    }
+    return STATUS_SUCCESS;
+}
+
+VOID
+SetXoff(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_  BOOLEAN           Xoff
+    )
+{
+    UINT32 result = EngineHoldTransmit(&DeviceContext->Engine, Xoff);
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "send of the held writes error: %#x", result);
+    }
+}
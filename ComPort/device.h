@@ -24,8 +24,35 @@ Environment:
 #define REG_PATH_DEVICEMAP          L"HARDWARE\\DEVICEMAP"
 #define SERIAL_DEVICE_MAP           L"SERIALCOMM"
 #define REG_VALUENAME_PORTNAME      L"PortName"
+#define REG_VALUENAME_HTSVSP_CONFIG L"HtsVspConfig"
+#define REG_VALUENAME_HTSVSP_SCHEDULE L"HtsVspSchedule"
+#define REG_VALUENAME_HTSVSP_POOL_SCHEDULE L"HtsVspPoolSchedule"
 #define REG_PATH_SERIALCOMM         REG_PATH_DEVICEMAP L"\\" SERIAL_DEVICE_MAP
 
+//
+// what the client loop keeps between its runs on the worker pool, see
+// ClientRun in network.cpp.
+//
+typedef struct _CLIENT_LOOP
+{
+    PPLATFORM_WAITER Waiter;
+
+    BOOL            WaiterConnected;    // the waiter has the socket source of a connection.
+
+    SOCKET          WaiterSocket;
+
+    PLATFORM_STREAM WaiterStream;
+
+    BOOL            SocketEnabled;
+
+    BOOL            SampleWake;
+
+    BOOL            OverflowTimerRunning;
+
+    BOOL            Waiting;            // the last run returned PoolWorkWait.
+
+} CLIENT_LOOP, *PCLIENT_LOOP;
+
 typedef struct _DEVICE_CONTEXT
 {
     WDFDEVICE       Device;
@@ -42,63 +69,90 @@ typedef struct _DEVICE_CONTEXT
 
     SERIAL_TIMEOUTS Timeouts;
 
+    SERIAL_HANDFLOW HandFlow;           // a receive handshake sets the watermarks of the engine.
+
+    SERIAL_CHARS    Chars;
+
     BOOLEAN         CreatedLegacyHardwareKey;
 
     PWSTR           PdoName;
 
     HTS_VSP_CONFIG  Config;
 
-    SOCKET          ServiceSocket;
+    HTS_VSP_SCHEDULE Schedule;          // of the port, its loops take it at their next run.
 
-    WSAEVENT        ServiceSocketEvent;
+    SOCKET          ServiceSocket;
 
-    SOCKET          ClientSocket;
+    PPOOL_WORK      Work;               // the loop of the client or the service, on the worker pool.
 
-    WSAEVENT        ClientSocketEvent;
+    PLATFORM_EVENT  ThreadEvent;
 
-    HANDLE          ThreadHandle;
+    PPOOL_WORK      ClientWork;         // for service client
 
-    HANDLE          ThreadEvent;
+    PLATFORM_EVENT  ClientStopEvent;    // ends the loop of a service client that lost its connection.
 
-    HANDLE          ClientThreadHandle; // for service client
+    SOCKET          PendingClient;      // the next service client, until the loop of the last one is done.
 
     BOOL            TerminateThread;
 
+    CLIENT_LOOP     ClientLoop;         // the state of the client loop between its runs.
+
+    PPLATFORM_WAITER ServiceWaiter;
+
+    ULONG           ServiceTimeoutMs;   // until the taps flush again.
+
     HTS_VSP_REPORT  Stats;
 
-    HANDLE          ReadQueueEvent;
+    struct _TIMELINE * Timeline;        // NULL until a timeline capture is started.
+
+    volatile LONG   NextCorrelationId;
+
+    ULONG           CurrentCorrelationId; // of CurrentRequest, for events outside the client loop.
+
+    PLATFORM_EVENT  ReadQueueEvent;
 
     WDFREQUEST      CurrentRequest;
 
-    HANDLE          CancelEvent;
+    PLATFORM_EVENT  CancelEvent;
+
+    PLATFORM_TIMER  IntervalTimer;
 
-    BOOL            UseIntervalTimer;
+    PLATFORM_TIMER  TotalTimer;
 
-    LARGE_INTEGER   IntervalTimeRelative;
+    PLATFORM_TIMER  ReconnectTimer;     // the backoff of a client that lost its connection.
 
-    ULONG           BytesFromLastRead;
+    PLATFORM_TIMER  OverflowTimer;      // the timeout of a receive ring that blocks the peer.
 
-    WDFTIMER        IntervalTimer;
+    CONNECT_BACKOFF Backoff;
 
-    HANDLE          IntervalTimerEvent;
+    ULONGLONG       DisconnectedUs;     // PlatformTimeUs when the connection was lost.
 
-    BOOL            UseTotalTimer;
+    ULONGLONG       StartedUs;          // PlatformTimeUs at device start.
 
-    LARGE_INTEGER   TotalTime;
+    BOOLEAN         StartupPending;     // the saved configuration has not connected yet.
 
-    LARGE_INTEGER   TotalTimeRelative;
+    //
+    // a new endpoint handed to the running thread, see ConfigureInPlace.
+    //
+    PLATFORM_EVENT  ConfigureEvent;     // signals the thread.
 
-    WDFTIMER        TotalTimer;
+    PLATFORM_EVENT  ConfiguredEvent;    // the thread took it.
 
-    HANDLE          TotalTimerEvent;
+    PLATFORM_LOCK   ConfigureLock;
 
-    ULONG           NumberNeededForRead;
+    BOOLEAN         ConfigurePending;
 
-    BOOL            returnWithWhatsPresent;
+    HTS_VSP_CONFIG  NextConfig;
 
-    BOOL            os2ssreturn;
+    SOCKET          NextSocket;         // connected for a client, listening for a service.
 
-    BOOL            crunchDownToOne;
+    PLATFORM_STREAM NextStream;
+
+    NET_ENGINE      Engine;             // the client socket, received data and the current read.
+
+    TAP_SET         Taps;               // the clients of a service that connect while one is connected.
+
+    CAPTURE_LOG     Capture;            // what went over the wire, while IOCTL_HTSVSP_CAPTURE_CONTROL has it running.
 
 } DEVICE_CONTEXT, *PDEVICE_CONTEXT;
 
@@ -128,8 +182,47 @@ DeviceWriteLegacyHardwareKey(
     _In_  WDFDEVICE         Device
     );
 
+//
+// the configuration of the last IOCTL_HTSVSP_CONFIGURE is kept in the device
+// hardware key and applied again at device start. A NULL Config removes it.
+//
+NTSTATUS
+DeviceSaveConfig(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_opt_ PHTS_VSP_CONFIG Config
+    );
+
+NTSTATUS
+DeviceLoadConfig(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _Out_ PHTS_VSP_CONFIG   Config
+    );
+
+//
+// the schedule of the last IOCTL_HTSVSP_SET_SCHEDULE, of the port or of the
+// worker pool, is kept in the device hardware key too. A device that starts
+// with a saved pool schedule sets the pool.
+//
+NTSTATUS
+DeviceSaveSchedule(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_  PHTS_VSP_SCHEDULE Schedule
+    );
+
+NTSTATUS
+DeviceLoadSchedule(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_  BOOL              Global,
+    _Out_ PHTS_VSP_SCHEDULE Schedule
+    );
+
 EVT_WDF_DEVICE_CONTEXT_CLEANUP  EvtDeviceCleanup;
 
+//
+// applies the saved configuration when the device starts.
+//
+EVT_WDF_DEVICE_D0_ENTRY         EvtDeviceD0Entry;
+
 ULONG
 GetBaudRate(
     _In_  PDEVICE_CONTEXT   DeviceContext
@@ -172,4 +265,54 @@ VOID
 GetTimeouts(
     _In_  PDEVICE_CONTEXT   DeviceContext,
     _Out_ SERIAL_TIMEOUTS   *Timeouts
-    );
\ No newline at end of file
+    );
+
+//
+// the receive handshakes, dtr, rts and xon/xoff, pause the engine at the
+// XoffLimit and resume it at the XonLimit. Fails for flags and limits
+// serial.sys rejects.
+//
+NTSTATUS
+SetHandFlow(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_  const SERIAL_HANDFLOW *HandFlow
+    );
+
+VOID
+GetHandFlow(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _Out_ SERIAL_HANDFLOW   *HandFlow
+    );
+
+NTSTATUS
+SetChars(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_  const SERIAL_CHARS *Chars
+    );
+
+VOID
+GetChars(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _Out_ SERIAL_CHARS      *Chars
+    );
+
+//
+// sets or clears SERIAL_MCR_DTR or SERIAL_MCR_RTS. Fails for a line under
+// handshake control. Clearing rts stops receiving only where the rts
+// handshake is emulated, see EngineSetRts.
+//
+NTSTATUS
+SetModemLine(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_  ULONG             Line,
+    _In_  BOOLEAN           On
+    );
+
+//
+// as if the peer sent an xoff or an xon: writes wait until the xon.
+//
+VOID
+SetXoff(
+    _In_  PDEVICE_CONTEXT   DeviceContext,
+    _In_  BOOLEAN           Xoff
+    );
@@ -39,6 +39,7 @@ DriverEntry(
     Globals.TraceLevel = TRACE_LEVEL_ERROR;
 #endif
     Globals.WaitUnits = 3;
+    QueryPerformanceFrequency(&Globals.PerfFrequency);
 
     UINT32 error = WinSockInitialize();
    if (error != NO_ERROR) {
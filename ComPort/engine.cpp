@@ -0,0 +1,833 @@
+/*++
+
+Module Name:
+
+    engine.cpp
+
+Abstract:
+
+    The portable receive and transmit engine, see engine.h.
+
+--*/
+
+#include "engine.h"
+
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+
+VOID
+HistogramAdd(
+    _Inout_ INT64           *Buckets,
+    _In_  ULONGLONG         Value
+    )
+{
+    ULONG index = 0;
+    if (Value != 0) {
+#ifdef _WIN32
+        ULONG msb;
+        _BitScanReverse64(&msb, Value);
+#else
+        ULONG msb = 63 - __builtin_clzll(Value);
+#endif
+        index = msb + 1;
+        if (index >= HTS_VSP_HISTOGRAM_BUCKETS) {
+            index = HTS_VSP_HISTOGRAM_BUCKETS - 1;
+        }
+    }
+    Buckets[index]++;
+}
+
+VOID
+CalculateReadTimers(
+    _In_  const SERIAL_TIMEOUTS *Timeouts,
+    _In_  ULONG             Length,
+    _Out_ PREAD_TIMERS      Timers
+    )
+{
+    ULONG multiplierVal = 0;
+    ULONG constantVal = 0;
+
+    RtlZeroMemory(Timers, sizeof(*Timers));
+
+    if (Timeouts->ReadIntervalTimeout &&
+        (Timeouts->ReadIntervalTimeout != MAXULONG))
+    {
+        Timers->UseIntervalTimer = TRUE;
+        Timers->IntervalMs = Timeouts->ReadIntervalTimeout;
+    }
+    if (Timeouts->ReadIntervalTimeout == MAXULONG) {
+        //
+        // We need to do special return quickly stuff here.
+        //
+        // 1) If both constant and multiplier are
+        //    0 then we return immediately with whatever
+        //    we've got, even if it was zero.
+        //
+        // 2) If constant and multiplier are not MAXULONG
+        //    then return immediately if any characters
+        //    are present, but if nothing is there, then
+        //    use the timeouts as specified.
+        //
+        // 3) If multiplier is MAXULONG then do as in
+        //    "2" but return when the first character
+        //    arrives.
+        //
+        if (!Timeouts->ReadTotalTimeoutConstant &&
+            !Timeouts->ReadTotalTimeoutMultiplier) {
+
+            Timers->returnWithWhatsPresent = TRUE;
+
+        }
+        else if ((Timeouts->ReadTotalTimeoutConstant != MAXULONG)
+            &&
+            (Timeouts->ReadTotalTimeoutMultiplier
+                != MAXULONG)) {
+
+            Timers->UseTotalTimer = TRUE;
+            Timers->os2ssreturn = TRUE;
+            multiplierVal = Timeouts->ReadTotalTimeoutMultiplier;
+            constantVal = Timeouts->ReadTotalTimeoutConstant;
+
+        }
+        else if ((Timeouts->ReadTotalTimeoutConstant != MAXULONG)
+            &&
+            (Timeouts->ReadTotalTimeoutMultiplier
+                == MAXULONG)) {
+
+            Timers->UseTotalTimer = TRUE;
+            Timers->os2ssreturn = TRUE;
+            Timers->crunchDownToOne = TRUE;
+            multiplierVal = 0;
+            constantVal = Timeouts->ReadTotalTimeoutConstant;
+
+        }
+    }
+    else {
+        //
+        // If both the multiplier and the constant are
+        // zero then don't do any total timeout processing.
+        //
+        if (Timeouts->ReadTotalTimeoutMultiplier ||
+            Timeouts->ReadTotalTimeoutConstant) {
+            //
+            // We have some timer values to calculate.
+            //
+            Timers->UseTotalTimer = TRUE;
+            multiplierVal = Timeouts->ReadTotalTimeoutMultiplier;
+            constantVal = Timeouts->ReadTotalTimeoutConstant;
+
+        }
+    }
+
+    if (Timers->UseTotalTimer) {
+        Timers->TotalMs = ((ULONGLONG)Length * multiplierVal) + constantVal;
+    }
+}
+
+VOID
+EngineInitialize(
+    _In_  PNET_ENGINE       Engine,
+    _In_  PHTS_VSP_REPORT   Stats
+    )
+{
+    Engine->Socket = INVALID_SOCKET;
+    Engine->Stream = NULL;
+    Engine->Stats = Stats;
+    Engine->CurrentRead = NULL;
+    Engine->LastError = NO_ERROR;
+    RtlZeroMemory(&Engine->Spin, sizeof(Engine->Spin));
+    RingBufferInitialize(&Engine->ReceiveRing,
+        Engine->ReceiveBuffer,
+        sizeof(Engine->ReceiveBuffer));
+    RtlZeroMemory(&Engine->Flow, sizeof(Engine->Flow));
+    EngineSetWatermarks(Engine, 0, 0);
+    RtlZeroMemory(&Engine->Overflow, sizeof(Engine->Overflow));
+    EngineSetOverflow(Engine, HtsOverflowBlock, 0);
+    PlatformLockInitialize(&Engine->SendLock);
+    Engine->Backlogging = FALSE;
+    RingBufferInitialize(&Engine->Backlog,
+        Engine->BacklogBuffer,
+        sizeof(Engine->BacklogBuffer));
+    Engine->Taps = NULL;
+    Engine->Capture = NULL;
+}
+
+VOID
+EngineReset(
+    _In_  PNET_ENGINE       Engine
+    )
+{
+    Engine->LastError = NO_ERROR;
+    RingBufferInitialize(&Engine->ReceiveRing,
+        Engine->ReceiveBuffer,
+        sizeof(Engine->ReceiveBuffer));
+}
+
+BOOL
+EngineConnected(
+    _In_  PNET_ENGINE       Engine
+    )
+{
+    return Engine->Stream != NULL || Engine->Socket != INVALID_SOCKET;
+}
+
+static VOID
+CloseConnection(
+    _In_  PNET_ENGINE       Engine
+    )
+{
+    if (Engine->Stream) {
+        PlatformStreamClose(Engine->Stream);
+        Engine->Stream = NULL;
+    }
+    if (Engine->Socket != INVALID_SOCKET) {
+        closesocket(Engine->Socket);
+        Engine->Socket = INVALID_SOCKET;
+    }
+}
+
+VOID
+EngineClose(
+    _In_  PNET_ENGINE       Engine
+    )
+{
+    PlatformLockAcquire(&Engine->SendLock);
+    CloseConnection(Engine);
+    Engine->Backlogging = FALSE;
+    RingBufferInitialize(&Engine->Backlog,
+        Engine->BacklogBuffer,
+        sizeof(Engine->BacklogBuffer));
+    PlatformLockRelease(&Engine->SendLock);
+}
+
+VOID
+EngineDisconnect(
+    _In_  PNET_ENGINE       Engine
+    )
+{
+    PlatformLockAcquire(&Engine->SendLock);
+    CloseConnection(Engine);
+    Engine->Backlogging = TRUE;
+    PlatformLockRelease(&Engine->SendLock);
+}
+
+//
+// sends the kept writes, under SendLock.
+//
+static UINT32
+SendBacklog(
+    _In_  PNET_ENGINE       Engine
+    )
+{
+    UINT32 error = NO_ERROR;
+    BYTE buffer[4096];
+    size_t length;
+
+    while (error == NO_ERROR &&
+        NT_SUCCESS(RingBufferRead(&Engine->Backlog, buffer, sizeof(buffer), &length)) &&
+        length != 0) {
+        error = EngineSend(Engine, (const char*)buffer, (int)length);
+    }
+    RingBufferInitialize(&Engine->Backlog,
+        Engine->BacklogBuffer,
+        sizeof(Engine->BacklogBuffer));
+    return error;
+}
+
+UINT32
+EngineAttach(
+    _In_  PNET_ENGINE       Engine,
+    _In_  SOCKET            Socket,
+    _In_  PLATFORM_STREAM   Stream
+    )
+{
+    UINT32 error = NO_ERROR;
+
+    PlatformLockAcquire(&Engine->SendLock);
+    CloseConnection(Engine);
+    Engine->Socket = Socket;
+    Engine->Stream = Stream;
+    Engine->Backlogging = FALSE;
+    //
+    // the kept writes go first, a write waiting for the lock comes after them.
+    // An xoff keeps them until the xon.
+    //
+    if (!Engine->Flow.TransmitHeld) {
+        error = SendBacklog(Engine);
+    }
+    PlatformLockRelease(&Engine->SendLock);
+    return error;
+}
+
+UINT32
+EngineWaiterAdd(
+    _In_  PNET_ENGINE       Engine,
+    _In_  PPLATFORM_WAITER  Waiter
+    )
+{
+    return Engine->Stream ?
+        PlatformWaiterAddStream(Waiter, Engine->Stream) :
+        PlatformWaiterAddSocket(Waiter, Engine->Socket, PLATFORM_SOCKET_READ);
+}
+
+VOID
+EngineWaiterEnable(
+    _In_  PNET_ENGINE       Engine,
+    _In_  PPLATFORM_WAITER  Waiter,
+    _In_  BOOL              Enable
+    )
+{
+    if (Engine->Stream) {
+        PlatformWaiterEnableStream(Waiter, Engine->Stream, Enable);
+    }
+    else {
+        PlatformWaiterEnableSocket(Waiter, Engine->Socket, Enable);
+    }
+}
+
+ENGINE_RECEIVE_STATUS
+EngineReceive(
+    _In_  PNET_ENGINE       Engine,
+    _Out_ ULONG             *Received
+    )
+{
+    size_t level;
+
+    *Received = 0;
+    if (!EngineReceiveAllowed(Engine)) {
+        return EngineReceiveIdle;
+    }
+    RingBufferGetAvailableData(&Engine->ReceiveRing, &level);
+    for (;;) {
+        BYTE* span;
+        size_t spanSize;
+        BOOL overflow = FALSE;
+        RingBufferGetWriteSpan(&Engine->ReceiveRing, &span, &spanSize);
+        if (spanSize == 0) {
+            Engine->Stats->overflowEvents++;
+            if (Engine->Overflow.Policy == HtsOverflowBlock && !Engine->Overflow.Expired) {
+                // the rest waits in the socket.
+                break;
+            }
+            span = Engine->OverflowBuffer;
+            spanSize = sizeof(Engine->OverflowBuffer);
+            overflow = TRUE;
+        }
+
+        int result = Engine->Stream ?
+            PlatformStreamRecv(Engine->Stream, (char*)span, (int)spanSize) :
+            recv(Engine->Socket, (char*)span, (int)spanSize, 0);
+        if (result > 0) {
+            if (overflow) {
+                size_t dropped = result;
+                if (Engine->Overflow.Policy == HtsOverflowDropOldest) {
+                    RingBufferWriteOverflow(&Engine->ReceiveRing, span, result,
+                        RingOverflowDropOldest, &dropped);
+                }
+                Engine->Stats->overflowBytes += dropped;
+            }
+            else {
+                RingBufferCommitWrite(&Engine->ReceiveRing, result);
+            }
+            TapCopy(Engine->Taps, span, (ULONG)result);
+            CaptureRecord(Engine->Capture, CAPTURE_RECEIVED, span, (ULONG)result);
+            Engine->Stats->sockRecvData++;
+            Engine->Stats->bytesRead += result;
+            HistogramAdd(Engine->Stats->recvSize, result);
+            *Received += result;
+            if (overflow) {
+                // one chunk, so that the reads get the ring in between.
+                break;
+            }
+            //
+            // the part above the high watermark is what the ring of a port
+            // that does not pause would not have had room for.
+            //
+            size_t above = (level > Engine->Flow.HighWater) ? level : Engine->Flow.HighWater;
+            level += result;
+            if (level > above) {
+                Engine->Stats->flowOverrunBytes += level - above;
+            }
+            if ((size_t)result < spanSize) {
+                //
+                // short read, the socket is most likely empty. If not
+                // the socket is still signalled.
+                //
+                break;
+            }
+            // the span ended at the end of the ring, go on at its base.
+            continue;
+        }
+        if (result == 0) {
+            return EngineReceiveClosed;
+        }
+        UINT32 error = PlatformSocketLastError();
+        if (PlatformSocketWouldBlock(error)) {
+            break;
+        }
+        Engine->LastError = error;
+        return EngineReceiveFailed;
+    }
+    return *Received ? EngineReceiveData : EngineReceiveIdle;
+}
+
+BOOL
+EngineReceiveRingFull(
+    _In_  PNET_ENGINE       Engine
+    )
+{
+    size_t availableSpace;
+    RingBufferGetAvailableSpace(&Engine->ReceiveRing, &availableSpace);
+    return availableSpace == 0;
+}
+
+VOID
+EngineSetWatermarks(
+    _In_  PNET_ENGINE       Engine,
+    _In_  size_t            HighWater,
+    _In_  size_t            LowWater
+    )
+{
+    // the ring keeps a byte free.
+    size_t capacity = Engine->ReceiveRing.Size - 1;
+    if (HighWater == 0 || HighWater > capacity) {
+        HighWater = capacity;
+    }
+    if (LowWater >= HighWater) {
+        LowWater = HighWater - 1;
+    }
+    Engine->Flow.HighWater = HighWater;
+    Engine->Flow.LowWater = LowWater;
+    Engine->Stats->flowHighWater = (DWORD)HighWater;
+    Engine->Stats->flowLowWater = (DWORD)LowWater;
+}
+
+BOOL
+EngineReceiveAllowed(
+    _In_  PNET_ENGINE       Engine
+    )
+{
+    size_t level;
+    RingBufferGetAvailableData(&Engine->ReceiveRing, &level);
+    BOOL held = Engine->Flow.ReceiveHeld;
+    if (Engine->Overflow.Expired && level <= Engine->Flow.LowWater) {
+        Engine->Overflow.Expired = FALSE;
+    }
+    // only a ring that blocks the peer pauses at the high watermark.
+    BOOL blocking = Engine->Overflow.Policy == HtsOverflowBlock && !Engine->Overflow.Expired;
+    if (!Engine->Flow.Paused) {
+        if (held || (blocking && level >= Engine->Flow.HighWater)) {
+            Engine->Flow.Paused = TRUE;
+            Engine->Stats->flowPauses++;
+        }
+    }
+    else if (!held && (!blocking || level <= Engine->Flow.LowWater)) {
+        Engine->Flow.Paused = FALSE;
+        Engine->Stats->flowResumes++;
+    }
+    return !Engine->Flow.Paused;
+}
+
+VOID
+EngineSetOverflow(
+    _In_  PNET_ENGINE       Engine,
+    _In_  ULONG             Policy,
+    _In_  ULONG             TimeoutMs
+    )
+{
+    Engine->Overflow.Policy = Policy;
+    Engine->Overflow.TimeoutMs = TimeoutMs;
+    Engine->Overflow.Expired = FALSE;
+    Engine->Stats->overflowPolicy = Policy;
+    Engine->Stats->overflowTimeoutMs = TimeoutMs;
+}
+
+ULONG
+EngineOverflowTimeout(
+    _In_  PNET_ENGINE       Engine
+    )
+{
+    if (!Engine->Flow.Paused ||
+        Engine->Flow.ReceiveHeld ||
+        Engine->Overflow.Policy != HtsOverflowBlock ||
+        Engine->Overflow.Expired) {
+        return 0;
+    }
+    return Engine->Overflow.TimeoutMs;
+}
+
+VOID
+EngineOverflowTimerExpired(
+    _In_  PNET_ENGINE       Engine
+    )
+{
+    if (EngineOverflowTimeout(Engine) != 0) {
+        Engine->Overflow.Expired = TRUE;
+        Engine->Stats->overflowTimeouts++;
+    }
+}
+
+VOID
+EngineHoldReceive(
+    _In_  PNET_ENGINE       Engine,
+    _In_  BOOL              Hold
+    )
+{
+    Engine->Flow.ReceiveHeld = Hold;
+}
+
+VOID
+EngineSetRts(
+    _In_  PNET_ENGINE       Engine,
+    _In_  BOOL              On
+    )
+{
+    EngineHoldReceive(Engine, !On && Engine->Flow.RtsHandshake);
+}
+
+UINT32
+EngineHoldTransmit(
+    _In_  PNET_ENGINE       Engine,
+    _In_  BOOL              Hold
+    )
+{
+    UINT32 error = NO_ERROR;
+
+    PlatformLockAcquire(&Engine->SendLock);
+    BOOL release = Engine->Flow.TransmitHeld && !Hold;
+    Engine->Flow.TransmitHeld = Hold;
+    if (release && EngineConnected(Engine)) {
+        error = SendBacklog(Engine);
+    }
+    PlatformLockRelease(&Engine->SendLock);
+    return error;
+}
+
+VOID
+EngineStartRead(
+    _In_  PNET_ENGINE       Engine,
+    _In_  PENGINE_READ      Read,
+    _In_  const SERIAL_TIMEOUTS *Timeouts
+    )
+{
+    Engine->CurrentRead = Read;
+    Engine->NumberNeededForRead = Read->Length - Read->Information;
+    Engine->BytesFromLastRead = 0;
+    CalculateReadTimers(Timeouts, Engine->NumberNeededForRead, &Engine->Timers);
+}
+
+static ENGINE_READ_STATUS
+EngineEndRead(
+    _In_  PNET_ENGINE       Engine,
+    _In_  ENGINE_READ_STATUS Status
+    )
+{
+    Engine->CurrentRead = NULL;
+    return Status;
+}
+
+ENGINE_READ_STATUS
+EngineProcessRead(
+    _In_  PNET_ENGINE       Engine
+    )
+{
+    PENGINE_READ read = Engine->CurrentRead;
+    size_t copied = 0;
+
+    Engine->BytesFromLastRead = 0;
+    if (read == NULL) {
+        return EngineReadPending;
+    }
+
+    RingBufferRead(&Engine->ReceiveRing,
+        read->Buffer + read->Information,
+        Engine->NumberNeededForRead,
+        &copied);
+    if (copied == 0) {
+        return EngineReadPending;
+    }
+
+    Engine->NumberNeededForRead -= (ULONG)copied;
+    read->Information += (ULONG)copied;
+    Engine->BytesFromLastRead = (ULONG)copied;
+
+    //
+    // if less than the length was read, the read should respect the read
+    // timers and wait for more data if required.
+    //
+    if (Engine->Timers.returnWithWhatsPresent ||
+        (0 == Engine->NumberNeededForRead) ||
+        (Engine->Timers.os2ssreturn &&
+            read->Information))
+    {
+        return EngineEndRead(Engine, EngineReadSuccess);
+    }
+    return EngineReadPending;
+}
+
+ENGINE_READ_STATUS
+EngineIntervalTimerExpired(
+    _In_  PNET_ENGINE       Engine
+    )
+{
+    //
+    // the interval only counts once the first byte is read.
+    //
+    if (Engine->CurrentRead && Engine->CurrentRead->Information) {
+        return EngineEndRead(Engine, EngineReadCancelled);
+    }
+    return EngineReadPending;
+}
+
+ENGINE_READ_STATUS
+EngineTotalTimerExpired(
+    _In_  PNET_ENGINE       Engine
+    )
+{
+    if (Engine->CurrentRead) {
+        return EngineEndRead(Engine, EngineReadCancelled);
+    }
+    return EngineReadPending;
+}
+
+ENGINE_READ_STATUS
+EngineWaitTimeout(
+    _In_  PNET_ENGINE       Engine,
+    _In_  ULONG             WaitUnits
+    )
+{
+    if (Engine->CurrentRead) {
+        Engine->CurrentRead->WaitTimeouts++;
+        if (Engine->CurrentRead->WaitTimeouts >= WaitUnits) {
+            return EngineEndRead(Engine, EngineReadTimeout);
+        }
+    }
+    return EngineReadPending;
+}
+
+VOID
+EngineAbortRead(
+    _In_  PNET_ENGINE       Engine
+    )
+{
+    Engine->CurrentRead = NULL;
+}
+
+UINT32
+EngineSend(
+    _In_  PNET_ENGINE       Engine,
+    _In_reads_bytes_(Length)
+          const char        *Buffer,
+    _In_  int               Length
+    )
+{
+    int sent = 0;
+    while (sent < Length) {
+        int result = Engine->Stream ?
+            PlatformStreamSend(Engine->Stream, Buffer + sent, Length - sent) :
+            send(Engine->Socket, Buffer + sent, Length - sent, MSG_NOSIGNAL);
+        if (result == SOCKET_ERROR) {
+            UINT32 error = PlatformSocketLastError();
+            if (PlatformSocketWouldBlock(error)) {
+                error = Engine->Stream ?
+                    PlatformStreamWaitWritable(Engine->Stream, ENGINE_SEND_TIMEOUT_MS) :
+                    PlatformSocketWaitWritable(Engine->Socket, ENGINE_SEND_TIMEOUT_MS);
+                if (error == NO_ERROR) {
+                    continue;
+                }
+            }
+            return error;
+        }
+        sent += result;
+        Engine->Stats->bytesWritten += result;
+    }
+    return NO_ERROR;
+}
+
+UINT32
+EngineWrite(
+    _In_  PNET_ENGINE       Engine,
+    _In_reads_bytes_(Length)
+          const char        *Buffer,
+    _In_  int               Length
+    )
+{
+    UINT32 error = NO_ERROR;
+
+    if (Length > 0) {
+        // takes no lock, the time orders it against the receives.
+        CaptureRecord(Engine->Capture, CAPTURE_WRITTEN, (const BYTE*)Buffer, (ULONG)Length);
+    }
+    PlatformLockAcquire(&Engine->SendLock);
+    if (Length > 0) {
+        TapCopy(Engine->Taps, (const BYTE*)Buffer, (ULONG)Length);
+    }
+    BOOL connected = EngineConnected(Engine);
+    if (connected && !Engine->Flow.TransmitHeld) {
+        error = EngineSend(Engine, Buffer, Length);
+    }
+    else if ((connected || Engine->Backlogging) && Length > 0) {
+        size_t space;
+        RingBufferGetAvailableSpace(&Engine->Backlog, &space);
+        size_t kept = ((size_t)Length < space) ? (size_t)Length : space;
+        if (kept != 0) {
+            RingBufferWrite(&Engine->Backlog, (BYTE*)Buffer, kept);
+        }
+        if (Engine->Backlogging) {
+            Engine->Stats->backlogBytes += kept;
+        }
+        else {
+            Engine->Stats->flowHeldBytes += kept;
+        }
+        Engine->Stats->backlogDroppedBytes += Length - kept;
+    }
+    PlatformLockRelease(&Engine->SendLock);
+    return error;
+}
+
+VOID
+EngineSetSpin(
+    _In_  PNET_ENGINE       Engine,
+    _In_  ULONG             MaxUs
+    )
+{
+    if (MaxUs > ENGINE_SPIN_MAX_US) {
+        MaxUs = ENGINE_SPIN_MAX_US;
+    }
+    Engine->Spin.MaxUs = MaxUs;
+    Engine->Stats->spinMaxUs = MaxUs;
+}
+
+VOID
+EngineSpinArrival(
+    _Inout_ PENGINE_SPIN    Spin,
+    _In_  ULONGLONG         WaitedUs
+    )
+{
+    if (WaitedUs <= Spin->MaxUs) {
+        //
+        // a spin of about this long catches the next one. Average over the
+        // last few so a single early arrival does not cut the budget.
+        //
+        LONG delta = (LONG)WaitedUs - (LONG)Spin->GapUs;
+        Spin->GapUs = (ULONG)((LONG)Spin->GapUs + delta / 4);
+        ULONG budget = 2 * Spin->GapUs + ENGINE_SPIN_MIN_US;
+        Spin->BudgetUs = (budget < Spin->MaxUs) ? budget : Spin->MaxUs;
+    }
+    else {
+        //
+        // no spin would have caught it. Spin less, until short arrivals return.
+        //
+        Spin->BudgetUs /= 2;
+        if (Spin->BudgetUs < ENGINE_SPIN_MIN_US) {
+            Spin->BudgetUs = 0;
+        }
+    }
+}
+
+VOID
+EngineSpinWakeLatency(
+    _In_  PNET_ENGINE       Engine,
+    _In_  ULONGLONG         LatencyUs
+    )
+{
+    INT64 delta = (INT64)LatencyUs - (INT64)Engine->Spin.WakeUs;
+    Engine->Spin.WakeUs = (ULONG)((INT64)Engine->Spin.WakeUs + delta / 8);
+    Engine->Stats->wakeLatencyUs = Engine->Spin.WakeUs;
+}
+
+//
+// the end of a wait, a spin hit or a blocked wait that returned.
+//
+static VOID
+EngineWaitEnd(
+    _In_  PNET_ENGINE       Engine,
+    _In_  ULONG             Result,
+    _In_  ULONG             ArrivalSources
+    )
+{
+    PENGINE_SPIN spin = &Engine->Spin;
+    if (spin->MaxUs == 0) {
+        return;
+    }
+    if (Result < 32 && (ArrivalSources & (1UL << Result))) {
+        EngineSpinArrival(spin, PlatformTimeUs() - spin->WaitStartUs);
+    }
+    Engine->Stats->spinBudgetUs = spin->BudgetUs;
+}
+
+ULONG
+EngineWaitPoll(
+    _In_  PNET_ENGINE       Engine,
+    _In_  PPLATFORM_WAITER  Waiter,
+    _Inout_ ULONG*          TimeoutMs,
+    _In_  ULONG             ArrivalSources
+    )
+{
+    PENGINE_SPIN spin = &Engine->Spin;
+    spin->WaitStartUs = PlatformTimeUs();
+    spin->LastWaitBlocked = TRUE;
+    if (spin->MaxUs == 0) {
+        return PLATFORM_WAIT_TIMEOUT;
+    }
+
+    ULONG budget = (spin->BudgetUs < spin->MaxUs) ? spin->BudgetUs : spin->MaxUs;
+    ULONGLONG start = spin->WaitStartUs;
+    ULONGLONG now = start;
+    ULONG result = PLATFORM_WAIT_TIMEOUT;
+    if (budget && *TimeoutMs != 0) {
+        Engine->Stats->spinWaits++;
+        for (;;) {
+            result = PlatformWait(Waiter, 0);
+            now = PlatformTimeUs();
+            if (result != PLATFORM_WAIT_TIMEOUT || now - start >= budget) {
+                break;
+            }
+            PlatformSpinPause();
+        }
+        Engine->Stats->spinUs += now - start;
+    }
+
+    if (result == PLATFORM_WAIT_TIMEOUT) {
+        if (*TimeoutMs != INFINITE) {
+            ULONG spunMs = (ULONG)((now - start) / 1000);
+            *TimeoutMs = (*TimeoutMs > spunMs) ? *TimeoutMs - spunMs : 0;
+        }
+        return PLATFORM_WAIT_TIMEOUT;
+    }
+    Engine->Stats->spinHits++;
+    Engine->Stats->spinSavedUs += spin->WakeUs;
+    spin->LastWaitBlocked = FALSE;
+    EngineWaitEnd(Engine, result, ArrivalSources);
+    return result;
+}
+
+ULONG
+EngineWaitWoken(
+    _In_  PNET_ENGINE       Engine,
+    _In_  PPLATFORM_WAITER  Waiter,
+    _In_  BOOL              TimedOut,
+    _In_  ULONG             ArrivalSources
+    )
+{
+    ULONG result = TimedOut ? PLATFORM_WAIT_TIMEOUT : PlatformWait(Waiter, 0);
+    EngineWaitEnd(Engine, result, ArrivalSources);
+    return result;
+}
+
+ULONG
+EngineWait(
+    _In_  PNET_ENGINE       Engine,
+    _In_  PPLATFORM_WAITER  Waiter,
+    _In_  ULONG             TimeoutMs,
+    _In_  ULONG             ArrivalSources
+    )
+{
+    ULONG result = EngineWaitPoll(Engine, Waiter, &TimeoutMs, ArrivalSources);
+    if (result == PLATFORM_WAIT_TIMEOUT && Engine->Spin.LastWaitBlocked) {
+        result = PlatformWait(Waiter, TimeoutMs);
+        EngineWaitEnd(Engine, result, ArrivalSources);
+    }
+    return result;
+}
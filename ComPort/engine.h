@@ -0,0 +1,507 @@
+/*++
+
+Module Name:
+
+    engine.h
+
+Abstract:
+
+    The receive and transmit engine of a port. It moves bytes between the
+    socket or stream, the receive ring and read buffers and applies the SERIAL_TIMEOUTS
+    rules, without any WDF dependency, so it builds on linux with
+    platform_posix.cpp for tests and benchmarks. network.cpp connects it to
+    the WDF read queue.
+
+--*/
+
+#pragma once
+
+#include "platform.h"
+#include "htsvsp.h"
+#include "serial.h"
+#include "ringbuffer.h"
+#include "tap.h"
+#include "capture.h"
+
+//
+// received data waits here until a read request takes it.
+//
+#define ENGINE_RECEIVE_BUFFER_SIZE  (64 * 1024)
+
+//
+// writes made while a client port reconnects wait here for the new
+// connection, up to this many bytes. Further writes are dropped.
+//
+#define ENGINE_BACKLOG_SIZE         (64 * 1024)
+
+//
+// a receive into a full ring that drops takes up to this many bytes at once.
+//
+#define ENGINE_OVERFLOW_CHUNK       4096
+
+//
+// longest a send waits for the peer to make room.
+//
+#define ENGINE_SEND_TIMEOUT_MS      5000
+
+//
+// longest spin before a blocking wait, and the least a spin is worth.
+//
+#define ENGINE_SPIN_MAX_US          1000
+#define ENGINE_SPIN_MIN_US          5
+
+//
+// the timer settings of one read, from SERIAL_TIMEOUTS and the read length.
+//
+typedef struct _READ_TIMERS
+{
+    BOOL        UseIntervalTimer;
+    ULONG       IntervalMs;
+    BOOL        UseTotalTimer;
+    ULONGLONG   TotalMs;
+    BOOL        returnWithWhatsPresent;
+    BOOL        os2ssreturn;
+    BOOL        crunchDownToOne;
+} READ_TIMERS, *PREAD_TIMERS;
+
+//
+// a read buffer and its progress.
+//
+typedef struct _ENGINE_READ
+{
+    PUCHAR      Buffer;
+    ULONG       Length;
+    ULONG       Information;    // bytes copied to Buffer.
+    ULONG       WaitTimeouts;
+} ENGINE_READ, *PENGINE_READ;
+
+//
+// what to do with the current read.
+//
+typedef enum _ENGINE_READ_STATUS
+{
+    EngineReadPending = 0,      // wait for more data or a timer.
+    EngineReadSuccess,          // complete with STATUS_SUCCESS and Information bytes.
+    EngineReadCancelled,        // a read timer expired, STATUS_CANCELLED and Information bytes.
+    EngineReadTimeout,          // no completion in WaitUnits waits, STATUS_TIMEOUT and no bytes.
+    EngineReadFailed,           // the connection is gone, STATUS_UNSUCCESSFUL and no bytes.
+} ENGINE_READ_STATUS;
+
+typedef enum _ENGINE_RECEIVE_STATUS
+{
+    EngineReceiveData = 0,      // bytes were added to the receive ring.
+    EngineReceiveIdle,          // nothing to receive, or the receive ring is full.
+    EngineReceiveClosed,        // the peer closed the connection.
+    EngineReceiveFailed,        // recv failed with LastError.
+} ENGINE_RECEIVE_STATUS;
+
+//
+// spin-then-block waiting. A wait first polls its sources for BudgetUs, which
+// follows the time arrivals take: twice the average of the waits shorter than
+// MaxUs, halved by every longer one, so an idle port stops spinning.
+//
+typedef struct _ENGINE_SPIN
+{
+    ULONG       MaxUs;          // 0 never spins.
+    ULONG       BudgetUs;
+    ULONG       GapUs;          // average wait for an arrival, of the waits up to MaxUs.
+    ULONG       WakeUs;         // average latency of a blocked wait.
+    BOOL        LastWaitBlocked;
+    ULONGLONG   WaitStartUs;    // of a wait EngineWaitPoll handed over.
+} ENGINE_SPIN, *PENGINE_SPIN;
+
+//
+// receive flow control. The socket is not read while the receive ring holds
+// HighWater bytes or more, until reads take it down to LowWater: the data
+// waits in the socket and tcp closes the receive window of the peer, as an
+// xoff or a dropped rts stops a serial sender. Without a receive handshake
+// HighWater is a full ring.
+//
+typedef struct _ENGINE_FLOW
+{
+    size_t      HighWater;
+    size_t      LowWater;
+    BOOL        Paused;             // receiving stopped, see EngineReceiveAllowed.
+    volatile BOOL ReceiveHeld;      // rts is off under the handshake, receiving stops at any level.
+    BOOL        RtsHandshake;       // a dropped rts holds receiving, see EngineSetRts.
+    BOOL        TransmitHeld;       // writes wait in the backlog for an xon. Under SendLock.
+} ENGINE_FLOW, *PENGINE_FLOW;
+
+//
+// what happens to received data that does not fit in the receive ring, see
+// HTS_VSP_OVERFLOW_POLICY.
+//
+typedef struct _ENGINE_OVERFLOW
+{
+    ULONG       Policy;
+    ULONG       TimeoutMs;          // HtsOverflowBlock, 0 for ever.
+    BOOL        Expired;            // the timeout passed, newest data is dropped until the low watermark.
+} ENGINE_OVERFLOW, *PENGINE_OVERFLOW;
+
+typedef struct _NET_ENGINE
+{
+    SOCKET          Socket;
+
+    PLATFORM_STREAM Stream;             // the transport if it is not a socket, else NULL.
+
+    PHTS_VSP_REPORT Stats;
+
+    PENGINE_READ    CurrentRead;        // NULL when no read is in progress.
+
+    READ_TIMERS     Timers;             // of CurrentRead.
+
+    ULONG           NumberNeededForRead;
+
+    ULONG           BytesFromLastRead;  // copied to CurrentRead by the last EngineProcessRead.
+
+    UINT32          LastError;
+
+    ENGINE_SPIN     Spin;
+
+    RING_BUFFER     ReceiveRing;
+
+    ENGINE_FLOW     Flow;               // of ReceiveRing and the writes.
+
+    ENGINE_OVERFLOW Overflow;           // of ReceiveRing.
+
+    BYTE            OverflowBuffer[ENGINE_OVERFLOW_CHUNK];
+
+    BYTE            ReceiveBuffer[ENGINE_RECEIVE_BUFFER_SIZE];
+
+    PLATFORM_LOCK   SendLock;           // EngineWrite against connection changes.
+
+    BOOL            Backlogging;        // EngineWrite keeps data while disconnected.
+
+    RING_BUFFER     Backlog;
+
+    BYTE            BacklogBuffer[ENGINE_BACKLOG_SIZE];
+
+    PTAP_SET        Taps;               // gets a copy of what is received and written, NULL for none.
+
+    PCAPTURE_LOG    Capture;            // records what is received and written, NULL for none.
+
+} NET_ENGINE, *PNET_ENGINE;
+
+VOID
+CalculateReadTimers(
+    _In_  const SERIAL_TIMEOUTS *Timeouts,
+    _In_  ULONG             Length,
+    _Out_ PREAD_TIMERS      Timers
+    );
+
+VOID
+EngineInitialize(
+    _In_  PNET_ENGINE       Engine,
+    _In_  PHTS_VSP_REPORT   Stats
+    );
+
+//
+// forgets received data, for a new connection.
+//
+VOID
+EngineReset(
+    _In_  PNET_ENGINE       Engine
+    );
+
+//
+// TRUE while there is a socket or a stream.
+//
+BOOL
+EngineConnected(
+    _In_  PNET_ENGINE       Engine
+    );
+
+//
+// closes the socket or the stream, and drops the writes waiting for a
+// reconnect.
+//
+VOID
+EngineClose(
+    _In_  PNET_ENGINE       Engine
+    );
+
+//
+// closes the socket or the stream of a lost connection that is reconnected.
+// EngineWrite keeps the writes until EngineAttach, the receive ring and the
+// current read stay.
+//
+VOID
+EngineDisconnect(
+    _In_  PNET_ENGINE       Engine
+    );
+
+//
+// makes Socket or Stream the connection and sends the writes kept since
+// EngineDisconnect first. Returns the error of that send.
+//
+UINT32
+EngineAttach(
+    _In_  PNET_ENGINE       Engine,
+    _In_  SOCKET            Socket,
+    _In_  PLATFORM_STREAM   Stream
+    );
+
+//
+// adds the socket or the stream to Waiter, signalled when there is data to
+// receive, and stops and restarts waiting on it.
+//
+_Success_(return == NO_ERROR)
+UINT32
+EngineWaiterAdd(
+    _In_  PNET_ENGINE       Engine,
+    _In_  PPLATFORM_WAITER  Waiter
+    );
+
+VOID
+EngineWaiterEnable(
+    _In_  PNET_ENGINE       Engine,
+    _In_  PPLATFORM_WAITER  Waiter,
+    _In_  BOOL              Enable
+    );
+
+//
+// receives from the non-blocking socket or the stream into the receive ring
+// until there is no more data or the ring is full, nothing while receiving is
+// paused. Into a full ring it receives one chunk by the overflow policy. The
+// taps get a copy.
+//
+ENGINE_RECEIVE_STATUS
+EngineReceive(
+    _In_  PNET_ENGINE       Engine,
+    _Out_ ULONG             *Received
+    );
+
+BOOL
+EngineReceiveRingFull(
+    _In_  PNET_ENGINE       Engine
+    );
+
+//
+// sets the receive watermarks, in bytes in the receive ring. A HighWater of 0
+// or above what the ring holds is a full ring, a LowWater from HighWater up is
+// one below it.
+//
+VOID
+EngineSetWatermarks(
+    _In_  PNET_ENGINE       Engine,
+    _In_  size_t            HighWater,
+    _In_  size_t            LowWater
+    );
+
+//
+// FALSE while receiving is paused: from the high watermark until the low
+// watermark, and while the receive is held. The caller stops waiting on the
+// socket while it is paused. Counts the pauses and resumes.
+//
+BOOL
+EngineReceiveAllowed(
+    _In_  PNET_ENGINE       Engine
+    );
+
+//
+// sets the HTS_VSP_OVERFLOW_POLICY of the receive ring. Only HtsOverflowBlock
+// pauses receiving at the high watermark, the others keep receiving and drop.
+//
+VOID
+EngineSetOverflow(
+    _In_  PNET_ENGINE       Engine,
+    _In_  ULONG             Policy,
+    _In_  ULONG             TimeoutMs
+    );
+
+//
+// the time to run the overflow timer for: the timeout of HtsOverflowBlock
+// while receiving is paused by the ring level, else 0.
+//
+ULONG
+EngineOverflowTimeout(
+    _In_  PNET_ENGINE       Engine
+    );
+
+//
+// the overflow timer expired, a blocked receive drops the newest data until
+// reads take the ring down to the low watermark.
+//
+VOID
+EngineOverflowTimerExpired(
+    _In_  PNET_ENGINE       Engine
+    );
+
+//
+// the peer is told to stop sending, or to go on. The thread that receives
+// finds out at its next EngineReceiveAllowed.
+//
+VOID
+EngineHoldReceive(
+    _In_  PNET_ENGINE       Engine,
+    _In_  BOOL              Hold
+    );
+
+//
+// the rts line, as IOCTL_SERIAL_SET_RTS and CLR_RTS drive it. A dropped rts
+// holds receiving only under the rts handshake. Without one it is a line the
+// peer may ignore, kernel32 SetCommState clears it for RTS_CONTROL_DISABLE
+// on any port, and the port goes on receiving.
+//
+VOID
+EngineSetRts(
+    _In_  PNET_ENGINE       Engine,
+    _In_  BOOL              On
+    );
+
+//
+// keeps the writes in the backlog while Hold is set, and sends them when it
+// is cleared. Returns the error of that send.
+//
+UINT32
+EngineHoldTransmit(
+    _In_  PNET_ENGINE       Engine,
+    _In_  BOOL              Hold
+    );
+
+//
+// makes Read the current read. Its timers are in Engine->Timers.
+//
+VOID
+EngineStartRead(
+    _In_  PNET_ENGINE       Engine,
+    _In_  PENGINE_READ      Read,
+    _In_  const SERIAL_TIMEOUTS *Timeouts
+    );
+
+//
+// copies received data to the current read. The Engine* read functions end
+// the current read when they return anything but EngineReadPending.
+//
+ENGINE_READ_STATUS
+EngineProcessRead(
+    _In_  PNET_ENGINE       Engine
+    );
+
+ENGINE_READ_STATUS
+EngineIntervalTimerExpired(
+    _In_  PNET_ENGINE       Engine
+    );
+
+ENGINE_READ_STATUS
+EngineTotalTimerExpired(
+    _In_  PNET_ENGINE       Engine
+    );
+
+//
+// a wait without read timers timed out.
+//
+ENGINE_READ_STATUS
+EngineWaitTimeout(
+    _In_  PNET_ENGINE       Engine,
+    _In_  ULONG             WaitUnits
+    );
+
+//
+// ends the current read, the connection is gone or the read was cancelled.
+//
+VOID
+EngineAbortRead(
+    _In_  PNET_ENGINE       Engine
+    );
+
+//
+// sets the spin limit, 0 turns spinning off. Limits above ENGINE_SPIN_MAX_US
+// are reduced to it.
+//
+VOID
+EngineSetSpin(
+    _In_  PNET_ENGINE       Engine,
+    _In_  ULONG             MaxUs
+    );
+
+//
+// waits like PlatformWait, spinning first when the budget allows. A source
+// with its bit set in ArrivalSources brings data or work, the time it took
+// adapts the budget.
+//
+ULONG
+EngineWait(
+    _In_  PNET_ENGINE       Engine,
+    _In_  PPLATFORM_WAITER  Waiter,
+    _In_  ULONG             TimeoutMs,
+    _In_  ULONG             ArrivalSources
+    );
+
+//
+// EngineWait in two halves, for a loop that does not block in its wait but
+// hands the waiter to the worker pool. EngineWaitPoll spins like EngineWait
+// and returns PLATFORM_WAIT_TIMEOUT when the caller is to block, for
+// *TimeoutMs, what the spin left of it. EngineWaitWoken then ends the wait,
+// TimedOut if its timeout passed.
+//
+ULONG
+EngineWaitPoll(
+    _In_  PNET_ENGINE       Engine,
+    _In_  PPLATFORM_WAITER  Waiter,
+    _Inout_ ULONG*          TimeoutMs,
+    _In_  ULONG             ArrivalSources
+    );
+
+ULONG
+EngineWaitWoken(
+    _In_  PNET_ENGINE       Engine,
+    _In_  PPLATFORM_WAITER  Waiter,
+    _In_  BOOL              TimedOut,
+    _In_  ULONG             ArrivalSources
+    );
+
+//
+// adapts the budget to an arrival WaitedUs after the wait started.
+//
+VOID
+EngineSpinArrival(
+    _Inout_ PENGINE_SPIN    Spin,
+    _In_  ULONGLONG         WaitedUs
+    );
+
+//
+// a sample of the latency from signalling a source to the return of a
+// blocked wait. It is what a spin hit saves.
+//
+VOID
+EngineSpinWakeLatency(
+    _In_  PNET_ENGINE       Engine,
+    _In_  ULONGLONG         LatencyUs
+    );
+
+//
+// sends all of Buffer, waiting for the peer when the socket buffer is full.
+// returns NO_ERROR or the socket error.
+//
+UINT32
+EngineSend(
+    _In_  PNET_ENGINE       Engine,
+    _In_reads_bytes_(Length)
+          const char        *Buffer,
+    _In_  int               Length
+    );
+
+//
+// sends Buffer like EngineSend when connected, keeps it between
+// EngineDisconnect and EngineAttach and while the transmit is held, and drops
+// it otherwise. Safe against the
+// connection changes of another thread.
+// The taps get a copy either way.
+//
+UINT32
+EngineWrite(
+    _In_  PNET_ENGINE       Engine,
+    _In_reads_bytes_(Length)
+          const char        *Buffer,
+    _In_  int               Length
+    );
+
+//
+// add one sample to a power of two histogram. see HTS_VSP_HISTOGRAM_BUCKETS.
+//
+VOID
+HistogramAdd(
+    _Inout_ INT64           *Buckets,
+    _In_  ULONGLONG         Value
+    );
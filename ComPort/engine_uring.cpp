@@ -0,0 +1,820 @@
+/*++
+
+Module Name:
+
+    engine_uring.cpp
+
+Abstract:
+
+    The io_uring backend of the engine, see engine_uring.h. It talks to the
+    kernel directly, the rings are mapped and driven here without liburing.
+
+--*/
+
+#include "engine_uring.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES           64
+
+#define URING_BUFFER_GROUP      0
+
+//
+// what a completion belongs to, in the low byte of its user_data. The
+// timers put their generation above it, the sends their slot.
+//
+typedef enum _URING_TAG {
+    UringTagIgnore = 0,
+    UringTagRecv,
+    UringTagSend,
+    UringTagIntervalTimer,
+    UringTagTotalTimer,
+} URING_TAG;
+
+//
+// what happened since the events were last taken, or-ed together.
+//
+#define URING_EVENT_DATA            0x01
+#define URING_EVENT_INTERVAL_TIMER  0x02
+#define URING_EVENT_TOTAL_TIMER     0x04
+#define URING_EVENT_CLOSED          0x08
+#define URING_EVENT_FAILED          0x10
+#define URING_EVENT_SENT            0x20    // a send chain completed.
+
+#define URING_READ_EVENTS           (URING_EVENT_DATA | URING_EVENT_INTERVAL_TIMER | \
+                                     URING_EVENT_TOTAL_TIMER | URING_EVENT_CLOSED | URING_EVENT_FAILED)
+
+typedef struct _URING_TIMER {
+    URING_TAG               Tag;
+    BOOL                    Armed;
+    ULONGLONG               Generation;
+    struct __kernel_timespec Due;   // read by the kernel when the SQE is submitted.
+} URING_TIMER;
+
+typedef struct _URING_SEND_SLOT {
+    ULONG                   Length;
+    ULONG                   Offset;     // bytes on the socket.
+    BOOL                    InFlight;
+    char                    Data[URING_ENGINE_SEND_SLOT_SIZE];
+} URING_SEND_SLOT;
+
+//
+// a completed recv whose data is not in the receive ring yet.
+//
+typedef struct _URING_PENDING_RECV {
+    USHORT                  BufferId;
+    ULONG                   Offset;
+    ULONG                   Length;
+} URING_PENDING_RECV;
+
+struct _URING_ENGINE {
+    PNET_ENGINE             Engine;
+    int                     RingFd;
+    ULONG                   Flags;
+
+    //
+    // the mapped rings.
+    //
+    PVOID                   SqRing;     // and the CQ ring, see IORING_FEAT_SINGLE_MMAP.
+    size_t                  SqRingSize;
+    struct io_uring_sqe*    Sqes;
+    size_t                  SqesSize;
+    unsigned*               SqHead;
+    unsigned*               SqTail;
+    unsigned*               SqFlags;
+    unsigned                SqMask;
+    unsigned                SqEntries;
+    unsigned*               CqHead;
+    unsigned*               CqTail;
+    unsigned                CqMask;
+    struct io_uring_cqe*    Cqes;
+    unsigned                Unsubmitted;
+
+    //
+    // provided buffers.
+    //
+    struct io_uring_buf_ring* BufferRing;
+    size_t                  BufferRingSize;
+    BYTE*                   Buffers;
+    BOOL                    RecvArmed;
+    URING_PENDING_RECV      Pending[URING_ENGINE_BUFFERS];
+    ULONG                   PendingHead;
+    ULONG                   PendingCount;
+
+    //
+    // the outbound queue, a fifo of slots. Only one chain is in flight, a
+    // second one could overtake it.
+    //
+    URING_SEND_SLOT*        SendSlots;
+    ULONG                   SendHead;
+    ULONG                   SendCount;
+    ULONG                   ChainInFlight;
+
+    URING_TIMER             IntervalTimer;
+    URING_TIMER             TotalTimer;
+
+    ULONG                   Events;
+    BOOL                    Closed;
+    BOOL                    Failed;
+    UINT32                  SendError;
+    ULONGLONG               Enters;
+};
+
+static int UringSetup(unsigned Entries, struct io_uring_params* Params)
+{
+    return (int)syscall(__NR_io_uring_setup, Entries, Params);
+}
+
+static int UringRegister(int Fd, unsigned Opcode, PVOID Arg, unsigned Count)
+{
+    return (int)syscall(__NR_io_uring_register, Fd, Opcode, Arg, Count);
+}
+
+static int UringEnter(PURING_ENGINE Uring, unsigned ToSubmit, unsigned MinComplete,
+    unsigned Flags, struct io_uring_getevents_arg* Arg)
+{
+    Uring->Enters++;
+    return (int)syscall(__NR_io_uring_enter, Uring->RingFd, ToSubmit, MinComplete,
+        Flags, Arg, Arg ? sizeof(*Arg) : 0);
+}
+
+static inline ULONG_PTR UringUserData(URING_TAG Tag, ULONGLONG Value)
+{
+    return (ULONG_PTR)Tag | (ULONG_PTR)(Value << 8);
+}
+
+//
+// makes room for Count SQEs, submitting the queued ones if the ring is full.
+// A link chain must go in one submission, the kernel ends it at the last SQE.
+//
+static VOID UringReserve(PURING_ENGINE Uring, unsigned Count)
+{
+    unsigned tail = *Uring->SqTail;
+    while ((Uring->SqEntries - (tail - __atomic_load_n(Uring->SqHead, __ATOMIC_ACQUIRE))) < Count) {
+        int result = UringEnter(Uring, Uring->Unsubmitted, 0, 0, NULL);
+        if (result > 0) {
+            Uring->Unsubmitted -= result;
+        }
+    }
+}
+
+static struct io_uring_sqe* UringGetSqe(PURING_ENGINE Uring)
+{
+    UringReserve(Uring, 1);
+    struct io_uring_sqe* sqe = &Uring->Sqes[*Uring->SqTail & Uring->SqMask];
+    RtlZeroMemory(sqe, sizeof(*sqe));
+    return sqe;
+}
+
+static VOID UringQueueSqe(PURING_ENGINE Uring)
+{
+    __atomic_store_n(Uring->SqTail, *Uring->SqTail + 1, __ATOMIC_RELEASE);
+    Uring->Unsubmitted++;
+}
+
+//
+// hands a provided buffer back to the kernel.
+//
+static VOID UringRecycleBuffer(PURING_ENGINE Uring, USHORT BufferId)
+{
+    struct io_uring_buf_ring* ring = Uring->BufferRing;
+    USHORT tail = ring->tail;
+    //
+    // not ring->bufs, in c++ the empty struct of __DECLARE_FLEX_ARRAY moves
+    // it off the start of the ring.
+    //
+    struct io_uring_buf* buffer = (struct io_uring_buf*)ring + (tail & (URING_ENGINE_BUFFERS - 1));
+    buffer->addr = (ULONG_PTR)(Uring->Buffers + (size_t)BufferId * URING_ENGINE_BUFFER_SIZE);
+    buffer->len = URING_ENGINE_BUFFER_SIZE;
+    buffer->bid = BufferId;
+    __atomic_store_n(&ring->tail, (USHORT)(tail + 1), __ATOMIC_RELEASE);
+}
+
+//
+// moves completed recv data to the receive ring while it has space, below the
+// high watermark if it blocks the peer. The pending buffers hold the rest
+// while receiving is paused, the other overflow policies drop it.
+//
+static VOID UringDrainPending(PURING_ENGINE Uring)
+{
+    PNET_ENGINE engine = Uring->Engine;
+    PRING_BUFFER ring = &engine->ReceiveRing;
+    while (Uring->PendingCount) {
+        URING_PENDING_RECV* pending = &Uring->Pending[Uring->PendingHead];
+        if (!EngineReceiveAllowed(engine)) {
+            return;
+        }
+        BYTE* data = Uring->Buffers + (size_t)pending->BufferId * URING_ENGINE_BUFFER_SIZE + pending->Offset;
+        ULONG length = pending->Length - pending->Offset;
+        size_t space;
+        RingBufferGetAvailableSpace(ring, &space);
+        if (engine->Overflow.Policy == HtsOverflowBlock && !engine->Overflow.Expired) {
+            size_t level;
+            RingBufferGetAvailableData(ring, &level);
+            size_t below = (level < engine->Flow.HighWater) ? engine->Flow.HighWater - level : 0;
+            if (space > below) {
+                space = below;
+            }
+            if (space == 0) {
+                return;
+            }
+        }
+        if (length <= space) {
+            RingBufferWrite(ring, data, length);
+        }
+        else if (space != 0 && engine->Overflow.Policy != HtsOverflowDropOldest) {
+            // what fits now, the rest at the next drain.
+            length = (ULONG)space;
+            RingBufferWrite(ring, data, length);
+        }
+        else {
+            size_t dropped;
+            RingBufferWriteOverflow(ring, data, length,
+                (engine->Overflow.Policy == HtsOverflowDropOldest) ? RingOverflowDropOldest : RingOverflowDropNewest,
+                &dropped);
+            engine->Stats->overflowEvents++;
+            engine->Stats->overflowBytes += dropped;
+        }
+        Uring->Events |= URING_EVENT_DATA;
+        pending->Offset += length;
+        if (pending->Offset < pending->Length) {
+            return;
+        }
+        UringRecycleBuffer(Uring, pending->BufferId);
+        Uring->PendingHead = (Uring->PendingHead + 1) % URING_ENGINE_BUFFERS;
+        Uring->PendingCount--;
+    }
+}
+
+static VOID UringRecvComplete(PURING_ENGINE Uring, struct io_uring_cqe* Cqe)
+{
+    PNET_ENGINE engine = Uring->Engine;
+
+    if (!(Cqe->flags & IORING_CQE_F_MORE)) {
+        Uring->RecvArmed = FALSE;
+    }
+    if (Cqe->res > 0) {
+        ASSERT(Cqe->flags & IORING_CQE_F_BUFFER);
+        URING_PENDING_RECV* pending = &Uring->Pending[
+            (Uring->PendingHead + Uring->PendingCount) % URING_ENGINE_BUFFERS];
+        pending->BufferId = (USHORT)(Cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        pending->Offset = 0;
+        pending->Length = Cqe->res;
+        Uring->PendingCount++;
+        engine->Stats->sockRecvData++;
+        engine->Stats->bytesRead += Cqe->res;
+        HistogramAdd(engine->Stats->recvSize, Cqe->res);
+        UringDrainPending(Uring);
+    }
+    else if (Cqe->res == 0) {
+        Uring->Closed = TRUE;
+        Uring->Events |= URING_EVENT_CLOSED;
+    }
+    else if (Cqe->res != -ENOBUFS) {
+        //
+        // out of buffers only stops the multishot recv, it is armed again
+        // once the receive ring took some.
+        //
+        engine->LastError = -Cqe->res;
+        Uring->Failed = TRUE;
+        Uring->Events |= URING_EVENT_FAILED;
+    }
+}
+
+static VOID UringSendComplete(PURING_ENGINE Uring, struct io_uring_cqe* Cqe, ULONG Slot)
+{
+    URING_SEND_SLOT* slot = &Uring->SendSlots[Slot];
+
+    slot->InFlight = FALSE;
+    Uring->ChainInFlight--;
+    if (Cqe->res > 0) {
+        slot->Offset += Cqe->res;
+        Uring->Engine->Stats->bytesWritten += Cqe->res;
+    }
+    else if ((Cqe->res != -ECANCELED) && (Uring->SendError == NO_ERROR)) {
+        //
+        // cancelled sends follow a short or failed one in the chain, they
+        // go again with the next chain.
+        //
+        Uring->SendError = -Cqe->res;
+    }
+    if (Uring->ChainInFlight == 0) {
+        Uring->Events |= URING_EVENT_SENT;
+        while (Uring->SendCount &&
+            (Uring->SendSlots[Uring->SendHead].Offset == Uring->SendSlots[Uring->SendHead].Length)) {
+            Uring->SendHead = (Uring->SendHead + 1) % URING_ENGINE_SEND_SLOTS;
+            Uring->SendCount--;
+        }
+    }
+}
+
+static VOID UringTimerComplete(PURING_ENGINE Uring, struct io_uring_cqe* Cqe,
+    URING_TIMER* Timer, ULONG Event)
+{
+    //
+    // a stopped or restarted timer has a new generation.
+    //
+    if ((Cqe->user_data >> 8) != Timer->Generation) {
+        return;
+    }
+    Timer->Armed = FALSE;
+    if (Cqe->res == -ETIME) {
+        Uring->Events |= Event;
+    }
+}
+
+//
+// handles the posted completions, no system call.
+//
+static VOID UringReap(PURING_ENGINE Uring)
+{
+    unsigned head = *Uring->CqHead;
+    unsigned tail = __atomic_load_n(Uring->CqTail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe* cqe = &Uring->Cqes[head & Uring->CqMask];
+        switch ((URING_TAG)(cqe->user_data & 0xff)) {
+        case UringTagRecv:
+            UringRecvComplete(Uring, cqe);
+            break;
+        case UringTagSend:
+            UringSendComplete(Uring, cqe, (ULONG)(cqe->user_data >> 8));
+            break;
+        case UringTagIntervalTimer:
+            UringTimerComplete(Uring, cqe, &Uring->IntervalTimer, URING_EVENT_INTERVAL_TIMER);
+            break;
+        case UringTagTotalTimer:
+            UringTimerComplete(Uring, cqe, &Uring->TotalTimer, URING_EVENT_TOTAL_TIMER);
+            break;
+        default:
+            break;
+        }
+    }
+    __atomic_store_n(Uring->CqHead, head, __ATOMIC_RELEASE);
+}
+
+//
+// queues the SQEs the state asks for: the recv when it ended and there
+// are buffers again, and a chain for the sends not on the socket yet.
+//
+static VOID UringPrepare(PURING_ENGINE Uring)
+{
+    if (!Uring->RecvArmed && !Uring->Closed && !Uring->Failed &&
+        (Uring->PendingCount < URING_ENGINE_BUFFERS)) {
+        struct io_uring_sqe* sqe = UringGetSqe(Uring);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = Uring->Engine->Socket;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = UringUserData(UringTagRecv, 0);
+        UringQueueSqe(Uring);
+        Uring->RecvArmed = TRUE;
+    }
+
+    if ((Uring->ChainInFlight == 0) && Uring->SendCount && (Uring->SendError == NO_ERROR)) {
+        struct io_uring_sqe* last = NULL;
+        UringReserve(Uring, Uring->SendCount);
+        for (ULONG i = 0; i < Uring->SendCount; i++) {
+            ULONG index = (Uring->SendHead + i) % URING_ENGINE_SEND_SLOTS;
+            URING_SEND_SLOT* slot = &Uring->SendSlots[index];
+            if (slot->Offset == slot->Length) {
+                continue;
+            }
+            if (last) {
+                last->flags |= IOSQE_IO_LINK;
+            }
+            struct io_uring_sqe* sqe = UringGetSqe(Uring);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = Uring->Engine->Socket;
+            sqe->addr = (ULONG_PTR)(slot->Data + slot->Offset);
+            sqe->len = slot->Length - slot->Offset;
+            //
+            // a short send fails the link, so nothing behind it goes first.
+            //
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = UringUserData(UringTagSend, index);
+            UringQueueSqe(Uring);
+            slot->InFlight = TRUE;
+            Uring->ChainInFlight++;
+            last = sqe;
+        }
+    }
+}
+
+//
+// submits what is queued and waits up to TimeoutMs for one of the Wanted
+// events, unless one is already there. Events accumulate in Uring->Events.
+//
+static VOID UringPump(PURING_ENGINE Uring, ULONG TimeoutMs, ULONG Wanted)
+{
+    UringReap(Uring);
+    UringDrainPending(Uring);
+    UringPrepare(Uring);
+
+    BOOL sqpoll = (Uring->Flags & URING_ENGINE_SQPOLL) != 0;
+    unsigned flags = 0;
+    unsigned toSubmit = Uring->Unsubmitted;
+    if (sqpoll) {
+        //
+        // the kernel thread takes the SQEs, unless it went to sleep.
+        //
+        toSubmit = 0;
+        Uring->Unsubmitted = 0;
+        if (__atomic_load_n(Uring->SqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP) {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+    }
+
+    if ((Uring->Events & Wanted) || (TimeoutMs == 0)) {
+        if (toSubmit || flags) {
+            int result = UringEnter(Uring, toSubmit, 0, flags, NULL);
+            if (result > 0 && !sqpoll) {
+                Uring->Unsubmitted -= result;
+            }
+            UringReap(Uring);
+        }
+        return;
+    }
+
+    struct __kernel_timespec timeout = { };
+    struct io_uring_getevents_arg arg = { };
+    if (TimeoutMs != INFINITE) {
+        timeout.tv_sec = TimeoutMs / 1000;
+        timeout.tv_nsec = (long long)(TimeoutMs % 1000) * 1000000;
+        arg.ts = (ULONG_PTR)&timeout;
+    }
+
+    //
+    // there may be completions that are not wanted, a send or a stale
+    // timer, so wait again until a wanted event or the timeout.
+    //
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        int result = UringEnter(Uring, toSubmit, 1,
+            flags | IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg);
+        if (result > 0 && !sqpoll) {
+            Uring->Unsubmitted -= result;
+        }
+        toSubmit = Uring->Unsubmitted;
+        flags &= ~IORING_ENTER_SQ_WAKEUP;
+        UringReap(Uring);
+        if (result < 0 && errno != EINTR && errno != ETIME && errno != EBUSY) {
+            Uring->Engine->LastError = errno;
+            Uring->Failed = TRUE;
+            Uring->Events |= URING_EVENT_FAILED;
+        }
+        if ((Uring->Events & Wanted) || (result < 0 && errno == ETIME)) {
+            return;
+        }
+        UringPrepare(Uring);
+        toSubmit = Uring->Unsubmitted;
+        if (TimeoutMs != INFINITE) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long elapsedMs = (now.tv_sec - start.tv_sec) * 1000LL +
+                (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (elapsedMs >= TimeoutMs) {
+                return;
+            }
+            timeout.tv_sec = (TimeoutMs - elapsedMs) / 1000;
+            timeout.tv_nsec = ((TimeoutMs - elapsedMs) % 1000) * 1000000;
+        }
+    }
+}
+
+static VOID UringTimerStart(PURING_ENGINE Uring, URING_TIMER* Timer, ULONGLONG DueMs, BOOL Arm)
+{
+    if (Timer->Armed) {
+        struct io_uring_sqe* sqe = UringGetSqe(Uring);
+        sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+        sqe->addr = UringUserData(Timer->Tag, Timer->Generation);
+        sqe->user_data = UringUserData(UringTagIgnore, 0);
+        UringQueueSqe(Uring);
+        Timer->Armed = FALSE;
+    }
+    Timer->Generation++;
+    if (!Arm) {
+        return;
+    }
+    Timer->Due.tv_sec = DueMs / 1000;
+    Timer->Due.tv_nsec = (DueMs % 1000) * 1000000;
+    struct io_uring_sqe* sqe = UringGetSqe(Uring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (ULONG_PTR)&Timer->Due;
+    sqe->len = 1;
+    sqe->user_data = UringUserData(Timer->Tag, Timer->Generation);
+    UringQueueSqe(Uring);
+    Timer->Armed = TRUE;
+}
+
+static VOID UringTimersStop(PURING_ENGINE Uring)
+{
+    UringTimerStart(Uring, &Uring->IntervalTimer, 0, FALSE);
+    UringTimerStart(Uring, &Uring->TotalTimer, 0, FALSE);
+    Uring->Events &= ~(URING_EVENT_INTERVAL_TIMER | URING_EVENT_TOTAL_TIMER);
+}
+
+UINT32
+UringEngineCreate(
+    _In_  PNET_ENGINE       Engine,
+    _In_  ULONG             Flags,
+    _Out_ PURING_ENGINE     *Uring
+    )
+{
+    struct io_uring_params params = { };
+    struct io_uring_buf_reg bufferReg = { };
+    PURING_ENGINE uring = NULL;
+    UINT32 error = NO_ERROR;
+    size_t cqRingSize;
+    BYTE* sq;
+    BYTE* cq;
+
+    *Uring = NULL;
+    uring = (PURING_ENGINE)calloc(1, sizeof(*uring));
+    if (uring == NULL) {
+        return ENOMEM;
+    }
+    uring->Engine = Engine;
+    uring->Flags = Flags;
+    uring->RingFd = -1;
+    uring->SqRing = MAP_FAILED;
+    uring->Sqes = (struct io_uring_sqe*)MAP_FAILED;
+    uring->BufferRing = (struct io_uring_buf_ring*)MAP_FAILED;
+    uring->IntervalTimer.Tag = UringTagIntervalTimer;
+    uring->TotalTimer.Tag = UringTagTotalTimer;
+
+    if (Flags & URING_ENGINE_SQPOLL) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 100;
+    }
+    uring->RingFd = UringSetup(URING_ENTRIES, &params);
+    if (uring->RingFd < 0) {
+        error = errno;
+        goto Exit;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_EXT_ARG)) {
+        // older than 5.11.
+        error = ENOSYS;
+        goto Exit;
+    }
+
+    uring->SqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cqRingSize > uring->SqRingSize) {
+        uring->SqRingSize = cqRingSize;
+    }
+    uring->SqRing = mmap(NULL, uring->SqRingSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, uring->RingFd, IORING_OFF_SQ_RING);
+    if (uring->SqRing == MAP_FAILED) {
+        error = errno;
+        goto Exit;
+    }
+    uring->SqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->Sqes = (struct io_uring_sqe*)mmap(NULL, uring->SqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, uring->RingFd, IORING_OFF_SQES);
+    if (uring->Sqes == MAP_FAILED) {
+        error = errno;
+        goto Exit;
+    }
+
+    sq = (BYTE*)uring->SqRing;
+    cq = sq;
+    uring->SqHead = (unsigned*)(sq + params.sq_off.head);
+    uring->SqTail = (unsigned*)(sq + params.sq_off.tail);
+    uring->SqFlags = (unsigned*)(sq + params.sq_off.flags);
+    uring->SqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    uring->SqEntries = params.sq_entries;
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        ((unsigned*)(sq + params.sq_off.array))[i] = i;
+    }
+    uring->CqHead = (unsigned*)(cq + params.cq_off.head);
+    uring->CqTail = (unsigned*)(cq + params.cq_off.tail);
+    uring->CqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    uring->Cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    //
+    // the provided buffer ring and its buffers.
+    //
+    uring->BufferRingSize = URING_ENGINE_BUFFERS * sizeof(struct io_uring_buf);
+    uring->BufferRing = (struct io_uring_buf_ring*)mmap(NULL, uring->BufferRingSize,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring->BufferRing == MAP_FAILED) {
+        error = errno;
+        goto Exit;
+    }
+    bufferReg.ring_addr = (ULONG_PTR)uring->BufferRing;
+    bufferReg.ring_entries = URING_ENGINE_BUFFERS;
+    bufferReg.bgid = URING_BUFFER_GROUP;
+    if (UringRegister(uring->RingFd, IORING_REGISTER_PBUF_RING, &bufferReg, 1) != 0) {
+        // older than 5.19.
+        error = errno;
+        goto Exit;
+    }
+    uring->Buffers = (BYTE*)malloc((size_t)URING_ENGINE_BUFFERS * URING_ENGINE_BUFFER_SIZE);
+    uring->SendSlots = (URING_SEND_SLOT*)calloc(URING_ENGINE_SEND_SLOTS, sizeof(URING_SEND_SLOT));
+    if (uring->Buffers == NULL || uring->SendSlots == NULL) {
+        error = ENOMEM;
+        goto Exit;
+    }
+    for (USHORT i = 0; i < URING_ENGINE_BUFFERS; i++) {
+        UringRecycleBuffer(uring, i);
+    }
+
+    {
+        int flags = fcntl(Engine->Socket, F_GETFL, 0);
+        if ((flags == -1) || (fcntl(Engine->Socket, F_SETFL, flags & ~O_NONBLOCK) != 0)) {
+            error = errno;
+            goto Exit;
+        }
+    }
+
+    *Uring = uring;
+    uring = NULL;
+
+Exit:
+    if (uring) {
+        UringEngineClose(uring);
+    }
+    return error;
+}
+
+VOID
+UringEngineClose(
+    _In_  PURING_ENGINE     Uring
+    )
+{
+    if (Uring == NULL) {
+        return;
+    }
+    if (Uring->RingFd >= 0) {
+        close(Uring->RingFd);
+    }
+    if (Uring->SqRing != MAP_FAILED) {
+        munmap(Uring->SqRing, Uring->SqRingSize);
+    }
+    if (Uring->Sqes != MAP_FAILED) {
+        munmap(Uring->Sqes, Uring->SqesSize);
+    }
+    if (Uring->BufferRing != MAP_FAILED) {
+        munmap(Uring->BufferRing, Uring->BufferRingSize);
+    }
+    free(Uring->Buffers);
+    free(Uring->SendSlots);
+    free(Uring);
+}
+
+VOID
+UringEngineStartRead(
+    _In_  PURING_ENGINE     Uring,
+    _In_  PENGINE_READ      Read,
+    _In_  const SERIAL_TIMEOUTS *Timeouts
+    )
+{
+    PNET_ENGINE engine = Uring->Engine;
+
+    EngineStartRead(engine, Read, Timeouts);
+    UringTimersStop(Uring);
+    if (engine->Timers.UseTotalTimer) {
+        UringTimerStart(Uring, &Uring->TotalTimer, engine->Timers.TotalMs, TRUE);
+    }
+}
+
+ENGINE_READ_STATUS
+UringEngineWaitRead(
+    _In_  PURING_ENGINE     Uring,
+    _In_  ULONG             WaitUnits
+    )
+{
+    PNET_ENGINE engine = Uring->Engine;
+    BOOL timedOut = FALSE;
+
+    for (;;) {
+        ULONG events = Uring->Events & URING_READ_EVENTS;
+        Uring->Events &= ~URING_READ_EVENTS;
+
+        ENGINE_READ_STATUS status = EngineProcessRead(engine);
+        if (engine->BytesFromLastRead && engine->Timers.UseIntervalTimer) {
+            // the interval restarts with every byte.
+            UringTimerStart(Uring, &Uring->IntervalTimer, engine->Timers.IntervalMs, TRUE);
+        }
+        else if ((status == EngineReadPending) && (events & URING_EVENT_INTERVAL_TIMER)) {
+            status = EngineIntervalTimerExpired(engine);
+        }
+        if ((status == EngineReadPending) && (events & URING_EVENT_TOTAL_TIMER)) {
+            status = EngineTotalTimerExpired(engine);
+        }
+        if ((status == EngineReadPending) && timedOut) {
+            status = EngineWaitTimeout(engine, WaitUnits);
+        }
+        if ((status == EngineReadPending) && engine->CurrentRead &&
+            (Uring->Closed || Uring->Failed) && (Uring->PendingCount == 0)) {
+            // the read still got what was received before the close.
+            EngineAbortRead(engine);
+            status = EngineReadFailed;
+        }
+        if (status != EngineReadPending || engine->CurrentRead == NULL) {
+            UringTimersStop(Uring);
+            return status;
+        }
+
+        ULONG timeout = INFINITE;
+        if (!engine->Timers.UseIntervalTimer && !engine->Timers.UseTotalTimer) {
+            timeout = 500;
+        }
+        UringPump(Uring, timeout, URING_READ_EVENTS);
+        timedOut = !(Uring->Events & URING_READ_EVENTS);
+    }
+}
+
+UINT32
+UringEngineSend(
+    _In_  PURING_ENGINE     Uring,
+    _In_reads_bytes_(Length)
+          const char        *Buffer,
+    _In_  int               Length
+    )
+{
+    while (Length > 0) {
+        if (Uring->SendError != NO_ERROR) {
+            return Uring->SendError;
+        }
+        URING_SEND_SLOT* slot = NULL;
+        if (Uring->SendCount) {
+            //
+            // add to the last slot while it is not submitted.
+            //
+            slot = &Uring->SendSlots[(Uring->SendHead + Uring->SendCount - 1) % URING_ENGINE_SEND_SLOTS];
+            if (slot->InFlight || slot->Offset || (slot->Length == URING_ENGINE_SEND_SLOT_SIZE)) {
+                slot = NULL;
+            }
+        }
+        if (slot == NULL) {
+            if (Uring->SendCount == URING_ENGINE_SEND_SLOTS) {
+                //
+                // wait for the chain in flight.
+                //
+                Uring->Events &= ~URING_EVENT_SENT;
+                UringPump(Uring, INFINITE, URING_EVENT_SENT | URING_EVENT_FAILED);
+                continue;
+            }
+            slot = &Uring->SendSlots[(Uring->SendHead + Uring->SendCount) % URING_ENGINE_SEND_SLOTS];
+            slot->Length = 0;
+            slot->Offset = 0;
+            slot->InFlight = FALSE;
+            Uring->SendCount++;
+        }
+        ULONG copy = URING_ENGINE_SEND_SLOT_SIZE - slot->Length;
+        if (copy > (ULONG)Length) {
+            copy = Length;
+        }
+        RtlCopyMemory(slot->Data + slot->Length, Buffer, copy);
+        slot->Length += copy;
+        Buffer += copy;
+        Length -= copy;
+    }
+    return NO_ERROR;
+}
+
+UINT32
+UringEngineFlush(
+    _In_  PURING_ENGINE     Uring,
+    _In_  ULONG             TimeoutMs
+    )
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (Uring->SendCount && (Uring->SendError == NO_ERROR) && !Uring->Failed) {
+        ULONG wait = 100;
+        if (TimeoutMs != INFINITE) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long elapsedMs = (now.tv_sec - start.tv_sec) * 1000LL +
+                (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (elapsedMs >= TimeoutMs) {
+                return ETIMEDOUT;
+            }
+        }
+        Uring->Events &= ~URING_EVENT_SENT;
+        UringPump(Uring, wait, URING_EVENT_SENT | URING_EVENT_FAILED);
+    }
+    if (Uring->SendError != NO_ERROR) {
+        return Uring->SendError;
+    }
+    return Uring->Failed ? Uring->Engine->LastError : NO_ERROR;
+}
+
+ULONGLONG
+UringEngineEnterCount(
+    _In_  PURING_ENGINE     Uring
+    )
+{
+    return Uring->Enters;
+}
@@ -0,0 +1,119 @@
+/*++
+
+Module Name:
+
+    engine_uring.h
+
+Abstract:
+
+    An io_uring backend for the engine, linux only. It replaces the epoll
+    waiter and the recv/send calls of engine.cpp with completions:
+
+    - a multishot recv with a provided buffer ring feeds the receive ring.
+    - queued sends go out as one chain of linked send SQEs, so they stay
+      in order without waiting for each other.
+    - the read interval and total timers are timeout SQEs.
+
+    Received data, the read rules and the statistics are those of the
+    NET_ENGINE the backend drives. Once a port is busy a wait finds its
+    completions already posted and costs no system call, and sends go out
+    with the next wait.
+
+--*/
+
+#pragma once
+
+#include "engine.h"
+
+//
+// buffers the kernel receives into. A buffer is recycled once its data is in
+// the receive ring, so together they bound what waits outside the ring.
+//
+#define URING_ENGINE_BUFFERS        16      // a power of two.
+#define URING_ENGINE_BUFFER_SIZE    (16 * 1024)
+
+//
+// the outbound queue. Small sends share a slot until it is submitted.
+//
+#define URING_ENGINE_SEND_SLOTS     16
+#define URING_ENGINE_SEND_SLOT_SIZE (16 * 1024)
+
+//
+// UringEngineCreate flags.
+//
+#define URING_ENGINE_SQPOLL         1   // a kernel thread takes the submissions.
+
+typedef struct _URING_ENGINE *PURING_ENGINE;
+
+//
+// sets up a ring for Engine->Socket. The socket is switched to blocking,
+// io_uring never blocks the caller. Returns NO_ERROR or an errno, ENOSYS if
+// the kernel has no io_uring.
+//
+_Success_(return == NO_ERROR)
+UINT32
+UringEngineCreate(
+    _In_  PNET_ENGINE       Engine,
+    _In_  ULONG             Flags,
+    _Out_ PURING_ENGINE     *Uring
+    );
+
+//
+// frees the ring. In flight operations are cancelled, the socket stays open.
+//
+VOID
+UringEngineClose(
+    _In_  PURING_ENGINE     Uring
+    );
+
+//
+// makes Read the current read and starts its total timer.
+//
+VOID
+UringEngineStartRead(
+    _In_  PURING_ENGINE     Uring,
+    _In_  PENGINE_READ      Read,
+    _In_  const SERIAL_TIMEOUTS *Timeouts
+    );
+
+//
+// waits until the current read ends by the engine read rules. Without read
+// timers the read times out after WaitUnits waits of 500 ms, like ClientRun.
+// Returns EngineReadFailed if the connection is gone and the data received
+// before cannot complete the read.
+//
+ENGINE_READ_STATUS
+UringEngineWaitRead(
+    _In_  PURING_ENGINE     Uring,
+    _In_  ULONG             WaitUnits
+    );
+
+//
+// queues Buffer for sending. Only waits when the outbound queue is full.
+// returns NO_ERROR or the error of an earlier send.
+//
+UINT32
+UringEngineSend(
+    _In_  PURING_ENGINE     Uring,
+    _In_reads_bytes_(Length)
+          const char        *Buffer,
+    _In_  int               Length
+    );
+
+//
+// waits until the outbound queue is on the socket.
+// returns NO_ERROR, the send error or ETIMEDOUT.
+//
+UINT32
+UringEngineFlush(
+    _In_  PURING_ENGINE     Uring,
+    _In_  ULONG             TimeoutMs
+    );
+
+//
+// io_uring_enter calls so far, the system calls of the backend.
+//
+ULONGLONG
+UringEngineEnterCount(
+    _In_  PURING_ENGINE     Uring
+    );
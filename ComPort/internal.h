@@ -34,11 +34,21 @@ Environment:
 //
 #include <winsock2.h>
 #include <Ws2tcpip.h>
+#include "platform.h"
 #include "htsvsp.h"
 #include "serial.h"
+#include "ringbuffer.h"
+#include "tap.h"
+#include "capture.h"
+#include "engine.h"
+#include "connect.h"
+#include "mux.h"
+#include "pool.h"
+#include "compress.h"
+#include "udp.h"
 #include "driver.h"
 #include "device.h"
-#include "ringbuffer.h"
+#include "timeline.h"
 #include "queue.h"
 #include "network.h"
 
@@ -48,6 +58,7 @@ typedef struct _CTX_GLOBAL_DATA {
     //
     ULONG TraceLevel;
     ULONG WaitUnits;
+    LARGE_INTEGER PerfFrequency; // QueryPerformanceFrequency, for latency stats.
 
 } CTX_GLOBAL_DATA, * PCTX_GLOBAL_DATA;
 
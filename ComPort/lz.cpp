@@ -0,0 +1,272 @@
+/*++
+
+Module Name:
+
+    lz.cpp
+
+Abstract:
+
+    The lz4 block format compressor and decompressor, see lz.h.
+
+--*/
+
+#include "lz.h"
+
+//
+// the lz4 end conditions: the last 5 bytes of a block are literals and the
+// last match starts at least 12 bytes before the end.
+//
+#define LZ_MIN_MATCH        4
+#define LZ_LAST_LITERALS    5
+#define LZ_MATCH_LIMIT      12
+#define LZ_MAX_OFFSET       65535
+
+//
+// a position without a match for 32 probes moves on a byte more per probe,
+// incompressible data goes by quickly.
+//
+#define LZ_SKIP_SHIFT       5
+
+static inline ULONG LzRead32(const BYTE* Data)
+{
+    ULONG value;
+    memcpy(&value, Data, sizeof(value));
+    return value;
+}
+
+static inline ULONG LzHash(ULONG Value)
+{
+    return (Value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+//
+// keeps the last LZ_WINDOW bytes of History if Length more do not fit. Both
+// sides move their history at the same points.
+//
+static ULONG LzMakeRoom(BYTE* History, ULONG* HistoryLength, ULONG Length)
+{
+    if (*HistoryLength + Length <= LZ_HISTORY_SIZE) {
+        return 0;
+    }
+    ULONG shift = *HistoryLength - LZ_WINDOW;
+    memmove(History, History + shift, LZ_WINDOW);
+    *HistoryLength = LZ_WINDOW;
+    return shift;
+}
+
+static BYTE* LzPutLength(BYTE* Out, ULONG Length)
+{
+    while (Length >= 255) {
+        *Out++ = 255;
+        Length -= 255;
+    }
+    *Out++ = (BYTE)Length;
+    return Out;
+}
+
+//
+// one sequence: Literals bytes at Literal and a match of MatchLength bytes
+// Offset back, no match if MatchLength is 0. Returns NULL if it would pass
+// Limit.
+//
+static BYTE* LzPutSequence(BYTE* Out, const BYTE* Limit, const BYTE* Literal, ULONG Literals,
+    ULONG Offset, ULONG MatchLength)
+{
+    if ((size_t)(Limit - Out) < 1 + Literals / 255 + 1 + Literals + 2 + MatchLength / 255 + 1) {
+        return NULL;
+    }
+    BYTE* token = Out++;
+    *token = (BYTE)((Literals < 15 ? Literals : 15) << 4);
+    if (Literals >= 15) {
+        Out = LzPutLength(Out, Literals - 15);
+    }
+    memcpy(Out, Literal, Literals);
+    Out += Literals;
+    if (MatchLength == 0) {
+        return Out;
+    }
+    *Out++ = (BYTE)Offset;
+    *Out++ = (BYTE)(Offset >> 8);
+    ULONG extra = MatchLength - LZ_MIN_MATCH;
+    *token |= (BYTE)(extra < 15 ? extra : 15);
+    if (extra >= 15) {
+        Out = LzPutLength(Out, extra - 15);
+    }
+    return Out;
+}
+
+VOID
+LzEncoderInitialize(
+    _In_  PLZ_ENCODER       Encoder
+    )
+{
+    Encoder->Length = 0;
+    memset(Encoder->Table, 0xff, sizeof(Encoder->Table));
+}
+
+ULONG
+LzCompress(
+    _In_  PLZ_ENCODER       Encoder,
+    _In_reads_bytes_(Length)
+          const BYTE        *Data,
+    _In_  ULONG             Length,
+    _Out_writes_bytes_(Length)
+          BYTE              *Block
+    )
+{
+    ASSERT(Length <= LZ_BLOCK_SIZE);
+
+    ULONG shift = LzMakeRoom(Encoder->History, &Encoder->Length, Length);
+    if (shift != 0) {
+        for (ULONG i = 0; i < (1u << LZ_HASH_BITS); i++) {
+            LONG position = Encoder->Table[i];
+            Encoder->Table[i] = (position >= (LONG)shift) ? position - (LONG)shift : -1;
+        }
+    }
+    const BYTE* history = Encoder->History;
+    ULONG start = Encoder->Length;
+    ULONG end = start + Length;
+    memcpy(Encoder->History + start, Data, Length);
+    Encoder->Length = end;
+    if (Length < LZ_MATCH_LIMIT + 1) {
+        return 0;
+    }
+
+    BYTE* out = Block;
+    const BYTE* limit = Block + Length - 1;
+    ULONG anchor = start;
+    ULONG position = start;
+    ULONG misses = 0;
+    while (position + LZ_MATCH_LIMIT <= end) {
+        ULONG value = LzRead32(history + position);
+        ULONG hash = LzHash(value);
+        LONG candidate = Encoder->Table[hash];
+        Encoder->Table[hash] = (LONG)position;
+        if (candidate < 0 || position - (ULONG)candidate > LZ_MAX_OFFSET ||
+            LzRead32(history + candidate) != value) {
+            position += 1 + (misses++ >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        ULONG matchLength = LZ_MIN_MATCH;
+        while (position + matchLength < end - LZ_LAST_LITERALS &&
+            history[candidate + matchLength] == history[position + matchLength]) {
+            matchLength++;
+        }
+        out = LzPutSequence(out, limit, history + anchor, position - anchor,
+            position - (ULONG)candidate, matchLength);
+        if (out == NULL) {
+            return 0;
+        }
+        position += matchLength;
+        anchor = position;
+        misses = 0;
+        if (position + LZ_MATCH_LIMIT <= end) {
+            Encoder->Table[LzHash(LzRead32(history + position - 2))] = (LONG)(position - 2);
+        }
+    }
+    out = LzPutSequence(out, limit, history + anchor, end - anchor, 0, 0);
+    return (out == NULL) ? 0 : (ULONG)(out - Block);
+}
+
+VOID
+LzDecoderInitialize(
+    _In_  PLZ_DECODER       Decoder
+    )
+{
+    Decoder->Length = 0;
+}
+
+//
+// an extended length, NULL if it runs past End.
+//
+static const BYTE* LzGetLength(const BYTE* In, const BYTE* End, size_t* Length)
+{
+    BYTE value;
+    do {
+        if (In >= End) {
+            return NULL;
+        }
+        value = *In++;
+        *Length += value;
+    } while (value == 255);
+    return In;
+}
+
+const BYTE*
+LzDecompress(
+    _In_  PLZ_DECODER       Decoder,
+    _In_reads_bytes_(BlockLength)
+          const BYTE        *Block,
+    _In_  ULONG             BlockLength,
+    _In_  ULONG             Length
+    )
+{
+    if (Length == 0 || Length > LZ_BLOCK_SIZE || BlockLength > Length) {
+        return NULL;
+    }
+    LzMakeRoom(Decoder->History, &Decoder->Length, Length);
+    BYTE* start = Decoder->History + Decoder->Length;
+    BYTE* out = start;
+    BYTE* outEnd = start + Length;
+
+    if (BlockLength == Length) {
+        memcpy(out, Block, Length);
+        Decoder->Length += Length;
+        return start;
+    }
+
+    const BYTE* in = Block;
+    const BYTE* inEnd = Block + BlockLength;
+    for (;;) {
+        if (in >= inEnd) {
+            return NULL;
+        }
+        BYTE token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15 && (in = LzGetLength(in, inEnd, &literals)) == NULL) {
+            return NULL;
+        }
+        if (literals > (size_t)(inEnd - in) || literals > (size_t)(outEnd - out)) {
+            return NULL;
+        }
+        memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+        if (in == inEnd) {
+            // the last sequence has no match.
+            break;
+        }
+
+        if (inEnd - in < 2) {
+            return NULL;
+        }
+        size_t offset = in[0] | ((size_t)in[1] << 8);
+        in += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && (in = LzGetLength(in, inEnd, &matchLength)) == NULL) {
+            return NULL;
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(out - Decoder->History) ||
+            matchLength > (size_t)(outEnd - out)) {
+            return NULL;
+        }
+        const BYTE* match = out - offset;
+        if (offset >= matchLength) {
+            memcpy(out, match, matchLength);
+            out += matchLength;
+        }
+        else {
+            // overlapping, a run.
+            while (matchLength--) {
+                *out++ = *match++;
+            }
+        }
+    }
+    if (out != outEnd) {
+        return NULL;
+    }
+    Decoder->Length += Length;
+    return start;
+}
@@ -0,0 +1,82 @@
+/*++
+
+Module Name:
+
+    lz.h
+
+Abstract:
+
+    The block compressor of the compressed transport, see compress.h. A
+    block is in the lz4 block format: sequences of literals and a match of
+    at least 4 bytes up to 65535 bytes back. A match may reach back into the
+    blocks before it, so small blocks such as kd packets still find the
+    repeats of the stream, and each side keeps the last LZ_WINDOW bytes of
+    the direction it compresses or decompresses.
+
+    The compressor is a single hash probe per position, fast enough to keep
+    up with a link at serial and WAN speeds on one core, it does not aim for
+    the best ratio.
+
+--*/
+
+#pragma once
+
+#include "platform.h"
+
+#define LZ_BLOCK_SIZE       (32 * 1024)
+#define LZ_WINDOW           (64 * 1024)
+#define LZ_HISTORY_SIZE     (LZ_WINDOW + LZ_BLOCK_SIZE)
+#define LZ_HASH_BITS        14
+
+typedef struct _LZ_ENCODER
+{
+    ULONG       Length;                         // of History.
+    LONG        Table[1 << LZ_HASH_BITS];       // last History position of each hash of 4 bytes, -1 for none.
+    BYTE        History[LZ_HISTORY_SIZE];
+} LZ_ENCODER, *PLZ_ENCODER;
+
+typedef struct _LZ_DECODER
+{
+    ULONG       Length;
+    BYTE        History[LZ_HISTORY_SIZE];
+} LZ_DECODER, *PLZ_DECODER;
+
+VOID
+LzEncoderInitialize(
+    _In_  PLZ_ENCODER       Encoder
+    );
+
+//
+// compresses Length bytes of Data, at most LZ_BLOCK_SIZE, to Block, which
+// holds Length bytes. Returns the size of the block, or 0 if it would not be
+// smaller and Data is sent as it is. Data is history for the next blocks
+// either way.
+//
+ULONG
+LzCompress(
+    _In_  PLZ_ENCODER       Encoder,
+    _In_reads_bytes_(Length)
+          const BYTE        *Data,
+    _In_  ULONG             Length,
+    _Out_writes_bytes_(Length)
+          BYTE              *Block
+    );
+
+VOID
+LzDecoderInitialize(
+    _In_  PLZ_DECODER       Decoder
+    );
+
+//
+// decompresses a block of BlockLength bytes to the Length bytes it was
+// made of, a block as long as that is the data as it is. Returns the data,
+// valid until the next call, or NULL for a block LzCompress does not make.
+//
+const BYTE*
+LzDecompress(
+    _In_  PLZ_DECODER       Decoder,
+    _In_reads_bytes_(BlockLength)
+          const BYTE        *Block,
+    _In_  ULONG             BlockLength,
+    _In_  ULONG             Length
+    );
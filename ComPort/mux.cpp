@@ -0,0 +1,750 @@
+/*++
+
+Module Name:
+
+    mux.cpp
+
+Abstract:
+
+    The channels of a mux session, see mux.h.
+
+    A session is one tcp connection to a relay and a thread that reads it and
+    hands each frame to its channel. The ports write their own data and
+    credit frames, SendLock keeps the frames of different ports whole. A
+    session is shared by the channels opened to the same relay and closed
+    with the last of them, a session that was lost is taken off the list at
+    once so the next open connects a new one.
+
+--*/
+
+#include "mux.h"
+#include "connect.h"
+#include "ringbuffer.h"
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define MUX_TIMEOUT_ERROR       WSAETIMEDOUT
+#define MUX_WOULD_BLOCK_ERROR   WSAEWOULDBLOCK
+#define MUX_CLOSED_ERROR        WSAECONNRESET
+#define MUX_PROTOCOL_ERROR      WSAECONNABORTED
+#define MUX_IN_USE_ERROR        WSAEADDRINUSE
+#define MUX_INVALID_ERROR       WSAEINVAL
+#define MUX_MEMORY_ERROR        ERROR_NOT_ENOUGH_MEMORY
+#else
+#define MUX_TIMEOUT_ERROR       ETIMEDOUT
+#define MUX_WOULD_BLOCK_ERROR   EWOULDBLOCK
+#define MUX_CLOSED_ERROR        ECONNRESET
+#define MUX_PROTOCOL_ERROR      ECONNABORTED
+#define MUX_IN_USE_ERROR        EADDRINUSE
+#define MUX_INVALID_ERROR       EINVAL
+#define MUX_MEMORY_ERROR        ENOMEM
+#endif
+
+//
+// longest a frame waits for the connection to take it. A relay that does
+// not read for that long is taken as lost.
+//
+#define MUX_SEND_TIMEOUT_MS     5000
+
+#define MUX_RECEIVE_BUFFER_SIZE (4 * (MUX_HEADER_SIZE + MUX_MAX_PAYLOAD))
+
+typedef struct _MUX_SESSION *PMUX_SESSION;
+
+typedef struct _MUX_CHANNEL {
+    PMUX_SESSION        Session;
+    USHORT              Id;
+
+    //
+    // under the Lock of the session.
+    //
+    BOOL                Opened;         // the relay answered the open.
+    BOOL                Closed;         // by the relay or a lost session.
+    UINT32              Error;
+    ULONG               SendCredit;
+    ULONG               Consumed;       // data bytes read since the last credit frame.
+    RING_BUFFER         Rx;
+
+    PLATFORM_EVENT      DataEvent;      // manual reset, set while Rx has data or the channel closed.
+    PLATFORM_EVENT      CreditEvent;    // auto reset, the open answer, credit or the close.
+    PPLATFORM_WAITER    CreditWaiter;
+    BYTE                RxBuffer[MUX_WINDOW + 1];
+} MUX_CHANNEL, *PMUX_CHANNEL;
+
+typedef struct _MUX_SESSION {
+    PMUX_SESSION        Next;
+    CHAR                Host[256];
+    USHORT              Port;
+    ULONG               References;     // under MuxLock, one for each channel and open.
+    BOOL                Listed;         // under MuxLock.
+
+    SOCKET              Socket;
+    PLATFORM_THREAD     Thread;
+    PLATFORM_EVENT      StopEvent;
+    PLATFORM_LOCK       SendLock;
+    UINT32              SendError;      // under SendLock, the frame that broke the session.
+
+    PLATFORM_LOCK       Lock;
+    BOOL                Lost;
+    UINT32              LostError;
+    PMUX_CHANNEL        Channels[MUX_MAX_CHANNELS];
+
+    ULONG               ReceiveLength;
+    BYTE                ReceiveBuffer[MUX_RECEIVE_BUFFER_SIZE];
+} MUX_SESSION;
+
+static PLATFORM_LOCK MuxLock;
+static PMUX_SESSION MuxSessions;
+
+VOID
+MuxEncodeUlong(
+    _In_  ULONG                     Value,
+    _Out_writes_bytes_(4) BYTE*     Buffer
+    )
+{
+    Buffer[0] = (BYTE)(Value >> 24);
+    Buffer[1] = (BYTE)(Value >> 16);
+    Buffer[2] = (BYTE)(Value >> 8);
+    Buffer[3] = (BYTE)Value;
+}
+
+ULONG
+MuxDecodeUlong(
+    _In_reads_bytes_(4) const BYTE* Buffer
+    )
+{
+    return ((ULONG)Buffer[0] << 24) | ((ULONG)Buffer[1] << 16) |
+        ((ULONG)Buffer[2] << 8) | (ULONG)Buffer[3];
+}
+
+VOID
+MuxEncodeHeader(
+    _In_  const MUX_HEADER*         Header,
+    _Out_writes_bytes_(MUX_HEADER_SIZE)
+          BYTE*                     Buffer
+    )
+{
+    Buffer[0] = Header->Type;
+    Buffer[1] = 0;
+    Buffer[2] = (BYTE)(Header->Channel >> 8);
+    Buffer[3] = (BYTE)Header->Channel;
+    MuxEncodeUlong(Header->Length, Buffer + 4);
+}
+
+BOOL
+MuxDecodeHeader(
+    _In_reads_bytes_(MUX_HEADER_SIZE)
+          const BYTE*               Buffer,
+    _Out_ PMUX_HEADER               Header
+    )
+{
+    Header->Type = Buffer[0];
+    Header->Channel = (USHORT)((Buffer[2] << 8) | Buffer[3]);
+    Header->Length = MuxDecodeUlong(Buffer + 4);
+    return (Header->Type >= MUX_FRAME_OPEN) && (Header->Type <= MUX_FRAME_CLOSE) &&
+        (Header->Length <= MUX_MAX_PAYLOAD);
+}
+
+VOID
+MuxStartup(
+    VOID
+    )
+{
+    PlatformLockInitialize(&MuxLock);
+    MuxSessions = NULL;
+}
+
+VOID
+MuxCleanup(
+    VOID
+    )
+{
+    ASSERT(MuxSessions == NULL);
+}
+
+//
+// sends one frame, whole. A frame that could not be sent breaks the framing
+// of the connection, the session is lost then and later frames fail too.
+//
+static UINT32
+MuxSendFrame(
+    _In_  PMUX_SESSION              Session,
+    _In_  UCHAR                     Type,
+    _In_  USHORT                    Channel,
+    _In_reads_bytes_(Length) const char* Payload,
+    _In_  ULONG                     Length
+    )
+{
+    BYTE frame[MUX_HEADER_SIZE + MUX_MAX_PAYLOAD];
+    MUX_HEADER header = { Type, Channel, Length };
+    MuxEncodeHeader(&header, frame);
+    if (Length != 0) {
+        RtlCopyMemory(frame + MUX_HEADER_SIZE, Payload, Length);
+    }
+
+    PlatformLockAcquire(&Session->SendLock);
+    UINT32 error = Session->SendError;
+    ULONG sent = 0;
+    ULONG total = MUX_HEADER_SIZE + Length;
+    while (error == NO_ERROR && sent < total) {
+        int result = send(Session->Socket, (const char*)frame + sent, (int)(total - sent), MSG_NOSIGNAL);
+        if (result > 0) {
+            sent += result;
+            continue;
+        }
+        error = PlatformSocketLastError();
+        if (PlatformSocketWouldBlock(error)) {
+            error = PlatformSocketWaitWritable(Session->Socket, MUX_SEND_TIMEOUT_MS);
+        }
+        if (error != NO_ERROR) {
+            Session->SendError = error;
+            PlatformEventSet(Session->StopEvent);
+        }
+    }
+    PlatformLockRelease(&Session->SendLock);
+    return error;
+}
+
+static UINT32
+MuxSendUlong(
+    _In_  PMUX_SESSION              Session,
+    _In_  UCHAR                     Type,
+    _In_  USHORT                    Channel,
+    _In_  ULONG                     Value
+    )
+{
+    BYTE payload[4];
+    MuxEncodeUlong(Value, payload);
+    return MuxSendFrame(Session, Type, Channel, (const char*)payload, sizeof(payload));
+}
+
+//
+// a channel the relay closed or whose session is gone. Called with the Lock
+// of the session held.
+//
+static VOID
+MuxCloseChannelLocked(
+    _In_  PMUX_CHANNEL              Channel,
+    _In_  UINT32                    Error
+    )
+{
+    Channel->Closed = TRUE;
+    Channel->Error = Error;
+    PlatformEventSet(Channel->DataEvent);
+    PlatformEventSet(Channel->CreditEvent);
+}
+
+static VOID
+MuxSessionLost(
+    _In_  PMUX_SESSION              Session,
+    _In_  UINT32                    Error
+    )
+{
+    PlatformLockAcquire(&MuxLock);
+    if (Session->Listed) {
+        PMUX_SESSION* link = &MuxSessions;
+        while (*link != Session) {
+            link = &(*link)->Next;
+        }
+        *link = Session->Next;
+        Session->Listed = FALSE;
+    }
+    PlatformLockRelease(&MuxLock);
+
+    PlatformLockAcquire(&Session->Lock);
+    Session->Lost = TRUE;
+    Session->LostError = (Error != NO_ERROR) ? Error : MUX_CLOSED_ERROR;
+    for (ULONG i = 0; i < MUX_MAX_CHANNELS; i++) {
+        if (Session->Channels[i] != NULL) {
+            MuxCloseChannelLocked(Session->Channels[i], Session->LostError);
+        }
+    }
+    PlatformLockRelease(&Session->Lock);
+}
+
+//
+// hands one frame to its channel. Returns FALSE if the relay broke the
+// protocol.
+//
+static BOOL
+MuxSessionDispatch(
+    _In_  PMUX_SESSION              Session,
+    _In_  const MUX_HEADER*         Header,
+    _In_reads_bytes_(Header->Length) const BYTE* Payload
+    )
+{
+    BOOL valid = TRUE;
+    if (Header->Channel >= MUX_MAX_CHANNELS) {
+        return FALSE;
+    }
+    if (Header->Type != MUX_FRAME_DATA && Header->Type != MUX_FRAME_CLOSE && Header->Length != 4) {
+        return FALSE;
+    }
+
+    PlatformLockAcquire(&Session->Lock);
+    PMUX_CHANNEL channel = Session->Channels[Header->Channel];
+    if (channel == NULL || channel->Closed) {
+        PlatformLockRelease(&Session->Lock);
+        return TRUE;
+    }
+    switch (Header->Type) {
+    case MUX_FRAME_OPEN:
+        valid = !channel->Opened;
+        channel->Opened = TRUE;
+        channel->SendCredit = MuxDecodeUlong(Payload);
+        PlatformEventSet(channel->CreditEvent);
+        break;
+
+    case MUX_FRAME_DATA: {
+        //
+        // the relay sends no more than the window it was given, there is
+        // always room for it.
+        //
+        size_t space = 0;
+        RingBufferGetAvailableSpace(&channel->Rx, &space);
+        valid = channel->Opened && (space >= Header->Length);
+        if (valid && Header->Length != 0) {
+            RingBufferWrite(&channel->Rx, (BYTE*)Payload, Header->Length);
+            PlatformEventSet(channel->DataEvent);
+        }
+        break;
+    }
+
+    case MUX_FRAME_CREDIT:
+        channel->SendCredit += MuxDecodeUlong(Payload);
+        PlatformEventSet(channel->CreditEvent);
+        break;
+
+    case MUX_FRAME_CLOSE:
+        MuxCloseChannelLocked(channel, MUX_CLOSED_ERROR);
+        break;
+    }
+    PlatformLockRelease(&Session->Lock);
+    return valid;
+}
+
+static UINT32
+MuxSessionThread(
+    _In_  PVOID                     Context
+    )
+{
+    PMUX_SESSION session = (PMUX_SESSION)Context;
+    PPLATFORM_WAITER waiter = NULL;
+    UINT32 error = PlatformWaiterCreate(&waiter);
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddEvent(waiter, session->StopEvent);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddSocket(waiter, session->Socket, PLATFORM_SOCKET_READ);
+    }
+
+    while (error == NO_ERROR) {
+        ULONG ready = PlatformWait(waiter, INFINITE);
+        if (ready != 1) {
+            //
+            // stopped by the last close or by a frame that could not be sent.
+            //
+            PlatformLockAcquire(&session->SendLock);
+            error = (ready == 0) ? session->SendError : MUX_CLOSED_ERROR;
+            PlatformLockRelease(&session->SendLock);
+            if (error == NO_ERROR) {
+                error = MUX_CLOSED_ERROR;
+            }
+            break;
+        }
+
+        int result = recv(session->Socket,
+            (char*)session->ReceiveBuffer + session->ReceiveLength,
+            (int)(sizeof(session->ReceiveBuffer) - session->ReceiveLength), 0);
+        if (result == 0) {
+            error = MUX_CLOSED_ERROR;
+            break;
+        }
+        if (result < 0) {
+            error = PlatformSocketLastError();
+            if (PlatformSocketWouldBlock(error)) {
+                error = NO_ERROR;
+            }
+            continue;
+        }
+        session->ReceiveLength += result;
+
+        ULONG offset = 0;
+        MUX_HEADER header;
+        while (session->ReceiveLength - offset >= MUX_HEADER_SIZE) {
+            if (!MuxDecodeHeader(session->ReceiveBuffer + offset, &header)) {
+                error = MUX_PROTOCOL_ERROR;
+                break;
+            }
+            if (session->ReceiveLength - offset < MUX_HEADER_SIZE + header.Length) {
+                break;
+            }
+            if (!MuxSessionDispatch(session, &header, session->ReceiveBuffer + offset + MUX_HEADER_SIZE)) {
+                error = MUX_PROTOCOL_ERROR;
+                break;
+            }
+            offset += MUX_HEADER_SIZE + header.Length;
+        }
+        memmove(session->ReceiveBuffer, session->ReceiveBuffer + offset, session->ReceiveLength - offset);
+        session->ReceiveLength -= offset;
+    }
+
+    PlatformWaiterClose(waiter);
+    MuxSessionLost(session, error);
+    return error;
+}
+
+static VOID
+MuxSessionFree(
+    _In_  PMUX_SESSION              Session
+    )
+{
+    if (Session->Thread) {
+        PlatformEventSet(Session->StopEvent);
+        PlatformThreadJoin(Session->Thread, INFINITE);
+    }
+    if (Session->Socket != INVALID_SOCKET) {
+        closesocket(Session->Socket);
+    }
+    if (Session->StopEvent) {
+        PlatformEventClose(Session->StopEvent);
+    }
+    free(Session);
+}
+
+static VOID
+MuxSessionRelease(
+    _In_  PMUX_SESSION              Session
+    )
+{
+    PlatformLockAcquire(&MuxLock);
+    BOOL last = (--Session->References == 0);
+    if (last && Session->Listed) {
+        PMUX_SESSION* link = &MuxSessions;
+        while (*link != Session) {
+            link = &(*link)->Next;
+        }
+        *link = Session->Next;
+        Session->Listed = FALSE;
+    }
+    PlatformLockRelease(&MuxLock);
+    if (last) {
+        MuxSessionFree(Session);
+    }
+}
+
+static PMUX_SESSION
+MuxSessionFindLocked(
+    _In_  const char*               Host,
+    _In_  USHORT                    Port
+    )
+{
+    for (PMUX_SESSION session = MuxSessions; session != NULL; session = session->Next) {
+        if (session->Port == Port && strcmp(session->Host, Host) == 0) {
+            session->References++;
+            return session;
+        }
+    }
+    return NULL;
+}
+
+//
+// the session to Host and Port with a reference for the caller, connected
+// if there is none.
+//
+static UINT32
+MuxSessionGet(
+    _In_  const char*               Host,
+    _In_  USHORT                    Port,
+    _In_  ULONG                     TimeoutMs,
+    _Out_ PMUX_SESSION*             Session
+    )
+{
+    PlatformLockAcquire(&MuxLock);
+    *Session = MuxSessionFindLocked(Host, Port);
+    PlatformLockRelease(&MuxLock);
+    if (*Session != NULL) {
+        return NO_ERROR;
+    }
+    if (strlen(Host) >= sizeof((*Session)->Host)) {
+        return MUX_INVALID_ERROR;
+    }
+
+    //
+    // connected without MuxLock, the opens of other relays go on meanwhile.
+    //
+    PMUX_SESSION session = (PMUX_SESSION)calloc(1, sizeof(*session));
+    if (session == NULL) {
+        return MUX_MEMORY_ERROR;
+    }
+    session->Socket = INVALID_SOCKET;
+    strcpy(session->Host, Host);
+    session->Port = Port;
+    PlatformLockInitialize(&session->Lock);
+    PlatformLockInitialize(&session->SendLock);
+
+    CONNECT_REPORT report;
+    UINT32 error = PlatformEventCreate(TRUE, &session->StopEvent);
+    if (error == NO_ERROR) {
+        error = TcpConnect(Host, Port, CONNECT_ATTEMPT_DELAY_MS, TimeoutMs, NULL, &session->Socket, &report);
+    }
+    if (error == NO_ERROR) {
+        int yes = 1;
+        setsockopt(session->Socket, IPPROTO_TCP, TCP_NODELAY, (char*)&yes, sizeof(yes));
+        error = PlatformThreadCreate(MuxSessionThread, session, &session->Thread);
+    }
+    if (error != NO_ERROR) {
+        session->Thread = NULL;
+        MuxSessionFree(session);
+        return error;
+    }
+
+    //
+    // another open may have connected the same relay meanwhile, the first
+    // one listed is kept.
+    //
+    PlatformLockAcquire(&MuxLock);
+    *Session = MuxSessionFindLocked(Host, Port);
+    if (*Session == NULL) {
+        session->References = 1;
+        session->Listed = TRUE;
+        session->Next = MuxSessions;
+        MuxSessions = session;
+        *Session = session;
+    }
+    PlatformLockRelease(&MuxLock);
+    if (*Session != session) {
+        MuxSessionFree(session);
+    }
+    return NO_ERROR;
+}
+
+static int
+MuxChannelRecv(
+    _In_  PVOID                     Context,
+    _Out_writes_bytes_(Length) char* Buffer,
+    _In_  int                       Length,
+    _Out_ UINT32*                   Error
+    )
+{
+    PMUX_CHANNEL channel = (PMUX_CHANNEL)Context;
+    PMUX_SESSION session = channel->Session;
+    size_t length = 0;
+    ULONG credit = 0;
+
+    PlatformLockAcquire(&session->Lock);
+    RingBufferGetAvailableData(&channel->Rx, &length);
+    if (length == 0) {
+        BOOL closed = channel->Closed;
+        if (!closed) {
+            PlatformEventReset(channel->DataEvent);
+        }
+        PlatformLockRelease(&session->Lock);
+        *Error = closed ? NO_ERROR : MUX_WOULD_BLOCK_ERROR;
+        return closed ? 0 : SOCKET_ERROR;
+    }
+    RingBufferRead(&channel->Rx, (BYTE*)Buffer, (size_t)Length, &length);
+    channel->Consumed += (ULONG)length;
+    if (channel->Consumed >= MUX_WINDOW / 2 && !channel->Closed) {
+        credit = channel->Consumed;
+        channel->Consumed = 0;
+    }
+    PlatformLockRelease(&session->Lock);
+
+    if (credit != 0) {
+        MuxSendUlong(session, MUX_FRAME_CREDIT, channel->Id, credit);
+    }
+    *Error = NO_ERROR;
+    return (int)length;
+}
+
+static int
+MuxChannelSend(
+    _In_  PVOID                     Context,
+    _In_reads_bytes_(Length) const char* Buffer,
+    _In_  int                       Length,
+    _Out_ UINT32*                   Error
+    )
+{
+    PMUX_CHANNEL channel = (PMUX_CHANNEL)Context;
+    PMUX_SESSION session = channel->Session;
+
+    PlatformLockAcquire(&session->Lock);
+    ULONG count = (ULONG)Length;
+    if (count > channel->SendCredit) {
+        count = channel->SendCredit;
+    }
+    if (count > MUX_MAX_PAYLOAD) {
+        count = MUX_MAX_PAYLOAD;
+    }
+    *Error = channel->Closed ? channel->Error : (count == 0) ? MUX_WOULD_BLOCK_ERROR : NO_ERROR;
+    if (*Error == NO_ERROR) {
+        channel->SendCredit -= count;
+    }
+    PlatformLockRelease(&session->Lock);
+    if (*Error != NO_ERROR) {
+        return SOCKET_ERROR;
+    }
+
+    *Error = MuxSendFrame(session, MUX_FRAME_DATA, channel->Id, Buffer, count);
+    return (*Error == NO_ERROR) ? (int)count : SOCKET_ERROR;
+}
+
+//
+// waits until the channel has credit, or is closed so that the next send
+// fails.
+//
+static UINT32
+MuxChannelWaitWritable(
+    _In_  PVOID                     Context,
+    _In_  ULONG                     TimeoutMs
+    )
+{
+    PMUX_CHANNEL channel = (PMUX_CHANNEL)Context;
+    PMUX_SESSION session = channel->Session;
+    ULONGLONG deadlineUs = PlatformTimeUs() + (ULONGLONG)TimeoutMs * 1000;
+
+    for (;;) {
+        PlatformLockAcquire(&session->Lock);
+        BOOL writable = channel->Closed || channel->SendCredit != 0;
+        PlatformLockRelease(&session->Lock);
+        if (writable) {
+            return NO_ERROR;
+        }
+        ULONGLONG nowUs = PlatformTimeUs();
+        if (nowUs >= deadlineUs ||
+            PlatformWait(channel->CreditWaiter, (ULONG)((deadlineUs - nowUs + 999) / 1000)) != 0) {
+            return MUX_TIMEOUT_ERROR;
+        }
+    }
+}
+
+static VOID
+MuxChannelFree(
+    _In_  PMUX_CHANNEL              Channel
+    )
+{
+    PlatformWaiterClose(Channel->CreditWaiter);
+    if (Channel->CreditEvent) {
+        PlatformEventClose(Channel->CreditEvent);
+    }
+    if (Channel->DataEvent) {
+        PlatformEventClose(Channel->DataEvent);
+    }
+    free(Channel);
+}
+
+static VOID
+MuxChannelClose(
+    _In_  PVOID                     Context
+    )
+{
+    PMUX_CHANNEL channel = (PMUX_CHANNEL)Context;
+    PMUX_SESSION session = channel->Session;
+
+    PlatformLockAcquire(&session->Lock);
+    session->Channels[channel->Id] = NULL;
+    BOOL tell = !channel->Closed;
+    PlatformLockRelease(&session->Lock);
+
+    if (tell) {
+        MuxSendFrame(session, MUX_FRAME_CLOSE, channel->Id, NULL, 0);
+    }
+    MuxChannelFree(channel);
+    MuxSessionRelease(session);
+}
+
+static const PLATFORM_STREAM_OPS MuxStreamOps = {
+    MuxChannelRecv,
+    MuxChannelSend,
+    MuxChannelWaitWritable,
+    MuxChannelClose,
+};
+
+_Success_(return == NO_ERROR)
+UINT32
+MuxChannelOpen(
+    _In_  const char*               Host,
+    _In_  USHORT                    Port,
+    _In_  USHORT                    Channel,
+    _In_  ULONG                     TimeoutMs,
+    _Out_ PLATFORM_STREAM*          Stream
+    )
+{
+    *Stream = NULL;
+    if (Channel == 0 || Channel >= MUX_MAX_CHANNELS) {
+        return MUX_INVALID_ERROR;
+    }
+
+    PMUX_CHANNEL channel = (PMUX_CHANNEL)calloc(1, sizeof(*channel));
+    if (channel == NULL) {
+        return MUX_MEMORY_ERROR;
+    }
+    channel->Id = Channel;
+    RingBufferInitialize(&channel->Rx, channel->RxBuffer, sizeof(channel->RxBuffer));
+    UINT32 error = PlatformEventCreate(TRUE, &channel->DataEvent);
+    if (error == NO_ERROR) {
+        error = PlatformEventCreate(FALSE, &channel->CreditEvent);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterCreate(&channel->CreditWaiter);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddEvent(channel->CreditWaiter, channel->CreditEvent);
+    }
+    if (error == NO_ERROR) {
+        error = MuxSessionGet(Host, Port, TimeoutMs, &channel->Session);
+    }
+    if (error != NO_ERROR) {
+        MuxChannelFree(channel);
+        return error;
+    }
+
+    PMUX_SESSION session = channel->Session;
+    PlatformLockAcquire(&session->Lock);
+    if (session->Lost) {
+        error = session->LostError;
+    }
+    else if (session->Channels[Channel] != NULL) {
+        error = MUX_IN_USE_ERROR;
+    }
+    else {
+        session->Channels[Channel] = channel;
+    }
+    PlatformLockRelease(&session->Lock);
+    if (error != NO_ERROR) {
+        MuxChannelFree(channel);
+        MuxSessionRelease(session);
+        return error;
+    }
+
+    //
+    // from here on the channel is closed like an open one, which tells the
+    // relay unless it closed it.
+    //
+    error = MuxSendUlong(session, MUX_FRAME_OPEN, Channel, MUX_WINDOW);
+    ULONGLONG deadlineUs = PlatformTimeUs() + (ULONGLONG)TimeoutMs * 1000;
+    while (error == NO_ERROR) {
+        PlatformLockAcquire(&session->Lock);
+        BOOL opened = channel->Opened;
+        if (channel->Closed) {
+            error = channel->Error;
+        }
+        PlatformLockRelease(&session->Lock);
+        if (opened || error != NO_ERROR) {
+            break;
+        }
+        ULONGLONG nowUs = PlatformTimeUs();
+        if (nowUs >= deadlineUs ||
+            PlatformWait(channel->CreditWaiter, (ULONG)((deadlineUs - nowUs + 999) / 1000)) != 0) {
+            error = MUX_TIMEOUT_ERROR;
+        }
+    }
+    if (error == NO_ERROR) {
+        error = PlatformStreamCreate(&MuxStreamOps, channel, channel->DataEvent, Stream);
+    }
+    if (error != NO_ERROR) {
+        MuxChannelClose(channel);
+    }
+    return error;
+}
@@ -0,0 +1,124 @@
+/*++
+
+Module Name:
+
+    mux.h
+
+Abstract:
+
+    The mux transport of a client port. A relay near the vm host, vspPeer
+    --relay, connects to the serial ports of many vms and carries them over
+    one tcp connection, a session, as numbered channels. A port opens its
+    channel of the session to the relay and reads and writes it as a stream,
+    the ports of one host process share the session.
+
+    Everything on the connection is a frame: a MUX_HEADER and Length bytes
+    of payload. Each side of a channel may send as many data bytes as the
+    window the other side gave in its open, and the other side gives them
+    back with a credit frame as it consumes them, so a port or a vm that does
+    not read stops its own channel and not the session.
+
+      MUX_FRAME_OPEN    port to relay: opens Channel, the payload is the
+                        window of the port. The relay answers with an open
+                        frame and its own window once it connected to the
+                        target of the channel, or with a close frame.
+      MUX_FRAME_DATA    the bytes of a channel, at most MUX_MAX_PAYLOAD.
+      MUX_FRAME_CREDIT  the payload is the number of data bytes consumed.
+      MUX_FRAME_CLOSE   either side closed the channel. The payload, if any,
+                        is an error code of the sender for its log. Frames
+                        of a channel that is closed are ignored.
+
+    The fields are big endian.
+
+--*/
+
+#pragma once
+
+#include "platform.h"
+
+#define MUX_HEADER_SIZE         8
+#define MUX_MAX_PAYLOAD         (16 * 1024)
+
+//
+// the data bytes one side of a channel takes before it returns credit, it
+// returns it once it consumed half of it.
+//
+#define MUX_WINDOW              (64 * 1024)
+
+//
+// channels 1 to MUX_MAX_CHANNELS - 1 of a session.
+//
+#define MUX_MAX_CHANNELS        1024
+
+#define MUX_FRAME_OPEN          1
+#define MUX_FRAME_DATA          2
+#define MUX_FRAME_CREDIT        3
+#define MUX_FRAME_CLOSE         4
+
+typedef struct _MUX_HEADER {
+    UCHAR   Type;
+    USHORT  Channel;
+    ULONG   Length;
+} MUX_HEADER, *PMUX_HEADER;
+
+VOID
+MuxEncodeHeader(
+    _In_  const MUX_HEADER*         Header,
+    _Out_writes_bytes_(MUX_HEADER_SIZE)
+          BYTE*                     Buffer
+    );
+
+//
+// returns FALSE for a frame no side sends: an unknown type or a payload
+// longer than MUX_MAX_PAYLOAD.
+//
+BOOL
+MuxDecodeHeader(
+    _In_reads_bytes_(MUX_HEADER_SIZE)
+          const BYTE*               Buffer,
+    _Out_ PMUX_HEADER               Header
+    );
+
+VOID
+MuxEncodeUlong(
+    _In_  ULONG                     Value,
+    _Out_writes_bytes_(4) BYTE*     Buffer
+    );
+
+ULONG
+MuxDecodeUlong(
+    _In_reads_bytes_(4) const BYTE* Buffer
+    );
+
+//
+// the sessions of the process. MuxCleanup is called once every channel is
+// closed.
+//
+VOID
+MuxStartup(
+    VOID
+    );
+
+VOID
+MuxCleanup(
+    VOID
+    );
+
+//
+// opens Channel of the session to the relay at Host and Port, connecting
+// the session if the process has none. Returns the error of the connect, a
+// timeout error after TimeoutMs or the error the relay closed the channel
+// with. Two opens of one channel fail with an address in use error.
+//
+// Stream reads and writes the channel. It reads 0 once the relay closed the
+// channel or the session was lost, and closing it closes the channel.
+//
+_Success_(return == NO_ERROR)
+UINT32
+MuxChannelOpen(
+    _In_  const char*               Host,
+    _In_  USHORT                    Port,
+    _In_  USHORT                    Channel,
+    _In_  ULONG                     TimeoutMs,
+    _Out_ PLATFORM_STREAM*          Stream
+    );
@@ -2,17 +2,73 @@
 #include <iostream>
 #include <string>
 
+//
+// client loop wait sources, in priority order. The timeline records
+// a wake up as WAIT_OBJECT_0 + source, see waitName in TimelineCapture.cpp.
+//
+enum CLIENT_WAIT_SOURCE {
+    ClientWaitSocket = 0,           // the reconnect timer while the client is disconnected.
+    ClientWaitTerminate,
+    ClientWaitReadQueue,
+    ClientWaitCancel,
+    ClientWaitIntervalTimer,
+    ClientWaitTotalTimer,
+    ClientWaitOverflowTimer,
+    ClientWaitConfigure,            // a client only.
+    ClientWaitStop = ClientWaitConfigure, // the loop of a service client only.
+};
+
+enum SERVICE_WAIT_SOURCE {
+    ServiceWaitAccept = 0,
+    ServiceWaitTerminate,
+    ServiceWaitConfigure,
+    ServiceWaitTap,                 // a tap has a copy to send.
+    ServiceWaitClientDone,          // the loop of the last client finished, while a client is pending.
+};
+
+static UINT32 ConnectClient(PDEVICE_CONTEXT deviceContext, ULONG timeoutMs);
+
+//
+// the connection state in the report and the timeline.
+//
+static void SetConnectionState(PDEVICE_CONTEXT deviceContext, HTS_VSP_CONNECTION_STATE state)
+{
+    DWORD oldState = deviceContext->Stats.connectionState;
+    if (oldState == (DWORD)state) {
+        return;
+    }
+    deviceContext->Stats.connectionState = state;
+    deviceContext->Stats.stateChanges++;
+    if (state == HtsConnectionConnected && deviceContext->StartupPending) {
+        deviceContext->StartupPending = FALSE;
+        deviceContext->Stats.startupConnectUs = (DWORD)(PlatformTimeUs() - deviceContext->StartedUs);
+        Trace(TRACE_LEVEL_INFO, "connected %lu us after device start",
+            deviceContext->Stats.startupConnectUs);
+    }
+    TimelineRecord(deviceContext->Timeline, HtsTimelineConnectionState,
+        deviceContext->CurrentCorrelationId, state, oldState);
+    Trace(TRACE_LEVEL_INFO, "connection state %lu -> %lu",
+        oldState, (DWORD)state);
+}
+
 _Success_(return == NO_ERROR)
 UINT32 WinSockInitialize()
 {
-    UINT16  versionRequested = WINSOCK_VERSION;
-    WSADATA wsaData = { 0 };
-    UINT32  status =  WSAStartup(versionRequested,
-        &wsaData);
+    UINT32  status = PlatformSocketStartup();
     if (status != NO_ERROR) {
         Trace(TRACE_LEVEL_ERROR, "status: %#x",
             status);
     }
+    else {
+        MuxStartup();
+        status = PoolStartup(0);
+        if (status != NO_ERROR) {
+            Trace(TRACE_LEVEL_ERROR, "worker pool start error: %#x",
+                status);
+            MuxCleanup();
+            PlatformSocketCleanup();
+        }
+    }
 
     return status;
 }
@@ -21,20 +77,14 @@ UINT32 WinSockInitialize()
 _Success_(return == NO_ERROR)
 UINT32 WinSockCleanup()
 {
-    UINT32 status = WSACleanup();
-    if (status != NO_ERROR)
-    {
-        status = WSAGetLastError();
-
-        Trace(TRACE_LEVEL_ERROR, "status: %#x",
-            status);
-    }
-
-    return status;
+    PoolCleanup();
+    MuxCleanup();
+    PlatformSocketCleanup();
+    return NO_ERROR;
 }
 
 _Success_(return == NO_ERROR)
-UINT32 WinSockCreate(SOCKET * pSocket)
+UINT32 WinSockCreate(SOCKET * pSocket, int family)
 {
     UINT32 status = NO_ERROR;
 
@@ -42,12 +92,12 @@ UINT32 WinSockCreate(SOCKET * pSocket)
         closesocket(*pSocket);
         *pSocket = INVALID_SOCKET;
     }
-        
+
     *pSocket = socket(
-        AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        family, SOCK_STREAM, family == AF_UNIX ? 0 : IPPROTO_TCP);
     if (*pSocket == INVALID_SOCKET)
     {
-        status = WSAGetLastError();
+        status = PlatformSocketLastError();
 
         Trace(TRACE_LEVEL_ERROR, "socket() status: %#x",
             status);
@@ -56,38 +106,55 @@ UINT32 WinSockCreate(SOCKET * pSocket)
     return status;
 }
 
+//
+// waits for a network loop to finish. The loop works on the device context,
+// so it is never left running: the terminate event ends its wait and cancels
+// a reconnect in progress, which otherwise gives up after
+// RECONNECT_TIMEOUT_MS.
+//
+static void JoinWork(PPOOL_WORK* work)
+{
+    if (*work == NULL) {
+        return;
+    }
+    PoolWorkJoin(*work, INFINITE);
+    *work = NULL;
+}
+
 void CleanupNetwork(PDEVICE_CONTEXT deviceContext)
 {
-    WdfTimerStop(deviceContext->IntervalTimer, FALSE);
-    WdfTimerStop(deviceContext->TotalTimer, FALSE);
+    PlatformTimerStop(deviceContext->IntervalTimer);
+    PlatformTimerStop(deviceContext->TotalTimer);
+    PlatformTimerStop(deviceContext->ReconnectTimer);
 
-    if (deviceContext->ThreadHandle != NULL) {
-        DWORD result = WAIT_FAILED;
-        deviceContext->TerminateThread = true;
-        if (deviceContext->ThreadEvent != NULL) {
-            SetEvent(deviceContext->ThreadEvent);
-            result = WaitForSingleObject(deviceContext->ThreadHandle, 5000);
-        }
-        if (result != WAIT_OBJECT_0) { // wtf?
-            TerminateThread(deviceContext->ThreadEvent, 1);
-        }
-        CloseHandle(deviceContext->ThreadHandle);
-        deviceContext->ThreadHandle = NULL;
+    deviceContext->TerminateThread = true;
+    if (deviceContext->ThreadEvent != NULL) {
+        PlatformEventSet(deviceContext->ThreadEvent);
     }
+    JoinWork(&deviceContext->Work);
+    JoinWork(&deviceContext->ClientWork);
+    TapCloseAll(&deviceContext->Taps);
 
+    if (deviceContext->PendingClient != INVALID_SOCKET) {
+        closesocket(deviceContext->PendingClient);
+        deviceContext->PendingClient = INVALID_SOCKET;
+    }
     if (deviceContext->ServiceSocket != INVALID_SOCKET) {
         closesocket(deviceContext->ServiceSocket);
         deviceContext->ServiceSocket = INVALID_SOCKET;
     }
-    if (deviceContext->ClientSocket != INVALID_SOCKET) {
-        closesocket(deviceContext->ClientSocket);
-        deviceContext->ClientSocket = INVALID_SOCKET;
-    }
+    EngineClose(&deviceContext->Engine);
+    SetConnectionState(deviceContext, HtsConnectionIdle);
 
-    if (deviceContext->ClientThreadHandle != NULL) {
-        TerminateThread(deviceContext->ClientThreadHandle, 1);
-        CloseHandle(deviceContext->ClientThreadHandle);
-        deviceContext->ClientThreadHandle = NULL;
+    //
+    // ready for the next configuration.
+    //
+    deviceContext->TerminateThread = false;
+    if (deviceContext->ThreadEvent != NULL) {
+        PlatformEventReset(deviceContext->ThreadEvent);
+    }
+    if (deviceContext->ClientStopEvent != NULL) {
+        PlatformEventReset(deviceContext->ClientStopEvent);
     }
 }
 
@@ -97,705 +164,1202 @@ void CloseNetwork(
 	CleanupNetwork(deviceContext);
 
     if (deviceContext->ThreadEvent != NULL) {
-        CloseHandle(deviceContext->ThreadEvent);
+        PlatformEventClose(deviceContext->ThreadEvent);
         deviceContext->ThreadEvent = NULL;
     }
-    if (deviceContext->ServiceSocket != INVALID_SOCKET) {
-        closesocket(deviceContext->ServiceSocket);
-        deviceContext->ServiceSocket = INVALID_SOCKET;
-    }
-    if (deviceContext->ServiceSocketEvent != WSA_INVALID_EVENT) {
-        WSACloseEvent(deviceContext->ServiceSocketEvent);
-        deviceContext->ServiceSocketEvent = WSA_INVALID_EVENT;
-    }
-    if (deviceContext->ClientSocket != INVALID_SOCKET) {
-        closesocket(deviceContext->ClientSocket);
-        deviceContext->ClientSocket = INVALID_SOCKET;
-    }
-    if (deviceContext->ClientSocketEvent != WSA_INVALID_EVENT) {
-        WSACloseEvent(deviceContext->ClientSocketEvent);
-        deviceContext->ClientSocketEvent = WSA_INVALID_EVENT;
-    }
 }
 
 //
-// try to send. Ignore failures.
+// try to send. Ignore failures. A client that reconnects keeps the data for
+// the new connection.
 //
 UINT32 WinSockSend(PDEVICE_CONTEXT deviceContext,
     char* buffer,
     int length)
 {
-    if (deviceContext->ClientSocket != INVALID_SOCKET) {
-        int sent = 0;
-        while (sent < length) {
-            int result = send(deviceContext->ClientSocket, buffer + sent, length - sent, 0);
-            if (result == SOCKET_ERROR) {
-                Trace(TRACE_LEVEL_ERROR, "send error %#x",
-                    WSAGetLastError());
-                break;
-            }
-            if (result == 0) {
-                Trace(TRACE_LEVEL_ERROR, "send  returned zero!");
-                break;
-            }
-            sent += result;
-            deviceContext->Stats.bytesWritten += result;
-        }
+    UINT32 result = EngineWrite(&deviceContext->Engine, buffer, length);
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "send error %#x",
+            result);
     }
     return NO_ERROR;
 }
 
-void calculateReadTimers(PDEVICE_CONTEXT deviceContext)
+//
+// microseconds since a QueryPerformanceCounter value.
+//
+static ULONGLONG ElapsedUs(LARGE_INTEGER since)
 {
-    PREQUEST_CONTEXT requestContext = GetRequestContext(deviceContext->CurrentRequest);
-    deviceContext->NumberNeededForRead = requestContext->Length;
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
 
-    WdfTimerStop(deviceContext->IntervalTimer, FALSE);
-    WdfTimerStop(deviceContext->TotalTimer, FALSE);
+    if (Globals.PerfFrequency.QuadPart == 0 || now.QuadPart <= since.QuadPart) {
+        return 0;
+    }
+    return ((ULONGLONG)(now.QuadPart - since.QuadPart) * 1000000) /
+        Globals.PerfFrequency.QuadPart;
+}
 
-    deviceContext->returnWithWhatsPresent = FALSE;
-    deviceContext->os2ssreturn = FALSE;
-    deviceContext->crunchDownToOne = FALSE;
-    deviceContext->UseTotalTimer = FALSE;
-    deviceContext->UseIntervalTimer = FALSE;
+//
+// all read requests taken from the ReadQueue are completed here
+// so that the completion latency is accounted for.
+//
+void CompleteReadRequest(PDEVICE_CONTEXT deviceContext,
+    WDFREQUEST request,
+    NTSTATUS status,
+    ULONG_PTR information)
+{
+    PREQUEST_CONTEXT requestContext = GetRequestContext(request);
+    ULONGLONG latencyUs = ElapsedUs(requestContext->QueuedTime);
+    deviceContext->Stats.readsCompleted++;
+    deviceContext->Stats.readLatencySumUs += latencyUs;
+    HistogramAdd(deviceContext->Stats.readLatencyUs, latencyUs);
+
+    TimelineRecord(deviceContext->Timeline, HtsTimelineReadCompleted,
+        requestContext->CorrelationId, status, (INT64)information);
+    if (deviceContext->CurrentCorrelationId == requestContext->CorrelationId) {
+        deviceContext->CurrentCorrelationId = 0;
+    }
 
-    ULONG multiplierVal = 0;
-    ULONG constantVal = 0;
-    LARGE_INTEGER totalTime = { 0 };
-    SERIAL_TIMEOUTS timeoutsForIrp = deviceContext->Timeouts;
+    WdfRequestCompleteWithInformation(request, status, information);
+}
 
-    if (timeoutsForIrp.ReadIntervalTimeout &&
-        (timeoutsForIrp.ReadIntervalTimeout !=
-            MAXULONG)) 
-    {
-        deviceContext->UseIntervalTimer = TRUE;
-        deviceContext->IntervalTimeRelative.QuadPart = WDF_REL_TIMEOUT_IN_MS(timeoutsForIrp.ReadIntervalTimeout);
-        deviceContext->BytesFromLastRead =  0;
-        Trace(TRACE_LEVEL_VERBOSE, "UseIntervalTimer: %I64x", deviceContext->IntervalTimeRelative.QuadPart);
+//
+// completes CurrentRequest as the engine decided.
+//
+static void CompleteCurrentRequest(PDEVICE_CONTEXT deviceContext,
+    ENGINE_READ_STATUS readStatus)
+{
+    WDFREQUEST readRequest = deviceContext->CurrentRequest;
+    PREQUEST_CONTEXT requestContext = GetRequestContext(readRequest);
+    NTSTATUS status;
+    ULONG_PTR information = requestContext->Read.Information;
+
+    switch (readStatus) {
+    case EngineReadSuccess:
+        status = STATUS_SUCCESS;
+        break;
+    case EngineReadCancelled:
+        status = STATUS_CANCELLED;
+        break;
+    case EngineReadTimeout:
+        // ? if information > 0 STATUS_SUCCESS?
+        status = STATUS_TIMEOUT;
+        information = 0;
+        break;
+    default:
+        status = STATUS_UNSUCCESSFUL;
+        information = 0;
+        break;
     }
-    if (timeoutsForIrp.ReadIntervalTimeout == MAXULONG) {
-        //
-        // We need to do special return quickly stuff here.
-        //
-        // 1) If both constant and multiplier are
-        //    0 then we return immediately with whatever
-        //    we've got, even if it was zero.
-        //
-        // 2) If constant and multiplier are not MAXULONG
-        //    then return immediately if any characters
-        //    are present, but if nothing is there, then
-        //    use the timeouts as specified.
-        //
-        // 3) If multiplier is MAXULONG then do as in
-        //    "2" but return when the first character
-        //    arrives.
-        //
-        if (!timeoutsForIrp.ReadTotalTimeoutConstant &&
-            !timeoutsForIrp.ReadTotalTimeoutMultiplier) {
 
-            deviceContext->returnWithWhatsPresent = TRUE;
+    PlatformTimerStop(deviceContext->IntervalTimer);
+    PlatformTimerStop(deviceContext->TotalTimer);
+    deviceContext->CurrentRequest = NULL;
+    Trace(TRACE_LEVEL_VERBOSE, "complete req %p status %#x info %d",
+        readRequest, status, (int)information);
+    CompleteReadRequest(deviceContext, readRequest, status, information);
+}
 
-        }
-        else if ((timeoutsForIrp.ReadTotalTimeoutConstant != MAXULONG)
-            &&
-            (timeoutsForIrp.ReadTotalTimeoutMultiplier
-                != MAXULONG)) {
+//
+// completes CurrentRequest without data.
+//
+static void AbortCurrentRequest(PDEVICE_CONTEXT deviceContext,
+    NTSTATUS status)
+{
+    WDFREQUEST readRequest = deviceContext->CurrentRequest;
 
-            deviceContext->UseTotalTimer = TRUE;
-            deviceContext->os2ssreturn = TRUE;
-            multiplierVal = timeoutsForIrp.ReadTotalTimeoutMultiplier;
-            constantVal = timeoutsForIrp.ReadTotalTimeoutConstant;
+    EngineAbortRead(&deviceContext->Engine);
+    PlatformTimerStop(deviceContext->IntervalTimer);
+    PlatformTimerStop(deviceContext->TotalTimer);
+    deviceContext->CurrentRequest = NULL;
+    CompleteReadRequest(deviceContext, readRequest, status, 0);
+}
 
-            Trace(TRACE_LEVEL_INFO, "UseTotalTimer: os2ssreturn");
+static INT64 TimelineWaitResult(ULONG waitResult)
+{
+    if (waitResult == PLATFORM_WAIT_TIMEOUT) {
+        return WAIT_TIMEOUT;
+    }
+    if (waitResult == PLATFORM_WAIT_FAILED) {
+        return WAIT_FAILED;
+    }
+    return WAIT_OBJECT_0 + waitResult;
+}
 
-        }
-        else if ((timeoutsForIrp.ReadTotalTimeoutConstant != MAXULONG)
-            &&
-            (timeoutsForIrp.ReadTotalTimeoutMultiplier
-                == MAXULONG)) {
-
-            deviceContext->UseTotalTimer = TRUE;
-            deviceContext->os2ssreturn = TRUE;
-            deviceContext->crunchDownToOne = TRUE;
-            multiplierVal = 0;
-            constantVal = timeoutsForIrp.ReadTotalTimeoutConstant;
-            Trace(TRACE_LEVEL_INFO, "UseTotalTimer: os2ssreturn and crunchDownToOne");
+//
+// moves socket data to the receive ring. Returns EngineReadFailed if the
+// connection is gone and the current request cannot be completed from the
+// data already received.
+//
+static ENGINE_READ_STATUS ClientReceive(PDEVICE_CONTEXT deviceContext)
+{
+    PNET_ENGINE engine = &deviceContext->Engine;
+    ULONG received = 0;
+
+    deviceContext->Stats.totalSocketEvents++;
+
+    ENGINE_RECEIVE_STATUS receiveStatus = EngineReceive(engine, &received);
+    switch (receiveStatus) {
+    case EngineReceiveData:
+        Trace(TRACE_LEVEL_VERBOSE, "recv %d bytes. request %p",
+            received, deviceContext->CurrentRequest);
+        deviceContext->Stats.sockReadEvents++;
+        TimelineRecord(deviceContext->Timeline, HtsTimelineRecv,
+            deviceContext->CurrentCorrelationId, received);
+        return EngineReadPending;
+
+    case EngineReceiveIdle:
+        // this is normal.
+        Trace(TRACE_LEVEL_VERBOSE, "socket event zero!");
+        return EngineReadPending;
+
+    default:
+        break;
+    }
 
-        }
+    if (receiveStatus == EngineReceiveClosed) {
+        Trace(TRACE_LEVEL_ERROR, "recv 0: socket closed.");
     }
     else {
+        Trace(TRACE_LEVEL_ERROR, "recv error: %#x unexpected. Socket closed.", engine->LastError);
+    }
+
+    if (deviceContext->Config.clientMode) {
         //
-        // If both the multiplier and the constant are
-        // zero then don't do any total timeout processing.
+        // the reads wait for the reconnect, their timers still run.
         //
-        if (timeoutsForIrp.ReadTotalTimeoutMultiplier ||
-            timeoutsForIrp.ReadTotalTimeoutConstant) {
-            //
-            // We have some timer values to calculate.
-            //
-            deviceContext->UseTotalTimer = TRUE;
-            multiplierVal = timeoutsForIrp.ReadTotalTimeoutMultiplier;
-            constantVal = timeoutsForIrp.ReadTotalTimeoutConstant;
-
-        }
+        EngineDisconnect(engine);
+        deviceContext->Stats.disconnects++;
+        deviceContext->DisconnectedUs = PlatformTimeUs();
+        SetConnectionState(deviceContext, HtsConnectionReconnecting);
+        ConnectBackoffReset(&deviceContext->Backoff, (ULONG)deviceContext->DisconnectedUs);
+        PlatformTimerStart(deviceContext->ReconnectTimer, ConnectBackoffNext(&deviceContext->Backoff));
+        return EngineProcessRead(engine);
     }
 
-    if (deviceContext->UseTotalTimer) {
+    EngineClose(engine);
+    SetConnectionState(deviceContext, (deviceContext->ServiceSocket != INVALID_SOCKET) ?
+        HtsConnectionListening : HtsConnectionIdle);
 
-        deviceContext->TotalTimeRelative.QuadPart = WDF_REL_TIMEOUT_IN_MS(
-            ((UInt32x32To64(deviceContext->NumberNeededForRead,
-            multiplierVal) 
-                + constantVal))); 
-        Trace(TRACE_LEVEL_VERBOSE, "UseTotalTimer: %I64x", 
-            deviceContext->TotalTimeRelative.QuadPart);
+    //
+    // the current request still gets what was received before the close.
+    //
+    ENGINE_READ_STATUS readStatus = EngineProcessRead(engine);
+    if (readStatus == EngineReadPending && deviceContext->CurrentRequest) {
+        EngineAbortRead(engine);
+        readStatus = EngineReadFailed;
+    }
+    return readStatus;
+}
 
+//
+// a client has a connection again.
+//
+static void ClientConnected(PDEVICE_CONTEXT deviceContext)
+{
+    if (deviceContext->Stats.connectionState == HtsConnectionReconnecting) {
+        INT64 downtimeUs = (INT64)(PlatformTimeUs() - deviceContext->DisconnectedUs);
+        deviceContext->Stats.downtimeUs += downtimeUs;
+        deviceContext->Stats.lastDowntimeUs = downtimeUs;
+        Trace(TRACE_LEVEL_INFO, "reconnected to %s after %I64d us",
+            deviceContext->Config.address, downtimeUs);
     }
+    SetConnectionState(deviceContext, HtsConnectionConnected);
+}
 
+//
+// reconnects a client after its backoff delay. On failure the next delay
+// starts.
+//
+static void ClientReconnect(PDEVICE_CONTEXT deviceContext)
+{
+    deviceContext->Stats.reconnectAttempts++;
+    UINT32 result = ConnectClient(deviceContext, RECONNECT_TIMEOUT_MS);
+    if (result != NO_ERROR) {
+        ULONG delayMs = ConnectBackoffNext(&deviceContext->Backoff);
+        Trace(TRACE_LEVEL_INFO, "reconnect to %s error %#x, next in %lu ms",
+            deviceContext->Config.address, result, delayMs);
+        PlatformTimerStart(deviceContext->ReconnectTimer, delayMs);
+        return;
+    }
+
+    ClientConnected(deviceContext);
 }
 
-// returns true if the request was completed else false.
-void processRequest(PDEVICE_CONTEXT deviceContext,
-    WSANETWORKEVENTS * networkEvents)
+//
+// takes the endpoint ConfigureInPlace handed over, if it is still there.
+//
+static BOOL TakeNextConfig(PDEVICE_CONTEXT deviceContext, SOCKET* socket, PLATFORM_STREAM* stream)
 {
-    WDFREQUEST readRequest = deviceContext->CurrentRequest;
-    PREQUEST_CONTEXT requestContext = GetRequestContext(readRequest);
+    PlatformLockAcquire(&deviceContext->ConfigureLock);
+    BOOL taken = deviceContext->ConfigurePending;
+    if (taken) {
+        deviceContext->Config = deviceContext->NextConfig;
+        *socket = deviceContext->NextSocket;
+        *stream = deviceContext->NextStream;
+        deviceContext->NextSocket = INVALID_SOCKET;
+        deviceContext->NextStream = NULL;
+        deviceContext->ConfigurePending = FALSE;
+        deviceContext->Stats.inPlaceConfigures++;
+    }
+    PlatformLockRelease(&deviceContext->ConfigureLock);
+    if (taken) {
+        PlatformEventSet(deviceContext->ConfiguredEvent);
+    }
+    return taken;
+}
 
-    int result = recv(deviceContext->ClientSocket, 
-        (char*)requestContext->Buffer + requestContext->Information,
-        (int)requestContext->Length - requestContext->Information, 0);
-    if (result > 0) { 
-        // if result is less than length, this request
-        // should respect the read timers and wait for more
-        // data if required. 
-        // If deviceContext->returnWithWhatsPresent is true,
-        // just complete the request.
-        Trace(TRACE_LEVEL_VERBOSE, "recv %d bytes. Len: %d req: %p Info: %d Needed: %d",
-            result,
-            requestContext->Length,
-            readRequest,
-            requestContext->Information,
-            deviceContext->NumberNeededForRead);
-
-        deviceContext->Stats.sockRecvData++;
-        deviceContext->Stats.bytesRead += result;
-        deviceContext->NumberNeededForRead -= result;
-        requestContext->Information += result;
-        deviceContext->BytesFromLastRead = result;
-
-        if (deviceContext->returnWithWhatsPresent ||
-            (0 == deviceContext->NumberNeededForRead) ||
-            (deviceContext->os2ssreturn &&
-                requestContext->Information))
-        {
-            deviceContext->CurrentRequest = NULL;
-            Trace(TRACE_LEVEL_VERBOSE, "complete req %p info %d",
-                readRequest,
-                requestContext->Information);
-            WdfRequestCompleteWithInformation(readRequest, STATUS_SUCCESS, requestContext->Information);
-        }
+//
+// a client switches to the new connection. The receive ring and the current
+// read stay, writes kept while it was reconnecting go to the new peer.
+//
+static void ClientConfigure(PDEVICE_CONTEXT deviceContext)
+{
+    SOCKET socket;
+    PLATFORM_STREAM stream;
+    if (!TakeNextConfig(deviceContext, &socket, &stream)) {
         return;
     }
-    if (result == 0) { // TBD socket is closed?
-        Trace(TRACE_LEVEL_ERROR, "recv 0:");
-        deviceContext->CurrentRequest = NULL;
-        WdfRequestComplete(readRequest, STATUS_UNSUCCESSFUL); 
-        return;
+    PlatformTimerStop(deviceContext->ReconnectTimer);
+    UINT32 result = EngineAttach(&deviceContext->Engine, socket, stream);
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "send of kept writes error: %#x",
+            result);
     }
-    // error returned from recv.
-    // EWOULDBLOCK is expected
-    // any other error is a damaged connection
-    int wsaError = WSAGetLastError();
-    if (wsaError == WSAEWOULDBLOCK) {
-        if (FD_READ & networkEvents->lNetworkEvents) {
+    Trace(TRACE_LEVEL_INFO, "client switched to %s:%d transport %d",
+        deviceContext->Config.address, deviceContext->Config.port, deviceContext->Config.transport);
+    ClientConnected(deviceContext);
+}
 
-            networkEvents->lNetworkEvents = 0;
-        }
-        deviceContext->BytesFromLastRead = 0;
-        Trace(TRACE_LEVEL_VERBOSE, "recv error: WSAEWOULDBLOCK");
-        return;
+//
+// the wait sources of the client loop, see CLIENT_WAIT_SOURCE. The socket
+// is the first, or the reconnect timer while there is none.
+//
+static UINT32 ClientWaiterCreate(PDEVICE_CONTEXT deviceContext, PPLATFORM_WAITER* waiter)
+{
+    PNET_ENGINE engine = &deviceContext->Engine;
+
+    UINT32 result = PlatformWaiterCreate(waiter);
+    if (result == NO_ERROR) {
+        result = EngineConnected(engine) ?
+            EngineWaiterAdd(engine, *waiter) :
+            PlatformWaiterAddTimer(*waiter, deviceContext->ReconnectTimer);
     }
-    // any other recv error is a broken connection.
-    Trace(TRACE_LEVEL_ERROR, "recv error: %#x unexpected. Socket closed.", wsaError);
-    deviceContext->CurrentRequest = NULL;
-    WdfRequestComplete(readRequest, STATUS_UNSUCCESSFUL);
-    closesocket(deviceContext->ClientSocket);
-    deviceContext->ClientSocket = INVALID_SOCKET;
-    return;
+    if (result == NO_ERROR) {
+        result = PlatformWaiterAddEvent(*waiter, deviceContext->ThreadEvent);
+    }
+    if (result == NO_ERROR) {
+        result = PlatformWaiterAddEvent(*waiter, deviceContext->ReadQueueEvent);
+    }
+    if (result == NO_ERROR) {
+        result = PlatformWaiterAddEvent(*waiter, deviceContext->CancelEvent);
+    }
+    if (result == NO_ERROR) {
+        result = PlatformWaiterAddTimer(*waiter, deviceContext->IntervalTimer);
+    }
+    if (result == NO_ERROR) {
+        result = PlatformWaiterAddTimer(*waiter, deviceContext->TotalTimer);
+    }
+    if (result == NO_ERROR) {
+        result = PlatformWaiterAddTimer(*waiter, deviceContext->OverflowTimer);
+    }
+    if (result == NO_ERROR) {
+        result = PlatformWaiterAddEvent(*waiter, deviceContext->Config.clientMode ?
+            deviceContext->ConfigureEvent : deviceContext->ClientStopEvent);
+    }
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "client wait setup error %#x",
+            result);
+        PlatformWaiterClose(*waiter);
+        *waiter = NULL;
+    }
+    return result;
 }
 
-DWORD ClientThread(PVOID context)
+//
+// the sources whose wake ups are arrivals for the spin, new data and new
+// requests.
+//
+static ULONG ClientArrivals(PCLIENT_LOOP loop)
+{
+    return (loop->WaiterConnected ? (1 << ClientWaitSocket) : 0) | (1 << ClientWaitReadQueue);
+}
+
+static POOL_WORK_STATUS ClientExit(PDEVICE_CONTEXT deviceContext)
+{
+    if (deviceContext->CurrentRequest) {
+        AbortCurrentRequest(deviceContext, STATUS_UNSUCCESSFUL);
+    }
+    PlatformWaiterClose(deviceContext->ClientLoop.Waiter);
+    deviceContext->ClientLoop.Waiter = NULL;
+    return PoolWorkDone;
+}
+
+//
+// the client loop, a work of the worker pool. A run serves the port until
+// it has to wait, then hands the waiter to the pool, which runs it again on
+// a wake up or a timeout. The state of the loop is in ClientLoop.
+//
+static POOL_WORK_STATUS ClientRun(PVOID context, BOOL timedOut, PPLATFORM_WAITER* waitOn, ULONG* timeoutMs)
 {
     PQUEUE_CONTEXT queueContext = (PQUEUE_CONTEXT)context;
     PDEVICE_CONTEXT deviceContext = queueContext->DeviceContext;
+    PNET_ENGINE engine = &deviceContext->Engine;
+    PCLIENT_LOOP loop = &deviceContext->ClientLoop;
+
+    // HTS_VSP_PRIORITY has the values of PLATFORM_PRIORITY.
+    PoolWorkSchedule((PLATFORM_PRIORITY)deviceContext->Schedule.priority, deviceContext->Schedule.affinity);
+    if (loop->Waiter == NULL) {
+        loop->WaiterConnected = EngineConnected(engine);
+        loop->WaiterSocket = engine->Socket;
+        loop->WaiterStream = engine->Stream;
+        loop->SocketEnabled = TRUE;
+        loop->SampleWake = FALSE;
+        loop->OverflowTimerRunning = FALSE;
+        loop->Waiting = FALSE;
+        if (ClientWaiterCreate(deviceContext, &loop->Waiter) != NO_ERROR) {
+            return PoolWorkDone;
+        }
+        deviceContext->CurrentRequest = NULL;
+        EngineAbortRead(engine);
+    }
 
-    HANDLE eventArray[] = {
-        deviceContext->ClientSocketEvent,
-        deviceContext->ThreadEvent,
-        deviceContext->ReadQueueEvent,
-        deviceContext->CancelEvent,
-        deviceContext->IntervalTimerEvent,
-        deviceContext->TotalTimerEvent
-    };
-    DWORD nEvents = sizeof(eventArray) / sizeof(HANDLE);
-
-    deviceContext->CurrentRequest = NULL;
     //
-    // loop until terminated.
+    // loop until terminated, or until the port has to wait or had its turns.
     //
-    WSANETWORKEVENTS networkEvents = { 0 };
-    BOOL waitTimeout = false;
-
-    while (!deviceContext->TerminateThread)
+    for (ULONG turn = 0; !deviceContext->TerminateThread; turn++)
     {
         NTSTATUS status;
         WDFREQUEST readRequest;
-
-        if (deviceContext->ClientSocket == INVALID_SOCKET)
-        {
-            Trace(TRACE_LEVEL_ERROR, "client socket closed");
-            break;
+        ULONG waitResult;
+
+        if (loop->Waiting) {
+            loop->Waiting = FALSE;
+            waitResult = EngineWaitWoken(engine, loop->Waiter, timedOut, ClientArrivals(loop));
+            if (waitResult == PLATFORM_WAIT_TIMEOUT && !timedOut) {
+                // what woke it is gone by now, it waits again.
+                if (deviceContext->CurrentRequest) {
+                    WdfRequestUnmarkCancelable(deviceContext->CurrentRequest);
+                }
+                continue;
+            }
         }
+        else {
+            if (turn == POOL_WORK_TURNS) {
+                return PoolWorkYield;
+            }
+            if (!EngineConnected(engine) && !deviceContext->Config.clientMode)
+            {
+                Trace(TRACE_LEVEL_ERROR, "client socket closed");
+                break;
+            }
 
-        if (!deviceContext->CurrentRequest) {
-            status = WdfIoQueueRetrieveNextRequest(queueContext->ReadQueue, &readRequest);
-            if (NT_SUCCESS(status)) {
-                deviceContext->CurrentRequest = readRequest;
-                deviceContext->Stats.readDequeue++;
-                calculateReadTimers(deviceContext);
+            //
+            // the socket source comes and goes with the connection.
+            //
+            if (engine->Socket != loop->WaiterSocket || engine->Stream != loop->WaiterStream) {
+                PlatformWaiterClose(loop->Waiter);
+                loop->Waiter = NULL;
+                if (ClientWaiterCreate(deviceContext, &loop->Waiter) != NO_ERROR) {
+                    break;
+                }
+                loop->WaiterConnected = EngineConnected(engine);
+                loop->WaiterSocket = engine->Socket;
+                loop->WaiterStream = engine->Stream;
+                loop->SocketEnabled = TRUE;
             }
-        }
 
-        if ((deviceContext->CurrentRequest) &&
-            ((FD_READ & networkEvents.lNetworkEvents) ||
-                (waitTimeout)))
-        {
-            if (waitTimeout) {
-                waitTimeout = false;
+            if (!deviceContext->CurrentRequest) {
+                status = WdfIoQueueRetrieveNextRequest(queueContext->ReadQueue, &readRequest);
+                if (NT_SUCCESS(status)) {
+                    PREQUEST_CONTEXT requestContext = GetRequestContext(readRequest);
+                    if (loop->SampleWake) {
+                        // the request woke the waiting loop, EvtIoRead timed it.
+                        EngineSpinWakeLatency(engine, ElapsedUs(requestContext->QueuedTime));
+                    }
+                    deviceContext->CurrentRequest = readRequest;
+                    deviceContext->Stats.readDequeue++;
+                    deviceContext->CurrentCorrelationId = requestContext->CorrelationId;
+                    TimelineRecord(deviceContext->Timeline, HtsTimelineReadDequeued,
+                        deviceContext->CurrentCorrelationId);
+                    EngineStartRead(engine, &requestContext->Read, &deviceContext->Timeouts);
+                    if (engine->Timers.UseTotalTimer) {
+                        Trace(TRACE_LEVEL_VERBOSE, "set total timer to %I64u ms",
+                            engine->Timers.TotalMs);
+                        PlatformTimerStart(deviceContext->TotalTimer, engine->Timers.TotalMs);
+                    }
+                }
             }
-            processRequest(deviceContext, &networkEvents);
-		}
-		// either consumes CurrentRequest by completing it
-		// or the CurrentRequest needs to wait for more data.
-	    // if the request was not completed wait for events
-        if (deviceContext->CurrentRequest) {
+
             //
-            // mark request cancelable.
+            // serve the request from data already received. Either completes
+            // CurrentRequest or it needs to wait for more data.
             //
-            status = WdfRequestMarkCancelableEx(deviceContext->CurrentRequest, EvtReadRequestCancel);
-            if (!NT_SUCCESS(status)) {
-                WdfRequestComplete(deviceContext->CurrentRequest, status);
-                deviceContext->CurrentRequest = NULL;
-                continue;
+            if (deviceContext->CurrentRequest) {
+                ENGINE_READ_STATUS readStatus = EngineProcessRead(engine);
+                if (engine->BytesFromLastRead && engine->Timers.UseIntervalTimer) {
+                    // the interval restarts with every byte.
+                    PlatformTimerStart(deviceContext->IntervalTimer, engine->Timers.IntervalMs);
+                }
+                if (readStatus != EngineReadPending) {
+                    CompleteCurrentRequest(deviceContext, readStatus);
+                    continue;
+                }
+                //
+                // mark request cancelable.
+                //
+                status = WdfRequestMarkCancelableEx(deviceContext->CurrentRequest, EvtReadRequestCancel);
+                if (!NT_SUCCESS(status)) {
+                    AbortCurrentRequest(deviceContext, status);
+                    continue;
+                }
             }
-            // set up timers
-            if (deviceContext->UseIntervalTimer) {
-                Trace(TRACE_LEVEL_VERBOSE, "set interval timer to %I64x",
-                    deviceContext->IntervalTimeRelative.QuadPart);
-                WdfTimerStart(deviceContext->IntervalTimer, deviceContext->IntervalTimeRelative.QuadPart);
+
+            //
+            // from the high watermark of the receive ring down to the low one the
+            // data waits in the socket and tcp flow controls the peer.
+            //
+            BOOL receive = EngineReceiveAllowed(engine);
+            if (receive != loop->SocketEnabled && loop->WaiterConnected) {
+                EngineWaiterEnable(engine, loop->Waiter, receive);
+                loop->SocketEnabled = receive;
             }
-            else {
-                WdfTimerStop(deviceContext->IntervalTimer, FALSE);
+            //
+            // an overflow timeout limits how long the peer is stopped.
+            //
+            ULONG overflowMs = EngineOverflowTimeout(engine);
+            if ((overflowMs != 0) != loop->OverflowTimerRunning) {
+                if (overflowMs) {
+                    PlatformTimerStart(deviceContext->OverflowTimer, overflowMs);
+                }
+                else {
+                    PlatformTimerStop(deviceContext->OverflowTimer);
+                }
+                loop->OverflowTimerRunning = overflowMs != 0;
             }
-            if (deviceContext->UseTotalTimer) {
-                Trace(TRACE_LEVEL_VERBOSE, "set total timer to %I64x",
-                    deviceContext->TotalTimeRelative.QuadPart);
-                WdfTimerStart(deviceContext->TotalTimer, deviceContext->TotalTimeRelative.QuadPart);
+
+            ULONG timeout = INFINITE;
+            if (deviceContext->CurrentRequest &&
+                !engine->Timers.UseIntervalTimer &&
+                !engine->Timers.UseTotalTimer) {
+                timeout = 500;
             }
-            else {
-                WdfTimerStop(deviceContext->TotalTimer, FALSE);
+            //
+            // nothing to do after the spin, the port waits without a worker.
+            //
+            waitResult = EngineWaitPoll(engine, loop->Waiter, &timeout, ClientArrivals(loop));
+            if (waitResult == PLATFORM_WAIT_TIMEOUT && timeout != 0) {
+                loop->Waiting = TRUE;
+                *waitOn = loop->Waiter;
+                *timeoutMs = timeout;
+                return PoolWorkWait;
             }
         }
-        DWORD timeout = INFINITE;
-        if (deviceContext->CurrentRequest &&
-            !deviceContext->UseIntervalTimer &&
-            !deviceContext->UseTotalTimer) {
-            timeout = 500;
-        }
-        DWORD eventIndex = WSAWaitForMultipleEvents(nEvents, eventArray, false, 
-            timeout,
-            true);
+        loop->SampleWake = waitResult == ClientWaitReadQueue &&
+            engine->Spin.LastWaitBlocked &&
+            !deviceContext->CurrentRequest;
         if (deviceContext->CurrentRequest) {
             WdfRequestUnmarkCancelable(deviceContext->CurrentRequest);
         }
+        TimelineRecord(deviceContext->Timeline, HtsTimelineWake,
+            deviceContext->CurrentCorrelationId, TimelineWaitResult(waitResult));
 
-        switch (eventIndex) {
-        case WAIT_TIMEOUT:
-        {
-            waitTimeout = true;
-
+        ENGINE_READ_STATUS readStatus = EngineReadPending;
+        switch (waitResult) {
+        case PLATFORM_WAIT_TIMEOUT:
             if (deviceContext->CurrentRequest) {
                 PREQUEST_CONTEXT requestContext = GetRequestContext(deviceContext->CurrentRequest);
-                requestContext->WaitTimeouts++;
-
-                if (requestContext->WaitTimeouts >= Globals.WaitUnits) {
+                readStatus = EngineWaitTimeout(engine, Globals.WaitUnits);
+                if (readStatus != EngineReadPending) {
                     deviceContext->Stats.waitTimeouts++;
-                    ULONG level = requestContext->Information ? TRACE_LEVEL_INFO : TRACE_LEVEL_VERBOSE;
+                    ULONG level = requestContext->Read.Information ? TRACE_LEVEL_INFO : TRACE_LEVEL_VERBOSE;
                     Trace(level, "complete request STATUS_TIMEOUT n= %d Info: %d",
-                        requestContext->WaitTimeouts,
-                        requestContext->Information);
-                    // ? if information > 0 STATUS_SUCCESS?
-                    WdfRequestCompleteWithInformation(deviceContext->CurrentRequest,
-                        STATUS_TIMEOUT, 0);
-                    deviceContext->CurrentRequest = NULL;
+                        requestContext->Read.WaitTimeouts,
+                        requestContext->Read.Information);
                 }
             }
             break;
-        }
 
-        case WAIT_OBJECT_0: // socket event
-		{
-			deviceContext->Stats.totalSocketEvents++;
-			networkEvents.lNetworkEvents = 0;
-            if (SOCKET_ERROR == WSAEnumNetworkEvents(deviceContext->ClientSocket,
-                deviceContext->ClientSocketEvent, &networkEvents)) {
-                Trace(TRACE_LEVEL_ERROR, "WSAEnumNetworkEvents error %d",
-                    WSAGetLastError());
-            }
-			if (FD_READ & networkEvents.lNetworkEvents)
-			{
-				// there is recv data
-				Trace(TRACE_LEVEL_VERBOSE, "socket event request %p",
-					deviceContext->CurrentRequest);
-				deviceContext->Stats.sockReadEvents++;
-                /// TBD: read all available data into the read ringbuffer.
-			}
-            else if (0 == networkEvents.lNetworkEvents) {
-                // this is normal.
-                Trace(TRACE_LEVEL_VERBOSE, "socket event zero!");
+        case ClientWaitSocket:
+            if (loop->WaiterConnected) {
+                readStatus = ClientReceive(deviceContext);
             }
             else {
-                Trace(TRACE_LEVEL_INFO, "unexpected socket event %x",
-                    networkEvents.lNetworkEvents);
+                ClientReconnect(deviceContext);
             }
             break;
 
-		}
-
-        case WAIT_OBJECT_0 + 1: // thread event: terminate.
+        case ClientWaitTerminate:
             Trace(TRACE_LEVEL_ERROR, "thread terminate event.");
             if (deviceContext->CurrentRequest) {
-                WdfRequestCompleteWithInformation(deviceContext->CurrentRequest,
-                    STATUS_CANCELLED, 0);
-                deviceContext->CurrentRequest = NULL;
+                AbortCurrentRequest(deviceContext, STATUS_CANCELLED);
             }
-            return 0;
+            return ClientExit(deviceContext);
 
-        case WAIT_OBJECT_0 + 2: // read queue event.
+        case ClientWaitReadQueue:
             deviceContext->Stats.readQueueEvents++;
             break;
 
-        case WAIT_OBJECT_0 +3: // cancel event.
+        case ClientWaitCancel:
             if (deviceContext->CurrentRequest) {
                 Trace(TRACE_LEVEL_INFO, "cancel event.");
-                WdfRequestCompleteWithInformation(deviceContext->CurrentRequest,
-                    STATUS_CANCELLED, 0);
-                deviceContext->CurrentRequest = NULL;
+                AbortCurrentRequest(deviceContext, STATUS_CANCELLED);
             }
             break;
 
-        case WAIT_OBJECT_0 + 4: // interval timer event.
+        case ClientWaitIntervalTimer:
+            TimelineRecord(deviceContext->Timeline, HtsTimelineTimerFired,
+                deviceContext->CurrentCorrelationId, 0);
             if (deviceContext->CurrentRequest) {
-                PREQUEST_CONTEXT requestContext = GetRequestContext(deviceContext->CurrentRequest);
                 Trace(TRACE_LEVEL_INFO, "interval timer event. bytes read: %d",
-                    requestContext->Information);
-
+                    GetRequestContext(deviceContext->CurrentRequest)->Read.Information);
                 deviceContext->Stats.intervalTimerEvents++;
-
-                if (requestContext->Information && 
-                    (deviceContext->BytesFromLastRead == 0)) {
-                    // timer doesn't start until at least one byte is read.
-
-                    WdfRequestCompleteWithInformation(deviceContext->CurrentRequest,
-                        STATUS_CANCELLED, requestContext->Information);
-                    deviceContext->CurrentRequest = NULL;
-                }
+                readStatus = EngineIntervalTimerExpired(engine);
             }
             break;
 
-        case WAIT_OBJECT_0 + 5: // total timer event.
+        case ClientWaitTotalTimer:
+            TimelineRecord(deviceContext->Timeline, HtsTimelineTimerFired,
+                deviceContext->CurrentCorrelationId, 1);
             if (deviceContext->CurrentRequest) {
-                PREQUEST_CONTEXT requestContext = GetRequestContext(deviceContext->CurrentRequest);
                 Trace(TRACE_LEVEL_INFO, "total timer event.");
-
                 deviceContext->Stats.totalTimerEvents++;
-
-                WdfRequestCompleteWithInformation(deviceContext->CurrentRequest,
-                    STATUS_CANCELLED, requestContext->Information);
-                deviceContext->CurrentRequest = NULL;
+                readStatus = EngineTotalTimerExpired(engine);
             }
             break;
 
-        case WSA_WAIT_IO_COMPLETION: // io completion interrupted the wait. retry.
-            Trace(TRACE_LEVEL_ERROR, "wait io completion event.");
+        case ClientWaitOverflowTimer:
+            loop->OverflowTimerRunning = FALSE;
+            EngineOverflowTimerExpired(engine);
+            if (engine->Overflow.Expired) {
+                Trace(TRACE_LEVEL_INFO, "receive ring full for %d ms, dropping",
+                    engine->Overflow.TimeoutMs);
+            }
             break;
 
-        default: // wtf event.
-            break;
-        }
-    }
-    return 0;
-}DWORD ServiceThread(PVOID context)
-{
-    PQUEUE_CONTEXT queueContext = (PQUEUE_CONTEXT)context;
-    PDEVICE_CONTEXT deviceContext = queueContext->DeviceContext;
-    int result;
-
-    HANDLE eventArray[3] = {
-        deviceContext->ServiceSocketEvent, // service socket accept event 
-        deviceContext->ThreadEvent,        //  terminate
-        NULL
-    };
-    //
-    // loop until terminated.
-    //
-    while (!deviceContext->TerminateThread)
-    {
-        WSANETWORKEVENTS networkEvents;
-        DWORD nEvents = eventArray[2] ? 3 : 2;
-
-        DWORD eventIndex = WSAWaitForMultipleEvents(nEvents, eventArray,
-            false, INFINITE, true);
-
-        switch (eventIndex) {
-        case WAIT_OBJECT_0:     // socket event
-        {
-            // only accept one connection at a time.
-            if (deviceContext->ClientSocket == INVALID_SOCKET) {
-                // reset the event only if we are going to do an accept.
-                WSAEnumNetworkEvents(deviceContext->ServiceSocket,
-                    deviceContext->ServiceSocketEvent, &networkEvents);
-
-                deviceContext->ClientSocket = accept(deviceContext->ServiceSocket, NULL, 0);
-                if (deviceContext->ClientSocket == INVALID_SOCKET) {
-                    Trace(TRACE_LEVEL_ERROR, "accept failure %#x",
-                        WSAGetLastError());
-                    break;
-                }
-
-                result = WSAEventSelect(deviceContext->ClientSocket,
-                    deviceContext->ClientSocketEvent,
-                    FD_READ);
-                if (result == SOCKET_ERROR) {
-                    Trace(TRACE_LEVEL_ERROR, "WSAEventSelect error % #x",
-                        WSAGetLastError());
-                    closesocket(deviceContext->ClientSocket);
-                    deviceContext->ClientSocket = INVALID_SOCKET;
-                    break;
-                }
-                deviceContext->ClientThreadHandle = CreateThread(NULL, 0, ClientThread, queueContext, 0, NULL);
-                if (deviceContext->ClientThreadHandle == NULL) {
-                    result = GetLastError();
-                    Trace(TRACE_LEVEL_ERROR, "CreateThread error: %#x",
-                        result);
-                    WSAEventSelect(deviceContext->ClientSocket,
-                        deviceContext->ClientSocketEvent,
-                        0);
-                    closesocket(deviceContext->ClientSocket);
-                    deviceContext->ClientSocket = INVALID_SOCKET;
-                    break;
-                }
-                eventArray[2] = deviceContext->ClientThreadHandle;
+        case ClientWaitConfigure:
+            if (!deviceContext->Config.clientMode) {
+                // ClientWaitStop, the service takes the next client.
+                Trace(TRACE_LEVEL_INFO, "client loop stop event.");
+                return ClientExit(deviceContext);
             }
+            ClientConfigure(deviceContext);
             break;
-        }
-        case WAIT_OBJECT_0 + 1:  //  terminate
-            return 0;
 
-        case WAIT_OBJECT_0 + 2: // client recv data available
-            break;
-        case WSA_WAIT_IO_COMPLETION: // io completion interrupted the wait. retry.
-            break;
         default:
+            Trace(TRACE_LEVEL_ERROR, "wait failed %#x", waitResult);
             break;
         }
+
+        if (readStatus != EngineReadPending) {
+            CompleteCurrentRequest(deviceContext, readStatus);
+        }
     }
-    return 0;
+
+    return ClientExit(deviceContext);
 }
 
-void stopThread(PDEVICE_CONTEXT deviceContext)
+//
+// the wait sources of the service loop, see SERVICE_WAIT_SOURCE. While the
+// loop of the last client finishes, the next client is pending and further
+// connections wait in the backlog.
+//
+static UINT32 ServiceWaiterCreate(PDEVICE_CONTEXT deviceContext, PPLATFORM_WAITER* waiter)
 {
-    TerminateThread(deviceContext->ThreadHandle, 0);
-    CloseHandle(deviceContext->ThreadHandle);
-    deviceContext->ThreadHandle = 0;
+    UINT32 result = PlatformWaiterCreate(waiter);
+    if (result == NO_ERROR) {
+        result = PlatformWaiterAddSocket(*waiter, deviceContext->ServiceSocket, PLATFORM_SOCKET_ACCEPT);
+    }
+    if (result == NO_ERROR) {
+        result = PlatformWaiterAddEvent(*waiter, deviceContext->ThreadEvent);
+    }
+    if (result == NO_ERROR) {
+        result = PlatformWaiterAddEvent(*waiter, deviceContext->ConfigureEvent);
+    }
+    if (result == NO_ERROR) {
+        result = PlatformWaiterAddEvent(*waiter, deviceContext->Taps.Event);
+    }
+    if (result == NO_ERROR && deviceContext->PendingClient != INVALID_SOCKET) {
+        result = PlatformWaiterAddEvent(*waiter, PoolWorkDoneEvent(deviceContext->ClientWork));
+        PlatformWaiterEnableSocket(*waiter, deviceContext->ServiceSocket, FALSE);
+    }
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "service wait setup error %#x",
+            result);
+        PlatformWaiterClose(*waiter);
+        *waiter = NULL;
+    }
+    return result;
 }
 
-void cleanupSocket(PDEVICE_CONTEXT deviceContext)
+static UINT32 ServiceWaiterReset(PDEVICE_CONTEXT deviceContext)
 {
-    WSAEventSelect(deviceContext->ClientSocket,
-        deviceContext->ClientSocketEvent,
-        0);
-    closesocket(deviceContext->ClientSocket);
-    deviceContext->ClientSocket = INVALID_SOCKET;
+    PlatformWaiterClose(deviceContext->ServiceWaiter);
+    deviceContext->ServiceWaiter = NULL;
+    return ServiceWaiterCreate(deviceContext, &deviceContext->ServiceWaiter);
 }
 
+//
+// starts the loop of a new client.
+//
+static void ServiceStartClient(PQUEUE_CONTEXT queueContext, SOCKET clientSocket)
+{
+    PDEVICE_CONTEXT deviceContext = queueContext->DeviceContext;
 
-UINT32
-ConfigureClient(PHTS_VSP_CONFIG vspConfig, PQUEUE_CONTEXT queueContext)
+    PlatformEventReset(deviceContext->ClientStopEvent);
+    EngineReset(&deviceContext->Engine);
+    EngineAttach(&deviceContext->Engine, clientSocket, NULL);
+    UINT32 result = PoolWorkStart(ClientRun, queueContext, &deviceContext->ClientWork);
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "client loop start error: %#x",
+            result);
+        EngineClose(&deviceContext->Engine);
+        return;
+    }
+    SetConnectionState(deviceContext, HtsConnectionConnected);
+}
+
+//
+// the first client drives the port. The clients that connect while it is
+// connected are taps, as many as the configuration takes. Fails if the
+// service cannot wait any more.
+//
+static UINT32 ServiceAccept(PQUEUE_CONTEXT queueContext)
 {
     PDEVICE_CONTEXT deviceContext = queueContext->DeviceContext;
 
-    CleanupNetwork(deviceContext);
+    SOCKET clientSocket = accept(deviceContext->ServiceSocket, NULL, NULL);
+    if (clientSocket == INVALID_SOCKET) {
+        UINT32 error = PlatformSocketLastError();
+        if (!PlatformSocketWouldBlock(error)) {
+            Trace(TRACE_LEVEL_ERROR, "accept failure %#x",
+                error);
+        }
+        return NO_ERROR;
+    }
+    int yes = 1;
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, (char*)&yes, sizeof(yes));
+
+    if (deviceContext->ClientWork != NULL) {
+        if (EngineConnected(&deviceContext->Engine)) {
+            if (TapAdd(&deviceContext->Taps, clientSocket)) {
+                Trace(TRACE_LEVEL_INFO, "tap connected, %d taps.",
+                    deviceContext->Stats.tapClients);
+                return NO_ERROR;
+            }
+            Trace(TRACE_LEVEL_INFO, "already connected, new connection closed.");
+            closesocket(clientSocket);
+            return NO_ERROR;
+        }
+        //
+        // the last client is gone. Its loop is stopped, and the new client
+        // waits until the loop is done rather than hold a worker on it.
+        //
+        deviceContext->PendingClient = clientSocket;
+        PlatformEventSet(deviceContext->ClientStopEvent);
+        return ServiceWaiterReset(deviceContext);
+    }
 
-    struct addrinfo hints = { };
-    hints.ai_flags = 0;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
+    ServiceStartClient(queueContext, clientSocket);
+    return NO_ERROR;
+}
 
-    std::string port = std::to_string(vspConfig->port);
-    struct addrinfo* srvAddr = NULL;
-    struct addrinfo* addr = NULL;
+//
+// the loop of the last client is done, the pending client takes its place.
+//
+static UINT32 ServiceClientDone(PQUEUE_CONTEXT queueContext)
+{
+    PDEVICE_CONTEXT deviceContext = queueContext->DeviceContext;
 
-    UINT32 result = WinSockCreate(&deviceContext->ClientSocket);
+    PoolWorkJoin(deviceContext->ClientWork, 0);
+    deviceContext->ClientWork = NULL;
+    SOCKET clientSocket = deviceContext->PendingClient;
+    deviceContext->PendingClient = INVALID_SOCKET;
+    UINT32 result = ServiceWaiterReset(deviceContext);
     if (result != NO_ERROR) {
-        // no point in continuing.
-        Trace(TRACE_LEVEL_ERROR, "WinSockCreate error: %#x",
-            result);
-        goto cleanup;
+        closesocket(clientSocket);
+        return result;
+    }
+    ServiceStartClient(queueContext, clientSocket);
+    return NO_ERROR;
+}
+
+//
+// the service loop, a work of the worker pool. A run takes one wake up, then
+// waits again for the next.
+//
+static POOL_WORK_STATUS ServiceRun(PVOID context, BOOL timedOut, PPLATFORM_WAITER* waitOn, ULONG* timeoutMs)
+{
+    PQUEUE_CONTEXT queueContext = (PQUEUE_CONTEXT)context;
+    PDEVICE_CONTEXT deviceContext = queueContext->DeviceContext;
+
+    PoolWorkSchedule((PLATFORM_PRIORITY)deviceContext->Schedule.priority, deviceContext->Schedule.affinity);
+    if (deviceContext->ServiceWaiter == NULL) {
+        if (ServiceWaiterCreate(deviceContext, &deviceContext->ServiceWaiter) != NO_ERROR) {
+            return PoolWorkDone;
+        }
+        deviceContext->ServiceTimeoutMs = INFINITE;
     }
-    result = getaddrinfo(vspConfig->address, port.c_str(), &hints, &srvAddr);
+    else if (!deviceContext->TerminateThread) {
+        //
+        // the taps are flushed after every wake up.
+        //
+        ULONG waitResult = timedOut ? PLATFORM_WAIT_TIMEOUT : PlatformWait(deviceContext->ServiceWaiter, 0);
+        if (waitResult == ServiceWaitConfigure) {
+            //
+            // listen on the new socket, a connected client and the taps stay
+            // until they close.
+            //
+            SOCKET listener;
+            PLATFORM_STREAM stream;
+            if (TakeNextConfig(deviceContext, &listener, &stream)) {
+                PlatformWaiterClose(deviceContext->ServiceWaiter);
+                deviceContext->ServiceWaiter = NULL;
+                closesocket(deviceContext->ServiceSocket);
+                deviceContext->ServiceSocket = listener;
+                Trace(TRACE_LEVEL_INFO, "service switched to %s:%d transport %d",
+                    deviceContext->Config.address, deviceContext->Config.port, deviceContext->Config.transport);
+                if (ServiceWaiterCreate(deviceContext, &deviceContext->ServiceWaiter) != NO_ERROR) {
+                    return PoolWorkDone;
+                }
+            }
+        }
+        else if (waitResult == ServiceWaitAccept) {
+            if (ServiceAccept(queueContext) != NO_ERROR) {
+                return PoolWorkDone;
+            }
+        }
+        else if (waitResult == ServiceWaitClientDone) {
+            if (ServiceClientDone(queueContext) != NO_ERROR) {
+                return PoolWorkDone;
+            }
+        }
+        if (waitResult != ServiceWaitTerminate) {
+            deviceContext->ServiceTimeoutMs = TapFlush(&deviceContext->Taps);
+        }
+    }
+
+    if (deviceContext->TerminateThread) {
+        PlatformWaiterClose(deviceContext->ServiceWaiter);
+        deviceContext->ServiceWaiter = NULL;
+        return PoolWorkDone;
+    }
+    *waitOn = deviceContext->ServiceWaiter;
+    *timeoutMs = deviceContext->ServiceTimeoutMs;
+    return PoolWorkWait;
+}
+
+//
+// connects Socket to the address of vspConfig that answers first, and keeps
+// the attempts in the report.
+//
+static UINT32 ConnectTcp(PHTS_VSP_CONFIG vspConfig, ULONG timeoutMs, PLATFORM_EVENT cancel,
+    PHTS_VSP_REPORT Stats, SOCKET* Socket)
+{
+    CONNECT_REPORT report;
+    int yes = 1;
+
+    UINT32 result = TcpConnect(vspConfig->address, vspConfig->port,
+        CONNECT_ATTEMPT_DELAY_MS, timeoutMs, cancel, Socket, &report);
+
+    for (ULONG index = 0; index < report.AttemptCount; index++) {
+        PHTS_VSP_CONNECT_ATTEMPT attempt = &report.Attempts[index];
+        if (attempt->error == HTS_VSP_CONNECT_ABANDONED) {
+            Trace(TRACE_LEVEL_INFO, "attempt %lu %s started at %lu us abandoned",
+                index, attempt->address, attempt->startUs);
+        }
+        else {
+            Trace(TRACE_LEVEL_INFO, "attempt %lu %s started at %lu us error %#x after %lu us",
+                index, attempt->address, attempt->startUs, attempt->error, attempt->latencyUs);
+        }
+    }
+    Stats->connectLatencyUs = report.LatencyUs;
+    Stats->connectAttemptCount = report.AttemptCount;
+    RtlCopyMemory(Stats->connectAttempts, report.Attempts,
+        report.AttemptCount * sizeof(report.Attempts[0]));
     if (result != NO_ERROR) {
-        Trace(TRACE_LEVEL_ERROR, "getaddrinfo error %#x",
+        return result;
+    }
+
+    result = setsockopt(*Socket, IPPROTO_TCP, TCP_NODELAY, (char*)&yes, sizeof(yes));
+    if (result == SOCKET_ERROR) {
+        result = PlatformSocketLastError();
+        Trace(TRACE_LEVEL_ERROR, "setsockopt NO_DELAY error: %#x",
             result);
-        goto cleanup;
     }
+    return result;
+}
 
-    result = ERROR_NO_MORE_ITEMS;
-    for (addr = srvAddr; addr != NULL; addr = addr->ai_next) {
-        // we can retry connect on each available addresses.
-        result = connect(deviceContext->ClientSocket, addr->ai_addr, (int) addr->ai_addrlen);
-        if (result == NO_ERROR) {
-            Trace(TRACE_LEVEL_INFO,
-                "connected to %s:%d",
-                vspConfig->address, vspConfig->port);
-            break;
-        }
+//
+// the address of a unix domain socket at path.
+//
+static UINT32 UnixAddress(const char* path, sockaddr_un* address)
+{
+    size_t length = strnlen(path, sizeof(address->sun_path));
+    if (length == 0 || length == sizeof(address->sun_path)) {
+        Trace(TRACE_LEVEL_ERROR, "invalid unix socket path");
+        return ERROR_INVALID_PARAMETER;
     }
+    RtlZeroMemory(address, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    RtlCopyMemory(address->sun_path, path, length);
+    return NO_ERROR;
+}
 
+static UINT32 ConnectUnix(PHTS_VSP_CONFIG vspConfig, SOCKET* Socket)
+{
+    sockaddr_un address;
+    UINT32 result = UnixAddress(vspConfig->address, &address);
     if (result == NO_ERROR) {
-        
-        // note that this sets the TCP_NODELAY property on the socket.
-        result = WSAEventSelect(deviceContext->ClientSocket,
-            deviceContext->ClientSocketEvent,
-            FD_READ);
-        if (result == SOCKET_ERROR) {
-            result = WSAGetLastError();
-            Trace(TRACE_LEVEL_ERROR, "WSAEventSelect error: %#x",
-                result);
-            goto cleanup;
+        result = WinSockCreate(Socket, AF_UNIX);
+    }
+    if (result == NO_ERROR &&
+        connect(*Socket, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+        result = PlatformSocketLastError();
+    }
+    return result;
+}
 
+//
+// connects Socket or Stream to the endpoint of vspConfig. A tcp connect gives
+// up when cancel, if not NULL, is signalled.
+//
+static UINT32 ConnectEndpoint(PHTS_VSP_CONFIG vspConfig, ULONG timeoutMs, PLATFORM_EVENT cancel,
+    PHTS_VSP_REPORT Stats, SOCKET* Socket, PLATFORM_STREAM* Stream)
+{
+    *Socket = INVALID_SOCKET;
+    *Stream = NULL;
+
+    UINT32 result;
+    switch (vspConfig->transport) {
+    case HtsTransportTcp:
+        result = ConnectTcp(vspConfig, timeoutMs, cancel, Stats, Socket);
+        break;
+
+    case HtsTransportUnix:
+        result = ConnectUnix(vspConfig, Socket);
+        break;
+
+    case HtsTransportPipe:
+        result = PlatformPipeConnect(vspConfig->address, Stream);
+        break;
+
+    case HtsTransportShm:
+        result = PlatformShmConnect(vspConfig->address, Stream);
+        break;
+
+    case HtsTransportMux:
+        result = MuxChannelOpen(vspConfig->address, vspConfig->port, vspConfig->channel,
+            timeoutMs, Stream);
+        break;
+
+    case HtsTransportUdp:
+        result = UdpStreamOpen(vspConfig->address, vspConfig->port, timeoutMs, Stats, Stream);
+        break;
+
+    default:
+        result = ERROR_INVALID_PARAMETER;
+        break;
+    }
+    if (result != NO_ERROR) {
+        if (*Socket != INVALID_SOCKET) {
+            closesocket(*Socket);
+            *Socket = INVALID_SOCKET;
         }
-        int yes = 1;
-        result = setsockopt(deviceContext->ClientSocket, IPPROTO_TCP, TCP_NODELAY, (char*)&yes, sizeof(yes));
-        if (result == SOCKET_ERROR) {
-            result = WSAGetLastError();
-            Trace(TRACE_LEVEL_ERROR, "setsockopt NO_DELAY error: %#x",
-                result);
-            goto cleanup;
+        return result;
+    }
+    if (*Socket != INVALID_SOCKET && vspConfig->compression == HtsCompressionLz) {
+        result = CompressStreamOpen(*Socket, timeoutMs, Stats, Stream);
+        *Socket = INVALID_SOCKET;
+        if (result != NO_ERROR) {
+            Trace(TRACE_LEVEL_ERROR,
+                "%s:%d does not compress, error %d",
+                vspConfig->address, vspConfig->port, result);
+            return result;
+        }
+    }
+    Trace(TRACE_LEVEL_INFO,
+        "connected to %s:%d transport %d",
+        vspConfig->address, vspConfig->port, vspConfig->transport);
+    return NO_ERROR;
+}
+
+//
+// connects to deviceContext->Config and makes it the connection of the
+// engine, after the writes kept while it was lost.
+//
+static UINT32 ConnectClient(PDEVICE_CONTEXT deviceContext, ULONG timeoutMs)
+{
+    SOCKET socket;
+    PLATFORM_STREAM stream;
+
+    UINT32 result = ConnectEndpoint(&deviceContext->Config, timeoutMs, deviceContext->ThreadEvent,
+        &deviceContext->Stats, &socket, &stream);
+    if (result != NO_ERROR) {
+        return result;
+    }
+
+    UINT32 sendResult = EngineAttach(&deviceContext->Engine, socket, stream);
+    if (sendResult != NO_ERROR) {
+        // the connection is lost again, the client loop finds out.
+        Trace(TRACE_LEVEL_ERROR, "send of kept writes error: %#x",
+            sendResult);
+    }
+    return NO_ERROR;
+}
 
+//
+// hands a new endpoint to the running thread, which switches to it and keeps
+// its events, timers, receive ring and current read. Returns FALSE if the
+// thread did not take it in time, the caller then closes the endpoint and
+// starts over.
+//
+static BOOL ConfigureInPlace(PDEVICE_CONTEXT deviceContext, PHTS_VSP_CONFIG vspConfig,
+    SOCKET socket, PLATFORM_STREAM stream)
+{
+    PPLATFORM_WAITER waiter = NULL;
+
+    PlatformEventReset(deviceContext->ConfiguredEvent);
+    PlatformLockAcquire(&deviceContext->ConfigureLock);
+    deviceContext->NextConfig = *vspConfig;
+    deviceContext->NextSocket = socket;
+    deviceContext->NextStream = stream;
+    deviceContext->ConfigurePending = TRUE;
+    PlatformLockRelease(&deviceContext->ConfigureLock);
+    PlatformEventSet(deviceContext->ConfigureEvent);
+
+    //
+    // a client loop may be in a send or a reconnect, which gives up after
+    // RECONNECT_TIMEOUT_MS.
+    //
+    if (PlatformWaiterCreate(&waiter) == NO_ERROR &&
+        PlatformWaiterAddEvent(waiter, deviceContext->ConfiguredEvent) == NO_ERROR) {
+        PlatformWait(waiter, 5000);
+    }
+    PlatformWaiterClose(waiter);
+
+    PlatformLockAcquire(&deviceContext->ConfigureLock);
+    BOOL taken = !deviceContext->ConfigurePending;
+    deviceContext->ConfigurePending = FALSE;
+    deviceContext->NextSocket = INVALID_SOCKET;
+    deviceContext->NextStream = NULL;
+    PlatformLockRelease(&deviceContext->ConfigureLock);
+    if (!taken) {
+        Trace(TRACE_LEVEL_ERROR, "network thread did not take the configuration");
+    }
+    return taken;
+}
+
+UINT32
+ConfigureClient(PHTS_VSP_CONFIG vspConfig, PQUEUE_CONTEXT queueContext, BOOL background)
+{
+    PDEVICE_CONTEXT deviceContext = queueContext->DeviceContext;
+    UINT32 result;
+
+    //
+    // a running client connects first and keeps its connection if that
+    // fails.
+    //
+    if (!background && deviceContext->Work != NULL && deviceContext->Config.clientMode) {
+        SOCKET socket;
+        PLATFORM_STREAM stream;
+        result = ConnectEndpoint(vspConfig, CONNECT_TIMEOUT_MS, NULL, &deviceContext->Stats, &socket, &stream);
+        if (result != NO_ERROR) {
+            Trace(TRACE_LEVEL_ERROR, "connect to %s error: %#x",
+                vspConfig->address, result);
+            return STATUS_UNSUCCESSFUL;
         }
-        deviceContext->ThreadHandle = CreateThread(NULL, 0, ClientThread, queueContext, 0, NULL);
-        if (deviceContext->ThreadHandle == NULL) {
-            result = GetLastError();
-            Trace(TRACE_LEVEL_ERROR, "CreateThread error: %#x",
-                result);
-            goto cleanup;
+        if (ConfigureInPlace(deviceContext, vspConfig, socket, stream)) {
+            return STATUS_SUCCESS;
+        }
+        if (socket != INVALID_SOCKET) {
+            closesocket(socket);
         }
-        Trace(TRACE_LEVEL_INFO, "client thread is ready.");
+        PlatformStreamClose(stream);
     }
 
-cleanup:
-    if (srvAddr) {
-        freeaddrinfo(srvAddr);
+    CleanupNetwork(deviceContext);
+    deviceContext->Config = *vspConfig;
+
+    EngineReset(&deviceContext->Engine);
+    if (background) {
+        //
+        // the client loop connects on the reconnect timer, the way it
+        // comes back from a lost connection.
+        //
+        EngineDisconnect(&deviceContext->Engine);
+        SetConnectionState(deviceContext, HtsConnectionConnecting);
+        ConnectBackoffReset(&deviceContext->Backoff, (ULONG)PlatformTimeUs());
+        PlatformTimerStart(deviceContext->ReconnectTimer, 0);
     }
+    else {
+        result = ConnectClient(deviceContext, CONNECT_TIMEOUT_MS);
+        if (result != NO_ERROR) {
+            Trace(TRACE_LEVEL_ERROR, "connect to %s error: %#x",
+                vspConfig->address, result);
+            goto cleanup;
+        }
+        SetConnectionState(deviceContext, HtsConnectionConnected);
+    }
+
+    result = PoolWorkStart(ClientRun, queueContext, &deviceContext->Work);
     if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "client loop start error: %#x",
+            result);
+        goto cleanup;
+    }
+    Trace(TRACE_LEVEL_INFO, "client loop is ready.");
 
-        if (deviceContext->ClientSocket != INVALID_SOCKET) {
-            cleanupSocket(deviceContext); 
-        }
-        if (deviceContext->ThreadHandle) {
-            stopThread(deviceContext);
-        }
+cleanup:
+    if (result != NO_ERROR) {
+        PlatformTimerStop(deviceContext->ReconnectTimer);
+        EngineClose(&deviceContext->Engine);
+        SetConnectionState(deviceContext, HtsConnectionIdle);
     }
     return result == NO_ERROR ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
 
+static UINT32 ListenTcp(PHTS_VSP_CONFIG vspConfig, SOCKET* Socket)
+{
+    if (*Socket != INVALID_SOCKET) {
+        closesocket(*Socket);
+    }
+    UINT32 result = TcpBind(vspConfig->address, vspConfig->port, Socket);
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "bind %s error: %#x",
+            vspConfig->address, result);
+    }
+    return result;
+}
 
+static UINT32 ListenUnix(PHTS_VSP_CONFIG vspConfig, SOCKET* Socket)
+{
+    sockaddr_un address;
+    UINT32 result = UnixAddress(vspConfig->address, &address);
+    if (result == NO_ERROR) {
+        result = WinSockCreate(Socket, AF_UNIX);
+    }
+    if (result == NO_ERROR) {
+        // the socket file of an earlier service is in the way.
+        DeleteFileA(vspConfig->address);
+        if (bind(*Socket, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+            result = PlatformSocketLastError();
+            Trace(TRACE_LEVEL_ERROR, "bind error: %#x",
+                result);
+        }
+    }
+    return result;
+}
 
 UINT32
 ConfigureService(PHTS_VSP_CONFIG vspConfig, PQUEUE_CONTEXT queueContext)
 {
     PDEVICE_CONTEXT deviceContext = queueContext->DeviceContext;
 
+    //
+    // a running socket service listens on the new address first. A client it
+    // serves stays connected. Binding the address it listens on fails, then
+    // it starts over.
+    //
+    if (deviceContext->Work != NULL && !deviceContext->Config.clientMode &&
+        deviceContext->ServiceSocket != INVALID_SOCKET &&
+        (vspConfig->transport == HtsTransportTcp || vspConfig->transport == HtsTransportUnix)) {
+        // the tap settings apply at once, connected taps stay.
+        TapConfigure(&deviceContext->Taps, vspConfig->taps, vspConfig->tapPolicy);
+        if (vspConfig->transport == deviceContext->Config.transport &&
+            vspConfig->port == deviceContext->Config.port &&
+            strcmp(vspConfig->address, deviceContext->Config.address) == 0) {
+            Trace(TRACE_LEVEL_INFO, "service configuration unchanged");
+            return STATUS_SUCCESS;
+        }
+        SOCKET listener = INVALID_SOCKET;
+        UINT32 result = (vspConfig->transport == HtsTransportTcp) ?
+            ListenTcp(vspConfig, &listener) :
+            ListenUnix(vspConfig, &listener);
+        if (result == NO_ERROR && listen(listener, 2) == SOCKET_ERROR) {
+            result = PlatformSocketLastError();
+        }
+        if (result == NO_ERROR &&
+            ConfigureInPlace(deviceContext, vspConfig, listener, NULL)) {
+            return STATUS_SUCCESS;
+        }
+        if (listener != INVALID_SOCKET) {
+            closesocket(listener);
+        }
+    }
+
     CleanupNetwork(deviceContext);
+    deviceContext->Config = *vspConfig;
+    TapConfigure(&deviceContext->Taps, vspConfig->taps, vspConfig->tapPolicy);
 
-    sockaddr_in service;
-    service.sin_family = AF_INET;
-    service.sin_addr.s_addr = htonl(INADDR_ANY);
-    service.sin_port = htons(vspConfig->port);
+    UINT32 result;
+    switch (vspConfig->transport) {
+    case HtsTransportTcp:
+        result = ListenTcp(vspConfig, &deviceContext->ServiceSocket);
+        break;
 
-    int result = bind(deviceContext->ServiceSocket, (sockaddr*)&service, sizeof(service));
-    if (result == SOCKET_ERROR) {
-        Trace(TRACE_LEVEL_ERROR, "WSACreateEvent error: %#x",
-            WSAGetLastError());
+    case HtsTransportUnix:
+        result = ListenUnix(vspConfig, &deviceContext->ServiceSocket);
+        break;
+
+    case HtsTransportPipe:
+    case HtsTransportShm:
+        //
+        // the pipe or the mapping is the connection, the client loop
+        // serves it without a service loop.
+        //
+        result = (vspConfig->transport == HtsTransportPipe) ?
+            PlatformPipeCreate(vspConfig->address, &deviceContext->Engine.Stream) :
+            PlatformShmCreate(vspConfig->address, 0, &deviceContext->Engine.Stream);
+        if (result != NO_ERROR) {
+            Trace(TRACE_LEVEL_ERROR, "stream %s create error: %#x",
+                vspConfig->address, result);
+            goto cleanup;
+        }
+        EngineReset(&deviceContext->Engine);
+        result = PoolWorkStart(ClientRun, queueContext, &deviceContext->ClientWork);
+        if (result != NO_ERROR) {
+            Trace(TRACE_LEVEL_ERROR, "client loop start error: %#x",
+                result);
+            goto cleanup;
+        }
+        SetConnectionState(deviceContext, HtsConnectionConnected);
         goto cleanup;
 
+    default:
+        result = ERROR_INVALID_PARAMETER;
+        break;
     }
-    result = listen(deviceContext->ServiceSocket, 2);
-    if (result == SOCKET_ERROR) {
-        Trace(TRACE_LEVEL_ERROR, "WSACreateEvent error: %#x",
-            WSAGetLastError());
+    if (result != NO_ERROR) {
         goto cleanup;
-
     }
-    result = WSAEventSelect(deviceContext->ServiceSocket,
-        deviceContext->ServiceSocketEvent,
-        FD_ACCEPT);
-    if (result == SOCKET_ERROR) {
-        Trace(TRACE_LEVEL_ERROR, "WSAEventSelect error: %#x",
-            WSAGetLastError());
+    if (listen(deviceContext->ServiceSocket, 2) == SOCKET_ERROR) {
+        result = PlatformSocketLastError();
+        Trace(TRACE_LEVEL_ERROR, "listen error: %#x",
+            result);
         goto cleanup;
 
     }
-    deviceContext->ThreadHandle = CreateThread(NULL, 0, ServiceThread, queueContext, 0, NULL);
-    if (deviceContext->ThreadHandle == NULL) {
-        result = GetLastError();
-        Trace(TRACE_LEVEL_ERROR, "CreateThread error: %#x",
+    result = PoolWorkStart(ServiceRun, queueContext, &deviceContext->Work);
+    if (result != NO_ERROR) {
+        Trace(TRACE_LEVEL_ERROR, "service loop start error: %#x",
             result);
         goto cleanup;
     }
 
+    SetConnectionState(deviceContext, HtsConnectionListening);
+    Trace(TRACE_LEVEL_INFO, "service loop is ready.");
+
 cleanup:
     if (result != NO_ERROR) {
 
         if (deviceContext->ServiceSocket != INVALID_SOCKET) {
-            WSAEventSelect(deviceContext->ServiceSocket,
-                deviceContext->ServiceSocketEvent,
-                0);
             closesocket(deviceContext->ServiceSocket);
             deviceContext->ServiceSocket = INVALID_SOCKET;
         }
-
-        if (deviceContext->ClientSocket != INVALID_SOCKET) {
-            WSAEventSelect(deviceContext->ClientSocket,
-                deviceContext->ClientSocketEvent,
-                0);
-            closesocket(deviceContext->ClientSocket);
-            deviceContext->ClientSocket = INVALID_SOCKET;
-        }
-
-        if (deviceContext->ThreadHandle) {
-            TerminateThread(deviceContext->ThreadHandle, 0);
-            CloseHandle(deviceContext->ThreadHandle);
-            deviceContext->ThreadHandle = 0;
-        }
+        EngineClose(&deviceContext->Engine);
     }
 
-    Trace(TRACE_LEVEL_INFO, "service thread is ready.");
-
     return result == NO_ERROR ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
-
-
-
-
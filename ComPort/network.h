@@ -10,7 +10,7 @@ UINT32 WinSockCleanup();
 
 
 _Success_(return == NO_ERROR)
-UINT32 WinSockCreate(SOCKET * pSocket);
+UINT32 WinSockCreate(SOCKET * pSocket, int family);
 
 void CloseNetwork(
     PDEVICE_CONTEXT deviceContext);
@@ -22,5 +22,14 @@ UINT32 WinSockSend(PDEVICE_CONTEXT deviceContext,
 UINT32
 ConfigureService(PHTS_VSP_CONFIG vspConfig, PQUEUE_CONTEXT queueContext);
 
+//
+// connects the client now, or with background the client loop connects
+// and retries with backoff while the writes are kept.
+//
 UINT32
-ConfigureClient(PHTS_VSP_CONFIG vspConfig, PQUEUE_CONTEXT queueContext);
\ No newline at end of file
+ConfigureClient(PHTS_VSP_CONFIG vspConfig, PQUEUE_CONTEXT queueContext, BOOL background);
+
+void CompleteReadRequest(PDEVICE_CONTEXT deviceContext,
+    WDFREQUEST request,
+    NTSTATUS status,
+    ULONG_PTR information);
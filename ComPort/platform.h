@@ -0,0 +1,417 @@
+/*++
+
+Module Name:
+
+    platform.h
+
+Abstract:
+
+    The socket, event, timer, thread and wait primitives used by the network
+    engine. platform_win.cpp implements them with winsock event select and
+    win32 objects, platform_posix.cpp with epoll, eventfd, timerfd and pthreads,
+    so the engine also builds and runs on linux.
+
+    Handles are opaque. A NULL handle is never valid.
+
+--*/
+
+#pragma once
+
+#ifdef _WIN32
+
+#include <winsock2.h>
+#include <Ws2tcpip.h>
+#include <afunix.h>
+
+typedef HANDLE PLATFORM_EVENT;
+typedef HANDLE PLATFORM_TIMER;
+typedef HANDLE PLATFORM_THREAD;
+typedef SRWLOCK PLATFORM_LOCK;
+
+#define MSG_NOSIGNAL    0   // winsock never raises SIGPIPE.
+
+//
+// the engine builds without wdf in the unit tests.
+//
+#ifndef NT_SUCCESS
+typedef LONG NTSTATUS;
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+#endif
+#ifndef STATUS_SUCCESS
+#define STATUS_SUCCESS          ((NTSTATUS)0x00000000L)
+#endif
+#ifndef STATUS_INTERNAL_ERROR
+#define STATUS_INTERNAL_ERROR   ((NTSTATUS)0xC00000E5L)
+#endif
+#ifndef ASSERT
+#include <assert.h>
+#define ASSERT(exp) assert(exp)
+#endif
+
+#else
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef int             SOCKET;
+typedef void            VOID;
+typedef void*           PVOID;
+typedef char            CHAR;
+typedef uint8_t         UCHAR;
+typedef uint8_t         BYTE;
+typedef uint8_t         BOOLEAN;
+typedef UCHAR*          PUCHAR;
+typedef uint16_t        USHORT;
+typedef int32_t         LONG;
+typedef uint32_t        ULONG;
+typedef uint32_t        UINT32;
+typedef uint32_t        DWORD;
+typedef int64_t         INT64;
+typedef uint64_t        ULONGLONG;
+typedef uintptr_t       ULONG_PTR;
+typedef int             BOOL;
+typedef int32_t         NTSTATUS;
+
+typedef struct _PLATFORM_EVENT*  PLATFORM_EVENT;
+typedef struct _PLATFORM_TIMER*  PLATFORM_TIMER;
+typedef struct _PLATFORM_THREAD* PLATFORM_THREAD;
+typedef pthread_mutex_t          PLATFORM_LOCK;
+
+#define TRUE                    1
+#define FALSE                   0
+#define INFINITE                0xFFFFFFFF
+#ifndef MAXULONG
+#define MAXULONG                0xffffffff
+#endif
+#define NO_ERROR                0
+#define INVALID_SOCKET          (-1)
+#define SOCKET_ERROR            (-1)
+#define SD_BOTH                 SHUT_RDWR
+#define STATUS_SUCCESS          ((NTSTATUS)0x00000000L)
+#define STATUS_INTERNAL_ERROR   ((NTSTATUS)0xC00000E5L)
+#define NT_SUCCESS(Status)      (((NTSTATUS)(Status)) >= 0)
+#define ASSERT(exp)             assert(exp)
+#define RtlCopyMemory(Destination, Source, Length) memcpy((Destination), (Source), (Length))
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+
+// NetCompat.h has the same shim.
+#ifndef CLOSESOCKET_SHIM
+#define CLOSESOCKET_SHIM
+inline int closesocket(SOCKET s) { return close(s); }
+#endif
+
+//
+// the sal annotations used by the shared headers.
+//
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Inout_
+#define _In_reads_bytes_(size)
+#define _Out_writes_bytes_(size)
+#define _Out_writes_bytes_to_(size, count)
+#define _Success_(expr)
+
+#endif
+
+//
+// PlatformWait results other than the index of a signalled source.
+//
+#define PLATFORM_WAIT_TIMEOUT   0xFFFFFFFE
+#define PLATFORM_WAIT_FAILED    0xFFFFFFFF
+
+//
+// most sources one waiter takes.
+//
+#define PLATFORM_WAIT_MAX       8
+
+//
+// socket interest for PlatformWaiterAddSocket.
+//
+#define PLATFORM_SOCKET_READ    1   // signalled while there is data to recv, or on close.
+#define PLATFORM_SOCKET_ACCEPT  2   // signalled while a connection is waiting to be accepted.
+#define PLATFORM_SOCKET_CONNECT 4   // signalled once a non-blocking connect succeeded or failed.
+
+typedef struct _PLATFORM_WAITER *PPLATFORM_WAITER;
+
+typedef struct _PLATFORM_WATCHER *PPLATFORM_WATCHER;
+
+typedef struct _PLATFORM_STREAM *PLATFORM_STREAM;
+
+typedef UINT32 (*PLATFORM_THREAD_ROUTINE)(PVOID Context);
+
+//
+// thread priorities, relative to the normal threads of the machine.
+//
+typedef enum _PLATFORM_PRIORITY {
+    PlatformPriorityNormal = 0,
+    PlatformPriorityHigh,           // runs ahead of normal threads that want the same cpu.
+    PlatformPriorityLow,            // gives the cpu to normal threads.
+} PLATFORM_PRIORITY;
+
+//
+// sockets
+//
+_Success_(return == NO_ERROR)
+UINT32 PlatformSocketStartup();
+
+VOID PlatformSocketCleanup();
+
+UINT32 PlatformSocketLastError();
+
+//
+// TRUE for the error of a non-blocking call that has to wait, also for a
+// connect that is still in progress.
+//
+BOOL PlatformSocketWouldBlock(UINT32 Error);
+
+//
+// the outcome of a non-blocking connect once PLATFORM_SOCKET_CONNECT signalled,
+// NO_ERROR if the socket is connected, else the error it failed with.
+//
+UINT32 PlatformSocketConnectResult(SOCKET Socket);
+
+//
+// makes Socket non-blocking without a waiter. On windows this also ends the
+// WSAEventSelect an accepted socket takes over from its listener.
+//
+UINT32 PlatformSocketSetNonBlocking(SOCKET Socket);
+
+//
+// waits until a non-blocking socket can take more data to send.
+// returns NO_ERROR when it can, else the socket error or a timeout error.
+//
+UINT32 PlatformSocketWaitWritable(SOCKET Socket, ULONG TimeoutMs);
+
+//
+// streams are the transports of a port that are not sockets. They are read and
+// written like a non-blocking socket: PlatformStreamRecv returns the bytes
+// read, 0 once the peer is gone or SOCKET_ERROR with the error in
+// PlatformSocketLastError, a would block error when there is no data.
+// PlatformStreamSend may send part of Buffer.
+//
+int PlatformStreamRecv(PLATFORM_STREAM Stream, char* Buffer, int Length);
+
+int PlatformStreamSend(PLATFORM_STREAM Stream, const char* Buffer, int Length);
+
+UINT32 PlatformStreamWaitWritable(PLATFORM_STREAM Stream, ULONG TimeoutMs);
+
+VOID PlatformStreamClose(PLATFORM_STREAM Stream);
+
+//
+// named pipe streams. On windows Name is \\.\pipe\Name, a duplex pipe. Elsewhere
+// a pipe is the fifo pair of a qemu pipe chardev: the client writes Name.in
+// and reads Name.out.
+//
+_Success_(return == NO_ERROR)
+UINT32 PlatformPipeConnect(const char* Name, PLATFORM_STREAM* Stream);
+
+//
+// creates the server end of a pipe. On windows it has no data and cannot send
+// until a client connected, and a client that disconnects closes it.
+//
+_Success_(return == NO_ERROR)
+UINT32 PlatformPipeCreate(const char* Name, PLATFORM_STREAM* Stream);
+
+//
+// shared memory streams, a pair of rings in a mapping shared with another
+// process of the same host, see shmring.h. On windows Name names the mapping
+// and its events in the global namespace. Elsewhere the server listens on a
+// unix socket at Name and hands the mapping and its eventfds to the client
+// it accepts, the socket then only tells each side when the other exits.
+//
+_Success_(return == NO_ERROR)
+UINT32 PlatformShmConnect(const char* Name, PLATFORM_STREAM* Stream);
+
+//
+// creates the server end of a shared memory stream, with rings of RingSize
+// bytes or SHM_DEFAULT_RING_SIZE if it is 0. Like a pipe it has no data and
+// cannot send until a client attached.
+//
+_Success_(return == NO_ERROR)
+UINT32 PlatformShmCreate(const char* Name, ULONG RingSize, PLATFORM_STREAM* Stream);
+
+//
+// files mapped into memory. With Create PlatformFileMap creates the file at
+// Path, or empties the one that is there, makes it *Size bytes of zeros and
+// maps it to read and write. Else it maps the file at Path to read and *Size
+// gets its length. The mapping outlives the file handle, PlatformFileUnmap
+// ends it.
+//
+_Success_(return == NO_ERROR)
+UINT32 PlatformFileMap(const char* Path, BOOL Create, ULONGLONG* Size, PVOID* View);
+
+VOID PlatformFileUnmap(PVOID View, ULONGLONG Size);
+
+//
+// a stream that another module implements, like a channel of a mux session.
+// The operations get Context and return like the PlatformStream calls, with
+// the error in *Error instead of PlatformSocketLastError. Event is the wait
+// source, a manual reset event the stream keeps set while Recv has something
+// to return. Close closes Context and Event.
+//
+typedef struct _PLATFORM_STREAM_OPS {
+    int     (*Recv)(PVOID Context, char* Buffer, int Length, UINT32* Error);
+    int     (*Send)(PVOID Context, const char* Buffer, int Length, UINT32* Error);
+    UINT32  (*WaitWritable)(PVOID Context, ULONG TimeoutMs);
+    VOID    (*Close)(PVOID Context);
+} PLATFORM_STREAM_OPS;
+
+_Success_(return == NO_ERROR)
+UINT32 PlatformStreamCreate(const PLATFORM_STREAM_OPS* Ops, PVOID Context,
+    PLATFORM_EVENT Event, PLATFORM_STREAM* Stream);
+
+//
+// events. An auto reset event is reset when a wait returns it.
+//
+_Success_(return == NO_ERROR)
+UINT32 PlatformEventCreate(BOOL ManualReset, PLATFORM_EVENT* Event);
+
+VOID PlatformEventSet(PLATFORM_EVENT Event);
+
+VOID PlatformEventReset(PLATFORM_EVENT Event);
+
+VOID PlatformEventClose(PLATFORM_EVENT Event);
+
+//
+// one shot timers, signalled DueMs milliseconds after PlatformTimerStart and
+// reset when a wait returns them. Starting a running timer restarts it.
+//
+_Success_(return == NO_ERROR)
+UINT32 PlatformTimerCreate(PLATFORM_TIMER* Timer);
+
+VOID PlatformTimerStart(PLATFORM_TIMER Timer, ULONGLONG DueMs);
+
+VOID PlatformTimerStop(PLATFORM_TIMER Timer);
+
+VOID PlatformTimerClose(PLATFORM_TIMER Timer);
+
+//
+// a monotonic clock in microseconds, and a hint to the cpu inside a busy wait loop.
+//
+ULONGLONG PlatformTimeUs();
+
+VOID PlatformSpinPause();
+
+//
+// the processors the process may run on.
+//
+ULONG PlatformCpuCount();
+
+//
+// threads
+//
+_Success_(return == NO_ERROR)
+UINT32 PlatformThreadCreate(PLATFORM_THREAD_ROUTINE Routine, PVOID Context, PLATFORM_THREAD* Thread);
+
+//
+// waits for the thread to exit and frees it. Returns FALSE on timeout, in which
+// case the thread is left running and the handle stays valid.
+//
+BOOL PlatformThreadJoin(PLATFORM_THREAD Thread, ULONG TimeoutMs);
+
+//
+// the processors the calling thread runs on, a mask of the first 64, 0 for
+// any, and its priority. A raised priority may need a
+// privilege, the call then fails and nothing changes.
+//
+_Success_(return == NO_ERROR)
+UINT32 PlatformThreadSetAffinity(ULONGLONG Mask);
+
+_Success_(return == NO_ERROR)
+UINT32 PlatformThreadSetPriority(PLATFORM_PRIORITY Priority);
+
+//
+// locks, for the state two threads change. A lock is not recursive, is held
+// briefly and needs no cleanup.
+//
+VOID PlatformLockInitialize(PLATFORM_LOCK* Lock);
+
+VOID PlatformLockAcquire(PLATFORM_LOCK* Lock);
+
+VOID PlatformLockRelease(PLATFORM_LOCK* Lock);
+
+//
+// waiters. Sources are numbered in the order they are added, and when several
+// are signalled PlatformWait returns the lowest number, like
+// WSAWaitForMultipleEvents. Adding a socket makes it non-blocking.
+//
+_Success_(return == NO_ERROR)
+UINT32 PlatformWaiterCreate(PPLATFORM_WAITER* Waiter);
+
+_Success_(return == NO_ERROR)
+UINT32 PlatformWaiterAddSocket(PPLATFORM_WAITER Waiter, SOCKET Socket, ULONG Interest);
+
+_Success_(return == NO_ERROR)
+UINT32 PlatformWaiterAddEvent(PPLATFORM_WAITER Waiter, PLATFORM_EVENT Event);
+
+_Success_(return == NO_ERROR)
+UINT32 PlatformWaiterAddTimer(PPLATFORM_WAITER Waiter, PLATFORM_TIMER Timer);
+
+//
+// a stream source is signalled while it has data, or is closed.
+//
+_Success_(return == NO_ERROR)
+UINT32 PlatformWaiterAddStream(PPLATFORM_WAITER Waiter, PLATFORM_STREAM Stream);
+
+//
+// stops and restarts waiting on the socket, for example while there is
+// nowhere to put received data.
+//
+VOID PlatformWaiterEnableSocket(PPLATFORM_WAITER Waiter, SOCKET Socket, BOOL Enable);
+
+VOID PlatformWaiterEnableStream(PPLATFORM_WAITER Waiter, PLATFORM_STREAM Stream, BOOL Enable);
+
+//
+// returns the number of a signalled source, PLATFORM_WAIT_TIMEOUT or PLATFORM_WAIT_FAILED.
+// TimeoutMs may be INFINITE.
+//
+ULONG PlatformWait(PPLATFORM_WAITER Waiter, ULONG TimeoutMs);
+
+//
+// closes the waiter, not the sources. A waiter that is watched is no longer.
+//
+VOID PlatformWaiterClose(PPLATFORM_WAITER Waiter);
+
+//
+// watchers, one thread waiting for many waiters. PlatformWatcherArm watches
+// Waiter once: the next PlatformWatcherWait that finds one of its sources
+// signalled returns Context for it. The source stays signalled for the next
+// PlatformWait of the waiter, which is not waited on in between. Arming a
+// waiter again, or with another context, replaces the earlier arm. A waiter
+// is armed with one watcher at a time.
+//
+_Success_(return == NO_ERROR)
+UINT32 PlatformWatcherCreate(PPLATFORM_WATCHER* Watcher);
+
+_Success_(return == NO_ERROR)
+UINT32 PlatformWatcherArm(PPLATFORM_WATCHER Watcher, PPLATFORM_WAITER Waiter, PVOID Context);
+
+//
+// makes a PlatformWatcherWait in progress return, with no contexts.
+//
+VOID PlatformWatcherWake(PPLATFORM_WATCHER Watcher);
+
+//
+// waits for armed waiters and returns how many contexts it put in Contexts,
+// at most MaxContexts. 0 on a timeout or a wake, PLATFORM_WAIT_FAILED if the
+// wait failed. TimeoutMs may be INFINITE. Each waiter it returns is disarmed.
+//
+ULONG PlatformWatcherWait(PPLATFORM_WATCHER Watcher, ULONG TimeoutMs, PVOID* Contexts, ULONG MaxContexts);
+
+//
+// closes the watcher, once the waiters armed with it are closed.
+//
+VOID PlatformWatcherClose(PPLATFORM_WATCHER Watcher);
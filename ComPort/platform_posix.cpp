@@ -0,0 +1,1255 @@
+/*++
+
+Module Name:
+
+    platform_posix.cpp
+
+Abstract:
+
+    The linux platform backend. Events are eventfds, timers are timerfds and a
+    waiter is an epoll set, so every source is a file descriptor. The wait
+    source of a shared memory stream is an epoll set of its own.
+
+--*/
+
+#include "platform.h"
+#include "shmring.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <string>
+
+struct _PLATFORM_EVENT {
+    int     Fd;
+    BOOL    ManualReset;
+};
+
+struct _PLATFORM_TIMER {
+    int     Fd;
+};
+
+#define SHM_CONNECT_TIMEOUT_MS  5000
+
+//
+// empty recvs of an armed shared memory stream between full looks, which take
+// a signal that came in late and check the connection. Either one keeps the
+// stream signalled, a stream that is polled makes no system calls in between.
+//
+#define SHM_POLL_CHECK          64
+
+typedef enum _PLATFORM_STREAM_TYPE {
+    PlatformStreamPipe,
+    PlatformStreamShm,
+    PlatformStreamOps,
+} PLATFORM_STREAM_TYPE;
+
+struct _PLATFORM_STREAM {
+    PLATFORM_STREAM_TYPE Type;
+    int     ReadFd;             // the wait source.
+    int     WriteFd;
+
+    //
+    // a shared memory stream. ReadFd is an epoll set of the data event of Rx
+    // and Connection, or Listener until a client connected.
+    //
+    ULONG   Side;               // SHM_SERVER or SHM_CLIENT.
+    int     Listener;
+    int     Connection;
+    int     MemoryFd;           // kept by the server until it is handed over.
+    int     Events[SHM_EVENTS];
+    PSHM_HEADER Header;
+    size_t  MappingSize;
+    SHM_RING_VIEW Rx;
+    SHM_RING_VIEW Tx;
+    ULONG   EmptyPolls;
+    ULONG   RxRing;
+    ULONG   TxRing;
+    char    Path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+    //
+    // a stream of PlatformStreamCreate, ReadFd is the fd of its event.
+    //
+    const PLATFORM_STREAM_OPS* Ops;
+    PVOID   Context;
+};
+
+struct _PLATFORM_THREAD {
+    pthread_t               Thread;
+    PLATFORM_THREAD_ROUTINE Routine;
+    PVOID                   Context;
+};
+
+typedef enum _PLATFORM_SOURCE_TYPE {
+    PlatformSourceSocket,
+    PlatformSourceEvent,
+    PlatformSourceTimer,
+    PlatformSourceStream,
+} PLATFORM_SOURCE_TYPE;
+
+typedef struct _PLATFORM_SOURCE {
+    PLATFORM_SOURCE_TYPE    Type;
+    int                     Fd;
+    uint32_t                Events; // epoll events while enabled.
+    BOOL                    Drain;  // read the fd when the wait returns it.
+} PLATFORM_SOURCE;
+
+struct _PLATFORM_WAITER {
+    int             EpollFd;
+    ULONG           Count;
+    PLATFORM_SOURCE Sources[PLATFORM_WAIT_MAX];
+    PPLATFORM_WATCHER Watcher;      // the watcher EpollFd was added to.
+};
+
+//
+// a watcher is an epoll set of the epoll sets of its waiters, each added one
+// shot, and of an eventfd for PlatformWatcherWake.
+//
+struct _PLATFORM_WATCHER {
+    int             EpollFd;
+    int             WakeFd;
+};
+
+static INT64 NowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (INT64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+UINT32 PlatformSocketStartup()
+{
+    return NO_ERROR;
+}
+
+VOID PlatformSocketCleanup()
+{
+}
+
+UINT32 PlatformSocketLastError()
+{
+    return (UINT32)errno;
+}
+
+BOOL PlatformSocketWouldBlock(UINT32 Error)
+{
+    return (Error == EWOULDBLOCK) || (Error == EAGAIN) || (Error == EINPROGRESS);
+}
+
+UINT32 PlatformSocketConnectResult(SOCKET Socket)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(Socket, SOL_SOCKET, SO_ERROR, &error, &length) != 0) {
+        return errno;
+    }
+    return (UINT32)error;
+}
+
+UINT32 PlatformSocketSetNonBlocking(SOCKET Socket)
+{
+    int flags = fcntl(Socket, F_GETFL, 0);
+    if ((flags == -1) || (fcntl(Socket, F_SETFL, flags | O_NONBLOCK) != 0)) {
+        return errno;
+    }
+    return NO_ERROR;
+}
+
+UINT32 PlatformSocketWaitWritable(SOCKET Socket, ULONG TimeoutMs)
+{
+    struct pollfd pfd = { Socket, POLLOUT, 0 };
+    int result = poll(&pfd, 1, TimeoutMs == INFINITE ? -1 : (int)TimeoutMs);
+    if (result < 0) {
+        return PlatformSocketLastError();
+    }
+    if (result == 0) {
+        return ETIMEDOUT;
+    }
+    return (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) ? ECONNRESET : NO_ERROR;
+}
+
+static int ShmRecv(PLATFORM_STREAM Stream, char* Buffer, int Length);
+static int ShmSend(PLATFORM_STREAM Stream, const char* Buffer, int Length);
+static UINT32 ShmWaitWritable(PLATFORM_STREAM Stream, ULONG TimeoutMs);
+static VOID ShmClose(PLATFORM_STREAM Stream);
+
+int PlatformStreamRecv(PLATFORM_STREAM Stream, char* Buffer, int Length)
+{
+    if (Stream->Type == PlatformStreamShm) {
+        return ShmRecv(Stream, Buffer, Length);
+    }
+    if (Stream->Type == PlatformStreamOps) {
+        UINT32 error = NO_ERROR;
+        int result = Stream->Ops->Recv(Stream->Context, Buffer, Length, &error);
+        errno = (int)error;
+        return result;
+    }
+    return (int)read(Stream->ReadFd, Buffer, Length);
+}
+
+int PlatformStreamSend(PLATFORM_STREAM Stream, const char* Buffer, int Length)
+{
+    if (Stream->Type == PlatformStreamShm) {
+        return ShmSend(Stream, Buffer, Length);
+    }
+    if (Stream->Type == PlatformStreamOps) {
+        UINT32 error = NO_ERROR;
+        int result = Stream->Ops->Send(Stream->Context, Buffer, Length, &error);
+        errno = (int)error;
+        return result;
+    }
+    //
+    // a fifo without a reader raises SIGPIPE, there is no MSG_NOSIGNAL for
+    // write. Block it and take the signal this write raised, if any.
+    //
+    sigset_t pipeSignal, pending, old;
+    sigemptyset(&pipeSignal);
+    sigaddset(&pipeSignal, SIGPIPE);
+    sigpending(&pending);
+    BOOL wasPending = sigismember(&pending, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSignal, &old);
+
+    ssize_t result = write(Stream->WriteFd, Buffer, Length);
+    if (result < 0 && errno == EPIPE && !wasPending) {
+        struct timespec zero = { 0, 0 };
+        sigtimedwait(&pipeSignal, NULL, &zero);
+        errno = EPIPE;
+    }
+    int error = errno;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    errno = error;
+    return (int)result;
+}
+
+UINT32 PlatformStreamWaitWritable(PLATFORM_STREAM Stream, ULONG TimeoutMs)
+{
+    if (Stream->Type == PlatformStreamShm) {
+        return ShmWaitWritable(Stream, TimeoutMs);
+    }
+    if (Stream->Type == PlatformStreamOps) {
+        return Stream->Ops->WaitWritable(Stream->Context, TimeoutMs);
+    }
+    return PlatformSocketWaitWritable(Stream->WriteFd, TimeoutMs);
+}
+
+VOID PlatformStreamClose(PLATFORM_STREAM Stream)
+{
+    if (Stream) {
+        if (Stream->Type == PlatformStreamShm) {
+            ShmClose(Stream);
+            return;
+        }
+        if (Stream->Type == PlatformStreamOps) {
+            Stream->Ops->Close(Stream->Context);
+            free(Stream);
+            return;
+        }
+        close(Stream->ReadFd);
+        close(Stream->WriteFd);
+        free(Stream);
+    }
+}
+
+UINT32 PlatformStreamCreate(const PLATFORM_STREAM_OPS* Ops, PVOID Context,
+    PLATFORM_EVENT Event, PLATFORM_STREAM* Stream)
+{
+    *Stream = (PLATFORM_STREAM)calloc(1, sizeof(**Stream));
+    if (*Stream == NULL) {
+        return ENOMEM;
+    }
+    (*Stream)->Type = PlatformStreamOps;
+    (*Stream)->ReadFd = Event->Fd;
+    (*Stream)->WriteFd = -1;
+    (*Stream)->Ops = Ops;
+    (*Stream)->Context = Context;
+    return NO_ERROR;
+}
+
+static UINT32 PipeOpen(const std::string& ReadName, int ReadFlags,
+    const std::string& WriteName, int WriteFlags, PLATFORM_STREAM* Stream)
+{
+    *Stream = NULL;
+    PLATFORM_STREAM stream = (PLATFORM_STREAM)calloc(1, sizeof(*stream));
+    if (stream == NULL) {
+        return ENOMEM;
+    }
+    //
+    // the write end first, it fails with ENXIO while nobody reads it.
+    //
+    stream->WriteFd = open(WriteName.c_str(), WriteFlags | O_NONBLOCK | O_CLOEXEC);
+    if (stream->WriteFd < 0) {
+        UINT32 error = errno;
+        free(stream);
+        return error;
+    }
+    stream->ReadFd = open(ReadName.c_str(), ReadFlags | O_NONBLOCK | O_CLOEXEC);
+    if (stream->ReadFd < 0) {
+        UINT32 error = errno;
+        close(stream->WriteFd);
+        free(stream);
+        return error;
+    }
+    *Stream = stream;
+    return NO_ERROR;
+}
+
+UINT32 PlatformPipeConnect(const char* Name, PLATFORM_STREAM* Stream)
+{
+    std::string name(Name);
+    return PipeOpen(name + ".out", O_RDONLY, name + ".in", O_WRONLY, Stream);
+}
+
+UINT32 PlatformPipeCreate(const char* Name, PLATFORM_STREAM* Stream)
+{
+    std::string name(Name);
+    for (const char* suffix : { ".in", ".out" }) {
+        if (mkfifo((name + suffix).c_str(), 0600) != 0 && errno != EEXIST) {
+            *Stream = NULL;
+            return errno;
+        }
+    }
+    //
+    // both opened read write, like qemu does. Holding a writer of Name.in
+    // means reads find no data instead of the end of the stream between
+    // clients, and writes do not need a reader of Name.out.
+    //
+    return PipeOpen(name + ".in", O_RDWR, name + ".out", O_RDWR, Stream);
+}
+
+static VOID ShmSignal(PLATFORM_STREAM Stream, ULONG Event)
+{
+    uint64_t one = 1;
+    ssize_t written = write(Stream->Events[Event], &one, sizeof(one));
+    UNREFERENCED_PARAMETER(written);
+}
+
+static VOID ShmDrain(PLATFORM_STREAM Stream, ULONG Event)
+{
+    uint64_t value;
+    ssize_t result = read(Stream->Events[Event], &value, sizeof(value));
+    UNREFERENCED_PARAMETER(result);
+}
+
+//
+// the other side closed its end, or its process exited and the kernel
+// closed the connection.
+//
+static BOOL ShmPeerGone(PLATFORM_STREAM Stream)
+{
+    if (Stream->Header->Closed[Stream->Side ^ 1]) {
+        return TRUE;
+    }
+    char byte;
+    ssize_t result = recv(Stream->Connection, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return (result == 0) || ((result < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK));
+}
+
+//
+// a server stream is attached once it handed the mapping to a client.
+// Returns FALSE with errno set until then.
+//
+static BOOL ShmAttached(PLATFORM_STREAM Stream)
+{
+    if (Stream->Listener < 0) {
+        return TRUE;
+    }
+    int connection = accept4(Stream->Listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connection < 0) {
+        return FALSE;
+    }
+
+    int fds[1 + SHM_EVENTS] = { Stream->MemoryFd };
+    RtlCopyMemory(&fds[1], Stream->Events, sizeof(Stream->Events));
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    union {
+        char            Buffer[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr  Align;
+    } control = { };
+    struct msghdr message = { };
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.Buffer;
+    message.msg_controllen = sizeof(control.Buffer);
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(fds));
+    RtlCopyMemory(CMSG_DATA(header), fds, sizeof(fds));
+
+    struct epoll_event event = { };
+    event.events = EPOLLIN | EPOLLRDHUP;
+    if ((sendmsg(connection, &message, MSG_NOSIGNAL) != 1) ||
+        (epoll_ctl(Stream->ReadFd, EPOLL_CTL_ADD, connection, &event) != 0)) {
+        // that client is gone already, wait for the next one.
+        close(connection);
+        errno = EAGAIN;
+        return FALSE;
+    }
+
+    //
+    // one client per stream, like a pipe. The name goes with the listener.
+    //
+    epoll_ctl(Stream->ReadFd, EPOLL_CTL_DEL, Stream->Listener, NULL);
+    close(Stream->Listener);
+    Stream->Listener = -1;
+    unlink(Stream->Path);
+    close(Stream->MemoryFd);
+    Stream->MemoryFd = -1;
+    Stream->Connection = connection;
+    Stream->Header->Attached = 1;
+    return TRUE;
+}
+
+static int ShmRecv(PLATFORM_STREAM Stream, char* Buffer, int Length)
+{
+    if (!ShmAttached(Stream)) {
+        return SOCKET_ERROR;
+    }
+    for (;;) {
+        BOOL wakeWriter;
+        ULONG count = ShmRingRead(&Stream->Rx, (BYTE*)Buffer, (ULONG)Length, &wakeWriter);
+        if (wakeWriter) {
+            ShmSignal(Stream, SHM_EVENT_SPACE(Stream->RxRing));
+        }
+        if (count != 0) {
+            return (int)count;
+        }
+        //
+        // empty. While the reader is armed the signal is still to come.
+        //
+        if (ShmRingReaderArmed(&Stream->Rx) &&
+            (++Stream->EmptyPolls % SHM_POLL_CHECK) != 0) {
+            if (Stream->Header->Closed[Stream->Side ^ 1]) {
+                return 0;
+            }
+            errno = EAGAIN;
+            return SOCKET_ERROR;
+        }
+        //
+        // take the signal, if any, and ask for the next one.
+        //
+        ShmDrain(Stream, SHM_EVENT_DATA(Stream->RxRing));
+        if (!ShmRingArmReader(&Stream->Rx)) {
+            continue;
+        }
+        if (ShmPeerGone(Stream)) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return SOCKET_ERROR;
+    }
+}
+
+static int ShmSend(PLATFORM_STREAM Stream, const char* Buffer, int Length)
+{
+    if (!ShmAttached(Stream)) {
+        errno = ENOTCONN;
+        return SOCKET_ERROR;
+    }
+    if (Stream->Header->Closed[Stream->Side ^ 1]) {
+        errno = EPIPE;
+        return SOCKET_ERROR;
+    }
+    BOOL wakeReader;
+    ULONG count = ShmRingWrite(&Stream->Tx, (const BYTE*)Buffer, (ULONG)Length, &wakeReader);
+    if (wakeReader) {
+        ShmSignal(Stream, SHM_EVENT_DATA(Stream->TxRing));
+    }
+    if (count == 0) {
+        errno = EAGAIN;
+        return SOCKET_ERROR;
+    }
+    return (int)count;
+}
+
+static UINT32 ShmWaitWritable(PLATFORM_STREAM Stream, ULONG TimeoutMs)
+{
+    if (Stream->Listener >= 0) {
+        return ENOTCONN;
+    }
+    INT64 deadline = (TimeoutMs == INFINITE) ? -1 : NowMs() + TimeoutMs;
+    for (;;) {
+        ShmDrain(Stream, SHM_EVENT_SPACE(Stream->TxRing));
+        if (!ShmRingArmWriter(&Stream->Tx)) {
+            return NO_ERROR;
+        }
+        if (ShmPeerGone(Stream)) {
+            return EPIPE;
+        }
+        int timeout = -1;
+        if (deadline >= 0) {
+            INT64 remaining = deadline - NowMs();
+            if (remaining <= 0) {
+                return ETIMEDOUT;
+            }
+            timeout = (int)remaining;
+        }
+        struct pollfd pfd[2] = {
+            { Stream->Events[SHM_EVENT_SPACE(Stream->TxRing)], POLLIN, 0 },
+            { Stream->Connection, POLLRDHUP, 0 },
+        };
+        if ((poll(pfd, 2, timeout) < 0) && (errno != EINTR)) {
+            return errno;
+        }
+    }
+}
+
+static VOID ShmClose(PLATFORM_STREAM Stream)
+{
+    if (Stream->Header) {
+        //
+        // wake the other side in case it waits for data or space.
+        //
+        Stream->Header->Closed[Stream->Side] = 1;
+        if (Stream->Listener < 0) {
+            ShmSignal(Stream, SHM_EVENT_DATA(Stream->TxRing));
+            ShmSignal(Stream, SHM_EVENT_SPACE(Stream->RxRing));
+        }
+        munmap(Stream->Header, Stream->MappingSize);
+    }
+    if (Stream->Listener >= 0) {
+        close(Stream->Listener);
+        unlink(Stream->Path);
+    }
+    for (int fd : { Stream->ReadFd, Stream->Connection, Stream->MemoryFd }) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    for (int fd : Stream->Events) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    free(Stream);
+}
+
+static UINT32 ShmStreamCreate(const char* Name, ULONG Side, PLATFORM_STREAM* Stream)
+{
+    *Stream = NULL;
+    if (strlen(Name) >= sizeof((*Stream)->Path)) {
+        return ENAMETOOLONG;
+    }
+    PLATFORM_STREAM stream = (PLATFORM_STREAM)calloc(1, sizeof(*stream));
+    if (stream == NULL) {
+        return ENOMEM;
+    }
+    stream->Type = PlatformStreamShm;
+    stream->Side = Side;
+    stream->RxRing = (Side == SHM_SERVER) ? SHM_RING_TO_SERVER : SHM_RING_TO_CLIENT;
+    stream->TxRing = stream->RxRing ^ 1;
+    stream->WriteFd = -1;
+    stream->Listener = -1;
+    stream->Connection = -1;
+    stream->MemoryFd = -1;
+    for (int& fd : stream->Events) {
+        fd = -1;
+    }
+    strcpy(stream->Path, Name);
+    stream->ReadFd = epoll_create1(EPOLL_CLOEXEC);
+    if (stream->ReadFd < 0) {
+        UINT32 error = errno;
+        ShmClose(stream);
+        return error;
+    }
+    *Stream = stream;
+    return NO_ERROR;
+}
+
+static UINT32 ShmMap(PLATFORM_STREAM Stream, int MemoryFd, size_t Size)
+{
+    PVOID base = mmap(NULL, Size, PROT_READ | PROT_WRITE, MAP_SHARED, MemoryFd, 0);
+    if (base == MAP_FAILED) {
+        return errno;
+    }
+    Stream->Header = (PSHM_HEADER)base;
+    Stream->MappingSize = Size;
+    return NO_ERROR;
+}
+
+static UINT32 ShmWatch(PLATFORM_STREAM Stream, int Fd)
+{
+    struct epoll_event event = { };
+    event.events = EPOLLIN;
+    return (epoll_ctl(Stream->ReadFd, EPOLL_CTL_ADD, Fd, &event) == 0) ? NO_ERROR : errno;
+}
+
+UINT32 PlatformShmConnect(const char* Name, PLATFORM_STREAM* Stream)
+{
+    UINT32 error = ShmStreamCreate(Name, SHM_CLIENT, Stream);
+    if (error != NO_ERROR) {
+        return error;
+    }
+    PLATFORM_STREAM stream = *Stream;
+    struct sockaddr_un address = { };
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, Name);
+    int fds[1 + SHM_EVENTS];
+    int received = 0;
+    struct stat memory;
+
+    stream->Connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((stream->Connection < 0) ||
+        (connect(stream->Connection, (struct sockaddr*)&address, sizeof(address)) != 0)) {
+        error = errno;
+        goto cleanup;
+    }
+
+    //
+    // the server hands the mapping over once its thread accepts.
+    //
+    {
+        struct pollfd pfd = { stream->Connection, POLLIN, 0 };
+        int ready = poll(&pfd, 1, SHM_CONNECT_TIMEOUT_MS);
+        if (ready <= 0) {
+            error = (ready == 0) ? ETIMEDOUT : errno;
+            goto cleanup;
+        }
+        char byte;
+        struct iovec iov = { &byte, 1 };
+        union {
+            char            Buffer[CMSG_SPACE(sizeof(fds))];
+            struct cmsghdr  Align;
+        } control = { };
+        struct msghdr message = { };
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.Buffer;
+        message.msg_controllen = sizeof(control.Buffer);
+        ssize_t result = recvmsg(stream->Connection, &message, MSG_CMSG_CLOEXEC);
+        if (result != 1) {
+            error = (result == 0) ? ECONNRESET : errno;
+            goto cleanup;
+        }
+        struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+        if (header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            received = (int)((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            RtlCopyMemory(fds, CMSG_DATA(header), received * sizeof(int));
+        }
+    }
+    for (int index = 1; index < received && index <= SHM_EVENTS; index++) {
+        stream->Events[index - 1] = fds[index];
+    }
+    if (received > 0) {
+        stream->MemoryFd = fds[0];
+    }
+    if (received != 1 + SHM_EVENTS) {
+        for (int index = 1 + SHM_EVENTS; index < received; index++) {
+            close(fds[index]);
+        }
+        error = EPROTO;
+        goto cleanup;
+    }
+
+    if (fstat(stream->MemoryFd, &memory) != 0) {
+        error = errno;
+        goto cleanup;
+    }
+    error = ShmMap(stream, stream->MemoryFd, (size_t)memory.st_size);
+    if (error != NO_ERROR) {
+        goto cleanup;
+    }
+    close(stream->MemoryFd);
+    stream->MemoryFd = -1;
+    if (ShmValidate(stream->Header, stream->MappingSize) == 0) {
+        error = EPROTO;
+        goto cleanup;
+    }
+    ShmRingView(stream->Header, stream->RxRing, &stream->Rx);
+    ShmRingView(stream->Header, stream->TxRing, &stream->Tx);
+
+    error = ShmWatch(stream, stream->Events[SHM_EVENT_DATA(stream->RxRing)]);
+    if (error == NO_ERROR) {
+        error = ShmWatch(stream, stream->Connection);
+    }
+    if (error == NO_ERROR) {
+        fcntl(stream->Connection, F_SETFL, fcntl(stream->Connection, F_GETFL, 0) | O_NONBLOCK);
+        return NO_ERROR;
+    }
+
+cleanup:
+    //
+    // the server learns from the connection that this client is gone, the
+    // mapping may not even be one of ours.
+    //
+    if (stream->Header) {
+        munmap(stream->Header, stream->MappingSize);
+        stream->Header = NULL;
+    }
+    ShmClose(stream);
+    *Stream = NULL;
+    return error;
+}
+
+UINT32 PlatformShmCreate(const char* Name, ULONG RingSize, PLATFORM_STREAM* Stream)
+{
+    if (RingSize == 0) {
+        RingSize = SHM_DEFAULT_RING_SIZE;
+    }
+    if (RingSize < SHM_MIN_RING_SIZE) {
+        *Stream = NULL;
+        return EINVAL;
+    }
+    UINT32 error = ShmStreamCreate(Name, SHM_SERVER, Stream);
+    if (error != NO_ERROR) {
+        return error;
+    }
+    PLATFORM_STREAM stream = *Stream;
+    size_t size = ShmMappingSize(RingSize);
+    struct sockaddr_un address = { };
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, Name);
+
+    stream->MemoryFd = memfd_create("htsvsp-shm", MFD_CLOEXEC);
+    if ((stream->MemoryFd < 0) || (ftruncate(stream->MemoryFd, (off_t)size) != 0)) {
+        error = errno;
+        goto cleanup;
+    }
+    error = ShmMap(stream, stream->MemoryFd, size);
+    if (error != NO_ERROR) {
+        goto cleanup;
+    }
+    ShmInitialize(stream->Header, RingSize);
+    ShmRingView(stream->Header, stream->RxRing, &stream->Rx);
+    ShmRingView(stream->Header, stream->TxRing, &stream->Tx);
+
+    for (int& fd : stream->Events) {
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0) {
+            error = errno;
+            goto cleanup;
+        }
+    }
+
+    //
+    // a socket left behind by an earlier server is replaced, like ListenUnix.
+    //
+    unlink(Name);
+    stream->Listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ((stream->Listener < 0) ||
+        (bind(stream->Listener, (struct sockaddr*)&address, sizeof(address)) != 0) ||
+        (listen(stream->Listener, 1) != 0)) {
+        error = errno;
+        goto cleanup;
+    }
+    error = ShmWatch(stream, stream->Listener);
+    if (error == NO_ERROR) {
+        error = ShmWatch(stream, stream->Events[SHM_EVENT_DATA(stream->RxRing)]);
+    }
+    if (error == NO_ERROR) {
+        return NO_ERROR;
+    }
+
+cleanup:
+    ShmClose(stream);
+    *Stream = NULL;
+    return error;
+}
+
+UINT32 PlatformEventCreate(BOOL ManualReset, PLATFORM_EVENT* Event)
+{
+    *Event = NULL;
+    PLATFORM_EVENT event = (PLATFORM_EVENT)calloc(1, sizeof(*event));
+    if (event == NULL) {
+        return ENOMEM;
+    }
+    event->Fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event->Fd < 0) {
+        UINT32 error = errno;
+        free(event);
+        return error;
+    }
+    event->ManualReset = ManualReset;
+    *Event = event;
+    return NO_ERROR;
+}
+
+VOID PlatformEventSet(PLATFORM_EVENT Event)
+{
+    uint64_t one = 1;
+    ssize_t result = write(Event->Fd, &one, sizeof(one));
+    UNREFERENCED_PARAMETER(result);
+}
+
+VOID PlatformEventReset(PLATFORM_EVENT Event)
+{
+    uint64_t value;
+    ssize_t result = read(Event->Fd, &value, sizeof(value));
+    UNREFERENCED_PARAMETER(result);
+}
+
+VOID PlatformEventClose(PLATFORM_EVENT Event)
+{
+    if (Event) {
+        close(Event->Fd);
+        free(Event);
+    }
+}
+
+UINT32 PlatformTimerCreate(PLATFORM_TIMER* Timer)
+{
+    *Timer = NULL;
+    PLATFORM_TIMER timer = (PLATFORM_TIMER)calloc(1, sizeof(*timer));
+    if (timer == NULL) {
+        return ENOMEM;
+    }
+    timer->Fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer->Fd < 0) {
+        UINT32 error = errno;
+        free(timer);
+        return error;
+    }
+    *Timer = timer;
+    return NO_ERROR;
+}
+
+static VOID TimerSet(PLATFORM_TIMER Timer, ULONGLONG DueMs, BOOL Arm)
+{
+    struct itimerspec due = { };
+    if (Arm) {
+        //
+        // a zero it_value disarms the timer, so a zero due time fires after 1ns.
+        //
+        due.it_value.tv_sec = (time_t)(DueMs / 1000);
+        due.it_value.tv_nsec = (long)((DueMs % 1000) * 1000000);
+        if (DueMs == 0) {
+            due.it_value.tv_nsec = 1;
+        }
+    }
+    //
+    // setting the timer also forgets an expiration the waiter has not seen yet.
+    //
+    timerfd_settime(Timer->Fd, 0, &due, NULL);
+}
+
+VOID PlatformTimerStart(PLATFORM_TIMER Timer, ULONGLONG DueMs)
+{
+    TimerSet(Timer, DueMs, TRUE);
+}
+
+VOID PlatformTimerStop(PLATFORM_TIMER Timer)
+{
+    TimerSet(Timer, 0, FALSE);
+}
+
+VOID PlatformTimerClose(PLATFORM_TIMER Timer)
+{
+    if (Timer) {
+        close(Timer->Fd);
+        free(Timer);
+    }
+}
+
+UINT32 PlatformFileMap(const char* Path, BOOL Create, ULONGLONG* Size, PVOID* View)
+{
+    *View = NULL;
+    int fd = Create ? open(Path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) :
+        open(Path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno;
+    }
+    UINT32 error = NO_ERROR;
+    struct stat status;
+    if (Create) {
+        // the file is sparse until written.
+        if (ftruncate(fd, (off_t)*Size) != 0) {
+            error = errno;
+        }
+    }
+    else if (fstat(fd, &status) != 0) {
+        error = errno;
+    }
+    else {
+        *Size = (ULONGLONG)status.st_size;
+    }
+    if (error == NO_ERROR && *Size == 0) {
+        error = EINVAL;
+    }
+    if (error == NO_ERROR) {
+        PVOID base = mmap(NULL, (size_t)*Size, Create ? (PROT_READ | PROT_WRITE) : PROT_READ,
+            MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            error = errno;
+        }
+        else {
+            *View = base;
+        }
+    }
+    close(fd);
+    return error;
+}
+
+VOID PlatformFileUnmap(PVOID View, ULONGLONG Size)
+{
+    if (View) {
+        munmap(View, (size_t)Size);
+    }
+}
+
+ULONGLONG PlatformTimeUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (ULONGLONG)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+VOID PlatformSpinPause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+ULONG PlatformCpuCount()
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        return (ULONG)CPU_COUNT(&set);
+    }
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (ULONG)count : 1;
+}
+
+static void* ThreadStart(void* Context)
+{
+    PLATFORM_THREAD thread = (PLATFORM_THREAD)Context;
+    thread->Routine(thread->Context);
+    return NULL;
+}
+
+UINT32 PlatformThreadCreate(PLATFORM_THREAD_ROUTINE Routine, PVOID Context, PLATFORM_THREAD* Thread)
+{
+    *Thread = NULL;
+    PLATFORM_THREAD thread = (PLATFORM_THREAD)calloc(1, sizeof(*thread));
+    if (thread == NULL) {
+        return ENOMEM;
+    }
+    thread->Routine = Routine;
+    thread->Context = Context;
+    int error = pthread_create(&thread->Thread, NULL, ThreadStart, thread);
+    if (error != 0) {
+        free(thread);
+        return (UINT32)error;
+    }
+    *Thread = thread;
+    return NO_ERROR;
+}
+
+BOOL PlatformThreadJoin(PLATFORM_THREAD Thread, ULONG TimeoutMs)
+{
+    if (TimeoutMs == INFINITE) {
+        pthread_join(Thread->Thread, NULL);
+    }
+    else {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += TimeoutMs / 1000;
+        deadline.tv_nsec += (long)(TimeoutMs % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (pthread_timedjoin_np(Thread->Thread, NULL, &deadline) != 0) {
+            return FALSE;
+        }
+    }
+    free(Thread);
+    return TRUE;
+}
+
+UINT32 PlatformThreadSetAffinity(ULONGLONG Mask)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        // the kernel keeps the cpus of the cpuset of the process.
+        if (Mask == 0 || (cpu < 64 && (Mask & (1ULL << cpu)))) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return (UINT32)pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+UINT32 PlatformThreadSetPriority(PLATFORM_PRIORITY Priority)
+{
+    //
+    // a nice value of the thread, the cfs share of a nice -10 thread is ten
+    // times that of a normal one. Below 0 needs CAP_SYS_NICE or RLIMIT_NICE.
+    //
+    int nice = 0;
+    if (Priority == PlatformPriorityHigh) {
+        nice = -10;
+    }
+    else if (Priority == PlatformPriorityLow) {
+        nice = 10;
+    }
+    if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice) != 0) {
+        return (UINT32)errno;
+    }
+    return NO_ERROR;
+}
+
+VOID PlatformLockInitialize(PLATFORM_LOCK* Lock)
+{
+    pthread_mutex_init(Lock, NULL);
+}
+
+VOID PlatformLockAcquire(PLATFORM_LOCK* Lock)
+{
+    pthread_mutex_lock(Lock);
+}
+
+VOID PlatformLockRelease(PLATFORM_LOCK* Lock)
+{
+    pthread_mutex_unlock(Lock);
+}
+
+UINT32 PlatformWaiterCreate(PPLATFORM_WAITER* Waiter)
+{
+    *Waiter = NULL;
+    PPLATFORM_WAITER waiter = (PPLATFORM_WAITER)calloc(1, sizeof(*waiter));
+    if (waiter == NULL) {
+        return ENOMEM;
+    }
+    waiter->EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (waiter->EpollFd < 0) {
+        UINT32 error = errno;
+        free(waiter);
+        return error;
+    }
+    *Waiter = waiter;
+    return NO_ERROR;
+}
+
+static UINT32 WaiterAdd(PPLATFORM_WAITER Waiter, PLATFORM_SOURCE_TYPE Type, int Fd, uint32_t Events, BOOL Drain)
+{
+    if (Waiter->Count == PLATFORM_WAIT_MAX) {
+        return ENOSPC;
+    }
+    struct epoll_event event = { };
+    event.events = Events;
+    event.data.u32 = Waiter->Count;
+    if (epoll_ctl(Waiter->EpollFd, EPOLL_CTL_ADD, Fd, &event) != 0) {
+        return errno;
+    }
+    Waiter->Sources[Waiter->Count].Type = Type;
+    Waiter->Sources[Waiter->Count].Fd = Fd;
+    Waiter->Sources[Waiter->Count].Events = Events;
+    Waiter->Sources[Waiter->Count].Drain = Drain;
+    Waiter->Count++;
+    return NO_ERROR;
+}
+
+UINT32 PlatformWaiterAddSocket(PPLATFORM_WAITER Waiter, SOCKET Socket, ULONG Interest)
+{
+    int flags = fcntl(Socket, F_GETFL, 0);
+    if ((flags == -1) || (fcntl(Socket, F_SETFL, flags | O_NONBLOCK) != 0)) {
+        return errno;
+    }
+    //
+    // a connect is done once the socket is writable, or has an error.
+    //
+    uint32_t events = (Interest == PLATFORM_SOCKET_CONNECT) ? (uint32_t)EPOLLOUT : (uint32_t)EPOLLIN;
+    return WaiterAdd(Waiter, PlatformSourceSocket, Socket, events, FALSE);
+}
+
+UINT32 PlatformWaiterAddStream(PPLATFORM_WAITER Waiter, PLATFORM_STREAM Stream)
+{
+    return WaiterAdd(Waiter, PlatformSourceStream, Stream->ReadFd, EPOLLIN, FALSE);
+}
+
+UINT32 PlatformWaiterAddEvent(PPLATFORM_WAITER Waiter, PLATFORM_EVENT Event)
+{
+    return WaiterAdd(Waiter, PlatformSourceEvent, Event->Fd, EPOLLIN, !Event->ManualReset);
+}
+
+UINT32 PlatformWaiterAddTimer(PPLATFORM_WAITER Waiter, PLATFORM_TIMER Timer)
+{
+    return WaiterAdd(Waiter, PlatformSourceTimer, Timer->Fd, EPOLLIN, TRUE);
+}
+
+static VOID WaiterEnable(PPLATFORM_WAITER Waiter, PLATFORM_SOURCE_TYPE Type, int Fd, BOOL Enable)
+{
+    for (ULONG index = 0; index < Waiter->Count; index++) {
+        if ((Waiter->Sources[index].Type == Type) &&
+            (Waiter->Sources[index].Fd == Fd)) {
+            //
+            // taken out of the set rather than left with no events, epoll
+            // still reports errors and hang ups of a source without events.
+            //
+            struct epoll_event event = { };
+            event.events = Waiter->Sources[index].Events;
+            event.data.u32 = index;
+            epoll_ctl(Waiter->EpollFd, Enable ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, Fd, &event);
+            return;
+        }
+    }
+}
+
+VOID PlatformWaiterEnableSocket(PPLATFORM_WAITER Waiter, SOCKET Socket, BOOL Enable)
+{
+    WaiterEnable(Waiter, PlatformSourceSocket, Socket, Enable);
+}
+
+VOID PlatformWaiterEnableStream(PPLATFORM_WAITER Waiter, PLATFORM_STREAM Stream, BOOL Enable)
+{
+    WaiterEnable(Waiter, PlatformSourceStream, Stream->ReadFd, Enable);
+}
+
+ULONG PlatformWait(PPLATFORM_WAITER Waiter, ULONG TimeoutMs)
+{
+    INT64 deadline = (TimeoutMs == INFINITE) ? -1 : NowMs() + TimeoutMs;
+
+    for (;;) {
+        int timeout = -1;
+        if (deadline >= 0) {
+            INT64 remaining = deadline - NowMs();
+            timeout = remaining > 0 ? (int)remaining : 0;
+        }
+        struct epoll_event events[PLATFORM_WAIT_MAX];
+        int count = epoll_wait(Waiter->EpollFd, events, PLATFORM_WAIT_MAX, timeout);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return PLATFORM_WAIT_FAILED;
+        }
+        if (count == 0) {
+            return PLATFORM_WAIT_TIMEOUT;
+        }
+        ULONG ready = PLATFORM_WAIT_MAX;
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.u32 < ready) {
+                ready = events[i].data.u32;
+            }
+        }
+        PLATFORM_SOURCE* source = &Waiter->Sources[ready];
+        if (!source->Drain) {
+            return ready;
+        }
+        //
+        // auto reset. Another waiter may have taken the signal first, or the
+        // timer was restarted since epoll saw it, then there is nothing to read.
+        //
+        uint64_t value;
+        if (read(source->Fd, &value, sizeof(value)) == sizeof(value)) {
+            return ready;
+        }
+    }
+}
+
+VOID PlatformWaiterClose(PPLATFORM_WAITER Waiter)
+{
+    if (Waiter) {
+        if (Waiter->Watcher) {
+            epoll_ctl(Waiter->Watcher->EpollFd, EPOLL_CTL_DEL, Waiter->EpollFd, NULL);
+        }
+        close(Waiter->EpollFd);
+        free(Waiter);
+    }
+}
+
+UINT32 PlatformWatcherCreate(PPLATFORM_WATCHER* Watcher)
+{
+    *Watcher = NULL;
+    PPLATFORM_WATCHER watcher = (PPLATFORM_WATCHER)calloc(1, sizeof(*watcher));
+    if (watcher == NULL) {
+        return ENOMEM;
+    }
+    UINT32 error = NO_ERROR;
+    watcher->WakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    watcher->EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (watcher->WakeFd < 0 || watcher->EpollFd < 0) {
+        error = errno;
+    }
+    else {
+        struct epoll_event event = { };
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(watcher->EpollFd, EPOLL_CTL_ADD, watcher->WakeFd, &event) != 0) {
+            error = errno;
+        }
+    }
+    if (error != NO_ERROR) {
+        PlatformWatcherClose(watcher);
+        return error;
+    }
+    *Watcher = watcher;
+    return NO_ERROR;
+}
+
+UINT32 PlatformWatcherArm(PPLATFORM_WATCHER Watcher, PPLATFORM_WAITER Waiter, PVOID Context)
+{
+    ASSERT(Waiter->Watcher == NULL || Waiter->Watcher == Watcher);
+    //
+    // one shot: epoll disables it once it reported it, it is modified to arm
+    // it again.
+    //
+    struct epoll_event event = { };
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = Context;
+    int operation = Waiter->Watcher ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(Watcher->EpollFd, operation, Waiter->EpollFd, &event) != 0) {
+        return errno;
+    }
+    Waiter->Watcher = Watcher;
+    return NO_ERROR;
+}
+
+VOID PlatformWatcherWake(PPLATFORM_WATCHER Watcher)
+{
+    uint64_t one = 1;
+    ssize_t result = write(Watcher->WakeFd, &one, sizeof(one));
+    UNREFERENCED_PARAMETER(result);
+}
+
+ULONG PlatformWatcherWait(PPLATFORM_WATCHER Watcher, ULONG TimeoutMs, PVOID* Contexts, ULONG MaxContexts)
+{
+    struct epoll_event events[64];
+    int maxEvents = (int)(MaxContexts < 64 ? MaxContexts : 64);
+    int count;
+    do {
+        count = epoll_wait(Watcher->EpollFd, events, maxEvents,
+            TimeoutMs == INFINITE ? -1 : (int)TimeoutMs);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0) {
+        return PLATFORM_WAIT_FAILED;
+    }
+    ULONG contexts = 0;
+    for (int i = 0; i < count; i++) {
+        if (events[i].data.ptr == NULL) {
+            uint64_t value;
+            ssize_t result = read(Watcher->WakeFd, &value, sizeof(value));
+            UNREFERENCED_PARAMETER(result);
+            continue;
+        }
+        Contexts[contexts++] = events[i].data.ptr;
+    }
+    return contexts;
+}
+
+VOID PlatformWatcherClose(PPLATFORM_WATCHER Watcher)
+{
+    if (Watcher) {
+        if (Watcher->EpollFd >= 0) {
+            close(Watcher->EpollFd);
+        }
+        if (Watcher->WakeFd >= 0) {
+            close(Watcher->WakeFd);
+        }
+        free(Watcher);
+    }
+}
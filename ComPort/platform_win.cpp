@@ -0,0 +1,1319 @@
+/*++
+
+Module Name:
+
+    platform_win.cpp
+
+Abstract:
+
+    The windows platform backend. Events and timers are win32 objects, sockets
+    are signalled through WSAEventSelect and a waiter is a
+    WSAWaitForMultipleEvents handle array. A shared memory stream is a named
+    file mapping with named manual reset events.
+
+--*/
+
+#include "platform.h"
+#include "shmring.h"
+#include <sddl.h>
+#include <stdlib.h>
+#include <string>
+
+#pragma comment(lib, "Ws2_32.lib")
+#pragma comment(lib, "Advapi32.lib")
+
+typedef struct _PLATFORM_THREAD_START {
+    PLATFORM_THREAD_ROUTINE Routine;
+    PVOID                   Context;
+} PLATFORM_THREAD_START, *PPLATFORM_THREAD_START;
+
+typedef struct _PLATFORM_WATCH_SOURCE {
+    PPLATFORM_WAITER Waiter;
+    ULONG       Index;
+} PLATFORM_WATCH_SOURCE;
+
+struct _PLATFORM_WAITER {
+    ULONG       Count;
+    HANDLE      Handles[PLATFORM_WAIT_MAX];
+    SOCKET      Sockets[PLATFORM_WAIT_MAX];     // INVALID_SOCKET if the source is not a socket.
+    long        NetworkEvents[PLATFORM_WAIT_MAX];
+    PLATFORM_STREAM Streams[PLATFORM_WAIT_MAX]; // NULL if the source is not a stream.
+
+    //
+    // while it is armed with a watcher, a registered wait for each source.
+    // A registered wait takes the signal of an auto reset event or timer, it
+    // is kept in Pending for the next PlatformWait.
+    //
+    PPLATFORM_WATCHER Watcher;
+    PVOID       WatchContext;
+    ULONG       WaitCount;
+    HANDLE      Waits[PLATFORM_WAIT_MAX];
+    PLATFORM_WATCH_SOURCE WatchSources[PLATFORM_WAIT_MAX];
+    volatile LONG Fired;
+    volatile LONG Pending;
+    PPLATFORM_WAITER FiredNext;                 // in the Fired list of the watcher.
+};
+
+//
+// the registered waits of the waiters armed with a watcher put the first
+// source that fired on the Fired list and set Event.
+//
+struct _PLATFORM_WATCHER {
+    SRWLOCK     Lock;
+    HANDLE      Event;
+    PPLATFORM_WAITER Fired;
+    PPLATFORM_WAITER FiredTail;
+};
+
+#define PIPE_BUFFER_SIZE        (16 * 1024)
+#define PIPE_WRITE_TIMEOUT_MS   5000
+
+//
+// empty recvs of an armed shared memory stream between resets of its data
+// event. A signal that came in late keeps the event set, a stream that is
+// polled makes no system calls in between.
+//
+#define SHM_POLL_CHECK          64
+
+//
+// the driver runs as local service in session 0, its peers in a user session.
+// System, administrators, local service and interactive users may open the
+// objects of a shared memory stream.
+//
+#define SHM_SDDL    "D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GA;;;LS)(A;;GA;;;IU)"
+
+typedef enum _PLATFORM_STREAM_TYPE {
+    PlatformStreamPipe,
+    PlatformStreamShm,
+    PlatformStreamOps,
+} PLATFORM_STREAM_TYPE;
+
+//
+// a named pipe opened for overlapped io. One read is kept outstanding into
+// ReadBuffer, its event is the wait source and stays signalled while
+// ReadBuffer has data.
+//
+// a shared memory stream waits on the data event of Rx instead, it is only
+// reset by a recv that found Rx empty. A stream of PlatformStreamCreate waits
+// on the event it was given.
+//
+struct _PLATFORM_STREAM {
+    PLATFORM_STREAM_TYPE Type;
+    ULONG       Side;               // SHM_SERVER or SHM_CLIENT.
+    BOOL        Joined;             // took part in the mapping, tells the other side when it closes.
+    HANDLE      Mapping;
+    HANDLE      Events[SHM_EVENTS];
+    PSHM_HEADER Header;
+    SHM_RING_VIEW Rx;
+    SHM_RING_VIEW Tx;
+    ULONG       RxRing;
+    ULONG       TxRing;
+    ULONG       EmptyPolls;
+
+    HANDLE      Pipe;
+    OVERLAPPED  ReadOverlapped;     // also connects a server pipe.
+    OVERLAPPED  WriteOverlapped;
+    HANDLE      IdleEvent;          // never signalled, waited on while the stream is disabled.
+    BOOL        Connecting;
+    BOOL        ReadPending;
+    BOOL        Closed;
+    DWORD       ReadOffset;
+    DWORD       ReadLength;
+    char        ReadBuffer[PIPE_BUFFER_SIZE];
+
+    const PLATFORM_STREAM_OPS* Ops;
+    PVOID       Context;
+    HANDLE      OpsEvent;
+};
+
+UINT32 PlatformSocketStartup()
+{
+    WSADATA wsaData = { 0 };
+    return WSAStartup(WINSOCK_VERSION, &wsaData);
+}
+
+VOID PlatformSocketCleanup()
+{
+    WSACleanup();
+}
+
+UINT32 PlatformSocketLastError()
+{
+    return WSAGetLastError();
+}
+
+BOOL PlatformSocketWouldBlock(UINT32 Error)
+{
+    return Error == WSAEWOULDBLOCK;
+}
+
+UINT32 PlatformSocketConnectResult(SOCKET Socket)
+{
+    int error = 0;
+    int length = sizeof(error);
+    if (getsockopt(Socket, SOL_SOCKET, SO_ERROR, (char*)&error, &length) == SOCKET_ERROR) {
+        return WSAGetLastError();
+    }
+    if (error != NO_ERROR) {
+        return (UINT32)error;
+    }
+    //
+    // WSAEnumNetworkEvents took the FD_CONNECT error, a socket that is not
+    // connected after all has no peer.
+    //
+    sockaddr_storage peer;
+    length = sizeof(peer);
+    if (getpeername(Socket, (sockaddr*)&peer, &length) == SOCKET_ERROR) {
+        return WSAGetLastError();
+    }
+    return NO_ERROR;
+}
+
+UINT32 PlatformSocketSetNonBlocking(SOCKET Socket)
+{
+    //
+    // FIONBIO fails while the socket has an event selected.
+    //
+    u_long yes = 1;
+    if (WSAEventSelect(Socket, NULL, 0) == SOCKET_ERROR ||
+        ioctlsocket(Socket, FIONBIO, &yes) == SOCKET_ERROR) {
+        return WSAGetLastError();
+    }
+    return NO_ERROR;
+}
+
+UINT32 PlatformSocketWaitWritable(SOCKET Socket, ULONG TimeoutMs)
+{
+    WSAPOLLFD pfd = { Socket, POLLOUT, 0 };
+    int result = WSAPoll(&pfd, 1, TimeoutMs == INFINITE ? -1 : (int)TimeoutMs);
+    if (result == SOCKET_ERROR) {
+        return WSAGetLastError();
+    }
+    if (result == 0) {
+        return WSAETIMEDOUT;
+    }
+    return (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) ? WSAECONNRESET : NO_ERROR;
+}
+
+//
+// starts the next read. A read that completes at once also signals the event.
+//
+static VOID PipeStartRead(PLATFORM_STREAM Stream)
+{
+    Stream->ReadOffset = 0;
+    Stream->ReadLength = 0;
+    DWORD read = 0;
+    if (ReadFile(Stream->Pipe, Stream->ReadBuffer, sizeof(Stream->ReadBuffer), &read,
+        &Stream->ReadOverlapped)) {
+        Stream->ReadLength = read;
+        return;
+    }
+    if (GetLastError() == ERROR_IO_PENDING) {
+        Stream->ReadPending = TRUE;
+        return;
+    }
+    // broken pipe or worse, the next recv reports the end of the stream.
+    Stream->Closed = TRUE;
+    SetEvent(Stream->ReadOverlapped.hEvent);
+}
+
+//
+// a server pipe is connected once its client opened it. Returns FALSE with
+// the socket error set until then.
+//
+static BOOL PipeConnected(PLATFORM_STREAM Stream)
+{
+    if (Stream->Connecting) {
+        DWORD transferred;
+        if (!GetOverlappedResult(Stream->Pipe, &Stream->ReadOverlapped, &transferred, FALSE)) {
+            DWORD error = GetLastError();
+            WSASetLastError(error == ERROR_IO_INCOMPLETE ? WSAEWOULDBLOCK : error);
+            return FALSE;
+        }
+        Stream->Connecting = FALSE;
+        PipeStartRead(Stream);
+    }
+    return TRUE;
+}
+
+static int ShmRecv(PLATFORM_STREAM Stream, char* Buffer, int Length);
+static int ShmSend(PLATFORM_STREAM Stream, const char* Buffer, int Length);
+static UINT32 ShmWaitWritable(PLATFORM_STREAM Stream, ULONG TimeoutMs);
+static VOID ShmClose(PLATFORM_STREAM Stream);
+
+static HANDLE StreamWaitHandle(PLATFORM_STREAM Stream)
+{
+    if (Stream->Type == PlatformStreamOps) {
+        return Stream->OpsEvent;
+    }
+    return (Stream->Type == PlatformStreamShm) ?
+        Stream->Events[SHM_EVENT_DATA(Stream->RxRing)] : Stream->ReadOverlapped.hEvent;
+}
+
+int PlatformStreamRecv(PLATFORM_STREAM Stream, char* Buffer, int Length)
+{
+    if (Stream->Type == PlatformStreamShm) {
+        return ShmRecv(Stream, Buffer, Length);
+    }
+    if (Stream->Type == PlatformStreamOps) {
+        UINT32 error = NO_ERROR;
+        int result = Stream->Ops->Recv(Stream->Context, Buffer, Length, &error);
+        WSASetLastError((int)error);
+        return result;
+    }
+    DWORD transferred = 0;
+    if (!PipeConnected(Stream)) {
+        return SOCKET_ERROR;
+    }
+    if (Stream->ReadPending) {
+        if (!GetOverlappedResult(Stream->Pipe, &Stream->ReadOverlapped, &transferred, FALSE)) {
+            DWORD error = GetLastError();
+            if (error == ERROR_IO_INCOMPLETE) {
+                WSASetLastError(WSAEWOULDBLOCK);
+                return SOCKET_ERROR;
+            }
+            Stream->ReadPending = FALSE;
+            Stream->Closed = TRUE;
+            if (error != ERROR_BROKEN_PIPE) {
+                WSASetLastError(error);
+                return SOCKET_ERROR;
+            }
+        }
+        Stream->ReadPending = FALSE;
+        Stream->ReadLength = transferred;
+    }
+    if (Stream->ReadOffset == Stream->ReadLength) {
+        if (Stream->Closed) {
+            return 0;
+        }
+        WSASetLastError(WSAEWOULDBLOCK);
+        return SOCKET_ERROR;
+    }
+
+    DWORD count = Stream->ReadLength - Stream->ReadOffset;
+    if (count > (DWORD)Length) {
+        count = (DWORD)Length;
+    }
+    RtlCopyMemory(Buffer, Stream->ReadBuffer + Stream->ReadOffset, count);
+    Stream->ReadOffset += count;
+    if (Stream->ReadOffset == Stream->ReadLength && !Stream->Closed) {
+        PipeStartRead(Stream);
+    }
+    return (int)count;
+}
+
+int PlatformStreamSend(PLATFORM_STREAM Stream, const char* Buffer, int Length)
+{
+    if (Stream->Type == PlatformStreamShm) {
+        return ShmSend(Stream, Buffer, Length);
+    }
+    if (Stream->Type == PlatformStreamOps) {
+        UINT32 error = NO_ERROR;
+        int result = Stream->Ops->Send(Stream->Context, Buffer, Length, &error);
+        WSASetLastError((int)error);
+        return result;
+    }
+    if (!PipeConnected(Stream)) {
+        if (WSAGetLastError() == WSAEWOULDBLOCK) {
+            WSASetLastError(WSAENOTCONN);
+        }
+        return SOCKET_ERROR;
+    }
+    //
+    // the write waits until the pipe takes the data, so it is never partial.
+    //
+    DWORD written = 0;
+    if (!WriteFile(Stream->Pipe, Buffer, Length, NULL, &Stream->WriteOverlapped) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        WSASetLastError(GetLastError());
+        return SOCKET_ERROR;
+    }
+    if (WaitForSingleObject(Stream->WriteOverlapped.hEvent, PIPE_WRITE_TIMEOUT_MS) != WAIT_OBJECT_0) {
+        CancelIoEx(Stream->Pipe, &Stream->WriteOverlapped);
+        GetOverlappedResult(Stream->Pipe, &Stream->WriteOverlapped, &written, TRUE);
+        WSASetLastError(WSAETIMEDOUT);
+        return SOCKET_ERROR;
+    }
+    if (!GetOverlappedResult(Stream->Pipe, &Stream->WriteOverlapped, &written, FALSE)) {
+        WSASetLastError(GetLastError());
+        return SOCKET_ERROR;
+    }
+    return (int)written;
+}
+
+UINT32 PlatformStreamWaitWritable(PLATFORM_STREAM Stream, ULONG TimeoutMs)
+{
+    if (Stream->Type == PlatformStreamShm) {
+        return ShmWaitWritable(Stream, TimeoutMs);
+    }
+    if (Stream->Type == PlatformStreamOps) {
+        return Stream->Ops->WaitWritable(Stream->Context, TimeoutMs);
+    }
+    return NO_ERROR;
+}
+
+VOID PlatformStreamClose(PLATFORM_STREAM Stream)
+{
+    if (Stream) {
+        if (Stream->Type == PlatformStreamShm) {
+            ShmClose(Stream);
+            return;
+        }
+        if (Stream->Type == PlatformStreamOps) {
+            Stream->Ops->Close(Stream->Context);
+            CloseHandle(Stream->IdleEvent);
+            free(Stream);
+            return;
+        }
+        if (Stream->Pipe != INVALID_HANDLE_VALUE) {
+            CancelIoEx(Stream->Pipe, NULL);
+            DWORD transferred;
+            if (Stream->Connecting || Stream->ReadPending) {
+                GetOverlappedResult(Stream->Pipe, &Stream->ReadOverlapped, &transferred, TRUE);
+            }
+            CloseHandle(Stream->Pipe);
+        }
+        if (Stream->ReadOverlapped.hEvent) {
+            CloseHandle(Stream->ReadOverlapped.hEvent);
+        }
+        if (Stream->WriteOverlapped.hEvent) {
+            CloseHandle(Stream->WriteOverlapped.hEvent);
+        }
+        if (Stream->IdleEvent) {
+            CloseHandle(Stream->IdleEvent);
+        }
+        free(Stream);
+    }
+}
+
+static std::string PipePath(const char* Name)
+{
+    std::string name(Name);
+    return (name.compare(0, 2, "\\\\") == 0) ? name : "\\\\.\\pipe\\" + name;
+}
+
+UINT32 PlatformStreamCreate(const PLATFORM_STREAM_OPS* Ops, PVOID Context,
+    PLATFORM_EVENT Event, PLATFORM_STREAM* Stream)
+{
+    *Stream = (PLATFORM_STREAM)calloc(1, sizeof(**Stream));
+    if (*Stream == NULL) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    PLATFORM_STREAM stream = *Stream;
+    stream->IdleEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (stream->IdleEvent == NULL) {
+        UINT32 error = GetLastError();
+        free(stream);
+        *Stream = NULL;
+        return error;
+    }
+    stream->Type = PlatformStreamOps;
+    stream->Pipe = INVALID_HANDLE_VALUE;
+    stream->Ops = Ops;
+    stream->Context = Context;
+    stream->OpsEvent = Event;
+    return NO_ERROR;
+}
+
+static UINT32 PipeStreamCreate(PLATFORM_STREAM* Stream)
+{
+    *Stream = (PLATFORM_STREAM)calloc(1, sizeof(**Stream));
+    if (*Stream == NULL) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    PLATFORM_STREAM stream = *Stream;
+    stream->Pipe = INVALID_HANDLE_VALUE;
+    stream->ReadOverlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    stream->WriteOverlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    stream->IdleEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!stream->ReadOverlapped.hEvent || !stream->WriteOverlapped.hEvent || !stream->IdleEvent) {
+        UINT32 error = GetLastError();
+        PlatformStreamClose(stream);
+        *Stream = NULL;
+        return error;
+    }
+    return NO_ERROR;
+}
+
+UINT32 PlatformPipeConnect(const char* Name, PLATFORM_STREAM* Stream)
+{
+    UINT32 error = PipeStreamCreate(Stream);
+    if (error != NO_ERROR) {
+        return error;
+    }
+    std::string path = PipePath(Name);
+    for (;;) {
+        (*Stream)->Pipe = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+            OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+        if ((*Stream)->Pipe != INVALID_HANDLE_VALUE) {
+            break;
+        }
+        error = GetLastError();
+        // all instances busy, wait a little for one.
+        if (error != ERROR_PIPE_BUSY || !WaitNamedPipeA(path.c_str(), 1000)) {
+            PlatformStreamClose(*Stream);
+            *Stream = NULL;
+            return error;
+        }
+    }
+    PipeStartRead(*Stream);
+    return NO_ERROR;
+}
+
+UINT32 PlatformPipeCreate(const char* Name, PLATFORM_STREAM* Stream)
+{
+    UINT32 error = PipeStreamCreate(Stream);
+    if (error != NO_ERROR) {
+        return error;
+    }
+    PLATFORM_STREAM stream = *Stream;
+    std::string path = PipePath(Name);
+    stream->Pipe = CreateNamedPipeA(path.c_str(),
+        PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        1, PIPE_BUFFER_SIZE, PIPE_BUFFER_SIZE, 0, NULL);
+    if (stream->Pipe == INVALID_HANDLE_VALUE) {
+        error = GetLastError();
+        PlatformStreamClose(stream);
+        *Stream = NULL;
+        return error;
+    }
+    //
+    // the read event signals the connect, the next recv starts reading.
+    //
+    if (ConnectNamedPipe(stream->Pipe, &stream->ReadOverlapped)) {
+        stream->Connecting = TRUE;
+        return NO_ERROR;
+    }
+    error = GetLastError();
+    if (error == ERROR_IO_PENDING) {
+        stream->Connecting = TRUE;
+        return NO_ERROR;
+    }
+    if (error == ERROR_PIPE_CONNECTED) {
+        PipeStartRead(stream);
+        return NO_ERROR;
+    }
+    PlatformStreamClose(stream);
+    *Stream = NULL;
+    return error;
+}
+
+static BOOL ShmPeerClosed(PLATFORM_STREAM Stream)
+{
+    return Stream->Header->Closed[Stream->Side ^ 1] != 0;
+}
+
+static int ShmRecv(PLATFORM_STREAM Stream, char* Buffer, int Length)
+{
+    if (!Stream->Header->Attached) {
+        WSASetLastError(WSAEWOULDBLOCK);
+        return SOCKET_ERROR;
+    }
+    for (;;) {
+        BOOL wakeWriter;
+        ULONG count = ShmRingRead(&Stream->Rx, (BYTE*)Buffer, (ULONG)Length, &wakeWriter);
+        if (wakeWriter) {
+            SetEvent(Stream->Events[SHM_EVENT_SPACE(Stream->RxRing)]);
+        }
+        if (count != 0) {
+            return (int)count;
+        }
+        //
+        // empty. While the reader is armed the signal is still to come,
+        // else reset the event and ask for the next one.
+        //
+        if (!ShmRingReaderArmed(&Stream->Rx) ||
+            (++Stream->EmptyPolls % SHM_POLL_CHECK) == 0) {
+            ResetEvent(Stream->Events[SHM_EVENT_DATA(Stream->RxRing)]);
+            if (!ShmRingArmReader(&Stream->Rx)) {
+                continue;
+            }
+        }
+        //
+        // a peer that exits without closing its end is not noticed here, a
+        // mapping has no connection that breaks.
+        //
+        if (ShmPeerClosed(Stream)) {
+            return 0;
+        }
+        WSASetLastError(WSAEWOULDBLOCK);
+        return SOCKET_ERROR;
+    }
+}
+
+static int ShmSend(PLATFORM_STREAM Stream, const char* Buffer, int Length)
+{
+    if (!Stream->Header->Attached) {
+        WSASetLastError(WSAENOTCONN);
+        return SOCKET_ERROR;
+    }
+    if (ShmPeerClosed(Stream)) {
+        WSASetLastError(WSAECONNRESET);
+        return SOCKET_ERROR;
+    }
+    BOOL wakeReader;
+    ULONG count = ShmRingWrite(&Stream->Tx, (const BYTE*)Buffer, (ULONG)Length, &wakeReader);
+    if (wakeReader) {
+        SetEvent(Stream->Events[SHM_EVENT_DATA(Stream->TxRing)]);
+    }
+    if (count == 0) {
+        WSASetLastError(WSAEWOULDBLOCK);
+        return SOCKET_ERROR;
+    }
+    return (int)count;
+}
+
+static UINT32 ShmWaitWritable(PLATFORM_STREAM Stream, ULONG TimeoutMs)
+{
+    if (!Stream->Header->Attached) {
+        return WSAENOTCONN;
+    }
+    HANDLE space = Stream->Events[SHM_EVENT_SPACE(Stream->TxRing)];
+    ULONGLONG deadline = GetTickCount64() + TimeoutMs;
+    for (;;) {
+        ResetEvent(space);
+        if (!ShmRingArmWriter(&Stream->Tx)) {
+            return NO_ERROR;
+        }
+        if (ShmPeerClosed(Stream)) {
+            return WSAECONNRESET;
+        }
+        DWORD wait = INFINITE;
+        if (TimeoutMs != INFINITE) {
+            ULONGLONG now = GetTickCount64();
+            if (now >= deadline) {
+                return WSAETIMEDOUT;
+            }
+            wait = (DWORD)(deadline - now);
+        }
+        if (WaitForSingleObject(space, wait) == WAIT_FAILED) {
+            return GetLastError();
+        }
+    }
+}
+
+static VOID ShmClose(PLATFORM_STREAM Stream)
+{
+    if (Stream->Header) {
+        if (Stream->Joined) {
+            //
+            // wake the other side in case it waits for data or space.
+            //
+            Stream->Header->Closed[Stream->Side] = 1;
+            SetEvent(Stream->Events[SHM_EVENT_DATA(Stream->TxRing)]);
+            SetEvent(Stream->Events[SHM_EVENT_SPACE(Stream->RxRing)]);
+        }
+        UnmapViewOfFile(Stream->Header);
+    }
+    for (HANDLE event : Stream->Events) {
+        if (event) {
+            CloseHandle(event);
+        }
+    }
+    if (Stream->Mapping) {
+        CloseHandle(Stream->Mapping);
+    }
+    if (Stream->IdleEvent) {
+        CloseHandle(Stream->IdleEvent);
+    }
+    free(Stream);
+}
+
+static std::string ShmObjectName(const char* Name, int Event)
+{
+    std::string name = std::string("Global\\htsvsp-shm-") + Name;
+    return (Event < 0) ? name : name + "-" + std::to_string(Event);
+}
+
+static UINT32 ShmStreamCreate(ULONG Side, PLATFORM_STREAM* Stream)
+{
+    *Stream = (PLATFORM_STREAM)calloc(1, sizeof(**Stream));
+    if (*Stream == NULL) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    PLATFORM_STREAM stream = *Stream;
+    stream->Type = PlatformStreamShm;
+    stream->Side = Side;
+    stream->RxRing = (Side == SHM_SERVER) ? SHM_RING_TO_SERVER : SHM_RING_TO_CLIENT;
+    stream->TxRing = stream->RxRing ^ 1;
+    stream->Pipe = INVALID_HANDLE_VALUE;
+    stream->IdleEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (stream->IdleEvent == NULL) {
+        UINT32 error = GetLastError();
+        ShmClose(stream);
+        *Stream = NULL;
+        return error;
+    }
+    return NO_ERROR;
+}
+
+UINT32 PlatformShmConnect(const char* Name, PLATFORM_STREAM* Stream)
+{
+    UINT32 error = ShmStreamCreate(SHM_CLIENT, Stream);
+    if (error != NO_ERROR) {
+        return error;
+    }
+    PLATFORM_STREAM stream = *Stream;
+    MEMORY_BASIC_INFORMATION region;
+
+    stream->Mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, ShmObjectName(Name, -1).c_str());
+    if (stream->Mapping == NULL) {
+        error = GetLastError();
+        goto cleanup;
+    }
+    stream->Header = (PSHM_HEADER)MapViewOfFile(stream->Mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (stream->Header == NULL) {
+        error = GetLastError();
+        goto cleanup;
+    }
+    if ((VirtualQuery(stream->Header, &region, sizeof(region)) == 0) ||
+        (ShmValidate(stream->Header, region.RegionSize) == 0)) {
+        error = ERROR_BAD_FORMAT;
+        goto cleanup;
+    }
+    for (int index = 0; index < SHM_EVENTS; index++) {
+        stream->Events[index] = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE,
+            ShmObjectName(Name, index).c_str());
+        if (stream->Events[index] == NULL) {
+            error = GetLastError();
+            goto cleanup;
+        }
+    }
+    ShmRingView(stream->Header, stream->RxRing, &stream->Rx);
+    ShmRingView(stream->Header, stream->TxRing, &stream->Tx);
+
+    //
+    // one client per mapping, like a pipe. The server learns of it from its
+    // data event.
+    //
+    if (InterlockedCompareExchange(&stream->Header->Attached, 1, 0) != 0) {
+        error = ERROR_PIPE_BUSY;
+        goto cleanup;
+    }
+    stream->Joined = TRUE;
+    SetEvent(stream->Events[SHM_EVENT_DATA(stream->TxRing)]);
+    return NO_ERROR;
+
+cleanup:
+    ShmClose(stream);
+    *Stream = NULL;
+    return error;
+}
+
+UINT32 PlatformShmCreate(const char* Name, ULONG RingSize, PLATFORM_STREAM* Stream)
+{
+    if (RingSize == 0) {
+        RingSize = SHM_DEFAULT_RING_SIZE;
+    }
+    if (RingSize < SHM_MIN_RING_SIZE) {
+        *Stream = NULL;
+        return ERROR_INVALID_PARAMETER;
+    }
+    UINT32 error = ShmStreamCreate(SHM_SERVER, Stream);
+    if (error != NO_ERROR) {
+        return error;
+    }
+    PLATFORM_STREAM stream = *Stream;
+    ULONGLONG size = ShmMappingSize(RingSize);
+    SECURITY_ATTRIBUTES security = { sizeof(security), NULL, FALSE };
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(SHM_SDDL, SDDL_REVISION_1,
+        &security.lpSecurityDescriptor, NULL)) {
+        error = GetLastError();
+        goto cleanup;
+    }
+
+    stream->Mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, &security, PAGE_READWRITE,
+        (DWORD)(size >> 32), (DWORD)size, ShmObjectName(Name, -1).c_str());
+    if (stream->Mapping == NULL || GetLastError() == ERROR_ALREADY_EXISTS) {
+        // another server has the name.
+        error = stream->Mapping ? ERROR_ALREADY_EXISTS : GetLastError();
+        goto cleanup;
+    }
+    stream->Header = (PSHM_HEADER)MapViewOfFile(stream->Mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)size);
+    if (stream->Header == NULL) {
+        error = GetLastError();
+        goto cleanup;
+    }
+    for (int index = 0; index < SHM_EVENTS; index++) {
+        stream->Events[index] = CreateEventA(&security, TRUE, FALSE, ShmObjectName(Name, index).c_str());
+        if (stream->Events[index] == NULL) {
+            error = GetLastError();
+            goto cleanup;
+        }
+    }
+    ShmInitialize(stream->Header, RingSize);
+    ShmRingView(stream->Header, stream->RxRing, &stream->Rx);
+    ShmRingView(stream->Header, stream->TxRing, &stream->Tx);
+    stream->Joined = TRUE;
+
+cleanup:
+    LocalFree(security.lpSecurityDescriptor);
+    if (error != NO_ERROR) {
+        ShmClose(stream);
+        *Stream = NULL;
+    }
+    return error;
+}
+
+UINT32 PlatformEventCreate(BOOL ManualReset, PLATFORM_EVENT* Event)
+{
+    *Event = CreateEvent(NULL, ManualReset, FALSE, NULL);
+    return *Event ? NO_ERROR : GetLastError();
+}
+
+VOID PlatformEventSet(PLATFORM_EVENT Event)
+{
+    SetEvent(Event);
+}
+
+VOID PlatformEventReset(PLATFORM_EVENT Event)
+{
+    ResetEvent(Event);
+}
+
+VOID PlatformEventClose(PLATFORM_EVENT Event)
+{
+    if (Event) {
+        CloseHandle(Event);
+    }
+}
+
+UINT32 PlatformTimerCreate(PLATFORM_TIMER* Timer)
+{
+    //
+    // a synchronization timer, reset when a wait returns it.
+    //
+    *Timer = CreateWaitableTimer(NULL, FALSE, NULL);
+    return *Timer ? NO_ERROR : GetLastError();
+}
+
+VOID PlatformTimerStart(PLATFORM_TIMER Timer, ULONGLONG DueMs)
+{
+    LARGE_INTEGER due;
+    due.QuadPart = -(LONGLONG)(DueMs * 10000);  // relative, in 100ns units.
+    SetWaitableTimer(Timer, &due, 0, NULL, NULL, FALSE);
+}
+
+VOID PlatformTimerStop(PLATFORM_TIMER Timer)
+{
+    CancelWaitableTimer(Timer);
+}
+
+VOID PlatformTimerClose(PLATFORM_TIMER Timer)
+{
+    if (Timer) {
+        CancelWaitableTimer(Timer);
+        CloseHandle(Timer);
+    }
+}
+
+static DWORD WINAPI ThreadStart(PVOID Context)
+{
+    PLATFORM_THREAD_START start = *(PPLATFORM_THREAD_START)Context;
+    free(Context);
+    return start.Routine(start.Context);
+}
+
+UINT32 PlatformFileMap(const char* Path, BOOL Create, ULONGLONG* Size, PVOID* View)
+{
+    *View = NULL;
+    HANDLE file = CreateFileA(Path, Create ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, Create ? CREATE_ALWAYS : OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return GetLastError();
+    }
+    UINT32 error = NO_ERROR;
+    LARGE_INTEGER length;
+    if (!Create) {
+        if (GetFileSizeEx(file, &length)) {
+            *Size = (ULONGLONG)length.QuadPart;
+        }
+        else {
+            error = GetLastError();
+        }
+    }
+    if (error == NO_ERROR && *Size == 0) {
+        error = ERROR_INVALID_PARAMETER;
+    }
+    if (error == NO_ERROR) {
+        // a mapping larger than the file extends it with zeros.
+        HANDLE mapping = CreateFileMappingA(file, NULL, Create ? PAGE_READWRITE : PAGE_READONLY,
+            (DWORD)(*Size >> 32), (DWORD)*Size, NULL);
+        if (mapping == NULL) {
+            error = GetLastError();
+        }
+        else {
+            *View = MapViewOfFile(mapping, Create ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, (SIZE_T)*Size);
+            if (*View == NULL) {
+                error = GetLastError();
+            }
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+    return error;
+}
+
+VOID PlatformFileUnmap(PVOID View, ULONGLONG Size)
+{
+    UNREFERENCED_PARAMETER(Size);
+    if (View) {
+        UnmapViewOfFile(View);
+    }
+}
+
+ULONGLONG PlatformTimeUs()
+{
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&now);
+    return (ULONGLONG)(now.QuadPart / frequency.QuadPart) * 1000000 +
+        (ULONGLONG)(now.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+VOID PlatformSpinPause()
+{
+    YieldProcessor();
+}
+
+ULONG PlatformCpuCount()
+{
+    DWORD_PTR processMask;
+    DWORD_PTR systemMask;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask) && processMask) {
+        ULONG count = 0;
+        for (; processMask; processMask &= processMask - 1) {
+            count++;
+        }
+        return count;
+    }
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+UINT32 PlatformThreadCreate(PLATFORM_THREAD_ROUTINE Routine, PVOID Context, PLATFORM_THREAD* Thread)
+{
+    *Thread = NULL;
+    PPLATFORM_THREAD_START start = (PPLATFORM_THREAD_START)malloc(sizeof(*start));
+    if (start == NULL) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    start->Routine = Routine;
+    start->Context = Context;
+    *Thread = CreateThread(NULL, 0, ThreadStart, start, 0, NULL);
+    if (*Thread == NULL) {
+        UINT32 error = GetLastError();
+        free(start);
+        return error;
+    }
+    return NO_ERROR;
+}
+
+BOOL PlatformThreadJoin(PLATFORM_THREAD Thread, ULONG TimeoutMs)
+{
+    if (WaitForSingleObject(Thread, TimeoutMs) != WAIT_OBJECT_0) {
+        return FALSE;
+    }
+    CloseHandle(Thread);
+    return TRUE;
+}
+
+UINT32 PlatformThreadSetAffinity(ULONGLONG Mask)
+{
+    DWORD_PTR processMask;
+    DWORD_PTR systemMask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+        return GetLastError();
+    }
+    DWORD_PTR mask = Mask ? ((DWORD_PTR)Mask & processMask) : processMask;
+    if (mask == 0) {
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0) {
+        return GetLastError();
+    }
+    return NO_ERROR;
+}
+
+UINT32 PlatformThreadSetPriority(PLATFORM_PRIORITY Priority)
+{
+    int priority = THREAD_PRIORITY_NORMAL;
+    if (Priority == PlatformPriorityHigh) {
+        priority = THREAD_PRIORITY_HIGHEST;
+    }
+    else if (Priority == PlatformPriorityLow) {
+        priority = THREAD_PRIORITY_BELOW_NORMAL;
+    }
+    if (!SetThreadPriority(GetCurrentThread(), priority)) {
+        return GetLastError();
+    }
+    return NO_ERROR;
+}
+
+VOID PlatformLockInitialize(PLATFORM_LOCK* Lock)
+{
+    InitializeSRWLock(Lock);
+}
+
+VOID PlatformLockAcquire(PLATFORM_LOCK* Lock)
+{
+    AcquireSRWLockExclusive(Lock);
+}
+
+VOID PlatformLockRelease(PLATFORM_LOCK* Lock)
+{
+    ReleaseSRWLockExclusive(Lock);
+}
+
+UINT32 PlatformWaiterCreate(PPLATFORM_WAITER* Waiter)
+{
+    *Waiter = (PPLATFORM_WAITER)calloc(1, sizeof(**Waiter));
+    return *Waiter ? NO_ERROR : ERROR_NOT_ENOUGH_MEMORY;
+}
+
+static UINT32 WaiterAdd(PPLATFORM_WAITER Waiter, HANDLE Handle, SOCKET Socket, long NetworkEvents)
+{
+    if (Waiter->Count == PLATFORM_WAIT_MAX) {
+        return ERROR_INSUFFICIENT_BUFFER;
+    }
+    Waiter->Handles[Waiter->Count] = Handle;
+    Waiter->Sockets[Waiter->Count] = Socket;
+    Waiter->NetworkEvents[Waiter->Count] = NetworkEvents;
+    Waiter->Count++;
+    return NO_ERROR;
+}
+
+UINT32 PlatformWaiterAddSocket(PPLATFORM_WAITER Waiter, SOCKET Socket, ULONG Interest)
+{
+    long networkEvents = (Interest == PLATFORM_SOCKET_ACCEPT) ? FD_ACCEPT :
+        (Interest == PLATFORM_SOCKET_CONNECT) ? FD_CONNECT : (FD_READ | FD_CLOSE);
+    WSAEVENT event = WSACreateEvent();
+    if (event == WSA_INVALID_EVENT) {
+        return WSAGetLastError();
+    }
+    //
+    // note that this makes the socket non-blocking.
+    //
+    if (WSAEventSelect(Socket, event, networkEvents) == SOCKET_ERROR) {
+        UINT32 error = WSAGetLastError();
+        WSACloseEvent(event);
+        return error;
+    }
+    UINT32 error = WaiterAdd(Waiter, event, Socket, networkEvents);
+    if (error != NO_ERROR) {
+        WSAEventSelect(Socket, event, 0);
+        WSACloseEvent(event);
+    }
+    return error;
+}
+
+UINT32 PlatformWaiterAddStream(PPLATFORM_WAITER Waiter, PLATFORM_STREAM Stream)
+{
+    UINT32 error = WaiterAdd(Waiter, StreamWaitHandle(Stream), INVALID_SOCKET, 0);
+    if (error == NO_ERROR) {
+        Waiter->Streams[Waiter->Count - 1] = Stream;
+    }
+    return error;
+}
+
+UINT32 PlatformWaiterAddEvent(PPLATFORM_WAITER Waiter, PLATFORM_EVENT Event)
+{
+    return WaiterAdd(Waiter, Event, INVALID_SOCKET, 0);
+}
+
+UINT32 PlatformWaiterAddTimer(PPLATFORM_WAITER Waiter, PLATFORM_TIMER Timer)
+{
+    return WaiterAdd(Waiter, Timer, INVALID_SOCKET, 0);
+}
+
+VOID PlatformWaiterEnableSocket(PPLATFORM_WAITER Waiter, SOCKET Socket, BOOL Enable)
+{
+    for (ULONG index = 0; index < Waiter->Count; index++) {
+        if (Waiter->Sockets[index] == Socket) {
+            WSAEventSelect(Socket, Waiter->Handles[index],
+                Enable ? Waiter->NetworkEvents[index] : 0);
+            if (!Enable) {
+                WSAResetEvent(Waiter->Handles[index]);
+            }
+            return;
+        }
+    }
+}
+
+VOID PlatformWaiterEnableStream(PPLATFORM_WAITER Waiter, PLATFORM_STREAM Stream, BOOL Enable)
+{
+    for (ULONG index = 0; index < Waiter->Count; index++) {
+        if (Waiter->Streams[index] == Stream) {
+            Waiter->Handles[index] = Enable ? StreamWaitHandle(Stream) : Stream->IdleEvent;
+            return;
+        }
+    }
+}
+
+//
+// the source a wait returned for. a socket event is reset here, winsock
+// signals it again after the next recv or accept if there is more to do.
+//
+static ULONG WaiterSignalled(PPLATFORM_WAITER Waiter, ULONG Index)
+{
+    if (Waiter->Sockets[Index] != INVALID_SOCKET) {
+        WSANETWORKEVENTS networkEvents;
+        WSAEnumNetworkEvents(Waiter->Sockets[Index], Waiter->Handles[Index], &networkEvents);
+    }
+    return Index;
+}
+
+//
+// the lowest source a registered wait took the signal of, or a lower source
+// that is signalled. probing a lower source takes its signal, auto reset
+// events and synchronization timers are reset by the probe, so it is
+// returned here rather than left for the wait that can no longer see it.
+//
+static ULONG WaiterTakePending(PPLATFORM_WAITER Waiter)
+{
+    LONG pending = InterlockedExchange(&Waiter->Pending, 0);
+    if (pending == 0) {
+        return PLATFORM_WAIT_TIMEOUT;
+    }
+    ULONG index = 0;
+    while (!(pending & (1L << index))) {
+        index++;
+    }
+    if (index > 0) {
+        DWORD result = WSAWaitForMultipleEvents(index, Waiter->Handles, FALSE, 0, FALSE);
+        if (result < WSA_WAIT_EVENT_0 + index) {
+            InterlockedOr(&Waiter->Pending, pending);
+            return WaiterSignalled(Waiter, result - WSA_WAIT_EVENT_0);
+        }
+    }
+    pending &= ~(1L << index);
+    if (pending) {
+        InterlockedOr(&Waiter->Pending, pending);
+    }
+    return index;
+}
+
+ULONG PlatformWait(PPLATFORM_WAITER Waiter, ULONG TimeoutMs)
+{
+    ULONG pending = WaiterTakePending(Waiter);
+    if (pending != PLATFORM_WAIT_TIMEOUT) {
+        return pending;
+    }
+    for (;;) {
+        DWORD result = WSAWaitForMultipleEvents(Waiter->Count, Waiter->Handles, FALSE,
+            TimeoutMs, TRUE);
+        if (result == WSA_WAIT_IO_COMPLETION) {
+            // io completion interrupted the wait. retry.
+            continue;
+        }
+        if (result == WSA_WAIT_TIMEOUT) {
+            return PLATFORM_WAIT_TIMEOUT;
+        }
+        if (result >= WSA_WAIT_EVENT_0 + Waiter->Count) {
+            return PLATFORM_WAIT_FAILED;
+        }
+        return WaiterSignalled(Waiter, result - WSA_WAIT_EVENT_0);
+    }
+}
+
+static VOID WatcherDisarm(PPLATFORM_WAITER Waiter);
+
+VOID PlatformWaiterClose(PPLATFORM_WAITER Waiter)
+{
+    if (Waiter) {
+        WatcherDisarm(Waiter);
+        for (ULONG index = 0; index < Waiter->Count; index++) {
+            if (Waiter->Sockets[index] != INVALID_SOCKET) {
+                WSAEventSelect(Waiter->Sockets[index], Waiter->Handles[index], 0);
+                WSACloseEvent(Waiter->Handles[index]);
+            }
+        }
+        free(Waiter);
+    }
+}
+
+UINT32 PlatformWatcherCreate(PPLATFORM_WATCHER* Watcher)
+{
+    *Watcher = NULL;
+    PPLATFORM_WATCHER watcher = (PPLATFORM_WATCHER)calloc(1, sizeof(*watcher));
+    if (watcher == NULL) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    InitializeSRWLock(&watcher->Lock);
+    watcher->Event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (watcher->Event == NULL) {
+        UINT32 error = GetLastError();
+        free(watcher);
+        return error;
+    }
+    *Watcher = watcher;
+    return NO_ERROR;
+}
+
+//
+// a registered wait fired. The first source of the waiter to fire puts it
+// on the Fired list.
+//
+static VOID CALLBACK WatchCallback(PVOID Parameter, BOOLEAN TimerOrWaitFired)
+{
+    UNREFERENCED_PARAMETER(TimerOrWaitFired);
+    PLATFORM_WATCH_SOURCE* source = (PLATFORM_WATCH_SOURCE*)Parameter;
+    PPLATFORM_WAITER waiter = source->Waiter;
+    if (waiter->Sockets[source->Index] == INVALID_SOCKET) {
+        InterlockedOr(&waiter->Pending, 1L << source->Index);
+    }
+    if (InterlockedExchange(&waiter->Fired, 1) != 0) {
+        return;
+    }
+    PPLATFORM_WATCHER watcher = waiter->Watcher;
+    AcquireSRWLockExclusive(&watcher->Lock);
+    waiter->FiredNext = NULL;
+    if (watcher->FiredTail) {
+        watcher->FiredTail->FiredNext = waiter;
+    }
+    else {
+        watcher->Fired = waiter;
+    }
+    watcher->FiredTail = waiter;
+    ReleaseSRWLockExclusive(&watcher->Lock);
+    SetEvent(watcher->Event);
+}
+
+//
+// takes the waiter off the Fired list, if it is on it, and its registered
+// waits. Under the Lock, so that each wait is unregistered once.
+//
+static ULONG WatcherTake(PPLATFORM_WATCHER Watcher, PPLATFORM_WAITER Waiter, HANDLE* Waits)
+{
+    PPLATFORM_WAITER previous = NULL;
+    for (PPLATFORM_WAITER current = Watcher->Fired; current; current = current->FiredNext) {
+        if (current == Waiter) {
+            if (previous) {
+                previous->FiredNext = current->FiredNext;
+            }
+            else {
+                Watcher->Fired = current->FiredNext;
+            }
+            if (Watcher->FiredTail == current) {
+                Watcher->FiredTail = previous;
+            }
+            break;
+        }
+        previous = current;
+    }
+    ULONG count = Waiter->WaitCount;
+    RtlCopyMemory(Waits, Waiter->Waits, count * sizeof(Waits[0]));
+    Waiter->WaitCount = 0;
+    return count;
+}
+
+//
+// ends registered waits, waiting for their callbacks in progress.
+//
+static VOID WatcherUnregister(HANDLE* Waits, ULONG Count)
+{
+    for (ULONG index = 0; index < Count; index++) {
+        UnregisterWaitEx(Waits[index], INVALID_HANDLE_VALUE);
+    }
+}
+
+static VOID WatcherDisarm(PPLATFORM_WAITER Waiter)
+{
+    PPLATFORM_WATCHER watcher = Waiter->Watcher;
+    if (watcher == NULL) {
+        return;
+    }
+    HANDLE waits[PLATFORM_WAIT_MAX];
+    AcquireSRWLockExclusive(&watcher->Lock);
+    ULONG count = WatcherTake(watcher, Waiter, waits);
+    ReleaseSRWLockExclusive(&watcher->Lock);
+    WatcherUnregister(waits, count);
+}
+
+UINT32 PlatformWatcherArm(PPLATFORM_WATCHER Watcher, PPLATFORM_WAITER Waiter, PVOID Context)
+{
+    ASSERT(Waiter->Watcher == NULL || Waiter->Watcher == Watcher);
+    WatcherDisarm(Waiter);
+    Waiter->Watcher = Watcher;
+    Waiter->WatchContext = Context;
+    Waiter->Fired = 0;
+
+    //
+    // registered outside the Lock, the callbacks take it. A callback may put
+    // the waiter on the Fired list before its waits are published, the next
+    // arm or the close unregisters them then.
+    //
+    HANDLE waits[PLATFORM_WAIT_MAX];
+    ULONG count = 0;
+    UINT32 error = NO_ERROR;
+    for (ULONG index = 0; index < Waiter->Count; index++) {
+        Waiter->WatchSources[index].Waiter = Waiter;
+        Waiter->WatchSources[index].Index = index;
+        if (!RegisterWaitForSingleObject(&waits[count], Waiter->Handles[index],
+            WatchCallback, &Waiter->WatchSources[index], INFINITE,
+            WT_EXECUTEONLYONCE | WT_EXECUTEINWAITTHREAD)) {
+            error = GetLastError();
+            break;
+        }
+        count++;
+    }
+    AcquireSRWLockExclusive(&Watcher->Lock);
+    RtlCopyMemory(Waiter->Waits, waits, count * sizeof(waits[0]));
+    Waiter->WaitCount = count;
+    ReleaseSRWLockExclusive(&Watcher->Lock);
+    if (error != NO_ERROR) {
+        WatcherDisarm(Waiter);
+    }
+    return error;
+}
+
+VOID PlatformWatcherWake(PPLATFORM_WATCHER Watcher)
+{
+    SetEvent(Watcher->Event);
+}
+
+ULONG PlatformWatcherWait(PPLATFORM_WATCHER Watcher, ULONG TimeoutMs, PVOID* Contexts, ULONG MaxContexts)
+{
+    DWORD result = WaitForSingleObject(Watcher->Event, TimeoutMs);
+    if (result == WAIT_TIMEOUT) {
+        return 0;
+    }
+    if (result != WAIT_OBJECT_0) {
+        return PLATFORM_WAIT_FAILED;
+    }
+    ULONG count = 0;
+    AcquireSRWLockExclusive(&Watcher->Lock);
+    while (Watcher->Fired && count < MaxContexts) {
+        PPLATFORM_WAITER waiter = Watcher->Fired;
+        HANDLE waits[PLATFORM_WAIT_MAX];
+        ULONG waitCount = WatcherTake(Watcher, waiter, waits);
+        Contexts[count++] = waiter->WatchContext;
+        //
+        // unregistering waits for a callback in progress, which may be
+        // waiting for the Lock.
+        //
+        ReleaseSRWLockExclusive(&Watcher->Lock);
+        WatcherUnregister(waits, waitCount);
+        AcquireSRWLockExclusive(&Watcher->Lock);
+    }
+    if (Watcher->Fired) {
+        // the rest for the next wait.
+        SetEvent(Watcher->Event);
+    }
+    ReleaseSRWLockExclusive(&Watcher->Lock);
+    return count;
+}
+
+VOID PlatformWatcherClose(PPLATFORM_WATCHER Watcher)
+{
+    if (Watcher) {
+        CloseHandle(Watcher->Event);
+        free(Watcher);
+    }
+}
@@ -0,0 +1,778 @@
+/*++
+
+Module Name:
+
+    pool.cpp
+
+Abstract:
+
+    The worker pool of the process, see pool.h.
+
+    PoolLock keeps the states of the works, the list of waiting works and
+    which workers are idle. Each queue has a lock of its own. A worker that
+    finds no work anywhere marks itself idle and waits for its event, a
+    work that is queued wakes the worker of its queue if that one is idle,
+    else another idle worker, which takes it from there.
+
+    A work that returns PoolWorkWait is armed with the watcher under
+    PoolLock, so the watcher, which takes PoolLock for the works it found,
+    never sees a signal of a work before the work is waiting.
+
+--*/
+
+#include "pool.h"
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define POOL_MEMORY_ERROR       ERROR_NOT_ENOUGH_MEMORY
+#define POOL_STATE_ERROR        ERROR_INVALID_STATE
+#else
+#define POOL_MEMORY_ERROR       ENOMEM
+#define POOL_STATE_ERROR        EINVAL
+#endif
+
+//
+// the works the watcher takes from one wait.
+//
+#define POOL_WATCH_BATCH        64
+
+typedef enum _POOL_WORK_STATE {
+    PoolStateQueued,
+    PoolStateWaiting,
+    PoolStateDone,
+} POOL_WORK_STATE;
+
+struct _POOL_WORK {
+    POOL_WORK_ROUTINE   Routine;
+    PVOID               Context;
+    ULONG               Home;           // the queue it goes back to.
+    PPOOL_WORK          Next;           // in a queue, or in the waiting list.
+    PLATFORM_EVENT      DoneEvent;
+
+    //
+    // under PoolLock.
+    //
+    POOL_WORK_STATE     State;
+    BOOL                TimedOut;
+    BOOL                Detached;       // a join gave up, it frees itself.
+    PPOOL_WORK*         WaitLink;       // where the waiting list points to it.
+    ULONGLONG           DeadlineUs;     // of its wait, 0 for none.
+
+    //
+    // set by the work itself, see PoolWorkSchedule.
+    //
+    PLATFORM_PRIORITY   Priority;
+    ULONGLONG           Affinity;
+};
+
+typedef struct _POOL_WORKER {
+    PLATFORM_THREAD     Thread;
+    PLATFORM_EVENT      Event;
+    PPLATFORM_WAITER    Waiter;         // of Event.
+
+    PLATFORM_LOCK       QueueLock;
+    PPOOL_WORK          QueueHead;      // under QueueLock.
+    PPOOL_WORK          QueueTail;
+    ULONG               QueueCount;
+
+    BOOL                Idle;           // under PoolLock.
+
+    PLATFORM_PRIORITY   Priority;       // of its thread now.
+    ULONGLONG           Affinity;
+
+    //
+    // of this worker only, read without a lock.
+    //
+    INT64               Runs;
+    INT64               Steals;
+    INT64               Yields;
+    INT64               ScheduleErrors;
+} POOL_WORKER, *PPOOL_WORKER;
+
+typedef struct _POOL {
+    PLATFORM_LOCK       Lock;
+    BOOL                Started;
+    BOOL                Stopping;
+    ULONG               WorkerCount;    // with a thread.
+    ULONG               WorkerSlots;
+    PPOOL_WORKER        Workers;
+    ULONG               NextHome;
+    ULONG               Works;
+
+    PPLATFORM_WATCHER   Watcher;
+    PLATFORM_THREAD     WatcherThread;
+    PPOOL_WORK          Waiting;        // the waiting works, under Lock.
+    ULONGLONG           WatchDeadlineUs;// the watcher wakes by then, 0 if it does not.
+
+    INT64               Wakeups;        // by the watcher only.
+    INT64               Timeouts;
+    INT64               ScheduleErrors;
+
+    //
+    // the schedule of the threads of the pool, see PoolSetSchedule.
+    //
+    PLATFORM_PRIORITY   Priority;
+    ULONGLONG           Affinity;
+    ULONG               HighWorks;      // works of high priority, under Lock.
+} POOL;
+
+static POOL Pool;
+
+//
+// 1 + the index of the worker of the thread, 0 on other threads.
+//
+static thread_local ULONG PoolCurrentWorker;
+
+//
+// the work that runs on the thread.
+//
+static thread_local PPOOL_WORK PoolCurrentWork;
+
+//
+// gives the calling thread the priority and the affinity, if it does not
+// have them yet. The thread keeps what it has when a call fails, the next
+// change tries again.
+//
+static VOID
+PoolApplySchedule(
+    _Inout_ PLATFORM_PRIORITY* Current,
+    _Inout_ ULONGLONG*         CurrentAffinity,
+    _In_  PLATFORM_PRIORITY Priority,
+    _In_  ULONGLONG         Affinity,
+    _Inout_ INT64*          Errors
+    )
+{
+    if (*Current != Priority) {
+        if (PlatformThreadSetPriority(Priority) != NO_ERROR) {
+            (*Errors)++;
+        }
+        *Current = Priority;
+    }
+    if (*CurrentAffinity != Affinity) {
+        if (PlatformThreadSetAffinity(Affinity) != NO_ERROR) {
+            (*Errors)++;
+        }
+        *CurrentAffinity = Affinity;
+    }
+}
+
+//
+// the worker takes the schedule of the work it runs, the one of the pool
+// where the work has none.
+//
+static VOID
+PoolScheduleWorker(
+    _In_  PPOOL_WORKER      Worker,
+    _In_  PPOOL_WORK        Work
+    )
+{
+    PLATFORM_PRIORITY priority = (Work->Priority != PlatformPriorityNormal) ? Work->Priority : Pool.Priority;
+    ULONGLONG affinity = Work->Affinity ? Work->Affinity : Pool.Affinity;
+    PoolApplySchedule(&Worker->Priority, &Worker->Affinity, priority, affinity, &Worker->ScheduleErrors);
+}
+
+static VOID
+PoolWake(
+    _In_  ULONG             Preferred
+    )
+{
+    PlatformLockAcquire(&Pool.Lock);
+    PPOOL_WORKER worker = NULL;
+    if (Pool.Workers[Preferred].Idle) {
+        worker = &Pool.Workers[Preferred];
+    }
+    else {
+        for (ULONG index = 0; index < Pool.WorkerCount; index++) {
+            if (Pool.Workers[index].Idle) {
+                worker = &Pool.Workers[index];
+                break;
+            }
+        }
+    }
+    if (worker) {
+        worker->Idle = FALSE;
+        PlatformEventSet(worker->Event);
+    }
+    PlatformLockRelease(&Pool.Lock);
+}
+
+static VOID
+PoolQueue(
+    _In_  PPOOL_WORK        Work,
+    _In_  ULONG             Index,
+    _In_  BOOL              Yield
+    )
+{
+    PPOOL_WORKER worker = &Pool.Workers[Index];
+    Work->Next = NULL;
+    PlatformLockAcquire(&worker->QueueLock);
+    if (Work->Priority == PlatformPriorityHigh && !Yield && worker->QueueHead) {
+        // ahead of the works of the other priorities.
+        Work->Next = worker->QueueHead;
+        worker->QueueHead = Work;
+    }
+    else if (worker->QueueTail) {
+        worker->QueueTail->Next = Work;
+        worker->QueueTail = Work;
+    }
+    else {
+        worker->QueueHead = Work;
+        worker->QueueTail = Work;
+    }
+    ULONG count = ++worker->QueueCount;
+    PlatformLockRelease(&worker->QueueLock);
+
+    //
+    // a work that yields and has the queue to itself runs next anyway.
+    //
+    if (!Yield || count > 1) {
+        PoolWake(Index);
+    }
+}
+
+static PPOOL_WORK
+PoolDequeue(
+    _In_  PPOOL_WORKER      Worker
+    )
+{
+    PlatformLockAcquire(&Worker->QueueLock);
+    PPOOL_WORK work = Worker->QueueHead;
+    if (work) {
+        Worker->QueueHead = work->Next;
+        if (Worker->QueueHead == NULL) {
+            Worker->QueueTail = NULL;
+        }
+        Worker->QueueCount--;
+    }
+    PlatformLockRelease(&Worker->QueueLock);
+    return work;
+}
+
+//
+// the next work of the worker's queue, or the oldest of another queue.
+//
+static PPOOL_WORK
+PoolTake(
+    _In_  ULONG             Self
+    )
+{
+    PPOOL_WORK work = PoolDequeue(&Pool.Workers[Self]);
+    for (ULONG step = 1; work == NULL && step < Pool.WorkerCount; step++) {
+        work = PoolDequeue(&Pool.Workers[(Self + step) % Pool.WorkerCount]);
+        if (work) {
+            Pool.Workers[Self].Steals++;
+        }
+    }
+    return work;
+}
+
+static VOID
+PoolFinish(
+    _In_  PPOOL_WORK        Work
+    )
+{
+    PlatformEventClose(Work->DoneEvent);
+    free(Work);
+}
+
+static VOID
+PoolRun(
+    _In_  ULONG             Self,
+    _In_  PPOOL_WORK        Work
+    )
+{
+    PPOOL_WORKER worker = &Pool.Workers[Self];
+    PPLATFORM_WAITER waiter = NULL;
+    ULONG timeoutMs = INFINITE;
+
+    Work->Home = Self;
+    worker->Runs++;
+    //
+    // a work that joins another runs works inside its own run.
+    //
+    PPOOL_WORK outer = PoolCurrentWork;
+    PoolScheduleWorker(worker, Work);
+    PoolCurrentWork = Work;
+    POOL_WORK_STATUS status = Work->Routine(Work->Context, Work->TimedOut, &waiter, &timeoutMs);
+    PoolCurrentWork = outer;
+    if (outer) {
+        PoolScheduleWorker(worker, outer);
+    }
+    Work->TimedOut = FALSE;
+
+    switch (status) {
+    case PoolWorkWait: {
+        PlatformLockAcquire(&Pool.Lock);
+        if (PlatformWatcherArm(Pool.Watcher, waiter, Work) != NO_ERROR) {
+            // it polls then.
+            PlatformLockRelease(&Pool.Lock);
+            PoolQueue(Work, Self, TRUE);
+            break;
+        }
+        Work->State = PoolStateWaiting;
+        Work->DeadlineUs = (timeoutMs == INFINITE) ? 0 :
+            PlatformTimeUs() + (ULONGLONG)timeoutMs * 1000;
+        Work->Next = Pool.Waiting;
+        Work->WaitLink = &Pool.Waiting;
+        if (Pool.Waiting) {
+            Pool.Waiting->WaitLink = &Work->Next;
+        }
+        Pool.Waiting = Work;
+        BOOL wakeWatcher = Work->DeadlineUs != 0 &&
+            (Pool.WatchDeadlineUs == 0 || Work->DeadlineUs < Pool.WatchDeadlineUs);
+        PlatformLockRelease(&Pool.Lock);
+        if (wakeWatcher) {
+            PlatformWatcherWake(Pool.Watcher);
+        }
+        break;
+    }
+
+    case PoolWorkYield:
+        worker->Yields++;
+        PoolQueue(Work, Self, TRUE);
+        break;
+
+    default: {
+        PlatformLockAcquire(&Pool.Lock);
+        Work->State = PoolStateDone;
+        Pool.Works--;
+        if (Work->Priority == PlatformPriorityHigh) {
+            Pool.HighWorks--;
+        }
+        BOOL detached = Work->Detached;
+        if (!detached) {
+            PlatformEventSet(Work->DoneEvent);
+        }
+        PlatformLockRelease(&Pool.Lock);
+        if (detached) {
+            PoolFinish(Work);
+        }
+        break;
+    }
+    }
+}
+
+//
+// waits on Waiter as an idle worker, so that a queued work wakes it. FALSE
+// once the pool stops.
+//
+static BOOL
+PoolIdle(
+    _In_  ULONG             Self,
+    _In_  PPLATFORM_WAITER  Waiter,
+    _In_  ULONG             TimeoutMs
+    )
+{
+    PPOOL_WORKER worker = &Pool.Workers[Self];
+    PlatformLockAcquire(&Pool.Lock);
+    if (Pool.Stopping) {
+        PlatformLockRelease(&Pool.Lock);
+        return FALSE;
+    }
+    worker->Idle = TRUE;
+    PlatformLockRelease(&Pool.Lock);
+
+    //
+    // a work queued before it was idle did not wake it.
+    //
+    BOOL queued = FALSE;
+    for (ULONG index = 0; index < Pool.WorkerCount && !queued; index++) {
+        PlatformLockAcquire(&Pool.Workers[index].QueueLock);
+        queued = Pool.Workers[index].QueueCount != 0;
+        PlatformLockRelease(&Pool.Workers[index].QueueLock);
+    }
+    if (!queued) {
+        PlatformWait(Waiter, TimeoutMs);
+    }
+
+    PlatformLockAcquire(&Pool.Lock);
+    worker->Idle = FALSE;
+    PlatformLockRelease(&Pool.Lock);
+    return TRUE;
+}
+
+static UINT32
+PoolWorkerThread(
+    _In_  PVOID             Context
+    )
+{
+    ULONG self = (ULONG)(ULONG_PTR)Context;
+    PoolCurrentWorker = self + 1;
+    for (;;) {
+        PPOOL_WORK work = PoolTake(self);
+        if (work) {
+            PoolRun(self, work);
+        }
+        else if (!PoolIdle(self, Pool.Workers[self].Waiter, INFINITE)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+//
+// queues the works whose sources were signalled and the works whose wait
+// timed out.
+//
+static UINT32
+PoolWatcherThread(
+    _In_  PVOID             Context
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+    PVOID found[POOL_WATCH_BATCH];
+    ULONG count = 0;
+    PLATFORM_PRIORITY priority = PlatformPriorityNormal;
+    ULONGLONG affinity = 0;
+
+    for (;;) {
+        PPOOL_WORK ready = NULL;
+        ULONGLONG now = PlatformTimeUs();
+        ULONGLONG next = 0;
+
+        PlatformLockAcquire(&Pool.Lock);
+        if (Pool.Stopping) {
+            PlatformLockRelease(&Pool.Lock);
+            break;
+        }
+        //
+        // the wake up of a work of high priority does not wait for the cpu
+        // either.
+        //
+        PoolApplySchedule(&priority, &affinity,
+            Pool.HighWorks ? PlatformPriorityHigh : Pool.Priority, Pool.Affinity, &Pool.ScheduleErrors);
+        for (ULONG index = 0; index < count; index++) {
+            //
+            // a timeout may have taken it first, then it may be done and
+            // freed by now. Only a work on the waiting list is looked at.
+            //
+            PPOOL_WORK work = Pool.Waiting;
+            while (work && work != (PPOOL_WORK)found[index]) {
+                work = work->Next;
+            }
+            if (work == NULL) {
+                continue;
+            }
+            work->State = PoolStateQueued;
+            *work->WaitLink = work->Next;
+            if (work->Next) {
+                work->Next->WaitLink = work->WaitLink;
+            }
+            work->Next = ready;
+            ready = work;
+            Pool.Wakeups++;
+        }
+        PPOOL_WORK* link = &Pool.Waiting;
+        while (*link) {
+            PPOOL_WORK work = *link;
+            if (work->DeadlineUs == 0 || work->DeadlineUs > now) {
+                if (work->DeadlineUs && (next == 0 || work->DeadlineUs < next)) {
+                    next = work->DeadlineUs;
+                }
+                link = &work->Next;
+                continue;
+            }
+            work->State = PoolStateQueued;
+            work->TimedOut = TRUE;
+            *link = work->Next;
+            if (work->Next) {
+                work->Next->WaitLink = link;
+            }
+            work->Next = ready;
+            ready = work;
+            Pool.Timeouts++;
+        }
+        Pool.WatchDeadlineUs = next;
+        PlatformLockRelease(&Pool.Lock);
+
+        while (ready) {
+            PPOOL_WORK work = ready;
+            ready = work->Next;
+            PoolQueue(work, work->Home, FALSE);
+        }
+
+        ULONG timeoutMs = INFINITE;
+        if (next) {
+            // rounded up, a wait that returns early only loops.
+            timeoutMs = (ULONG)((next - now + 999) / 1000);
+        }
+        count = PlatformWatcherWait(Pool.Watcher, timeoutMs, found, POOL_WATCH_BATCH);
+        if (count == PLATFORM_WAIT_FAILED) {
+            count = 0;
+        }
+    }
+    return 0;
+}
+
+UINT32
+PoolStartup(
+    _In_  ULONG             Workers
+    )
+{
+    if (Workers == 0) {
+        Workers = PlatformCpuCount();
+        if (Workers < POOL_MIN_WORKERS) {
+            Workers = POOL_MIN_WORKERS;
+        }
+    }
+    if (Workers > POOL_MAX_WORKERS) {
+        Workers = POOL_MAX_WORKERS;
+    }
+
+    RtlZeroMemory(&Pool, sizeof(Pool));
+    PlatformLockInitialize(&Pool.Lock);
+    Pool.Workers = (PPOOL_WORKER)calloc(Workers, sizeof(POOL_WORKER));
+    if (Pool.Workers == NULL) {
+        return POOL_MEMORY_ERROR;
+    }
+    Pool.WorkerSlots = Workers;
+    Pool.Started = TRUE;
+
+    UINT32 error = PlatformWatcherCreate(&Pool.Watcher);
+    for (ULONG index = 0; index < Workers && error == NO_ERROR; index++) {
+        PPOOL_WORKER worker = &Pool.Workers[index];
+        PlatformLockInitialize(&worker->QueueLock);
+        error = PlatformEventCreate(FALSE, &worker->Event);
+        if (error == NO_ERROR) {
+            error = PlatformWaiterCreate(&worker->Waiter);
+        }
+        if (error == NO_ERROR) {
+            error = PlatformWaiterAddEvent(worker->Waiter, worker->Event);
+        }
+    }
+
+    //
+    // every slot is counted before any thread runs, the workers read the
+    // count without the lock when they steal from the others.
+    //
+    if (error == NO_ERROR) {
+        Pool.WorkerCount = Workers;
+    }
+    for (ULONG index = 0; index < Workers && error == NO_ERROR; index++) {
+        error = PlatformThreadCreate(PoolWorkerThread, (PVOID)(ULONG_PTR)index,
+            &Pool.Workers[index].Thread);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformThreadCreate(PoolWatcherThread, NULL, &Pool.WatcherThread);
+    }
+    if (error != NO_ERROR) {
+        PoolCleanup();
+    }
+    return error;
+}
+
+VOID
+PoolCleanup(
+    VOID
+    )
+{
+    if (!Pool.Started) {
+        return;
+    }
+    ASSERT(Pool.Works == 0);
+    PlatformLockAcquire(&Pool.Lock);
+    Pool.Stopping = TRUE;
+    PlatformLockRelease(&Pool.Lock);
+
+    if (Pool.WatcherThread) {
+        PlatformWatcherWake(Pool.Watcher);
+        PlatformThreadJoin(Pool.WatcherThread, INFINITE);
+    }
+    for (ULONG index = 0; index < Pool.WorkerCount; index++) {
+        PPOOL_WORKER worker = &Pool.Workers[index];
+        if (worker->Thread) {
+            PlatformEventSet(worker->Event);
+            PlatformThreadJoin(worker->Thread, INFINITE);
+        }
+    }
+    for (ULONG index = 0; index < Pool.WorkerSlots; index++) {
+        PlatformWaiterClose(Pool.Workers[index].Waiter);
+        PlatformEventClose(Pool.Workers[index].Event);
+    }
+    PlatformWatcherClose(Pool.Watcher);
+    free(Pool.Workers);
+    RtlZeroMemory(&Pool, sizeof(Pool));
+}
+
+UINT32
+PoolWorkStart(
+    _In_  POOL_WORK_ROUTINE Routine,
+    _In_  PVOID             Context,
+    _Out_ PPOOL_WORK*       Work
+    )
+{
+    *Work = NULL;
+    if (Pool.WorkerCount == 0) {
+        return POOL_STATE_ERROR;
+    }
+    PPOOL_WORK work = (PPOOL_WORK)calloc(1, sizeof(*work));
+    if (work == NULL) {
+        return POOL_MEMORY_ERROR;
+    }
+    UINT32 error = PlatformEventCreate(TRUE, &work->DoneEvent);
+    if (error != NO_ERROR) {
+        free(work);
+        return error;
+    }
+    work->Routine = Routine;
+    work->Context = Context;
+    work->State = PoolStateQueued;
+
+    PlatformLockAcquire(&Pool.Lock);
+    Pool.Works++;
+    if (PoolCurrentWorker) {
+        work->Home = PoolCurrentWorker - 1;
+    }
+    else {
+        work->Home = Pool.NextHome++ % Pool.WorkerCount;
+    }
+    PlatformLockRelease(&Pool.Lock);
+
+    *Work = work;
+    PoolQueue(work, work->Home, FALSE);
+    return NO_ERROR;
+}
+
+BOOL
+PoolWorkJoin(
+    _In_  PPOOL_WORK        Work,
+    _In_  ULONG             TimeoutMs
+    )
+{
+    ULONGLONG deadline = (TimeoutMs == INFINITE) ? 0 : PlatformTimeUs() + (ULONGLONG)TimeoutMs * 1000;
+    ULONG self = PoolCurrentWorker;
+    PPLATFORM_WAITER waiter = NULL;
+    UINT32 error = PlatformWaiterCreate(&waiter);
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddEvent(waiter, Work->DoneEvent);
+    }
+    if (error == NO_ERROR && self) {
+        error = PlatformWaiterAddEvent(waiter, Pool.Workers[self - 1].Event);
+    }
+
+    BOOL done = FALSE;
+    for (;;) {
+        PlatformLockAcquire(&Pool.Lock);
+        done = Work->State == PoolStateDone;
+        PlatformLockRelease(&Pool.Lock);
+        if (done) {
+            break;
+        }
+        //
+        // the work may be queued behind this worker.
+        //
+        if (self) {
+            PPOOL_WORK other = PoolTake(self - 1);
+            if (other) {
+                PoolRun(self - 1, other);
+                continue;
+            }
+        }
+        ULONG waitMs = INFINITE;
+        if (deadline) {
+            ULONGLONG now = PlatformTimeUs();
+            if (now >= deadline) {
+                break;
+            }
+            waitMs = (ULONG)((deadline - now + 999) / 1000);
+        }
+        if (error != NO_ERROR) {
+            // no waiter, it polls.
+            waitMs = 1;
+        }
+        if (self) {
+            PoolIdle(self - 1, waiter, waitMs);
+        }
+        else if (error == NO_ERROR) {
+            PlatformWait(waiter, waitMs);
+        }
+    }
+    PlatformWaiterClose(waiter);
+
+    if (!done) {
+        PlatformLockAcquire(&Pool.Lock);
+        done = Work->State == PoolStateDone;
+        Work->Detached = !done;
+        PlatformLockRelease(&Pool.Lock);
+    }
+    if (done) {
+        PoolFinish(Work);
+    }
+    return done;
+}
+
+PLATFORM_EVENT
+PoolWorkDoneEvent(
+    _In_  PPOOL_WORK        Work
+    )
+{
+    return Work->DoneEvent;
+}
+
+VOID
+PoolGetStats(
+    _Out_ PPOOL_STATS       Stats
+    )
+{
+    RtlZeroMemory(Stats, sizeof(*Stats));
+    PlatformLockAcquire(&Pool.Lock);
+    Stats->Workers = Pool.WorkerCount;
+    Stats->Works = Pool.Works;
+    Stats->Wakeups = Pool.Wakeups;
+    Stats->Timeouts = Pool.Timeouts;
+    Stats->ScheduleErrors = Pool.ScheduleErrors;
+    Stats->Priority = Pool.Priority;
+    Stats->Affinity = Pool.Affinity;
+    for (ULONG index = 0; index < Pool.WorkerCount; index++) {
+        Stats->Runs += Pool.Workers[index].Runs;
+        Stats->Steals += Pool.Workers[index].Steals;
+        Stats->Yields += Pool.Workers[index].Yields;
+        Stats->ScheduleErrors += Pool.Workers[index].ScheduleErrors;
+    }
+    PlatformLockRelease(&Pool.Lock);
+}
+
+VOID
+PoolSetSchedule(
+    _In_  PLATFORM_PRIORITY Priority,
+    _In_  ULONGLONG         Affinity
+    )
+{
+    PlatformLockAcquire(&Pool.Lock);
+    Pool.Priority = Priority;
+    Pool.Affinity = Affinity;
+    BOOL started = Pool.Watcher != NULL;
+    PlatformLockRelease(&Pool.Lock);
+    if (started) {
+        PlatformWatcherWake(Pool.Watcher);
+    }
+}
+
+VOID
+PoolWorkSchedule(
+    _In_  PLATFORM_PRIORITY Priority,
+    _In_  ULONGLONG         Affinity
+    )
+{
+    PPOOL_WORK work = PoolCurrentWork;
+    if (work == NULL) {
+        return;
+    }
+    if (work->Priority != Priority) {
+        PlatformLockAcquire(&Pool.Lock);
+        BOOL wakeWatcher = FALSE;
+        if (work->Priority == PlatformPriorityHigh) {
+            wakeWatcher = --Pool.HighWorks == 0;
+        }
+        else if (Priority == PlatformPriorityHigh) {
+            wakeWatcher = Pool.HighWorks++ == 0;
+        }
+        work->Priority = Priority;
+        PlatformLockRelease(&Pool.Lock);
+        if (wakeWatcher) {
+            PlatformWatcherWake(Pool.Watcher);
+        }
+    }
+    work->Affinity = Affinity;
+    PoolScheduleWorker(&Pool.Workers[PoolCurrentWorker - 1], work);
+}
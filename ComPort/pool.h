@@ -0,0 +1,154 @@
+/*++
+
+Module Name:
+
+    pool.h
+
+Abstract:
+
+    The worker pool of the process, which runs the network loops of all the
+    ports. A port does not own a thread: its loop is a work that runs on a
+    worker until it would block, then hands its waiter to the watcher thread
+    of the pool and returns. When a source of the waiter is signalled, or
+    the timeout of the wait passed, the watcher queues the work again. An
+    idle port costs no thread and a busy one keeps its worker, and its core.
+
+    Each worker has its own queue. A work that is woken goes back to the
+    queue of the worker that ran it last, a work started from a worker to
+    the queue of that worker, and a worker whose queue is empty takes the
+    oldest work of another queue, so a worker held up by one port does not
+    hold up the others. A work never runs on two workers at once.
+
+    A work may block, in a connect for example, it holds its worker then.
+
+--*/
+
+#pragma once
+
+#include "platform.h"
+
+//
+// PoolStartup with 0 workers starts one per processor, at least this many,
+// because a port in a connect holds its worker.
+//
+#define POOL_MIN_WORKERS        4
+#define POOL_MAX_WORKERS        64
+
+//
+// the turns of its loop a work runs before it returns PoolWorkYield, so that
+// a busy port shares its worker with the ports queued behind it.
+//
+#define POOL_WORK_TURNS         64
+
+typedef struct _POOL_WORK *PPOOL_WORK;
+
+typedef enum _POOL_WORK_STATUS {
+    PoolWorkWait,       // run again when a source of *Waiter is signalled or *TimeoutMs passed.
+    PoolWorkYield,      // run again after the work queued behind it.
+    PoolWorkDone,       // finished, PoolWorkJoin returns.
+} POOL_WORK_STATUS;
+
+//
+// one run of a work. TimedOut is TRUE when it runs because the timeout of its
+// last wait passed, else something woke it and it looks at its waiter with
+// PlatformWait(Waiter, 0). For PoolWorkWait it sets *Waiter and *TimeoutMs,
+// which may be INFINITE. A work closes the waiters it waited on before it
+// returns PoolWorkDone.
+//
+typedef POOL_WORK_STATUS (*POOL_WORK_ROUTINE)(
+    PVOID               Context,
+    BOOL                TimedOut,
+    PPLATFORM_WAITER*   Waiter,
+    ULONG*              TimeoutMs
+    );
+
+typedef struct _POOL_STATS {
+    ULONG       Workers;
+    ULONG       Works;          // started and not joined.
+    INT64       Runs;
+    INT64       Steals;         // runs of a work taken from the queue of another worker.
+    INT64       Yields;
+    INT64       Wakeups;        // works the watcher queued for a signalled source.
+    INT64       Timeouts;       // works the watcher queued for their timeout.
+    INT64       ScheduleErrors; // priorities and affinities a thread could not take.
+    PLATFORM_PRIORITY Priority; // of the pool, see PoolSetSchedule.
+    ULONGLONG   Affinity;
+} POOL_STATS, *PPOOL_STATS;
+
+//
+// starts the pool of the process with Workers workers, 0 for the default.
+//
+_Success_(return == NO_ERROR)
+UINT32
+PoolStartup(
+    _In_  ULONG             Workers
+    );
+
+//
+// stops the workers and the watcher. Every work is joined by then.
+//
+VOID
+PoolCleanup(
+    VOID
+    );
+
+//
+// queues Routine to run with Context.
+//
+_Success_(return == NO_ERROR)
+UINT32
+PoolWorkStart(
+    _In_  POOL_WORK_ROUTINE Routine,
+    _In_  PVOID             Context,
+    _Out_ PPOOL_WORK*       Work
+    );
+
+//
+// waits until the work is done and frees it. A worker that joins runs other
+// works in the meantime. Returns FALSE on timeout, the work then frees itself
+// once it is done.
+//
+BOOL
+PoolWorkJoin(
+    _In_  PPOOL_WORK        Work,
+    _In_  ULONG             TimeoutMs
+    );
+
+//
+// signalled once the work is done, until it is joined. A work does not join
+// a work that may still run, it waits for this event as a source of its
+// waiter and joins with a 0 timeout when it is signalled.
+//
+PLATFORM_EVENT
+PoolWorkDoneEvent(
+    _In_  PPOOL_WORK        Work
+    );
+
+VOID
+PoolGetStats(
+    _Out_ PPOOL_STATS       Stats
+    );
+
+//
+// the priority and the processors, a mask as for PlatformThreadSetAffinity,
+// of the workers and the watcher, after PoolStartup. A worker takes it at its
+// next run, the watcher at once.
+//
+VOID
+PoolSetSchedule(
+    _In_  PLATFORM_PRIORITY Priority,
+    _In_  ULONGLONG         Affinity
+    );
+
+//
+// the schedule of the calling work, for a port whose latency matters more
+// or less than that of the others: a normal priority or a 0 affinity keep
+// those of the pool. The worker takes it at once and at every run after.
+// A work of high priority is queued ahead of the other works, and the
+// watcher runs at high priority while there is one. Only a work calls it.
+//
+VOID
+PoolWorkSchedule(
+    _In_  PLATFORM_PRIORITY Priority,
+    _In_  ULONGLONG         Affinity
+    );
@@ -28,28 +28,14 @@ void EvtReadQueueReady(
 {
     UNREFERENCED_PARAMETER(queue);
     PQUEUE_CONTEXT queueContext = (PQUEUE_CONTEXT)Context;
-    SetEvent(queueContext->DeviceContext->ReadQueueEvent);
+    PlatformEventSet(queueContext->DeviceContext->ReadQueueEvent);
 }
 
-void EvtIntervalTimer(
-    _In_ WDFTIMER Timer)
-{
-    PDEVICE_CONTEXT deviceContext = GetDeviceContext(WdfTimerGetParentObject(Timer));
-    SetEvent(deviceContext->IntervalTimerEvent);
-}
-
-void EvtTotalTimer(
-    _In_ WDFTIMER Timer)
-{
-    PDEVICE_CONTEXT deviceContext = GetDeviceContext(WdfTimerGetParentObject(Timer));
-    SetEvent(deviceContext->TotalTimerEvent);
-};
-
 void EvtReadRequestCancel(
     _In_ WDFREQUEST Request)
 {
     PREQUEST_CONTEXT requestContext = GetRequestContext(Request);
-    SetEvent(requestContext->QueueContext->DeviceContext->CancelEvent);
+    PlatformEventSet(requestContext->QueueContext->DeviceContext->CancelEvent);
 }
 
 
@@ -241,6 +227,12 @@ Routine Description:
     case IOCTL_HTSVSP_REPORT: return "IOCTL_HTSVSP_REPORT";
     case IOCTL_HTSVSP_GET_WAIT_UNITS: return "IOCTL_HTSVSP_GET_WAIT_UNITS";
     case IOCTL_HTSVSP_SET_WAIT_UNITS: return "IOCTL_HTSVSP_SET_WAIT_UNITS";
+    case IOCTL_HTSVSP_TIMELINE_CONTROL: return "IOCTL_HTSVSP_TIMELINE_CONTROL";
+    case IOCTL_HTSVSP_TIMELINE_READ: return "IOCTL_HTSVSP_TIMELINE_READ";
+    case IOCTL_HTSVSP_SET_SPIN: return "IOCTL_HTSVSP_SET_SPIN";
+    case IOCTL_HTSVSP_CAPTURE_CONTROL: return "IOCTL_HTSVSP_CAPTURE_CONTROL";
+    case IOCTL_HTSVSP_SET_OVERFLOW: return "IOCTL_HTSVSP_SET_OVERFLOW";
+    case IOCTL_HTSVSP_SET_SCHEDULE: return "IOCTL_HTSVSP_SET_SCHEDULE";
     case IOCTL_SERIAL_SET_BAUD_RATE: return "IOCTL_SERIAL_SET_BAUD_RATE";
     case IOCTL_SERIAL_GET_BAUD_RATE: return "IOCTL_SERIAL_GET_BAUD_RATE";
     case IOCTL_SERIAL_GET_MODEM_CONTROL: return "IOCTL_SERIAL_GET_MODEM_CONTROL";
@@ -253,7 +245,7 @@ Routine Description:
     case IOCTL_SERIAL_SET_CHARS: return "IOCTL_SERIAL_SET_CHARS";
     case IOCTL_SERIAL_GET_CHARS: return "IOCTL_SERIAL_GET_CHARS";
     case IOCTL_SERIAL_SET_DTR: return "IOCTL_SERIAL_SET_DTR";
-    case IOCTL_SERIAL_CLR_DTR: return "IOCTL_SERIAL_SET_DTR";
+    case IOCTL_SERIAL_CLR_DTR: return "IOCTL_SERIAL_CLR_DTR";
     case IOCTL_SERIAL_RESET_DEVICE: return "IOCTL_SERIAL_RESET_DEVICE";
     case IOCTL_SERIAL_SET_RTS: return "IOCTL_SERIAL_SET_RTS";
     case IOCTL_SERIAL_CLR_RTS: return "IOCTL_SERIAL_CLR_RTS";
@@ -317,12 +309,17 @@ EvtIoDeviceControl(
 				CloseNetwork(deviceContext);
 			}
 			else if (vspConfig.clientMode) {
-                status = ConfigureClient(&vspConfig, queueContext);
+                status = ConfigureClient(&vspConfig, queueContext, FALSE);
             }
             else {
                 status = ConfigureService(&vspConfig, queueContext);
             }
         }
+        if (NT_SUCCESS(status)) {
+            // the port comes back with it after a restart, a failure to save
+            // does not fail the configuration.
+            DeviceSaveConfig(deviceContext, vspConfig.closeConnections ? NULL : &vspConfig);
+        }
         break;
     }
 
@@ -347,6 +344,20 @@ EvtIoDeviceControl(
     {
         deviceContext->Stats.traceLevel = Globals.TraceLevel;
         deviceContext->Stats.waitUnits = Globals.WaitUnits;
+        POOL_STATS pool;
+        PoolGetStats(&pool);
+        deviceContext->Stats.poolWorkers = pool.Workers;
+        deviceContext->Stats.poolWorks = pool.Works;
+        deviceContext->Stats.poolRuns = pool.Runs;
+        deviceContext->Stats.poolSteals = pool.Steals;
+        deviceContext->Stats.poolYields = pool.Yields;
+        deviceContext->Stats.poolWakeups = pool.Wakeups;
+        deviceContext->Stats.poolTimeouts = pool.Timeouts;
+        deviceContext->Stats.poolScheduleErrors = pool.ScheduleErrors;
+        deviceContext->Stats.poolPriority = pool.Priority;
+        deviceContext->Stats.poolAffinity = pool.Affinity;
+        deviceContext->Stats.schedulePriority = deviceContext->Schedule.priority;
+        deviceContext->Stats.scheduleAffinity = deviceContext->Schedule.affinity;
         status = RequestCopyFromBuffer(Request, &deviceContext->Stats, sizeof(deviceContext->Stats));
         break;
     }
@@ -364,6 +375,106 @@ EvtIoDeviceControl(
         break;
     }
 
+    case IOCTL_HTSVSP_TIMELINE_CONTROL:
+    {
+        DWORD enable = 0;
+        status = RequestCopyToBuffer(Request, &enable, sizeof(enable));
+        if (NT_SUCCESS(status) && enable) {
+            status = TimelineCreate(deviceContext);
+        }
+        if (NT_SUCCESS(status) && deviceContext->Timeline) {
+            TimelineControl(deviceContext->Timeline, enable != 0);
+        }
+        break;
+    }
+
+    case IOCTL_HTSVSP_TIMELINE_READ:
+    {
+        if (deviceContext->Timeline == NULL) {
+            status = STATUS_INVALID_DEVICE_STATE;
+            break;
+        }
+        status = TimelineRead(deviceContext->Timeline, Request);
+        break;
+    }
+
+    case IOCTL_HTSVSP_SET_SPIN:
+    {
+        DWORD spinUs = 0;
+        status = RequestCopyToBuffer(Request, &spinUs, sizeof(spinUs));
+        if (NT_SUCCESS(status)) {
+            EngineSetSpin(&deviceContext->Engine, spinUs);
+            Trace(TRACE_LEVEL_INFO, "spin set to %d us", deviceContext->Engine.Spin.MaxUs);
+        }
+        break;
+    }
+
+    case IOCTL_HTSVSP_SET_OVERFLOW:
+    {
+        HTS_VSP_OVERFLOW overflow = { 0 };
+        status = RequestCopyToBuffer(Request, &overflow, sizeof(overflow));
+        if (NT_SUCCESS(status) && overflow.policy > HtsOverflowDropOldest) {
+            status = STATUS_INVALID_PARAMETER;
+        }
+        if (NT_SUCCESS(status)) {
+            EngineSetOverflow(&deviceContext->Engine, overflow.policy, overflow.timeoutMs);
+            // the client loop applies it at its next wait.
+            PlatformEventSet(deviceContext->ReadQueueEvent);
+            Trace(TRACE_LEVEL_INFO, "overflow policy %d timeout %d ms",
+                overflow.policy, overflow.timeoutMs);
+        }
+        break;
+    }
+
+    case IOCTL_HTSVSP_SET_SCHEDULE:
+    {
+        HTS_VSP_SCHEDULE schedule = { 0 };
+        status = RequestCopyToBuffer(Request, &schedule, sizeof(schedule));
+        if (NT_SUCCESS(status) && schedule.priority > HtsPriorityBulk) {
+            status = STATUS_INVALID_PARAMETER;
+        }
+        if (NT_SUCCESS(status)) {
+            if (schedule.global) {
+                PoolSetSchedule((PLATFORM_PRIORITY)schedule.priority, schedule.affinity);
+            }
+            else {
+                deviceContext->Schedule = schedule;
+                // the client loop takes it at its next run.
+                PlatformEventSet(deviceContext->ReadQueueEvent);
+            }
+            // a failure to save does not fail the setting.
+            DeviceSaveSchedule(deviceContext, &schedule);
+            Trace(TRACE_LEVEL_INFO, "%s schedule priority %d affinity %#I64x",
+                schedule.global ? "pool" : "port", schedule.priority, schedule.affinity);
+        }
+        break;
+    }
+
+    case IOCTL_HTSVSP_CAPTURE_CONTROL:
+    {
+        HTS_VSP_CAPTURE_CONTROL control = { 0 };
+        status = RequestCopyToBuffer(Request, &control, sizeof(control));
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+        control.path[sizeof(control.path) - 1] = 0;
+        if (control.path[0] == 0) {
+            CaptureStop(&deviceContext->Capture);
+            Trace(TRACE_LEVEL_INFO, "capture stopped, %lld records",
+                deviceContext->Stats.captureRecords);
+            break;
+        }
+        UINT32 result = CaptureStart(&deviceContext->Capture, control.path, control.segmentBytes);
+        if (result != NO_ERROR) {
+            Trace(TRACE_LEVEL_ERROR, "capture %s start error: %#x",
+                control.path, result);
+            status = STATUS_UNSUCCESSFUL;
+            break;
+        }
+        Trace(TRACE_LEVEL_INFO, "capture started to %s", control.path);
+        break;
+    }
+
     case IOCTL_SERIAL_SET_BAUD_RATE:
     {
         //
@@ -566,16 +677,90 @@ EvtIoDeviceControl(
         break;
     }
 
-    case IOCTL_SERIAL_SET_QUEUE_SIZE:
+    case IOCTL_SERIAL_SET_HANDFLOW:
+    {
+        SERIAL_HANDFLOW handFlow = {0};
+
+        status = RequestCopyToBuffer(Request,
+                            &handFlow,
+                            sizeof(handFlow));
+
+        if( NT_SUCCESS(status) ) {
+            status = SetHandFlow(deviceContext, &handFlow);
+        }
+        break;
+    }
+
+    case IOCTL_SERIAL_GET_HANDFLOW:
+    {
+        SERIAL_HANDFLOW handFlow = {0};
+
+        GetHandFlow(deviceContext, &handFlow);
+
+        status = RequestCopyFromBuffer(Request,
+                            &handFlow,
+                            sizeof(handFlow));
+        break;
+    }
+
+    case IOCTL_SERIAL_SET_CHARS:
+    {
+        SERIAL_CHARS chars = {0};
+
+        status = RequestCopyToBuffer(Request,
+                            &chars,
+                            sizeof(chars));
+
+        if( NT_SUCCESS(status) ) {
+            status = SetChars(deviceContext, &chars);
+        }
+        break;
+    }
+
+    case IOCTL_SERIAL_GET_CHARS:
+    {
+        SERIAL_CHARS chars = {0};
+
+        GetChars(deviceContext, &chars);
+
+        status = RequestCopyFromBuffer(Request,
+                            &chars,
+                            sizeof(chars));
+        break;
+    }
+
     case IOCTL_SERIAL_SET_DTR:
+    case IOCTL_SERIAL_CLR_DTR:
+        status = SetModemLine(deviceContext,
+                            SERIAL_MCR_DTR,
+                            IoControlCode == IOCTL_SERIAL_SET_DTR);
+        break;
+
     case IOCTL_SERIAL_SET_RTS:
     case IOCTL_SERIAL_CLR_RTS:
-    case IOCTL_SERIAL_SET_XON:
+        status = SetModemLine(deviceContext,
+                            SERIAL_MCR_RTS,
+                            IoControlCode == IOCTL_SERIAL_SET_RTS);
+        break;
+
+    case IOCTL_SERIAL_GET_DTRRTS:
+    {
+        ULONG lines = *GetModemControlRegisterPtr(deviceContext) &
+                            (SERIAL_MCR_DTR | SERIAL_MCR_RTS);
+
+        status = RequestCopyFromBuffer(Request,
+                            &lines,
+                            sizeof(lines));
+        break;
+    }
+
     case IOCTL_SERIAL_SET_XOFF:
-    case IOCTL_SERIAL_SET_CHARS:
-    case IOCTL_SERIAL_GET_CHARS:
-    case IOCTL_SERIAL_GET_HANDFLOW:
-    case IOCTL_SERIAL_SET_HANDFLOW:
+    case IOCTL_SERIAL_SET_XON:
+        SetXoff(deviceContext, IoControlCode == IOCTL_SERIAL_SET_XOFF);
+        status = STATUS_SUCCESS;
+        break;
+
+    case IOCTL_SERIAL_SET_QUEUE_SIZE:
     case IOCTL_SERIAL_RESET_DEVICE:
         //
         // NOTE: The application expects STATUS_SUCCESS for these IOCTLs.
@@ -645,31 +830,39 @@ EvtIoRead(
 {
     NTSTATUS                status;
     PQUEUE_CONTEXT          queueContext = GetQueueContext(Queue);
+    PDEVICE_CONTEXT         deviceContext = queueContext->DeviceContext;
     PREQUEST_CONTEXT        requestContext = GetRequestContext(Request);
 
     RtlZeroMemory(requestContext, sizeof(*requestContext));
+    requestContext->CorrelationId = (ULONG)InterlockedIncrement(&deviceContext->NextCorrelationId);
 
     Trace(TRACE_LEVEL_VERBOSE,
-            " request:0x%p length: %d", Request, (int) Length);
+            " request:0x%p id: %u length: %d", Request, requestContext->CorrelationId, (int) Length);
     // setup the request context
     WDF_REQUEST_PARAMETERS_INIT(&requestContext->Params);
     WdfRequestGetParameters(
         Request, &requestContext->Params);
 
-    requestContext->Length = (ULONG) Length;
+    requestContext->Read.Length = (ULONG) Length;
     requestContext->QueueContext = queueContext;
+    QueryPerformanceCounter(&requestContext->QueuedTime);
 
 
     // require that the outputbuffer is in fact Length bytes.
+    PVOID buffer;
     size_t bufLen;
     status = WdfRequestRetrieveOutputBuffer(Request, Length,
-        &requestContext->Buffer, &bufLen);
+        &buffer, &bufLen);
     if( !NT_SUCCESS(status) ) {
         Trace(TRACE_LEVEL_ERROR,
             "Error: WdfRequestRetrieveOutputBuffer failed 0x%x", status);
         WdfRequestComplete(Request, status);
         return;
     }
+    requestContext->Read.Buffer = (PUCHAR)buffer;
+
+    TimelineRecord(deviceContext->Timeline, HtsTimelineReadQueued,
+        requestContext->CorrelationId, (INT64)Length);
 
     status = WdfRequestForwardToIoQueue(Request,
                         queueContext->ReadQueue);
@@ -71,11 +71,10 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(QUEUE_CONTEXT, GetQueueContext);
 
 typedef struct REQUEST_CONTEXT {
     WDF_REQUEST_PARAMETERS Params;
-    PVOID Buffer;
-    ULONG Length;
-    ULONG Information;
+    ENGINE_READ Read;         // buffer, length and progress of the read.
     PQUEUE_CONTEXT QueueContext;
-    ULONG WaitTimeouts;
+    LARGE_INTEGER QueuedTime; // performance counter when EvtIoRead queued the request.
+    ULONG CorrelationId;      // identifies the request in timeline events.
 } *PREQUEST_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(REQUEST_CONTEXT,
@@ -85,8 +84,6 @@ EVT_WDF_IO_QUEUE_IO_READ            EvtIoRead;
 EVT_WDF_IO_QUEUE_IO_WRITE           EvtIoWrite;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL  EvtIoDeviceControl;
 
-EVT_WDF_TIMER EvtIntervalTimer;
-EVT_WDF_TIMER EvtTotalTimer;
 
 EVT_WDF_REQUEST_CANCEL EvtReadRequestCancel;
 
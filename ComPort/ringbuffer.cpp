@@ -14,7 +14,8 @@ Environment:
 
 --*/
 
-#include "internal.h"
+#include "platform.h"
+#include "ringbuffer.h"
 
 VOID
 RingBufferInitialize(
@@ -243,6 +244,96 @@ RingBufferWrite(
 }
 
 
+NTSTATUS
+RingBufferWriteOverflow(
+    _In_  PRING_BUFFER      Self,
+    _In_reads_bytes_(DataSize)
+          BYTE*             Data,
+    _In_  size_t            DataSize,
+    _In_  RING_OVERFLOW_POLICY Policy,
+    _Out_ size_t            *Dropped
+    )
+{
+    size_t                  availableSpace;
+    size_t                  capacity = Self->Size - 1;
+
+    ASSERT(Dropped);
+
+    *Dropped = 0;
+    if (DataSize == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    RingBufferGetAvailableSpace(Self, &availableSpace);
+    if (availableSpace >= DataSize)
+    {
+        return RingBufferWrite(Self, Data, DataSize);
+    }
+
+    if (Policy == RingOverflowDropOldest)
+    {
+        //
+        // only the last capacity bytes of Data can stay, and they replace
+        // the oldest data.
+        //
+        if (DataSize > capacity)
+        {
+            *Dropped = DataSize - capacity;
+            Data += DataSize - capacity;
+            DataSize = capacity;
+        }
+        size_t discarded = 0;
+        if (DataSize > availableSpace)
+        {
+            RingBufferDiscard(Self, DataSize - availableSpace, &discarded);
+        }
+        *Dropped += discarded;
+        return RingBufferWrite(Self, Data, DataSize);
+    }
+
+    *Dropped = DataSize - availableSpace;
+    if (availableSpace == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+    return RingBufferWrite(Self, Data, availableSpace);
+}
+
+
+VOID
+RingBufferDiscard(
+    _In_  PRING_BUFFER      Self,
+    _In_  size_t            Length,
+    _Out_ size_t            *Discarded
+    )
+{
+    size_t                  availableData;
+
+    ASSERT(Discarded);
+
+    RingBufferGetAvailableData(Self, &availableData);
+    if (Length > availableData)
+    {
+        Length = availableData;
+    }
+    *Discarded = Length;
+
+    //
+    // Advance the head pointer, wrapping at the end of the buffer.
+    //
+    size_t dataFromCurrToEnd = Self->End - Self->Head;
+    if (Length >= dataFromCurrToEnd)
+    {
+        Self->Head = Self->Base + (Length - dataFromCurrToEnd);
+    }
+    else
+    {
+        Self->Head += Length;
+    }
+}
+
+
 NTSTATUS
 RingBufferRead(
     _In_  PRING_BUFFER      Self,
@@ -336,3 +427,41 @@ RingBufferRead(
     return STATUS_SUCCESS;
 }
 
+
+VOID
+RingBufferGetWriteSpan(
+    _In_  PRING_BUFFER      Self,
+    _Out_ BYTE              **Span,
+    _Out_ size_t            *SpanSize
+    )
+{
+    size_t                  availableSpace;
+    size_t                  spaceFromCurrToEnd;
+
+    ASSERT(Span && SpanSize);
+
+    RingBufferGetAvailableSpace(Self, &availableSpace);
+
+    //
+    // the free space may wrap, the span ends at the end of the buffer.
+    //
+    spaceFromCurrToEnd = Self->End - Self->Tail;
+
+    *Span = Self->Tail;
+    *SpanSize = (availableSpace < spaceFromCurrToEnd) ? availableSpace : spaceFromCurrToEnd;
+}
+
+
+VOID
+RingBufferCommitWrite(
+    _In_  PRING_BUFFER      Self,
+    _In_  size_t            Length
+    )
+{
+    ASSERT(Length <= (size_t)(Self->End - Self->Tail));
+
+    Self->Tail += Length;
+    if (Self->Tail == Self->End) {
+        Self->Tail = Self->Base;
+    }
+}
@@ -95,6 +95,42 @@ RingBufferWrite(
     _In_  size_t            DataSize
     );
 
+//
+// what RingBufferWriteOverflow does with data that does not fit.
+//
+typedef enum _RING_OVERFLOW_POLICY
+{
+    RingOverflowDropNewest = 0,     // copies what fits, like RingBufferWrite.
+    RingOverflowDropOldest,         // drops the oldest data to make room.
+} RING_OVERFLOW_POLICY;
+
+//
+// RingBufferWrite with an overflow policy. Dropped is the number of bytes
+// that were dropped, of Data or of the oldest data. Dropping the oldest
+// moves the read pointer, so only the reader may do that, or the writer with
+// the reader locked out.
+//
+NTSTATUS
+RingBufferWriteOverflow(
+    _In_  PRING_BUFFER      Self,
+    _In_reads_bytes_(DataSize)
+          BYTE*             Data,
+    _In_  size_t            DataSize,
+    _In_  RING_OVERFLOW_POLICY Policy,
+    _Out_ size_t            *Dropped
+    );
+
+//
+// drops up to Length bytes of the oldest data, like a read that does not
+// copy them. Discarded is the number dropped.
+//
+VOID
+RingBufferDiscard(
+    _In_  PRING_BUFFER      Self,
+    _In_  size_t            Length,
+    _Out_ size_t            *Discarded
+    );
+
 NTSTATUS
 RingBufferRead(
     _In_  PRING_BUFFER      Self,
@@ -115,3 +151,21 @@ RingBufferGetAvailableData(
     _In_  PRING_BUFFER      Self,
     _Out_ size_t            *AvailableData
     );
+
+//
+// Zero copy writes: GetWriteSpan returns the largest contiguous free block at
+// the write point, CommitWrite makes the first Length bytes of it readable.
+// The span is empty when the buffer is full.
+//
+VOID
+RingBufferGetWriteSpan(
+    _In_  PRING_BUFFER      Self,
+    _Out_ BYTE              **Span,
+    _Out_ size_t            *SpanSize
+    );
+
+VOID
+RingBufferCommitWrite(
+    _In_  PRING_BUFFER      Self,
+    _In_  size_t            Length
+    );
@@ -0,0 +1,572 @@
+/*++
+
+Module Name:
+
+    rudp.cpp
+
+Abstract:
+
+    The reliable udp protocol, see rudp.h.
+
+    The header is the type, a zero byte, the window as a big endian 16 bit
+    value and the packet number, the cumulative ack and the selective ack
+    bitmap as big endian 32 bit values. Bit n of the bitmap is packet
+    ack + 1 + n.
+
+--*/
+
+#include "rudp.h"
+
+#ifdef _WIN32
+#define RUDP_TIMEOUT_ERROR      WSAETIMEDOUT
+#define RUDP_RESET_ERROR        WSAECONNRESET
+#else
+#define RUDP_TIMEOUT_ERROR      ETIMEDOUT
+#define RUDP_RESET_ERROR        ECONNRESET
+#endif
+
+//
+// the clock granularity of RFC 6298, the driver waits in milliseconds.
+//
+#define RUDP_GRANULARITY_US     1000
+
+static inline VOID RudpPut32(BYTE* Buffer, ULONG Value)
+{
+    Buffer[0] = (BYTE)(Value >> 24);
+    Buffer[1] = (BYTE)(Value >> 16);
+    Buffer[2] = (BYTE)(Value >> 8);
+    Buffer[3] = (BYTE)Value;
+}
+
+static inline ULONG RudpGet32(const BYTE* Buffer)
+{
+    return (ULONG)Buffer[0] << 24 | (ULONG)Buffer[1] << 16 | (ULONG)Buffer[2] << 8 | Buffer[3];
+}
+
+//
+// packet A comes before packet B.
+//
+static inline BOOL RudpBefore(ULONG A, ULONG B)
+{
+    return (LONG)(A - B) < 0;
+}
+
+static UINT32 RudpFail(PRUDP_CONNECTION Connection, UINT32 Error)
+{
+    Connection->State = RudpClosed;
+    Connection->Error = Error;
+    return Error;
+}
+
+//
+// the header of every datagram, with the acks and the window of now.
+//
+static ULONG RudpHeader(PRUDP_CONNECTION Connection, BYTE Type, ULONG Packet, BYTE* Datagram)
+{
+    ULONG limit = Connection->ReceiveBase + RUDP_WINDOW;
+    ULONG window = limit - Connection->ReceiveNext;
+    ULONG sack = 0;
+    for (ULONG bit = 0; bit < 32; bit++) {
+        ULONG packet = Connection->ReceiveNext + 1 + bit;
+        if (!RudpBefore(packet, limit)) {
+            break;
+        }
+        if (Connection->Receive[packet % RUDP_WINDOW].Present) {
+            sack |= 1u << bit;
+        }
+    }
+    Datagram[0] = Type;
+    Datagram[1] = 0;
+    Datagram[2] = (BYTE)(window >> 8);
+    Datagram[3] = (BYTE)window;
+    RudpPut32(Datagram + 4, Packet);
+    RudpPut32(Datagram + 8, Connection->ReceiveNext);
+    RudpPut32(Datagram + 12, sack);
+    Connection->AdvertisedLimit = limit;
+    Connection->AckPending = FALSE;
+    Connection->Counters.DatagramsSent++;
+    return RUDP_HEADER_SIZE;
+}
+
+static ULONG RudpSendData(PRUDP_CONNECTION Connection, ULONG Packet, ULONGLONG NowUs, BOOL Again, BYTE* Datagram)
+{
+    PRUDP_SEND_SLOT slot = &Connection->Send[Packet % RUDP_WINDOW];
+    ULONG length = RudpHeader(Connection, RudpData, Packet, Datagram);
+    memcpy(Datagram + length, slot->Data, slot->Length);
+    slot->Sends++;
+    slot->SentUs = NowUs;
+    slot->Retransmit = FALSE;
+    if (Again) {
+        Connection->Counters.Retransmits++;
+    }
+    return length + slot->Length;
+}
+
+//
+// RFC 6298.
+//
+static VOID RudpUpdateRtt(PRUDP_CONNECTION Connection, ULONG SampleUs)
+{
+    if (Connection->SrttUs == 0) {
+        Connection->SrttUs = SampleUs ? SampleUs : 1;
+        Connection->RttvarUs = SampleUs / 2;
+    }
+    else {
+        ULONG delta = (Connection->SrttUs > SampleUs) ?
+            Connection->SrttUs - SampleUs : SampleUs - Connection->SrttUs;
+        Connection->RttvarUs = (3 * Connection->RttvarUs + delta) / 4;
+        Connection->SrttUs = (7 * Connection->SrttUs + SampleUs) / 8;
+    }
+    ULONG variance = 4 * Connection->RttvarUs;
+    ULONG rto = Connection->SrttUs + ((variance > RUDP_GRANULARITY_US) ? variance : RUDP_GRANULARITY_US);
+    if (rto < RUDP_MIN_RTO_US) {
+        rto = RUDP_MIN_RTO_US;
+    }
+    Connection->RtoUs = (rto > RUDP_MAX_RTO_US) ? RUDP_MAX_RTO_US : rto;
+}
+
+static VOID RudpEstablish(PRUDP_CONNECTION Connection, ULONGLONG NowUs)
+{
+    Connection->State = RudpEstablished;
+    Connection->RtoUs = RUDP_INITIAL_RTO_US;
+    if (Connection->SynSends == 1) {
+        RudpUpdateRtt(Connection, (ULONG)(NowUs - Connection->SynSentUs));
+    }
+}
+
+static VOID RudpMarkAcked(PRUDP_SEND_SLOT Slot, ULONGLONG NowUs, ULONG* SampleUs)
+{
+    if (Slot->Acked) {
+        return;
+    }
+    // Karn: only a packet sent once times the round trip.
+    if (Slot->Sends == 1) {
+        *SampleUs = (ULONG)(NowUs - Slot->SentUs);
+    }
+    Slot->Acked = TRUE;
+    Slot->Retransmit = FALSE;
+}
+
+static VOID RudpProcessAck(PRUDP_CONNECTION Connection, ULONG Ack, ULONG Sack, ULONG Window, ULONGLONG NowUs)
+{
+    if (RudpBefore(Ack, Connection->SendBase) || RudpBefore(Connection->SendNext, Ack)) {
+        // an old ack overtaken by a newer one, or none of ours.
+        return;
+    }
+    ULONG sampleUs = MAXULONG;
+    BOOL progress = (Ack != Connection->SendBase);
+    for (ULONG packet = Connection->SendBase; packet != Ack; packet++) {
+        RudpMarkAcked(&Connection->Send[packet % RUDP_WINDOW], NowUs, &sampleUs);
+    }
+    ULONG highest = Ack;
+    for (ULONG bit = 0; bit < 32; bit++) {
+        ULONG packet = Ack + 1 + bit;
+        if (!RudpBefore(packet, Connection->SendNext)) {
+            break;
+        }
+        if (Sack & (1u << bit)) {
+            RudpMarkAcked(&Connection->Send[packet % RUDP_WINDOW], NowUs, &sampleUs);
+            highest = packet + 1;
+        }
+    }
+    Connection->SendBase = Ack;
+    Connection->PeerLimit = Ack + ((Window < RUDP_WINDOW) ? Window : RUDP_WINDOW);
+    if (Connection->PeerLimit == Connection->SendNext) {
+        Connection->ProbeDueUs = NowUs + Connection->RtoUs;
+    }
+
+    if (sampleUs != MAXULONG) {
+        RudpUpdateRtt(Connection, sampleUs);
+    }
+    if (progress) {
+        Connection->TimeoutsInARow = 0;
+        Connection->RtoDeadlineUs = NowUs + Connection->RtoUs;
+    }
+
+    //
+    // a packet that RUDP_DUP_THRESHOLD acked ones overtook is lost, it is
+    // sent again once until the next timeout.
+    //
+    ULONG overtaking = 0;
+    for (ULONG packet = highest; packet != Connection->SendBase; ) {
+        packet--;
+        PRUDP_SEND_SLOT slot = &Connection->Send[packet % RUDP_WINDOW];
+        if (slot->Acked) {
+            overtaking++;
+        }
+        else if (overtaking >= RUDP_DUP_THRESHOLD && !slot->FastRetransmitted) {
+            slot->Retransmit = TRUE;
+            slot->FastRetransmitted = TRUE;
+            Connection->Counters.FastRetransmits++;
+        }
+    }
+}
+
+static VOID RudpReceiveData(PRUDP_CONNECTION Connection, ULONG Packet, const BYTE* Data, ULONG Length)
+{
+    Connection->AckPending = TRUE;
+    if (Length == 0 || Length > RUDP_MAX_PAYLOAD) {
+        return;
+    }
+    if (RudpBefore(Packet, Connection->ReceiveNext)) {
+        Connection->Counters.Duplicates++;
+        return;
+    }
+    if (!RudpBefore(Packet, Connection->ReceiveBase + RUDP_WINDOW)) {
+        // beyond the window, the ack tells the sender.
+        return;
+    }
+    PRUDP_RECEIVE_SLOT slot = &Connection->Receive[Packet % RUDP_WINDOW];
+    if (slot->Present) {
+        Connection->Counters.Duplicates++;
+        return;
+    }
+    memcpy(slot->Data, Data, Length);
+    slot->Length = Length;
+    slot->Present = TRUE;
+    while (RudpBefore(Connection->ReceiveNext, Connection->ReceiveBase + RUDP_WINDOW) &&
+        Connection->Receive[Connection->ReceiveNext % RUDP_WINDOW].Present) {
+        Connection->ReceiveNext++;
+    }
+}
+
+VOID
+RudpInitialize(
+    _In_  PRUDP_CONNECTION  Connection,
+    _In_  BOOL              Peer,
+    _In_  ULONGLONG         NowUs
+    )
+{
+    memset(Connection, 0, sizeof(*Connection));
+    Connection->Peer = Peer;
+    Connection->State = Peer ? RudpIdle : RudpConnecting;
+    Connection->RtoUs = RUDP_INITIAL_RTO_US;
+    Connection->HandshakeDueUs = NowUs;
+    Connection->LastReceiveUs = NowUs;
+    Connection->KeepaliveDueUs = NowUs + RUDP_KEEPALIVE_US;
+    Connection->PeerLimit = RUDP_WINDOW;
+    Connection->AdvertisedLimit = RUDP_WINDOW;
+}
+
+UINT32
+RudpInput(
+    _In_  PRUDP_CONNECTION  Connection,
+    _In_reads_bytes_(Length)
+          const BYTE        *Datagram,
+    _In_  ULONG             Length,
+    _In_  ULONGLONG         NowUs
+    )
+{
+    if (Connection->State == RudpClosed) {
+        return Connection->Error;
+    }
+    if (Length < RUDP_HEADER_SIZE) {
+        return NO_ERROR;
+    }
+    BYTE type = Datagram[0];
+    ULONG window = (ULONG)Datagram[2] << 8 | Datagram[3];
+    ULONG packet = RudpGet32(Datagram + 4);
+    ULONG ack = RudpGet32(Datagram + 8);
+    ULONG sack = RudpGet32(Datagram + 12);
+
+    Connection->Counters.DatagramsReceived++;
+    Connection->LastReceiveUs = NowUs;
+    Connection->KeepaliveDueUs = NowUs + RUDP_KEEPALIVE_US;
+
+    switch (type) {
+    case RudpReset:
+        return RudpFail(Connection, RUDP_RESET_ERROR);
+
+    case RudpFin:
+        return RudpFail(Connection, NO_ERROR);
+
+    case RudpSyn:
+        if (!Connection->Peer) {
+            return NO_ERROR;
+        }
+        if (Connection->State == RudpIdle) {
+            Connection->State = RudpEstablished;
+        }
+        else if (Connection->SendNext != 0 || Connection->ReceiveNext != 0) {
+            // the client started over.
+            return RudpFail(Connection, RUDP_RESET_ERROR);
+        }
+        // again if the syn ack was lost.
+        Connection->SynAckPending = TRUE;
+        Connection->PeerLimit = (window < RUDP_WINDOW) ? window : RUDP_WINDOW;
+        return NO_ERROR;
+
+    case RudpSynAck:
+    case RudpData:
+    case RudpAck:
+    case RudpProbe:
+        if (Connection->State == RudpIdle) {
+            return NO_ERROR;
+        }
+        if (Connection->State == RudpConnecting && !Connection->Peer) {
+            // the peer answering anything means the syn ack was lost.
+            RudpEstablish(Connection, NowUs);
+        }
+        break;
+
+    default:
+        return NO_ERROR;
+    }
+
+    RudpProcessAck(Connection, ack, sack, window, NowUs);
+    if (type == RudpData) {
+        RudpReceiveData(Connection, packet, Datagram + RUDP_HEADER_SIZE, Length - RUDP_HEADER_SIZE);
+    }
+    else if (type == RudpProbe) {
+        Connection->AckPending = TRUE;
+    }
+    return NO_ERROR;
+}
+
+ULONG
+RudpOutput(
+    _In_  PRUDP_CONNECTION  Connection,
+    _In_  ULONGLONG         NowUs,
+    _Out_writes_bytes_(RUDP_MAX_DATAGRAM)
+          BYTE              *Datagram
+    )
+{
+    if (Connection->FinPending) {
+        Connection->FinPending = FALSE;
+        return RudpHeader(Connection, RudpFin, Connection->SendNext, Datagram);
+    }
+
+    if (Connection->State == RudpConnecting) {
+        if (NowUs < Connection->HandshakeDueUs) {
+            return 0;
+        }
+        if (Connection->SynSends > RUDP_MAX_TIMEOUTS) {
+            RudpFail(Connection, RUDP_TIMEOUT_ERROR);
+            return 0;
+        }
+        Connection->SynSends++;
+        Connection->SynSentUs = NowUs;
+        Connection->HandshakeDueUs = NowUs + Connection->RtoUs;
+        Connection->RtoUs = (2 * Connection->RtoUs < RUDP_MAX_RTO_US) ? 2 * Connection->RtoUs : RUDP_MAX_RTO_US;
+        return RudpHeader(Connection, RudpSyn, 0, Datagram);
+    }
+    if (Connection->State != RudpEstablished) {
+        return 0;
+    }
+    if (NowUs - Connection->LastReceiveUs >= RUDP_DEAD_US) {
+        RudpFail(Connection, RUDP_TIMEOUT_ERROR);
+        return 0;
+    }
+    if (Connection->SynAckPending) {
+        Connection->SynAckPending = FALSE;
+        return RudpHeader(Connection, RudpSynAck, Connection->SendNext, Datagram);
+    }
+
+    for (ULONG packet = Connection->SendBase; packet != Connection->SendNext; packet++) {
+        if (Connection->Send[packet % RUDP_WINDOW].Retransmit) {
+            return RudpSendData(Connection, packet, NowUs, TRUE, Datagram);
+        }
+    }
+    if (Connection->SendBase != Connection->SendNext && NowUs >= Connection->RtoDeadlineUs) {
+        Connection->Counters.Timeouts++;
+        if (++Connection->TimeoutsInARow > RUDP_MAX_TIMEOUTS) {
+            RudpFail(Connection, RUDP_TIMEOUT_ERROR);
+            return 0;
+        }
+        Connection->RtoUs = (2 * Connection->RtoUs < RUDP_MAX_RTO_US) ? 2 * Connection->RtoUs : RUDP_MAX_RTO_US;
+        Connection->RtoDeadlineUs = NowUs + Connection->RtoUs;
+        for (ULONG packet = Connection->SendBase; packet != Connection->SendNext; packet++) {
+            Connection->Send[packet % RUDP_WINDOW].FastRetransmitted = FALSE;
+        }
+        return RudpSendData(Connection, Connection->SendBase, NowUs, TRUE, Datagram);
+    }
+
+    if (Connection->SendNext != Connection->SendTail) {
+        if (RudpBefore(Connection->SendNext, Connection->PeerLimit)) {
+            if (NowUs >= Connection->PaceUs) {
+                // a burst, then RUDP_WINDOW packets per round trip.
+                ULONGLONG intervalUs = Connection->SrttUs / RUDP_WINDOW;
+                ULONGLONG burstUs = RUDP_PACE_BURST * intervalUs;
+                if (Connection->PaceUs + burstUs < NowUs) {
+                    Connection->PaceUs = NowUs - burstUs;
+                }
+                Connection->PaceUs += intervalUs;
+                if (Connection->SendBase == Connection->SendNext) {
+                    Connection->RtoDeadlineUs = NowUs + Connection->RtoUs;
+                }
+                return RudpSendData(Connection, Connection->SendNext++, NowUs, FALSE, Datagram);
+            }
+        }
+        else if (Connection->SendBase == Connection->SendNext && NowUs >= Connection->ProbeDueUs) {
+            // the window update of the peer may have been lost.
+            Connection->ProbeDueUs = NowUs + Connection->RtoUs;
+            return RudpHeader(Connection, RudpProbe, Connection->SendNext, Datagram);
+        }
+    }
+    if (NowUs >= Connection->KeepaliveDueUs) {
+        Connection->KeepaliveDueUs = NowUs + RUDP_KEEPALIVE_US;
+        return RudpHeader(Connection, RudpProbe, Connection->SendNext, Datagram);
+    }
+    if (Connection->AckPending) {
+        return RudpHeader(Connection, RudpAck, Connection->SendNext, Datagram);
+    }
+    return 0;
+}
+
+ULONGLONG
+RudpNextUs(
+    _In_  PRUDP_CONNECTION  Connection
+    )
+{
+    if (Connection->FinPending) {
+        return 0;
+    }
+    if (Connection->State == RudpConnecting) {
+        return Connection->HandshakeDueUs;
+    }
+    if (Connection->State != RudpEstablished) {
+        return RUDP_NEVER;
+    }
+    if (Connection->SynAckPending || Connection->AckPending) {
+        return 0;
+    }
+    ULONGLONG next = Connection->LastReceiveUs + RUDP_DEAD_US;
+    if (Connection->KeepaliveDueUs < next) {
+        next = Connection->KeepaliveDueUs;
+    }
+    if (Connection->SendBase != Connection->SendNext && Connection->RtoDeadlineUs < next) {
+        next = Connection->RtoDeadlineUs;
+    }
+    if (Connection->SendNext != Connection->SendTail) {
+        if (RudpBefore(Connection->SendNext, Connection->PeerLimit)) {
+            if (Connection->PaceUs < next) {
+                next = Connection->PaceUs;
+            }
+        }
+        else if (Connection->SendBase == Connection->SendNext && Connection->ProbeDueUs < next) {
+            next = Connection->ProbeDueUs;
+        }
+    }
+    return next;
+}
+
+ULONG
+RudpWrite(
+    _In_  PRUDP_CONNECTION  Connection,
+    _In_reads_bytes_(Length)
+          const BYTE        *Data,
+    _In_  ULONG             Length
+    )
+{
+    if (Connection->State != RudpConnecting && Connection->State != RudpEstablished) {
+        return 0;
+    }
+    ULONG written = 0;
+    if (Connection->SendTail != Connection->SendNext) {
+        PRUDP_SEND_SLOT slot = &Connection->Send[(Connection->SendTail - 1) % RUDP_WINDOW];
+        ULONG count = RUDP_MAX_PAYLOAD - slot->Length;
+        count = (count < Length) ? count : Length;
+        memcpy(slot->Data + slot->Length, Data, count);
+        slot->Length += count;
+        written = count;
+    }
+    while (written < Length && Connection->SendTail - Connection->SendBase < RUDP_WINDOW) {
+        PRUDP_SEND_SLOT slot = &Connection->Send[Connection->SendTail % RUDP_WINDOW];
+        ULONG count = Length - written;
+        count = (count < RUDP_MAX_PAYLOAD) ? count : RUDP_MAX_PAYLOAD;
+        memcpy(slot->Data, Data + written, count);
+        slot->Length = count;
+        slot->Sends = 0;
+        slot->Acked = FALSE;
+        slot->Retransmit = FALSE;
+        slot->FastRetransmitted = FALSE;
+        Connection->SendTail++;
+        written += count;
+    }
+    return written;
+}
+
+ULONG
+RudpRead(
+    _In_  PRUDP_CONNECTION  Connection,
+    _Out_writes_bytes_(Length)
+          BYTE              *Data,
+    _In_  ULONG             Length
+    )
+{
+    ULONG read = 0;
+    while (read < Length && Connection->ReceiveBase != Connection->ReceiveNext) {
+        PRUDP_RECEIVE_SLOT slot = &Connection->Receive[Connection->ReceiveBase % RUDP_WINDOW];
+        ULONG count = slot->Length - Connection->ReadOffset;
+        count = (count < Length - read) ? count : Length - read;
+        memcpy(Data + read, slot->Data + Connection->ReadOffset, count);
+        Connection->ReadOffset += count;
+        read += count;
+        if (Connection->ReadOffset == slot->Length) {
+            slot->Present = FALSE;
+            Connection->ReceiveBase++;
+            Connection->ReadOffset = 0;
+        }
+    }
+    // a window that opened by half is told at once.
+    if (Connection->State == RudpEstablished &&
+        Connection->ReceiveBase + RUDP_WINDOW - Connection->AdvertisedLimit >= RUDP_WINDOW / 2) {
+        Connection->AckPending = TRUE;
+    }
+    return read;
+}
+
+BOOL
+RudpReadable(
+    _In_  PRUDP_CONNECTION  Connection
+    )
+{
+    return Connection->ReceiveBase != Connection->ReceiveNext;
+}
+
+BOOL
+RudpWritable(
+    _In_  PRUDP_CONNECTION  Connection
+    )
+{
+    if (Connection->State != RudpConnecting && Connection->State != RudpEstablished) {
+        return FALSE;
+    }
+    return Connection->SendTail - Connection->SendBase < RUDP_WINDOW ||
+        (Connection->SendTail != Connection->SendNext &&
+         Connection->Send[(Connection->SendTail - 1) % RUDP_WINDOW].Length < RUDP_MAX_PAYLOAD);
+}
+
+VOID
+RudpClose(
+    _In_  PRUDP_CONNECTION  Connection
+    )
+{
+    if (Connection->State == RudpEstablished) {
+        Connection->FinPending = TRUE;
+    }
+    if (Connection->State != RudpClosed) {
+        RudpFail(Connection, NO_ERROR);
+    }
+}
+
+ULONG
+RudpEncodeReset(
+    _Out_writes_bytes_(RUDP_HEADER_SIZE)
+          BYTE              *Datagram
+    )
+{
+    memset(Datagram, 0, RUDP_HEADER_SIZE);
+    Datagram[0] = RudpReset;
+    return RUDP_HEADER_SIZE;
+}
+
+BOOL
+RudpIsSyn(
+    _In_reads_bytes_(Length)
+          const BYTE        *Datagram,
+    _In_  ULONG             Length
+    )
+{
+    return Length >= RUDP_HEADER_SIZE && Datagram[0] == RudpSyn;
+}
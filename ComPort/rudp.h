@@ -0,0 +1,248 @@
+/*++
+
+Module Name:
+
+    rudp.h
+
+Abstract:
+
+    The reliable udp protocol of the udp transport, see udp.h. It keeps
+    the byte stream of a client port in order over datagrams without the
+    head of line blocking and delayed acks of tcp, for an interactive kd
+    session over a LAN that loses packets now and then.
+
+    A datagram is a RUDP_HEADER_SIZE header and, for RudpData, up to
+    RUDP_MAX_PAYLOAD bytes of the stream. Data packets are numbered and
+    every datagram carries the number of the next packet expected, the
+    packets received after it as a bitmap (selective acks) and how many
+    more packets the receiver takes. The receiver acks every batch of data
+    it received at once. A packet that three later ones overtook is sent
+    again at once (fast retransmit), else after the retransmit timeout of
+    RFC 6298, which starts at RUDP_MIN_RTO_US rather than the 200 ms of
+    tcp. New packets are paced to RUDP_WINDOW per round trip after a burst
+    of RUDP_PACE_BURST.
+
+    The protocol does no io and takes the time from its caller, the
+    driver stream and the peers of vspControl and vspPeer drive it.
+
+--*/
+
+#pragma once
+
+#include "platform.h"
+
+#define RUDP_HEADER_SIZE        16
+#define RUDP_MAX_PAYLOAD        1200
+#define RUDP_MAX_DATAGRAM       (RUDP_HEADER_SIZE + RUDP_MAX_PAYLOAD)
+
+//
+// packets in flight, and packets the receiver holds. The selective acks
+// cover as many.
+//
+#define RUDP_WINDOW             32
+
+#define RUDP_INITIAL_RTO_US     100000
+#define RUDP_MIN_RTO_US         10000
+#define RUDP_MAX_RTO_US         1000000
+#define RUDP_MAX_TIMEOUTS       12      // in a row, about 10 s at the longest timeout.
+#define RUDP_DUP_THRESHOLD      3
+#define RUDP_PACE_BURST         8
+
+//
+// a connection without a datagram for RUDP_KEEPALIVE_US asks for an ack,
+// one without for RUDP_DEAD_US is lost.
+//
+#define RUDP_KEEPALIVE_US       5000000
+#define RUDP_DEAD_US            30000000
+
+#define RUDP_NEVER              0xFFFFFFFFFFFFFFFFull
+
+enum RUDP_TYPE {
+    RudpSyn = 1,        // the client connects.
+    RudpSynAck,         // the peer answers.
+    RudpData,
+    RudpAck,
+    RudpProbe,          // asks for an ack, for a closed window or a quiet connection.
+    RudpFin,            // the sender closed.
+    RudpReset,          // the peer does not know the connection.
+};
+
+enum RUDP_STATE {
+    RudpIdle = 0,       // a peer waiting for the syn.
+    RudpConnecting,
+    RudpEstablished,
+    RudpClosed,         // by either side, Error tells why.
+};
+
+typedef struct _RUDP_COUNTERS
+{
+    INT64       DatagramsSent;
+    INT64       DatagramsReceived;
+    INT64       Retransmits;        // all data packets sent again.
+    INT64       FastRetransmits;    // of those, sent again on selective acks.
+    INT64       Timeouts;           // retransmit timer expirations.
+    INT64       Duplicates;         // data packets received twice.
+} RUDP_COUNTERS, *PRUDP_COUNTERS;
+
+typedef struct _RUDP_SEND_SLOT
+{
+    ULONG       Length;
+    ULONGLONG   SentUs;
+    ULONG       Sends;
+    BOOLEAN     Acked;
+    BOOLEAN     Retransmit;         // due at once.
+    BOOLEAN     FastRetransmitted;  // since the last timeout.
+    BYTE        Data[RUDP_MAX_PAYLOAD];
+} RUDP_SEND_SLOT, *PRUDP_SEND_SLOT;
+
+typedef struct _RUDP_RECEIVE_SLOT
+{
+    ULONG       Length;
+    BOOLEAN     Present;
+    BYTE        Data[RUDP_MAX_PAYLOAD];
+} RUDP_RECEIVE_SLOT, *PRUDP_RECEIVE_SLOT;
+
+//
+// packet numbers only grow, the slot of packet n is n % RUDP_WINDOW.
+//
+typedef struct _RUDP_CONNECTION
+{
+    ULONG       State;              // RUDP_STATE
+    UINT32      Error;              // once closed, NO_ERROR if the peer closed.
+    BOOL        Peer;               // the side that answers the syn.
+    BOOL        SynAckPending;
+    BOOL        AckPending;
+    BOOL        FinPending;
+    ULONG       SynSends;
+    ULONGLONG   SynSentUs;
+    ULONGLONG   HandshakeDueUs;
+
+    ULONG       SrttUs;             // 0 until the first sample.
+    ULONG       RttvarUs;
+    ULONG       RtoUs;
+    ULONG       TimeoutsInARow;
+    ULONGLONG   RtoDeadlineUs;      // of the oldest packet in flight.
+    ULONGLONG   PaceUs;             // when the next new packet may go.
+    ULONGLONG   ProbeDueUs;
+    ULONGLONG   LastReceiveUs;
+    ULONGLONG   KeepaliveDueUs;
+
+    ULONG       SendBase;           // oldest packet not acked.
+    ULONG       SendNext;           // next packet sent for the first time.
+    ULONG       SendTail;           // next packet written.
+    ULONG       PeerLimit;          // first packet the peer does not take yet.
+    RUDP_SEND_SLOT Send[RUDP_WINDOW];
+
+    ULONG       ReceiveBase;        // oldest packet not read.
+    ULONG       ReceiveNext;        // next packet expected, the cumulative ack.
+    ULONG       ReadOffset;         // into the packet of ReceiveBase.
+    ULONG       AdvertisedLimit;    // the PeerLimit the peer was last told.
+    RUDP_RECEIVE_SLOT Receive[RUDP_WINDOW];
+
+    RUDP_COUNTERS Counters;
+} RUDP_CONNECTION, *PRUDP_CONNECTION;
+
+//
+// a client connects at once, a peer is given the syn with RudpInput.
+//
+VOID
+RudpInitialize(
+    _In_  PRUDP_CONNECTION  Connection,
+    _In_  BOOL              Peer,
+    _In_  ULONGLONG         NowUs
+    );
+
+//
+// takes a datagram of the peer. Returns the error that closed the
+// connection, if this one did.
+//
+UINT32
+RudpInput(
+    _In_  PRUDP_CONNECTION  Connection,
+    _In_reads_bytes_(Length)
+          const BYTE        *Datagram,
+    _In_  ULONG             Length,
+    _In_  ULONGLONG         NowUs
+    );
+
+//
+// the next datagram to send, in Datagram which holds RUDP_MAX_DATAGRAM
+// bytes. Returns its length, 0 once there is nothing to send until
+// RudpNextUs. Also closes a connection that timed out.
+//
+ULONG
+RudpOutput(
+    _In_  PRUDP_CONNECTION  Connection,
+    _In_  ULONGLONG         NowUs,
+    _Out_writes_bytes_(RUDP_MAX_DATAGRAM)
+          BYTE              *Datagram
+    );
+
+//
+// when RudpOutput has something to send without a datagram of the peer,
+// RUDP_NEVER for a closed connection.
+//
+ULONGLONG
+RudpNextUs(
+    _In_  PRUDP_CONNECTION  Connection
+    );
+
+//
+// queues up to Length bytes, returns how many, 0 if the window is full.
+// Each write starts a packet unless the last one is still waiting to go.
+//
+ULONG
+RudpWrite(
+    _In_  PRUDP_CONNECTION  Connection,
+    _In_reads_bytes_(Length)
+          const BYTE        *Data,
+    _In_  ULONG             Length
+    );
+
+//
+// reads up to Length bytes of the stream in order, returns how many.
+//
+ULONG
+RudpRead(
+    _In_  PRUDP_CONNECTION  Connection,
+    _Out_writes_bytes_(Length)
+          BYTE              *Data,
+    _In_  ULONG             Length
+    );
+
+BOOL
+RudpReadable(
+    _In_  PRUDP_CONNECTION  Connection
+    );
+
+BOOL
+RudpWritable(
+    _In_  PRUDP_CONNECTION  Connection
+    );
+
+//
+// closes the connection, RudpOutput sends a fin once.
+//
+VOID
+RudpClose(
+    _In_  PRUDP_CONNECTION  Connection
+    );
+
+//
+// the answer to a datagram of an unknown connection.
+//
+ULONG
+RudpEncodeReset(
+    _Out_writes_bytes_(RUDP_HEADER_SIZE)
+          BYTE              *Datagram
+    );
+
+//
+// returns TRUE for a syn, the first datagram of a connection.
+//
+BOOL
+RudpIsSyn(
+    _In_reads_bytes_(Length)
+          const BYTE        *Datagram,
+    _In_  ULONG             Length
+    );
@@ -0,0 +1,239 @@
+/*++
+
+Module Name:
+
+    shmring.cpp
+
+Abstract:
+
+    The shared memory rings of the shm transport. Each field of a ring is
+    written by one side only. A side publishes its point with a release store
+    after the data, and reads the other side's point with an acquire load
+    before the data.
+
+    The waiting flags are the one place both sides write. A reader stores
+    ReaderWaiting and then checks Tail, a writer stores Tail and then checks
+    ReaderWaiting, with a full barrier between the store and the load on both
+    sides. So at least one of them sees the other and a signal is never lost.
+
+--*/
+
+#include "shmring.h"
+#include <atomic>
+
+static inline ULONG LoadAcquire(volatile ULONG* Point)
+{
+    ULONG value = *Point;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return value;
+}
+
+static inline VOID StoreRelease(volatile ULONG* Point, ULONG Value)
+{
+    std::atomic_thread_fence(std::memory_order_release);
+    *Point = Value;
+}
+
+//
+// clears a waiting flag and returns it, so only one side signals a wait.
+//
+static inline LONG TakeWaiting(volatile LONG* Waiting)
+{
+#ifdef _WIN32
+    return InterlockedExchange(Waiting, 0);
+#else
+    return __atomic_exchange_n(Waiting, 0, __ATOMIC_SEQ_CST);
+#endif
+}
+
+VOID
+ShmInitialize(
+    _In_  PSHM_HEADER   Header,
+    _In_  ULONG         RingSize
+    )
+{
+    RtlZeroMemory(Header, sizeof(*Header));
+    Header->Version = SHM_VERSION;
+    Header->RingSize = RingSize;
+    //
+    // readers start out waiting, a stream is waited on before its first
+    // recv and the first write must signal it.
+    //
+    Header->Rings[SHM_RING_TO_SERVER].ReaderWaiting = 1;
+    Header->Rings[SHM_RING_TO_CLIENT].ReaderWaiting = 1;
+    std::atomic_thread_fence(std::memory_order_release);
+    Header->Magic = SHM_MAGIC;
+}
+
+ULONG
+ShmValidate(
+    _In_  PSHM_HEADER   Header,
+    _In_  size_t        MappingSize
+    )
+{
+    if (MappingSize < sizeof(SHM_HEADER) || Header->Magic != SHM_MAGIC) {
+        return 0;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (Header->Version != SHM_VERSION ||
+        Header->RingSize < SHM_MIN_RING_SIZE ||
+        ShmMappingSize(Header->RingSize) > MappingSize) {
+        return 0;
+    }
+    return Header->RingSize;
+}
+
+VOID
+ShmRingView(
+    _In_  PSHM_HEADER       Header,
+    _In_  ULONG             Ring,
+    _Out_ PSHM_RING_VIEW    View
+    )
+{
+    View->Ring = &Header->Rings[Ring];
+    View->Size = Header->RingSize;
+    View->Data = (BYTE*)(Header + 1) + (size_t)Ring * Header->RingSize;
+}
+
+static inline ULONG RingData(ULONG Head, ULONG Tail, ULONG Size)
+{
+    return (Tail >= Head) ? (Tail - Head) : (Size - Head + Tail);
+}
+
+ULONG
+ShmRingAvailableData(
+    _In_  PSHM_RING_VIEW    View
+    )
+{
+    return RingData(LoadAcquire(&View->Ring->Head), LoadAcquire(&View->Ring->Tail), View->Size);
+}
+
+ULONG
+ShmRingAvailableSpace(
+    _In_  PSHM_RING_VIEW    View
+    )
+{
+    return View->Size - 1 - ShmRingAvailableData(View);
+}
+
+ULONG
+ShmRingWrite(
+    _In_  PSHM_RING_VIEW    View,
+    _In_reads_bytes_(Length)
+          const BYTE        *Data,
+    _In_  ULONG             Length,
+    _Out_ BOOL              *WakeReader
+    )
+{
+    PSHM_RING ring = View->Ring;
+    ULONG tail = ring->Tail;
+    ULONG head = LoadAcquire(&ring->Head);
+    ULONG space = View->Size - 1 - RingData(head, tail, View->Size);
+
+    *WakeReader = FALSE;
+    if (Length > space) {
+        Length = space;
+    }
+    if (Length == 0) {
+        return 0;
+    }
+
+    //
+    // up to the end of the ring, then from its start.
+    //
+    ULONG first = View->Size - tail;
+    if (first > Length) {
+        first = Length;
+    }
+    RtlCopyMemory(View->Data + tail, Data, first);
+    RtlCopyMemory(View->Data, Data + first, Length - first);
+    tail += Length;
+    if (tail >= View->Size) {
+        tail -= View->Size;
+    }
+    StoreRelease(&ring->Tail, tail);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring->ReaderWaiting) {
+        *WakeReader = TakeWaiting(&ring->ReaderWaiting) != 0;
+    }
+    return Length;
+}
+
+ULONG
+ShmRingRead(
+    _In_  PSHM_RING_VIEW    View,
+    _Out_writes_bytes_to_(Length, return)
+          BYTE              *Data,
+    _In_  ULONG             Length,
+    _Out_ BOOL              *WakeWriter
+    )
+{
+    PSHM_RING ring = View->Ring;
+    ULONG head = ring->Head;
+    ULONG available = RingData(head, LoadAcquire(&ring->Tail), View->Size);
+
+    *WakeWriter = FALSE;
+    if (Length > available) {
+        Length = available;
+    }
+    if (Length == 0) {
+        return 0;
+    }
+
+    ULONG first = View->Size - head;
+    if (first > Length) {
+        first = Length;
+    }
+    RtlCopyMemory(Data, View->Data + head, first);
+    RtlCopyMemory(Data + first, View->Data, Length - first);
+    head += Length;
+    if (head >= View->Size) {
+        head -= View->Size;
+    }
+    StoreRelease(&ring->Head, head);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring->WriterWaiting) {
+        *WakeWriter = TakeWaiting(&ring->WriterWaiting) != 0;
+    }
+    return Length;
+}
+
+BOOL
+ShmRingArmReader(
+    _In_  PSHM_RING_VIEW    View
+    )
+{
+    //
+    // the reader stays armed even if data came in the meantime. It took the
+    // last signal before arming and may wait again without another look at
+    // the ring, so the next write must signal. At worst that signal finds
+    // the data already read.
+    //
+    View->Ring->ReaderWaiting = 1;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return ShmRingAvailableData(View) == 0;
+}
+
+BOOL
+ShmRingReaderArmed(
+    _In_  PSHM_RING_VIEW    View
+    )
+{
+    return View->Ring->ReaderWaiting != 0;
+}
+
+BOOL
+ShmRingArmWriter(
+    _In_  PSHM_RING_VIEW    View
+    )
+{
+    View->Ring->WriterWaiting = 1;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ShmRingAvailableSpace(View) != 0) {
+        TakeWaiting(&View->Ring->WriterWaiting);
+        return FALSE;
+    }
+    return TRUE;
+}
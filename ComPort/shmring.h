@@ -0,0 +1,181 @@
+/*++
+
+Module Name:
+
+    shmring.h
+
+Abstract:
+
+    Single producer single consumer byte rings in memory shared by two
+    processes, the shm transport of a port. They follow RING_BUFFER: Head is
+    the read point, Tail the write point and one byte stays free so that
+    Head == Tail means empty. The points are offsets instead of pointers, a
+    mapping has a different address in each process, and each is written by
+    one side only.
+
+    The sides only signal each other on a transition the other side waits
+    for: a reader that found its ring empty sets ReaderWaiting and the writer
+    that makes the ring non-empty signals it, a writer that found its ring
+    full sets WriterWaiting and the reader that frees space signals it. A busy
+    stream makes no system calls at all.
+
+--*/
+
+#pragma once
+
+#include "platform.h"
+
+#define SHM_MAGIC               0x70737668  // 'hvsp'
+#define SHM_VERSION             1
+
+//
+// the ring size of a new mapping, a client takes the size the server chose.
+//
+#define SHM_DEFAULT_RING_SIZE   (1024 * 1024)
+#define SHM_MIN_RING_SIZE       4096
+
+#define SHM_CACHE_LINE          64
+
+//
+// the rings of a mapping. The client writes SHM_RING_TO_SERVER.
+//
+#define SHM_RING_TO_SERVER      0
+#define SHM_RING_TO_CLIENT      1
+
+#define SHM_SERVER              0
+#define SHM_CLIENT              1
+
+//
+// the signals of a mapping, a data and a space signal for each ring.
+//
+#define SHM_EVENTS              4
+#define SHM_EVENT_DATA(Ring)    ((Ring) * 2)
+#define SHM_EVENT_SPACE(Ring)   ((Ring) * 2 + 1)
+
+//
+// the shared state of one ring. The consumer and the producer fields are on
+// separate cache lines so the sides do not steal each other's line.
+//
+typedef struct _SHM_RING {
+    volatile ULONG  Head;           // written by the reader.
+    volatile LONG   WriterWaiting;  // set by the writer, cleared by the reader that signals it.
+    BYTE            ReaderLine[SHM_CACHE_LINE - 2 * sizeof(ULONG)];
+    volatile ULONG  Tail;           // written by the writer.
+    volatile LONG   ReaderWaiting;  // set by the reader, cleared by the writer that signals it.
+    BYTE            WriterLine[SHM_CACHE_LINE - 2 * sizeof(ULONG)];
+} SHM_RING, *PSHM_RING;
+
+//
+// the start of a mapping. The ring data follows, SHM_RING_TO_SERVER first.
+//
+typedef struct _SHM_HEADER {
+    ULONG           Magic;
+    ULONG           Version;
+    ULONG           RingSize;
+    volatile LONG   Attached;       // a client opened the mapping.
+    volatile LONG   Closed[2];      // indexed by SHM_SERVER or SHM_CLIENT.
+    BYTE            HeaderLine[SHM_CACHE_LINE - 6 * sizeof(ULONG)];
+    SHM_RING        Rings[2];
+} SHM_HEADER, *PSHM_HEADER;
+
+//
+// one side's view of a ring.
+//
+typedef struct _SHM_RING_VIEW {
+    PSHM_RING       Ring;
+    BYTE*           Data;
+    ULONG           Size;
+} SHM_RING_VIEW, *PSHM_RING_VIEW;
+
+inline size_t ShmMappingSize(ULONG RingSize)
+{
+    return sizeof(SHM_HEADER) + 2 * (size_t)RingSize;
+}
+
+//
+// fills in a new mapping.
+//
+VOID
+ShmInitialize(
+    _In_  PSHM_HEADER   Header,
+    _In_  ULONG         RingSize
+    );
+
+//
+// checks the header of a mapping a client opened and returns its ring size,
+// 0 if it is not a mapping of this version.
+//
+ULONG
+ShmValidate(
+    _In_  PSHM_HEADER   Header,
+    _In_  size_t        MappingSize
+    );
+
+VOID
+ShmRingView(
+    _In_  PSHM_HEADER       Header,
+    _In_  ULONG             Ring,
+    _Out_ PSHM_RING_VIEW    View
+    );
+
+ULONG
+ShmRingAvailableData(
+    _In_  PSHM_RING_VIEW    View
+    );
+
+ULONG
+ShmRingAvailableSpace(
+    _In_  PSHM_RING_VIEW    View
+    );
+
+//
+// copies up to Length bytes into the ring. WakeReader is set if the reader
+// waits for them and must be signalled.
+//
+ULONG
+ShmRingWrite(
+    _In_  PSHM_RING_VIEW    View,
+    _In_reads_bytes_(Length)
+          const BYTE        *Data,
+    _In_  ULONG             Length,
+    _Out_ BOOL              *WakeReader
+    );
+
+//
+// copies up to Length bytes out of the ring. WakeWriter is set if the writer
+// waits for the space and must be signalled.
+//
+ULONG
+ShmRingRead(
+    _In_  PSHM_RING_VIEW    View,
+    _Out_writes_bytes_to_(Length, return)
+          BYTE              *Data,
+    _In_  ULONG             Length,
+    _Out_ BOOL              *WakeWriter
+    );
+
+//
+// asks the writer for a signal with the next data. Returns FALSE if the ring
+// already has some, then the reader must read it before it waits.
+//
+BOOL
+ShmRingArmReader(
+    _In_  PSHM_RING_VIEW    View
+    );
+
+//
+// TRUE while a signal asked for by ShmRingArmReader is still to come.
+//
+BOOL
+ShmRingReaderArmed(
+    _In_  PSHM_RING_VIEW    View
+    );
+
+//
+// asks the reader for a signal once the ring has space. Returns FALSE if it
+// already has some.
+//
+BOOL
+ShmRingArmWriter(
+    _In_  PSHM_RING_VIEW    View
+    );
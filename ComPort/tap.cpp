@@ -0,0 +1,266 @@
+/*++
+
+Module Name:
+
+    tap.cpp
+
+Abstract:
+
+    The taps of a service port, see tap.h.
+
+--*/
+
+#include "tap.h"
+#include <stdlib.h>
+
+//
+// recvs of one flush that discard what a tap sends, so a tap that floods
+// the port does not keep the service loop.
+//
+#define TAP_DISCARD_READS   4
+
+UINT32
+TapInitialize(
+    _In_  PTAP_SET          Taps,
+    _In_  PHTS_VSP_REPORT   Stats
+    )
+{
+    RtlZeroMemory(Taps, sizeof(*Taps));
+    PlatformLockInitialize(&Taps->Lock);
+    Taps->Stats = Stats;
+    return PlatformEventCreate(FALSE, &Taps->Event);
+}
+
+VOID
+TapCleanup(
+    _In_  PTAP_SET          Taps
+    )
+{
+    TapCloseAll(Taps);
+    if (Taps->Event != NULL) {
+        PlatformEventClose(Taps->Event);
+        Taps->Event = NULL;
+    }
+}
+
+VOID
+TapConfigure(
+    _In_  PTAP_SET          Taps,
+    _In_  USHORT            Limit,
+    _In_  USHORT            Policy
+    )
+{
+    PlatformLockAcquire(&Taps->Lock);
+    Taps->Limit = (Limit < TAP_MAX_CLIENTS) ? Limit : TAP_MAX_CLIENTS;
+    Taps->Policy = Policy;
+    PlatformLockRelease(&Taps->Lock);
+}
+
+BOOL
+TapAdd(
+    _In_  PTAP_SET          Taps,
+    _In_  SOCKET            Socket
+    )
+{
+    if (Taps->Count >= Taps->Limit) {
+        return FALSE;
+    }
+    if (PlatformSocketSetNonBlocking(Socket) != NO_ERROR) {
+        return FALSE;
+    }
+    PTAP_CLIENT client = (PTAP_CLIENT)malloc(sizeof(*client));
+    if (client == NULL) {
+        return FALSE;
+    }
+    client->Socket = Socket;
+    client->Overflowed = FALSE;
+    client->SendOffset = 0;
+    client->SendLength = 0;
+    RingBufferInitialize(&client->Queue, client->QueueBuffer, sizeof(client->QueueBuffer));
+
+    BOOL added = FALSE;
+    PlatformLockAcquire(&Taps->Lock);
+    for (ULONG i = 0; i < TAP_MAX_CLIENTS && Taps->Count < Taps->Limit; i++) {
+        if (Taps->Clients[i] == NULL) {
+            Taps->Clients[i] = client;
+            Taps->Count++;
+            Taps->Stats->tapClients = Taps->Count;
+            added = TRUE;
+            break;
+        }
+    }
+    PlatformLockRelease(&Taps->Lock);
+    if (!added) {
+        free(client);
+    }
+    return added;
+}
+
+VOID
+TapCopy(
+    _In_  PTAP_SET          Taps,
+    _In_reads_bytes_(Length)
+          const BYTE        *Data,
+    _In_  ULONG             Length
+    )
+{
+    //
+    // a tap that connects meanwhile gets the next copy.
+    //
+    if (Taps == NULL || Taps->Count == 0 || Length == 0) {
+        return;
+    }
+
+    BOOL signal = FALSE;
+    PlatformLockAcquire(&Taps->Lock);
+    for (ULONG i = 0; i < TAP_MAX_CLIENTS; i++) {
+        PTAP_CLIENT client = Taps->Clients[i];
+        if (client == NULL || client->Overflowed) {
+            continue;
+        }
+        size_t space;
+        RingBufferGetAvailableSpace(&client->Queue, &space);
+        if (space < Length) {
+            if (Taps->Policy == HtsTapDisconnect) {
+                client->Overflowed = TRUE;
+                signal = TRUE;
+            }
+            else {
+                Taps->Stats->tapDroppedBytes += Length;
+            }
+            continue;
+        }
+        RingBufferWrite(&client->Queue, (BYTE*)Data, Length);
+        signal = TRUE;
+    }
+    if (signal && !Taps->Signalled) {
+        Taps->Signalled = TRUE;
+    }
+    else {
+        // the flush has not run since the last signal.
+        signal = FALSE;
+    }
+    PlatformLockRelease(&Taps->Lock);
+
+    if (signal) {
+        PlatformEventSet(Taps->Event);
+    }
+}
+
+static VOID
+TapRemove(
+    _In_  PTAP_SET          Taps,
+    _In_  ULONG             Index
+    )
+{
+    PTAP_CLIENT client = Taps->Clients[Index];
+
+    PlatformLockAcquire(&Taps->Lock);
+    Taps->Clients[Index] = NULL;
+    Taps->Count--;
+    Taps->Stats->tapClients = Taps->Count;
+    PlatformLockRelease(&Taps->Lock);
+
+    closesocket(client->Socket);
+    free(client);
+}
+
+//
+// returns FALSE if the tap is gone. *Pending is TRUE if it could not take
+// everything.
+//
+static BOOL
+TapSend(
+    _In_  PTAP_SET          Taps,
+    _In_  PTAP_CLIENT       Client,
+    _Out_ BOOL              *Pending
+    )
+{
+    char discard[256];
+
+    *Pending = FALSE;
+    for (ULONG i = 0; i < TAP_DISCARD_READS; i++) {
+        int result = recv(Client->Socket, discard, sizeof(discard), 0);
+        if (result > 0) {
+            continue;
+        }
+        if (result == 0 || !PlatformSocketWouldBlock(PlatformSocketLastError())) {
+            return FALSE;
+        }
+        break;
+    }
+
+    PlatformLockAcquire(&Taps->Lock);
+    BOOL overflowed = Client->Overflowed;
+    PlatformLockRelease(&Taps->Lock);
+    if (overflowed) {
+        Taps->Stats->tapDisconnects++;
+        return FALSE;
+    }
+
+    for (;;) {
+        if (Client->SendOffset == Client->SendLength) {
+            size_t length = 0;
+            PlatformLockAcquire(&Taps->Lock);
+            RingBufferRead(&Client->Queue, Client->SendBuffer, sizeof(Client->SendBuffer), &length);
+            PlatformLockRelease(&Taps->Lock);
+            Client->SendOffset = 0;
+            Client->SendLength = (ULONG)length;
+            if (length == 0) {
+                return TRUE;
+            }
+        }
+        int result = send(Client->Socket, (const char*)Client->SendBuffer + Client->SendOffset,
+            (int)(Client->SendLength - Client->SendOffset), MSG_NOSIGNAL);
+        if (result == SOCKET_ERROR) {
+            if (PlatformSocketWouldBlock(PlatformSocketLastError())) {
+                *Pending = TRUE;
+                return TRUE;
+            }
+            return FALSE;
+        }
+        Client->SendOffset += result;
+        Taps->Stats->tapBytes += result;
+    }
+}
+
+ULONG
+TapFlush(
+    _In_  PTAP_SET          Taps
+    )
+{
+    ULONG timeoutMs = INFINITE;
+
+    PlatformLockAcquire(&Taps->Lock);
+    Taps->Signalled = FALSE;
+    PlatformLockRelease(&Taps->Lock);
+
+    for (ULONG i = 0; i < TAP_MAX_CLIENTS; i++) {
+        PTAP_CLIENT client = Taps->Clients[i];
+        if (client == NULL) {
+            continue;
+        }
+        BOOL pending;
+        if (!TapSend(Taps, client, &pending)) {
+            TapRemove(Taps, i);
+            continue;
+        }
+        ULONG clientMs = pending ? TAP_RETRY_MS : TAP_POLL_MS;
+        if (clientMs < timeoutMs) {
+            timeoutMs = clientMs;
+        }
+    }
+    return timeoutMs;
+}
+
+VOID
+TapCloseAll(
+    _In_  PTAP_SET          Taps
+    )
+{
+    for (ULONG i = 0; i < TAP_MAX_CLIENTS; i++) {
+        if (Taps->Clients[i] != NULL) {
+            TapRemove(Taps, i);
+        }
+    }
+}
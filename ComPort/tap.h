@@ -0,0 +1,147 @@
+/*++
+
+Module Name:
+
+    tap.h
+
+Abstract:
+
+    The taps of a service port. While its client is connected, further
+    clients that connect get a copy of the traffic of the port and are not
+    heard: what they send is discarded. The copies of both directions go to
+    each tap in the order they happened, whole, the bytes the port receives
+    as the engine receives them and the bytes written to the port as they
+    are written.
+
+    Copying only queues. Each tap has its own bounded queue that one loop,
+    the service loop, sends from without blocking, so a tap that does not
+    read never holds up the client or another tap. A copy that does not fit
+    in the queue of a tap is dropped or closes the tap, see
+    HTS_VSP_TAP_POLICY.
+
+--*/
+
+#pragma once
+
+#include "platform.h"
+#include "htsvsp.h"
+#include "ringbuffer.h"
+
+#define TAP_MAX_CLIENTS     8
+
+//
+// the copies a tap may be behind by. A copy longer than this never fits.
+//
+#define TAP_QUEUE_SIZE      (256 * 1024)
+
+#define TAP_SEND_SIZE       (16 * 1024)
+
+//
+// how often a tap that is up to date is checked for a close, and how soon a
+// tap that could not take everything is tried again.
+//
+#define TAP_POLL_MS         500
+#define TAP_RETRY_MS        10
+
+typedef struct _TAP_CLIENT
+{
+    SOCKET          Socket;
+
+    BOOL            Overflowed;         // under the Lock, closed by the next TapFlush.
+
+    RING_BUFFER     Queue;              // under the Lock.
+
+    ULONG           SendOffset;         // of SendBuffer, by the TapFlush thread only.
+
+    ULONG           SendLength;
+
+    BYTE            SendBuffer[TAP_SEND_SIZE];
+
+    BYTE            QueueBuffer[TAP_QUEUE_SIZE + 1];
+
+} TAP_CLIENT, *PTAP_CLIENT;
+
+typedef struct _TAP_SET
+{
+    PLATFORM_LOCK   Lock;
+
+    PHTS_VSP_REPORT Stats;
+
+    PLATFORM_EVENT  Event;              // auto reset, a queue got data or a tap overflowed.
+
+    BOOL            Signalled;          // Event was set since the last TapFlush.
+
+    USHORT          Limit;
+
+    USHORT          Policy;             // HTS_VSP_TAP_POLICY
+
+    volatile ULONG  Count;
+
+    PTAP_CLIENT     Clients[TAP_MAX_CLIENTS];
+
+} TAP_SET, *PTAP_SET;
+
+_Success_(return == NO_ERROR)
+UINT32
+TapInitialize(
+    _In_  PTAP_SET          Taps,
+    _In_  PHTS_VSP_REPORT   Stats
+    );
+
+//
+// closes the taps and the event.
+//
+VOID
+TapCleanup(
+    _In_  PTAP_SET          Taps
+    );
+
+//
+// the most taps and the policy of the next copies. Limits above
+// TAP_MAX_CLIENTS are reduced to it, taps that are connected stay.
+//
+VOID
+TapConfigure(
+    _In_  PTAP_SET          Taps,
+    _In_  USHORT            Limit,
+    _In_  USHORT            Policy
+    );
+
+//
+// Socket becomes a tap. Returns FALSE if there are Limit taps already or it
+// fails, the caller keeps Socket then.
+//
+// TapAdd, TapFlush and TapCloseAll are called by one thread.
+//
+BOOL
+TapAdd(
+    _In_  PTAP_SET          Taps,
+    _In_  SOCKET            Socket
+    );
+
+//
+// queues a copy of Data for every tap. Safe from any thread, and cheap
+// without taps.
+//
+VOID
+TapCopy(
+    _In_  PTAP_SET          Taps,
+    _In_reads_bytes_(Length)
+          const BYTE        *Data,
+    _In_  ULONG             Length
+    );
+
+//
+// sends what the taps can take without blocking and closes the taps that
+// are gone or overflowed. Call it when Event is signalled and when the
+// returned time elapsed, INFINITE while there are no taps.
+//
+ULONG
+TapFlush(
+    _In_  PTAP_SET          Taps
+    );
+
+VOID
+TapCloseAll(
+    _In_  PTAP_SET          Taps
+    );
@@ -0,0 +1,152 @@
+#include "internal.h"
+
+//
+// the capture is large, so it is only allocated for devices
+// that have had a timeline capture started.
+//
+NTSTATUS
+TimelineCreate(
+    _In_  PDEVICE_CONTEXT   DeviceContext
+    )
+{
+    NTSTATUS                status;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    WDFMEMORY               memory;
+    PVOID                   buffer;
+
+    if (DeviceContext->Timeline != NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = DeviceContext->Device;
+
+    status = WdfMemoryCreate(&attributes,
+        NonPagedPoolNx,
+        0,
+        sizeof(TIMELINE),
+        &memory,
+        &buffer);
+    if (!NT_SUCCESS(status)) {
+        Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreate timeline error: %#x",
+            status);
+        return status;
+    }
+
+    RtlZeroMemory(buffer, sizeof(TIMELINE));
+    DeviceContext->Timeline = (PTIMELINE)buffer;
+    return status;
+}
+
+VOID
+TimelineRecordEvent(
+    _In_  PTIMELINE         Timeline,
+    _In_  USHORT            Type,
+    _In_  ULONG             CorrelationId,
+    _In_  INT64             Arg0,
+    _In_  INT64             Arg1
+    )
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    LONG64 index = InterlockedIncrement64(&Timeline->WriteIndex) - 1;
+    PTIMELINE_SLOT slot = &Timeline->Slots[index & (TIMELINE_EVENTS - 1)];
+
+    //
+    // invalidate the slot while it is rewritten so a reader
+    // never returns a half written event.
+    //
+    InterlockedExchange64(&slot->Sequence, 0);
+    slot->Event.timestamp = now.QuadPart;
+    slot->Event.correlationId = CorrelationId;
+    slot->Event.type = Type;
+    slot->Event.reserved = 0;
+    slot->Event.arg0 = Arg0;
+    slot->Event.arg1 = Arg1;
+    InterlockedExchange64(&slot->Sequence, index + 1);
+}
+
+VOID
+TimelineControl(
+    _In_  PTIMELINE         Timeline,
+    _In_  BOOL              Enable
+    )
+{
+    if (Enable) {
+        InterlockedExchange(&Timeline->Enabled, 0);
+        Timeline->ReadIndex = Timeline->WriteIndex;
+        InterlockedExchange(&Timeline->Enabled, 1);
+    }
+    else {
+        InterlockedExchange(&Timeline->Enabled, 0);
+    }
+    Trace(TRACE_LEVEL_INFO, "timeline capture %s", Enable ? "started" : "stopped");
+}
+
+NTSTATUS
+TimelineRead(
+    _In_  PTIMELINE         Timeline,
+    _In_  WDFREQUEST        Request
+    )
+{
+    NTSTATUS                status;
+    PVOID                   buffer;
+    size_t                  length;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(HTS_VSP_TIMELINE_HEADER),
+        &buffer,
+        &length);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    PHTS_VSP_TIMELINE_HEADER header = (PHTS_VSP_TIMELINE_HEADER)buffer;
+    PHTS_VSP_TIMELINE_EVENT events = (PHTS_VSP_TIMELINE_EVENT)(header + 1);
+    size_t maxEvents = (length - sizeof(*header)) / sizeof(HTS_VSP_TIMELINE_EVENT);
+
+    header->count = 0;
+    header->dropped = 0;
+
+    LONG64 writeIndex = Timeline->WriteIndex;
+    if (writeIndex - Timeline->ReadIndex > TIMELINE_EVENTS) {
+        //
+        // the producers lapped the reader.
+        //
+        header->dropped = (ULONG)(writeIndex - Timeline->ReadIndex - TIMELINE_EVENTS);
+        Timeline->ReadIndex = writeIndex - TIMELINE_EVENTS;
+    }
+
+    while ((Timeline->ReadIndex < writeIndex) &&
+           (header->count < maxEvents)) {
+        PTIMELINE_SLOT slot = &Timeline->Slots[Timeline->ReadIndex & (TIMELINE_EVENTS - 1)];
+        if (slot->Sequence != Timeline->ReadIndex + 1) {
+            //
+            // either still being written, or already overwritten.
+            // Stop at an unpublished slot, skip an overwritten one.
+            //
+            if (slot->Sequence <= Timeline->ReadIndex) {
+                break;
+            }
+            header->dropped++;
+        }
+        else {
+            events[header->count] = slot->Event;
+            //
+            // the slot may have been rewritten during the copy.
+            //
+            if (slot->Sequence == Timeline->ReadIndex + 1) {
+                header->count++;
+            }
+            else {
+                header->dropped++;
+            }
+        }
+        Timeline->ReadIndex++;
+    }
+
+    WdfRequestSetInformation(Request,
+        sizeof(*header) + header->count * sizeof(HTS_VSP_TIMELINE_EVENT));
+    return status;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+//
+// per device capture of read request lifecycle events, read by
+// vspControl --timeline and written out as a chrome trace file.
+//
+// Events are recorded by the framework callbacks, the timer callbacks and
+// the client loop, so the capture is a multiple producer ring. A producer
+// claims a slot with an interlocked increment and publishes it by writing
+// the slot sequence last. When the capture is not enabled recording costs
+// one test of Enabled.
+//
+#define TIMELINE_EVENTS 4096   // must be a power of two.
+
+typedef struct _TIMELINE_SLOT
+{
+    volatile LONG64         Sequence;   // claim index + 1 once the event is written.
+    HTS_VSP_TIMELINE_EVENT  Event;
+} TIMELINE_SLOT, *PTIMELINE_SLOT;
+
+typedef struct _TIMELINE
+{
+    volatile LONG           Enabled;
+
+    volatile LONG64         WriteIndex;
+
+    LONG64                  ReadIndex;  // only the IOCTL_HTSVSP_TIMELINE_READ handler uses this.
+
+    TIMELINE_SLOT           Slots[TIMELINE_EVENTS];
+
+} TIMELINE, *PTIMELINE;
+
+NTSTATUS
+TimelineCreate(
+    _In_  PDEVICE_CONTEXT   DeviceContext
+    );
+
+VOID
+TimelineRecordEvent(
+    _In_  PTIMELINE         Timeline,
+    _In_  USHORT            Type,
+    _In_  ULONG             CorrelationId,
+    _In_  INT64             Arg0,
+    _In_  INT64             Arg1
+    );
+
+__forceinline
+VOID
+TimelineRecord(
+    _In_  PTIMELINE         Timeline,
+    _In_  USHORT            Type,
+    _In_  ULONG             CorrelationId,
+    _In_  INT64             Arg0 = 0,
+    _In_  INT64             Arg1 = 0
+    )
+{
+    if (Timeline && Timeline->Enabled) {
+        TimelineRecordEvent(Timeline, Type, CorrelationId, Arg0, Arg1);
+    }
+}
+
+VOID
+TimelineControl(
+    _In_  PTIMELINE         Timeline,
+    _In_  BOOL              Enable
+    );
+
+NTSTATUS
+TimelineRead(
+    _In_  PTIMELINE         Timeline,
+    _In_  WDFREQUEST        Request
+    );
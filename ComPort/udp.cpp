@@ -0,0 +1,452 @@
+/*++
+
+Module Name:
+
+    udp.cpp
+
+Abstract:
+
+    The udp stream of a client port, see udp.h.
+
+    The connection of rudp.h is under the Lock. The thread takes the
+    datagrams of the peer, and sends what the connection has to send in
+    batches outside the Lock, then sleeps until the next timer of the
+    connection or until a read or a write gives it more to send.
+
+--*/
+
+#include "udp.h"
+#include <string>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define UDP_TIMEOUT_ERROR       WSAETIMEDOUT
+#define UDP_WOULD_BLOCK_ERROR   WSAEWOULDBLOCK
+#define UDP_CLOSED_ERROR        WSAECONNRESET
+#define UDP_NO_ADDRESS_ERROR    WSAEADDRNOTAVAIL
+#define UDP_MEMORY_ERROR        ERROR_NOT_ENOUGH_MEMORY
+#else
+#define UDP_TIMEOUT_ERROR       ETIMEDOUT
+#define UDP_WOULD_BLOCK_ERROR   EWOULDBLOCK
+#define UDP_CLOSED_ERROR        ECONNRESET
+#define UDP_NO_ADDRESS_ERROR    EADDRNOTAVAIL
+#define UDP_MEMORY_ERROR        ENOMEM
+#endif
+
+//
+// datagrams sent, and received, in one go.
+//
+#define UDP_BATCH               16
+
+enum UDP_WAIT_SOURCE {
+    UdpWaitStop = 0,
+    UdpWaitSocket,
+    UdpWaitWake,
+};
+
+typedef struct _UDP_STREAM {
+    SOCKET              Socket;
+    PHTS_VSP_REPORT     Stats;
+    PLATFORM_THREAD     Thread;
+    PLATFORM_EVENT      StopEvent;      // manual reset, the stream is closed.
+    PLATFORM_EVENT      WakeEvent;      // auto reset, a read or a write gave the connection something to send.
+    PLATFORM_EVENT      ChangeEvent;    // auto reset, the connection was established, closed or took acks.
+    PPLATFORM_WAITER    ChangeWaiter;
+    PLATFORM_EVENT      DataEvent;      // manual reset, set while there is data or the connection closed.
+
+    PLATFORM_LOCK       Lock;
+    RUDP_CONNECTION     Connection;
+
+    //
+    // the thread only.
+    //
+    ULONG               OutLength[UDP_BATCH];
+    BYTE                Out[UDP_BATCH][RUDP_MAX_DATAGRAM];
+    BYTE                In[RUDP_MAX_DATAGRAM];
+} UDP_STREAM, *PUDP_STREAM;
+
+//
+// called with the Lock held.
+//
+static VOID
+UdpUpdateStats(
+    _In_  PUDP_STREAM       Stream
+    )
+{
+    PRUDP_CONNECTION connection = &Stream->Connection;
+    Stream->Stats->udpSrttUs = connection->SrttUs;
+    Stream->Stats->udpRtoUs = connection->RtoUs;
+    Stream->Stats->udpDatagramsSent = connection->Counters.DatagramsSent;
+    Stream->Stats->udpDatagramsReceived = connection->Counters.DatagramsReceived;
+    Stream->Stats->udpRetransmits = connection->Counters.Retransmits;
+    Stream->Stats->udpFastRetransmits = connection->Counters.FastRetransmits;
+    Stream->Stats->udpTimeouts = connection->Counters.Timeouts;
+    Stream->Stats->udpDuplicates = connection->Counters.Duplicates;
+}
+
+//
+// takes the datagrams the socket has, a batch at most so that the acks
+// they ask for go out in time.
+//
+static VOID
+UdpReceive(
+    _In_  PUDP_STREAM       Stream
+    )
+{
+    for (ULONG count = 0; count < UDP_BATCH; count++) {
+        int result = recv(Stream->Socket, (char*)Stream->In, sizeof(Stream->In), 0);
+        if (result < 0) {
+            // also the port unreachable of a peer not up yet, the syn is
+            // sent again.
+            break;
+        }
+        PlatformLockAcquire(&Stream->Lock);
+        ULONG state = Stream->Connection.State;
+        RudpInput(&Stream->Connection, Stream->In, (ULONG)result, PlatformTimeUs());
+        if (RudpReadable(&Stream->Connection) || Stream->Connection.State == RudpClosed) {
+            PlatformEventSet(Stream->DataEvent);
+        }
+        if (state != Stream->Connection.State || RudpWritable(&Stream->Connection)) {
+            PlatformEventSet(Stream->ChangeEvent);
+        }
+        PlatformLockRelease(&Stream->Lock);
+    }
+}
+
+//
+// sends the datagrams due, a batch at a time. A datagram the socket does
+// not take is lost like one on the wire. Returns FALSE once the connection
+// closed and its fin went out.
+//
+static BOOL
+UdpSend(
+    _In_  PUDP_STREAM       Stream,
+    _Out_ ULONGLONG         *NextUs
+    )
+{
+    ULONG count;
+    BOOL open;
+    do {
+        count = 0;
+        PlatformLockAcquire(&Stream->Lock);
+        ULONG state = Stream->Connection.State;
+        ULONGLONG nowUs = PlatformTimeUs();
+        while (count < UDP_BATCH) {
+            ULONG length = RudpOutput(&Stream->Connection, nowUs, Stream->Out[count]);
+            if (length == 0) {
+                break;
+            }
+            Stream->OutLength[count++] = length;
+        }
+        *NextUs = RudpNextUs(&Stream->Connection);
+        open = Stream->Connection.State != RudpClosed;
+        if (state != Stream->Connection.State) {
+            // timed out.
+            PlatformEventSet(Stream->DataEvent);
+            PlatformEventSet(Stream->ChangeEvent);
+        }
+        UdpUpdateStats(Stream);
+        PlatformLockRelease(&Stream->Lock);
+
+        for (ULONG index = 0; index < count; index++) {
+            send(Stream->Socket, (const char*)Stream->Out[index], (int)Stream->OutLength[index], MSG_NOSIGNAL);
+        }
+    } while (count == UDP_BATCH);
+    return open;
+}
+
+static UINT32
+UdpThread(
+    _In_  PVOID             Context
+    )
+{
+    PUDP_STREAM stream = (PUDP_STREAM)Context;
+    PPLATFORM_WAITER waiter = NULL;
+
+    UINT32 error = PlatformWaiterCreate(&waiter);
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddEvent(waiter, stream->StopEvent);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddSocket(waiter, stream->Socket, PLATFORM_SOCKET_READ);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddEvent(waiter, stream->WakeEvent);
+    }
+
+    ULONGLONG nextUs;
+    while (error == NO_ERROR && UdpSend(stream, &nextUs)) {
+        ULONG timeoutMs = INFINITE;
+        if (nextUs != RUDP_NEVER) {
+            ULONGLONG nowUs = PlatformTimeUs();
+            timeoutMs = (nextUs <= nowUs) ? 0 : (ULONG)((nextUs - nowUs + 999) / 1000);
+        }
+        ULONG ready = PlatformWait(waiter, timeoutMs);
+        if (ready == UdpWaitStop) {
+            // the fin, once.
+            PlatformLockAcquire(&stream->Lock);
+            RudpClose(&stream->Connection);
+            PlatformLockRelease(&stream->Lock);
+            UdpSend(stream, &nextUs);
+            break;
+        }
+        if (ready == PLATFORM_WAIT_FAILED) {
+            error = PlatformSocketLastError();
+        }
+        else if (ready == UdpWaitSocket) {
+            UdpReceive(stream);
+        }
+    }
+    PlatformWaiterClose(waiter);
+
+    PlatformLockAcquire(&stream->Lock);
+    if (stream->Connection.State != RudpClosed) {
+        stream->Connection.State = RudpClosed;
+        stream->Connection.Error = (error != NO_ERROR) ? error : UDP_CLOSED_ERROR;
+    }
+    PlatformEventSet(stream->DataEvent);
+    PlatformEventSet(stream->ChangeEvent);
+    PlatformLockRelease(&stream->Lock);
+    return error;
+}
+
+static int
+UdpStreamRecv(
+    _In_  PVOID             Context,
+    _Out_writes_bytes_(Length) char* Buffer,
+    _In_  int               Length,
+    _Out_ UINT32*           Error
+    )
+{
+    PUDP_STREAM stream = (PUDP_STREAM)Context;
+
+    PlatformLockAcquire(&stream->Lock);
+    ULONG length = RudpRead(&stream->Connection, (BYTE*)Buffer, (ULONG)Length);
+    if (length == 0) {
+        BOOL closed = stream->Connection.State == RudpClosed;
+        *Error = closed ? stream->Connection.Error : UDP_WOULD_BLOCK_ERROR;
+        if (!closed) {
+            PlatformEventReset(stream->DataEvent);
+        }
+        PlatformLockRelease(&stream->Lock);
+        return (closed && *Error == NO_ERROR) ? 0 : SOCKET_ERROR;
+    }
+    // the read opened the window, the peer is told at once.
+    BOOL wake = stream->Connection.AckPending;
+    PlatformLockRelease(&stream->Lock);
+
+    if (wake) {
+        PlatformEventSet(stream->WakeEvent);
+    }
+    *Error = NO_ERROR;
+    return (int)length;
+}
+
+static int
+UdpStreamSend(
+    _In_  PVOID             Context,
+    _In_reads_bytes_(Length) const char* Buffer,
+    _In_  int               Length,
+    _Out_ UINT32*           Error
+    )
+{
+    PUDP_STREAM stream = (PUDP_STREAM)Context;
+
+    PlatformLockAcquire(&stream->Lock);
+    ULONG count = RudpWrite(&stream->Connection, (const BYTE*)Buffer, (ULONG)Length);
+    if (stream->Connection.State == RudpClosed) {
+        // a peer that closed takes nothing more either.
+        *Error = (stream->Connection.Error != NO_ERROR) ? stream->Connection.Error : UDP_CLOSED_ERROR;
+    }
+    else {
+        *Error = (count == 0 && Length != 0) ? UDP_WOULD_BLOCK_ERROR : NO_ERROR;
+    }
+    PlatformLockRelease(&stream->Lock);
+    if (*Error != NO_ERROR) {
+        return SOCKET_ERROR;
+    }
+
+    PlatformEventSet(stream->WakeEvent);
+    return (int)count;
+}
+
+//
+// waits until the window has room, or the connection closed so that the
+// next send fails.
+//
+static UINT32
+UdpStreamWaitWritable(
+    _In_  PVOID             Context,
+    _In_  ULONG             TimeoutMs
+    )
+{
+    PUDP_STREAM stream = (PUDP_STREAM)Context;
+    ULONGLONG deadlineUs = PlatformTimeUs() + (ULONGLONG)TimeoutMs * 1000;
+
+    for (;;) {
+        PlatformLockAcquire(&stream->Lock);
+        BOOL writable = stream->Connection.State == RudpClosed || RudpWritable(&stream->Connection);
+        PlatformLockRelease(&stream->Lock);
+        if (writable) {
+            return NO_ERROR;
+        }
+        ULONGLONG nowUs = PlatformTimeUs();
+        if (nowUs >= deadlineUs ||
+            PlatformWait(stream->ChangeWaiter, (ULONG)((deadlineUs - nowUs + 999) / 1000)) != 0) {
+            return UDP_TIMEOUT_ERROR;
+        }
+    }
+}
+
+static VOID
+UdpStreamClose(
+    _In_  PVOID             Context
+    )
+{
+    PUDP_STREAM stream = (PUDP_STREAM)Context;
+    if (stream->Thread) {
+        PlatformEventSet(stream->StopEvent);
+        PlatformThreadJoin(stream->Thread, INFINITE);
+    }
+    if (stream->Socket != INVALID_SOCKET) {
+        closesocket(stream->Socket);
+    }
+    PlatformWaiterClose(stream->ChangeWaiter);
+    if (stream->StopEvent) {
+        PlatformEventClose(stream->StopEvent);
+    }
+    if (stream->WakeEvent) {
+        PlatformEventClose(stream->WakeEvent);
+    }
+    if (stream->ChangeEvent) {
+        PlatformEventClose(stream->ChangeEvent);
+    }
+    if (stream->DataEvent) {
+        PlatformEventClose(stream->DataEvent);
+    }
+    free(stream);
+}
+
+static const PLATFORM_STREAM_OPS UdpStreamOps = {
+    UdpStreamRecv,
+    UdpStreamSend,
+    UdpStreamWaitWritable,
+    UdpStreamClose,
+};
+
+//
+// a udp socket connected to the first address of Host.
+//
+static UINT32
+UdpConnectSocket(
+    _In_  const char*       Host,
+    _In_  USHORT            Port,
+    _Out_ SOCKET*           Socket
+    )
+{
+    struct addrinfo hints = { };
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+
+    std::string port = std::to_string(Port);
+    struct addrinfo* list = NULL;
+    *Socket = INVALID_SOCKET;
+    int result = getaddrinfo(Host, port.c_str(), &hints, &list);
+    if (result != 0) {
+        return (UINT32)result;
+    }
+    UINT32 error = UDP_NO_ADDRESS_ERROR;
+    for (struct addrinfo* addr = list; addr != NULL; addr = addr->ai_next) {
+        *Socket = socket(addr->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+        if (*Socket == INVALID_SOCKET) {
+            error = PlatformSocketLastError();
+            continue;
+        }
+        error = (connect(*Socket, addr->ai_addr, (int)addr->ai_addrlen) == SOCKET_ERROR) ?
+            PlatformSocketLastError() : PlatformSocketSetNonBlocking(*Socket);
+        if (error == NO_ERROR) {
+            break;
+        }
+        closesocket(*Socket);
+        *Socket = INVALID_SOCKET;
+    }
+    freeaddrinfo(list);
+    return error;
+}
+
+_Success_(return == NO_ERROR)
+UINT32
+UdpStreamOpen(
+    _In_  const char*       Host,
+    _In_  USHORT            Port,
+    _In_  ULONG             TimeoutMs,
+    _In_  PHTS_VSP_REPORT   Stats,
+    _Out_ PLATFORM_STREAM   *Stream
+    )
+{
+    *Stream = NULL;
+    PUDP_STREAM stream = (PUDP_STREAM)calloc(1, sizeof(*stream));
+    if (stream == NULL) {
+        return UDP_MEMORY_ERROR;
+    }
+    stream->Stats = Stats;
+    PlatformLockInitialize(&stream->Lock);
+    RudpInitialize(&stream->Connection, FALSE, PlatformTimeUs());
+
+    UINT32 error = UdpConnectSocket(Host, Port, &stream->Socket);
+    if (error == NO_ERROR) {
+        error = PlatformEventCreate(TRUE, &stream->StopEvent);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformEventCreate(FALSE, &stream->WakeEvent);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformEventCreate(FALSE, &stream->ChangeEvent);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformEventCreate(TRUE, &stream->DataEvent);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterCreate(&stream->ChangeWaiter);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformWaiterAddEvent(stream->ChangeWaiter, stream->ChangeEvent);
+    }
+    if (error == NO_ERROR) {
+        error = PlatformThreadCreate(UdpThread, stream, &stream->Thread);
+        if (error != NO_ERROR) {
+            stream->Thread = NULL;
+        }
+    }
+
+    //
+    // the thread sends the syn and its retries.
+    //
+    ULONGLONG deadlineUs = PlatformTimeUs() + (ULONGLONG)TimeoutMs * 1000;
+    while (error == NO_ERROR) {
+        PlatformLockAcquire(&stream->Lock);
+        ULONG state = stream->Connection.State;
+        UINT32 closeError = stream->Connection.Error;
+        PlatformLockRelease(&stream->Lock);
+        if (state == RudpEstablished) {
+            break;
+        }
+        if (state == RudpClosed) {
+            error = (closeError != NO_ERROR) ? closeError : UDP_CLOSED_ERROR;
+            break;
+        }
+        ULONGLONG nowUs = PlatformTimeUs();
+        if (nowUs >= deadlineUs ||
+            PlatformWait(stream->ChangeWaiter, (ULONG)((deadlineUs - nowUs + 999) / 1000)) != 0) {
+            error = UDP_TIMEOUT_ERROR;
+        }
+    }
+    if (error == NO_ERROR) {
+        error = PlatformStreamCreate(&UdpStreamOps, stream, stream->DataEvent, Stream);
+    }
+    if (error != NO_ERROR) {
+        UdpStreamClose(stream);
+    }
+    return error;
+}
@@ -0,0 +1,42 @@
+/*++
+
+Module Name:
+
+    udp.h
+
+Abstract:
+
+    The udp transport of a client port, for a kd session over a LAN that
+    loses packets now and then. The stream of the port goes over the
+    reliable udp protocol of rudp.h to a peer that speaks it too,
+    vspControl --echoservice --transport udp or vspPeer --serve --udp, on
+    the udp port of the same number.
+
+    A lost packet holds up only the bytes behind it until the selective
+    acks of the peer get it sent again, after about a round trip, where tcp
+    waits for its retransmit timeout and delays its acks.
+
+--*/
+
+#pragma once
+
+#include "platform.h"
+#include "htsvsp.h"
+#include "rudp.h"
+
+//
+// resolves Host and connects to Port, within TimeoutMs. A peer that does
+// not answer times out, one that does not know the connection resets it.
+//
+// A thread sends and receives the datagrams and runs the timers. Stats
+// gets the round trip time and the retransmit counters.
+//
+_Success_(return == NO_ERROR)
+UINT32
+UdpStreamOpen(
+    _In_  const char*       Host,
+    _In_  USHORT            Port,
+    _In_  ULONG             TimeoutMs,
+    _In_  PHTS_VSP_REPORT   Stats,
+    _Out_ PLATFORM_STREAM   *Stream
+    );
@@ -1,5 +1,7 @@
 #pragma once
+#ifdef _WIN32
 #include <windows.h>
+#endif
 
 #define VSP_CODE_BASE 200
 
@@ -10,6 +12,10 @@
 // input is a HST_VSP_CONFIG structure defining the role and network address of the port
 // no output
 // returns success if configuration succeeded, else an error.
+// a configuration that succeeded is saved in the device and applied again at
+// device start, closeConnections removes it. A new endpoint of the same role
+// is connected or bound first and then swapped in, if that fails the port
+// keeps its current one.
 // 
 #define IOCTL_HTSVSP_CONFIGURE  CTL_CODE(FILE_DEVICE_SERIAL_PORT,VSP_CODE_BASE + 1,METHOD_BUFFERED,FILE_ANY_ACCESS)
 
@@ -28,6 +34,57 @@
 // input is a DWORD
 #define IOCTL_HTSVSP_SET_WAIT_UNITS  CTL_CODE(FILE_DEVICE_SERIAL_PORT,VSP_CODE_BASE +6,METHOD_BUFFERED,FILE_ANY_ACCESS)
 
+// input is a DWORD, non zero clears and starts the request timeline capture, zero stops it.
+#define IOCTL_HTSVSP_TIMELINE_CONTROL  CTL_CODE(FILE_DEVICE_SERIAL_PORT,VSP_CODE_BASE + 7,METHOD_BUFFERED,FILE_ANY_ACCESS)
+
+// output is a HTS_VSP_TIMELINE_HEADER followed by as many HTS_VSP_TIMELINE_EVENT
+// as fit in the output buffer. The returned events are removed from the capture.
+#define IOCTL_HTSVSP_TIMELINE_READ  CTL_CODE(FILE_DEVICE_SERIAL_PORT,VSP_CODE_BASE + 8,METHOD_BUFFERED,FILE_ANY_ACCESS)
+
+// input is a DWORD, the longest the port busy polls in microseconds before it
+// blocks, 0 turns spinning off. The spin adapts within this limit.
+#define IOCTL_HTSVSP_SET_SPIN  CTL_CODE(FILE_DEVICE_SERIAL_PORT,VSP_CODE_BASE + 9,METHOD_BUFFERED,FILE_ANY_ACCESS)
+
+// input is a HTS_VSP_CAPTURE_CONTROL. A path starts capturing what the port
+// receives and what is written to it to memory mapped files path.0, path.1
+// and so on, replacing an earlier capture. An empty path stops it.
+#define IOCTL_HTSVSP_CAPTURE_CONTROL  CTL_CODE(FILE_DEVICE_SERIAL_PORT,VSP_CODE_BASE + 10,METHOD_BUFFERED,FILE_ANY_ACCESS)
+
+// input is a HTS_VSP_OVERFLOW, what the port does with received data that
+// does not fit in its receive ring.
+#define IOCTL_HTSVSP_SET_OVERFLOW  CTL_CODE(FILE_DEVICE_SERIAL_PORT,VSP_CODE_BASE + 11,METHOD_BUFFERED,FILE_ANY_ACCESS)
+
+// input is a HTS_VSP_SCHEDULE, the priority of the port and the processors its
+// loop runs on, or with global those of the worker pool that runs the loops
+// of all the ports. Both are saved in the device and applied again at device
+// start, the pool takes the saved pool setting of the last device that starts.
+#define IOCTL_HTSVSP_SET_SCHEDULE  CTL_CODE(FILE_DEVICE_SERIAL_PORT,VSP_CODE_BASE + 12,METHOD_BUFFERED,FILE_ANY_ACCESS)
+
+// HTS_VSP_CONFIG transports.
+enum HTS_VSP_TRANSPORT : USHORT
+{
+	HtsTransportTcp = 0,   // address and port.
+	HtsTransportUnix,      // unix domain stream socket, address is its path.
+	HtsTransportPipe,      // named pipe, address is the pipe name, \\.\pipe\ is optional.
+	HtsTransportShm,       // shared memory rings with a peer on the same host, address is their name.
+	HtsTransportMux,       // a channel of the session to a mux relay at address and port, client only.
+	HtsTransportUdp,       // reliable udp to a peer at address and port, client only.
+};
+
+// HTS_VSP_CONFIG tapPolicy, what happens to a tap that does not keep up.
+enum HTS_VSP_TAP_POLICY : USHORT
+{
+	HtsTapDrop = 0,        // a copy that does not fit in its queue is dropped and counted.
+	HtsTapDisconnect,      // the tap is closed.
+};
+
+// HTS_VSP_CONFIG compression.
+enum HTS_VSP_COMPRESSION : USHORT
+{
+	HtsCompressionNone = 0,
+	HtsCompressionLz,      // lz4 block format, the peer must compress too.
+};
+
 struct HTS_VSP_CONFIG
 {
 	bool closeConnections; // if true close all connections and stop the service.
@@ -35,9 +92,85 @@ struct HTS_VSP_CONFIG
 	USHORT port;           // service port number
 	CHAR   address[256];   // client: server address (domain name or ip address.)
 	                       // service: 0 (INADDR_ANY) for all addresses or a specific network.
+	USHORT transport;      // HTS_VSP_TRANSPORT, the port is only used by tcp, mux and udp.
+	USHORT channel;        // mux: the channel of the relay, 1 to 1023.
+	USHORT taps;           // tcp and unix service: clients that connect while one is connected
+	                       // become read-only taps, up to this many. 0 closes them.
+	USHORT tapPolicy;      // HTS_VSP_TAP_POLICY
+	USHORT compression;    // HTS_VSP_COMPRESSION, tcp and unix client.
 };
 typedef HTS_VSP_CONFIG* PHTS_VSP_CONFIG;
 
+// HTS_VSP_OVERFLOW policy.
+enum HTS_VSP_OVERFLOW_POLICY : DWORD
+{
+	HtsOverflowBlock = 0,      // the data waits in the socket and tcp stops the peer. After timeoutMs
+	                           // the port drops the newest data until reads drain the ring.
+	HtsOverflowDropNewest,     // what does not fit is dropped, like a uart overrun.
+	HtsOverflowDropOldest,     // the oldest received data is dropped to make room.
+};
+
+struct HTS_VSP_OVERFLOW
+{
+	DWORD  policy;         // HTS_VSP_OVERFLOW_POLICY
+	DWORD  timeoutMs;      // HtsOverflowBlock: how long the peer may be stopped, 0 for ever.
+};
+typedef HTS_VSP_OVERFLOW* PHTS_VSP_OVERFLOW;
+
+// HTS_VSP_SCHEDULE priority.
+enum HTS_VSP_PRIORITY : DWORD
+{
+	HtsPriorityNormal = 0,     // of the pool, for a port.
+	HtsPriorityLatency,        // a debugger port: queued ahead of the others and run at a raised thread priority.
+	HtsPriorityBulk,           // a log port: run at a lowered thread priority.
+};
+
+struct HTS_VSP_SCHEDULE
+{
+	DWORD      global;         // non zero sets the worker pool, else the port.
+	DWORD      priority;       // HTS_VSP_PRIORITY
+	ULONGLONG  affinity;       // bit n runs on processor n, 0 on any. A port with 0 runs on those of the pool.
+};
+typedef HTS_VSP_SCHEDULE* PHTS_VSP_SCHEDULE;
+
+struct HTS_VSP_CAPTURE_CONTROL
+{
+	CHAR   path[256];      // of the segment files, without the number. Empty stops the capture.
+	DWORD  segmentBytes;   // size of a segment file, 0 for 16MB.
+};
+typedef HTS_VSP_CAPTURE_CONTROL* PHTS_VSP_CAPTURE_CONTROL;
+
+// histograms in HTS_VSP_REPORT use power of two buckets.
+// bucket n counts samples with a value less than 2^n, bucket 0 counts zero.
+// the last bucket also counts everything larger.
+#define HTS_VSP_HISTOGRAM_BUCKETS 24
+
+// HTS_VSP_REPORT connectionState.
+enum HTS_VSP_CONNECTION_STATE : DWORD
+{
+	HtsConnectionIdle = 0,       // not configured, or closed.
+	HtsConnectionListening,      // a service waits for its client.
+	HtsConnectionConnected,
+	HtsConnectionReconnecting,   // a client lost its connection and reconnects with backoff.
+	HtsConnectionConnecting,     // a client saved in the device connects in the background at device start.
+};
+
+// the connect attempts of a client kept in HTS_VSP_REPORT, one per address tried.
+#define HTS_VSP_CONNECT_ATTEMPTS 8
+
+// HTS_VSP_CONNECT_ATTEMPT error of an attempt that was still pending when another connected.
+#define HTS_VSP_CONNECT_ABANDONED 0xFFFFFFFF
+
+struct HTS_VSP_CONNECT_ATTEMPT
+{
+	CHAR    address[46];      // numeric, ipv4 or ipv6.
+	USHORT  family;           // AF_INET or AF_INET6.
+	DWORD   error;            // 0 for the attempt that connected, else its socket error.
+	DWORD   startUs;          // when it started, after the first attempt.
+	DWORD   latencyUs;        // from its start until it connected or failed.
+};
+typedef HTS_VSP_CONNECT_ATTEMPT* PHTS_VSP_CONNECT_ATTEMPT;
+
 struct HTS_VSP_REPORT
 {
 	INT64   bytesWritten;     // total bytes sent
@@ -50,9 +183,117 @@ struct HTS_VSP_REPORT
 	INT64   readQueueEvents;  // queue ready event signalled
 	INT64   readDequeue;      // request dequeued
 	INT64   waitTimeouts;
+	INT64   readsCompleted;   // read requests completed, any status.
+	INT64   readLatencySumUs; // sum of readLatencyUs samples.
+	INT64   readLatencyUs[HTS_VSP_HISTOGRAM_BUCKETS]; // EvtIoRead to completion, microseconds.
+	INT64   recvSize[HTS_VSP_HISTOGRAM_BUCKETS];      // bytes returned by each successful recv.
+	INT64   spinWaits;        // waits that spun before blocking.
+	INT64   spinHits;         // waits that ended while spinning, without a blocking wakeup.
+	INT64   spinUs;           // time spent spinning, a cpu is busy for all of it.
+	INT64   spinSavedUs;      // estimated latency saved, wakeLatencyUs for every spin hit.
 
 	DWORD   traceLevel;
 	DWORD   waitUnits;
+	DWORD   spinMaxUs;        // spin limit of the port, 0 is off.
+	DWORD   spinBudgetUs;     // spin of the next wait.
+	DWORD   wakeLatencyUs;    // average latency of a blocked wait, measured on the read queue.
+
+	DWORD   connectLatencyUs; // the last client connect, from the first attempt until one connected.
+	DWORD   connectAttemptCount; // attempts of the last client connect, the first HTS_VSP_CONNECT_ATTEMPTS are kept.
+	HTS_VSP_CONNECT_ATTEMPT connectAttempts[HTS_VSP_CONNECT_ATTEMPTS];
+
+	DWORD   connectionState;  // HTS_VSP_CONNECTION_STATE
+	DWORD   stateChanges;     // connectionState transitions, each is also a timeline event.
+	DWORD   disconnects;      // client connections lost, each is reconnected.
+	DWORD   reconnectAttempts;
+	INT64   downtimeUs;       // total time spent reconnecting.
+	INT64   lastDowntimeUs;   // of the last reconnect that succeeded.
+	INT64   backlogBytes;     // written while reconnecting and kept for the new connection.
+	INT64   backlogDroppedBytes; // written while reconnecting or held by an xoff, beyond the backlog.
+
+	DWORD   startupConnectUs; // device start until the saved configuration connected, 0 until then.
+	DWORD   inPlaceConfigures; // configurations applied by the running thread, without a restart.
+
+	DWORD   tapClients;       // taps connected now.
+	DWORD   tapDisconnects;   // taps closed by HtsTapDisconnect.
+	INT64   tapBytes;         // sent to taps, all of them.
+	INT64   tapDroppedBytes;  // copies dropped by HtsTapDrop.
+
+	INT64   compressRawBytes;    // written, before compression.
+	INT64   compressWireBytes;   // sent for them, block headers included.
+	INT64   decompressWireBytes; // received, block headers included.
+	INT64   decompressRawBytes;  // read, after decompression.
+	INT64   compressUs;          // time spent compressing.
+	INT64   decompressUs;        // time spent decompressing.
+
+	DWORD   udpSrttUs;           // smoothed round trip time, 0 until measured.
+	DWORD   udpRtoUs;            // retransmit timeout now.
+	INT64   udpDatagramsSent;
+	INT64   udpDatagramsReceived;
+	INT64   udpRetransmits;      // data packets sent again.
+	INT64   udpFastRetransmits;  // of those, on selective acks before the timeout.
+	INT64   udpTimeouts;         // retransmit timeouts.
+	INT64   udpDuplicates;       // data packets received twice.
+
+	DWORD   captureSegments;     // segment files, of the capture running or the last one.
+	INT64   captureRecords;      // receives and writes captured, of the same.
+	INT64   captureBytes;        // their data.
+	INT64   captureDroppedRecords; // not captured, the log was behind or the record too large.
+
+	DWORD   flowHighWater;       // receiving stops with this many bytes in the receive ring,
+	DWORD   flowLowWater;        // and goes on once reads take it down to this many.
+	INT64   flowPauses;          // receiving stopped at the high watermark or for rts dropped under the handshake.
+	INT64   flowResumes;
+	INT64   flowOverrunBytes;    // received past the high watermark, a port without flow control would drop them.
+	INT64   flowHeldBytes;       // written while IOCTL_SERIAL_SET_XOFF held the transmit, sent at SET_XON.
+
+	DWORD   overflowPolicy;      // HTS_VSP_OVERFLOW_POLICY of the receive ring.
+	DWORD   overflowTimeoutMs;   // of HtsOverflowBlock, 0 for ever.
+	INT64   overflowEvents;      // receives that found the receive ring full.
+	INT64   overflowBytes;       // received and dropped, the newest or the oldest by the policy.
+	INT64   overflowTimeouts;    // times HtsOverflowBlock gave up waiting for room.
+
+	DWORD   poolWorkers;         // the worker pool of the driver host, which runs the loops of all the ports.
+	DWORD   poolWorks;           // port loops on it.
+	INT64   poolRuns;            // runs of a port loop, each until it waits or yields.
+	INT64   poolSteals;          // of those, taken from the queue of another worker.
+	INT64   poolYields;          // runs that gave up the worker to the ports queued behind.
+	INT64   poolWakeups;         // waits that ended for a signalled source.
+	INT64   poolTimeouts;        // waits that ended at their timeout.
+	INT64   poolScheduleErrors;  // priorities and affinities a thread of the pool could not take.
+	DWORD   poolPriority;        // HTS_VSP_SCHEDULE of the pool,
+	ULONGLONG poolAffinity;
+	DWORD   schedulePriority;    // and of the port.
+	ULONGLONG scheduleAffinity;
 };
 typedef HTS_VSP_REPORT* PHTS_VSP_REPORT;
 
+// request timeline event types.
+enum HTS_VSP_TIMELINE_TYPE : USHORT
+{
+	HtsTimelineReadQueued = 1,   // EvtIoRead put the request in the ReadQueue. arg0: length.
+	HtsTimelineReadDequeued,     // ClientRun took the request from the ReadQueue.
+	HtsTimelineWake,             // ClientRun wait returned. arg0: wait result.
+	HtsTimelineTimerFired,       // read timer callback. arg0: 0 interval, 1 total.
+	HtsTimelineRecv,             // recv returned data. arg0: bytes.
+	HtsTimelineReadCompleted,    // arg0: status, arg1: information.
+	HtsTimelineConnectionState,  // arg0: the new HTS_VSP_CONNECTION_STATE, arg1: the old one.
+};
+
+struct HTS_VSP_TIMELINE_EVENT
+{
+	INT64   timestamp;        // QueryPerformanceCounter value.
+	ULONG   correlationId;    // read request correlation id, 0 if there is no current request.
+	USHORT  type;             // HTS_VSP_TIMELINE_TYPE
+	USHORT  reserved;
+	INT64   arg0;
+	INT64   arg1;
+};
+typedef HTS_VSP_TIMELINE_EVENT* PHTS_VSP_TIMELINE_EVENT;
+
+struct HTS_VSP_TIMELINE_HEADER
+{
+	ULONG   count;            // number of events that follow.
+	ULONG   dropped;          // events overwritten before they could be read, since the last read.
+};
+typedef HTS_VSP_TIMELINE_HEADER* PHTS_VSP_TIMELINE_HEADER;